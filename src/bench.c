@@ -0,0 +1,283 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+
+/*
+ * Micro-benchmarks of the chunk, iterator and aggregation hot paths, see `make bench`. Each
+ * benchmark runs over synthetic datasets and prints a JSON object per line, with the time per
+ * sample and, for the encodings, the bytes per sample:
+ *
+ *   bench_runner [samples]
+ */
+#include "compaction.h"
+#include "compressed_chunk.h"
+#include "consts.h"
+#include "tsdb.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "rmutil/alloc.h"
+
+#define BENCH_DEFAULT_SAMPLES 1000000
+#define BENCH_CHUNK_SIZE 4096
+#define BENCH_UPSERTS 10000
+#define BENCH_BUCKET_SAMPLES 60
+
+typedef struct BenchDataset
+{
+    const char *name;
+    timestamp_t *timestamps;
+    double *values;
+    size_t count;
+} BenchDataset;
+
+typedef struct BenchChunks
+{
+    Chunk_t **chunks;
+    size_t count;
+} BenchChunks;
+
+static double nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *benchmark,
+                   const BenchDataset *data,
+                   size_t samples,
+                   double elapsedNs,
+                   double bytes) {
+    printf("{\"benchmark\": \"%s\", \"dataset\": \"%s\", \"samples\": %zu, \"ns_per_sample\": %.3f",
+           benchmark,
+           data->name,
+           samples,
+           elapsedNs / samples);
+    if (bytes > 0) {
+        printf(", \"bytes_per_sample\": %.3f", bytes / samples);
+    }
+    printf("}\n");
+}
+
+// A sensor reading every second: regular, with jitter on the timestamps, or random values
+static BenchDataset makeDataset(const char *name, size_t count, bool jitter, bool randomValues) {
+    BenchDataset data = { .name = name, .count = count };
+    data.timestamps = malloc(count * sizeof(timestamp_t));
+    data.values = malloc(count * sizeof(double));
+    timestamp_t ts = 1600000000000;
+    for (size_t i = 0; i < count; i++) {
+        ts += jitter ? 1000 - 50 + rand() % 101 : 1000;
+        data.timestamps[i] = ts;
+        data.values[i] = randomValues ? (double)rand() / RAND_MAX * 1e6
+                                      : round((20 + 5 * sin(i / 600.0)) * 100) / 100;
+    }
+    return data;
+}
+
+static void freeDataset(BenchDataset *data) {
+    free(data->timestamps);
+    free(data->values);
+}
+
+static void freeChunks(BenchChunks *chunks) {
+    for (size_t i = 0; i < chunks->count; i++) {
+        Compressed_FreeChunk(chunks->chunks[i]);
+    }
+    free(chunks->chunks);
+}
+
+static BenchChunks benchAppend(const BenchDataset *data,
+                               const char *name,
+                               ChunkResult (*append)(Chunk_t *, Sample *)) {
+    BenchChunks chunks = { .chunks = malloc(sizeof(Chunk_t *)), .count = 1 };
+    size_t capacity = 1;
+    chunks.chunks[0] = Compressed_NewChunk(BENCH_CHUNK_SIZE);
+    double start = nowNs();
+    for (size_t i = 0; i < data->count; i++) {
+        Sample sample = { .timestamp = data->timestamps[i], .value = data->values[i] };
+        if (append(chunks.chunks[chunks.count - 1], &sample) == CR_END) {
+            if (chunks.count == capacity) {
+                capacity *= 2;
+                chunks.chunks = realloc(chunks.chunks, capacity * sizeof(Chunk_t *));
+            }
+            chunks.chunks[chunks.count++] = Compressed_NewChunk(BENCH_CHUNK_SIZE);
+            append(chunks.chunks[chunks.count - 1], &sample);
+        }
+    }
+    double elapsed = nowNs() - start;
+    size_t bytes = 0;
+    for (size_t i = 0; i < chunks.count; i++) {
+        bytes += Compressed_GetChunkSize(chunks.chunks[i], false);
+    }
+    report(name, data, data->count, elapsed, bytes);
+    return chunks;
+}
+
+static void benchRead(const BenchDataset *data, const BenchChunks *chunks) {
+    ChunkIterFuncs funcs;
+    // reused across the chunks, as by the series iterator
+    ChunkIterStorage storage = { 0 };
+    Sample sample;
+    double checksum = 0;
+    size_t read = 0;
+    double start = nowNs();
+    for (size_t i = 0; i < chunks->count; i++) {
+        ChunkIter_t *iter =
+            Compressed_InitChunkIterator(chunks->chunks[i], CHUNK_ITER_OP_NONE, &funcs, &storage);
+        while (Compressed_ChunkIteratorGetNext(iter, &sample) == CR_OK) {
+            checksum += sample.value;
+            read++;
+        }
+    }
+    report("compressed_read_next", data, read, nowNs() - start, 0);
+
+    timestamp_t timestamps[SERIES_ITER_BATCH_SIZE];
+    double values[SERIES_ITER_BATCH_SIZE];
+    read = 0;
+    start = nowNs();
+    for (size_t i = 0; i < chunks->count; i++) {
+        ChunkIter_t *iter =
+            Compressed_InitChunkIterator(chunks->chunks[i], CHUNK_ITER_OP_NONE, &funcs, &storage);
+        size_t count;
+        while ((count = Compressed_ChunkIteratorGetNextBatch(
+                    iter, timestamps, values, SERIES_ITER_BATCH_SIZE)) > 0) {
+            checksum += values[count - 1];
+            read += count;
+        }
+    }
+    report("compressed_read_batch", data, read, nowNs() - start, 0);
+    Compressed_ReleaseChunkIterator((ChunkIter_t *)&storage);
+    if (isnan(checksum)) {
+        printf("# checksum %f\n", checksum);
+    }
+}
+
+// Upserts replace samples at random within the chunks, each upsert re-encoding its chunk
+static void benchUpsert(const BenchDataset *data, const BenchChunks *chunks) {
+    BenchChunks copies = { .chunks = malloc(chunks->count * sizeof(Chunk_t *)),
+                           .count = chunks->count };
+    for (size_t i = 0; i < chunks->count; i++) {
+        copies.chunks[i] = Compressed_CloneChunk(chunks->chunks[i]);
+    }
+    size_t upserts = min(BENCH_UPSERTS, data->count);
+    double start = nowNs();
+    for (size_t i = 0; i < upserts; i++) {
+        size_t pos = rand() % copies.count;
+        Chunk_t *chunk = copies.chunks[pos];
+        timestamp_t first = Compressed_GetFirstTimestamp(chunk);
+        timestamp_t last = Compressed_GetLastTimestamp(chunk);
+        UpsertCtx uCtx = {
+            .inChunk = chunk,
+            .sample = { .timestamp = first + rand() % (last - first + 1), .value = i },
+        };
+        int size = 0;
+        Compressed_UpsertSample(&uCtx, &size, DP_LAST);
+        copies.chunks[pos] = uCtx.inChunk;
+    }
+    report("compressed_upsert", data, upserts, nowNs() - start, 0);
+    freeChunks(&copies);
+}
+
+static void benchSplit(const BenchDataset *data, const BenchChunks *chunks) {
+    double elapsed = 0;
+    size_t split = 0;
+    for (size_t i = 0; i < chunks->count; i++) {
+        Chunk_t *chunk = Compressed_CloneChunk(chunks->chunks[i]);
+        split += Compressed_ChunkNumOfSample(chunk);
+        double start = nowNs();
+        Chunk_t *second = Compressed_SplitChunk(chunk);
+        elapsed += nowNs() - start;
+        Compressed_FreeChunk(chunk);
+        Compressed_FreeChunk(second);
+    }
+    report("compressed_split", data, split, elapsed, 0);
+}
+
+static void benchSeriesIterator(const BenchDataset *data) {
+    CreateCtx cCtx = { .chunkSizeBytes = BENCH_CHUNK_SIZE, .duplicatePolicy = DP_BLOCK };
+    Series *series = NewSeries(NULL, &cCtx);
+    for (size_t i = 0; i < data->count; i++) {
+        SeriesAddSample(series, data->timestamps[i], data->values[i]);
+    }
+
+    for (int rev = 0; rev <= 1; rev++) {
+        timestamp_t timestamps[SERIES_ITER_BATCH_SIZE];
+        double values[SERIES_ITER_BATCH_SIZE];
+        double checksum = 0;
+        size_t read = 0, count;
+        double start = nowNs();
+        SeriesIterator iterator = SeriesQuery(series, 0, UINT64_MAX, rev);
+        while ((count = SeriesIteratorGetNextBatch(
+                    &iterator, timestamps, values, SERIES_ITER_BATCH_SIZE)) > 0) {
+            checksum += values[count - 1];
+            read += count;
+        }
+        SeriesIteratorClose(&iterator);
+        report(rev ? "series_iterator_rev" : "series_iterator", data, read, nowNs() - start, 0);
+        if (isnan(checksum)) {
+            printf("# checksum %f\n", checksum);
+        }
+    }
+    FreeSeriesCopy(series);
+}
+
+// Each aggregation over buckets of BENCH_BUCKET_SAMPLES samples, as a range query computes them
+static void benchAggregations(const BenchDataset *data) {
+    for (int type = TS_AGG_NONE + 1; type < TS_AGG_TYPES_MAX; type++) {
+        AggregationClass *aggClass = GetAggClass(type);
+        void *context = aggClass->createContext();
+        double checksum = 0, value;
+        double start = nowNs();
+        for (size_t i = 0; i < data->count; i++) {
+            aggClass->appendValue(context, data->values[i]);
+            if ((i + 1) % BENCH_BUCKET_SAMPLES == 0 || i + 1 == data->count) {
+                aggClass->finalize(context, &value);
+                checksum += value;
+                aggClass->resetContext(context);
+            }
+        }
+        double elapsed = nowNs() - start;
+        aggClass->freeContext(context);
+
+        char benchmark[64];
+        snprintf(benchmark, sizeof(benchmark), "aggregation_%s", AggTypeEnumToString(type));
+        report(benchmark, data, data->count, elapsed, 0);
+        if (isnan(checksum)) {
+            printf("# checksum %f\n", checksum);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    RMUTil_InitAlloc();
+    size_t samples = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_DEFAULT_SAMPLES;
+    if (samples == 0) {
+        fprintf(stderr, "usage: %s [samples]\n", argv[0]);
+        return 1;
+    }
+
+    srand(1);
+    BenchDataset datasets[] = {
+        makeDataset("regular", samples, false, false),
+        makeDataset("jittery", samples, true, false),
+        makeDataset("random", samples, false, true),
+    };
+    for (size_t i = 0; i < sizeof(datasets) / sizeof(datasets[0]); i++) {
+        BenchChunks buffered =
+            benchAppend(&datasets[i], "compressed_buffered_append", Compressed_BufferSample);
+        freeChunks(&buffered);
+        BenchChunks chunks = benchAppend(&datasets[i], "compressed_append", Compressed_AddSample);
+        benchRead(&datasets[i], &chunks);
+        benchUpsert(&datasets[i], &chunks);
+        benchSplit(&datasets[i], &chunks);
+        freeChunks(&chunks);
+        benchSeriesIterator(&datasets[i]);
+        benchAggregations(&datasets[i]);
+        freeDataset(&datasets[i]);
+    }
+    return 0;
+}
@@ -5,25 +5,79 @@
  */
 #include "chunk.h"
 
+#include "chunk_pool.h"
+#include "rdb.h"
+
 #include "rmutil/alloc.h"
 
+static inline size_t capacityOf(size_t size) {
+    return size / SAMPLE_SIZE;
+}
+
+// Lays the columns out in `buffer`, of `size` bytes
+static void setColumns(Chunk *chunk, void *buffer, size_t size) {
+    chunk->timestamps = buffer;
+    chunk->values = (double *)(chunk->timestamps + capacityOf(size));
+    chunk->size = size;
+}
+
+// Moves the samples to a buffer of `size` bytes, which must hold them
+static void resizeChunk(Chunk *chunk, size_t size) {
+    size_t count = chunk->num_samples;
+    if (capacityOf(size) < capacityOf(chunk->size)) {
+        memmove(chunk->timestamps + capacityOf(size), chunk->values, count * sizeof(double));
+    }
+    void *buffer = ChunkPool_Realloc(chunk->timestamps, chunk->size, size);
+    if (capacityOf(size) > capacityOf(chunk->size)) {
+        timestamp_t *timestamps = buffer;
+        memmove(timestamps + capacityOf(size),
+                timestamps + capacityOf(chunk->size),
+                count * sizeof(double));
+    }
+    setColumns(chunk, buffer, size);
+}
+
+// Position of the first sample at or after `timestamp`
+static size_t lowerBound(const Chunk *chunk, timestamp_t timestamp) {
+    size_t lo = 0, hi = chunk->num_samples;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (chunk->timestamps[mid] < timestamp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 Chunk_t *Uncompressed_NewChunk(size_t size) {
     Chunk *newChunk = (Chunk *)malloc(sizeof(Chunk));
     newChunk->num_samples = 0;
-    newChunk->size = size;
-    newChunk->samples = (Sample *)malloc(size);
+    setColumns(newChunk, ChunkPool_Alloc(size), size);
+    ChunkSummaryReset(&newChunk->summary);
 #ifdef DEBUG
-    memset(newChunk->samples, 0, size);
+    memset(newChunk->timestamps, 0, size);
 #endif
 
     return newChunk;
 }
 
 void Uncompressed_FreeChunk(Chunk_t *chunk) {
-    free(((Chunk *)chunk)->samples);
+    ChunkPool_Free(((Chunk *)chunk)->timestamps, ((Chunk *)chunk)->size);
     free(chunk);
 }
 
+Chunk_t *Uncompressed_CloneChunk(Chunk_t *chunk) {
+    Chunk *curChunk = (Chunk *)chunk;
+    Chunk *newChunk = (Chunk *)malloc(sizeof(Chunk));
+    *newChunk = *curChunk;
+    setColumns(newChunk, ChunkPool_Alloc(curChunk->size), curChunk->size);
+    memcpy(newChunk->timestamps, curChunk->timestamps, curChunk->num_samples * sizeof(timestamp_t));
+    memcpy(newChunk->values, curChunk->values, curChunk->num_samples * sizeof(double));
+    return newChunk;
+}
+
 /**
  * TODO: describe me
  * @param chunk
@@ -36,19 +90,29 @@ Chunk_t *Uncompressed_SplitChunk(Chunk_t *chunk) {
 
     // create chunk and copy samples
     Chunk *newChunk = Uncompressed_NewChunk(split * SAMPLE_SIZE);
-    for (size_t i = 0; i < split; ++i) {
-        Sample *sample = &curChunk->samples[curNumSamples + i];
-        Uncompressed_AddSample(newChunk, sample);
-    }
+    memcpy(newChunk->timestamps, curChunk->timestamps + curNumSamples, split * sizeof(timestamp_t));
+    memcpy(newChunk->values, curChunk->values + curNumSamples, split * sizeof(double));
+    newChunk->num_samples = split;
+    newChunk->base_timestamp = split > 0 ? newChunk->timestamps[0] : 0;
+    newChunk->summary.stale = true;
 
     // update current chunk
     curChunk->num_samples = curNumSamples;
-    curChunk->size = curNumSamples * SAMPLE_SIZE;
-    curChunk->samples = realloc(curChunk->samples, curChunk->size);
+    resizeChunk(curChunk, curNumSamples * SAMPLE_SIZE);
+    curChunk->summary.stale = true;
 
     return newChunk;
 }
 
+void Uncompressed_SealChunk(Chunk_t *chunk) {
+    Chunk *regChunk = (Chunk *)chunk;
+    size_t usedSize = regChunk->num_samples * SAMPLE_SIZE;
+    if (usedSize == 0 || usedSize == regChunk->size) {
+        return;
+    }
+    resizeChunk(regChunk, usedSize);
+}
+
 static int IsChunkFull(Chunk *chunk) {
     return chunk->num_samples == chunk->size / SAMPLE_SIZE;
 }
@@ -57,22 +121,33 @@ u_int64_t Uncompressed_NumOfSample(Chunk_t *chunk) {
     return ((Chunk *)chunk)->num_samples;
 }
 
-static Sample *ChunkGetSample(Chunk *chunk, int index) {
-    return &chunk->samples[index];
+static Sample ChunkGetSample(const Chunk *chunk, int index) {
+    return (Sample){ .timestamp = chunk->timestamps[index], .value = chunk->values[index] };
 }
 
 timestamp_t Uncompressed_GetLastTimestamp(Chunk_t *chunk) {
     if (((Chunk *)chunk)->num_samples == 0) {
         return -1;
     }
-    return ChunkGetSample(chunk, ((Chunk *)chunk)->num_samples - 1)->timestamp;
+    return ((Chunk *)chunk)->timestamps[((Chunk *)chunk)->num_samples - 1];
 }
 
 timestamp_t Uncompressed_GetFirstTimestamp(Chunk_t *chunk) {
     if (((Chunk *)chunk)->num_samples == 0) {
         return -1;
     }
-    return ChunkGetSample(chunk, 0)->timestamp;
+    return ((Chunk *)chunk)->timestamps[0];
+}
+
+const ChunkSummary *Uncompressed_GetSummary(Chunk_t *chunk) {
+    Chunk *regChunk = (Chunk *)chunk;
+    if (regChunk->summary.stale) {
+        ChunkSummaryReset(&regChunk->summary);
+        for (size_t i = 0; i < regChunk->num_samples; ++i) {
+            ChunkSummaryAdd(&regChunk->summary, regChunk->values[i]);
+        }
+    }
+    return &regChunk->summary;
 }
 
 ChunkResult Uncompressed_AddSample(Chunk_t *chunk, Sample *sample) {
@@ -86,8 +161,10 @@ ChunkResult Uncompressed_AddSample(Chunk_t *chunk, Sample *sample) {
         regChunk->base_timestamp = sample->timestamp;
     }
 
-    regChunk->samples[regChunk->num_samples] = *sample;
+    regChunk->timestamps[regChunk->num_samples] = sample->timestamp;
+    regChunk->values[regChunk->num_samples] = sample->value;
     regChunk->num_samples++;
+    ChunkSummaryAdd(&regChunk->summary, sample->value);
 
     return CR_OK;
 }
@@ -99,17 +176,18 @@ ChunkResult Uncompressed_AddSample(Chunk_t *chunk, Sample *sample) {
  * @param sample
  */
 static void upsertChunk(Chunk *chunk, size_t idx, Sample *sample) {
-    if (chunk->num_samples == chunk->size / SAMPLE_SIZE) {
-        chunk->size += sizeof(Sample);
-        chunk->samples = realloc(chunk->samples, chunk->size);
+    if (IsChunkFull(chunk)) {
+        resizeChunk(chunk, (capacityOf(chunk->size) + 1) * SAMPLE_SIZE);
     }
     if (idx < chunk->num_samples) { // sample is not last
-        memmove(&chunk->samples[idx + 1],
-                &chunk->samples[idx],
-                (chunk->num_samples - idx) * sizeof(Sample));
+        size_t count = chunk->num_samples - idx;
+        memmove(&chunk->timestamps[idx + 1], &chunk->timestamps[idx], count * sizeof(timestamp_t));
+        memmove(&chunk->values[idx + 1], &chunk->values[idx], count * sizeof(double));
     }
-    chunk->samples[idx] = *sample;
+    chunk->timestamps[idx] = sample->timestamp;
+    chunk->values[idx] = sample->value;
     chunk->num_samples++;
+    chunk->summary.stale = true;
 }
 
 /**
@@ -122,23 +200,18 @@ ChunkResult Uncompressed_UpsertSample(UpsertCtx *uCtx, int *size, DuplicatePolic
     *size = 0;
     Chunk *regChunk = (Chunk *)uCtx->inChunk;
     timestamp_t ts = uCtx->sample.timestamp;
-    short numSamples = regChunk->num_samples;
     // find sample location
-    size_t i = 0;
-    Sample *sample = NULL;
-    for (; i < numSamples; ++i) {
-        sample = ChunkGetSample(regChunk, i);
-        if (ts <= sample->timestamp) {
-            break;
-        }
-    }
+    size_t i = lowerBound(regChunk, ts);
     // update value in case timestamp exists
-    if (sample != NULL && ts == sample->timestamp) {
-        ChunkResult cr = handleDuplicateSample(duplicatePolicy, *sample, &uCtx->sample);
+    if (i < regChunk->num_samples && ts == regChunk->timestamps[i]) {
+        Sample sample = ChunkGetSample(regChunk, i);
+        uCtx->replacedValue = sample.value;
+        ChunkResult cr = handleDuplicateSample(duplicatePolicy, sample, &uCtx->sample);
         if (cr != CR_OK) {
             return CR_ERR;
         }
-        regChunk->samples[i].value = uCtx->sample.value;
+        regChunk->values[i] = uCtx->sample.value;
+        regChunk->summary.stale = true;
         return CR_OK;
     }
 
@@ -151,10 +224,30 @@ ChunkResult Uncompressed_UpsertSample(UpsertCtx *uCtx, int *size, DuplicatePolic
     return CR_OK;
 }
 
-ChunkIter_t *Uncompressed_NewChunkIterator(Chunk_t *chunk,
-                                           int options,
-                                           ChunkIterFuncs *retChunkIterClass) {
-    ChunkIterator *iter = (ChunkIterator *)calloc(1, sizeof(ChunkIterator));
+// The samples within the range are removed with one move, the chunk keeps its room
+size_t Uncompressed_DelRange(Chunk_t *chunk, timestamp_t startTs, timestamp_t endTs) {
+    Chunk *regChunk = (Chunk *)chunk;
+    size_t from = lowerBound(regChunk, startTs);
+    size_t to = endTs == UINT64_MAX ? regChunk->num_samples : lowerBound(regChunk, endTs + 1);
+    if (to <= from) {
+        return 0;
+    }
+    size_t count = regChunk->num_samples - to;
+    memmove(&regChunk->timestamps[from], &regChunk->timestamps[to], count * sizeof(timestamp_t));
+    memmove(&regChunk->values[from], &regChunk->values[to], count * sizeof(double));
+    regChunk->num_samples -= to - from;
+    if (from == 0 && regChunk->num_samples > 0) {
+        regChunk->base_timestamp = regChunk->timestamps[0];
+    }
+    regChunk->summary.stale = true;
+    return to - from;
+}
+
+__extension__ _Static_assert(sizeof(ChunkIterator) <= sizeof(ChunkIterStorage),
+                             "ChunkIterStorage is too small for ChunkIterator");
+
+static void initChunkIterator(ChunkIterator *iter, Chunk_t *chunk, int options) {
+    memset(iter, 0, sizeof(*iter));
     iter->chunk = chunk;
     iter->options = options;
     if (options & CHUNK_ITER_OP_REVERSE) { // iterate from last to first
@@ -162,18 +255,35 @@ ChunkIter_t *Uncompressed_NewChunkIterator(Chunk_t *chunk,
     } else { // iterate from first to last
         iter->currentIndex = 0;
     }
+}
 
+ChunkIter_t *Uncompressed_NewChunkIterator(Chunk_t *chunk,
+                                           int options,
+                                           ChunkIterFuncs *retChunkIterClass) {
+    ChunkIterator *iter = (ChunkIterator *)malloc(sizeof(ChunkIterator));
+    initChunkIterator(iter, chunk, options);
     if (retChunkIterClass != NULL) {
         *retChunkIterClass = *GetChunkIteratorClass(CHUNK_REGULAR);
     }
+    return (ChunkIter_t *)iter;
+}
 
+ChunkIter_t *Uncompressed_InitChunkIterator(Chunk_t *chunk,
+                                            int options,
+                                            ChunkIterFuncs *retChunkIterClass,
+                                            ChunkIterStorage *storage) {
+    ChunkIterator *iter = (ChunkIterator *)storage;
+    initChunkIterator(iter, chunk, options);
+    if (retChunkIterClass != NULL) {
+        *retChunkIterClass = *GetChunkIteratorClass(CHUNK_REGULAR);
+    }
     return (ChunkIter_t *)iter;
 }
 
 ChunkResult Uncompressed_ChunkIteratorGetNext(ChunkIter_t *iterator, Sample *sample) {
     ChunkIterator *iter = (ChunkIterator *)iterator;
     if (iter->currentIndex < iter->chunk->num_samples) {
-        *sample = *ChunkGetSample(iter->chunk, iter->currentIndex);
+        *sample = ChunkGetSample(iter->chunk, iter->currentIndex);
         iter->currentIndex++;
         return CR_OK;
     } else {
@@ -184,7 +294,7 @@ ChunkResult Uncompressed_ChunkIteratorGetNext(ChunkIter_t *iterator, Sample *sam
 ChunkResult Uncompressed_ChunkIteratorGetPrev(ChunkIter_t *iterator, Sample *sample) {
     ChunkIterator *iter = (ChunkIterator *)iterator;
     if (iter->currentIndex >= 0) {
-        *sample = *ChunkGetSample(iter->chunk, iter->currentIndex);
+        *sample = ChunkGetSample(iter->chunk, iter->currentIndex);
         iter->currentIndex--;
         return CR_OK;
     } else {
@@ -192,12 +302,60 @@ ChunkResult Uncompressed_ChunkIteratorGetPrev(ChunkIter_t *iterator, Sample *sam
     }
 }
 
-void Uncompressed_FreeChunkIterator(ChunkIter_t *iterator) {
+size_t Uncompressed_ChunkIteratorGetNextBatch(ChunkIter_t *iterator,
+                                              timestamp_t *timestamps,
+                                              double *values,
+                                              size_t max) {
+    ChunkIterator *iter = (ChunkIterator *)iterator;
+    if (iter->currentIndex >= iter->chunk->num_samples) {
+        return 0;
+    }
+    size_t count = min(max, iter->chunk->num_samples - iter->currentIndex);
+    memcpy(timestamps, &iter->chunk->timestamps[iter->currentIndex], count * sizeof(timestamp_t));
+    memcpy(values, &iter->chunk->values[iter->currentIndex], count * sizeof(double));
+    iter->currentIndex += count;
+    return count;
+}
+
+size_t Uncompressed_ChunkIteratorGetPrevBatch(ChunkIter_t *iterator,
+                                              timestamp_t *timestamps,
+                                              double *values,
+                                              size_t max) {
+    ChunkIterator *iter = (ChunkIterator *)iterator;
+    if (iter->currentIndex < 0) {
+        return 0;
+    }
+    size_t count = min(max, iter->currentIndex + 1);
+    const timestamp_t *chunkTimestamps = &iter->chunk->timestamps[iter->currentIndex];
+    const double *chunkValues = &iter->chunk->values[iter->currentIndex];
+    for (size_t i = 0; i < count; ++i) {
+        timestamps[i] = chunkTimestamps[-(ssize_t)i];
+        values[i] = chunkValues[-(ssize_t)i];
+    }
+    iter->currentIndex -= count;
+    return count;
+}
+
+// Binary search for the first sample at or after `timestamp` (last at or before when reversed)
+void Uncompressed_ChunkIteratorSeek(ChunkIter_t *iterator, timestamp_t timestamp) {
     ChunkIterator *iter = (ChunkIterator *)iterator;
-    if (iter->options & CHUNK_ITER_OP_FREE_CHUNK) {
-        Uncompressed_FreeChunk(iter->chunk);
+    int lo = lowerBound(iter->chunk, timestamp);
+    if (iter->options & CHUNK_ITER_OP_REVERSE) {
+        if (lo < iter->chunk->num_samples && iter->chunk->timestamps[lo] == timestamp) {
+            iter->currentIndex = lo;
+        } else {
+            iter->currentIndex = lo - 1;
+        }
+    } else {
+        iter->currentIndex = lo;
     }
-    free(iter);
+}
+
+void Uncompressed_FreeChunkIterator(ChunkIter_t *iterator) {
+    free(iterator);
+}
+
+void Uncompressed_ReleaseChunkIterator(ChunkIter_t *iterator) {
 }
 
 size_t Uncompressed_GetChunkSize(Chunk_t *chunk, bool includeStruct) {
@@ -207,23 +365,65 @@ size_t Uncompressed_GetChunkSize(Chunk_t *chunk, bool includeStruct) {
     return size;
 }
 
+size_t Uncompressed_GetChunkUsedSize(Chunk_t *chunk) {
+    return ((Chunk *)chunk)->num_samples * sizeof(Sample);
+}
+
+// Saved as one buffer followed by the samples since TS_PACKED_CHUNKS_VER
+typedef struct UncompressedChunkHeader
+{
+    u_int64_t base_timestamp;
+    u_int64_t num_samples;
+    u_int64_t size;
+} UncompressedChunkHeader;
+
 void Uncompressed_SaveToRDB(Chunk_t *chunk, struct RedisModuleIO *io) {
     Chunk *uncompchunk = chunk;
 
-    RedisModule_SaveUnsigned(io, uncompchunk->base_timestamp);
-    RedisModule_SaveUnsigned(io, uncompchunk->num_samples);
-    RedisModule_SaveUnsigned(io, uncompchunk->size);
-
-    RedisModule_SaveStringBuffer(io, (char *)uncompchunk->samples, uncompchunk->size);
+    UncompressedChunkHeader header = {
+        .base_timestamp = uncompchunk->base_timestamp,
+        .num_samples = uncompchunk->num_samples,
+        .size = uncompchunk->size,
+    };
+    RedisModule_SaveStringBuffer(io, (char *)&header, sizeof(header));
+    // the samples are saved interleaved, the loader leaves the rest of the chunk unset
+    size_t count = uncompchunk->num_samples;
+    Sample *samples = malloc(max(count, 1) * sizeof(Sample));
+    for (size_t i = 0; i < count; ++i) {
+        samples[i] = ChunkGetSample(uncompchunk, i);
+    }
+    RedisModule_SaveStringBuffer(io, (char *)samples, count * sizeof(Sample));
+    free(samples);
 }
 
-void Uncompressed_LoadFromRDB(Chunk_t **chunk, struct RedisModuleIO *io) {
+void Uncompressed_LoadFromRDB(Chunk_t **chunk, struct RedisModuleIO *io, int encver) {
     Chunk *uncompchunk = (Chunk *)malloc(sizeof(*uncompchunk));
 
-    uncompchunk->base_timestamp = RedisModule_LoadUnsigned(io);
-    uncompchunk->num_samples = RedisModule_LoadUnsigned(io);
-    uncompchunk->size = RedisModule_LoadUnsigned(io);
+    if (encver >= TS_PACKED_CHUNKS_VER) {
+        size_t len;
+        UncompressedChunkHeader header = { 0 };
+        char *buffer = RedisModule_LoadStringBuffer(io, &len);
+        memcpy(&header, buffer, min(len, sizeof(header)));
+        RedisModule_Free(buffer);
+        uncompchunk->base_timestamp = header.base_timestamp;
+        uncompchunk->num_samples = header.num_samples;
+        uncompchunk->size = header.size;
+    } else {
+        uncompchunk->base_timestamp = RedisModule_LoadUnsigned(io);
+        uncompchunk->num_samples = RedisModule_LoadUnsigned(io);
+        uncompchunk->size = RedisModule_LoadUnsigned(io);
+    }
     size_t string_buffer_size;
-    uncompchunk->samples = (Sample *)RedisModule_LoadStringBuffer(io, &string_buffer_size);
+    char *buffer = RedisModule_LoadStringBuffer(io, &string_buffer_size);
+    setColumns(uncompchunk, ChunkPool_Alloc(uncompchunk->size), uncompchunk->size);
+    size_t count = min(string_buffer_size, uncompchunk->size) / sizeof(Sample);
+    const Sample *samples = (const Sample *)buffer;
+    for (size_t i = 0; i < min(count, uncompchunk->num_samples); ++i) {
+        uncompchunk->timestamps[i] = samples[i].timestamp;
+        uncompchunk->values[i] = samples[i].value;
+    }
+    RedisModule_Free(buffer);
+    ChunkSummaryReset(&uncompchunk->summary);
+    uncompchunk->summary.stale = true;
     *chunk = (Chunk_t *)uncompchunk;
 }
@@ -11,12 +11,19 @@
 
 #include <sys/types.h>
 
+/*
+ * The samples are stored in two columns, so that reading the timestamps or the values only loads
+ * those. A buffer of `size` bytes holds size / SAMPLE_SIZE samples: the timestamps first, then the
+ * values. RDB keeps the samples interleaved.
+ */
 typedef struct Chunk
 {
     timestamp_t base_timestamp;
-    Sample *samples;
+    timestamp_t *timestamps; // the buffer
+    double *values;
     unsigned int num_samples;
     size_t size;
+    ChunkSummary summary;
 } Chunk;
 
 typedef struct ChunkIterator
@@ -30,6 +37,7 @@ typedef struct ChunkIterator
 
 Chunk_t *Uncompressed_NewChunk(size_t sampleCount);
 void Uncompressed_FreeChunk(Chunk_t *chunk);
+Chunk_t *Uncompressed_CloneChunk(Chunk_t *chunk);
 
 /**
  * TODO: describe me
@@ -38,6 +46,9 @@ void Uncompressed_FreeChunk(Chunk_t *chunk);
  */
 Chunk_t *Uncompressed_SplitChunk(Chunk_t *chunk);
 size_t Uncompressed_GetChunkSize(Chunk_t *chunk, bool includeStruct);
+size_t Uncompressed_GetChunkUsedSize(Chunk_t *chunk);
+// Shrink the chunk to its samples
+void Uncompressed_SealChunk(Chunk_t *chunk);
 
 /**
  * TODO: describe me
@@ -55,20 +66,36 @@ ChunkResult Uncompressed_AddSample(Chunk_t *chunk, Sample *sample);
  * @return
  */
 ChunkResult Uncompressed_UpsertSample(UpsertCtx *uCtx, int *size, DuplicatePolicy duplicatePolicy);
+size_t Uncompressed_DelRange(Chunk_t *chunk, timestamp_t startTs, timestamp_t endTs);
 
 u_int64_t Uncompressed_NumOfSample(Chunk_t *chunk);
 timestamp_t Uncompressed_GetLastTimestamp(Chunk_t *chunk);
 timestamp_t Uncompressed_GetFirstTimestamp(Chunk_t *chunk);
+const ChunkSummary *Uncompressed_GetSummary(Chunk_t *chunk);
 
 ChunkIter_t *Uncompressed_NewChunkIterator(Chunk_t *chunk,
                                            int options,
                                            ChunkIterFuncs *retChunkIterClass);
+ChunkIter_t *Uncompressed_InitChunkIterator(Chunk_t *chunk,
+                                            int options,
+                                            ChunkIterFuncs *retChunkIterClass,
+                                            ChunkIterStorage *storage);
 ChunkResult Uncompressed_ChunkIteratorGetNext(ChunkIter_t *iterator, Sample *sample);
 ChunkResult Uncompressed_ChunkIteratorGetPrev(ChunkIter_t *iterator, Sample *sample);
+size_t Uncompressed_ChunkIteratorGetNextBatch(ChunkIter_t *iterator,
+                                              timestamp_t *timestamps,
+                                              double *values,
+                                              size_t max);
+size_t Uncompressed_ChunkIteratorGetPrevBatch(ChunkIter_t *iterator,
+                                              timestamp_t *timestamps,
+                                              double *values,
+                                              size_t max);
+void Uncompressed_ChunkIteratorSeek(ChunkIter_t *iterator, timestamp_t timestamp);
 void Uncompressed_FreeChunkIterator(ChunkIter_t *iter);
+void Uncompressed_ReleaseChunkIterator(ChunkIter_t *iter);
 
 // RDB
 void Uncompressed_SaveToRDB(Chunk_t *chunk, struct RedisModuleIO *io);
-void Uncompressed_LoadFromRDB(Chunk_t **chunk, struct RedisModuleIO *io);
+void Uncompressed_LoadFromRDB(Chunk_t **chunk, struct RedisModuleIO *io, int encver);
 
 #endif
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "chunk_dir.h"
+
+#include <string.h>
+#include "rmutil/alloc.h"
+
+// most series hold a few chunks, larger ones double their capacity
+#define CHUNK_DIR_MIN_CAPACITY 4
+
+void ChunkDir_Init(ChunkDir *dir) {
+    dir->entries = NULL;
+    dir->count = 0;
+    dir->capacity = 0;
+}
+
+void ChunkDir_Free(ChunkDir *dir) {
+    free(dir->entries);
+    ChunkDir_Init(dir);
+}
+
+static void chunkDirResize(ChunkDir *dir, size_t capacity) {
+    dir->entries = realloc(dir->entries, capacity * sizeof(ChunkDirEntry));
+    dir->capacity = capacity;
+}
+
+// Position of the first chunk keyed after `key`
+static size_t chunkDirUpperBound(const ChunkDir *dir, timestamp_t key) {
+    size_t low = 0, high = dir->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (dir->entries[mid].key <= key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+int ChunkDir_Insert(ChunkDir *dir, timestamp_t key, Chunk_t *chunk) {
+    size_t pos = dir->count;
+    // new chunks are appended, unless the series is backfilled
+    if (dir->count > 0 && key <= dir->entries[dir->count - 1].key) {
+        pos = chunkDirUpperBound(dir, key);
+        if (pos > 0 && dir->entries[pos - 1].key == key) {
+            return TSDB_ERROR;
+        }
+    }
+    if (dir->count == dir->capacity) {
+        chunkDirResize(dir, dir->capacity > 0 ? dir->capacity * 2 : CHUNK_DIR_MIN_CAPACITY);
+    }
+    memmove(&dir->entries[pos + 1], &dir->entries[pos], (dir->count - pos) * sizeof(ChunkDirEntry));
+    dir->entries[pos] = (ChunkDirEntry){ .key = key, .chunk = chunk };
+    dir->count++;
+    return TSDB_OK;
+}
+
+// Gives memory back once the retention freed most of the chunks
+static void chunkDirShrink(ChunkDir *dir) {
+    size_t capacity = dir->capacity;
+    while (capacity > CHUNK_DIR_MIN_CAPACITY && dir->count <= capacity / 4) {
+        capacity /= 2;
+    }
+    if (capacity < dir->capacity) {
+        chunkDirResize(dir, capacity);
+    }
+}
+
+int ChunkDir_Delete(ChunkDir *dir, timestamp_t key) {
+    size_t pos = chunkDirUpperBound(dir, key);
+    if (pos == 0 || dir->entries[pos - 1].key != key) {
+        return TSDB_ERROR;
+    }
+    memmove(&dir->entries[pos - 1], &dir->entries[pos], (dir->count - pos) * sizeof(ChunkDirEntry));
+    dir->count--;
+    chunkDirShrink(dir);
+    return TSDB_OK;
+}
+
+void ChunkDir_DeleteFirst(ChunkDir *dir, size_t count) {
+    ChunkDir_DeleteRange(dir, 0, count);
+}
+
+void ChunkDir_DeleteRange(ChunkDir *dir, size_t pos, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    memmove(&dir->entries[pos],
+            &dir->entries[pos + count],
+            (dir->count - pos - count) * sizeof(ChunkDirEntry));
+    dir->count -= count;
+    chunkDirShrink(dir);
+}
+
+size_t ChunkDir_Find(const ChunkDir *dir, timestamp_t timestamp) {
+    // the latest chunk is the usual target
+    if (dir->count > 0 && dir->entries[dir->count - 1].key <= timestamp) {
+        return dir->count - 1;
+    }
+    size_t pos = chunkDirUpperBound(dir, timestamp);
+    return pos > 0 ? pos - 1 : 0;
+}
+
+size_t ChunkDir_FindFrom(const ChunkDir *dir, timestamp_t timestamp, size_t hint) {
+    if (hint < dir->count && dir->entries[hint].key <= timestamp &&
+        (hint + 1 == dir->count || dir->entries[hint + 1].key > timestamp)) {
+        return hint;
+    }
+    return ChunkDir_Find(dir, timestamp);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef CHUNK_DIR_H
+#define CHUNK_DIR_H
+
+#include "consts.h"
+#include "generic_chunk.h"
+
+#include <stddef.h>
+
+/*
+ * The chunks of a series in a sorted array, keyed by the first timestamp of each chunk when it was
+ * indexed (the first chunk of a series may be keyed 0). Chunks are appended in the common case and
+ * looked up by binary search otherwise, and iterating the chunks walks contiguous memory.
+ * Positions are invalidated by inserts and deletes.
+ */
+typedef struct ChunkDirEntry
+{
+    timestamp_t key;
+    Chunk_t *chunk;
+} ChunkDirEntry;
+
+typedef struct ChunkDir
+{
+    ChunkDirEntry *entries;
+    size_t count;
+    size_t capacity;
+} ChunkDir;
+
+void ChunkDir_Init(ChunkDir *dir);
+// Frees the directory, not the chunks
+void ChunkDir_Free(ChunkDir *dir);
+
+static inline size_t ChunkDir_Count(const ChunkDir *dir) {
+    return dir->count;
+}
+
+static inline Chunk_t *ChunkDir_Get(const ChunkDir *dir, size_t pos) {
+    return dir->entries[pos].chunk;
+}
+
+static inline timestamp_t ChunkDir_Key(const ChunkDir *dir, size_t pos) {
+    return dir->entries[pos].key;
+}
+
+// Replaces the chunk at `pos`, keeping its key
+static inline void ChunkDir_Set(ChunkDir *dir, size_t pos, Chunk_t *chunk) {
+    dir->entries[pos].chunk = chunk;
+}
+
+// Returns TSDB_ERROR if a chunk is already keyed `key`
+int ChunkDir_Insert(ChunkDir *dir, timestamp_t key, Chunk_t *chunk);
+// Returns TSDB_ERROR if no chunk is keyed `key`
+int ChunkDir_Delete(ChunkDir *dir, timestamp_t key);
+// Removes the `count` first chunks
+void ChunkDir_DeleteFirst(ChunkDir *dir, size_t count);
+// Removes the `count` chunks from position `pos` on
+void ChunkDir_DeleteRange(ChunkDir *dir, size_t pos, size_t count);
+// Position of the last chunk keyed at or before `timestamp`, or of the first chunk if there is none
+size_t ChunkDir_Find(const ChunkDir *dir, timestamp_t timestamp);
+// Same as ChunkDir_Find, returning `hint` without a search when it is the position found
+size_t ChunkDir_FindFrom(const ChunkDir *dir, timestamp_t timestamp, size_t hint);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "chunk_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include "rmutil/alloc.h"
+
+// 16 bytes steps up to 128 bytes, then 4 classes per doubling up to CHUNK_POOL_MAX_SIZE
+#define SMALL_CLASS_STEP 16
+#define SMALL_CLASSES 8
+#define SMALL_CLASSES_MAX (SMALL_CLASS_STEP * SMALL_CLASSES)
+#define CLASSES_PER_DOUBLING 4
+#define NUM_CLASSES 60
+#define NOT_POOLED -1
+
+typedef struct FreeBuffer
+{
+    struct FreeBuffer *next;
+} FreeBuffer;
+
+static struct
+{
+    pthread_mutex_t lock;
+    FreeBuffer *freeLists[NUM_CLASSES];
+    size_t idleBytes;
+} chunkPool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int sizeClass(size_t size) {
+    if (size <= SMALL_CLASSES_MAX) {
+        return size == 0 ? 0 : (int)((size - 1) / SMALL_CLASS_STEP);
+    }
+    if (size > CHUNK_POOL_MAX_SIZE) {
+        return NOT_POOLED;
+    }
+    // the power of two below size, and which quarter above it size falls in
+    int exponent = 63 - __builtin_clzll(size - 1);
+    size_t base = (size_t)1 << exponent;
+    size_t quarter = (size - 1 - base) / (base / CLASSES_PER_DOUBLING);
+    return SMALL_CLASSES + (exponent - 7) * CLASSES_PER_DOUBLING + (int)quarter;
+}
+
+static size_t classSize(int sizeClass) {
+    if (sizeClass < SMALL_CLASSES) {
+        return (size_t)(sizeClass + 1) * SMALL_CLASS_STEP;
+    }
+    int group = (sizeClass - SMALL_CLASSES) / CLASSES_PER_DOUBLING;
+    size_t base = (size_t)SMALL_CLASSES_MAX << group;
+    size_t quarter = (sizeClass - SMALL_CLASSES) % CLASSES_PER_DOUBLING;
+    return base + (quarter + 1) * (base / CLASSES_PER_DOUBLING);
+}
+
+size_t ChunkPool_AllocatedSize(size_t size) {
+    int cls = sizeClass(size);
+    return cls == NOT_POOLED ? size : classSize(cls);
+}
+
+void *ChunkPool_Alloc(size_t size) {
+    int cls = sizeClass(size);
+    if (cls == NOT_POOLED) {
+        return malloc(size);
+    }
+
+    pthread_mutex_lock(&chunkPool.lock);
+    FreeBuffer *buffer = chunkPool.freeLists[cls];
+    if (buffer != NULL) {
+        chunkPool.freeLists[cls] = buffer->next;
+        chunkPool.idleBytes -= classSize(cls);
+    }
+    pthread_mutex_unlock(&chunkPool.lock);
+
+    return buffer != NULL ? (void *)buffer : malloc(classSize(cls));
+}
+
+void *ChunkPool_Calloc(size_t size) {
+    void *ptr = ChunkPool_Alloc(size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void ChunkPool_Free(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    int cls = sizeClass(size);
+    if (cls != NOT_POOLED) {
+        pthread_mutex_lock(&chunkPool.lock);
+        bool pooled = chunkPool.idleBytes + classSize(cls) <= CHUNK_POOL_MAX_IDLE_BYTES;
+        if (pooled) {
+            FreeBuffer *buffer = ptr;
+            buffer->next = chunkPool.freeLists[cls];
+            chunkPool.freeLists[cls] = buffer;
+            chunkPool.idleBytes += classSize(cls);
+        }
+        pthread_mutex_unlock(&chunkPool.lock);
+        if (pooled) {
+            return;
+        }
+    }
+    free(ptr);
+}
+
+void *ChunkPool_Realloc(void *ptr, size_t oldSize, size_t newSize) {
+    int oldClass = sizeClass(oldSize), newClass = sizeClass(newSize);
+    if (oldClass == newClass && oldClass != NOT_POOLED) {
+        return ptr;
+    }
+    if (oldClass == NOT_POOLED && newClass == NOT_POOLED) {
+        return realloc(ptr, newSize);
+    }
+
+    void *resized = ChunkPool_Alloc(newSize);
+    memcpy(resized, ptr, oldSize < newSize ? oldSize : newSize);
+    ChunkPool_Free(ptr, oldSize);
+    return resized;
+}
+
+size_t ChunkPool_IdleBytes() {
+    pthread_mutex_lock(&chunkPool.lock);
+    size_t idleBytes = chunkPool.idleBytes;
+    pthread_mutex_unlock(&chunkPool.lock);
+    return idleBytes;
+}
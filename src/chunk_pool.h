@@ -0,0 +1,35 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef CHUNK_POOL_H
+#define CHUNK_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Allocator for the sample buffers of the chunks. Buffer sizes are rounded up to a size class
+ * (the classes of jemalloc, so rounding costs no memory) and freed buffers are kept on a free list
+ * per class, up to CHUNK_POOL_MAX_IDLE_BYTES overall, for the next chunk of the same class.
+ * Buffers larger than CHUNK_POOL_MAX_SIZE are not pooled.
+ *
+ * The size given when freeing or resizing a buffer must be the size it was last allocated with.
+ * The pool is thread safe, chunk copies may be freed on the worker threads.
+ */
+#define CHUNK_POOL_MAX_SIZE (1024 * 1024)
+#define CHUNK_POOL_MAX_IDLE_BYTES (64 * 1024 * 1024)
+
+void *ChunkPool_Alloc(size_t size);
+// Like ChunkPool_Alloc, with the first `size` bytes zeroed
+void *ChunkPool_Calloc(size_t size);
+// Returns ptr itself when both sizes are in the same class, otherwise the content is moved
+void *ChunkPool_Realloc(void *ptr, size_t oldSize, size_t newSize);
+void ChunkPool_Free(void *ptr, size_t size);
+
+// Size of the memory backing a buffer of `size` bytes
+size_t ChunkPool_AllocatedSize(size_t size);
+// Bytes held by the free lists
+size_t ChunkPool_IdleBytes();
+
+#endif
@@ -0,0 +1,378 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "cluster.h"
+
+#include "common.h"
+#include "consts.h"
+
+#include <string.h>
+#include "rmutil/alloc.h"
+
+#define CLUSTER_MSG_QUERY 1
+#define CLUSTER_MSG_RESULT 2
+
+// results start with their status
+#define CLUSTER_RESULT_OK 0
+#define CLUSTER_RESULT_ERROR 1
+
+typedef struct ClusterQueryType
+{
+    ClusterShardFunc shard;
+    ClusterMergeFunc merge;
+} ClusterQueryType;
+
+// A query scattered by this node, waiting for the results of the shards
+typedef struct ClusterQuery
+{
+    uint64_t id;
+    int type;
+    RedisModuleBlockedClient *bc;
+    ClusterBuffer *parts;
+    size_t partsCount;
+    size_t shardsCount;
+    size_t answered;
+    bool failed;
+} ClusterQuery;
+
+static ClusterQueryType queryTypes[CLUSTER_QUERY_TYPES_MAX];
+static int queryTypesCount;
+// the blocked queries by id
+static RedisModuleDict *pendingQueries;
+static uint64_t nextQueryId = 1;
+
+static void clusterBufferReserve(ClusterBuffer *buffer, size_t len) {
+    if (buffer->len + len > buffer->capacity) {
+        buffer->capacity = max(buffer->capacity * 2, buffer->len + len);
+        buffer->capacity = max(buffer->capacity, 256);
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+}
+
+static void clusterBufferWrite(ClusterBuffer *buffer, const void *data, size_t len) {
+    clusterBufferReserve(buffer, len);
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+static bool clusterBufferRead(ClusterBuffer *buffer, void *data, size_t len) {
+    if (buffer->error || buffer->len - buffer->pos < len) {
+        buffer->error = true;
+        memset(data, 0, len);
+        return false;
+    }
+    memcpy(data, buffer->data + buffer->pos, len);
+    buffer->pos += len;
+    return true;
+}
+
+void ClusterBuffer_WriteU64(ClusterBuffer *buffer, uint64_t value) {
+    clusterBufferWrite(buffer, &value, sizeof(value));
+}
+
+void ClusterBuffer_WriteDouble(ClusterBuffer *buffer, double value) {
+    clusterBufferWrite(buffer, &value, sizeof(value));
+}
+
+void ClusterBuffer_WriteString(ClusterBuffer *buffer, const char *str, size_t len) {
+    ClusterBuffer_WriteU64(buffer, len);
+    clusterBufferWrite(buffer, str, len);
+}
+
+void ClusterBuffer_SetU64(ClusterBuffer *buffer, size_t pos, uint64_t value) {
+    memcpy(buffer->data + pos, &value, sizeof(value));
+}
+
+uint64_t ClusterBuffer_ReadU64(ClusterBuffer *buffer) {
+    uint64_t value;
+    clusterBufferRead(buffer, &value, sizeof(value));
+    return value;
+}
+
+double ClusterBuffer_ReadDouble(ClusterBuffer *buffer) {
+    double value;
+    clusterBufferRead(buffer, &value, sizeof(value));
+    return value;
+}
+
+const char *ClusterBuffer_ReadString(ClusterBuffer *buffer, size_t *len) {
+    *len = ClusterBuffer_ReadU64(buffer);
+    if (buffer->error || buffer->len - buffer->pos < *len) {
+        buffer->error = true;
+        *len = 0;
+        return "";
+    }
+    const char *str = buffer->data + buffer->pos;
+    buffer->pos += *len;
+    return str;
+}
+
+void ClusterBuffer_Free(ClusterBuffer *buffer) {
+    free(buffer->data);
+    *buffer = (ClusterBuffer){ 0 };
+}
+
+int Cluster_RegisterQuery(ClusterShardFunc shard, ClusterMergeFunc merge) {
+    if (queryTypesCount == CLUSTER_QUERY_TYPES_MAX) {
+        return -1;
+    }
+    queryTypes[queryTypesCount] = (ClusterQueryType){ .shard = shard, .merge = merge };
+    return queryTypesCount++;
+}
+
+static void freeClusterQuery(ClusterQuery *query) {
+    for (size_t i = 0; i < query->partsCount; i++) {
+        ClusterBuffer_Free(&query->parts[i]);
+    }
+    free(query->parts);
+    free(query);
+}
+
+// Runs the query on this node, the result starts with its status
+static void runShardQuery(RedisModuleCtx *ctx,
+                          int type,
+                          RedisModuleString **argv,
+                          int argc,
+                          ClusterBuffer *out) {
+    size_t statusPos = out->len;
+    ClusterBuffer_WriteU64(out, CLUSTER_RESULT_OK);
+    if (type < 0 || type >= queryTypesCount ||
+        queryTypes[type].shard(ctx, argv, argc, out) != TSDB_OK) {
+        out->len = statusPos;
+        ClusterBuffer_WriteU64(out, CLUSTER_RESULT_ERROR);
+    }
+}
+
+static void addQueryResult(ClusterQuery *query, const char *data, size_t len) {
+    ClusterBuffer part = { 0 };
+    clusterBufferWrite(&part, data, len);
+    if (ClusterBuffer_ReadU64(&part) != CLUSTER_RESULT_OK) {
+        query->failed = true;
+        ClusterBuffer_Free(&part);
+    } else {
+        query->parts[query->partsCount++] = part;
+    }
+    query->answered++;
+}
+
+static int replyClusterQuery(RedisModuleCtx *ctx,
+                             ClusterQuery *query,
+                             RedisModuleString **argv,
+                             int argc) {
+    if (query->failed) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: the cluster query failed on a shard");
+    }
+    return queryTypes[query->type].merge(ctx, argv, argc, query->parts, query->partsCount);
+}
+
+static int clusterQueryReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return replyClusterQuery(ctx, RedisModule_GetBlockedClientPrivateData(ctx), argv, argc);
+}
+
+static int clusterQueryTimeout(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    // the query wasn't handed to the blocked client, it is still pending
+    RedisModuleBlockedClient *bc = RedisModule_GetBlockedClientHandle(ctx);
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(pendingQueries, "^", NULL, 0);
+    ClusterQuery *query = NULL, *pending;
+    size_t keyLen;
+    while (RedisModule_DictNextC(iter, &keyLen, (void **)&pending) != NULL) {
+        if (pending->bc == bc) {
+            query = pending;
+            break;
+        }
+    }
+    RedisModule_DictIteratorStop(iter);
+    if (query != NULL) {
+        RedisModule_DictDelC(pendingQueries, &query->id, sizeof(query->id), NULL);
+        freeClusterQuery(query);
+    }
+    return RTS_ReplyGeneralError(ctx, "TSDB: the cluster query timed out");
+}
+
+static void clusterQueryFree(RedisModuleCtx *ctx, void *privdata) {
+    freeClusterQuery(privdata);
+}
+
+static void completeIfAnswered(ClusterQuery *query) {
+    if (query->answered == query->shardsCount) {
+        RedisModule_DictDelC(pendingQueries, &query->id, sizeof(query->id), NULL);
+        RedisModule_UnblockClient(query->bc, query);
+    }
+}
+
+// A query message holds the id of the query, its type and its arguments
+static void onQueryMessage(RedisModuleCtx *ctx,
+                           const char *sender_id,
+                           uint8_t type,
+                           const unsigned char *payload,
+                           uint32_t len) {
+    RedisModule_AutoMemory(ctx);
+    ClusterBuffer message = { .data = (char *)payload, .len = len };
+    uint64_t id = ClusterBuffer_ReadU64(&message);
+    int queryType = ClusterBuffer_ReadU64(&message);
+    int argc = ClusterBuffer_ReadU64(&message);
+    RedisModuleString **argv = NULL;
+    if (!message.error && argc > 0 && argc <= len) {
+        argv = RedisModule_PoolAlloc(ctx, argc * sizeof(RedisModuleString *));
+        for (int i = 0; i < argc; i++) {
+            size_t argLen;
+            const char *arg = ClusterBuffer_ReadString(&message, &argLen);
+            argv[i] = RedisModule_CreateString(ctx, arg, argLen);
+        }
+    }
+
+    ClusterBuffer result = { 0 };
+    ClusterBuffer_WriteU64(&result, id);
+    if (argv == NULL || message.error) {
+        ClusterBuffer_WriteU64(&result, CLUSTER_RESULT_ERROR);
+    } else {
+        runShardQuery(ctx, queryType, argv, argc, &result);
+    }
+    char sender[REDISMODULE_NODE_ID_LEN];
+    memcpy(sender, sender_id, REDISMODULE_NODE_ID_LEN);
+    if (RedisModule_SendClusterMessage(
+            ctx, sender, CLUSTER_MSG_RESULT, (unsigned char *)result.data, result.len) !=
+        REDISMODULE_OK) {
+        RedisModule_Log(ctx, "warning", "couldn't send the result of a cluster query");
+    }
+    ClusterBuffer_Free(&result);
+}
+
+static void onResultMessage(RedisModuleCtx *ctx,
+                            const char *sender_id,
+                            uint8_t type,
+                            const unsigned char *payload,
+                            uint32_t len) {
+    ClusterBuffer message = { .data = (char *)payload, .len = len };
+    uint64_t id = ClusterBuffer_ReadU64(&message);
+    ClusterQuery *query = RedisModule_DictGetC(pendingQueries, &id, sizeof(id), NULL);
+    if (message.error || query == NULL) {
+        return; // the query timed out
+    }
+    addQueryResult(query, message.data + message.pos, message.len - message.pos);
+    completeIfAnswered(query);
+}
+
+int Cluster_Init(RedisModuleCtx *ctx) {
+    pendingQueries = RedisModule_CreateDict(NULL);
+    RedisModule_RegisterClusterMessageReceiver(ctx, CLUSTER_MSG_QUERY, onQueryMessage);
+    RedisModule_RegisterClusterMessageReceiver(ctx, CLUSTER_MSG_RESULT, onResultMessage);
+    return TSDB_OK;
+}
+
+static bool canBlockClient(RedisModuleCtx *ctx) {
+    int flags = RedisModule_GetContextFlags(ctx);
+    return !(flags & (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA |
+                      REDISMODULE_CTX_FLAGS_DENY_BLOCKING));
+}
+
+// The ids of the other masters, NULL outside of a cluster. A replica only asks the masters.
+static char **remoteShards(RedisModuleCtx *ctx, size_t *count, bool *down, bool *local) {
+    *count = 0;
+    *down = false;
+    *local = true;
+    if (!(RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_CLUSTER)) {
+        return NULL;
+    }
+    size_t nodesCount;
+    char **nodes = RedisModule_GetClusterNodesList(ctx, &nodesCount);
+    if (nodes == NULL) {
+        return NULL;
+    }
+    char **shards = malloc(max(nodesCount, 1) * sizeof(char *));
+    for (size_t i = 0; i < nodesCount; i++) {
+        int flags = 0;
+        if (RedisModule_GetClusterNodeInfo(ctx, nodes[i], NULL, NULL, NULL, &flags) !=
+            REDISMODULE_OK) {
+            continue;
+        }
+        if (flags & REDISMODULE_NODE_MYSELF) {
+            *local = flags & REDISMODULE_NODE_MASTER;
+            continue;
+        }
+        if (!(flags & REDISMODULE_NODE_MASTER)) {
+            continue;
+        }
+        if (flags & (REDISMODULE_NODE_PFAIL | REDISMODULE_NODE_FAIL)) {
+            *down = true;
+        }
+        shards[*count] = malloc(REDISMODULE_NODE_ID_LEN);
+        memcpy(shards[(*count)++], nodes[i], REDISMODULE_NODE_ID_LEN);
+    }
+    RedisModule_FreeClusterNodesList(nodes);
+    return shards;
+}
+
+static void freeShards(char **shards, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(shards[i]);
+    }
+    free(shards);
+}
+
+int Cluster_Query(RedisModuleCtx *ctx, int type, RedisModuleString **argv, int argc) {
+    size_t shardsCount;
+    bool down, local;
+    char **shards = remoteShards(ctx, &shardsCount, &down, &local);
+    if (down) {
+        freeShards(shards, shardsCount);
+        return RTS_ReplyGeneralError(ctx, "TSDB: a shard of the cluster is down");
+    }
+    if (shardsCount > 0 && !canBlockClient(ctx)) {
+        freeShards(shards, shardsCount);
+        return RTS_ReplyGeneralError(ctx, "TSDB: cluster queries can't run in MULTI or scripts");
+    }
+
+    ClusterQuery *query = calloc(1, sizeof(ClusterQuery));
+    query->id = nextQueryId++;
+    query->type = type;
+    query->shardsCount = shardsCount + local;
+    query->parts = calloc(max(query->shardsCount, 1), sizeof(ClusterBuffer));
+
+    if (shardsCount > 0) {
+        ClusterBuffer message = { 0 };
+        ClusterBuffer_WriteU64(&message, query->id);
+        ClusterBuffer_WriteU64(&message, type);
+        ClusterBuffer_WriteU64(&message, argc);
+        for (int i = 0; i < argc; i++) {
+            size_t len;
+            const char *arg = RedisModule_StringPtrLen(argv[i], &len);
+            ClusterBuffer_WriteString(&message, arg, len);
+        }
+        query->bc = RedisModule_BlockClient(ctx,
+                                            clusterQueryReply,
+                                            clusterQueryTimeout,
+                                            clusterQueryFree,
+                                            CLUSTER_QUERY_TIMEOUT_MS);
+        RedisModule_DictSetC(pendingQueries, &query->id, sizeof(query->id), query);
+        for (size_t i = 0; i < shardsCount; i++) {
+            if (RedisModule_SendClusterMessage(ctx,
+                                               shards[i],
+                                               CLUSTER_MSG_QUERY,
+                                               (unsigned char *)message.data,
+                                               message.len) != REDISMODULE_OK) {
+                query->failed = true;
+                query->answered++;
+            }
+        }
+        ClusterBuffer_Free(&message);
+    }
+    freeShards(shards, shardsCount);
+
+    if (local) {
+        ClusterBuffer result = { 0 };
+        runShardQuery(ctx, type, argv, argc, &result);
+        addQueryResult(query, result.data, result.len);
+        ClusterBuffer_Free(&result);
+    }
+
+    if (query->bc != NULL) {
+        completeIfAnswered(query);
+        return REDISMODULE_OK;
+    }
+    int rv = replyClusterQuery(ctx, query, argv, argc);
+    freeClusterQuery(query);
+    return rv;
+}
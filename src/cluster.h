@@ -0,0 +1,63 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "redismodule.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Cluster queries are scattered to all the masters of the cluster over the cluster bus, run on
+ * each shard, and the partial results are merged on the node the client is connected to. The
+ * query fails if a shard doesn't answer within CLUSTER_QUERY_TIMEOUT_MS. Outside of a cluster the
+ * node is the only shard. Messages are handled on the main thread.
+ */
+#define CLUSTER_QUERY_TIMEOUT_MS 5000
+#define CLUSTER_QUERY_TYPES_MAX 16
+
+// A message, or the partial result of a shard. The nodes of a cluster share their byte order.
+typedef struct ClusterBuffer
+{
+    char *data;
+    size_t len;
+    size_t capacity;
+    size_t pos;  // of the next read
+    bool error;  // set once a read went past the end
+} ClusterBuffer;
+
+void ClusterBuffer_WriteU64(ClusterBuffer *buffer, uint64_t value);
+void ClusterBuffer_WriteDouble(ClusterBuffer *buffer, double value);
+void ClusterBuffer_WriteString(ClusterBuffer *buffer, const char *str, size_t len);
+// Overwrites a value written at `pos`, e.g. a count only known once the items are written
+void ClusterBuffer_SetU64(ClusterBuffer *buffer, size_t pos, uint64_t value);
+uint64_t ClusterBuffer_ReadU64(ClusterBuffer *buffer);
+double ClusterBuffer_ReadDouble(ClusterBuffer *buffer);
+// Points into the buffer
+const char *ClusterBuffer_ReadString(ClusterBuffer *buffer, size_t *len);
+void ClusterBuffer_Free(ClusterBuffer *buffer);
+
+// Runs the query of argv on the local shard, writing its partial result to `out`
+typedef int (*ClusterShardFunc)(RedisModuleCtx *ctx,
+                                RedisModuleString **argv,
+                                int argc,
+                                ClusterBuffer *out);
+// Replies with the merge of the partial results of all the shards
+typedef int (*ClusterMergeFunc)(RedisModuleCtx *ctx,
+                                RedisModuleString **argv,
+                                int argc,
+                                ClusterBuffer *parts,
+                                size_t count);
+
+int Cluster_Init(RedisModuleCtx *ctx);
+// The queries must be registered in the same order on all the nodes, returns the query type
+int Cluster_RegisterQuery(ClusterShardFunc shard, ClusterMergeFunc merge);
+// Scatters argv to the shards, the arguments must already be validated
+int Cluster_Query(RedisModuleCtx *ctx, int type, RedisModuleString **argv, int argc);
+
+#endif
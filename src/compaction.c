@@ -5,6 +5,8 @@
  */
 #include "compaction.h"
 
+#include "sketch.h"
+
 #include <ctype.h>
 #include <math.h> // sqrt
 #include <string.h>
@@ -29,6 +31,23 @@ typedef struct AvgContext
     double cnt;
 } AvgContext;
 
+/*
+ * A counter only grows, a decrease being a reset to 0 (e.g. a restart), after which the counter
+ * counted up to its new value. The first and previous values are in the order appended.
+ */
+typedef struct CounterContext
+{
+    double first;
+    double previous;
+    double increase; // sum of the increments between the values, the resets accounted for
+    u_int64_t cnt;
+    // the sample before the bucket, the increment from it to the earliest value is the bucket's
+    double preceding;
+    bool hasPreceding;
+    timestamp_t timeBucket;
+    bool reversed;
+} CounterContext;
+
 typedef struct StdContext
 {
     double sum;
@@ -36,6 +55,52 @@ typedef struct StdContext
     u_int64_t cnt;
 } StdContext;
 
+/*
+ * The batch kernels below keep BATCH_LANES independent accumulators so the loops carry no
+ * dependency between consecutive elements; gcc and clang turn them into packed SSE/AVX/NEON
+ * instructions at -O2 -ftree-vectorize / -O3 without target-specific intrinsics.
+ */
+#define BATCH_LANES 4
+
+static inline double batchSum(const double *values, size_t count) {
+    double acc[BATCH_LANES] = { 0 };
+    size_t i = 0;
+    for (; i + BATCH_LANES <= count; i += BATCH_LANES) {
+        for (size_t l = 0; l < BATCH_LANES; ++l) {
+            acc[l] += values[i + l];
+        }
+    }
+    for (; i < count; ++i) {
+        acc[0] += values[i];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+static inline void batchMinMax(const double *values, size_t count, double *min, double *max) {
+    double lo[BATCH_LANES], hi[BATCH_LANES];
+    for (size_t l = 0; l < BATCH_LANES; ++l) {
+        lo[l] = *min;
+        hi[l] = *max;
+    }
+    size_t i = 0;
+    for (; i + BATCH_LANES <= count; i += BATCH_LANES) {
+        for (size_t l = 0; l < BATCH_LANES; ++l) {
+            lo[l] = values[i + l] < lo[l] ? values[i + l] : lo[l];
+            hi[l] = values[i + l] > hi[l] ? values[i + l] : hi[l];
+        }
+    }
+    for (; i < count; ++i) {
+        lo[0] = values[i] < lo[0] ? values[i] : lo[0];
+        hi[0] = values[i] > hi[0] ? values[i] : hi[0];
+    }
+    for (size_t l = 1; l < BATCH_LANES; ++l) {
+        lo[0] = lo[l] < lo[0] ? lo[l] : lo[0];
+        hi[0] = hi[l] > hi[0] ? hi[l] : hi[0];
+    }
+    *min = lo[0];
+    *max = hi[0];
+}
+
 void *SingleValueCreateContext() {
     SingleValueContext *context = (SingleValueContext *)malloc(sizeof(SingleValueContext));
     context->value = 0;
@@ -81,6 +146,25 @@ void AvgAddValue(void *contextPtr, double value) {
     context->cnt++;
 }
 
+void AvgAppendValues(void *contextPtr, const double *values, size_t count) {
+    AvgContext *context = (AvgContext *)contextPtr;
+    context->val += batchSum(values, count);
+    context->cnt += count;
+}
+
+void AvgAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    AvgContext *context = (AvgContext *)contextPtr;
+    context->val += summary->sum;
+    context->cnt += summary->count;
+}
+
+int AvgRemoveValue(void *contextPtr, double value) {
+    AvgContext *context = (AvgContext *)contextPtr;
+    context->val -= value;
+    context->cnt--;
+    return TSDB_OK;
+}
+
 int AvgFinalize(void *contextPtr, double *value) {
     AvgContext *context = (AvgContext *)contextPtr;
     if (context->cnt == 0)
@@ -122,6 +206,42 @@ void StdAddValue(void *contextPtr, double value) {
     context->sum_2 += value * value;
 }
 
+void StdAppendValues(void *contextPtr, const double *values, size_t count) {
+    StdContext *context = (StdContext *)contextPtr;
+    double sum[BATCH_LANES] = { 0 }, sum_2[BATCH_LANES] = { 0 };
+    size_t i = 0;
+    for (; i + BATCH_LANES <= count; i += BATCH_LANES) {
+        for (size_t l = 0; l < BATCH_LANES; ++l) {
+            sum[l] += values[i + l];
+            sum_2[l] += values[i + l] * values[i + l];
+        }
+    }
+    for (; i < count; ++i) {
+        sum[0] += values[i];
+        sum_2[0] += values[i] * values[i];
+    }
+    for (size_t l = 0; l < BATCH_LANES; ++l) {
+        context->sum += sum[l];
+        context->sum_2 += sum_2[l];
+    }
+    context->cnt += count;
+}
+
+void StdAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    StdContext *context = (StdContext *)contextPtr;
+    context->sum += summary->sum;
+    context->sum_2 += summary->sumsq;
+    context->cnt += summary->count;
+}
+
+int StdRemoveValue(void *contextPtr, double value) {
+    StdContext *context = (StdContext *)contextPtr;
+    --context->cnt;
+    context->sum -= value;
+    context->sum_2 -= value * value;
+    return TSDB_OK;
+}
+
 static inline double variance(double sum, double sum_2, double count) {
     if (count == 0) {
         return 0;
@@ -202,6 +322,9 @@ void rm_free(void *ptr) {
 
 static AggregationClass aggAvg = { .createContext = AvgCreateContext,
                                    .appendValue = AvgAddValue,
+                                   .appendValues = AvgAppendValues,
+                                   .appendSummary = AvgAppendSummary,
+                                   .removeValue = AvgRemoveValue,
                                    .freeContext = rm_free,
                                    .finalize = AvgFinalize,
                                    .writeContext = AvgWriteContext,
@@ -210,6 +333,9 @@ static AggregationClass aggAvg = { .createContext = AvgCreateContext,
 
 static AggregationClass aggStdP = { .createContext = StdCreateContext,
                                     .appendValue = StdAddValue,
+                                    .appendValues = StdAppendValues,
+                                    .appendSummary = StdAppendSummary,
+                                    .removeValue = StdRemoveValue,
                                     .freeContext = rm_free,
                                     .finalize = StdPopulationFinalize,
                                     .writeContext = StdWriteContext,
@@ -218,6 +344,9 @@ static AggregationClass aggStdP = { .createContext = StdCreateContext,
 
 static AggregationClass aggStdS = { .createContext = StdCreateContext,
                                     .appendValue = StdAddValue,
+                                    .appendValues = StdAppendValues,
+                                    .appendSummary = StdAppendSummary,
+                                    .removeValue = StdRemoveValue,
                                     .freeContext = rm_free,
                                     .finalize = StdSamplesFinalize,
                                     .writeContext = StdWriteContext,
@@ -226,6 +355,9 @@ static AggregationClass aggStdS = { .createContext = StdCreateContext,
 
 static AggregationClass aggVarP = { .createContext = StdCreateContext,
                                     .appendValue = StdAddValue,
+                                    .appendValues = StdAppendValues,
+                                    .appendSummary = StdAppendSummary,
+                                    .removeValue = StdRemoveValue,
                                     .freeContext = rm_free,
                                     .finalize = VarPopulationFinalize,
                                     .writeContext = StdWriteContext,
@@ -234,12 +366,141 @@ static AggregationClass aggVarP = { .createContext = StdCreateContext,
 
 static AggregationClass aggVarS = { .createContext = StdCreateContext,
                                     .appendValue = StdAddValue,
+                                    .appendValues = StdAppendValues,
+                                    .appendSummary = StdAppendSummary,
+                                    .removeValue = StdRemoveValue,
                                     .freeContext = rm_free,
                                     .finalize = VarSamplesFinalize,
                                     .writeContext = StdWriteContext,
                                     .readContext = StdReadContext,
                                     .resetContext = StdReset };
 
+void *QuantileCreateContext() {
+    QuantileSketch *context = (QuantileSketch *)malloc(sizeof(QuantileSketch));
+    QuantileSketch_Init(context);
+    return context;
+}
+
+void QuantileFreeContext(void *contextPtr) {
+    QuantileSketch_Free((QuantileSketch *)contextPtr);
+    free(contextPtr);
+}
+
+void QuantileAppendValue(void *contextPtr, double value) {
+    QuantileSketch_Add((QuantileSketch *)contextPtr, value);
+}
+
+int QuantileRemoveValue(void *contextPtr, double value) {
+    return QuantileSketch_Remove((QuantileSketch *)contextPtr, value);
+}
+
+void QuantileReset(void *contextPtr) {
+    QuantileSketch_Reset((QuantileSketch *)contextPtr);
+}
+
+int P50Finalize(void *contextPtr, double *value) {
+    return QuantileSketch_Quantile((QuantileSketch *)contextPtr, 0.5, value);
+}
+
+int P90Finalize(void *contextPtr, double *value) {
+    return QuantileSketch_Quantile((QuantileSketch *)contextPtr, 0.9, value);
+}
+
+int P95Finalize(void *contextPtr, double *value) {
+    return QuantileSketch_Quantile((QuantileSketch *)contextPtr, 0.95, value);
+}
+
+int P99Finalize(void *contextPtr, double *value) {
+    return QuantileSketch_Quantile((QuantileSketch *)contextPtr, 0.99, value);
+}
+
+int P999Finalize(void *contextPtr, double *value) {
+    return QuantileSketch_Quantile((QuantileSketch *)contextPtr, 0.999, value);
+}
+
+static void QuantileWriteStore(const SketchStore *store, RedisModuleIO *io) {
+    RedisModule_SaveSigned(io, store->offset);
+    const char *bins = store->bins != NULL ? (const char *)store->bins : "";
+    RedisModule_SaveStringBuffer(io, bins, store->size * sizeof(uint64_t));
+}
+
+static void QuantileReadStore(SketchStore *store, RedisModuleIO *io) {
+    int32_t offset = RedisModule_LoadSigned(io);
+    size_t len;
+    char *bins = RedisModule_LoadStringBuffer(io, &len);
+    uint32_t size = len / sizeof(uint64_t);
+    if (size > 0) {
+        memcpy(SketchStore_Reserve(store, offset, size), bins, size * sizeof(uint64_t));
+    }
+    RedisModule_Free(bins);
+}
+
+void QuantileWriteContext(void *contextPtr, RedisModuleIO *io) {
+    QuantileSketch *context = (QuantileSketch *)contextPtr;
+    RedisModule_SaveUnsigned(io, context->count);
+    RedisModule_SaveUnsigned(io, context->zeros);
+    RedisModule_SaveDouble(io, context->min);
+    RedisModule_SaveDouble(io, context->max);
+    QuantileWriteStore(&context->positive, io);
+    QuantileWriteStore(&context->negative, io);
+}
+
+void QuantileReadContext(void *contextPtr, RedisModuleIO *io) {
+    QuantileSketch *context = (QuantileSketch *)contextPtr;
+    QuantileSketch_Reset(context);
+    context->count = RedisModule_LoadUnsigned(io);
+    context->zeros = RedisModule_LoadUnsigned(io);
+    context->min = RedisModule_LoadDouble(io);
+    context->max = RedisModule_LoadDouble(io);
+    QuantileReadStore(&context->positive, io);
+    QuantileReadStore(&context->negative, io);
+}
+
+static AggregationClass aggP50 = { .createContext = QuantileCreateContext,
+                                   .appendValue = QuantileAppendValue,
+                                   .removeValue = QuantileRemoveValue,
+                                   .freeContext = QuantileFreeContext,
+                                   .finalize = P50Finalize,
+                                   .writeContext = QuantileWriteContext,
+                                   .readContext = QuantileReadContext,
+                                   .resetContext = QuantileReset };
+
+static AggregationClass aggP90 = { .createContext = QuantileCreateContext,
+                                   .appendValue = QuantileAppendValue,
+                                   .removeValue = QuantileRemoveValue,
+                                   .freeContext = QuantileFreeContext,
+                                   .finalize = P90Finalize,
+                                   .writeContext = QuantileWriteContext,
+                                   .readContext = QuantileReadContext,
+                                   .resetContext = QuantileReset };
+
+static AggregationClass aggP95 = { .createContext = QuantileCreateContext,
+                                   .appendValue = QuantileAppendValue,
+                                   .removeValue = QuantileRemoveValue,
+                                   .freeContext = QuantileFreeContext,
+                                   .finalize = P95Finalize,
+                                   .writeContext = QuantileWriteContext,
+                                   .readContext = QuantileReadContext,
+                                   .resetContext = QuantileReset };
+
+static AggregationClass aggP99 = { .createContext = QuantileCreateContext,
+                                   .appendValue = QuantileAppendValue,
+                                   .removeValue = QuantileRemoveValue,
+                                   .freeContext = QuantileFreeContext,
+                                   .finalize = P99Finalize,
+                                   .writeContext = QuantileWriteContext,
+                                   .readContext = QuantileReadContext,
+                                   .resetContext = QuantileReset };
+
+static AggregationClass aggP999 = { .createContext = QuantileCreateContext,
+                                    .appendValue = QuantileAppendValue,
+                                    .removeValue = QuantileRemoveValue,
+                                    .freeContext = QuantileFreeContext,
+                                    .finalize = P999Finalize,
+                                    .writeContext = QuantileWriteContext,
+                                    .readContext = QuantileReadContext,
+                                    .resetContext = QuantileReset };
+
 void *MaxMinCreateContext() {
     MaxMinContext *context = (MaxMinContext *)malloc(sizeof(MaxMinContext));
     context->minValue = 0;
@@ -264,6 +525,46 @@ void MaxMinAppendValue(void *contextPtr, double value) {
     }
 }
 
+void MaxMinAppendValues(void *contextPtr, const double *values, size_t count) {
+    MaxMinContext *context = (MaxMinContext *)contextPtr;
+    if (count == 0) {
+        return;
+    }
+    if (context->isResetted) {
+        context->isResetted = FALSE;
+        context->maxValue = values[0];
+        context->minValue = values[0];
+    }
+    batchMinMax(values, count, &context->minValue, &context->maxValue);
+}
+
+void MaxMinAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    MaxMinAppendValue(contextPtr, summary->min);
+    MaxMinAppendValue(contextPtr, summary->max);
+}
+
+int MaxRemoveValue(void *contextPtr, double value) {
+    MaxMinContext *context = (MaxMinContext *)contextPtr;
+    return context->isResetted || value >= context->maxValue ? TSDB_ERROR : TSDB_OK;
+}
+
+int MinRemoveValue(void *contextPtr, double value) {
+    MaxMinContext *context = (MaxMinContext *)contextPtr;
+    return context->isResetted || value <= context->minValue ? TSDB_ERROR : TSDB_OK;
+}
+
+int RangeRemoveValue(void *contextPtr, double value) {
+    return MaxRemoveValue(contextPtr, value) == TSDB_OK ? MinRemoveValue(contextPtr, value)
+                                                        : TSDB_ERROR;
+}
+
+void MaxMinLoadValue(void *contextPtr, double value) {
+    MaxMinContext *context = (MaxMinContext *)contextPtr;
+    context->maxValue = value;
+    context->minValue = value;
+    context->isResetted = FALSE;
+}
+
 int MaxFinalize(void *contextPtr, double *value) {
     MaxMinContext *context = (MaxMinContext *)contextPtr;
     if (context->isResetted == TRUE) {
@@ -321,12 +622,60 @@ void SumAppendValue(void *contextPtr, double value) {
     context->isResetted = FALSE;
 }
 
+void SumAppendValues(void *contextPtr, const double *values, size_t count) {
+    SingleValueContext *context = (SingleValueContext *)contextPtr;
+    if (count == 0) {
+        return;
+    }
+    context->value += batchSum(values, count);
+    context->isResetted = FALSE;
+}
+
+void SumAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    SingleValueContext *context = (SingleValueContext *)contextPtr;
+    context->value += summary->sum;
+    context->isResetted = FALSE;
+}
+
+int SumRemoveValue(void *contextPtr, double value) {
+    SingleValueContext *context = (SingleValueContext *)contextPtr;
+    context->value -= value;
+    return TSDB_OK;
+}
+
+void SingleValueLoadValue(void *contextPtr, double value) {
+    SingleValueContext *context = (SingleValueContext *)contextPtr;
+    context->value = value;
+    context->isResetted = FALSE;
+}
+
 void CountAppendValue(void *contextPtr, double value) {
     SingleValueContext *context = (SingleValueContext *)contextPtr;
     context->value++;
     context->isResetted = FALSE;
 }
 
+void CountAppendValues(void *contextPtr, const double *values, size_t count) {
+    SingleValueContext *context = (SingleValueContext *)contextPtr;
+    if (count == 0) {
+        return;
+    }
+    context->value += count;
+    context->isResetted = FALSE;
+}
+
+void CountAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    SingleValueContext *context = (SingleValueContext *)contextPtr;
+    context->value += summary->count;
+    context->isResetted = FALSE;
+}
+
+int CountRemoveValue(void *contextPtr, double value) {
+    SingleValueContext *context = (SingleValueContext *)contextPtr;
+    context->value--;
+    return TSDB_OK;
+}
+
 int CountFinalize(void *contextPtr, double *val) {
     SingleValueContext *context = (SingleValueContext *)contextPtr;
     *val = context->value;
@@ -341,14 +690,38 @@ void FirstAppendValue(void *contextPtr, double value) {
     }
 }
 
+void FirstAppendValues(void *contextPtr, const double *values, size_t count) {
+    if (count > 0) {
+        FirstAppendValue(contextPtr, values[0]);
+    }
+}
+
+void FirstAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    FirstAppendValue(contextPtr, summary->first);
+}
+
 void LastAppendValue(void *contextPtr, double value) {
     SingleValueContext *context = (SingleValueContext *)contextPtr;
     context->value = value;
     context->isResetted = FALSE;
 }
 
+void LastAppendValues(void *contextPtr, const double *values, size_t count) {
+    if (count > 0) {
+        LastAppendValue(contextPtr, values[count - 1]);
+    }
+}
+
+void LastAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    LastAppendValue(contextPtr, summary->last);
+}
+
 static AggregationClass aggMax = { .createContext = MaxMinCreateContext,
                                    .appendValue = MaxMinAppendValue,
+                                   .appendValues = MaxMinAppendValues,
+                                   .appendSummary = MaxMinAppendSummary,
+                                   .removeValue = MaxRemoveValue,
+                                   .loadValue = MaxMinLoadValue,
                                    .freeContext = rm_free,
                                    .finalize = MaxFinalize,
                                    .writeContext = MaxMinWriteContext,
@@ -357,6 +730,10 @@ static AggregationClass aggMax = { .createContext = MaxMinCreateContext,
 
 static AggregationClass aggMin = { .createContext = MaxMinCreateContext,
                                    .appendValue = MaxMinAppendValue,
+                                   .appendValues = MaxMinAppendValues,
+                                   .appendSummary = MaxMinAppendSummary,
+                                   .removeValue = MinRemoveValue,
+                                   .loadValue = MaxMinLoadValue,
                                    .freeContext = rm_free,
                                    .finalize = MinFinalize,
                                    .writeContext = MaxMinWriteContext,
@@ -365,6 +742,10 @@ static AggregationClass aggMin = { .createContext = MaxMinCreateContext,
 
 static AggregationClass aggSum = { .createContext = SingleValueCreateContext,
                                    .appendValue = SumAppendValue,
+                                   .appendValues = SumAppendValues,
+                                   .appendSummary = SumAppendSummary,
+                                   .removeValue = SumRemoveValue,
+                                   .loadValue = SingleValueLoadValue,
                                    .freeContext = rm_free,
                                    .finalize = SingleValueFinalize,
                                    .writeContext = SingleValueWriteContext,
@@ -373,6 +754,10 @@ static AggregationClass aggSum = { .createContext = SingleValueCreateContext,
 
 static AggregationClass aggCount = { .createContext = SingleValueCreateContext,
                                      .appendValue = CountAppendValue,
+                                     .appendValues = CountAppendValues,
+                                     .appendSummary = CountAppendSummary,
+                                     .removeValue = CountRemoveValue,
+                                     .loadValue = SingleValueLoadValue,
                                      .freeContext = rm_free,
                                      .finalize = CountFinalize,
                                      .writeContext = SingleValueWriteContext,
@@ -381,6 +766,8 @@ static AggregationClass aggCount = { .createContext = SingleValueCreateContext,
 
 static AggregationClass aggFirst = { .createContext = SingleValueCreateContext,
                                      .appendValue = FirstAppendValue,
+                                     .appendValues = FirstAppendValues,
+                                     .appendSummary = FirstAppendSummary,
                                      .freeContext = rm_free,
                                      .finalize = SingleValueFinalize,
                                      .writeContext = SingleValueWriteContext,
@@ -389,6 +776,8 @@ static AggregationClass aggFirst = { .createContext = SingleValueCreateContext,
 
 static AggregationClass aggLast = { .createContext = SingleValueCreateContext,
                                     .appendValue = LastAppendValue,
+                                    .appendValues = LastAppendValues,
+                                    .appendSummary = LastAppendSummary,
                                     .freeContext = rm_free,
                                     .finalize = SingleValueFinalize,
                                     .writeContext = SingleValueWriteContext,
@@ -397,12 +786,176 @@ static AggregationClass aggLast = { .createContext = SingleValueCreateContext,
 
 static AggregationClass aggRange = { .createContext = MaxMinCreateContext,
                                      .appendValue = MaxMinAppendValue,
+                                     .appendValues = MaxMinAppendValues,
+                                     .appendSummary = MaxMinAppendSummary,
+                                     .removeValue = RangeRemoveValue,
                                      .freeContext = rm_free,
                                      .finalize = RangeFinalize,
                                      .writeContext = MaxMinWriteContext,
                                      .readContext = MaxMinReadContext,
                                      .resetContext = MaxMinReset };
 
+void *CounterCreateContext() {
+    CounterContext *context = (CounterContext *)calloc(1, sizeof(CounterContext));
+    return context;
+}
+
+void CounterInitContext(void *contextPtr, timestamp_t timeBucket, bool reversed) {
+    CounterContext *context = (CounterContext *)contextPtr;
+    context->timeBucket = timeBucket;
+    context->reversed = reversed;
+}
+
+static inline double counterIncrement(double earlier, double later) {
+    return later >= earlier ? later - earlier : later;
+}
+
+void CounterAppendValue(void *contextPtr, double value) {
+    CounterContext *context = (CounterContext *)contextPtr;
+    if (context->cnt == 0) {
+        context->first = value;
+    } else if (context->reversed) {
+        context->increase += counterIncrement(value, context->previous);
+    } else {
+        context->increase += counterIncrement(context->previous, value);
+    }
+    context->previous = value;
+    context->cnt++;
+}
+
+void CounterAppendValues(void *contextPtr, const double *values, size_t count) {
+    CounterContext *context = (CounterContext *)contextPtr;
+    if (count == 0) {
+        return;
+    }
+    CounterAppendValue(context, values[0]);
+    double increase = 0;
+    if (context->reversed) {
+        for (size_t i = 1; i < count; ++i) {
+            increase += counterIncrement(values[i], values[i - 1]);
+        }
+    } else {
+        for (size_t i = 1; i < count; ++i) {
+            increase += counterIncrement(values[i - 1], values[i]);
+        }
+    }
+    context->increase += increase;
+    context->previous = values[count - 1];
+    context->cnt += count - 1;
+}
+
+void CounterSeed(void *contextPtr, double value) {
+    CounterContext *context = (CounterContext *)contextPtr;
+    context->preceding = value;
+    context->hasPreceding = true;
+}
+
+void CounterReset(void *contextPtr) {
+    CounterContext *context = (CounterContext *)contextPtr;
+    // going forward the latest value precedes the next bucket, backward the bucket is seeded
+    if (context->reversed) {
+        context->hasPreceding = false;
+    } else if (context->cnt > 0) {
+        CounterSeed(context, context->previous);
+    }
+    context->first = 0;
+    context->previous = 0;
+    context->increase = 0;
+    context->cnt = 0;
+}
+
+// the increments within the bucket and from the sample preceding it
+static double counterIncrease(const CounterContext *context) {
+    if (!context->hasPreceding) {
+        return context->increase;
+    }
+    double earliest = context->reversed ? context->previous : context->first;
+    return context->increase + counterIncrement(context->preceding, earliest);
+}
+
+int IncreaseFinalize(void *contextPtr, double *value) {
+    CounterContext *context = (CounterContext *)contextPtr;
+    if (context->cnt == 0) {
+        return TSDB_ERROR;
+    }
+    *value = counterIncrease(context);
+    return TSDB_OK;
+}
+
+// the increase per second of the bucket
+int RateFinalize(void *contextPtr, double *value) {
+    CounterContext *context = (CounterContext *)contextPtr;
+    if (context->cnt == 0 || context->timeBucket == 0) {
+        return TSDB_ERROR;
+    }
+    *value = counterIncrease(context) * 1000 / context->timeBucket;
+    return TSDB_OK;
+}
+
+// the change of a gauge, from the earliest to the latest value
+int DeltaFinalize(void *contextPtr, double *value) {
+    CounterContext *context = (CounterContext *)contextPtr;
+    if (context->cnt == 0) {
+        return TSDB_ERROR;
+    }
+    *value = context->reversed ? context->first - context->previous
+                               : context->previous - context->first;
+    return TSDB_OK;
+}
+
+void CounterWriteContext(void *contextPtr, RedisModuleIO *io) {
+    CounterContext *context = (CounterContext *)contextPtr;
+    RedisModule_SaveDouble(io, context->first);
+    RedisModule_SaveDouble(io, context->previous);
+    RedisModule_SaveDouble(io, context->increase);
+    RedisModule_SaveUnsigned(io, context->cnt);
+    RedisModule_SaveDouble(io, context->preceding);
+    RedisModule_SaveUnsigned(io, context->hasPreceding);
+}
+
+void CounterReadContext(void *contextPtr, RedisModuleIO *io) {
+    CounterContext *context = (CounterContext *)contextPtr;
+    context->first = RedisModule_LoadDouble(io);
+    context->previous = RedisModule_LoadDouble(io);
+    context->increase = RedisModule_LoadDouble(io);
+    context->cnt = RedisModule_LoadUnsigned(io);
+    context->preceding = RedisModule_LoadDouble(io);
+    context->hasPreceding = RedisModule_LoadUnsigned(io);
+}
+
+// a chunk summary can't tell the resets within, the counters aggregate the samples
+static AggregationClass aggIncrease = { .createContext = CounterCreateContext,
+                                        .initContext = CounterInitContext,
+                                        .appendValue = CounterAppendValue,
+                                        .appendValues = CounterAppendValues,
+                                        .freeContext = rm_free,
+                                        .finalize = IncreaseFinalize,
+                                        .writeContext = CounterWriteContext,
+                                        .readContext = CounterReadContext,
+                                        .seedContext = CounterSeed,
+                                        .resetContext = CounterReset };
+
+static AggregationClass aggRate = { .createContext = CounterCreateContext,
+                                    .initContext = CounterInitContext,
+                                    .appendValue = CounterAppendValue,
+                                    .appendValues = CounterAppendValues,
+                                    .freeContext = rm_free,
+                                    .finalize = RateFinalize,
+                                    .writeContext = CounterWriteContext,
+                                    .readContext = CounterReadContext,
+                                    .seedContext = CounterSeed,
+                                    .resetContext = CounterReset };
+
+static AggregationClass aggDelta = { .createContext = CounterCreateContext,
+                                     .initContext = CounterInitContext,
+                                     .appendValue = CounterAppendValue,
+                                     .appendValues = CounterAppendValues,
+                                     .freeContext = rm_free,
+                                     .finalize = DeltaFinalize,
+                                     .writeContext = CounterWriteContext,
+                                     .readContext = CounterReadContext,
+                                     .resetContext = CounterReset };
+
 int StringAggTypeToEnum(const char *agg_type) {
     return StringLenAggTypeToEnum(agg_type, strlen(agg_type));
 }
@@ -428,10 +981,20 @@ int StringLenAggTypeToEnum(const char *agg_type, size_t len) {
             result = TS_AGG_SUM;
         } else if (strncmp(agg_type_lower, "avg", len) == 0) {
             result = TS_AGG_AVG;
+        } else if (strncmp(agg_type_lower, "p50", len) == 0) {
+            result = TS_AGG_P50;
+        } else if (strncmp(agg_type_lower, "p90", len) == 0) {
+            result = TS_AGG_P90;
+        } else if (strncmp(agg_type_lower, "p95", len) == 0) {
+            result = TS_AGG_P95;
+        } else if (strncmp(agg_type_lower, "p99", len) == 0) {
+            result = TS_AGG_P99;
         }
     } else if (len == 4) {
         if (strncmp(agg_type_lower, "last", len) == 0) {
             result = TS_AGG_LAST;
+        } else if (strncmp(agg_type_lower, "rate", len) == 0) {
+            result = TS_AGG_RATE;
         }
     } else if (len == 5) {
         if (strncmp(agg_type_lower, "count", len) == 0) {
@@ -448,6 +1011,14 @@ int StringLenAggTypeToEnum(const char *agg_type, size_t len) {
             result = TS_AGG_VAR_P;
         } else if (strncmp(agg_type_lower, "var.s", len) == 0) {
             result = TS_AGG_VAR_S;
+        } else if (strncmp(agg_type_lower, "p99.9", len) == 0) {
+            result = TS_AGG_P999;
+        } else if (strncmp(agg_type_lower, "delta", len) == 0) {
+            result = TS_AGG_DELTA;
+        }
+    } else if (len == 8) {
+        if (strncmp(agg_type_lower, "increase", len) == 0) {
+            result = TS_AGG_INCREASE;
         }
     }
     return result;
@@ -479,6 +1050,22 @@ const char *AggTypeEnumToString(TS_AGG_TYPES_T aggType) {
             return "LAST";
         case TS_AGG_RANGE:
             return "RANGE";
+        case TS_AGG_P50:
+            return "P50";
+        case TS_AGG_P90:
+            return "P90";
+        case TS_AGG_P95:
+            return "P95";
+        case TS_AGG_P99:
+            return "P99";
+        case TS_AGG_P999:
+            return "P99.9";
+        case TS_AGG_INCREASE:
+            return "INCREASE";
+        case TS_AGG_RATE:
+            return "RATE";
+        case TS_AGG_DELTA:
+            return "DELTA";
         case TS_AGG_NONE:
         case TS_AGG_INVALID:
         case TS_AGG_TYPES_MAX:
@@ -513,6 +1100,22 @@ AggregationClass *GetAggClass(TS_AGG_TYPES_T aggType) {
             return &aggLast;
         case TS_AGG_RANGE:
             return &aggRange;
+        case TS_AGG_P50:
+            return &aggP50;
+        case TS_AGG_P90:
+            return &aggP90;
+        case TS_AGG_P95:
+            return &aggP95;
+        case TS_AGG_P99:
+            return &aggP99;
+        case TS_AGG_P999:
+            return &aggP999;
+        case TS_AGG_INCREASE:
+            return &aggIncrease;
+        case TS_AGG_RATE:
+            return &aggRate;
+        case TS_AGG_DELTA:
+            return &aggDelta;
         case TS_AGG_NONE:
         case TS_AGG_INVALID:
         case TS_AGG_TYPES_MAX:
@@ -520,3 +1123,28 @@ AggregationClass *GetAggClass(TS_AGG_TYPES_T aggType) {
     }
     return NULL;
 }
+
+void AggregationAppendValues(AggregationClass *aggClass,
+                             void *context,
+                             const double *values,
+                             size_t count) {
+    if (aggClass->appendValues != NULL) {
+        aggClass->appendValues(context, values, count);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        aggClass->appendValue(context, values[i]);
+    }
+}
+
+bool IsCounterAggType(TS_AGG_TYPES_T aggType) {
+    return aggType == TS_AGG_INCREASE || aggType == TS_AGG_RATE || aggType == TS_AGG_DELTA;
+}
+
+void *AggregationCreateContext(AggregationClass *aggClass, timestamp_t timeBucket, bool reversed) {
+    void *context = aggClass->createContext();
+    if (aggClass->initContext != NULL) {
+        aggClass->initContext(context, timeBucket, reversed);
+    }
+    return context;
+}
@@ -6,8 +6,10 @@
 #ifndef COMPACTION_H
 #define COMPACTION_H
 #include "consts.h"
+#include "generic_chunk.h"
 #include "redismodule.h"
 
+#include <stdbool.h>
 #include <sys/types.h>
 #include <rmutil/util.h>
 
@@ -16,6 +18,25 @@ typedef struct AggregationClass
     void *(*createContext)();
     void (*freeContext)(void *context);
     void (*appendValue)(void *context, double value);
+    // optional, equivalent to calling appendValue for each of values[0..count)
+    void (*appendValues)(void *context, const double *values, size_t count);
+    // optional, appends the samples a non-empty chunk summary stands for, in iteration order
+    void (*appendSummary)(void *context, const ChunkSummary *summary);
+    // optional, undoes an earlier appendValue of `value`. Returns TSDB_ERROR when the result
+    // cannot be told without the other values, e.g. when removing the minimum, leaving the
+    // context to be rebuilt from the samples.
+    int (*removeValue)(void *context, double value);
+    // optional, for the aggregations whose result is their whole state: sets the context to that
+    // of a bucket that finalized to `value`
+    void (*loadValue)(void *context, double value);
+    // optional, for the aggregations depending on the bucket duration or on the order of the
+    // values: called once created, with the bucket duration (ms) and whether the values are
+    // appended from the latest. Kept across resetContext.
+    void (*initContext)(void *context, timestamp_t timeBucket, bool reversed);
+    // optional, for the aggregations depending on the sample preceding the bucket: the value of
+    // the last sample before the earliest one appended. Going forward, resetContext seeds the
+    // next bucket with the latest value of the previous one.
+    void (*seedContext)(void *context, double value);
     void (*resetContext)(void *context);
     void (*writeContext)(void *context, RedisModuleIO *io);
     void (*readContext)(void *context, RedisModuleIO *io);
@@ -23,9 +44,17 @@ typedef struct AggregationClass
 } AggregationClass;
 
 AggregationClass *GetAggClass(TS_AGG_TYPES_T aggType);
+// Counter aggregations can't be reduced across series
+bool IsCounterAggType(TS_AGG_TYPES_T aggType);
+// createContext, followed by initContext when the aggregation has one
+void *AggregationCreateContext(AggregationClass *aggClass, timestamp_t timeBucket, bool reversed);
 int StringAggTypeToEnum(const char *agg_type);
 int RMStringLenAggTypeToEnum(RedisModuleString *aggTypeStr);
 int StringLenAggTypeToEnum(const char *agg_type, size_t len);
 const char *AggTypeEnumToString(TS_AGG_TYPES_T aggType);
+void AggregationAppendValues(AggregationClass *aggClass,
+                             void *context,
+                             const double *values,
+                             size_t count);
 
 #endif
@@ -7,7 +7,11 @@
 #include "compressed_chunk.h"
 
 #include "chunk.h"
+#include "chunk_pool.h"
 #include "generic_chunk.h"
+#include "rdb.h"
+#include "segment_store.h"
+#include "trace.h"
 
 #include <assert.h> // assert
 #include <limits.h>
@@ -15,152 +19,501 @@
 #include <stdlib.h> // malloc
 #include "rmutil/alloc.h"
 
-#define BIT 8
-#define CHUNK_RESIZE_STEP 32
 
 /*********************
  *  Chunk functions  *
  *********************/
-Chunk_t *Compressed_NewChunk(size_t size) {
-    CompressedChunk *chunk = (CompressedChunk *)calloc(1, sizeof(CompressedChunk));
+__extension__ _Static_assert(sizeof(CompressedChunk) <= 160,
+                             "CompressedChunk outgrew its allocation class");
+
+static void initChunk(CompressedChunk *chunk, size_t size) {
+    memset(chunk, 0, sizeof(CompressedChunk));
     chunk->size = size;
-    chunk->data = (u_int64_t *)calloc(chunk->size, sizeof(char));
+    chunk->data = (u_int64_t *)ChunkPool_Calloc(chunk->size);
 #ifdef DEBUG
     memset(chunk->data, 0, chunk->size);
 #endif
     chunk->prevLeading = 32;
     chunk->prevTrailing = 32;
+    chunk->decimals = DECIMALS_UNSET;
+}
+
+Chunk_t *Compressed_NewChunk(size_t size) {
+    CompressedChunk *chunk = (CompressedChunk *)malloc(sizeof(CompressedChunk));
+    initChunk(chunk, size);
+    return chunk;
+}
+
+Chunk_t *Compressed_NewDecimalChunk(size_t size) {
+    CompressedChunk *chunk = Compressed_NewChunk(size);
+    chunk->decimalValues = true;
     return chunk;
 }
 
+// Initializes `newChunk` to encode values like `chunk`
+static void initChunkLike(CompressedChunk *newChunk, CompressedChunk *chunk, size_t size) {
+    initChunk(newChunk, size);
+    newChunk->decimalValues = chunk->decimalValues;
+    newChunk->decimals = chunk->decimals;
+}
+
+// A new chunk encoding values like `chunk`
+static CompressedChunk *newChunkLike(CompressedChunk *chunk, size_t size) {
+    CompressedChunk *newChunk = (CompressedChunk *)malloc(sizeof(CompressedChunk));
+    initChunkLike(newChunk, chunk, size);
+    return newChunk;
+}
+
+static void freeData(CompressedChunk *chunk) {
+    if (chunk->offloaded) {
+        SegmentStore_Release(chunk->data, chunk->size);
+    } else {
+        ChunkPool_Free(chunk->data, chunk->size);
+    }
+}
+
+// The chunk was sized with a CompressedSizeEstimator, appending cannot run out of space
+static void appendSample(CompressedChunk *chunk, const Sample *sample) {
+    ChunkResult res = Compressed_Append(chunk, sample->timestamp, sample->value);
+    assert(res == CR_OK);
+    (void)res;
+}
+
+/*
+ * Encodes the samples of the head in one pass, the head keeping its buffer. Compressed_BufferSample
+ * only takes samples that fit in the chunk at their largest size. The summary already has them.
+ */
+static void flushHead(CompressedChunk *chunk) {
+    CompressedHead *head = chunk->head;
+    if (head == NULL || head->count == 0) {
+        return;
+    }
+    TRACE_PROBE1(head_flush, head->count);
+    size_t appended = Compressed_AppendBlock(chunk, head->samples, head->count);
+    assert(appended == head->count);
+    (void)appended;
+    head->count = 0;
+}
+
+static void freeHead(CompressedChunk *chunk) {
+    flushHead(chunk);
+    free(chunk->head);
+    chunk->head = NULL;
+}
+
+static inline u_int32_t headCount(const CompressedChunk *chunk) {
+    return chunk->head != NULL ? chunk->head->count : 0;
+}
+
 void Compressed_FreeChunk(Chunk_t *chunk) {
     CompressedChunk *cmpChunk = chunk;
-    free(cmpChunk->data);
+    freeData(cmpChunk);
     cmpChunk->data = NULL;
+    free(cmpChunk->checkpoints);
+    cmpChunk->checkpoints = NULL;
+    free(cmpChunk->head);
     free(chunk);
 }
 
-static void swapChunks(CompressedChunk *a, CompressedChunk *b) {
-    CompressedChunk tmp = *a;
-    *a = *b;
-    *b = tmp;
+Chunk_t *Compressed_CloneChunk(Chunk_t *chunk) {
+    CompressedChunk *curChunk = chunk;
+    flushHead(curChunk);
+    CompressedChunk *newChunk = (CompressedChunk *)malloc(sizeof(CompressedChunk));
+    *newChunk = *curChunk;
+    newChunk->head = NULL;
+    newChunk->data = (u_int64_t *)ChunkPool_Alloc(curChunk->size);
+    memcpy(newChunk->data, curChunk->data, curChunk->size);
+    newChunk->offloaded = false;
+    newChunk->checkpoints = NULL;
+    if (curChunk->checkpointsCount > 0) {
+        size_t checkpointsSize = curChunk->checkpointsCount * sizeof(CompressedCheckpoint);
+        newChunk->checkpoints = (CompressedCheckpoint *)malloc(checkpointsSize);
+        memcpy(newChunk->checkpoints, curChunk->checkpoints, checkpointsSize);
+    }
+    return newChunk;
 }
 
-static void ensureAddSample(CompressedChunk *chunk, Sample *sample) {
-    ChunkResult res = Compressed_AddSample(chunk, sample);
-    if (res != CR_OK) {
-        int oldsize = chunk->size;
-        chunk->size += CHUNK_RESIZE_STEP;
-        chunk->data = (u_int64_t *)realloc(chunk->data, chunk->size * sizeof(char));
-        memset((char *)chunk->data + oldsize, 0, CHUNK_RESIZE_STEP);
-        // printf("Chunk extended to %lu \n", chunk->size);
-        res = Compressed_AddSample(chunk, sample);
-        assert(res == CR_OK);
-    }
+/*
+ * Replaces the content of `chunk` with the one of `rebuilt`, built on the stack by the operations
+ * that re-encode a chunk. The chunk keeps its allocation, only the data buffer changes hands, and
+ * that one goes back to the pool for the next rebuild.
+ */
+static void replaceContent(CompressedChunk *chunk, CompressedChunk *rebuilt) {
+    freeData(chunk);
+    free(chunk->checkpoints);
+    // the rebuilds start from a flushed head, which keeps its buffer
+    CompressedHead *head = chunk->head;
+    *chunk = *rebuilt;
+    chunk->head = head;
 }
 
-static void trimChunk(CompressedChunk *chunk) {
-    int excess = (chunk->size * BIT - chunk->idx) / BIT;
+// The checkpoint nearest the middle of the chunk, 0 when none leaves a quarter on each side
+static u_int32_t splitBlock(const CompressedChunk *chunk) {
+    u_int64_t half = chunk->count / 2, quarter = chunk->count / 4;
+    u_int32_t best = 0;
+    u_int64_t bestDistance = UINT64_MAX;
+    for (u_int32_t i = 0; i < chunk->checkpointsCount; ++i) {
+        u_int64_t count = chunk->checkpoints[i].count;
+        u_int64_t distance = count > half ? count - half : half - count;
+        if (count >= quarter && chunk->count - count >= quarter && count < chunk->count &&
+            distance < bestDistance) {
+            best = i + 1;
+            bestDistance = distance;
+        }
+    }
+    return best;
+}
 
-    assert(excess >= 0); // else we have written beyond allocated memory
+// Splits at block `blockId`: its prefix is copied as is, only the second half is re-encoded
+static CompressedChunk *splitAtBlock(CompressedChunk *curChunk, u_int32_t blockId) {
+    CompressedSizeEstimator estimator;
+    Compressed_SizeEstimatorInitFromBlocks(&estimator, curChunk, blockId);
+    CompressedChunk newChunk1;
+    initChunkLike(&newChunk1, curChunk, Compressed_SizeEstimatorBytes(&estimator));
+    Compressed_CopyBlocks(&newChunk1, curChunk, blockId);
 
-    if (excess > 1) {
-        size_t newSize = chunk->size - excess + 1;
-        // align to 8 bytes (u_int64_t) otherwise we will have an heap overflow in gorilla.c because
-        // each write happens in 8 bytes blocks.
-        newSize += sizeof(binary_t) - (newSize % sizeof(binary_t));
-        chunk->data = realloc(chunk->data, newSize);
-        chunk->size = newSize;
+    u_int64_t count = curChunk->count - newChunk1.count;
+    Sample sample;
+    Compressed_Iterator iter = { .chunk = curChunk };
+    Compressed_IteratorSeekBlock(&iter, blockId);
+    Compressed_SizeEstimatorInit(&estimator, curChunk);
+    for (u_int64_t i = 0; i < count; ++i) {
+        Compressed_ChunkIteratorGetNext(&iter, &sample);
+        Compressed_SizeEstimatorAdd(&estimator, sample.timestamp, sample.value);
+    }
+    CompressedChunk *newChunk2 = newChunkLike(curChunk, Compressed_SizeEstimatorBytes(&estimator));
+    Compressed_IteratorSeekBlock(&iter, blockId);
+    for (u_int64_t i = 0; i < count; ++i) {
+        Compressed_ChunkIteratorGetNext(&iter, &sample);
+        appendSample(newChunk2, &sample);
     }
+
+    replaceContent(curChunk, &newChunk1);
+    return newChunk2;
 }
 
 Chunk_t *Compressed_SplitChunk(Chunk_t *chunk) {
     CompressedChunk *curChunk = chunk;
+    // the halves take a head again when appended to
+    freeHead(curChunk);
+    u_int32_t blockId = splitBlock(curChunk);
+    if (blockId > 0) {
+        return splitAtBlock(curChunk, blockId);
+    }
+
+    // the chunks without a checkpoint near their middle are split in the middle
     size_t split = curChunk->count / 2;
     size_t curNumSamples = curChunk->count - split;
 
-    // add samples in new chunks
-    size_t i = 0;
+    // measure both halves first, so that each new chunk is allocated once at its exact size
+    CompressedSizeEstimator estimators[2];
+    Compressed_SizeEstimatorInit(&estimators[0], curChunk);
+    Compressed_SizeEstimatorInit(&estimators[1], curChunk);
     Sample sample;
-    ChunkIter_t *iter = Compressed_NewChunkIterator(curChunk, CHUNK_ITER_OP_NONE, NULL);
-    CompressedChunk *newChunk1 = Compressed_NewChunk(curChunk->size);
-    CompressedChunk *newChunk2 = Compressed_NewChunk(curChunk->size);
-    for (; i < curNumSamples; ++i) {
-        Compressed_ChunkIteratorGetNext(iter, &sample);
-        ensureAddSample(newChunk1, &sample);
-    }
-    for (; i < curChunk->count; ++i) {
-        Compressed_ChunkIteratorGetNext(iter, &sample);
-        ensureAddSample(newChunk2, &sample);
+    Compressed_Iterator iter = { .chunk = curChunk };
+    Compressed_IteratorSeekBlock(&iter, 0);
+    for (size_t i = 0; i < curChunk->count; ++i) {
+        Compressed_ChunkIteratorGetNext(&iter, &sample);
+        Compressed_SizeEstimatorAdd(
+            &estimators[i < curNumSamples ? 0 : 1], sample.timestamp, sample.value);
     }
 
-    trimChunk(newChunk1);
-    trimChunk(newChunk2);
-    swapChunks(curChunk, newChunk1);
+    // add samples in new chunks
+    Compressed_IteratorSeekBlock(&iter, 0);
+    CompressedChunk newChunk1;
+    initChunkLike(&newChunk1, curChunk, Compressed_SizeEstimatorBytes(&estimators[0]));
+    CompressedChunk *newChunk2 =
+        newChunkLike(curChunk, Compressed_SizeEstimatorBytes(&estimators[1]));
+    for (size_t i = 0; i < curChunk->count; ++i) {
+        Compressed_ChunkIteratorGetNext(&iter, &sample);
+        appendSample(i < curNumSamples ? &newChunk1 : newChunk2, &sample);
+    }
 
-    Compressed_FreeChunkIterator(iter);
-    Compressed_FreeChunk(newChunk1);
+    replaceContent(curChunk, &newChunk1);
 
     return newChunk2;
 }
 
-ChunkResult Compressed_UpsertSample(UpsertCtx *uCtx, int *size, DuplicatePolicy duplicatePolicy) {
+// Returns the first block whose last sample is at or after `timestamp`
+static u_int32_t findBlock(CompressedChunk *chunk, timestamp_t timestamp) {
+    u_int32_t lo = 0, hi = chunk->checkpointsCount;
+    while (lo < hi) {
+        u_int32_t mid = lo + (hi - lo) / 2;
+        if (chunk->checkpoints[mid].prevTS < timestamp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Merge `samples` with the samples of `oldChunk` from block `blockId` on. The result goes to
+ * `newChunk`, or when it is NULL, is only measured by `estimator` and `samples` are left as is.
+ * When merging into `newChunk`, `replacedValues` (if not NULL) receives the previous value of
+ * the samples whose timestamp was already present.
+ * Returns the number of samples added, or -1 if the duplicate policy rejected a sample.
+ */
+static int mergeFromBlock(CompressedChunk *oldChunk,
+                          u_int32_t blockId,
+                          PendingSample *samples,
+                          size_t count,
+                          CompressedChunk *newChunk,
+                          CompressedSizeEstimator *estimator,
+                          double *replacedValues) {
+    Compressed_Iterator iter = { .chunk = oldChunk };
+    Compressed_IteratorSeekBlock(&iter, blockId);
+
+    int added = 0;
+    size_t i = 0;
+    Sample iterSample, sample;
+    ChunkResult iterRes = Compressed_ChunkIteratorGetNext(&iter, &iterSample);
+    while (iterRes == CR_OK || i < count) {
+        if (i < count &&
+            (iterRes != CR_OK || samples[i].sample.timestamp <= iterSample.timestamp)) {
+            sample = samples[i].sample;
+            if (iterRes == CR_OK && sample.timestamp == iterSample.timestamp) {
+                if (handleDuplicateSample(samples[i].duplicatePolicy, iterSample, &sample) !=
+                    CR_OK) {
+                    return -1;
+                }
+                if (newChunk != NULL) {
+                    samples[i].sample = sample;
+                    if (replacedValues != NULL) {
+                        replacedValues[i] = iterSample.value;
+                    }
+                }
+                iterRes = Compressed_ChunkIteratorGetNext(&iter, &iterSample);
+                added--; // the sample replaces an existing one
+            }
+            added++;
+            i++;
+        } else {
+            sample = iterSample;
+            iterRes = Compressed_ChunkIteratorGetNext(&iter, &iterSample);
+        }
+
+        if (newChunk != NULL) {
+            appendSample(newChunk, &sample);
+        } else {
+            Compressed_SizeEstimatorAdd(estimator, sample.timestamp, sample.value);
+        }
+    }
+
+    return added;
+}
+
+static ChunkResult mergeSamples(Chunk_t *chunk,
+                                PendingSample *samples,
+                                size_t count,
+                                int *size,
+                                double *replacedValues) {
     *size = 0;
-    ChunkResult rv = CR_OK;
-    ChunkResult nextRes = CR_OK;
-    CompressedChunk *oldChunk = (CompressedChunk *)uCtx->inChunk;
+    if (count == 0) {
+        return CR_OK;
+    }
+    CompressedChunk *oldChunk = chunk;
+    flushHead(oldChunk);
+
+    // blocks that end before the first merged sample are copied as is, the rest is measured
+    // first so the merged chunk is allocated once
+    u_int32_t blockId = findBlock(oldChunk, samples[0].sample.timestamp);
+    CompressedSizeEstimator estimator;
+    Compressed_SizeEstimatorInitFromBlocks(&estimator, oldChunk, blockId);
+    if (mergeFromBlock(oldChunk, blockId, samples, count, NULL, &estimator, NULL) < 0) {
+        return CR_ERR;
+    }
 
-    size_t newSize = oldChunk->size;
+    // keep the room left for appending to the chunk
+    CompressedChunk newChunk;
+    initChunkLike(
+        &newChunk, oldChunk, max(oldChunk->size, Compressed_SizeEstimatorBytes(&estimator)));
+    Compressed_CopyBlocks(&newChunk, oldChunk, blockId);
+    int added =
+        mergeFromBlock(oldChunk, blockId, samples, count, &newChunk, NULL, replacedValues);
+
+    replaceContent(oldChunk, &newChunk);
+    *size = added;
+    return CR_OK;
+}
 
-    CompressedChunk *newChunk = Compressed_NewChunk(newSize);
-    Compressed_Iterator *iter = Compressed_NewChunkIterator(oldChunk, CHUNK_ITER_OP_NONE, NULL);
-    timestamp_t ts = uCtx->sample.timestamp;
-    int numSamples = oldChunk->count;
+ChunkResult Compressed_MergeSamples(Chunk_t *chunk,
+                                    PendingSample *samples,
+                                    size_t count,
+                                    int *size) {
+    return mergeSamples(chunk, samples, count, size, NULL);
+}
 
-    size_t i = 0;
-    Sample iterSample;
-    for (; i < numSamples; ++i) {
-        nextRes = Compressed_ChunkIteratorGetNext(iter, &iterSample);
-        if (iterSample.timestamp >= ts) {
-            break;
-        }
-        ensureAddSample(newChunk, &iterSample);
+ChunkResult Compressed_UpsertSample(UpsertCtx *uCtx, int *size, DuplicatePolicy duplicatePolicy) {
+    PendingSample pending = { .sample = uCtx->sample, .duplicatePolicy = duplicatePolicy };
+    ChunkResult rv = mergeSamples(uCtx->inChunk, &pending, 1, size, &uCtx->replacedValue);
+    uCtx->sample = pending.sample;
+    return rv;
+}
+
+/*
+ * The blocks that end before the range are copied as is, the samples after them are measured and
+ * re-encoded without those within the range.
+ */
+size_t Compressed_DelRange(Chunk_t *chunk, timestamp_t startTs, timestamp_t endTs) {
+    CompressedChunk *oldChunk = chunk;
+    flushHead(oldChunk);
+    if (oldChunk->count == 0 || startTs > oldChunk->prevTimestamp ||
+        endTs < oldChunk->baseTimestamp) {
+        return 0;
     }
 
-    if (ts == iterSample.timestamp) {
-        ChunkResult cr = handleDuplicateSample(duplicatePolicy, iterSample, &uCtx->sample);
-        if (cr != CR_OK) {
-            Compressed_FreeChunkIterator(iter);
-            Compressed_FreeChunk(newChunk);
-            return CR_ERR;
+    u_int32_t blockId = findBlock(oldChunk, startTs);
+    CompressedSizeEstimator estimator;
+    Compressed_SizeEstimatorInitFromBlocks(&estimator, oldChunk, blockId);
+    Compressed_Iterator iter = { .chunk = oldChunk };
+    Compressed_IteratorSeekBlock(&iter, blockId);
+    Sample sample;
+    size_t deleted = 0;
+    while (Compressed_ChunkIteratorGetNext(&iter, &sample) == CR_OK) {
+        if (sample.timestamp >= startTs && sample.timestamp <= endTs) {
+            deleted++;
+        } else {
+            Compressed_SizeEstimatorAdd(&estimator, sample.timestamp, sample.value);
         }
-        nextRes = Compressed_ChunkIteratorGetNext(iter, &iterSample);
-        *size = -1; // we skipped a sample
     }
-    // upsert the sample
-    ensureAddSample(newChunk, &uCtx->sample);
-    *size += 1;
+    if (deleted == 0) {
+        return 0;
+    }
 
-    if (i < numSamples) {
-        while (nextRes == CR_OK) {
-            ensureAddSample(newChunk, &iterSample);
-            nextRes = Compressed_ChunkIteratorGetNext(iter, &iterSample);
+    // keep the room left for appending to the chunk
+    CompressedChunk newChunk;
+    initChunkLike(
+        &newChunk, oldChunk, max(oldChunk->size, Compressed_SizeEstimatorBytes(&estimator)));
+    Compressed_CopyBlocks(&newChunk, oldChunk, blockId);
+    Compressed_IteratorSeekBlock(&iter, blockId);
+    while (Compressed_ChunkIteratorGetNext(&iter, &sample) == CR_OK) {
+        if (sample.timestamp < startTs || sample.timestamp > endTs) {
+            appendSample(&newChunk, &sample);
         }
     }
 
-    swapChunks(newChunk, oldChunk);
+    replaceContent(oldChunk, &newChunk);
+    return deleted;
+}
 
-    Compressed_FreeChunkIterator(iter);
-    Compressed_FreeChunk(newChunk);
-    return rv;
+// Re-encode the values of a decimal chunk with more decimals
+static void setDecimals(CompressedChunk *chunk, u_int8_t decimals) {
+    CompressedSizeEstimator estimator;
+    Compressed_SizeEstimatorInit(&estimator, chunk);
+    estimator.decimals = decimals;
+    Sample sample;
+    Compressed_Iterator iter = { .chunk = chunk };
+    Compressed_IteratorSeekBlock(&iter, 0);
+    while (Compressed_ChunkIteratorGetNext(&iter, &sample) == CR_OK) {
+        Compressed_SizeEstimatorAdd(&estimator, sample.timestamp, sample.value);
+    }
+
+    CompressedChunk newChunk;
+    initChunkLike(&newChunk, chunk, max(chunk->size, Compressed_SizeEstimatorBytes(&estimator)));
+    newChunk.decimals = decimals;
+    Compressed_IteratorSeekBlock(&iter, 0);
+    while (Compressed_ChunkIteratorGetNext(&iter, &sample) == CR_OK) {
+        appendSample(&newChunk, &sample);
+    }
+
+    replaceContent(chunk, &newChunk);
+}
+
+// The bytes of the words holding the samples
+static size_t usedSize(const CompressedChunk *chunk) {
+    return (chunk->idx + 63) / 64 * sizeof(binary_t);
+}
+
+void Compressed_SealChunk(Chunk_t *chunk) {
+    CompressedChunk *cmpChunk = chunk;
+    // chunks are sealed once no longer appended to
+    freeHead(cmpChunk);
+    if (cmpChunk->sealed || cmpChunk->count == 0) {
+        return;
+    }
+    // the checkpoints stay, at 40 bytes per block they spare decoding the chunk to seek or reverse
+    size_t size = usedSize(cmpChunk);
+    cmpChunk->data = ChunkPool_Realloc(cmpChunk->data, cmpChunk->size, size);
+    cmpChunk->size = size;
+    cmpChunk->sealed = true;
+}
+
+void Compressed_OffloadChunk(Chunk_t *chunk) {
+    CompressedChunk *cmpChunk = chunk;
+    Compressed_SealChunk(chunk);
+    if (cmpChunk->offloaded || cmpChunk->count == 0) {
+        return;
+    }
+    u_int64_t *stored = SegmentStore_Append(cmpChunk->data, cmpChunk->size);
+    if (stored != NULL) {
+        ChunkPool_Free(cmpChunk->data, cmpChunk->size);
+        cmpChunk->data = stored;
+        cmpChunk->offloaded = true;
+    }
+}
+
+// Readies the chunk for appending `sample`
+static void prepareAppend(CompressedChunk *cmpChunk, const Sample *sample) {
+    if (cmpChunk->offloaded) {
+        u_int64_t *data = (u_int64_t *)ChunkPool_Alloc(cmpChunk->size);
+        memcpy(data, cmpChunk->data, cmpChunk->size);
+        SegmentStore_Release(cmpChunk->data, cmpChunk->size);
+        cmpChunk->data = data;
+        cmpChunk->offloaded = false;
+    }
+    cmpChunk->sealed = false;
+    if (cmpChunk->decimalValues && cmpChunk->count > 0) {
+        // a sample with more decimals than the chunk has only happens a few times per chunk
+        u_int8_t decimals = Compressed_DecimalsOf(sample->value);
+        if (decimals != DECIMALS_UNSET && decimals > cmpChunk->decimals) {
+            // the head fits at the size of the chunk before it is re-encoded
+            flushHead(cmpChunk);
+            setDecimals(cmpChunk, decimals);
+        }
+    }
+}
+
+void Compressed_FlushChunk(Chunk_t *chunk) {
+    freeHead(chunk);
 }
 
 ChunkResult Compressed_AddSample(Chunk_t *chunk, Sample *sample) {
-    return Compressed_Append((CompressedChunk *)chunk, sample->timestamp, sample->value);
+    CompressedChunk *cmpChunk = chunk;
+    flushHead(cmpChunk);
+    prepareAppend(cmpChunk, sample);
+    return Compressed_Append(cmpChunk, sample->timestamp, sample->value);
+}
+
+ChunkResult Compressed_BufferSample(Chunk_t *chunk, Sample *sample) {
+    CompressedChunk *cmpChunk = chunk;
+    prepareAppend(cmpChunk, sample);
+    u_int32_t count = headCount(cmpChunk);
+    // the first sample sets the base of the chunk, the last ones fill it up exactly
+    if (cmpChunk->count == 0 ||
+        cmpChunk->idx + (count + 1) * HEAD_SAMPLE_MAX_BITS > cmpChunk->size * 8ULL) {
+        ChunkResult res = Compressed_AddSample(chunk, sample);
+        if (res == CR_END) {
+            freeHead(cmpChunk);
+        }
+        return res;
+    }
+
+    if (cmpChunk->head == NULL) {
+        cmpChunk->head = (CompressedHead *)malloc(sizeof(CompressedHead));
+        cmpChunk->head->count = 0;
+    }
+    cmpChunk->head->samples[cmpChunk->head->count++] = *sample;
+    ChunkSummaryAdd(&cmpChunk->summary, sample->value);
+    if (cmpChunk->head->count == HEAD_BLOCK_SAMPLES) {
+        flushHead(cmpChunk);
+    }
+    return CR_OK;
 }
 
 u_int64_t Compressed_ChunkNumOfSample(Chunk_t *chunk) {
-    return ((CompressedChunk *)chunk)->count;
+    return ((CompressedChunk *)chunk)->count + headCount(chunk);
 }
 
 timestamp_t Compressed_GetFirstTimestamp(Chunk_t *chunk) {
@@ -168,28 +521,49 @@ timestamp_t Compressed_GetFirstTimestamp(Chunk_t *chunk) {
 }
 
 timestamp_t Compressed_GetLastTimestamp(Chunk_t *chunk) {
-    return ((CompressedChunk *)chunk)->prevTimestamp;
+    CompressedChunk *cmpChunk = chunk;
+    u_int32_t count = headCount(cmpChunk);
+    return count > 0 ? cmpChunk->head->samples[count - 1].timestamp : cmpChunk->prevTimestamp;
+}
+
+const ChunkSummary *Compressed_GetSummary(Chunk_t *chunk) {
+    CompressedChunk *cmpChunk = chunk;
+    if (cmpChunk->summary.stale) {
+        ChunkSummaryReset(&cmpChunk->summary);
+        Compressed_Iterator iter = { .chunk = cmpChunk };
+        Compressed_IteratorSeekBlock(&iter, 0);
+        timestamp_t ts;
+        double value;
+        while (Compressed_ReadNext(&iter, &ts, &value) == CR_OK) {
+            ChunkSummaryAdd(&cmpChunk->summary, value);
+        }
+        for (u_int32_t i = 0; i < headCount(cmpChunk); ++i) {
+            ChunkSummaryAdd(&cmpChunk->summary, cmpChunk->head->samples[i].value);
+        }
+    }
+    return &cmpChunk->summary;
 }
 
 size_t Compressed_GetChunkSize(Chunk_t *chunk, bool includeStruct) {
     CompressedChunk *cmpChunk = chunk;
     size_t size = cmpChunk->size * sizeof(char);
-    size += includeStruct ? sizeof(*cmpChunk) : 0;
+    if (includeStruct) {
+        // offloaded data takes no memory
+        if (cmpChunk->offloaded) {
+            size = 0;
+        }
+        size += sizeof(*cmpChunk);
+        size += cmpChunk->checkpointsCount * sizeof(CompressedCheckpoint);
+        if (cmpChunk->head != NULL) {
+            size += sizeof(CompressedHead);
+        }
+    }
     return size;
 }
 
-static Chunk *decompressChunk(CompressedChunk *compressedChunk) {
-    Sample sample;
-    uint64_t numSamples = compressedChunk->count;
-    Chunk *uncompressedChunk = Uncompressed_NewChunk(numSamples * SAMPLE_SIZE);
-
-    ChunkIter_t *iter = Compressed_NewChunkIterator(compressedChunk, CHUNK_ITER_OP_NONE, NULL);
-    for (uint64_t i = 0; i < numSamples; ++i) {
-        Compressed_ChunkIteratorGetNext(iter, &sample);
-        Uncompressed_AddSample(uncompressedChunk, &sample);
-    }
-    Compressed_FreeChunkIterator(iter);
-    return uncompressedChunk;
+// The words of the data holding encoded bits, what sealing the chunk shrinks it to
+size_t Compressed_GetChunkUsedSize(Chunk_t *chunk) {
+    return usedSize(chunk);
 }
 
 /************************
@@ -201,66 +575,308 @@ u_int64_t getIterIdx(ChunkIter_t *iter) {
 }
 // LCOV_EXCL_STOP
 
+__extension__ _Static_assert(sizeof(Compressed_Iterator) <= sizeof(ChunkIterStorage),
+                             "ChunkIterStorage is too small for Compressed_Iterator");
+
+// Keeps the block buffer of a previous iterator initialized in `iter`, if any
+static void initChunkIterator(Compressed_Iterator *iter, CompressedChunk *chunk, int options) {
+    Sample *block = iter->block;
+    u_int32_t blockCapacity = iter->blockCapacity;
+    memset(iter, 0, sizeof(*iter));
+    iter->chunk = chunk;
+    iter->block = block;
+    iter->blockCapacity = blockCapacity;
+    iter->headPos = -1;
+    Compressed_IteratorSeekBlock(iter, 0);
+
+    // for reverse iterator of compressed chunks, blocks are decoded lazily from the last one
+    if (options & CHUNK_ITER_OP_REVERSE) {
+        if (iter->block == NULL) {
+            iter->block = (Sample *)malloc(CHECKPOINT_MAX_SAMPLES * sizeof(Sample));
+            iter->blockCapacity = CHECKPOINT_MAX_SAMPLES;
+        }
+        iter->reverse = true;
+        iter->blockId = chunk->checkpointsCount + 1;
+        iter->blockPos = -1;
+        iter->headPos = (int)headCount(chunk) - 1;
+    }
+}
+
 ChunkIter_t *Compressed_NewChunkIterator(Chunk_t *chunk,
                                          int options,
                                          ChunkIterFuncs *retChunkIterClass) {
-    CompressedChunk *compressedChunk = chunk;
-
-    // for reverse iterator of compressed chunks
-    if (options & CHUNK_ITER_OP_REVERSE) {
-        int uncompressed_options = CHUNK_ITER_OP_REVERSE | CHUNK_ITER_OP_FREE_CHUNK;
-        Chunk *uncompressedChunk = decompressChunk(compressedChunk);
-        return Uncompressed_NewChunkIterator(
-            uncompressedChunk, uncompressed_options, retChunkIterClass);
+    Compressed_Iterator *iter = (Compressed_Iterator *)calloc(1, sizeof(Compressed_Iterator));
+    initChunkIterator(iter, chunk, options);
+    if (retChunkIterClass != NULL) {
+        *retChunkIterClass = *GetChunkIteratorClass(CHUNK_COMPRESSED);
     }
+    return (ChunkIter_t *)iter;
+}
 
+ChunkIter_t *Compressed_InitChunkIterator(Chunk_t *chunk,
+                                          int options,
+                                          ChunkIterFuncs *retChunkIterClass,
+                                          ChunkIterStorage *storage) {
+    Compressed_Iterator *iter = (Compressed_Iterator *)storage;
+    initChunkIterator(iter, chunk, options);
     if (retChunkIterClass != NULL) {
         *retChunkIterClass = *GetChunkIteratorClass(CHUNK_COMPRESSED);
-        ;
     }
+    return (ChunkIter_t *)iter;
+}
 
-    Compressed_Iterator *iter = (Compressed_Iterator *)calloc(1, sizeof(Compressed_Iterator));
+// Reads the encoded samples, then the ones of the head
+static inline ChunkResult readNext(Compressed_Iterator *iter,
+                                   timestamp_t *timestamp,
+                                   double *value) {
+    if (Compressed_ReadNext(iter, timestamp, value) == CR_OK) {
+        return CR_OK;
+    }
+    CompressedChunk *chunk = iter->chunk;
+    u_int64_t pos = iter->count - chunk->count;
+    if (pos >= headCount(chunk)) {
+        return CR_END;
+    }
+    *timestamp = chunk->head->samples[pos].timestamp;
+    *value = chunk->head->samples[pos].value;
+    iter->count++;
+    return CR_OK;
+}
 
-    iter->chunk = compressedChunk;
-    iter->idx = 0;
-    iter->count = 0;
+ChunkResult Compressed_ChunkIteratorGetNext(ChunkIter_t *iter, Sample *sample) {
+    return readNext((Compressed_Iterator *)iter, &sample->timestamp, &sample->value);
+}
 
-    iter->prevTS = compressedChunk->baseTimestamp;
-    iter->prevDelta = 0;
+// Decode the whole block into the iterator buffer so it can be served backwards
+static void decodeBlock(Compressed_Iterator *iter, u_int32_t blockId) {
+    TRACE_PROBE1(reverse_decode_start, blockId);
+    Compressed_IteratorSeekBlock(iter, blockId);
+    iter->blockCount = Compressed_BlockNumOfSamples(iter->chunk, blockId);
+    for (int i = 0; i < iter->blockCount; ++i) {
+        Compressed_ReadNext(iter, &iter->block[i].timestamp, &iter->block[i].value);
+    }
+    TRACE_PROBE2(reverse_decode_done, blockId, iter->blockCount);
+    iter->blockId = blockId;
+    iter->blockPos = iter->blockCount - 1;
+}
+
+ChunkResult Compressed_ChunkIteratorGetPrev(ChunkIter_t *iterator, Sample *sample) {
+    Compressed_Iterator *iter = (Compressed_Iterator *)iterator;
+    if (iter->headPos >= 0) {
+        *sample = iter->chunk->head->samples[iter->headPos--];
+        return CR_OK;
+    }
+    while (iter->blockPos < 0) {
+        if (iter->blockId == 0) {
+            return CR_END;
+        }
+        decodeBlock(iter, iter->blockId - 1);
+    }
+    *sample = iter->block[iter->blockPos--];
+    return CR_OK;
+}
 
-    iter->prevValue.d = compressedChunk->baseValue.d;
-    iter->prevLeading = 32;
-    iter->prevTrailing = 32;
+size_t Compressed_ChunkIteratorGetNextBatch(ChunkIter_t *iterator,
+                                            timestamp_t *timestamps,
+                                            double *values,
+                                            size_t max) {
+    Compressed_Iterator *iter = (Compressed_Iterator *)iterator;
+    size_t count = 0;
+    while (count < max && readNext(iter, &timestamps[count], &values[count]) == CR_OK) {
+        count++;
+    }
+    return count;
+}
 
-    return (ChunkIter_t *)iter;
+size_t Compressed_ChunkIteratorGetPrevBatch(ChunkIter_t *iterator,
+                                            timestamp_t *timestamps,
+                                            double *values,
+                                            size_t max) {
+    Compressed_Iterator *iter = (Compressed_Iterator *)iterator;
+    size_t count = 0;
+    for (; count < max && iter->headPos >= 0; count++) {
+        Sample *sample = &iter->chunk->head->samples[iter->headPos--];
+        timestamps[count] = sample->timestamp;
+        values[count] = sample->value;
+    }
+    while (count < max) {
+        if (iter->blockPos < 0) {
+            if (iter->blockId == 0) {
+                break;
+            }
+            decodeBlock(iter, iter->blockId - 1);
+            continue;
+        }
+        Sample *sample = &iter->block[iter->blockPos--];
+        timestamps[count] = sample->timestamp;
+        values[count] = sample->value;
+        count++;
+    }
+    return count;
 }
 
-ChunkResult Compressed_ChunkIteratorGetNext(ChunkIter_t *iter, Sample *sample) {
-    return Compressed_ReadNext((Compressed_Iterator *)iter, &sample->timestamp, &sample->value);
+void Compressed_ChunkIteratorSeek(ChunkIter_t *iterator, timestamp_t timestamp) {
+    Compressed_Iterator *iter = (Compressed_Iterator *)iterator;
+    CompressedChunk *chunk = iter->chunk;
+    u_int32_t count = headCount(chunk);
+    if (count > 0 && timestamp > chunk->prevTimestamp) {
+        // within the head, the encoded samples are all older
+        CompressedHead *head = chunk->head;
+        if (!iter->reverse) {
+            iter->count = chunk->count;
+            while (iter->count - chunk->count < count &&
+                   head->samples[iter->count - chunk->count].timestamp < timestamp) {
+                iter->count++;
+            }
+            return;
+        }
+        while (iter->headPos >= 0 && head->samples[iter->headPos].timestamp > timestamp) {
+            iter->headPos--;
+        }
+        if (iter->headPos >= 0) {
+            return;
+        }
+    }
+    iter->headPos = -1;
+    u_int32_t lo = findBlock(chunk, timestamp);
+
+    if (!iter->reverse) {
+        // forward: every sample in the blocks before `lo` is older than `timestamp`
+        Compressed_IteratorSeekBlock(iter, lo);
+        return;
+    }
+
+    // reverse: if the last block ends before `timestamp`, all samples qualify
+    if (lo == chunk->checkpointsCount && chunk->prevTimestamp < timestamp) {
+        return;
+    }
+    decodeBlock(iter, lo);
+    while (iter->blockPos >= 0 && iter->block[iter->blockPos].timestamp > timestamp) {
+        iter->blockPos--;
+    }
 }
 
 void Compressed_FreeChunkIterator(ChunkIter_t *iter) {
+    Compressed_ReleaseChunkIterator(iter);
     free(iter);
 }
 
+void Compressed_ReleaseChunkIterator(ChunkIter_t *iter) {
+    free(((Compressed_Iterator *)iter)->block);
+    ((Compressed_Iterator *)iter)->block = NULL;
+    ((Compressed_Iterator *)iter)->blockCapacity = 0;
+}
+
+/*
+ * The encoder state of a chunk, saved as one buffer followed by the checkpoints and the data
+ * since TS_PACKED_CHUNKS_VER. Like the data, it is saved in the byte order of the machine.
+ */
+typedef struct CompressedChunkHeader
+{
+    u_int64_t size;
+    u_int64_t count;
+    u_int64_t idx;
+    u_int64_t baseValue;
+    u_int64_t baseTimestamp;
+    u_int64_t prevTimestamp;
+    int64_t prevTimestampDelta;
+    u_int64_t prevValue;
+    u_int64_t prevLeading;
+    u_int64_t prevTrailing;
+    u_int64_t regularCount;
+    u_int64_t decimalValues;
+    u_int64_t decimals;
+    u_int64_t checkpointsCount;
+} CompressedChunkHeader;
+
 void Compressed_SaveToRDB(Chunk_t *chunk, struct RedisModuleIO *io) {
     CompressedChunk *compchunk = chunk;
-
-    RedisModule_SaveUnsigned(io, compchunk->size);
-    RedisModule_SaveUnsigned(io, compchunk->count);
-    RedisModule_SaveUnsigned(io, compchunk->idx);
-    RedisModule_SaveUnsigned(io, compchunk->baseValue.u);
-    RedisModule_SaveUnsigned(io, compchunk->baseTimestamp);
-    RedisModule_SaveUnsigned(io, compchunk->prevTimestamp);
-    RedisModule_SaveSigned(io, compchunk->prevTimestampDelta);
-    RedisModule_SaveUnsigned(io, compchunk->prevValue.u);
-    RedisModule_SaveUnsigned(io, compchunk->prevLeading);
-    RedisModule_SaveUnsigned(io, compchunk->prevTrailing);
+    flushHead(compchunk);
+
+    CompressedChunkHeader header = {
+        .size = compchunk->size,
+        .count = compchunk->count,
+        .idx = compchunk->idx,
+        .baseValue = compchunk->baseValue.u,
+        .baseTimestamp = compchunk->baseTimestamp,
+        .prevTimestamp = compchunk->prevTimestamp,
+        .prevTimestampDelta = compchunk->prevTimestampDelta,
+        .prevValue = compchunk->prevValue.u,
+        .prevLeading = compchunk->prevLeading,
+        .prevTrailing = compchunk->prevTrailing,
+        .regularCount = compchunk->regularCount,
+        .decimalValues = compchunk->decimalValues,
+        .decimals = compchunk->decimals,
+        .checkpointsCount = compchunk->checkpointsCount,
+    };
+    RedisModule_SaveStringBuffer(io, (char *)&header, sizeof(header));
+    RedisModule_SaveStringBuffer(io,
+                                 (char *)compchunk->checkpoints,
+                                 compchunk->checkpointsCount * sizeof(CompressedCheckpoint));
     RedisModule_SaveStringBuffer(io, (char *)compchunk->data, compchunk->size);
 }
 
-void Compressed_LoadFromRDB(Chunk_t **chunk, struct RedisModuleIO *io) {
+static void loadData(CompressedChunk *compchunk, struct RedisModuleIO *io) {
+    size_t len;
+    char *data = RedisModule_LoadStringBuffer(io, &len);
+    compchunk->data = (uint64_t *)ChunkPool_Calloc(compchunk->size);
+    compchunk->offloaded = false;
+    memcpy(compchunk->data, data, min(len, compchunk->size));
+    RedisModule_Free(data);
+}
+
+static void loadPackedChunk(CompressedChunk *compchunk, struct RedisModuleIO *io) {
+    size_t len;
+    CompressedChunkHeader header = { 0 };
+    char *buffer = RedisModule_LoadStringBuffer(io, &len);
+    memcpy(&header, buffer, min(len, sizeof(header)));
+    RedisModule_Free(buffer);
+
+    compchunk->size = header.size;
+    compchunk->count = header.count;
+    compchunk->idx = header.idx;
+    compchunk->baseValue.u = header.baseValue;
+    compchunk->baseTimestamp = header.baseTimestamp;
+    compchunk->prevTimestamp = header.prevTimestamp;
+    compchunk->prevTimestampDelta = header.prevTimestampDelta;
+    compchunk->prevValue.u = header.prevValue;
+    compchunk->prevLeading = header.prevLeading;
+    compchunk->prevTrailing = header.prevTrailing;
+    compchunk->regularCount = header.regularCount;
+    compchunk->decimalValues = header.decimalValues;
+    compchunk->decimals = header.decimals;
+
+    // the checkpoints spare decoding the chunk, the summary is computed when first needed
+    size_t checkpointsSize = header.checkpointsCount * sizeof(CompressedCheckpoint);
+    buffer = RedisModule_LoadStringBuffer(io, &len);
+    compchunk->checkpoints = NULL;
+    compchunk->checkpointsCount = 0;
+    if (len == checkpointsSize && checkpointsSize > 0) {
+        compchunk->checkpoints = (CompressedCheckpoint *)malloc(checkpointsSize);
+        memcpy(compchunk->checkpoints, buffer, checkpointsSize);
+        compchunk->checkpointsCount = header.checkpointsCount;
+    }
+    RedisModule_Free(buffer);
+    ChunkSummaryReset(&compchunk->summary);
+    compchunk->summary.stale = true;
+
+    loadData(compchunk, io);
+    // sealed chunks stay sealed, those saved without their checkpoints get them back
+    if (len != checkpointsSize ||
+        (checkpointsSize == 0 && compchunk->count > CHECKPOINT_MAX_SAMPLES)) {
+        Compressed_BuildCheckpoints(compchunk);
+    }
+    compchunk->sealed = compchunk->count > 0 && compchunk->size == usedSize(compchunk);
+}
+
+void Compressed_LoadFromRDB(Chunk_t **chunk, struct RedisModuleIO *io, int encver) {
     CompressedChunk *compchunk = (CompressedChunk *)malloc(sizeof(*compchunk));
+    compchunk->head = NULL;
+    if (encver >= TS_PACKED_CHUNKS_VER) {
+        loadPackedChunk(compchunk, io);
+        *chunk = (Chunk_t *)compchunk;
+        return;
+    }
 
     compchunk->size = RedisModule_LoadUnsigned(io);
     compchunk->count = RedisModule_LoadUnsigned(io);
@@ -272,7 +888,24 @@ void Compressed_LoadFromRDB(Chunk_t **chunk, struct RedisModuleIO *io) {
     compchunk->prevValue.u = RedisModule_LoadUnsigned(io);
     compchunk->prevLeading = RedisModule_LoadUnsigned(io);
     compchunk->prevTrailing = RedisModule_LoadUnsigned(io);
+    if (encver >= TS_REGULAR_RUN_VER) {
+        compchunk->regularCount = RedisModule_LoadUnsigned(io);
+    } else {
+        // every timestamp past the first was encoded
+        compchunk->regularCount = min(compchunk->count, 2);
+    }
+    if (encver >= TS_DECIMAL_VER) {
+        compchunk->decimalValues = RedisModule_LoadUnsigned(io);
+        compchunk->decimals = RedisModule_LoadUnsigned(io);
+    } else {
+        compchunk->decimalValues = false;
+        compchunk->decimals = DECIMALS_UNSET;
+    }
 
-    compchunk->data = (uint64_t *)RedisModule_LoadStringBuffer(io, NULL);
+    loadData(compchunk, io);
+    compchunk->checkpoints = NULL;
+    compchunk->checkpointsCount = 0;
+    compchunk->sealed = false;
+    Compressed_BuildCheckpoints(compchunk);
     *chunk = (Chunk_t *)compchunk;
 }
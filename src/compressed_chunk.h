@@ -15,29 +15,63 @@
 
 // Initialize compressed chunk
 Chunk_t *Compressed_NewChunk(size_t size);
+// A chunk encoding its values as decimals, see CompressedChunk
+Chunk_t *Compressed_NewDecimalChunk(size_t size);
 void Compressed_FreeChunk(Chunk_t *chunk);
+Chunk_t *Compressed_CloneChunk(Chunk_t *chunk);
 Chunk_t *Compressed_SplitChunk(Chunk_t *chunk);
 
 // Append a sample to a compressed chunk
 ChunkResult Compressed_AddSample(Chunk_t *chunk, Sample *sample);
+// Appends through the head block of the chunk, see CompressedHead
+ChunkResult Compressed_BufferSample(Chunk_t *chunk, Sample *sample);
 ChunkResult Compressed_UpsertSample(UpsertCtx *uCtx, int *size, DuplicatePolicy duplicatePolicy);
+ChunkResult Compressed_MergeSamples(Chunk_t *chunk,
+                                    PendingSample *samples,
+                                    size_t count,
+                                    int *size);
+// Re-encode the chunk without the samples within [startTs, endTs]
+size_t Compressed_DelRange(Chunk_t *chunk, timestamp_t startTs, timestamp_t endTs);
+// Drop the room left for appending, once the chunk is not expected to change
+void Compressed_SealChunk(Chunk_t *chunk);
+// Seal the chunk and move its data to the segment store, if it has room
+void Compressed_OffloadChunk(Chunk_t *chunk);
+// Encodes the head block and frees it
+void Compressed_FlushChunk(Chunk_t *chunk);
 
 // Read from compressed chunk using an iterator
 ChunkIter_t *Compressed_NewChunkIterator(Chunk_t *chunk,
                                          int options,
                                          ChunkIterFuncs *retChunkIterClass);
+ChunkIter_t *Compressed_InitChunkIterator(Chunk_t *chunk,
+                                          int options,
+                                          ChunkIterFuncs *retChunkIterClass,
+                                          ChunkIterStorage *storage);
 ChunkResult Compressed_ChunkIteratorGetNext(ChunkIter_t *iter, Sample *sample);
+ChunkResult Compressed_ChunkIteratorGetPrev(ChunkIter_t *iter, Sample *sample);
+size_t Compressed_ChunkIteratorGetNextBatch(ChunkIter_t *iter,
+                                            timestamp_t *timestamps,
+                                            double *values,
+                                            size_t max);
+size_t Compressed_ChunkIteratorGetPrevBatch(ChunkIter_t *iter,
+                                            timestamp_t *timestamps,
+                                            double *values,
+                                            size_t max);
+void Compressed_ChunkIteratorSeek(ChunkIter_t *iter, timestamp_t timestamp);
 void Compressed_FreeChunkIterator(ChunkIter_t *iter);
+void Compressed_ReleaseChunkIterator(ChunkIter_t *iter);
 
 // Miscellaneous
 size_t Compressed_GetChunkSize(Chunk_t *chunk, bool includeStruct);
+size_t Compressed_GetChunkUsedSize(Chunk_t *chunk);
 u_int64_t Compressed_ChunkNumOfSample(Chunk_t *chunk);
 timestamp_t Compressed_GetFirstTimestamp(Chunk_t *chunk);
+const ChunkSummary *Compressed_GetSummary(Chunk_t *chunk);
 timestamp_t Compressed_GetLastTimestamp(Chunk_t *chunk);
 
 // RDB
 void Compressed_SaveToRDB(Chunk_t *chunk, struct RedisModuleIO *io);
-void Compressed_LoadFromRDB(Chunk_t **chunk, struct RedisModuleIO *io);
+void Compressed_LoadFromRDB(Chunk_t **chunk, struct RedisModuleIO *io, int encver);
 
 /* Used in tests */
 u_int64_t getIterIdx(ChunkIter_t *iter);
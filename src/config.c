@@ -86,6 +86,116 @@ int ReadConfig(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
                     "loaded server DUPLICATE_POLICY: %s \n",
                     DuplicatePolicyToString(TSGlobalConfig.duplicatePolicy));
 
+    TSGlobalConfig.workerThreads = 0;
+    if (argc > 1 && RMUtil_ArgIndex("WORKER_THREADS", argv, argc) >= 0) {
+        if (RMUtil_ParseArgsAfter(
+                "WORKER_THREADS", argv, argc, "l", &TSGlobalConfig.workerThreads) !=
+                REDISMODULE_OK ||
+            TSGlobalConfig.workerThreads < 0) {
+            return TSDB_ERROR;
+        }
+        RedisModule_Log(ctx,
+                        "verbose",
+                        "loaded WORKER_THREADS: %lld \n",
+                        TSGlobalConfig.workerThreads);
+    }
+
+    TSGlobalConfig.asyncCompaction =
+        argc > 0 && RMUtil_ArgIndex("ASYNC_COMPACTION", argv, argc) >= 0;
+    if (TSGlobalConfig.asyncCompaction) {
+        RedisModule_Log(ctx, "verbose", "loaded ASYNC_COMPACTION \n");
+    }
+
+    TSGlobalConfig.coldChunkAge = 0;
+    if (argc > 1 && RMUtil_ArgIndex("COLD_CHUNK_AGE", argv, argc) >= 0) {
+        if (RMUtil_ParseArgsAfter(
+                "COLD_CHUNK_AGE", argv, argc, "l", &TSGlobalConfig.coldChunkAge) !=
+                REDISMODULE_OK ||
+            TSGlobalConfig.coldChunkAge < 0) {
+            return TSDB_ERROR;
+        }
+        RedisModule_Log(ctx,
+                        "verbose",
+                        "loaded COLD_CHUNK_AGE: %lld \n",
+                        TSGlobalConfig.coldChunkAge);
+    }
+
+    TSGlobalConfig.offloadDir = NULL;
+    TSGlobalConfig.offloadAge = 0;
+    if (argc > 1 && RMUtil_ArgIndex("OFFLOAD_DIR", argv, argc) >= 0) {
+        RedisModuleString *offloadDir;
+        if (RMUtil_ParseArgsAfter("OFFLOAD_DIR", argv, argc, "s", &offloadDir) !=
+                REDISMODULE_OK ||
+            RMUtil_ParseArgsAfter(
+                "OFFLOAD_AGE", argv, argc, "l", &TSGlobalConfig.offloadAge) != REDISMODULE_OK ||
+            TSGlobalConfig.offloadAge <= 0) {
+            RedisModule_Log(ctx, "warning", "OFFLOAD_DIR requires a positive OFFLOAD_AGE");
+            return TSDB_ERROR;
+        }
+        TSGlobalConfig.offloadDir = strdup(RedisModule_StringPtrLen(offloadDir, NULL));
+        RedisModule_Log(ctx,
+                        "verbose",
+                        "loaded OFFLOAD_DIR: %s, OFFLOAD_AGE: %lld \n",
+                        TSGlobalConfig.offloadDir,
+                        TSGlobalConfig.offloadAge);
+    }
+
+    TSGlobalConfig.queryCacheSize = 0;
+    if (argc > 1 && RMUtil_ArgIndex("QUERY_CACHE", argv, argc) >= 0) {
+        if (RMUtil_ParseArgsAfter(
+                "QUERY_CACHE", argv, argc, "l", &TSGlobalConfig.queryCacheSize) !=
+                REDISMODULE_OK ||
+            TSGlobalConfig.queryCacheSize < 0) {
+            return TSDB_ERROR;
+        }
+        RedisModule_Log(ctx,
+                        "verbose",
+                        "loaded QUERY_CACHE: %lld \n",
+                        TSGlobalConfig.queryCacheSize);
+    }
+
+    TSGlobalConfig.queryMaxSeries = 0;
+    if (argc > 1 && RMUtil_ArgIndex("QUERY_MAX_SERIES", argv, argc) >= 0) {
+        if (RMUtil_ParseArgsAfter(
+                "QUERY_MAX_SERIES", argv, argc, "l", &TSGlobalConfig.queryMaxSeries) !=
+                REDISMODULE_OK ||
+            TSGlobalConfig.queryMaxSeries < 0) {
+            return TSDB_ERROR;
+        }
+        RedisModule_Log(ctx,
+                        "verbose",
+                        "loaded QUERY_MAX_SERIES: %lld \n",
+                        TSGlobalConfig.queryMaxSeries);
+    }
+
+    TSGlobalConfig.queryMaxSamples = 0;
+    if (argc > 1 && RMUtil_ArgIndex("QUERY_MAX_SAMPLES", argv, argc) >= 0) {
+        if (RMUtil_ParseArgsAfter(
+                "QUERY_MAX_SAMPLES", argv, argc, "l", &TSGlobalConfig.queryMaxSamples) !=
+                REDISMODULE_OK ||
+            TSGlobalConfig.queryMaxSamples < 0) {
+            return TSDB_ERROR;
+        }
+        RedisModule_Log(ctx,
+                        "verbose",
+                        "loaded QUERY_MAX_SAMPLES: %lld \n",
+                        TSGlobalConfig.queryMaxSamples);
+    }
+
+    TSGlobalConfig.queryTimeout = 0;
+    if (argc > 1 && RMUtil_ArgIndex("QUERY_TIMEOUT", argv, argc) >= 0) {
+        if (RMUtil_ParseArgsAfter(
+                "QUERY_TIMEOUT", argv, argc, "l", &TSGlobalConfig.queryTimeout) !=
+                REDISMODULE_OK ||
+            TSGlobalConfig.queryTimeout < 0) {
+            return TSDB_ERROR;
+        }
+        RedisModule_Log(ctx,
+                        "verbose",
+                        "loaded QUERY_TIMEOUT: %lld \n",
+                        TSGlobalConfig.queryTimeout);
+    }
+
     if (argc > 1 && RMUtil_ArgIndex("CHUNK_TYPE", argv, argc) >= 0) {
         RedisModuleString *chunk_type;
         size_t len;
@@ -180,3 +290,25 @@ void RTS_GetRedisVersion() {
     RedisModule_FreeCallReply(reply);
     RedisModule_FreeThreadSafeContext(ctx);
 }
+
+bool RTS_IsSingleDatabase(RedisModuleCtx *ctx) {
+    if (RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_CLUSTER) {
+        return true;
+    }
+
+    RedisModuleCallReply *reply = RedisModule_Call(ctx, "config", "cc", "get", "databases");
+    bool single = false;
+    if (reply != NULL && RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_ARRAY &&
+        RedisModule_CallReplyLength(reply) == 2) {
+        long long databases;
+        RedisModuleString *value =
+            RedisModule_CreateStringFromCallReply(RedisModule_CallReplyArrayElement(reply, 1));
+        single = RedisModule_StringToLongLong(value, &databases) == REDISMODULE_OK &&
+                 databases == 1;
+        RedisModule_FreeString(ctx, value);
+    }
+    if (reply != NULL) {
+        RedisModule_FreeCallReply(reply);
+    }
+    return single;
+}
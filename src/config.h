@@ -20,6 +20,15 @@ typedef struct
     short options;
     int hasGlobalConfig;
     DuplicatePolicy duplicatePolicy;
+    long long workerThreads;  // 0 runs every query on the main thread
+    bool asyncCompaction;     // closed buckets are written to the destinations by a timer
+    long long coldChunkAge;   // chunks this much older than the last sample are sealed, 0 never
+    char *offloadDir;         // where the segment files are created, NULL keeps chunks in memory
+    long long offloadAge;     // chunks this much older than the last sample are offloaded
+    long long queryCacheSize; // TS.MRANGE and TS.MGET replies kept by the query cache, 0 none
+    long long queryMaxSeries;  // series a TS.MRANGE page may read, 0 unlimited
+    long long queryMaxSamples; // samples a range query may decode, 0 unlimited
+    long long queryTimeout;    // milliseconds a TS.MRANGE may run, 0 unlimited
 } TSConfig;
 
 extern TSConfig TSGlobalConfig;
@@ -47,4 +56,6 @@ static inline int RTS_IsEnterprise() {
 
 int RTS_CheckSupportedVestion();
 void RTS_GetRedisVersion();
+// Whether a key name identifies a single key: a cluster node or a server with one database
+bool RTS_IsSingleDatabase(RedisModuleCtx *ctx);
 #endif
@@ -27,6 +27,14 @@
 #define Chunk_SIZE_BYTES_SECS           4096LL   // fills one page 4096
 #define SPLIT_FACTOR                    1.2
 #define DEFAULT_DUPLICATE_POLICY        DP_BLOCK
+#define PENDING_SAMPLES_MAX             128      // out of order samples buffered per series
+#define CHUNK_SIZE_MAX_BYTES            (1024 * 1024)
+
+/* CHUNK_SIZE ADAPTIVE: each new chunk is sized to hold about ADAPTIVE_CHUNK_TARGET_SPAN_MS of
+ * samples at the rate and compression of the previous one */
+#define ADAPTIVE_CHUNK_TARGET_SPAN_MS   (60 * 60 * 1000LL)
+#define ADAPTIVE_CHUNK_MIN_BYTES        128
+#define ADAPTIVE_CHUNK_MAX_BYTES        (64 * 1024)
 
 /* TS.Range Aggregation types */
 typedef enum {
@@ -44,7 +52,15 @@ typedef enum {
     TS_AGG_STD_S,
     TS_AGG_VAR_P,
     TS_AGG_VAR_S,
-    TS_AGG_TYPES_MAX // 13
+    TS_AGG_P50,
+    TS_AGG_P90,
+    TS_AGG_P95,
+    TS_AGG_P99,
+    TS_AGG_P999,
+    TS_AGG_INCREASE,
+    TS_AGG_RATE,
+    TS_AGG_DELTA,
+    TS_AGG_TYPES_MAX // 21
 } TS_AGG_TYPES_T;
 
 
@@ -61,6 +77,8 @@ typedef enum DuplicatePolicy {
 
 /* Series struct options */
 #define SERIES_OPT_UNCOMPRESSED 0x1
+#define SERIES_OPT_DECIMAL 0x2
+#define SERIES_OPT_ADAPTIVE_CHUNK_SIZE 0x4
 
 /* Chunk enum */
 typedef enum {
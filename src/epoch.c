@@ -0,0 +1,114 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "rmutil/alloc.h"
+
+typedef struct RetiredPtr
+{
+    void *ptr;
+    void (*reclaim)(void *ptr);
+    u_int64_t epoch; // the readers entered at or before it may see it
+} RetiredPtr;
+
+static struct
+{
+    pthread_mutex_t lock;
+    u_int64_t current; // epoch 0 is never pinned
+    // the readers in the order they entered, the first one pinned the oldest epoch
+    EpochGuard *first;
+    EpochGuard *last;
+    u_int64_t oldestPinned; // UINT64_MAX without readers, read without the lock
+    // in the order they were retired
+    RetiredPtr *retired;
+    size_t retiredCount;
+    size_t retiredCapacity;
+} epochs = { .lock = PTHREAD_MUTEX_INITIALIZER, .current = 1, .oldestPinned = UINT64_MAX };
+
+static void updateOldestPinned() {
+    u_int64_t oldest = epochs.first != NULL ? epochs.first->epoch : UINT64_MAX;
+    __atomic_store_n(&epochs.oldestPinned, oldest, __ATOMIC_RELEASE);
+}
+
+void Epoch_Enter(EpochGuard *guard) {
+    pthread_mutex_lock(&epochs.lock);
+    guard->epoch = epochs.current;
+    guard->prev = epochs.last;
+    guard->next = NULL;
+    if (epochs.last != NULL) {
+        epochs.last->next = guard;
+    } else {
+        epochs.first = guard;
+    }
+    epochs.last = guard;
+    updateOldestPinned();
+    pthread_mutex_unlock(&epochs.lock);
+}
+
+void Epoch_Exit(EpochGuard *guard) {
+    pthread_mutex_lock(&epochs.lock);
+    if (guard->prev != NULL) {
+        guard->prev->next = guard->next;
+    } else {
+        epochs.first = guard->next;
+    }
+    if (guard->next != NULL) {
+        guard->next->prev = guard->prev;
+    } else {
+        epochs.last = guard->prev;
+    }
+    updateOldestPinned();
+
+    // the pointers retired before the oldest epoch pinned are freed out of the lock
+    size_t count = 0;
+    while (count < epochs.retiredCount && epochs.retired[count].epoch < epochs.oldestPinned) {
+        count++;
+    }
+    RetiredPtr *reclaimed = NULL;
+    if (count > 0) {
+        reclaimed = malloc(count * sizeof(RetiredPtr));
+        memcpy(reclaimed, epochs.retired, count * sizeof(RetiredPtr));
+        epochs.retiredCount -= count;
+        memmove(epochs.retired, epochs.retired + count, epochs.retiredCount * sizeof(RetiredPtr));
+    }
+    pthread_mutex_unlock(&epochs.lock);
+
+    for (size_t i = 0; i < count; i++) {
+        reclaimed[i].reclaim(reclaimed[i].ptr);
+    }
+    free(reclaimed);
+}
+
+bool Epoch_Pinned(u_int64_t epoch) {
+    return epoch >= __atomic_load_n(&epochs.oldestPinned, __ATOMIC_ACQUIRE);
+}
+
+void Epoch_Retire(void *ptr, void (*reclaim)(void *ptr)) {
+    pthread_mutex_lock(&epochs.lock);
+    if (epochs.first == NULL) {
+        pthread_mutex_unlock(&epochs.lock);
+        reclaim(ptr);
+        return;
+    }
+    if (epochs.retiredCount == epochs.retiredCapacity) {
+        epochs.retiredCapacity = epochs.retiredCapacity > 0 ? epochs.retiredCapacity * 2 : 64;
+        epochs.retired = realloc(epochs.retired, epochs.retiredCapacity * sizeof(RetiredPtr));
+    }
+    // the readers entering from now on can't see it
+    epochs.retired[epochs.retiredCount++] =
+        (RetiredPtr){ .ptr = ptr, .reclaim = reclaim, .epoch = epochs.current++ };
+    pthread_mutex_unlock(&epochs.lock);
+}
+
+size_t Epoch_RetiredCount() {
+    pthread_mutex_lock(&epochs.lock);
+    size_t count = epochs.retiredCount;
+    pthread_mutex_unlock(&epochs.lock);
+    return count;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Epoch based reclamation of the chunks that snapshots share with their series, see SeriesSnapshot.
+ * A reader enters an epoch before taking its snapshots under the GIL, and exits it once it is done
+ * reading them without the GIL. Meanwhile the writers change copies of the shared chunks and
+ * retire the chunks they replace or remove: a chunk retired is freed once every reader that
+ * entered before it was retired exited. The functions are thread safe.
+ */
+typedef struct EpochGuard
+{
+    u_int64_t epoch;
+    struct EpochGuard *prev;
+    struct EpochGuard *next;
+} EpochGuard;
+
+void Epoch_Enter(EpochGuard *guard);
+// Frees the chunks retired that no reader can see anymore
+void Epoch_Exit(EpochGuard *guard);
+// Whether a reader that entered at `epoch` or before hasn't exited yet
+bool Epoch_Pinned(u_int64_t epoch);
+// Frees `ptr` with `reclaim` once the readers entered so far exited, right away without readers
+void Epoch_Retire(void *ptr, void (*reclaim)(void *ptr));
+// Retired and not freed yet
+size_t Epoch_RetiredCount();
+
+#endif
@@ -9,17 +9,23 @@
 static ChunkFuncs regChunk = {
     .NewChunk = Uncompressed_NewChunk,
     .FreeChunk = Uncompressed_FreeChunk,
+    .CloneChunk = Uncompressed_CloneChunk,
     .SplitChunk = Uncompressed_SplitChunk,
 
     .AddSample = Uncompressed_AddSample,
     .UpsertSample = Uncompressed_UpsertSample,
+    .DelRange = Uncompressed_DelRange,
+    .SealChunk = Uncompressed_SealChunk,
 
     .NewChunkIterator = Uncompressed_NewChunkIterator,
+    .InitChunkIterator = Uncompressed_InitChunkIterator,
 
     .GetChunkSize = Uncompressed_GetChunkSize,
+    .GetChunkUsedSize = Uncompressed_GetChunkUsedSize,
     .GetNumOfSample = Uncompressed_NumOfSample,
     .GetLastTimestamp = Uncompressed_GetLastTimestamp,
     .GetFirstTimestamp = Uncompressed_GetFirstTimestamp,
+    .GetSummary = Uncompressed_GetSummary,
 
     .SaveToRDB = Uncompressed_SaveToRDB,
     .LoadFromRDB = Uncompressed_LoadFromRDB,
@@ -27,24 +33,65 @@ static ChunkFuncs regChunk = {
 
 ChunkIterFuncs uncompressedChunkIteratorClass = {
     .Free = Uncompressed_FreeChunkIterator,
+    .Release = Uncompressed_ReleaseChunkIterator,
     .GetNext = Uncompressed_ChunkIteratorGetNext,
     .GetPrev = Uncompressed_ChunkIteratorGetPrev,
+    .GetNextBatch = Uncompressed_ChunkIteratorGetNextBatch,
+    .GetPrevBatch = Uncompressed_ChunkIteratorGetPrevBatch,
+    .Seek = Uncompressed_ChunkIteratorSeek,
 };
 
 static ChunkFuncs comprChunk = {
     .NewChunk = Compressed_NewChunk,
     .FreeChunk = Compressed_FreeChunk,
+    .CloneChunk = Compressed_CloneChunk,
     .SplitChunk = Compressed_SplitChunk,
 
-    .AddSample = Compressed_AddSample,
+    .AddSample = Compressed_BufferSample,
     .UpsertSample = Compressed_UpsertSample,
+    .MergeSamples = Compressed_MergeSamples,
+    .DelRange = Compressed_DelRange,
+    .SealChunk = Compressed_SealChunk,
+    .OffloadChunk = Compressed_OffloadChunk,
+    .FlushChunk = Compressed_FlushChunk,
 
     .NewChunkIterator = Compressed_NewChunkIterator,
+    .InitChunkIterator = Compressed_InitChunkIterator,
 
     .GetChunkSize = Compressed_GetChunkSize,
+    .GetChunkUsedSize = Compressed_GetChunkUsedSize,
     .GetNumOfSample = Compressed_ChunkNumOfSample,
     .GetLastTimestamp = Compressed_GetLastTimestamp,
     .GetFirstTimestamp = Compressed_GetFirstTimestamp,
+    .GetSummary = Compressed_GetSummary,
+
+    .SaveToRDB = Compressed_SaveToRDB,
+    .LoadFromRDB = Compressed_LoadFromRDB,
+};
+
+static ChunkFuncs decimalChunk = {
+    .NewChunk = Compressed_NewDecimalChunk,
+    .FreeChunk = Compressed_FreeChunk,
+    .CloneChunk = Compressed_CloneChunk,
+    .SplitChunk = Compressed_SplitChunk,
+
+    .AddSample = Compressed_BufferSample,
+    .UpsertSample = Compressed_UpsertSample,
+    .MergeSamples = Compressed_MergeSamples,
+    .DelRange = Compressed_DelRange,
+    .SealChunk = Compressed_SealChunk,
+    .OffloadChunk = Compressed_OffloadChunk,
+    .FlushChunk = Compressed_FlushChunk,
+
+    .NewChunkIterator = Compressed_NewChunkIterator,
+    .InitChunkIterator = Compressed_InitChunkIterator,
+
+    .GetChunkSize = Compressed_GetChunkSize,
+    .GetChunkUsedSize = Compressed_GetChunkUsedSize,
+    .GetNumOfSample = Compressed_ChunkNumOfSample,
+    .GetLastTimestamp = Compressed_GetLastTimestamp,
+    .GetFirstTimestamp = Compressed_GetFirstTimestamp,
+    .GetSummary = Compressed_GetSummary,
 
     .SaveToRDB = Compressed_SaveToRDB,
     .LoadFromRDB = Compressed_LoadFromRDB,
@@ -52,11 +99,35 @@ static ChunkFuncs comprChunk = {
 
 static ChunkIterFuncs compressedChunkIteratorClass = {
     .Free = Compressed_FreeChunkIterator,
+    .Release = Compressed_ReleaseChunkIterator,
     .GetNext = Compressed_ChunkIteratorGetNext,
-    /*** Reverse iteration is on temporary decompressed chunk ***/
-    .GetPrev = NULL,
+    .GetPrev = Compressed_ChunkIteratorGetPrev,
+    .GetNextBatch = Compressed_ChunkIteratorGetNextBatch,
+    .GetPrevBatch = Compressed_ChunkIteratorGetPrevBatch,
+    .Seek = Compressed_ChunkIteratorSeek,
 };
 
+void ChunkSummaryReset(ChunkSummary *summary) {
+    *summary = (ChunkSummary){ 0 };
+}
+
+void ChunkSummaryAdd(ChunkSummary *summary, double value) {
+    if (summary->count == 0) {
+        summary->min = summary->max = summary->first = value;
+    } else {
+        if (value < summary->min) {
+            summary->min = value;
+        }
+        if (value > summary->max) {
+            summary->max = value;
+        }
+    }
+    summary->last = value;
+    summary->sum += value;
+    summary->sumsq += value * value;
+    summary->count++;
+}
+
 // This function will decide according to the policy how to handle duplicate sample, the `newSample`
 // will contain the data that will be kept in the database.
 ChunkResult handleDuplicateSample(DuplicatePolicy policy, Sample oldSample, Sample *newSample) {
@@ -90,6 +161,8 @@ ChunkFuncs *GetChunkClass(CHUNK_TYPES_T chunkType) {
             return &regChunk;
         case CHUNK_COMPRESSED:
             return &comprChunk;
+        case CHUNK_DECIMAL:
+            return &decimalChunk;
     }
     return NULL;
 }
@@ -99,6 +172,7 @@ ChunkIterFuncs *GetChunkIteratorClass(CHUNK_TYPES_T chunkType) {
         case CHUNK_REGULAR:
             return &uncompressedChunkIteratorClass;
         case CHUNK_COMPRESSED:
+        case CHUNK_DECIMAL:
             return &compressedChunkIteratorClass;
     }
     return NULL;
@@ -26,54 +26,118 @@ typedef struct Sample
 typedef void Chunk_t;
 typedef void ChunkIter_t;
 
+// Room for the iterator of any chunk class, to embed iterators in other structs
+#define CHUNK_ITER_STORAGE_SIZE 96
+typedef union ChunkIterStorage
+{
+    char bytes[CHUNK_ITER_STORAGE_SIZE];
+    u_int64_t alignment;
+    void *pointer;
+} ChunkIterStorage;
+
 #define CHUNK_ITER_OP_NONE 0
 #define CHUNK_ITER_OP_REVERSE 1
-// This is supported *only* by uncompressed chunk, this is used when we reverse read a compressed
-// chunk by uncompressing it into a *un*compressed chunk and returning a reverse iterator on that
-// "temporary" uncompressed chunk.
-#define CHUNK_ITER_OP_FREE_CHUNK 1 << 2
 
 typedef enum
 {
     CHUNK_REGULAR,
-    CHUNK_COMPRESSED
+    CHUNK_COMPRESSED,
+    CHUNK_DECIMAL // compressed chunks with decimal values
 } CHUNK_TYPES_T;
 
+// A sample waiting to be merged into a chunk, with the policy to apply if its timestamp is
+// already present there
+typedef struct PendingSample
+{
+    Sample sample;
+    DuplicatePolicy duplicatePolicy;
+} PendingSample;
+
+// Aggregates over all the samples of a chunk, `first` and `last` in timestamp order.
+// A stale summary is recomputed from the samples the next time it is requested.
+typedef struct ChunkSummary
+{
+    u_int64_t count;
+    double min;
+    double max;
+    double sum;
+    double sumsq; // sum of (values^2)
+    double first;
+    double last;
+    bool stale;
+} ChunkSummary;
+
 typedef struct UpsertCtx
 {
     Sample sample;
-    Chunk_t *inChunk; // original chunk
+    Chunk_t *inChunk;     // original chunk
+    double replacedValue; // on success with no sample added, the value the sample replaced
 } UpsertCtx;
 
 typedef struct ChunkIterFuncs
 {
     void (*Free)(ChunkIter_t *iter);
+    // Releases an iterator initialized in place, leaving its storage to the caller
+    void (*Release)(ChunkIter_t *iter);
     ChunkResult (*GetNext)(ChunkIter_t *iter, Sample *sample);
     ChunkResult (*GetPrev)(ChunkIter_t *iter, Sample *sample);
+    // Decode up to `max` samples at once, returns the number of samples read, 0 at the end
+    size_t (*GetNextBatch)(ChunkIter_t *iter, timestamp_t *timestamps, double *values, size_t max);
+    size_t (*GetPrevBatch)(ChunkIter_t *iter, timestamp_t *timestamps, double *values, size_t max);
+    // Skip ahead, in iteration order, to the neighbourhood of `timestamp`. No sample at or past
+    // `timestamp` is skipped, yet some samples before it may still be returned.
+    void (*Seek)(ChunkIter_t *iter, timestamp_t timestamp);
 } ChunkIterFuncs;
 
 typedef struct ChunkFuncs
 {
     Chunk_t *(*NewChunk)(size_t sampleCount);
     void (*FreeChunk)(Chunk_t *chunk);
+    Chunk_t *(*CloneChunk)(Chunk_t *chunk);
     Chunk_t *(*SplitChunk)(Chunk_t *chunk);
 
     ChunkResult (*AddSample)(Chunk_t *chunk, Sample *sample);
     ChunkResult (*UpsertSample)(UpsertCtx *uCtx, int *size, DuplicatePolicy duplicatePolicy);
+    // Optional. Merges `count` samples sorted by unique timestamps into the chunk in one pass.
+    // On success the samples hold the values that were stored.
+    ChunkResult (*MergeSamples)(Chunk_t *chunk, PendingSample *samples, size_t count, int *size);
+    // Removes the samples within [startTs, endTs] in one pass, returns the number removed
+    size_t (*DelRange)(Chunk_t *chunk, timestamp_t startTs, timestamp_t endTs);
+    // Frees what only serves writing to the chunk, once it is old enough not to change. The chunk
+    // remains writable.
+    void (*SealChunk)(Chunk_t *chunk);
+    // Optional. Seals the chunk and moves its samples out of memory, see segment_store.h.
+    void (*OffloadChunk)(Chunk_t *chunk);
+    // Optional. Stores the samples buffered for appending, once they go to a newer chunk.
+    void (*FlushChunk)(Chunk_t *chunk);
 
     ChunkIter_t *(*NewChunkIterator)(Chunk_t *chunk,
                                      int options,
                                      ChunkIterFuncs *retChunkIterClass);
+    // Like NewChunkIterator, without allocating the iterator. `storage` is either zeroed or holds
+    // an iterator of the same class, initialized before and not released, whose buffers are
+    // reused. Release the last iterator initialized in `storage` when done.
+    ChunkIter_t *(*InitChunkIterator)(Chunk_t *chunk,
+                                      int options,
+                                      ChunkIterFuncs *retChunkIterClass,
+                                      ChunkIterStorage *storage);
 
     size_t (*GetChunkSize)(Chunk_t *chunk, bool includeStruct);
+    // The bytes of the data of GetChunkSize that hold the samples
+    size_t (*GetChunkUsedSize)(Chunk_t *chunk);
     u_int64_t (*GetNumOfSample)(Chunk_t *chunk);
     u_int64_t (*GetLastTimestamp)(Chunk_t *chunk);
     u_int64_t (*GetFirstTimestamp)(Chunk_t *chunk);
+    const ChunkSummary *(*GetSummary)(Chunk_t *chunk);
 
     void (*SaveToRDB)(Chunk_t *chunk, struct RedisModuleIO *io);
-    void (*LoadFromRDB)(Chunk_t **chunk, struct RedisModuleIO *io);
+    void (*LoadFromRDB)(Chunk_t **chunk, struct RedisModuleIO *io, int encver);
 } ChunkFuncs;
 
+void ChunkSummaryReset(ChunkSummary *summary);
+// Account for `value` as the new last sample of the chunk
+void ChunkSummaryAdd(ChunkSummary *summary, double value);
+
 ChunkResult handleDuplicateSample(DuplicatePolicy policy, Sample oldSample, Sample *newSample);
 const char *DuplicatePolicyToString(DuplicatePolicy policy);
 int RMStringLenDuplicationPolicyToEnum(RedisModuleString *aggTypeStr);
@@ -86,11 +86,23 @@
  * 0x0024b33333333333 01011 * 0x0024b33333333333 *  0 * 10 * 1 * 1 *  18.7 * 5.5 *
  *********************************************************************************
  * t=trailing, l=leading, p=use of previous params, 0=xor equal zero
+ *
+ *********************************************************************************
+ * Compression of decimal values
+ *
+ * Decimal chunks scale the values by 10^decimals. When the result is an integer
+ * that divides back to the exact value, its delta from the scaled previous value
+ * is written in the buckets of the timestamps, 0 standing for a repeated value.
+ * Otherwise, the six bits of the largest bucket are followed by the 64 bits of
+ * the double itself.
  */
 
 #include "gorilla.h"
 
 #include <assert.h>
+#include <math.h>
+#include <string.h>
+#include "rmutil/alloc.h"
 
 #define BIN_NUM_VALUES 64
 #define BINW BIN_NUM_VALUES
@@ -164,6 +176,7 @@ static binary_t int2bin(int64_t x, u_int8_t l) {
     return bin;
 }
 
+#ifdef GORILLA_BITWISE_DECODE
 // Converts `bin`, a binary of length `l` bits, into an int64
 static int64_t bin2int(binary_t bin, u_int8_t l) {
     bool pos = !(bin & BIT(l - 1));
@@ -172,6 +185,7 @@ static int64_t bin2int(binary_t bin, u_int8_t l) {
     // return (int64_t) (bin | ~MASK(l)); // sign extend `bin`
     return (int64_t)bin - BIT(l); // same but cheaper
 }
+#endif
 
 // note that return value is a signed int
 static inline int64_t Bin_MaxVal(u_int8_t nbits) {
@@ -223,6 +237,7 @@ static void appendBits(binary_t *bins, globalbit_t *bit, binary_t data, u_int8_t
     *bit += dataLen;
 }
 
+#ifdef GORILLA_BITWISE_DECODE
 // Read `dataLen` bits from `bins` at position `bit`
 static binary_t readBits(binary_t *bins, globalbit_t *bit, u_int8_t dataLen) {
     binary_t *bin_it = Bins_bitbin(bins, *bit);
@@ -240,12 +255,96 @@ static binary_t readBits(binary_t *bins, globalbit_t *bit, u_int8_t dataLen) {
     *bit += dataLen;
     return bin;
 }
+#endif
 
 static bool isSpaceAvailable(CompressedChunk *chunk, u_int8_t size) {
     u_int64_t available = (chunk->size * 8) - chunk->idx;
     return size <= available;
 }
 
+/***************************** DECIMALS ********************************/
+static const double decimalScales[DECIMALS_MAX + 1] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+
+// Scaled values stay below 2^50 so that scaling the decoded value back gives the same integer
+#define DECIMAL_SCALED_MAX 1125899906842624.0
+
+// Sets `scaled` to value * 10^decimals when that integer decodes to exactly `value`
+static bool toScaled(double value, u_int8_t decimals, int64_t *scaled) {
+    double x = value * decimalScales[decimals];
+    if (!(fabs(x) < DECIMAL_SCALED_MAX)) { // also rules out NaN
+        return false;
+    }
+    union64bits decoded, original = { .d = value };
+    int64_t rounded = llround(x);
+    decoded.d = (double)rounded / decimalScales[decimals];
+    if (decoded.u != original.u) { // -0.0 does not round trip either
+        return false;
+    }
+    *scaled = rounded;
+    return true;
+}
+
+// The scaled integer deltas are taken from, 0 after a value stored as is
+static int64_t scaledBase(double prevValue, u_int8_t decimals) {
+    int64_t scaled;
+    return toScaled(prevValue, decimals, &scaled) ? scaled : 0;
+}
+
+u_int8_t Compressed_DecimalsOf(double value) {
+    int64_t scaled;
+    for (u_int8_t decimals = 0; decimals <= DECIMALS_MAX; ++decimals) {
+        if (toScaled(value, decimals, &scaled)) {
+            return decimals;
+        }
+    }
+    return DECIMALS_UNSET;
+}
+
+// The mantissa bits kept for each number of significant digits, ceil(digits * log2(10)) + 1
+static const u_int8_t significantDigitsBits[SIGNIFICANT_DIGITS_MAX + 1] = {
+    52, 5, 8, 11, 15, 18, 21, 25, 28, 31, 35, 38, 41, 45, 48, 51
+};
+
+double Compressed_RoundSignificantDigits(double value, u_int8_t digits) {
+    if (digits == 0 || !isfinite(value)) {
+        return value;
+    }
+    u_int64_t mask = (1ULL << (52 - significantDigitsBits[digits])) - 1;
+    union64bits rounded = { .d = value };
+    // half up, a carry out of the mantissa goes to the exponent
+    rounded.u = (rounded.u + (mask >> 1) + 1) & ~mask;
+    if (!isfinite(rounded.d)) {
+        rounded.d = value;
+        rounded.u &= ~mask;
+    }
+    return rounded.d;
+}
+
+// Decimals of a chunk starting with `value`, more decimals can be set when appending later samples
+static u_int8_t firstDecimals(double value) {
+    u_int8_t decimals = Compressed_DecimalsOf(value);
+    return decimals == DECIMALS_UNSET ? 0 : decimals;
+}
+
+/*
+ * Returns the delta to encode for `value` in a decimal chunk, or false if the value is stored as
+ * is. A zero delta means the previous value repeats, which is also how a repeated value that is
+ * stored as is gets encoded.
+ */
+static bool decimalDelta(double value, double prevValue, u_int8_t decimals, int64_t *delta) {
+    union64bits val = { .d = value }, prev = { .d = prevValue };
+    if (val.u == prev.u) {
+        *delta = 0;
+        return true;
+    }
+    int64_t scaled;
+    if (!toScaled(value, decimals, &scaled)) {
+        return false;
+    }
+    *delta = scaled - scaledBase(prevValue, decimals);
+    return *delta != 0 && Bin_InRange(*delta, CMPR_L5);
+}
+
 /***************************** APPEND ********************************/
 static ChunkResult appendInteger(CompressedChunk *chunk, timestamp_t timestamp) {
     assert(timestamp >= chunk->prevTimestamp);
@@ -303,6 +402,13 @@ static ChunkResult appendInteger(CompressedChunk *chunk, timestamp_t timestamp)
     return CR_OK;
 }
 
+// A timestamp in the regular run at the start of the chunk takes no bits
+static ChunkResult appendImpliedInteger(CompressedChunk *chunk, timestamp_t timestamp) {
+    CHECKSPACE(chunk, 1); // the value takes at least one bit
+    chunk->prevTimestamp = timestamp;
+    return CR_OK;
+}
+
 static ChunkResult appendFloat(CompressedChunk *chunk, double value) {
     union64bits val;
     val.d = value;
@@ -360,29 +466,260 @@ static ChunkResult appendFloat(CompressedChunk *chunk, double value) {
     return CR_OK;
 }
 
-ChunkResult Compressed_Append(CompressedChunk *chunk, timestamp_t timestamp, double value) {
-    assert(chunk);
+static ChunkResult appendDecimal(CompressedChunk *chunk, double value) {
+    binary_t *bins = chunk->data;
+    globalbit_t *bit = &chunk->idx;
+
+    // CHECKSPACE already checked for 1 extra bit availability in appendInteger.
+    int64_t delta;
+    if (!decimalDelta(value, chunk->prevValue.d, chunk->decimals, &delta)) {
+        union64bits val = { .d = value };
+        CHECKSPACE(chunk, 6 + 64);
+        appendBits(bins, bit, 0x3f, 6);
+        appendBits(bins, bit, val.u, 64);
+    } else if (delta == 0) {
+        appendBits(bins, bit, 0x00, 1);
+    } else if (Bin_InRange(delta, CMPR_L1)) {
+        CHECKSPACE(chunk, 2 + CMPR_L1);
+        appendBits(bins, bit, 0x01, 2);
+        appendBits(bins, bit, int2bin(delta, CMPR_L1), CMPR_L1);
+    } else if (Bin_InRange(delta, CMPR_L2)) {
+        CHECKSPACE(chunk, 3 + CMPR_L2);
+        appendBits(bins, bit, 0x03, 3);
+        appendBits(bins, bit, int2bin(delta, CMPR_L2), CMPR_L2);
+    } else if (Bin_InRange(delta, CMPR_L3)) {
+        CHECKSPACE(chunk, 4 + CMPR_L3);
+        appendBits(bins, bit, 0x07, 4);
+        appendBits(bins, bit, int2bin(delta, CMPR_L3), CMPR_L3);
+    } else if (Bin_InRange(delta, CMPR_L4)) {
+        CHECKSPACE(chunk, 5 + CMPR_L4);
+        appendBits(bins, bit, 0x0f, 5);
+        appendBits(bins, bit, int2bin(delta, CMPR_L4), CMPR_L4);
+    } else {
+        CHECKSPACE(chunk, 6 + CMPR_L5);
+        appendBits(bins, bit, 0x1f, 6);
+        appendBits(bins, bit, int2bin(delta, CMPR_L5), CMPR_L5);
+    }
+    chunk->prevValue.d = value;
+    return CR_OK;
+}
+
+/***************************** SIZE ESTIMATION ********************************/
+// Mirrors appendInteger
+static u_int8_t integerEncodedBits(int64_t doubleDelta) {
+    if (doubleDelta == 0) {
+        return 1;
+    } else if (Bin_InRange(doubleDelta, CMPR_L1)) {
+        return 2 + CMPR_L1;
+    } else if (Bin_InRange(doubleDelta, CMPR_L2)) {
+        return 3 + CMPR_L2;
+    } else if (Bin_InRange(doubleDelta, CMPR_L3)) {
+        return 4 + CMPR_L3;
+    } else if (Bin_InRange(doubleDelta, CMPR_L4)) {
+        return 5 + CMPR_L4;
+    } else if (Bin_InRange(doubleDelta, CMPR_L5)) {
+        return 6 + CMPR_L5;
+    }
+    return 6 + 64;
+}
+
+// Mirrors appendDecimal
+static u_int8_t decimalEncodedBits(double value, double prevValue, u_int8_t decimals) {
+    int64_t delta;
+    if (!decimalDelta(value, prevValue, decimals, &delta)) {
+        return 6 + 64;
+    }
+    return integerEncodedBits(delta);
+}
+
+void Compressed_SizeEstimatorInit(CompressedSizeEstimator *estimator,
+                                  const CompressedChunk *chunk) {
+    memset(estimator, 0, sizeof(*estimator));
+    estimator->prevLeading = 32;
+    estimator->prevTrailing = 32;
+    estimator->decimalValues = chunk->decimalValues;
+    estimator->decimals = chunk->decimals;
+}
+
+void Compressed_SizeEstimatorInitFromBlocks(CompressedSizeEstimator *estimator,
+                                            CompressedChunk *chunk,
+                                            u_int32_t blockId) {
+    Compressed_SizeEstimatorInit(estimator, chunk);
+    if (blockId == 0) {
+        return;
+    }
+    CompressedCheckpoint *cp = &chunk->checkpoints[blockId - 1];
+    estimator->idx = cp->idx;
+    estimator->count = cp->count;
+    estimator->prevTimestamp = cp->prevTS;
+    estimator->prevTimestampDelta = cp->prevDelta;
+    estimator->prevValue = cp->prevValue;
+    estimator->prevLeading = cp->prevLeading;
+    estimator->prevTrailing = cp->prevTrailing;
+    estimator->regularCount = min(chunk->regularCount, cp->count);
+}
+
+// Mirrors Compressed_Append, appendInteger, appendFloat and appendDecimal
+void Compressed_SizeEstimatorAdd(CompressedSizeEstimator *estimator,
+                                 timestamp_t timestamp,
+                                 double value) {
+    if (estimator->count == 0) {
+        if (estimator->decimalValues && estimator->decimals == DECIMALS_UNSET) {
+            estimator->decimals = firstDecimals(value);
+        }
+        estimator->count = estimator->regularCount = 1;
+        estimator->prevValue.d = value;
+        estimator->prevTimestamp = timestamp;
+        estimator->prevTimestampDelta = 0;
+        return;
+    }
+
+    timestamp_t curDelta = timestamp - estimator->prevTimestamp;
+    bool implied = estimator->count > 1 && estimator->regularCount == estimator->count &&
+                   curDelta == estimator->prevTimestampDelta;
+    if (!implied) {
+        estimator->idx += integerEncodedBits(curDelta - estimator->prevTimestampDelta);
+    }
+    if (implied || estimator->count == 1) {
+        estimator->regularCount++;
+    }
+    estimator->count++;
+    estimator->prevTimestampDelta = curDelta;
+    estimator->prevTimestamp = timestamp;
+
+    if (estimator->decimalValues) {
+        estimator->idx += decimalEncodedBits(value, estimator->prevValue.d, estimator->decimals);
+        estimator->prevValue.d = value;
+        return;
+    }
+
+    union64bits val;
+    val.d = value;
+    u_int64_t xorWithPrevious = val.u ^ estimator->prevValue.u;
+    estimator->prevValue = val;
+    if (xorWithPrevious == 0) {
+        estimator->idx += 1;
+        return;
+    }
+
+    u_int64_t leading = min(LeadingZeros64(xorWithPrevious), 31);
+    u_int64_t trailing = TrailingZeros64(xorWithPrevious);
+    localbit_t blockSize = BINW - leading - trailing;
+    u_int32_t expectedSize = DOUBLE_LEADING + DOUBLE_BLOCK_SIZE + blockSize;
+    localbit_t prevBlockInfoSize = BINW - estimator->prevLeading - estimator->prevTrailing;
+    if (leading >= estimator->prevLeading && trailing >= estimator->prevTrailing &&
+        expectedSize > prevBlockInfoSize) {
+        estimator->idx += 2 + prevBlockInfoSize;
+    } else {
+        estimator->idx += 2 + expectedSize;
+        estimator->prevLeading = leading;
+        estimator->prevTrailing = trailing;
+    }
+}
+
+size_t Compressed_SizeEstimatorBytes(const CompressedSizeEstimator *estimator) {
+    // appending needs the bits of the sample and writes in whole binary_t words
+    return (estimator->idx + BINW - 1) / BINW * sizeof(binary_t);
+}
+
+/***************************** CHECKPOINTS ********************************/
+static void addCheckpointIfNeeded(CompressedChunk *chunk,
+                                  u_int64_t idx,
+                                  u_int64_t count,
+                                  u_int64_t prevTS,
+                                  int64_t prevDelta,
+                                  union64bits prevValue,
+                                  u_int8_t prevLeading,
+                                  u_int8_t prevTrailing) {
+    u_int64_t lastIdx = 0, lastCount = 0;
+    if (chunk->checkpointsCount > 0) {
+        lastIdx = chunk->checkpoints[chunk->checkpointsCount - 1].idx;
+        lastCount = chunk->checkpoints[chunk->checkpointsCount - 1].count;
+    }
+    if (idx - lastIdx < CHECKPOINT_INTERVAL_BITS && count - lastCount < CHECKPOINT_MAX_SAMPLES) {
+        return;
+    }
+
+    chunk->checkpoints = realloc(chunk->checkpoints,
+                                 (chunk->checkpointsCount + 1) * sizeof(CompressedCheckpoint));
+    CompressedCheckpoint *cp = &chunk->checkpoints[chunk->checkpointsCount++];
+    memset(cp, 0, sizeof(*cp)); // checkpoints are saved to RDB with their padding
+    cp->idx = idx;
+    cp->count = count;
+    cp->prevTS = prevTS;
+    cp->prevDelta = prevDelta;
+    cp->prevValue = prevValue;
+    cp->prevLeading = prevLeading;
+    cp->prevTrailing = prevTrailing;
+}
+
+// Encodes a sample, leaving the summary to the caller
+static inline ChunkResult encodeSample(CompressedChunk *chunk,
+                                       timestamp_t timestamp,
+                                       double value) {
 
     if (chunk->count == 0) {
+        if (chunk->decimalValues && chunk->decimals == DECIMALS_UNSET) {
+            chunk->decimals = firstDecimals(value);
+        }
         chunk->baseValue.d = chunk->prevValue.d = value;
         chunk->baseTimestamp = chunk->prevTimestamp = timestamp;
         chunk->prevTimestampDelta = 0;
+        chunk->regularCount = 1;
     } else {
         u_int64_t idx = chunk->idx;
         u_int64_t prevTimestamp = chunk->prevTimestamp;
         int64_t prevTimestampDelta = chunk->prevTimestampDelta;
-        if (appendInteger(chunk, timestamp) != CR_OK || appendFloat(chunk, value) != CR_OK) {
+        // the second sample sets the interval, the timestamp of the next ones is implied by it
+        bool implied = chunk->count > 1 && chunk->regularCount == chunk->count &&
+                       timestamp - prevTimestamp == prevTimestampDelta;
+        ChunkResult res = implied ? appendImpliedInteger(chunk, timestamp)
+                                  : appendInteger(chunk, timestamp);
+        if (res == CR_OK) {
+            res = chunk->decimalValues ? appendDecimal(chunk, value) : appendFloat(chunk, value);
+        }
+        if (res != CR_OK) {
             chunk->idx = idx;
             chunk->prevTimestamp = prevTimestamp;
             chunk->prevTimestampDelta = prevTimestampDelta;
             return CR_END;
         }
+        if (implied || chunk->count == 1) {
+            chunk->regularCount++;
+        }
     }
     chunk->count++;
+    addCheckpointIfNeeded(chunk,
+                          chunk->idx,
+                          chunk->count,
+                          chunk->prevTimestamp,
+                          chunk->prevTimestampDelta,
+                          chunk->prevValue,
+                          chunk->prevLeading,
+                          chunk->prevTrailing);
     return CR_OK;
 }
 
+ChunkResult Compressed_Append(CompressedChunk *chunk, timestamp_t timestamp, double value) {
+    assert(chunk);
+    ChunkResult res = encodeSample(chunk, timestamp, value);
+    if (res == CR_OK) {
+        ChunkSummaryAdd(&chunk->summary, value);
+    }
+    return res;
+}
+
+size_t Compressed_AppendBlock(CompressedChunk *chunk, const Sample *samples, size_t count) {
+    assert(chunk);
+    size_t i = 0;
+    while (i < count && encodeSample(chunk, samples[i].timestamp, samples[i].value) == CR_OK) {
+        i++;
+    }
+    return i;
+}
+
 /********************************** READ *********************************/
+#ifdef GORILLA_BITWISE_DECODE
 /*
  * This function decodes timestamps inserted by appendInteger.
  *
@@ -460,6 +797,154 @@ static double readFloat(Compressed_Iterator *iter) {
     return iter->prevValue.d = rv.d;
 }
 
+/*
+ * This function decodes values inserted by appendDecimal.
+ *
+ * The delta is read like the double delta of readInteger, a zero delta repeats the previous
+ * value and the largest bucket holds the value itself.
+ */
+static double readDecimal(Compressed_Iterator *iter) {
+    binary_t *bins = iter->chunk->data;
+    globalbit_t *bit = &iter->idx;
+
+    int64_t delta;
+    if (Bins_bitoff(bins, (*bit)++)) {
+        return iter->prevValue.d;
+    } else if (Bins_bitoff(bins, (*bit)++)) {
+        delta = bin2int(readBits(bins, bit, CMPR_L1), CMPR_L1);
+    } else if (Bins_bitoff(bins, (*bit)++)) {
+        delta = bin2int(readBits(bins, bit, CMPR_L2), CMPR_L2);
+    } else if (Bins_bitoff(bins, (*bit)++)) {
+        delta = bin2int(readBits(bins, bit, CMPR_L3), CMPR_L3);
+    } else if (Bins_bitoff(bins, (*bit)++)) {
+        delta = bin2int(readBits(bins, bit, CMPR_L4), CMPR_L4);
+    } else if (Bins_bitoff(bins, (*bit)++)) {
+        delta = bin2int(readBits(bins, bit, CMPR_L5), CMPR_L5);
+    } else {
+        iter->prevValue.u = readBits(bins, bit, 64);
+        return iter->prevValue.d;
+    }
+
+    u_int8_t decimals = iter->chunk->decimals;
+    int64_t scaled = scaledBase(iter->prevValue.d, decimals) + delta;
+    return iter->prevValue.d = (double)scaled / decimalScales[decimals];
+}
+
+#else
+/*
+ * The decoder below peeks the next 64 bits of the stream at once: the bucket of a delta is the
+ * number of trailing ones of its control prefix, and its widths come from a table, so a sample
+ * costs a couple of loads and shifts rather than a readBits call per field. Building with
+ * GORILLA_BITWISE_DECODE selects the decoder reading the fields one by one instead.
+ */
+#define BUCKET_ZERO 0
+#define BUCKET_FULL 6
+
+// prefix and payload widths of the buckets written by appendInteger
+static const u_int8_t bucketPrefixBits[BUCKET_FULL + 1] = { 1, 2, 3, 4, 5, 6, 6 };
+static const u_int8_t bucketPayloadBits[BUCKET_FULL + 1] = {
+    0, CMPR_L1, CMPR_L2, CMPR_L3, CMPR_L4, CMPR_L5, 64
+};
+
+// The 64 bits of the stream from `bit` on, those past the end of the chunk read as zeros
+static inline binary_t peekBits(const CompressedChunk *chunk, globalbit_t bit) {
+    const binary_t *bins = chunk->data;
+    globalbit_t word = bit / BINW;
+    localbit_t lbit = localbit(bit);
+    binary_t bin = bins[word] >> lbit;
+    if (lbit != 0 && (word + 1) * sizeof(binary_t) < chunk->size) {
+        bin |= bins[word + 1] << (BINW - lbit);
+    }
+    return bin;
+}
+
+/*
+ * Reads a delta written in the buckets of appendInteger and returns its bucket. The delta is
+ * sign extended, except in BUCKET_FULL where `value` holds the 64 bits as written.
+ */
+static inline u_int8_t readBucket(const CompressedChunk *chunk, globalbit_t *bit, int64_t *value) {
+    binary_t bin = peekBits(chunk, *bit);
+    // counting the trailing ones stops at the sixth
+    u_int8_t bucket = __builtin_ctzll(~bin | BIT(BUCKET_FULL));
+    if (bucket == BUCKET_ZERO) {
+        *value = 0;
+        *bit += 1;
+    } else if (bucket == BUCKET_FULL) {
+        *value = (int64_t)peekBits(chunk, *bit + bucketPrefixBits[BUCKET_FULL]);
+        *bit += bucketPrefixBits[BUCKET_FULL] + bucketPayloadBits[BUCKET_FULL];
+    } else {
+        u_int8_t prefix = bucketPrefixBits[bucket], payload = bucketPayloadBits[bucket];
+        // move the payload to the top bits, and back with an arithmetic shift
+        *value = (int64_t)(bin << (BINW - prefix - payload)) >> (BINW - payload);
+        *bit += prefix + payload;
+    }
+    return bucket;
+}
+
+// Decodes the timestamps inserted by appendInteger
+static u_int64_t readInteger(Compressed_Iterator *iter) {
+    int64_t dd;
+    readBucket(iter->chunk, &iter->idx, &dd);
+    iter->prevDelta += dd;
+    return iter->prevTS = iter->prevTS + iter->prevDelta;
+}
+
+// Decodes the values inserted by appendFloat
+static double readFloat(Compressed_Iterator *iter) {
+    const CompressedChunk *chunk = iter->chunk;
+    binary_t bin = peekBits(chunk, iter->idx);
+    // value unchanged
+    if (!(bin & 1)) {
+        iter->idx += 1;
+        return iter->prevValue.d;
+    }
+
+    binary_t xorValue;
+    if (!(bin & 2)) {
+        // previous block information
+        u_int8_t blockSize = BINW - iter->prevLeading - iter->prevTrailing;
+        iter->idx += 2;
+        xorValue = LSB(peekBits(chunk, iter->idx), blockSize) << iter->prevTrailing;
+        iter->idx += blockSize;
+    } else {
+        u_int8_t leading = LSB(bin >> 2, DOUBLE_LEADING);
+        u_int8_t blockSize =
+            LSB(bin >> (2 + DOUBLE_LEADING), DOUBLE_BLOCK_SIZE) + DOUBLE_BLOCK_ADJUST;
+        u_int8_t trailing = BINW - leading - blockSize;
+        iter->idx += 2 + DOUBLE_LEADING + DOUBLE_BLOCK_SIZE;
+        xorValue = LSB(peekBits(chunk, iter->idx), blockSize) << trailing;
+        iter->idx += blockSize;
+        iter->prevLeading = leading;
+        iter->prevTrailing = trailing;
+    }
+
+    union64bits rv;
+    rv.u = xorValue ^ iter->prevValue.u;
+    return iter->prevValue.d = rv.d;
+}
+
+// Decodes the values inserted by appendDecimal
+static double readDecimal(Compressed_Iterator *iter) {
+    int64_t delta;
+    u_int8_t bucket = readBucket(iter->chunk, &iter->idx, &delta);
+    if (bucket == BUCKET_ZERO) {
+        return iter->prevValue.d;
+    } else if (bucket == BUCKET_FULL) {
+        iter->prevValue.u = (u_int64_t)delta;
+        return iter->prevValue.d;
+    }
+
+    u_int8_t decimals = iter->chunk->decimals;
+    int64_t scaled = scaledBase(iter->prevValue.d, decimals) + delta;
+    return iter->prevValue.d = (double)scaled / decimalScales[decimals];
+}
+
+#endif
+
+static inline double readValue(Compressed_Iterator *iter) {
+    return iter->chunk->decimalValues ? readDecimal(iter) : readFloat(iter);
+}
+
 ChunkResult Compressed_ReadNext(Compressed_Iterator *iter, timestamp_t *timestamp, double *value) {
     assert(iter);
     assert(iter->chunk);
@@ -470,10 +955,103 @@ ChunkResult Compressed_ReadNext(Compressed_Iterator *iter, timestamp_t *timestam
     if (iter->count == 0) { // First sample
         *timestamp = iter->chunk->baseTimestamp;
         *value = iter->chunk->baseValue.d;
+    } else if (iter->count > 1 && iter->count < iter->chunk->regularCount) {
+        *timestamp = iter->prevTS += iter->prevDelta;
+        *value = iter->prevValue.d = readValue(iter);
     } else {
         *timestamp = iter->prevTS = readInteger(iter);
-        *value = iter->prevValue.d = readFloat(iter);
+        *value = iter->prevValue.d = readValue(iter);
     }
     iter->count++;
     return CR_OK;
 }
+
+void Compressed_IteratorSeekBlock(Compressed_Iterator *iter, u_int32_t blockId) {
+    CompressedChunk *chunk = iter->chunk;
+    assert(blockId <= chunk->checkpointsCount);
+
+    if (blockId == 0) {
+        iter->idx = 0;
+        iter->count = 0;
+        iter->prevTS = chunk->baseTimestamp;
+        iter->prevDelta = 0;
+        iter->prevValue.d = chunk->baseValue.d;
+        iter->prevLeading = 32;
+        iter->prevTrailing = 32;
+        return;
+    }
+
+    CompressedCheckpoint *cp = &chunk->checkpoints[blockId - 1];
+    iter->idx = cp->idx;
+    iter->count = cp->count;
+    iter->prevTS = cp->prevTS;
+    iter->prevDelta = cp->prevDelta;
+    iter->prevValue = cp->prevValue;
+    iter->prevLeading = cp->prevLeading;
+    iter->prevTrailing = cp->prevTrailing;
+}
+
+u_int64_t Compressed_BlockNumOfSamples(CompressedChunk *chunk, u_int32_t blockId) {
+    u_int64_t start = blockId == 0 ? 0 : chunk->checkpoints[blockId - 1].count;
+    u_int64_t end =
+        blockId < chunk->checkpointsCount ? chunk->checkpoints[blockId].count : chunk->count;
+    return end - start;
+}
+
+void Compressed_BuildCheckpoints(CompressedChunk *chunk) {
+    free(chunk->checkpoints);
+    chunk->checkpoints = NULL;
+    chunk->checkpointsCount = 0;
+    ChunkSummaryReset(&chunk->summary);
+
+    Compressed_Iterator iter = { .chunk = chunk };
+    Compressed_IteratorSeekBlock(&iter, 0);
+    timestamp_t ts;
+    double value;
+    while (Compressed_ReadNext(&iter, &ts, &value) == CR_OK) {
+        ChunkSummaryAdd(&chunk->summary, value);
+        addCheckpointIfNeeded(chunk,
+                              iter.idx,
+                              iter.count,
+                              iter.prevTS,
+                              iter.prevDelta,
+                              iter.prevValue,
+                              iter.prevLeading,
+                              iter.prevTrailing);
+    }
+}
+
+void Compressed_CopyBlocks(CompressedChunk *dst, CompressedChunk *src, u_int32_t blockId) {
+    assert(dst->count == 0);
+    assert(blockId <= src->checkpointsCount);
+    if (blockId == 0) {
+        return;
+    }
+
+    CompressedCheckpoint *cp = &src->checkpoints[blockId - 1];
+    assert(dst->size * 8 >= cp->idx);
+    globalbit_t fullBins = cp->idx / BINW;
+    memcpy(dst->data, src->data, fullBins * sizeof(binary_t));
+    if (localbit(cp->idx) != 0) {
+        dst->data[fullBins] = LSB(src->data[fullBins], localbit(cp->idx));
+    }
+
+    dst->checkpoints = malloc(blockId * sizeof(CompressedCheckpoint));
+    memcpy(dst->checkpoints, src->checkpoints, blockId * sizeof(CompressedCheckpoint));
+    dst->checkpointsCount = blockId;
+
+    dst->idx = cp->idx;
+    dst->count = cp->count;
+    dst->baseValue = src->baseValue;
+    dst->baseTimestamp = src->baseTimestamp;
+    dst->prevTimestamp = cp->prevTS;
+    dst->prevTimestampDelta = cp->prevDelta;
+    dst->prevValue = cp->prevValue;
+    dst->prevLeading = cp->prevLeading;
+    dst->prevTrailing = cp->prevTrailing;
+    dst->regularCount = min(src->regularCount, cp->count);
+    dst->decimalValues = src->decimalValues;
+    dst->decimals = src->decimals;
+    // the copied samples were not decoded
+    dst->summary.stale = true;
+}
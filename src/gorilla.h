@@ -11,6 +11,7 @@
 #include "generic_chunk.h"
 
 #include <stdbool.h>   // bool
+#include <stdint.h>    // UINT8_MAX
 #include <sys/types.h> // u_int_t
 
 typedef u_int64_t timestamp_t;
@@ -25,10 +26,54 @@ typedef union
     u_int64_t u;
 } union64bits;
 
+/*
+ * A checkpoint snapshots the decoder state right after sample `count - 1` was encoded, so that
+ * decoding can resume at bit `idx` without reading the chunk from its start.
+ * Checkpoints are taken while appending, whenever CHECKPOINT_INTERVAL_BITS bits or
+ * CHECKPOINT_MAX_SAMPLES samples were written since the previous one.
+ */
+#define CHECKPOINT_INTERVAL_BITS 8192
+#define CHECKPOINT_MAX_SAMPLES 256
+
+// Decimal chunks store values with up to DECIMALS_MAX digits after the point as integers
+#define DECIMALS_MAX 6
+#define DECIMALS_UNSET UINT8_MAX
+
+typedef struct CompressedCheckpoint
+{
+    u_int32_t idx;
+    u_int32_t count;
+    u_int64_t prevTS;
+    int64_t prevDelta;
+    union64bits prevValue;
+    u_int8_t prevLeading;
+    u_int8_t prevTrailing;
+} CompressedCheckpoint;
+
+/*
+ * The latest samples appended to a chunk through Compressed_BufferSample, newer than its encoded
+ * ones. Appends only copy the sample, the block is encoded in one pass when it fills up, and the
+ * newest samples are read from it without decoding. A chunk only takes a head while appended to.
+ */
+#define HEAD_BLOCK_SAMPLES 32
+// the most bits a sample is encoded in, a 64 bits timestamp and value with their control bits
+#define HEAD_SAMPLE_MAX_BITS 160
+
+typedef struct CompressedHead
+{
+    u_int32_t count;
+    Sample samples[HEAD_BLOCK_SAMPLES];
+} CompressedHead;
+
 typedef struct CompressedChunk
 {
-    u_int64_t size;
-    u_int64_t count;
+    /*
+     * Every chunk older than the latest one of its series keeps this header, so it is packed to fit
+     * the 160 bytes class of the allocator: sizes and counts take 32 bits like in the checkpoints,
+     * and the byte wide fields share the last word before the summary.
+     */
+    u_int32_t size;
+    u_int32_t count;
     u_int64_t idx;
 
     union64bits baseValue;
@@ -38,10 +83,39 @@ typedef struct CompressedChunk
 
     u_int64_t prevTimestamp;
     int64_t prevTimestampDelta;
-
     union64bits prevValue;
+
+    /*
+     * The first regularCount samples are spaced by the same interval, the delta of the second
+     * sample. The timestamps of the following ones in that run take no bits, only their values
+     * are encoded. The run ends at the first sample with another interval.
+     */
+    u_int32_t regularCount;
+
+    u_int32_t checkpointsCount;
+    CompressedCheckpoint *checkpoints;
+
     u_int8_t prevLeading;
     u_int8_t prevTrailing;
+
+    /*
+     * Values of decimal chunks are encoded as the delta of value * 10^decimals, an integer for
+     * counters and fixed precision gauges, rather than as the XOR with the previous value. Values
+     * with more decimals are stored as is. Unless set on creation, the first sample sets
+     * `decimals`.
+     */
+    bool decimalValues;
+    u_int8_t decimals;
+
+    // Sealed chunks have no room past their last sample, see Compressed_SealChunk. They keep their
+    // checkpoints, which reads seek and reverse from as on any chunk.
+    bool sealed;
+    // the data of offloaded chunks, sealed as well, is in the segment store
+    bool offloaded;
+
+    // the summary includes the samples of the head
+    ChunkSummary summary;
+    CompressedHead *head;
 } CompressedChunk;
 
 typedef struct Compressed_Iterator
@@ -58,9 +132,74 @@ typedef struct Compressed_Iterator
     union64bits prevValue;
     u_int8_t prevLeading;
     u_int8_t prevTrailing;
+
+    // reverse iteration decodes one block (the samples between two checkpoints) at a time into
+    // `block`, which has room for blockCapacity (CHECKPOINT_MAX_SAMPLES) samples
+    bool reverse;
+    Sample *block;
+    int blockCount;
+    int blockPos;
+    u_int32_t blockId;
+    u_int32_t blockCapacity;
+    // forward iteration reads the head past the encoded samples, reverse iteration from headPos
+    int headPos;
 } Compressed_Iterator;
 
+/*
+ * Follows the encoder state of a chunk without writing the samples, to learn the exact size a
+ * sequence of samples is encoded in before allocating the chunk for it.
+ */
+typedef struct CompressedSizeEstimator
+{
+    u_int64_t idx;
+    u_int64_t count;
+    u_int64_t prevTimestamp;
+    int64_t prevTimestampDelta;
+    union64bits prevValue;
+    u_int8_t prevLeading;
+    u_int8_t prevTrailing;
+    u_int64_t regularCount;
+    bool decimalValues;
+    u_int8_t decimals;
+} CompressedSizeEstimator;
+
+// Start from an empty chunk encoding values like `chunk`
+void Compressed_SizeEstimatorInit(CompressedSizeEstimator *estimator,
+                                  const CompressedChunk *chunk);
+// Start from the samples of `chunk` preceding block `blockId`, as copied by Compressed_CopyBlocks
+void Compressed_SizeEstimatorInitFromBlocks(CompressedSizeEstimator *estimator,
+                                            CompressedChunk *chunk,
+                                            u_int32_t blockId);
+void Compressed_SizeEstimatorAdd(CompressedSizeEstimator *estimator,
+                                 u_int64_t timestamp,
+                                 double value);
+// The chunk size in bytes that fits all the samples added so far
+size_t Compressed_SizeEstimatorBytes(const CompressedSizeEstimator *estimator);
+
+// The fewest decimals `value` is written with, DECIMALS_UNSET beyond DECIMALS_MAX
+u_int8_t Compressed_DecimalsOf(double value);
+
+#define SIGNIFICANT_DIGITS_MAX 15
+/*
+ * Rounds the mantissa of `value` to the bits worth `digits` significant decimal digits, so that
+ * its XOR with the previous value ends in zeros the encoding leaves out. The relative error is
+ * below half a unit of the last digit. 0 digits keep the value as is.
+ */
+double Compressed_RoundSignificantDigits(double value, u_int8_t digits);
+
 ChunkResult Compressed_Append(CompressedChunk *chunk, u_int64_t timestamp, double value);
+// Appends the samples that fit in one pass, without adding them to the summary. Returns how many.
+size_t Compressed_AppendBlock(CompressedChunk *chunk, const Sample *samples, size_t count);
 ChunkResult Compressed_ReadNext(Compressed_Iterator *iter, u_int64_t *timestamp, double *value);
 
+// Position `iter` at the beginning of block `blockId`. Block 0 starts at the first sample, block
+// N starts right after checkpoint N-1.
+void Compressed_IteratorSeekBlock(Compressed_Iterator *iter, u_int32_t blockId);
+// Number of samples in block `blockId`
+u_int64_t Compressed_BlockNumOfSamples(CompressedChunk *chunk, u_int32_t blockId);
+// Make the empty chunk `dst` a copy of the samples of `src` preceding block `blockId`
+void Compressed_CopyBlocks(CompressedChunk *dst, CompressedChunk *src, u_int32_t blockId);
+// Recreate the checkpoints and summary of a chunk whose data was loaded as is (e.g. from RDB)
+void Compressed_BuildCheckpoints(CompressedChunk *chunk);
+
 #endif
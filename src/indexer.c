@@ -6,8 +6,16 @@
 #include "indexer.h"
 
 #include "consts.h"
+#include "trace.h"
 
 #include <limits.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <rmutil/alloc.h>
 
@@ -16,6 +24,54 @@ RedisModuleDict *labelsIndex;
 #define KV_PREFIX "__index_%s=%s"
 #define K_PREFIX "__key_index_%s"
 
+/*
+ * Every indexed series is assigned a small integer ID, and each label index entry holds a sorted
+ * array of the IDs of the series carrying that label (a posting list). Queries intersect and
+ * subtract posting lists in place, and only the final result is mapped back to key names.
+ */
+typedef struct PostingList
+{
+    u_int32_t *ids;
+    size_t count;
+    size_t capacity;
+} PostingList;
+
+typedef struct SeriesIdEntry
+{
+    RedisModuleString *keyName; // NULL when the ID is unused
+    size_t refs;
+    void *handle;    // the indexed series
+    bool isVolatile; // the key may have an expire, so it must be looked up to be read
+} SeriesIdEntry;
+
+// Set when a key name identifies a single key, so queries may hand out the series handles
+static bool useSeriesHandles;
+// bumped whenever the result of a query may change
+static uint64_t indexVersion;
+
+static RedisModuleDict *seriesIdsByKey;
+static SeriesIdEntry *seriesIdEntries;
+static size_t seriesIdCount;
+static size_t seriesIdCapacity;
+// released IDs are reused before new ones are assigned, keeping the ID space dense
+static u_int32_t *freeSeriesIds;
+static size_t freeSeriesIdsCount;
+static size_t freeSeriesIdsCapacity;
+
+/*
+ * The label names and values of the series are interned: each distinct string is stored once, in
+ * labelStrings, with the number of labels referencing it. Series may be freed on background
+ * threads, the table is guarded by labelStringsLock.
+ */
+typedef struct InternedString
+{
+    RedisModuleString *str;
+    size_t refs;
+} InternedString;
+
+static RedisModuleDict *labelStrings;
+static pthread_mutex_t labelStringsLock = PTHREAD_MUTEX_INITIALIZER;
+
 typedef enum
 {
     Indexer_Add,
@@ -24,6 +80,8 @@ typedef enum
 
 void IndexInit() {
     labelsIndex = RedisModule_CreateDict(NULL);
+    seriesIdsByKey = RedisModule_CreateDict(NULL);
+    labelStrings = RedisModule_CreateDict(NULL);
 }
 
 void FreeLabels(void *value, size_t labelsCount) {
@@ -35,6 +93,142 @@ void FreeLabels(void *value, size_t labelsCount) {
     free(labels);
 }
 
+// Returns the interned copy of str, which is freed if one exists. Called with the lock held.
+static RedisModuleString *InternString(RedisModuleString *str) {
+    size_t len;
+    const char *bytes = RedisModule_StringPtrLen(str, &len);
+    InternedString *entry = RedisModule_DictGetC(labelStrings, (void *)bytes, len, NULL);
+    if (entry == NULL) {
+        entry = malloc(sizeof(InternedString));
+        entry->str = str;
+        entry->refs = 0;
+        RedisModule_DictSetC(labelStrings, (void *)bytes, len, entry);
+    } else {
+        RedisModule_FreeString(NULL, str);
+    }
+    entry->refs++;
+    return entry->str;
+}
+
+// Called with the lock held
+static InternedString *GetInternedString(RedisModuleString *str) {
+    size_t len;
+    const char *bytes = RedisModule_StringPtrLen(str, &len);
+    return RedisModule_DictGetC(labelStrings, (void *)bytes, len, NULL);
+}
+
+// Called with the lock held
+static void ReleaseString(RedisModuleString *str) {
+    InternedString *entry = GetInternedString(str);
+    if (--entry->refs > 0) {
+        return;
+    }
+    size_t len;
+    const char *bytes = RedisModule_StringPtrLen(str, &len);
+    RedisModule_DictDelC(labelStrings, (void *)bytes, len, NULL);
+    RedisModule_FreeString(NULL, entry->str);
+    free(entry);
+}
+
+void InternLabels(Label *labels, size_t labelsCount) {
+    pthread_mutex_lock(&labelStringsLock);
+    for (size_t i = 0; i < labelsCount; i++) {
+        labels[i].key = InternString(labels[i].key);
+        labels[i].value = InternString(labels[i].value);
+    }
+    pthread_mutex_unlock(&labelStringsLock);
+}
+
+Label *RetainLabels(const Label *labels, size_t labelsCount) {
+    Label *retained = malloc(sizeof(Label) * labelsCount);
+    pthread_mutex_lock(&labelStringsLock);
+    for (size_t i = 0; i < labelsCount; i++) {
+        GetInternedString(labels[i].key)->refs++;
+        GetInternedString(labels[i].value)->refs++;
+        retained[i] = labels[i];
+    }
+    pthread_mutex_unlock(&labelStringsLock);
+    return retained;
+}
+
+void ReleaseLabels(Label *labels, size_t labelsCount) {
+    pthread_mutex_lock(&labelStringsLock);
+    for (size_t i = 0; i < labelsCount; i++) {
+        ReleaseString(labels[i].key);
+        ReleaseString(labels[i].value);
+    }
+    pthread_mutex_unlock(&labelStringsLock);
+    free(labels);
+}
+
+size_t InternedLabelStrings() {
+    pthread_mutex_lock(&labelStringsLock);
+    size_t count = RedisModule_DictSize(labelStrings);
+    pthread_mutex_unlock(&labelStringsLock);
+    return count;
+}
+
+static int CompileLabelRegex(const char *pattern, regex_t *regex);
+
+/*
+ * The buffers of a query are allocated from the pool of the command, which works as its arena:
+ * they are never freed one by one but all at once when the command returns.
+ */
+
+// Formats an index key in the pool of ctx, its length is set to len
+static const char *PoolIndexKey(RedisModuleCtx *ctx, size_t *len, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    *len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    char *key = RedisModule_PoolAlloc(ctx, *len + 1);
+    va_start(args, fmt);
+    vsnprintf(key, *len + 1, fmt, args);
+    va_end(args);
+    return key;
+}
+
+// Returns array with room for one more element past count, grown in the pool of ctx if needed
+static void *PoolReserve(RedisModuleCtx *ctx,
+                         void *array,
+                         size_t count,
+                         size_t *capacity,
+                         size_t size) {
+    if (count < *capacity) {
+        return array;
+    }
+    *capacity = *capacity ? *capacity * 2 : 16;
+    void *grown = RedisModule_PoolAlloc(ctx, *capacity * size);
+    if (count > 0) {
+        memcpy(grown, array, count * size);
+    }
+    return grown;
+}
+
+static int parsePatternPredicate(RedisModuleCtx *ctx,
+                                 char *labelstr,
+                                 QueryPredicate *retQuery,
+                                 const char *separator) {
+    // The pattern is taken verbatim, it may contain any of the separator characters
+    char *sep = strstr(labelstr, separator);
+    char *pattern = sep + strlen(separator);
+    if (sep == labelstr || *pattern == '\0') {
+        return TSDB_ERROR;
+    }
+    if (retQuery->type == REGEX_MATCH) {
+        regex_t regex;
+        if (CompileLabelRegex(pattern, &regex) != TSDB_OK) {
+            return TSDB_ERROR;
+        }
+        regfree(&regex);
+    }
+    retQuery->key = RedisModule_CreateString(ctx, labelstr, sep - labelstr);
+    retQuery->valueListCount = 1;
+    retQuery->valuesList = RedisModule_PoolAlloc(ctx, sizeof(RedisModuleString *));
+    retQuery->valuesList[0] = RedisModule_CreateString(ctx, pattern, strlen(pattern));
+    return TSDB_OK;
+}
+
 int parsePredicate(RedisModuleCtx *ctx,
                    RedisModuleString *label,
                    QueryPredicate *retQuery,
@@ -47,6 +241,10 @@ int parsePredicate(RedisModuleCtx *ctx,
     labelstr[_s] = '\0';
     strncpy(labelstr, labelRaw, _s);
 
+    if (retQuery->type == PREFIX_MATCH || retQuery->type == REGEX_MATCH) {
+        return parsePatternPredicate(ctx, labelstr, retQuery, separator);
+    }
+
     // Extract key
     token = strtok_r(labelstr, separator, &iter_ptr);
     if (token == NULL) {
@@ -112,26 +310,168 @@ int CountPredicateType(QueryPredicate *queries, size_t query_count, PredicateTyp
     return count;
 }
 
-void indexUnderKey(INDEXER_OPERATION_T op, RedisModuleString *key, RedisModuleString *ts_key) {
+int CountMatcherPredicates(QueryPredicate *queries, size_t query_count) {
+    return CountPredicateType(queries, query_count, EQ) +
+           CountPredicateType(queries, query_count, LIST_MATCH) +
+           CountPredicateType(queries, query_count, PREFIX_MATCH) +
+           CountPredicateType(queries, query_count, REGEX_MATCH);
+}
+
+static u_int32_t AcquireSeriesId(RedisModuleString *ts_key, void *handle) {
+    int nokey = 0;
+    void *value = RedisModule_DictGet(seriesIdsByKey, ts_key, &nokey);
+    if (!nokey) {
+        u_int32_t id = (u_int32_t)(uintptr_t)value;
+        seriesIdEntries[id].refs++;
+        seriesIdEntries[id].handle = handle;
+        seriesIdEntries[id].isVolatile = true;
+        return id;
+    }
+
+    u_int32_t id;
+    if (freeSeriesIdsCount > 0) {
+        id = freeSeriesIds[--freeSeriesIdsCount];
+    } else {
+        if (seriesIdCount == seriesIdCapacity) {
+            seriesIdCapacity = seriesIdCapacity ? seriesIdCapacity * 2 : 1024;
+            seriesIdEntries = realloc(seriesIdEntries, seriesIdCapacity * sizeof(SeriesIdEntry));
+        }
+        id = (u_int32_t)seriesIdCount++;
+    }
+    seriesIdEntries[id].keyName = RedisModule_CreateStringFromString(NULL, ts_key);
+    seriesIdEntries[id].refs = 1;
+    seriesIdEntries[id].handle = handle;
+    seriesIdEntries[id].isVolatile = true;
+    RedisModule_DictSet(seriesIdsByKey, ts_key, (void *)(uintptr_t)id);
+    return id;
+}
+
+static bool LookupSeriesId(RedisModuleString *ts_key, u_int32_t *id) {
+    int nokey = 0;
+    void *value = RedisModule_DictGet(seriesIdsByKey, ts_key, &nokey);
+    if (nokey) {
+        return false;
+    }
+    *id = (u_int32_t)(uintptr_t)value;
+    return true;
+}
+
+static void ReleaseSeriesId(u_int32_t id) {
+    SeriesIdEntry *entry = &seriesIdEntries[id];
+    if (--entry->refs > 0) {
+        // The name is still indexed in another database, its series can't be told apart
+        entry->handle = NULL;
+        return;
+    }
+    RedisModule_DictDel(seriesIdsByKey, entry->keyName, NULL);
+    RedisModule_FreeString(NULL, entry->keyName);
+    entry->keyName = NULL;
+    entry->handle = NULL;
+
+    if (freeSeriesIdsCount == freeSeriesIdsCapacity) {
+        freeSeriesIdsCapacity = freeSeriesIdsCapacity ? freeSeriesIdsCapacity * 2 : 64;
+        freeSeriesIds = realloc(freeSeriesIds, freeSeriesIdsCapacity * sizeof(u_int32_t));
+    }
+    freeSeriesIds[freeSeriesIdsCount++] = id;
+}
+
+/*
+ * Return the first position at or after `from` whose ID is >= id. The range is first bracketed
+ * with exponentially growing steps and then binary searched, so seeking a short distance is cheap
+ * and a long skip costs O(log distance).
+ */
+static size_t PostingListSeek(const PostingList *list, size_t from, u_int32_t id) {
+    size_t lo = from, hi = from, step = 1;
+    while (hi < list->count && list->ids[hi] < id) {
+        lo = hi + 1;
+        hi += step;
+        step <<= 1;
+    }
+    if (hi > list->count) {
+        hi = list->count;
+    }
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (list->ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void PostingListInsert(PostingList *list, u_int32_t id) {
+    size_t pos = list->count;
+    if (list->count > 0 && list->ids[list->count - 1] >= id) {
+        pos = PostingListSeek(list, 0, id);
+        if (list->ids[pos] == id) {
+            return;
+        }
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 4;
+        list->ids = realloc(list->ids, list->capacity * sizeof(u_int32_t));
+    }
+    memmove(&list->ids[pos + 1], &list->ids[pos], (list->count - pos) * sizeof(u_int32_t));
+    list->ids[pos] = id;
+    list->count++;
+}
+
+static void PostingListRemove(PostingList *list, u_int32_t id) {
+    size_t pos = PostingListSeek(list, 0, id);
+    if (pos == list->count || list->ids[pos] != id) {
+        return;
+    }
+    memmove(&list->ids[pos], &list->ids[pos + 1], (list->count - pos - 1) * sizeof(u_int32_t));
+    list->count--;
+}
+
+uint64_t IndexVersion() {
+    return indexVersion;
+}
+
+void indexUnderKey(INDEXER_OPERATION_T op, RedisModuleString *key, u_int32_t id) {
+    indexVersion++;
     int nokey = 0;
-    RedisModuleDict *leaf = RedisModule_DictGet(labelsIndex, key, &nokey);
+    PostingList *leaf = RedisModule_DictGet(labelsIndex, key, &nokey);
     if (nokey) {
-        leaf = RedisModule_CreateDict(NULL);
+        if (op == Indexer_Remove) {
+            return;
+        }
+        leaf = calloc(1, sizeof(PostingList));
         RedisModule_DictSet(labelsIndex, key, leaf);
     }
 
     if (op == Indexer_Add) {
-        RedisModule_DictSet(leaf, ts_key, NULL);
+        PostingListInsert(leaf, id);
     } else if (op == Indexer_Remove) {
-        RedisModule_DictDel(leaf, ts_key, NULL);
+        PostingListRemove(leaf, id);
+        if (leaf->count == 0) {
+            RedisModule_DictDel(labelsIndex, key, NULL);
+            free(leaf->ids);
+            free(leaf);
+        }
     }
 }
 
 void IndexOperation(RedisModuleCtx *ctx,
                     INDEXER_OPERATION_T op,
                     RedisModuleString *ts_key,
+                    void *handle,
                     Label *labels,
                     size_t labels_count) {
+    if (labels_count == 0) {
+        return;
+    }
+
+    u_int32_t id;
+    if (op == Indexer_Add) {
+        id = AcquireSeriesId(ts_key, handle);
+    } else if (!LookupSeriesId(ts_key, &id)) {
+        return;
+    }
+
     const char *key_string, *value_string;
     for (int i = 0; i < labels_count; i++) {
         size_t _s;
@@ -141,227 +481,704 @@ void IndexOperation(RedisModuleCtx *ctx,
             RedisModule_CreateStringPrintf(ctx, KV_PREFIX, key_string, value_string);
         RedisModuleString *indexed_key = RedisModule_CreateStringPrintf(ctx, K_PREFIX, key_string);
 
-        indexUnderKey(op, indexed_key_value, ts_key);
-        indexUnderKey(op, indexed_key, ts_key);
+        indexUnderKey(op, indexed_key_value, id);
+        indexUnderKey(op, indexed_key, id);
 
         RedisModule_FreeString(ctx, indexed_key_value);
         RedisModule_FreeString(ctx, indexed_key);
     }
+
+    if (op == Indexer_Remove) {
+        ReleaseSeriesId(id);
+    }
 }
 
 void IndexMetric(RedisModuleCtx *ctx,
                  RedisModuleString *ts_key,
+                 void *handle,
                  Label *labels,
                  size_t labels_count) {
-    IndexOperation(ctx, Indexer_Add, ts_key, labels, labels_count);
+    IndexOperation(ctx, Indexer_Add, ts_key, handle, labels, labels_count);
+}
+
+// Series indexed together by IndexMetrics, bounding the memory of the label index entries
+#define INDEX_BULK_BATCH_SIZE 16384
+
+// A label index entry name and the ID to add to its posting list
+typedef struct BulkIndexEntry
+{
+    size_t nameOffset;
+    size_t nameLen;
+    u_int32_t id;
+} BulkIndexEntry;
+
+static const char *bulkNames;
+
+static int CompareBulkIndexEntries(const void *a, const void *b) {
+    const BulkIndexEntry *left = a, *right = b;
+    int cmp = memcmp(bulkNames + left->nameOffset,
+                     bulkNames + right->nameOffset,
+                     min(left->nameLen, right->nameLen));
+    if (cmp != 0) {
+        return cmp;
+    }
+    if (left->nameLen != right->nameLen) {
+        return left->nameLen < right->nameLen ? -1 : 1;
+    }
+    return left->id < right->id ? -1 : left->id > right->id;
+}
+
+static void IndexMetricsBatch(const IndexedMetric *metrics, size_t count) {
+    indexVersion++;
+    size_t entriesCount = 0, namesSize = 0;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < metrics[i].labelsCount; j++) {
+            const char *key = RedisModule_StringPtrLen(metrics[i].labels[j].key, NULL);
+            const char *value = RedisModule_StringPtrLen(metrics[i].labels[j].value, NULL);
+            namesSize += snprintf(NULL, 0, KV_PREFIX, key, value) + 1;
+            namesSize += snprintf(NULL, 0, K_PREFIX, key) + 1;
+            entriesCount += 2;
+        }
+    }
+    if (entriesCount == 0) {
+        return;
+    }
+
+    // the names are formatted like IndexOperation does
+    char *names = malloc(namesSize);
+    BulkIndexEntry *entries = malloc(entriesCount * sizeof(BulkIndexEntry));
+    size_t offset = 0, n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (metrics[i].labelsCount == 0) {
+            continue;
+        }
+        u_int32_t id = AcquireSeriesId(metrics[i].keyName, metrics[i].handle);
+        for (size_t j = 0; j < metrics[i].labelsCount; j++) {
+            const char *key = RedisModule_StringPtrLen(metrics[i].labels[j].key, NULL);
+            const char *value = RedisModule_StringPtrLen(metrics[i].labels[j].value, NULL);
+            size_t len = sprintf(names + offset, KV_PREFIX, key, value);
+            entries[n++] = (BulkIndexEntry){ .nameOffset = offset, .nameLen = len, .id = id };
+            offset += len + 1;
+            len = sprintf(names + offset, K_PREFIX, key);
+            entries[n++] = (BulkIndexEntry){ .nameOffset = offset, .nameLen = len, .id = id };
+            offset += len + 1;
+        }
+    }
+
+    bulkNames = names;
+    qsort(entries, n, sizeof(BulkIndexEntry), CompareBulkIndexEntries);
+    bulkNames = NULL;
+
+    for (size_t i = 0; i < n;) {
+        size_t end = i + 1;
+        while (end < n && entries[end].nameLen == entries[i].nameLen &&
+               memcmp(names + entries[end].nameOffset,
+                      names + entries[i].nameOffset,
+                      entries[i].nameLen) == 0) {
+            end++;
+        }
+
+        char *name = names + entries[i].nameOffset;
+        int nokey = 0;
+        PostingList *leaf = RedisModule_DictGetC(labelsIndex, name, entries[i].nameLen, &nokey);
+        if (nokey) {
+            leaf = calloc(1, sizeof(PostingList));
+            RedisModule_DictSetC(labelsIndex, name, entries[i].nameLen, leaf);
+        }
+        if (leaf->capacity < leaf->count + (end - i)) {
+            leaf->capacity = leaf->count + (end - i);
+            leaf->ids = realloc(leaf->ids, leaf->capacity * sizeof(u_int32_t));
+        }
+        // the IDs are sorted, new ones past the end of the list are appended
+        for (; i < end; i++) {
+            u_int32_t id = entries[i].id;
+            if (leaf->count == 0 || leaf->ids[leaf->count - 1] < id) {
+                leaf->ids[leaf->count++] = id;
+            } else {
+                PostingListInsert(leaf, id);
+            }
+        }
+    }
+
+    free(entries);
+    free(names);
+}
+
+void IndexMetrics(const IndexedMetric *metrics, size_t count) {
+    for (size_t i = 0; i < count; i += INDEX_BULK_BATCH_SIZE) {
+        IndexMetricsBatch(metrics + i, min(count - i, INDEX_BULK_BATCH_SIZE));
+    }
 }
 
 void RemoveIndexedMetric(RedisModuleCtx *ctx,
                          RedisModuleString *ts_key,
                          Label *labels,
                          size_t labels_count) {
-    IndexOperation(ctx, Indexer_Remove, ts_key, labels, labels_count);
+    IndexOperation(ctx, Indexer_Remove, ts_key, NULL, labels, labels_count);
+}
+
+void IndexUseSeriesHandles(bool enabled) {
+    useSeriesHandles = enabled;
+}
+
+void IndexSetSeriesVolatile(RedisModuleString *ts_key, bool isVolatile) {
+    u_int32_t id;
+    if (LookupSeriesId(ts_key, &id) && seriesIdEntries[id].isVolatile != isVolatile) {
+        seriesIdEntries[id].isVolatile = isVolatile;
+        indexVersion++;
+    }
+}
+
+void IndexSetAllSeriesVolatile() {
+    indexVersion++;
+    for (size_t id = 0; id < seriesIdCount; id++) {
+        seriesIdEntries[id].isVolatile = true;
+    }
+}
+
+void RenameIndexedMetric(RedisModuleCtx *ctx,
+                         RedisModuleString *from_key,
+                         RedisModuleString *to_key,
+                         Label *labels,
+                         size_t labels_count) {
+    u_int32_t id;
+    int nokey = 0;
+    RedisModule_DictGet(seriesIdsByKey, to_key, &nokey);
+    if (!nokey || !LookupSeriesId(from_key, &id) || seriesIdEntries[id].refs > 1) {
+        // Either name is shared with a series in another database, reindex under the new name
+        void *handle = LookupSeriesId(from_key, &id) ? seriesIdEntries[id].handle : NULL;
+        RemoveIndexedMetric(ctx, from_key, labels, labels_count);
+        IndexMetric(ctx, to_key, handle, labels, labels_count);
+        return;
+    }
+
+    // The posting lists only hold the ID, so renaming just remaps the ID to the new name
+    indexVersion++;
+    SeriesIdEntry *entry = &seriesIdEntries[id];
+    RedisModule_DictDel(seriesIdsByKey, from_key, NULL);
+    RedisModule_DictSet(seriesIdsByKey, to_key, (void *)(uintptr_t)id);
+    RedisModule_FreeString(NULL, entry->keyName);
+    entry->keyName = RedisModule_CreateStringFromString(NULL, to_key);
 }
 
-void _union(RedisModuleCtx *ctx, RedisModuleDict *dest, RedisModuleDict *src) {
+static void _union(PostingList *dest, const PostingList *left, const PostingList *right) {
     /*
-     * Copy all elements from src to dest
+     * Merge two sorted posting lists into dest, which has room for both
      */
-    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(src, "^", NULL, 0);
-    RedisModuleString *currentKey;
-    while ((currentKey = RedisModule_DictNext(ctx, iter, NULL)) != NULL) {
-        RedisModule_DictSet(dest, currentKey, (void *)1);
+    size_t i = 0, j = 0, n = 0;
+    while (i < left->count && j < right->count) {
+        if (left->ids[i] < right->ids[j]) {
+            dest->ids[n++] = left->ids[i++];
+        } else if (left->ids[i] > right->ids[j]) {
+            dest->ids[n++] = right->ids[j++];
+        } else {
+            dest->ids[n++] = left->ids[i++];
+            j++;
+        }
     }
-    RedisModule_DictIteratorStop(iter);
+    while (i < left->count) {
+        dest->ids[n++] = left->ids[i++];
+    }
+    while (j < right->count) {
+        dest->ids[n++] = right->ids[j++];
+    }
+    dest->count = n;
 }
 
-void _intersect(RedisModuleCtx *ctx, RedisModuleDict *left, RedisModuleDict *right) {
-    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(left, "^", NULL, 0);
-    char *currentKey;
-    size_t currentKeyLen;
-    while ((currentKey = RedisModule_DictNextC(iter, &currentKeyLen, NULL)) != NULL) {
-        int doesNotExist = 0;
-        RedisModule_DictGetC(right, currentKey, currentKeyLen, &doesNotExist);
-        if (doesNotExist == 0) {
-            continue;
+static size_t _intersect(u_int32_t *ids, size_t count, const PostingList *right) {
+    // ids is the running result and is never larger than the lists it was intersected with, so
+    // galloping through right skips the IDs that cannot match in O(log distance).
+    size_t n = 0, pos = 0;
+    for (size_t i = 0; i < count && pos < right->count; i++) {
+        pos = PostingListSeek(right, pos, ids[i]);
+        if (pos < right->count && right->ids[pos] == ids[i]) {
+            ids[n++] = ids[i];
         }
-        RedisModule_DictDelC(left, currentKey, currentKeyLen, NULL);
-        RedisModule_DictIteratorReseekC(iter, ">", currentKey, currentKeyLen);
     }
-    RedisModule_DictIteratorStop(iter);
+    return n;
 }
 
-void _difference(RedisModuleCtx *ctx, RedisModuleDict *left, RedisModuleDict *right) {
-    if (RedisModule_DictSize(right) == 0) {
+static size_t _difference(u_int32_t *ids, size_t count, const PostingList *right) {
+    if (right->count == 0) {
         // the right leaf is empty, this means that the diff is basically no-op since the left will
         // remain intact.
-        return;
+        return count;
+    }
+
+    size_t n = 0, pos = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (pos < right->count) {
+            pos = PostingListSeek(right, pos, ids[i]);
+        }
+        if (pos == right->count || right->ids[pos] != ids[i]) {
+            ids[n++] = ids[i];
+        }
     }
+    return n;
+}
 
-    // iterating over the left dict (which is always smaller) will allow us to have less data to
-    // iterate over
-    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(left, "^", NULL, 0);
+static void UnionPostingLists(RedisModuleCtx *ctx,
+                              PostingList *lists,
+                              size_t count,
+                              PostingList *result) {
+    /*
+     * Union the lists pairwise, level by level, so each ID is copied O(log count) times. The
+     * lists array is used as scratch space.
+     */
+    size_t listsCount = count;
+    while (count > 1) {
+        size_t merged = 0;
+        for (size_t i = 0; i + 1 < count; i += 2) {
+            PostingList dest = { 0 };
+            dest.ids = RedisModule_PoolAlloc(
+                ctx, (lists[i].count + lists[i + 1].count) * sizeof(u_int32_t));
+            _union(&dest, &lists[i], &lists[i + 1]);
+            lists[merged++] = dest;
+        }
+        if (count % 2 == 1) {
+            lists[merged++] = lists[count - 1];
+        }
+        count = merged;
+    }
+    *result = count == 1 ? lists[0] : (PostingList){ 0 };
+    TRACE_PROBE2(index_union, listsCount, result->count);
+}
 
+static int CompileLabelRegex(const char *pattern, regex_t *regex) {
+    // The pattern must match the whole label value
+    size_t len = strlen(pattern);
+    char *anchored = malloc(len + 5);
+    anchored[0] = '^';
+    anchored[1] = '(';
+    memcpy(anchored + 2, pattern, len);
+    memcpy(anchored + 2 + len, ")$", 3);
+    int rc = regcomp(regex, anchored, REG_EXTENDED | REG_NOSUB);
+    free(anchored);
+    return rc == 0 ? TSDB_OK : TSDB_ERROR;
+}
+
+static size_t RegexLiteralPrefix(const char *pattern, char *prefix) {
+    /*
+     * Copy the literal characters every match of the pattern must start with, so only the values
+     * sharing them are scanned.
+     */
+    size_t len = 0;
+    prefix[0] = '\0';
+    if (strchr(pattern, '|') != NULL) {
+        return 0;
+    }
+    for (const char *p = pattern; *p != '\0'; p++) {
+        if (strchr(".[]()*+?{}^$\\", *p) != NULL) {
+            // the literal right before an optional quantifier may be absent
+            if (len > 0 && strchr("*?{", *p) != NULL) {
+                len--;
+            }
+            break;
+        }
+        prefix[len++] = *p;
+    }
+    prefix[len] = '\0';
+    return len;
+}
+
+static size_t ScanPredicateValues(RedisModuleCtx *ctx,
+                                  QueryPredicate *predicate,
+                                  PostingList **result) {
+    /*
+     * labelsIndex is ordered by index key, so all the values of a label sharing a prefix are
+     * adjacent. Only that range is visited, and for a regex each value in it is matched against
+     * the pattern. Return the number of matching index entries, copied to result.
+     */
+    const char *key = RedisModule_StringPtrLen(predicate->key, NULL);
+    const char *pattern = RedisModule_StringPtrLen(predicate->valuesList[0], NULL);
+    const bool isRegex = predicate->type == REGEX_MATCH;
+    regex_t regex;
+    char *literal = RedisModule_PoolAlloc(ctx, strlen(pattern) + 1);
+
+    if (isRegex) {
+        if (CompileLabelRegex(pattern, &regex) != TSDB_OK) {
+            *result = NULL;
+            return 0;
+        }
+        RegexLiteralPrefix(pattern, literal);
+    } else {
+        strcpy(literal, pattern);
+    }
+
+    size_t labelPrefixLen, scanPrefixLen;
+    PoolIndexKey(ctx, &labelPrefixLen, KV_PREFIX, key, "");
+    const char *scanPrefix = PoolIndexKey(ctx, &scanPrefixLen, KV_PREFIX, key, literal);
+
+    PostingList *lists = NULL;
+    size_t listsCount = 0, listsCapacity = 0;
+    char *value = NULL;
+    size_t valueCapacity = 0;
+
+    RedisModuleDictIter *iter =
+        RedisModule_DictIteratorStartC(labelsIndex, ">=", (void *)scanPrefix, scanPrefixLen);
     char *currentKey;
     size_t currentKeyLen;
-    while ((currentKey = RedisModule_DictNextC(iter, &currentKeyLen, NULL)) != NULL) {
-        int doesNotExist = 0;
-        RedisModule_DictGetC(right, currentKey, currentKeyLen, &doesNotExist);
-        if (doesNotExist == 1) {
-            continue;
+    PostingList *currentLeaf;
+    while ((currentKey = RedisModule_DictNextC(iter, &currentKeyLen, (void **)&currentLeaf)) !=
+           NULL) {
+        if (currentKeyLen < scanPrefixLen || memcmp(currentKey, scanPrefix, scanPrefixLen) != 0) {
+            break;
         }
-        RedisModule_DictDelC(left, currentKey, currentKeyLen, NULL);
-        RedisModule_DictIteratorReseekC(iter, ">", currentKey, currentKeyLen);
+        if (isRegex) {
+            size_t valueLen = currentKeyLen - labelPrefixLen;
+            if (valueLen + 1 > valueCapacity) {
+                valueCapacity = valueLen + 1 > valueCapacity * 2 ? valueLen + 1 : valueCapacity * 2;
+                value = RedisModule_PoolAlloc(ctx, valueCapacity);
+            }
+            memcpy(value, currentKey + labelPrefixLen, valueLen);
+            value[valueLen] = '\0';
+            if (regexec(&regex, value, 0, NULL, 0) != 0) {
+                continue;
+            }
+        }
+        lists = PoolReserve(ctx, lists, listsCount, &listsCapacity, sizeof(PostingList));
+        lists[listsCount++] = *currentLeaf;
     }
     RedisModule_DictIteratorStop(iter);
+
+    *result = lists;
+    if (isRegex) {
+        regfree(&regex);
+    }
+    return listsCount;
 }
 
-RedisModuleDict *GetPredicateKeysDict(RedisModuleCtx *ctx, QueryPredicate *predicate) {
-    /*
-     * Return the dictionary of all the keys that match the predicate.
-     */
-    RedisModuleDict *currentLeaf = NULL;
-    RedisModuleString *index_key;
-    size_t _s;
-    const char *key = RedisModule_StringPtrLen(predicate->key, &_s);
-    const char *value;
+/*
+ * A predicate resolved to the index entries it matches, whose union is only materialized when
+ * that is cheaper than looking the candidates up in each entry. The estimate is the number of
+ * series the predicate may match: the sum of the entry lengths, or the number of series carrying
+ * the label for a pattern that wasn't scanned yet.
+ */
+typedef struct PredicatePlan
+{
+    QueryPredicate *predicate;
+    bool isMatcher;
+    bool resolved;
+    PostingList *lists;
+    size_t listsCount;
+    size_t estimate;
+} PredicatePlan;
+
+static inline bool IsMatcherPredicate(const QueryPredicate *predicate) {
+    return predicate->type == EQ || predicate->type == CONTAINS || predicate->type == LIST_MATCH ||
+           predicate->type == PREFIX_MATCH || predicate->type == REGEX_MATCH;
+}
+
+static inline bool IsPatternPredicate(const QueryPredicate *predicate) {
+    return predicate->type == PREFIX_MATCH || predicate->type == REGEX_MATCH;
+}
 
+static PostingList *GetLabelPostingList(RedisModuleCtx *ctx, const char *key) {
     int nokey;
+    size_t len;
+    const char *index_key = PoolIndexKey(ctx, &len, K_PREFIX, key);
+    return RedisModule_DictGetC(labelsIndex, (void *)index_key, len, &nokey);
+}
+
+static void ResolvePredicate(RedisModuleCtx *ctx, PredicatePlan *plan) {
+    QueryPredicate *predicate = plan->predicate;
+    const char *key = RedisModule_StringPtrLen(predicate->key, NULL);
+    plan->resolved = true;
+    plan->listsCount = 0;
+    plan->estimate = 0;
 
     if (predicate->type == NCONTAINS || predicate->type == CONTAINS) {
-        index_key = RedisModule_CreateStringPrintf(
-            ctx, K_PREFIX, RedisModule_StringPtrLen(predicate->key, &_s));
-        currentLeaf = RedisModule_DictGet(labelsIndex, index_key, &nokey);
-    } else { // one or more entries
-        RedisModuleDict *singleEntryLeaf;
-        int unioned_count = 0;
+        PostingList *leaf = GetLabelPostingList(ctx, key);
+        if (leaf != NULL) {
+            plan->lists = leaf;
+            plan->listsCount = 1;
+            plan->estimate = leaf->count;
+        }
+        return;
+    }
+
+    if (IsPatternPredicate(predicate)) {
+        plan->listsCount = ScanPredicateValues(ctx, predicate, &plan->lists);
+    } else {
+        plan->lists = RedisModule_PoolAlloc(ctx, predicate->valueListCount * sizeof(PostingList));
         for (int i = 0; i < predicate->valueListCount; i++) {
-            value = RedisModule_StringPtrLen(predicate->valuesList[i], &_s);
-            index_key = RedisModule_CreateStringPrintf(ctx, KV_PREFIX, key, value);
-            singleEntryLeaf = RedisModule_DictGet(labelsIndex, index_key, &nokey);
-            if (singleEntryLeaf != NULL) {
-                // if there's only 1 item left to fetch from the index we can just return it
-                if (unioned_count == 0 && predicate->valueListCount - i == 1) {
-                    return singleEntryLeaf;
-                }
-                if (currentLeaf == NULL) {
-                    currentLeaf = RedisModule_CreateDict(ctx);
-                }
-                _union(ctx, currentLeaf, singleEntryLeaf);
-                unioned_count++;
+            const char *value = RedisModule_StringPtrLen(predicate->valuesList[i], NULL);
+            size_t len;
+            const char *index_key = PoolIndexKey(ctx, &len, KV_PREFIX, key, value);
+            int nokey;
+            PostingList *leaf = RedisModule_DictGetC(labelsIndex, (void *)index_key, len, &nokey);
+            if (leaf != NULL) {
+                plan->lists[plan->listsCount++] = *leaf;
             }
         }
     }
-    return currentLeaf;
+    for (size_t i = 0; i < plan->listsCount; i++) {
+        plan->estimate += plan->lists[i].count;
+    }
 }
 
-RedisModuleDict *QueryIndexPredicate(RedisModuleCtx *ctx,
-                                     QueryPredicate *predicate,
-                                     RedisModuleDict *prevResults) {
-    RedisModuleDict *localResult = RedisModule_CreateDict(ctx);
-    RedisModuleDict *currentLeaf;
-
-    currentLeaf = GetPredicateKeysDict(ctx, predicate);
+static void PlanPredicate(RedisModuleCtx *ctx, QueryPredicate *predicate, PredicatePlan *plan) {
+    *plan = (PredicatePlan){ .predicate = predicate, .isMatcher = IsMatcherPredicate(predicate) };
+    if (!IsPatternPredicate(predicate)) {
+        ResolvePredicate(ctx, plan);
+        return;
+    }
+    // scanning the values of a label may be costly, it is deferred until the pattern is applied
+    PostingList *leaf = GetLabelPostingList(ctx, RedisModule_StringPtrLen(predicate->key, NULL));
+    plan->estimate = leaf != NULL ? leaf->count : 0;
+}
 
-    if (currentLeaf != NULL) {
-        // Copy everything to new dict only in case this is the first predicate.
-        // In the next iteration, when prevResults is no longer NULL, there is
-        // no need to copy again. We can work on currentLeaf, since only the left dict is being
-        // changed during intersection / difference.
-        if (prevResults == NULL) {
-            RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(currentLeaf, "^", NULL, 0);
-            RedisModuleString *currentKey;
-            while ((currentKey = RedisModule_DictNext(ctx, iter, NULL)) != NULL) {
-                RedisModule_DictSet(localResult, currentKey, (void *)1);
-            }
-            RedisModule_DictIteratorStop(iter);
-        } else {
-            localResult = currentLeaf;
-        }
-    }
-
-    if (prevResults != NULL) {
-        if (predicate->type == EQ || predicate->type == CONTAINS) {
-            _intersect(ctx, prevResults, localResult);
-        } else if (predicate->type == LIST_MATCH) {
-            _intersect(ctx, prevResults, localResult);
-        } else if (predicate->type == LIST_NOTMATCH) {
-            _difference(ctx, prevResults, localResult);
-        } else if (predicate->type == NCONTAINS) {
-            _difference(ctx, prevResults, localResult);
-        } else if (predicate->type == NEQ) {
-            _difference(ctx, prevResults, localResult);
-        }
-        return prevResults;
-    } else if (predicate->type == EQ || predicate->type == CONTAINS ||
-               predicate->type == LIST_MATCH) {
-        return localResult;
-    } else {
-        return prevResults; // always NULL
+static int ComparePredicatePlans(const void *a, const void *b) {
+    /*
+     * Matchers come first, the most selective one first so the candidates are as few as possible.
+     * The negations follow, those excluding the most series first.
+     */
+    const PredicatePlan *left = a, *right = b;
+    if (left->isMatcher != right->isMatcher) {
+        return left->isMatcher ? -1 : 1;
     }
+    if (left->estimate == right->estimate) {
+        return 0;
+    }
+    return (left->estimate < right->estimate) == left->isMatcher ? -1 : 1;
 }
 
-void PromoteSmallestPredicateToFront(RedisModuleCtx *ctx,
-                                     QueryPredicate *index_predicate,
-                                     size_t predicate_count) {
+static size_t FilterCandidates(RedisModuleCtx *ctx,
+                               u_int32_t *ids,
+                               size_t count,
+                               PredicatePlan *plan) {
     /*
-     * Find the predicate that has the minimal amount of keys that match to it, and move it to the
-     * beginning of the predicate list so we will start our calculation from the smallest predicate.
-     * This is an optimization, so we will copy the smallest dict possible.
+     * Keep the candidates the predicate matches, or doesn't for a negation. A single entry is
+     * galloped through. With several entries, each candidate is looked up in all of them unless
+     * materializing their union costs less.
      */
-    if (predicate_count > 1) {
-        int minIndex = 0;
-        unsigned int minDictSize = UINT_MAX;
-        for (int i = 0; i < predicate_count; i++) {
-            RedisModuleDict *currentPredicateKeys = GetPredicateKeysDict(ctx, &index_predicate[i]);
-            int currentDictSize =
-                (currentPredicateKeys != NULL) ? RedisModule_DictSize(currentPredicateKeys) : 0;
-            if (currentDictSize < minDictSize) {
-                minIndex = i;
-                minDictSize = currentDictSize;
-            }
+    if (plan->listsCount == 0) {
+        return plan->isMatcher ? 0 : count;
+    }
+    if (plan->listsCount > 1 && count * plan->listsCount > plan->estimate) {
+        PostingList merged;
+        UnionPostingLists(ctx, plan->lists, plan->listsCount, &merged);
+        plan->lists[0] = merged;
+        plan->listsCount = 1;
+    }
+    if (plan->listsCount == 1) {
+        return plan->isMatcher ? _intersect(ids, count, &plan->lists[0])
+                               : _difference(ids, count, &plan->lists[0]);
+    }
+
+    size_t *positions = RedisModule_PoolAlloc(ctx, plan->listsCount * sizeof(size_t));
+    memset(positions, 0, plan->listsCount * sizeof(size_t));
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        bool found = false;
+        for (size_t j = 0; j < plan->listsCount && !found; j++) {
+            const PostingList *list = &plan->lists[j];
+            positions[j] = PostingListSeek(list, positions[j], ids[i]);
+            found = positions[j] < list->count && list->ids[positions[j]] == ids[i];
         }
+        if (found == plan->isMatcher) {
+            ids[n++] = ids[i];
+        }
+    }
+    return n;
+}
+
+static int CompareKeyNames(const void *a, const void *b) {
+    size_t leftLen, rightLen;
+    const char *left =
+        RedisModule_StringPtrLen(seriesIdEntries[*(const u_int32_t *)a].keyName, &leftLen);
+    const char *right =
+        RedisModule_StringPtrLen(seriesIdEntries[*(const u_int32_t *)b].keyName, &rightLen);
+    int cmp = memcmp(left, right, min(leftLen, rightLen));
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (leftLen > rightLen) - (leftLen < rightLen);
+}
 
-        // switch between the minimal predicate and the predicate in the first place
-        if (minIndex != 0) {
-            QueryPredicate temp = index_predicate[minIndex];
-            index_predicate[minIndex] = index_predicate[0];
-            index_predicate[0] = temp;
+/*
+ * Return the sorted IDs of the series matching all the predicates, owned by ctx, and set count to
+ * their number. candidates is set to the number the most selective matcher started from.
+ */
+static u_int32_t *MatchSeriesIds(RedisModuleCtx *ctx,
+                                 QueryPredicate *index_predicate,
+                                 size_t predicate_count,
+                                 size_t *result_count,
+                                 size_t *candidates_count) {
+    *result_count = 0;
+    *candidates_count = 0;
+    PredicatePlan *plans = RedisModule_PoolAlloc(ctx, predicate_count * sizeof(PredicatePlan));
+    for (size_t i = 0; i < predicate_count; i++) {
+        PlanPredicate(ctx, &index_predicate[i], &plans[i]);
+    }
+    // a pattern may match far fewer series than its label estimate, replan once it is scanned
+    while (true) {
+        qsort(plans, predicate_count, sizeof(PredicatePlan), ComparePredicatePlans);
+        if (!plans[0].isMatcher || plans[0].estimate == 0) {
+            return NULL;
         }
+        if (plans[0].resolved) {
+            break;
+        }
+        ResolvePredicate(ctx, &plans[0]);
     }
+
+    // the candidates start as the most selective matcher, the others only filter them
+    PostingList first;
+    UnionPostingLists(ctx, plans[0].lists, plans[0].listsCount, &first);
+    size_t count = first.count;
+    u_int32_t *ids = RedisModule_PoolAlloc(ctx, count * sizeof(u_int32_t));
+    memcpy(ids, first.ids, count * sizeof(u_int32_t));
+
+    for (size_t i = 1; i < predicate_count && count > 0; i++) {
+        if (!plans[i].resolved) {
+            ResolvePredicate(ctx, &plans[i]);
+        }
+        size_t candidates = count;
+        count = FilterCandidates(ctx, ids, count, &plans[i]);
+        TRACE_PROBE4(index_filter, plans[i].isMatcher, plans[i].listsCount, candidates, count);
+    }
+    *candidates_count = first.count;
+    *result_count = count;
+    return ids;
 }
-RedisModuleDict *QueryIndex(RedisModuleCtx *ctx,
-                            QueryPredicate *index_predicate,
-                            size_t predicate_count) {
-    RedisModuleDict *result = NULL;
-
-    PromoteSmallestPredicateToFront(ctx, index_predicate, predicate_count);
-
-    // EQ or Contains
-    for (int i = 0; i < predicate_count; i++) {
-        if (index_predicate[i].type == EQ || index_predicate[i].type == CONTAINS ||
-            index_predicate[i].type == LIST_MATCH) {
-            result = QueryIndexPredicate(ctx, &index_predicate[i], result);
-            if (result == NULL) {
-                return RedisModule_CreateDict(ctx);
-            }
+
+RedisModuleString **QueryIndex(RedisModuleCtx *ctx,
+                               QueryPredicate *index_predicate,
+                               size_t predicate_count,
+                               size_t *result_count,
+                               void ***handles) {
+    *result_count = 0;
+    if (predicate_count == 0) {
+        return NULL;
+    }
+    TRACE_PROBE1(index_query_start, predicate_count);
+
+    size_t count, candidates;
+    u_int32_t *ids = MatchSeriesIds(ctx, index_predicate, predicate_count, &count, &candidates);
+    if (count == 0) {
+        TRACE_PROBE2(index_query_done, candidates, 0);
+        return NULL;
+    }
+
+    // Copy the key names out, the registry entries may be released while the caller opens the
+    // keys (e.g. on lazy expiry), and keep the replies ordered by key name.
+    size_t keysCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (seriesIdEntries[ids[i]].keyName != NULL) {
+            ids[keysCount++] = ids[i];
+        }
+    }
+    qsort(ids, keysCount, sizeof(u_int32_t), CompareKeyNames);
+    RedisModuleString **keys = RedisModule_PoolAlloc(ctx, keysCount * sizeof(RedisModuleString *));
+    if (handles != NULL) {
+        *handles = RedisModule_PoolAlloc(ctx, keysCount * sizeof(void *));
+    }
+    for (size_t i = 0; i < keysCount; i++) {
+        SeriesIdEntry *entry = &seriesIdEntries[ids[i]];
+        keys[i] = RedisModule_CreateStringFromString(ctx, entry->keyName);
+        if (handles != NULL) {
+            (*handles)[i] = useSeriesHandles && !entry->isVolatile ? entry->handle : NULL;
         }
     }
+    *result_count = keysCount;
+    TRACE_PROBE2(index_query_done, candidates, keysCount);
+    return keys;
+}
 
-    // The next two types of queries are reducers so we run them after the matcher
-    // NCONTAINS or NEQ
-    for (int i = 0; i < predicate_count; i++) {
-        if (index_predicate[i].type == NCONTAINS || index_predicate[i].type == NEQ ||
-            index_predicate[i].type == LIST_NOTMATCH) {
-            result = QueryIndexPredicate(ctx, &index_predicate[i], result);
-            if (result == NULL) {
-                return RedisModule_CreateDict(ctx);
-            }
+static size_t CountCommonIds(const PostingList *left, const PostingList *right) {
+    // walk the shorter list, galloping through the longer one
+    if (left->count > right->count) {
+        const PostingList *swap = left;
+        left = right;
+        right = swap;
+    }
+    size_t common = 0, pos = 0;
+    for (size_t i = 0; i < left->count && pos < right->count; i++) {
+        pos = PostingListSeek(right, pos, left->ids[i]);
+        if (pos < right->count && right->ids[pos] == left->ids[i]) {
+            common++;
         }
     }
+    return common;
+}
+
+static LabelCount *ScanLabelEntries(RedisModuleCtx *ctx,
+                                    const char *prefixStr,
+                                    size_t prefixLen,
+                                    const PostingList *filter,
+                                    size_t *result_count) {
+    /*
+     * Visit the index entries starting with prefix, which are adjacent in labelsIndex, and reply
+     * the rest of their names with the number of series of each, the ones in filter if not NULL.
+     */
+    LabelCount *entries = NULL;
+    size_t count = 0, capacity = 0;
 
-    if (result == NULL) {
-        return RedisModule_CreateDict(ctx);
+    RedisModuleDictIter *iter =
+        RedisModule_DictIteratorStartC(labelsIndex, ">=", (void *)prefixStr, prefixLen);
+    char *currentKey;
+    size_t currentKeyLen;
+    PostingList *currentLeaf;
+    while ((currentKey = RedisModule_DictNextC(iter, &currentKeyLen, (void **)&currentLeaf)) !=
+           NULL) {
+        if (currentKeyLen < prefixLen || memcmp(currentKey, prefixStr, prefixLen) != 0) {
+            break;
+        }
+        size_t series =
+            filter != NULL ? CountCommonIds(currentLeaf, filter) : currentLeaf->count;
+        if (series == 0) {
+            continue;
+        }
+        entries = PoolReserve(ctx, entries, count, &capacity, sizeof(LabelCount));
+        entries[count].name = currentKey + prefixLen;
+        entries[count].nameLen = currentKeyLen - prefixLen;
+        entries[count].count = series;
+        count++;
     }
-    return result;
+    RedisModule_DictIteratorStop(iter);
+
+    *result_count = count;
+    return entries;
+}
+
+static LabelCount *QueryLabelEntries(RedisModuleCtx *ctx,
+                                     const char *prefix,
+                                     size_t prefixLen,
+                                     QueryPredicate *index_predicate,
+                                     size_t predicate_count,
+                                     size_t *result_count) {
+    if (predicate_count == 0) {
+        return ScanLabelEntries(ctx, prefix, prefixLen, NULL, result_count);
+    }
+    PostingList filter = { 0 };
+    size_t candidates;
+    filter.ids =
+        MatchSeriesIds(ctx, index_predicate, predicate_count, &filter.count, &candidates);
+    if (filter.count == 0) {
+        *result_count = 0;
+        return NULL;
+    }
+    return ScanLabelEntries(ctx, prefix, prefixLen, &filter, result_count);
+}
+
+LabelCount *QueryLabelNames(RedisModuleCtx *ctx,
+                            QueryPredicate *index_predicate,
+                            size_t predicate_count,
+                            size_t *result_count) {
+    size_t prefixLen;
+    const char *prefix = PoolIndexKey(ctx, &prefixLen, K_PREFIX, "");
+    return QueryLabelEntries(
+        ctx, prefix, prefixLen, index_predicate, predicate_count, result_count);
+}
+
+LabelCount *QueryLabelValues(RedisModuleCtx *ctx,
+                             const char *label,
+                             QueryPredicate *index_predicate,
+                             size_t predicate_count,
+                             size_t *result_count) {
+    size_t prefixLen;
+    const char *prefix = PoolIndexKey(ctx, &prefixLen, KV_PREFIX, label, "");
+    return QueryLabelEntries(
+        ctx, prefix, prefixLen, index_predicate, predicate_count, result_count);
 }
@@ -8,6 +8,7 @@
 
 #include "redismodule.h"
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 typedef struct
@@ -26,6 +27,8 @@ typedef enum
     NCONTAINS,
     LIST_MATCH,    // List of matching predicates
     LIST_NOTMATCH, // List of non-matching predicates
+    PREFIX_MATCH,  // Label value starts with the given prefix
+    REGEX_MATCH,   // Label value matches the given extended regular expression
     // REQ,
     // NREQ
 } PredicateType;
@@ -38,22 +41,96 @@ typedef struct QueryPredicate
     int valueListCount;
 } QueryPredicate;
 
+typedef struct IndexedMetric
+{
+    RedisModuleString *keyName;
+    void *handle;
+    Label *labels;
+    size_t labelsCount;
+} IndexedMetric;
+
 void IndexInit();
 void FreeLabels(void *value, size_t labelsCount);
+/*
+ * The labels of the series share their strings through a global table of label names and values.
+ * InternLabels replaces the strings of labels, which it takes, by their shared copies.
+ * RetainLabels returns a copy of interned labels referencing the same strings, and ReleaseLabels
+ * frees such labels. Interned labels are never passed to FreeLabels. All may be called on any
+ * thread.
+ */
+void InternLabels(Label *labels, size_t labelsCount);
+Label *RetainLabels(const Label *labels, size_t labelsCount);
+void ReleaseLabels(Label *labels, size_t labelsCount);
+// The number of distinct label names and values
+size_t InternedLabelStrings();
 void IndexMetric(RedisModuleCtx *ctx,
                  RedisModuleString *ts_key,
+                 void *handle,
                  Label *labels,
                  size_t labels_count);
+// Index many series at once, e.g. all the series loaded from RDB. Like calling IndexMetric for
+// each, but each label index entry is looked up and grown once per batch of series.
+void IndexMetrics(const IndexedMetric *metrics, size_t count);
 void RemoveIndexedMetric(RedisModuleCtx *ctx,
                          RedisModuleString *ts_key,
                          Label *labels,
                          size_t labels_count);
-RedisModuleDict *QueryIndex(RedisModuleCtx *ctx,
+void RenameIndexedMetric(RedisModuleCtx *ctx,
+                         RedisModuleString *from_key,
+                         RedisModuleString *to_key,
+                         Label *labels,
+                         size_t labels_count);
+/*
+ * Series handles are the values given to IndexMetric. They are only handed out by QueryIndex once
+ * enabled, which is safe when a key name identifies a single key (one database), and for keys
+ * that aren't volatile. Keys start volatile, as they might have an expire, and must be set
+ * otherwise once they were looked up and found without one.
+ */
+void IndexUseSeriesHandles(bool enabled);
+void IndexSetSeriesVolatile(RedisModuleString *ts_key, bool isVolatile);
+// Used when the keys are about to be freed without being deleted one by one (e.g. FLUSHALL ASYNC)
+void IndexSetAllSeriesVolatile();
+// Changes whenever the series matching a query may have changed
+uint64_t IndexVersion();
+/*
+ * Return the names of the series matching all the predicates, ordered by name. The array and the
+ * strings are owned by ctx (pool allocation and automatic memory). When handles isn't NULL, it is
+ * set to an array of the series handles of the results, where NULL means the key has to be
+ * looked up.
+ */
+RedisModuleString **QueryIndex(RedisModuleCtx *ctx,
+                               QueryPredicate *index_predicate,
+                               size_t predicate_count,
+                               size_t *result_count,
+                               void ***handles);
+
+typedef struct LabelCount
+{
+    const char *name; // points in the index, valid until it is next modified
+    size_t nameLen;
+    size_t count; // the number of series carrying the label, or the label value
+} LabelCount;
+
+/*
+ * Return the label names of the indexed series, or the values of a label, each with the number of
+ * series carrying it, ordered by name. The entries are range scanned from the index, without
+ * looking up the series. When predicates are given, only the series matching all of them are
+ * counted and the names none of them carry are left out. The array is owned by ctx.
+ */
+LabelCount *QueryLabelNames(RedisModuleCtx *ctx,
                             QueryPredicate *index_predicate,
-                            size_t predicate_count);
+                            size_t predicate_count,
+                            size_t *result_count);
+LabelCount *QueryLabelValues(RedisModuleCtx *ctx,
+                             const char *label,
+                             QueryPredicate *index_predicate,
+                             size_t predicate_count,
+                             size_t *result_count);
 int parsePredicate(RedisModuleCtx *ctx,
                    RedisModuleString *label,
                    QueryPredicate *retQuery,
                    const char *separator);
 int CountPredicateType(QueryPredicate *queries, size_t query_count, PredicateType type);
+// Count the predicates that select series by value (EQ, LIST_MATCH, PREFIX_MATCH, REGEX_MATCH)
+int CountMatcherPredicates(QueryPredicate *queries, size_t query_count);
 #endif
@@ -9,16 +9,27 @@
 #include "module.h"
 
 #include "RedisModulesSDK/redismodule.h"
+#include "cluster.h"
 #include "common.h"
 #include "compaction.h"
 #include "config.h"
+#include "endianconv.h"
+#include "epoch.h"
 #include "indexer.h"
+#include "query_cache.h"
+#include "query_cursor.h"
 #include "rdb.h"
+#include "segment_store.h"
+#include "stage_stats.h"
+#include "subscription.h"
+#include "thread_pool.h"
 #include "tsdb.h"
 #include "version.h"
+#include "wide_series.h"
 
 #include <ctype.h>
 #include <limits.h>
+#include <math.h>
 #include <string.h>
 #include <strings.h>
 #include <time.h>
@@ -31,6 +42,30 @@
 #endif
 
 RedisModuleType *SeriesType;
+RedisModuleType *WideSeriesType;
+
+// Destination of the samples of a range query
+typedef struct RangeWriter
+{
+    RedisModuleCtx *ctx; // when set, samples are replied right away
+    Sample *samples;     // otherwise they are collected here
+    size_t count;
+    size_t capacity;
+} RangeWriter;
+
+/*
+ * The buckets of compaction rules that stand in for the samples of a series within
+ * [start, end) in an aggregated range query. `values` holds the buckets of a rule of
+ * `valuesType`, and `counts` when set the buckets of a count rule over the same buckets.
+ */
+typedef struct CompactionRoute
+{
+    Series *values;
+    TS_AGG_TYPES_T valuesType;
+    Series *counts;
+    timestamp_t start;
+    timestamp_t end;
+} CompactionRoute;
 
 static int ReplySeriesRange(RedisModuleCtx *ctx,
                             Series *series,
@@ -39,7 +74,54 @@ static int ReplySeriesRange(RedisModuleCtx *ctx,
                             AggregationClass *aggObject,
                             int64_t time_delta,
                             long long maxResults,
-                            bool rev);
+                            bool rev,
+                            const ValueFilter *filter,
+                            size_t downsample);
+static int ReplySeriesRangeAggregations(RedisModuleCtx *ctx,
+                                        Series *series,
+                                        api_timestamp_t start_ts,
+                                        api_timestamp_t end_ts,
+                                        AggregationClass **aggObjects,
+                                        size_t aggCount,
+                                        int64_t time_delta,
+                                        long long maxResults,
+                                        bool rev,
+                                        const CompactionRoute *route,
+                                        const ValueFilter *filter,
+                                        size_t downsample);
+static int ReplySeriesRangeBinary(RedisModuleCtx *ctx,
+                                  Series *series,
+                                  api_timestamp_t start_ts,
+                                  api_timestamp_t end_ts,
+                                  AggregationClass *aggObject,
+                                  int64_t time_delta,
+                                  long long maxResults,
+                                  bool rev,
+                                  const CompactionRoute *route,
+                                  const ValueFilter *filter,
+                                  size_t downsample);
+static long long WriteSeriesRange(RangeWriter *writer,
+                                  Series *series,
+                                  api_timestamp_t start_ts,
+                                  api_timestamp_t end_ts,
+                                  AggregationClass *aggObject,
+                                  int64_t time_delta,
+                                  long long maxResults,
+                                  bool rev,
+                                  const ValueFilter *filter,
+                                  size_t downsample);
+static long long WriteSeriesRangeAggregations(RangeWriter *writer,
+                                              Series *series,
+                                              api_timestamp_t start_ts,
+                                              api_timestamp_t end_ts,
+                                              AggregationClass **aggObjects,
+                                              size_t aggCount,
+                                              int64_t time_delta,
+                                              long long maxResults,
+                                              bool rev,
+                                              const CompactionRoute *route,
+                                              const ValueFilter *filter,
+                                              size_t downsample);
 
 static void ReplyWithSeriesLabels(RedisModuleCtx *ctx, const Series *series);
 static void ReplyWithSeriesLastDatapoint(RedisModuleCtx *ctx, const Series *series);
@@ -170,9 +252,14 @@ static int parseCreateArgs(RedisModuleCtx *ctx,
         return REDISMODULE_ERR;
     }
 
-    if (RMUtil_ArgIndex("CHUNK_SIZE", argv, argc) > 0 &&
-        RMUtil_ParseArgsAfter("CHUNK_SIZE", argv, argc, "l", &cCtx->chunkSizeBytes) !=
-            REDISMODULE_OK) {
+    int chunkSizeIndex = RMUtil_ArgIndex("CHUNK_SIZE", argv, argc);
+    if (chunkSizeIndex > 0 && chunkSizeIndex + 1 < argc &&
+        RMUtil_StringEqualsCaseC(argv[chunkSizeIndex + 1], "ADAPTIVE")) {
+        // starts from the default size
+        cCtx->options |= SERIES_OPT_ADAPTIVE_CHUNK_SIZE;
+    } else if (chunkSizeIndex > 0 &&
+               RMUtil_ParseArgsAfter("CHUNK_SIZE", argv, argc, "l", &cCtx->chunkSizeBytes) !=
+                   REDISMODULE_OK) {
         RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse CHUNK_SIZE");
         return REDISMODULE_ERR;
     }
@@ -181,11 +268,57 @@ static int parseCreateArgs(RedisModuleCtx *ctx,
         RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse CHUNK_SIZE");
         return REDISMODULE_ERR;
     }
+    if (cCtx->chunkSizeBytes > CHUNK_SIZE_MAX_BYTES) {
+        RTS_ReplyGeneralError(ctx, "TSDB: CHUNK_SIZE is larger than 1048576 bytes");
+        return REDISMODULE_ERR;
+    }
+
+    long long chunkTimeWindow = 0;
+    if (RMUtil_ArgIndex("CHUNK_TIME_WINDOW", argv, argc) > 0 &&
+        (RMUtil_ParseArgsAfter("CHUNK_TIME_WINDOW", argv, argc, "l", &chunkTimeWindow) !=
+             REDISMODULE_OK ||
+         chunkTimeWindow < 0)) {
+        RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse CHUNK_TIME_WINDOW");
+        return REDISMODULE_ERR;
+    }
+    cCtx->chunkTimeWindow = chunkTimeWindow;
 
     if (RMUtil_ArgIndex("UNCOMPRESSED", argv, argc) > 0) {
         cCtx->options |= SERIES_OPT_UNCOMPRESSED;
     }
 
+    if (RMUtil_ArgIndex("ENCODING", argv, argc) > 0) {
+        RedisModuleString *encoding = NULL;
+        if (RMUtil_ParseArgsAfter("ENCODING", argv, argc, "s", &encoding) != REDISMODULE_OK) {
+            RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse ENCODING");
+            return TSDB_ERROR;
+        }
+        cCtx->options &= ~(SERIES_OPT_UNCOMPRESSED | SERIES_OPT_DECIMAL);
+        if (RMUtil_StringEqualsCaseC(encoding, "UNCOMPRESSED")) {
+            cCtx->options |= SERIES_OPT_UNCOMPRESSED;
+        } else if (RMUtil_StringEqualsCaseC(encoding, "DECIMAL")) {
+            cCtx->options |= SERIES_OPT_DECIMAL;
+        } else if (!RMUtil_StringEqualsCaseC(encoding, "COMPRESSED")) {
+            RTS_ReplyGeneralError(ctx, "TSDB: Unknown ENCODING");
+            return TSDB_ERROR;
+        }
+    }
+
+    long long significantDigits = 0;
+    if (RMUtil_ArgIndex("SIGNIFICANT_DIGITS", argv, argc) > 0) {
+        if (RMUtil_ParseArgsAfter("SIGNIFICANT_DIGITS", argv, argc, "l", &significantDigits) !=
+                REDISMODULE_OK ||
+            significantDigits < 0 || significantDigits > SIGNIFICANT_DIGITS_MAX) {
+            RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse SIGNIFICANT_DIGITS");
+            return TSDB_ERROR;
+        }
+        if (significantDigits > 0 && (cCtx->options & SERIES_OPT_DECIMAL)) {
+            RTS_ReplyGeneralError(ctx, "TSDB: SIGNIFICANT_DIGITS can't be used with DECIMAL");
+            return TSDB_ERROR;
+        }
+    }
+    cCtx->significantDigits = significantDigits;
+
     cCtx->duplicatePolicy = DP_NONE;
     if (ParseDuplicatePolicy(ctx, argv, argc, DUPLICATE_POLICY_ARG, &cCtx->duplicatePolicy) !=
         TSDB_OK) {
@@ -195,11 +328,40 @@ static int parseCreateArgs(RedisModuleCtx *ctx,
     return REDISMODULE_OK;
 }
 
-static int _parseAggregationArgs(RedisModuleCtx *ctx,
-                                 RedisModuleString **argv,
-                                 int argc,
-                                 api_timestamp_t *time_delta,
-                                 int *agg_type) {
+// Parses a comma separated list of up to `max_types` aggregation types
+static int parseAggregationTypes(RedisModuleString *aggTypeStr,
+                                 int *agg_types,
+                                 size_t max_types,
+                                 size_t *types_count) {
+    size_t len;
+    const char *types = RedisModule_StringPtrLen(aggTypeStr, &len);
+    const char *end = types + len;
+    *types_count = 0;
+    while (true) {
+        const char *comma = memchr(types, ',', end - types);
+        const char *typeEnd = comma != NULL ? comma : end;
+        if (*types_count == max_types || typeEnd == types) {
+            return TSDB_ERROR;
+        }
+        int type = StringLenAggTypeToEnum(types, typeEnd - types);
+        if (type < 0 || type >= TS_AGG_TYPES_MAX) {
+            return TSDB_ERROR;
+        }
+        agg_types[(*types_count)++] = type;
+        if (comma == NULL) {
+            return TSDB_OK;
+        }
+        types = comma + 1;
+    }
+}
+
+static int _parseAggregationListArgs(RedisModuleCtx *ctx,
+                                     RedisModuleString **argv,
+                                     int argc,
+                                     api_timestamp_t *time_delta,
+                                     int *agg_types,
+                                     size_t max_types,
+                                     size_t *types_count) {
     RedisModuleString *aggTypeStr = NULL;
     int offset = RMUtil_ArgIndex("AGGREGATION", argv, argc);
     if (offset > 0) {
@@ -215,9 +377,7 @@ static int _parseAggregationArgs(RedisModuleCtx *ctx,
             return TSDB_ERROR;
         }
 
-        *agg_type = RMStringLenAggTypeToEnum(aggTypeStr);
-
-        if (*agg_type < 0 || *agg_type >= TS_AGG_TYPES_MAX) {
+        if (parseAggregationTypes(aggTypeStr, agg_types, max_types, types_count) != TSDB_OK) {
             RTS_ReplyGeneralError(ctx, "TSDB: Unknown aggregation type");
             return TSDB_ERROR;
         }
@@ -235,23 +395,46 @@ static int _parseAggregationArgs(RedisModuleCtx *ctx,
     return TSDB_NOTEXISTS;
 }
 
+static int _parseAggregationArgs(RedisModuleCtx *ctx,
+                                 RedisModuleString **argv,
+                                 int argc,
+                                 api_timestamp_t *time_delta,
+                                 int *agg_type) {
+    size_t types_count;
+    return _parseAggregationListArgs(ctx, argv, argc, time_delta, agg_type, 1, &types_count);
+}
+
+// AGGREGATION with up to `max_objects` comma separated aggregation types
+static int parseAggregationListArgs(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv,
+                                    int argc,
+                                    api_timestamp_t *time_delta,
+                                    AggregationClass **agg_objects,
+                                    size_t max_objects,
+                                    size_t *objects_count) {
+    int agg_types[max_objects];
+    int result = _parseAggregationListArgs(
+        ctx, argv, argc, time_delta, agg_types, max_objects, objects_count);
+    if (result != TSDB_OK) {
+        return result;
+    }
+    for (size_t i = 0; i < *objects_count; i++) {
+        agg_objects[i] = GetAggClass(agg_types[i]);
+        if (agg_objects[i] == NULL) {
+            RTS_ReplyGeneralError(ctx, "TSDB: Failed to retrieve aggregation class");
+            return TSDB_ERROR;
+        }
+    }
+    return TSDB_OK;
+}
+
 static int parseAggregationArgs(RedisModuleCtx *ctx,
                                 RedisModuleString **argv,
                                 int argc,
                                 api_timestamp_t *time_delta,
                                 AggregationClass **agg_object) {
-    int agg_type;
-    int result = _parseAggregationArgs(ctx, argv, argc, time_delta, &agg_type);
-    if (result == TSDB_OK) {
-        *agg_object = GetAggClass(agg_type);
-        if (*agg_object == NULL) {
-            RTS_ReplyGeneralError(ctx, "TSDB: Failed to retrieve aggregation class");
-            return TSDB_ERROR;
-        }
-        return TSDB_OK;
-    } else {
-        return result;
-    }
+    size_t objects_count;
+    return parseAggregationListArgs(ctx, argv, argc, time_delta, agg_object, 1, &objects_count);
 }
 
 static int parseRangeArguments(RedisModuleCtx *ctx,
@@ -287,6 +470,81 @@ static int parseRangeArguments(RedisModuleCtx *ctx,
     return REDISMODULE_OK;
 }
 
+static int parseFormatArgument(RedisModuleCtx *ctx,
+                               RedisModuleString **argv,
+                               int argc,
+                               bool *binary) {
+    *binary = false;
+    int offset = RMUtil_ArgIndex("FORMAT", argv, argc);
+    if (offset > 0) {
+        if (offset + 1 == argc) {
+            RTS_ReplyGeneralError(ctx, "TSDB: FORMAT argument is missing");
+            return TSDB_ERROR;
+        }
+        if (RMUtil_StringEqualsCaseC(argv[offset + 1], "BINARY")) {
+            *binary = true;
+        } else if (!RMUtil_StringEqualsCaseC(argv[offset + 1], "TEXT")) {
+            RTS_ReplyGeneralError(ctx, "TSDB: Unknown FORMAT");
+            return TSDB_ERROR;
+        }
+    }
+    return TSDB_OK;
+}
+
+static int parseValueFilterArgument(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv,
+                                    int argc,
+                                    ValueFilter *filter) {
+    *filter = (ValueFilter){ 0 };
+    int offset = RMUtil_ArgIndex("FILTER_BY_VALUE", argv, argc);
+    if (offset > 0) {
+        if (offset + 2 >= argc) {
+            RTS_ReplyGeneralError(ctx, "TSDB: FILTER_BY_VALUE arguments are missing");
+            return TSDB_ERROR;
+        }
+        if (RedisModule_StringToDouble(argv[offset + 1], &filter->min) != REDISMODULE_OK ||
+            RedisModule_StringToDouble(argv[offset + 2], &filter->max) != REDISMODULE_OK ||
+            filter->min > filter->max) {
+            RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse FILTER_BY_VALUE");
+            return TSDB_ERROR;
+        }
+        filter->enabled = true;
+    }
+    return TSDB_OK;
+}
+
+// DOWNSAMPLE LTTB points, `points` is 0 without it
+static int parseDownsampleArgument(RedisModuleCtx *ctx,
+                                   RedisModuleString **argv,
+                                   int argc,
+                                   bool aggregated,
+                                   size_t *points) {
+    *points = 0;
+    int offset = RMUtil_ArgIndex("DOWNSAMPLE", argv, argc);
+    if (offset > 0) {
+        if (offset + 2 >= argc) {
+            RTS_ReplyGeneralError(ctx, "TSDB: DOWNSAMPLE arguments are missing");
+            return TSDB_ERROR;
+        }
+        if (!RMUtil_StringEqualsCaseC(argv[offset + 1], "LTTB")) {
+            RTS_ReplyGeneralError(ctx, "TSDB: Unknown DOWNSAMPLE method");
+            return TSDB_ERROR;
+        }
+        long long value;
+        if (RedisModule_StringToLongLong(argv[offset + 2], &value) != REDISMODULE_OK ||
+            value < 3) {
+            RTS_ReplyGeneralError(ctx, "TSDB: DOWNSAMPLE points must be at least 3");
+            return TSDB_ERROR;
+        }
+        if (aggregated) {
+            RTS_ReplyGeneralError(ctx, "TSDB: DOWNSAMPLE cannot be used with AGGREGATION");
+            return TSDB_ERROR;
+        }
+        *points = value;
+    }
+    return TSDB_OK;
+}
+
 static int parseCountArgument(RedisModuleCtx *ctx,
                               RedisModuleString **argv,
                               int argc,
@@ -313,6 +571,141 @@ static int parseCountArgument(RedisModuleCtx *ctx,
     return TSDB_OK;
 }
 
+/*
+ * The resources a range query may use, QUERY_MAX_SERIES, QUERY_MAX_SAMPLES and QUERY_TIMEOUT
+ * lowered by the MAX_SERIES, MAX_SAMPLES and TIMEOUT arguments, 0 being unlimited. A series is
+ * charged the samples of the chunks its range overlaps before it is read, and the deadline is
+ * checked before each series, so a query stops at the first series over its budget.
+ */
+typedef enum
+{
+    QUERY_BUDGET_OK,
+    QUERY_BUDGET_SERIES,
+    QUERY_BUDGET_SAMPLES,
+    QUERY_BUDGET_TIME,
+} QueryBudgetStatus;
+
+typedef struct QueryBudget
+{
+    long long maxSeries;
+    long long maxSamples;
+    long long deadline; // RedisModule_Milliseconds(), 0 without a timeout
+    long long samples;  // charged so far, by the workers too
+    int exceeded;       // the QueryBudgetStatus that stopped the query
+} QueryBudget;
+
+static inline long long lowerLimit(long long global, long long local) {
+    return global == 0 || (local != 0 && local < global) ? local : global;
+}
+
+static int parseBudgetLimit(RedisModuleString **argv,
+                            int argc,
+                            const char *name,
+                            long long *limit) {
+    *limit = 0;
+    int offset = RMUtil_ArgIndex(name, argv, argc);
+    if (offset < 0) {
+        return TSDB_OK;
+    }
+    if (offset + 1 == argc ||
+        RedisModule_StringToLongLong(argv[offset + 1], limit) != REDISMODULE_OK || *limit < 0) {
+        return TSDB_ERROR;
+    }
+    return TSDB_OK;
+}
+
+// Parses MAX_SAMPLES, and MAX_SERIES and TIMEOUT unless `samplesOnly`, replying on failure
+static int parseQueryBudget(RedisModuleCtx *ctx,
+                            RedisModuleString **argv,
+                            int argc,
+                            bool samplesOnly,
+                            QueryBudget *budget) {
+    long long maxSeries = 0, maxSamples = 0, timeout = 0;
+    if (parseBudgetLimit(argv, argc, "MAX_SAMPLES", &maxSamples) != TSDB_OK) {
+        RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse MAX_SAMPLES");
+        return TSDB_ERROR;
+    }
+    if (!samplesOnly && parseBudgetLimit(argv, argc, "MAX_SERIES", &maxSeries) != TSDB_OK) {
+        RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse MAX_SERIES");
+        return TSDB_ERROR;
+    }
+    if (!samplesOnly && parseBudgetLimit(argv, argc, "TIMEOUT", &timeout) != TSDB_OK) {
+        RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse TIMEOUT");
+        return TSDB_ERROR;
+    }
+    timeout = samplesOnly ? 0 : lowerLimit(TSGlobalConfig.queryTimeout, timeout);
+    *budget = (QueryBudget){ .maxSeries = lowerLimit(TSGlobalConfig.queryMaxSeries, maxSeries),
+                             .maxSamples = lowerLimit(TSGlobalConfig.queryMaxSamples, maxSamples),
+                             .deadline = timeout > 0 ? RedisModule_Milliseconds() + timeout : 0 };
+    return TSDB_OK;
+}
+
+// Whether the series must all be read before replying, to reply an error instead
+static inline bool QueryBudgetBoundsReading(const QueryBudget *budget) {
+    return budget->maxSamples > 0 || budget->deadline > 0;
+}
+
+static inline void QueryBudgetExceed(QueryBudget *budget, QueryBudgetStatus status) {
+    int ok = QUERY_BUDGET_OK;
+    __atomic_compare_exchange_n(
+        &budget->exceeded, &ok, status, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static inline bool QueryBudgetExceeded(QueryBudget *budget) {
+    return __atomic_load_n(&budget->exceeded, __ATOMIC_RELAXED) != QUERY_BUDGET_OK;
+}
+
+// Returns false once the query is over its budget, checking the deadline
+static bool QueryBudgetCheck(QueryBudget *budget) {
+    if (budget->deadline > 0 && RedisModule_Milliseconds() > budget->deadline) {
+        QueryBudgetExceed(budget, QUERY_BUDGET_TIME);
+    }
+    return !QueryBudgetExceeded(budget);
+}
+
+static bool QueryBudgetAdmitSeries(QueryBudget *budget, size_t count) {
+    if (budget->maxSeries > 0 && count > (size_t)budget->maxSeries) {
+        QueryBudgetExceed(budget, QUERY_BUDGET_SERIES);
+    }
+    return !QueryBudgetExceeded(budget);
+}
+
+/*
+ * The samples reading the range decodes at most, those of the chunks it overlaps, or COUNT when
+ * the samples are replied as they are read.
+ */
+static size_t RangeSamplesToRead(Series *series,
+                                 api_timestamp_t start_ts,
+                                 api_timestamp_t end_ts,
+                                 bool aggregated,
+                                 long long count,
+                                 const ValueFilter *filter) {
+    size_t samples = SeriesRangeSamples(series, start_ts, end_ts);
+    if (!aggregated && !filter->enabled && count >= 0) {
+        samples = min(samples, (size_t)count);
+    }
+    return samples;
+}
+
+static bool QueryBudgetCharge(QueryBudget *budget, size_t samples) {
+    if (budget->maxSamples > 0 &&
+        __atomic_add_fetch(&budget->samples, samples, __ATOMIC_RELAXED) > budget->maxSamples) {
+        QueryBudgetExceed(budget, QUERY_BUDGET_SAMPLES);
+    }
+    return QueryBudgetCheck(budget);
+}
+
+static int ReplyQueryBudgetExceeded(RedisModuleCtx *ctx, const QueryBudget *budget) {
+    switch (budget->exceeded) {
+        case QUERY_BUDGET_SERIES:
+            return RTS_ReplyGeneralError(ctx, "TSDB: query matches more than MAX_SERIES series");
+        case QUERY_BUDGET_SAMPLES:
+            return RTS_ReplyGeneralError(ctx, "TSDB: query reads more than MAX_SAMPLES samples");
+        default:
+            return RTS_ReplyGeneralError(ctx, "TSDB: query ran longer than TIMEOUT");
+    }
+}
+
 int TSDB_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
@@ -326,12 +719,13 @@ int TSDB_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     if (!status) {
         return REDISMODULE_ERR;
     }
+    SeriesFlushPendingSamples(series);
 
     int is_debug = RMUtil_ArgExists("DEBUG", argv, argc, 1);
     if (is_debug) {
-        RedisModule_ReplyWithArray(ctx, 13 * 2);
+        RedisModule_ReplyWithArray(ctx, 16 * 2);
     } else {
-        RedisModule_ReplyWithArray(ctx, 12 * 2);
+        RedisModule_ReplyWithArray(ctx, 13 * 2);
     }
 
     long long skippedSamples;
@@ -348,15 +742,19 @@ int TSDB_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_ReplyWithSimpleString(ctx, "retentionTime");
     RedisModule_ReplyWithLongLong(ctx, series->retentionTime);
     RedisModule_ReplyWithSimpleString(ctx, "chunkCount");
-    RedisModule_ReplyWithLongLong(ctx, RedisModule_DictSize(series->chunks));
+    RedisModule_ReplyWithLongLong(ctx, ChunkDir_Count(&series->chunks));
     RedisModule_ReplyWithSimpleString(ctx, "chunkSize");
     RedisModule_ReplyWithLongLong(ctx, series->chunkSizeBytes);
     RedisModule_ReplyWithSimpleString(ctx, "chunkType");
     if (series->options & SERIES_OPT_UNCOMPRESSED) {
         RedisModule_ReplyWithSimpleString(ctx, "uncompressed");
+    } else if (series->options & SERIES_OPT_DECIMAL) {
+        RedisModule_ReplyWithSimpleString(ctx, "decimal");
     } else {
         RedisModule_ReplyWithSimpleString(ctx, "compressed");
     };
+    RedisModule_ReplyWithSimpleString(ctx, "significantDigits");
+    RedisModule_ReplyWithLongLong(ctx, series->significantDigits);
     RedisModule_ReplyWithSimpleString(ctx, "duplicatePolicy");
     if (series->duplicatePolicy != DP_NONE) {
         RedisModule_ReplyWithSimpleString(ctx, DuplicatePolicyToString(series->duplicatePolicy));
@@ -390,14 +788,28 @@ int TSDB_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_ReplySetArrayLength(ctx, ruleCount);
 
     if (is_debug) {
-        RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(series->chunks, ">", "", 0);
-        Chunk_t *chunk = NULL;
+        // how much of the chunk data holds samples, and the memory the samples save
+        size_t totalSize = 0, totalUsed = 0, totalSamples = 0;
+        for (size_t i = 0; i < ChunkDir_Count(&series->chunks); i++) {
+            Chunk_t *chunk = ChunkDir_Get(&series->chunks, i);
+            totalSize += series->funcs->GetChunkSize(chunk, FALSE);
+            totalUsed += series->funcs->GetChunkUsedSize(chunk);
+            totalSamples += series->funcs->GetNumOfSample(chunk);
+        }
+        RedisModule_ReplyWithSimpleString(ctx, "fillFactor");
+        RedisModule_ReplyWithDouble(ctx, totalSize > 0 ? (double)totalUsed / totalSize : 0);
+        RedisModule_ReplyWithSimpleString(ctx, "compressionRatio");
+        RedisModule_ReplyWithDouble(
+            ctx, totalSize > 0 ? (double)totalSamples * SAMPLE_SIZE / totalSize : 0);
+
         int chunkCount = 0;
         RedisModule_ReplyWithSimpleString(ctx, "Chunks");
         RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-        while (RedisModule_DictNextC(iter, NULL, (void *)&chunk)) {
+        for (size_t i = 0; i < ChunkDir_Count(&series->chunks); i++) {
+            Chunk_t *chunk = ChunkDir_Get(&series->chunks, i);
             size_t chunkSize = series->funcs->GetChunkSize(chunk, FALSE);
-            RedisModule_ReplyWithArray(ctx, 5 * 2);
+            size_t usedSize = series->funcs->GetChunkUsedSize(chunk);
+            RedisModule_ReplyWithArray(ctx, 7 * 2);
             RedisModule_ReplyWithSimpleString(ctx, "startTimestamp");
             RedisModule_ReplyWithLongLong(ctx, series->funcs->GetFirstTimestamp(chunk));
             RedisModule_ReplyWithSimpleString(ctx, "endTimestamp");
@@ -409,9 +821,12 @@ int TSDB_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
             RedisModule_ReplyWithLongLong(ctx, chunkSize);
             RedisModule_ReplyWithSimpleString(ctx, "bytesPerSample");
             RedisModule_ReplyWithDouble(ctx, (float)chunkSize / numOfSamples);
+            RedisModule_ReplyWithSimpleString(ctx, "usedSize");
+            RedisModule_ReplyWithLongLong(ctx, usedSize);
+            RedisModule_ReplyWithSimpleString(ctx, "fillFactor");
+            RedisModule_ReplyWithDouble(ctx, chunkSize > 0 ? (double)usedSize / chunkSize : 0);
             chunkCount++;
         }
-        RedisModule_DictIteratorStop(iter);
         RedisModule_ReplySetArrayLength(ctx, chunkCount);
     }
     RedisModule_CloseKey(key);
@@ -419,15 +834,19 @@ int TSDB_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     return REDISMODULE_OK;
 }
 
-static void ReplyWithSeriesLabels(RedisModuleCtx *ctx, const Series *series) {
-    RedisModule_ReplyWithArray(ctx, series->labelsCount);
-    for (int i = 0; i < series->labelsCount; i++) {
+static void ReplyWithLabels(RedisModuleCtx *ctx, const Label *labels, size_t labelsCount) {
+    RedisModule_ReplyWithArray(ctx, labelsCount);
+    for (int i = 0; i < labelsCount; i++) {
         RedisModule_ReplyWithArray(ctx, 2);
-        RedisModule_ReplyWithString(ctx, series->labels[i].key);
-        RedisModule_ReplyWithString(ctx, series->labels[i].value);
+        RedisModule_ReplyWithString(ctx, labels[i].key);
+        RedisModule_ReplyWithString(ctx, labels[i].value);
     }
 }
 
+static void ReplyWithSeriesLabels(RedisModuleCtx *ctx, const Series *series) {
+    ReplyWithLabels(ctx, series->labels, series->labelsCount);
+}
+
 // double string presentation requires 15 digit integers +
 // '.' + "e+" or "e-" + 3 digits of exponent
 #define MAX_VAL_LEN 24
@@ -439,6 +858,62 @@ static void ReplyWithSample(RedisModuleCtx *ctx, u_int64_t timestamp, double val
     RedisModule_ReplyWithSimpleString(ctx, buf);
 }
 
+static void WriteSample(RangeWriter *writer, u_int64_t timestamp, double value) {
+    if (writer->ctx != NULL) {
+        ReplyWithSample(writer->ctx, timestamp, value);
+        return;
+    }
+    if (writer->count == writer->capacity) {
+        writer->capacity = max(writer->capacity * 2, SERIES_ITER_BATCH_SIZE);
+        writer->samples = realloc(writer->samples, writer->capacity * sizeof(Sample));
+    }
+    writer->samples[writer->count].timestamp = timestamp;
+    writer->samples[writer->count].value = value;
+    writer->count++;
+}
+
+// Writes a batch of samples, the destination is chosen once for the whole batch
+static void WriteSamples(RangeWriter *writer,
+                         const timestamp_t *timestamps,
+                         const double *values,
+                         size_t count) {
+    if (writer->ctx != NULL) {
+        for (size_t i = 0; i < count; ++i) {
+            ReplyWithSample(writer->ctx, timestamps[i], values[i]);
+        }
+        return;
+    }
+    if (writer->count + count > writer->capacity) {
+        writer->capacity = max(max(writer->capacity * 2, writer->count + count),
+                               (size_t)SERIES_ITER_BATCH_SIZE);
+        writer->samples = realloc(writer->samples, writer->capacity * sizeof(Sample));
+    }
+    Sample *samples = writer->samples + writer->count;
+    for (size_t i = 0; i < count; ++i) {
+        samples[i].timestamp = timestamps[i];
+        samples[i].value = values[i];
+    }
+    writer->count += count;
+}
+
+// A bucket of several aggregations, replied as its timestamp followed by the values
+static void WriteSampleValues(RangeWriter *writer,
+                              u_int64_t timestamp,
+                              const double *values,
+                              size_t count) {
+    if (count == 1 || writer->ctx == NULL) { // only replies hold several values per sample
+        WriteSample(writer, timestamp, values[0]);
+        return;
+    }
+    RedisModule_ReplyWithArray(writer->ctx, 1 + count);
+    RedisModule_ReplyWithLongLong(writer->ctx, timestamp);
+    for (size_t i = 0; i < count; i++) {
+        char buf[MAX_VAL_LEN];
+        snprintf(buf, MAX_VAL_LEN, "%.15g", values[i]);
+        RedisModule_ReplyWithSimpleString(writer->ctx, buf);
+    }
+}
+
 void ReplyWithSeriesLastDatapoint(RedisModuleCtx *ctx, const Series *series) {
     if (SeriesGetNumSamples(series) == 0) {
         RedisModule_ReplyWithArray(ctx, 0);
@@ -456,7 +931,17 @@ int parseLabelListFromArgs(RedisModuleCtx *ctx,
     for (int i = start; i < start + query_count; i++) {
         size_t _s;
         const char *str2 = RedisModule_StringPtrLen(argv[i], &_s);
-        if (strstr(str2, "!=(") != NULL) { // order is important! Must be before "!=".
+        if (strstr(str2, "=~") != NULL) { // order is important! Must be before all the others.
+            query->type = REGEX_MATCH;
+            if (parsePredicate(ctx, argv[i], query, "=~") == TSDB_ERROR) {
+                return TSDB_ERROR;
+            }
+        } else if (strstr(str2, "^=") != NULL) {
+            query->type = PREFIX_MATCH;
+            if (parsePredicate(ctx, argv[i], query, "^=") == TSDB_ERROR) {
+                return TSDB_ERROR;
+            }
+        } else if (strstr(str2, "!=(") != NULL) { // order is important! Must be before "!=".
             query->type = LIST_NOTMATCH;
             if (parsePredicate(ctx, argv[i], query, "!=(") == TSDB_ERROR) {
                 return TSDB_ERROR;
@@ -504,778 +989,4471 @@ int TSDB_queryindex(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         return RTS_ReplyGeneralError(ctx, "TSDB: failed parsing labels");
     }
 
-    if (CountPredicateType(queries, (size_t)query_count, EQ) +
-            CountPredicateType(queries, (size_t)query_count, LIST_MATCH) ==
-        0) {
+    if (CountMatcherPredicates(queries, (size_t)query_count) == 0) {
         return RTS_ReplyGeneralError(ctx, "TSDB: please provide at least one matcher");
     }
 
-    RedisModuleDict *result = QueryIndex(ctx, queries, query_count);
-
-    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    size_t result_count;
+    RedisModuleString **result = QueryIndex(ctx, queries, query_count, &result_count, NULL);
 
-    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(result, "^", NULL, 0);
-    char *currentKey;
-    size_t currentKeyLen;
-    long long replylen = 0;
-    while ((currentKey = RedisModule_DictNextC(iter, &currentKeyLen, NULL)) != NULL) {
-        RedisModule_ReplyWithStringBuffer(ctx, currentKey, currentKeyLen);
-        replylen++;
+    RedisModule_ReplyWithArray(ctx, result_count);
+    for (size_t i = 0; i < result_count; i++) {
+        RedisModule_ReplyWithString(ctx, result[i]);
     }
-    RedisModule_DictIteratorStop(iter);
-    RedisModule_ReplySetArrayLength(ctx, replylen);
 
     return REDISMODULE_OK;
 }
 
-int TSDB_generic_mrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, bool rev) {
-    RedisModule_AutoMemory(ctx);
-
-    if (argc < 4) {
-        return RedisModule_WrongArity(ctx);
+static int replyLabelCounts(RedisModuleCtx *ctx, const LabelCount *entries, size_t count) {
+    RedisModule_ReplyWithArray(ctx, count);
+    for (size_t i = 0; i < count; i++) {
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithStringBuffer(ctx, entries[i].name, entries[i].nameLen);
+        RedisModule_ReplyWithLongLong(ctx, entries[i].count);
     }
+    return REDISMODULE_OK;
+}
 
-    api_timestamp_t start_ts, end_ts;
-    api_timestamp_t time_delta = 0;
-    Series fake_series = { 0 };
-    fake_series.lastTimestamp = LLONG_MAX;
-    if (parseRangeArguments(ctx, &fake_series, 1, argv, &start_ts, &end_ts) != REDISMODULE_OK) {
-        return REDISMODULE_ERR;
+// Parse the optional FILTER filter.. at argv[first], setting queries to NULL when there is none
+static int parseOptionalFilter(RedisModuleCtx *ctx,
+                               RedisModuleString **argv,
+                               int argc,
+                               int first,
+                               QueryPredicate **queries,
+                               size_t *query_count) {
+    *queries = NULL;
+    *query_count = 0;
+    if (argc == first) {
+        return TSDB_OK;
     }
+    if (argc < first + 2 || !RMUtil_StringEqualsCaseC(argv[first], "FILTER")) {
+        RedisModule_WrongArity(ctx);
+        return TSDB_ERROR;
+    }
+    int count = argc - first - 1;
+    *queries = RedisModule_PoolAlloc(ctx, sizeof(QueryPredicate) * count);
+    if (parseLabelListFromArgs(ctx, argv, first + 1, count, *queries) == TSDB_ERROR) {
+        RTS_ReplyGeneralError(ctx, "TSDB: failed parsing labels");
+        return TSDB_ERROR;
+    }
+    if (CountMatcherPredicates(*queries, (size_t)count) == 0) {
+        RTS_ReplyGeneralError(ctx, "TSDB: please provide at least one matcher");
+        return TSDB_ERROR;
+    }
+    *query_count = count;
+    return TSDB_OK;
+}
 
-    AggregationClass *aggObject = NULL;
-    const int aggregationResult = parseAggregationArgs(ctx, argv, argc, &time_delta, &aggObject);
-    if (aggregationResult == TSDB_ERROR) {
-        return REDISMODULE_ERR;
+// TS.LABELNAMES [FILTER filter..]
+int TSDB_labelnames(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    QueryPredicate *queries;
+    size_t query_count;
+    if (parseOptionalFilter(ctx, argv, argc, 1, &queries, &query_count) == TSDB_ERROR) {
+        return REDISMODULE_OK;
     }
 
-    const int filter_location = RMUtil_ArgIndex("FILTER", argv, argc);
-    if (filter_location == -1) {
+    size_t count;
+    LabelCount *entries = QueryLabelNames(ctx, queries, query_count, &count);
+    return replyLabelCounts(ctx, entries, count);
+}
+
+// TS.LABELVALUES label [FILTER filter..]
+int TSDB_labelvalues(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 2) {
         return RedisModule_WrongArity(ctx);
     }
 
-    long long count = -1;
-    if (parseCountArgument(ctx, argv, argc, &count) != REDISMODULE_OK) {
-        return REDISMODULE_ERR;
+    QueryPredicate *queries;
+    size_t query_count;
+    if (parseOptionalFilter(ctx, argv, argc, 2, &queries, &query_count) == TSDB_ERROR) {
+        return REDISMODULE_OK;
     }
 
-    const size_t query_count = argc - 1 - filter_location;
-    const int withlabels_location = RMUtil_ArgIndex("WITHLABELS", argv, argc);
+    size_t count;
+    LabelCount *entries = QueryLabelValues(
+        ctx, RedisModule_StringPtrLen(argv[1], NULL), queries, query_count, &count);
+    return replyLabelCounts(ctx, entries, count);
+}
+
+// TS.SUBSCRIBE channel FILTER filter..
+int TSDB_subscribe(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 4 || !RMUtil_StringEqualsCaseC(argv[2], "FILTER")) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    int query_count = argc - 3;
     QueryPredicate *queries = RedisModule_PoolAlloc(ctx, sizeof(QueryPredicate) * query_count);
-    if (parseLabelListFromArgs(ctx, argv, filter_location + 1, query_count, queries) ==
-        TSDB_ERROR) {
+    if (parseLabelListFromArgs(ctx, argv, 3, query_count, queries) == TSDB_ERROR) {
         return RTS_ReplyGeneralError(ctx, "TSDB: failed parsing labels");
     }
 
-    if (CountPredicateType(queries, (size_t)query_count, EQ) +
-            CountPredicateType(queries, (size_t)query_count, LIST_MATCH) ==
-        0) {
+    if (CountMatcherPredicates(queries, (size_t)query_count) == 0) {
         return RTS_ReplyGeneralError(ctx, "TSDB: please provide at least one matcher");
     }
 
-    RedisModuleDict *result = QueryIndex(ctx, queries, query_count);
+    Subscriptions_Set(argv[1], argv + 3, query_count);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
 
-    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+int TSDB_unsubscribe(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 2) {
+        return RedisModule_WrongArity(ctx);
+    }
 
-    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(result, "^", NULL, 0);
-    char *currentKey;
-    size_t currentKeyLen;
-    long long replylen = 0;
-    Series *series;
-    while ((currentKey = RedisModule_DictNextC(iter, &currentKeyLen, NULL)) != NULL) {
+    if (Subscriptions_Remove(argv[1]) != TSDB_OK) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: the channel is not subscribed");
+    }
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/*
+ * With WORKER_THREADS, TS.MRANGE blocks the client and scans the matching series on the thread
+ * pool. A job holds the GIL only while copying the chunks of a series that overlap the range,
+ * the copy is then scanned and aggregated concurrently with the main thread and the other jobs.
+ * Once the last job completes, the reply is built on the main thread from the collected samples.
+ */
+#define MRANGE_SERIES_PER_JOB 16
+// series per page of TS.MRANGE CURSOR without LIMIT
+#define MRANGE_CURSOR_DEFAULT_LIMIT 100
+
+typedef struct MRangeSeries
+{
+    RedisModuleString *keyName;
+    bool found;
+    Label *labels;
+    size_t labelsCount;
+    RangeWriter writer;
+    uint64_t version; // of the series when its range was written
+} MRangeSeries;
+
+// GROUPBY <label> REDUCE <reducer> of TS.MRANGE, `label` is NULL without GROUPBY
+typedef struct MRangeGroupBy
+{
+    RedisModuleString *label;
+    TS_AGG_TYPES_T reducerType;
+    AggregationClass *reducer;
+} MRangeGroupBy;
+
+typedef struct MRangeCtx
+{
+    RedisModuleBlockedClient *bc;
+    api_timestamp_t start_ts;
+    api_timestamp_t end_ts;
+    AggregationClass *aggObject;
+    int64_t time_delta;
+    long long count;
+    bool rev;
+    ValueFilter filter;
+    size_t downsample; // the points of the LTTB downsampling, 0 without it
+    bool withLabels;
+    MRangeGroupBy groupBy;
+    MRangeSeries *series;
+    size_t seriesCount;
+    size_t pendingJobs;
+    // the cursor of the next page, -1 without CURSOR
+    long long nextCursor;
+    // set when the reply goes to the query cache, for a query run at indexVersion
+    RedisModuleString *cacheKey;
+    uint64_t indexVersion;
+    // with PROFILE, the query runs on the main thread and replies with its stages
+    bool profile;
+    QueryBudget *budget;
+} MRangeCtx;
+
+typedef struct MRangeJob
+{
+    MRangeCtx *mrange;
+    size_t start;
+    size_t end;
+} MRangeJob;
+
+static size_t MRangeSamplesToRead(const MRangeCtx *query, Series *series) {
+    return RangeSamplesToRead(series,
+                              query->start_ts,
+                              query->end_ts,
+                              query->aggObject != NULL || query->downsample > 0,
+                              query->count,
+                              &query->filter);
+}
+
+static void MRangeJobRun(void *arg) {
+    MRangeJob *job = arg;
+    MRangeCtx *mrange = job->mrange;
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(mrange->bc);
+    for (size_t i = job->start; i < job->end; ++i) {
+        MRangeSeries *result = &mrange->series[i];
         RedisModuleKey *key;
-        const int status = SilentGetSeries(ctx,
-                                           RedisModule_CreateString(ctx, currentKey, currentKeyLen),
-                                           &key,
-                                           &series,
-                                           REDISMODULE_READ);
-        if (!status) {
+        Series *series, *copy = NULL;
+        EpochGuard guard;
+
+        if (!QueryBudgetCheck(mrange->budget)) {
+            break;
+        }
+        RedisModule_ThreadSafeContextLock(ctx);
+        STAGE_BEGIN(STAGE_KEY_LOOKUP, lookupStart);
+        bool found = SilentGetSeries(ctx, result->keyName, &key, &series, REDISMODULE_READ);
+        STAGE_END(STAGE_KEY_LOOKUP, lookupStart);
+        if (found) {
+            if (QueryBudgetCharge(mrange->budget, MRangeSamplesToRead(mrange, series))) {
+                Epoch_Enter(&guard);
+                copy = SeriesSnapshot(series, mrange->start_ts, mrange->end_ts, &guard);
+                result->version = series->version;
+                if (mrange->withLabels || mrange->groupBy.label != NULL) {
+                    result->labels = RetainLabels(series->labels, series->labelsCount);
+                    result->labelsCount = series->labelsCount;
+                }
+            }
+            RedisModule_CloseKey(key);
+        }
+        RedisModule_ThreadSafeContextUnlock(ctx);
+
+        if (QueryBudgetExceeded(mrange->budget)) {
+            if (copy != NULL) {
+                // the other jobs exceeded the budget meanwhile
+                FreeSeriesSnapshot(copy);
+                Epoch_Exit(&guard);
+            }
+            break;
+        }
+        if (copy == NULL) {
             RedisModule_Log(ctx,
                             "warning",
-                            "couldn't open key or key is not a Timeseries. key=%.*s",
-                            currentKeyLen,
-                            currentKey);
-            // The iterator may have been invalidated, stop and restart from after the current key.
-            RedisModule_DictIteratorStop(iter);
-            iter = RedisModule_DictIteratorStartC(result, ">", currentKey, currentKeyLen);
+                            "couldn't open key or key is not a Timeseries. key=%s",
+                            RedisModule_StringPtrLen(result->keyName, NULL));
             continue;
         }
-        RedisModule_ReplyWithArray(ctx, 3);
-        RedisModule_ReplyWithStringBuffer(ctx, currentKey, currentKeyLen);
-        if (withlabels_location >= 0) {
-            ReplyWithSeriesLabels(ctx, series);
-        } else {
-            RedisModule_ReplyWithArray(ctx, 0);
-        }
-        ReplySeriesRange(ctx, series, start_ts, end_ts, aggObject, time_delta, count, rev);
-        replylen++;
-        RedisModule_CloseKey(key);
+        result->found = true;
+        STAGE_BEGIN(STAGE_SERIES_READ, readStart);
+        WriteSeriesRange(&result->writer,
+                         copy,
+                         mrange->start_ts,
+                         mrange->end_ts,
+                         mrange->aggObject,
+                         mrange->time_delta,
+                         mrange->count,
+                         mrange->rev,
+                         &mrange->filter,
+                         mrange->downsample);
+        STAGE_END(STAGE_SERIES_READ, readStart);
+        FreeSeriesSnapshot(copy);
+        Epoch_Exit(&guard);
     }
-    RedisModule_DictIteratorStop(iter);
-    RedisModule_ReplySetArrayLength(ctx, replylen);
+    RedisModule_FreeThreadSafeContext(ctx);
 
-    return REDISMODULE_OK;
+    if (__atomic_sub_fetch(&mrange->pendingJobs, 1, __ATOMIC_ACQ_REL) == 0) {
+        RedisModule_UnblockClient(mrange->bc, mrange);
+    }
+    free(job);
 }
 
-int TSDB_mrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return TSDB_generic_mrange(ctx, argv, argc, false);
-}
+/*
+ * With GROUPBY, the series are grouped by their value of the label, and each group is replied as
+ * a single series whose samples reduce the samples of the group sharing a timestamp. The ranges of
+ * a group are merged in one pass, a heap holding the next sample of each range.
+ */
+typedef struct MRangeCursor
+{
+    const Sample *samples;
+    size_t count;
+    size_t pos;
+} MRangeCursor;
+
+typedef struct MRangeGroupMember
+{
+    size_t index;
+    const char *value;
+    size_t valueLen;
+} MRangeGroupMember;
+
+static int CompareGroupMembers(const void *a, const void *b) {
+    const MRangeGroupMember *left = a, *right = b;
+    int cmp = memcmp(left->value, right->value, min(left->valueLen, right->valueLen));
+    if (cmp == 0 && left->valueLen != right->valueLen) {
+        cmp = left->valueLen < right->valueLen ? -1 : 1;
+    }
+    if (cmp == 0) { // keep the order of the index within a group
+        cmp = left->index < right->index ? -1 : left->index > right->index;
+    }
+    return cmp;
+}
+
+static inline bool CursorBefore(const MRangeCursor *a, const MRangeCursor *b, bool rev) {
+    timestamp_t left = a->samples[a->pos].timestamp, right = b->samples[b->pos].timestamp;
+    return rev ? left > right : left < right;
+}
+
+static void CursorHeapSiftDown(MRangeCursor *heap, size_t count, size_t pos, bool rev) {
+    while (true) {
+        size_t first = pos, child = 2 * pos + 1;
+        if (child < count && CursorBefore(&heap[child], &heap[first], rev)) {
+            first = child;
+        }
+        if (child + 1 < count && CursorBefore(&heap[child + 1], &heap[first], rev)) {
+            first = child + 1;
+        }
+        if (first == pos) {
+            return;
+        }
+        MRangeCursor cursor = heap[pos];
+        heap[pos] = heap[first];
+        heap[first] = cursor;
+        pos = first;
+    }
+}
+
+// Replies with the samples of the ranges reduced by timestamp, the heap holds non-empty ranges
+static void ReplyReducedSamples(RedisModuleCtx *ctx,
+                                MRangeCursor *heap,
+                                size_t count,
+                                AggregationClass *reducer,
+                                bool rev) {
+    for (size_t i = count / 2; i-- > 0;) {
+        CursorHeapSiftDown(heap, count, i, rev);
+    }
+    void *context = reducer->createContext();
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    long long arraylen = 0;
+    while (count > 0) {
+        timestamp_t timestamp = heap[0].samples[heap[0].pos].timestamp;
+        while (count > 0 && heap[0].samples[heap[0].pos].timestamp == timestamp) {
+            reducer->appendValue(context, heap[0].samples[heap[0].pos].value);
+            if (++heap[0].pos == heap[0].count) {
+                heap[0] = heap[--count];
+            }
+            CursorHeapSiftDown(heap, count, 0, rev);
+        }
+        double value;
+        if (reducer->finalize(context, &value) == TSDB_OK) {
+            ReplyWithSample(ctx, timestamp, value);
+            arraylen++;
+        }
+        reducer->resetContext(context);
+    }
+    reducer->freeContext(context);
+    RedisModule_ReplySetArrayLength(ctx, arraylen);
+}
+
+static const char *SeriesLabelValue(const MRangeSeries *series,
+                                    const char *label,
+                                    size_t labelLen,
+                                    size_t *valueLen) {
+    for (size_t i = 0; i < series->labelsCount; i++) {
+        size_t len;
+        const char *key = RedisModule_StringPtrLen(series->labels[i].key, &len);
+        if (len == labelLen && memcmp(key, label, len) == 0) {
+            return RedisModule_StringPtrLen(series->labels[i].value, valueLen);
+        }
+    }
+    return NULL;
+}
+
+static void ReplyWithLabelPair(RedisModuleCtx *ctx,
+                               const char *key,
+                               size_t keyLen,
+                               const char *value,
+                               size_t valueLen) {
+    RedisModule_ReplyWithArray(ctx, 2);
+    RedisModule_ReplyWithStringBuffer(ctx, key, keyLen);
+    RedisModule_ReplyWithStringBuffer(ctx, value, valueLen);
+}
+
+// Sorts the series carrying the label by their value of it, returns the number of members
+static size_t GroupSeriesMembers(const MRangeSeries *series,
+                                 size_t seriesCount,
+                                 const char *label,
+                                 size_t labelLen,
+                                 MRangeGroupMember *members) {
+    size_t membersCount = 0;
+    for (size_t i = 0; i < seriesCount; i++) {
+        MRangeGroupMember *member = &members[membersCount];
+        if (series[i].found &&
+            (member->value = SeriesLabelValue(&series[i], label, labelLen, &member->valueLen))) {
+            member->index = i;
+            membersCount++;
+        }
+    }
+    qsort(members, membersCount, sizeof(MRangeGroupMember), CompareGroupMembers);
+    return membersCount;
+}
+
+// The end of the group of the members starting at `start`
+static size_t GroupEnd(const MRangeGroupMember *members, size_t membersCount, size_t start) {
+    const MRangeGroupMember *first = &members[start];
+    size_t end = start + 1;
+    while (end < membersCount && members[end].valueLen == first->valueLen &&
+           memcmp(members[end].value, first->value, first->valueLen) == 0) {
+        end++;
+    }
+    return end;
+}
+
+// Joins the key names of the series of a group, separated by commas
+static char *GroupSources(const MRangeSeries *series,
+                          const MRangeGroupMember *members,
+                          size_t start,
+                          size_t end,
+                          size_t *len) {
+    size_t sourcesLen = 0;
+    for (size_t i = start; i < end; i++) {
+        size_t keyLen;
+        RedisModule_StringPtrLen(series[members[i].index].keyName, &keyLen);
+        sourcesLen += keyLen + 1;
+    }
+    char *sources = malloc(sourcesLen);
+    size_t pos = 0;
+    for (size_t i = start; i < end; i++) {
+        size_t keyLen;
+        const char *key = RedisModule_StringPtrLen(series[members[i].index].keyName, &keyLen);
+        memcpy(sources + pos, key, keyLen);
+        pos += keyLen;
+        sources[pos++] = ',';
+    }
+    *len = pos - 1;
+    return sources;
+}
+
+// The name of a group, then its labels: label=value, the reducer and the source series
+static void ReplyGroupHeader(RedisModuleCtx *ctx,
+                             const char *label,
+                             size_t labelLen,
+                             const char *value,
+                             size_t valueLen,
+                             TS_AGG_TYPES_T reducerType,
+                             const char *sources,
+                             size_t sourcesLen) {
+    const char *reducerName = AggTypeEnumToString(reducerType);
+    char *name = malloc(labelLen + 1 + valueLen);
+    memcpy(name, label, labelLen);
+    name[labelLen] = '=';
+    memcpy(name + labelLen + 1, value, valueLen);
+    RedisModule_ReplyWithArray(ctx, 3);
+    RedisModule_ReplyWithStringBuffer(ctx, name, labelLen + 1 + valueLen);
+    free(name);
+    RedisModule_ReplyWithArray(ctx, 3);
+    ReplyWithLabelPair(ctx, label, labelLen, value, valueLen);
+    ReplyWithLabelPair(
+        ctx, "__reducer__", strlen("__reducer__"), reducerName, strlen(reducerName));
+    ReplyWithLabelPair(ctx, "__source__", strlen("__source__"), sources, sourcesLen);
+}
+
+// Replies with the groups of `series`, series without the label belong to no group
+static void ReplyGroupedSeries(RedisModuleCtx *ctx,
+                               const MRangeSeries *series,
+                               size_t seriesCount,
+                               const MRangeGroupBy *groupBy,
+                               bool rev) {
+    size_t labelLen;
+    const char *label = RedisModule_StringPtrLen(groupBy->label, &labelLen);
+    MRangeGroupMember *members = malloc(max(seriesCount, 1) * sizeof(MRangeGroupMember));
+    size_t membersCount = GroupSeriesMembers(series, seriesCount, label, labelLen, members);
+
+    MRangeCursor *heap = malloc(max(membersCount, 1) * sizeof(MRangeCursor));
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    long long replylen = 0;
+    for (size_t start = 0, end; start < membersCount; start = end) {
+        end = GroupEnd(members, membersCount, start);
+        size_t heapCount = 0;
+        for (size_t i = start; i < end; i++) {
+            const MRangeSeries *member = &series[members[i].index];
+            if (member->writer.count > 0) {
+                heap[heapCount++] = (MRangeCursor){ .samples = member->writer.samples,
+                                                    .count = member->writer.count };
+            }
+        }
+
+        size_t sourcesLen;
+        char *sources = GroupSources(series, members, start, end, &sourcesLen);
+        ReplyGroupHeader(ctx,
+                         label,
+                         labelLen,
+                         members[start].value,
+                         members[start].valueLen,
+                         groupBy->reducerType,
+                         sources,
+                         sourcesLen);
+        free(sources);
+
+        ReplyReducedSamples(ctx, heap, heapCount, groupBy->reducer, rev);
+        replylen++;
+    }
+    RedisModule_ReplySetArrayLength(ctx, replylen);
+    free(heap);
+    free(members);
+}
+
+// A paged reply starts with the cursor of the next page, 0 after the last page
+static void ReplyWithNextCursor(RedisModuleCtx *ctx, long long nextCursor) {
+    if (nextCursor >= 0) {
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithLongLong(ctx, nextCursor);
+    }
+}
+
+static void ReplyMRangeSeries(RedisModuleCtx *ctx,
+                              const MRangeCtx *query,
+                              const MRangeSeries *series,
+                              size_t seriesCount) {
+    ReplyWithNextCursor(ctx, query->nextCursor);
+    if (query->groupBy.label != NULL) {
+        ReplyGroupedSeries(ctx, series, seriesCount, &query->groupBy, query->rev);
+        return;
+    }
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    long long replylen = 0;
+    for (size_t i = 0; i < seriesCount; ++i) {
+        const MRangeSeries *result = &series[i];
+        if (!result->found) {
+            continue;
+        }
+        RedisModule_ReplyWithArray(ctx, 3);
+        RedisModule_ReplyWithString(ctx, result->keyName);
+        ReplyWithLabels(ctx, result->labels, result->labelsCount);
+        RedisModule_ReplyWithArray(ctx, result->writer.count);
+        for (size_t j = 0; j < result->writer.count; ++j) {
+            ReplyWithSample(
+                ctx, result->writer.samples[j].timestamp, result->writer.samples[j].value);
+        }
+        replylen++;
+    }
+    RedisModule_ReplySetArrayLength(ctx, replylen);
+}
+
+static void FreeMRangeSeries(MRangeSeries *series, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        MRangeSeries *result = &series[i];
+        RedisModule_FreeString(NULL, result->keyName);
+        if (result->labels != NULL) {
+            ReleaseLabels(result->labels, result->labelsCount);
+        }
+        free(result->writer.samples);
+    }
+    free(series);
+}
+
+// The series of a TS.MRANGE in the query cache
+typedef struct MRangeCached
+{
+    MRangeSeries *series;
+    size_t seriesCount;
+} MRangeCached;
+
+static void FreeMRangeCached(void *value) {
+    MRangeCached *cached = value;
+    FreeMRangeSeries(cached->series, cached->seriesCount);
+    free(cached);
+}
+
+// Hands the series over to the query cache
+static void MRangeCacheSeries(const MRangeCtx *query, MRangeSeries *series, size_t seriesCount) {
+    MRangeCached *cached = malloc(sizeof(MRangeCached));
+    cached->series = series;
+    cached->seriesCount = seriesCount;
+    QueryCache_Put(query->cacheKey, query->indexVersion, cached, FreeMRangeCached);
+}
+
+static int MRangeReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    MRangeCtx *mrange = RedisModule_GetBlockedClientPrivateData(ctx);
+    if (QueryBudgetExceeded(mrange->budget)) {
+        return ReplyQueryBudgetExceeded(ctx, mrange->budget);
+    }
+    STAGE_BEGIN(STAGE_REPLY, replyStart);
+    ReplyMRangeSeries(ctx, mrange, mrange->series, mrange->seriesCount);
+    STAGE_END(STAGE_REPLY, replyStart);
+    if (mrange->cacheKey != NULL) {
+        MRangeCacheSeries(mrange, mrange->series, mrange->seriesCount);
+        mrange->series = NULL;
+        mrange->seriesCount = 0;
+    }
+    return REDISMODULE_OK;
+}
+
+static void MRangeFree(RedisModuleCtx *ctx, void *privdata) {
+    MRangeCtx *mrange = privdata;
+    FreeMRangeSeries(mrange->series, mrange->seriesCount);
+    if (mrange->groupBy.label != NULL) {
+        RedisModule_FreeString(NULL, mrange->groupBy.label);
+    }
+    if (mrange->cacheKey != NULL) {
+        RedisModule_FreeString(NULL, mrange->cacheKey);
+    }
+    free(mrange->budget);
+    free(mrange);
+}
+
+static bool CanBlockClient(RedisModuleCtx *ctx) {
+    int flags = RedisModule_GetContextFlags(ctx);
+    return !(flags & (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA |
+                      REDISMODULE_CTX_FLAGS_DENY_BLOCKING));
+}
+
+static int MRangeOnThreadPool(RedisModuleCtx *ctx,
+                              const MRangeCtx *query,
+                              RedisModuleString **result,
+                              size_t result_count) {
+    MRangeCtx *mrange = malloc(sizeof(MRangeCtx));
+    *mrange = *query;
+    if (query->groupBy.label != NULL) {
+        mrange->groupBy.label = RedisModule_CreateStringFromString(NULL, query->groupBy.label);
+    }
+    if (query->cacheKey != NULL) {
+        mrange->cacheKey = RedisModule_CreateStringFromString(NULL, query->cacheKey);
+    }
+    mrange->budget = malloc(sizeof(QueryBudget));
+    *mrange->budget = *query->budget;
+    mrange->series = calloc(result_count, sizeof(MRangeSeries));
+    mrange->seriesCount = 0;
+    for (size_t i = 0; i < result_count; i++) {
+        mrange->series[mrange->seriesCount++].keyName =
+            RedisModule_CreateStringFromString(NULL, result[i]);
+    }
+
+    size_t numJobs = (mrange->seriesCount + MRANGE_SERIES_PER_JOB - 1) / MRANGE_SERIES_PER_JOB;
+    mrange->pendingJobs = numJobs;
+    mrange->bc = RedisModule_BlockClient(ctx, MRangeReply, NULL, MRangeFree, 0);
+    for (size_t i = 0; i < numJobs; ++i) {
+        MRangeJob *job = malloc(sizeof(MRangeJob));
+        job->mrange = mrange;
+        job->start = i * MRANGE_SERIES_PER_JOB;
+        job->end = min(job->start + MRANGE_SERIES_PER_JOB, mrange->seriesCount);
+        ThreadPool_AddJob(MRangeJobRun, job);
+    }
+    return REDISMODULE_OK;
+}
+
+// CURSOR <cursor> [LIMIT <series>] of TS.MRANGE, they come before the filters
+static int parseCursorArguments(RedisModuleCtx *ctx,
+                                RedisModuleString **argv,
+                                int filter_location,
+                                long long *cursor,
+                                long long *limit) {
+    int offset = RMUtil_ArgIndex("CURSOR", argv, filter_location);
+    int limit_offset = RMUtil_ArgIndex("LIMIT", argv, filter_location);
+    if (offset < 0) {
+        if (limit_offset >= 0) {
+            RTS_ReplyGeneralError(ctx, "TSDB: LIMIT requires CURSOR");
+            return TSDB_ERROR;
+        }
+        return TSDB_NOTEXISTS;
+    }
+    if (offset + 1 >= filter_location ||
+        RedisModule_StringToLongLong(argv[offset + 1], cursor) != REDISMODULE_OK || *cursor < 0) {
+        RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse CURSOR");
+        return TSDB_ERROR;
+    }
+    *limit = MRANGE_CURSOR_DEFAULT_LIMIT;
+    if (limit_offset >= 0 &&
+        (limit_offset + 1 >= filter_location ||
+         RedisModule_StringToLongLong(argv[limit_offset + 1], limit) != REDISMODULE_OK ||
+         *limit <= 0)) {
+        RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse LIMIT");
+        return TSDB_ERROR;
+    }
+    return TSDB_OK;
+}
+
+static int parseGroupByArguments(RedisModuleCtx *ctx,
+                                 RedisModuleString **argv,
+                                 int argc,
+                                 int filter_location,
+                                 int offset,
+                                 MRangeGroupBy *groupBy) {
+    if (offset < 0) {
+        return TSDB_NOTEXISTS;
+    }
+    // GROUPBY comes after the filters
+    if (offset < filter_location) {
+        RTS_ReplyGeneralError(ctx, "TSDB: GROUPBY must follow FILTER");
+        return TSDB_ERROR;
+    }
+    if (offset + 3 >= argc || RMUtil_StringEqualsCaseC(argv[offset + 2], "REDUCE") == 0) {
+        RTS_ReplyGeneralError(ctx, "TSDB: missing REDUCE");
+        return TSDB_ERROR;
+    }
+    int reducerType = RMStringLenAggTypeToEnum(argv[offset + 3]);
+    if (reducerType <= TS_AGG_NONE || reducerType >= TS_AGG_TYPES_MAX ||
+        IsCounterAggType(reducerType)) {
+        RTS_ReplyGeneralError(ctx, "TSDB: Unknown reducer type");
+        return TSDB_ERROR;
+    }
+    groupBy->label = argv[offset + 1];
+    groupBy->reducerType = reducerType;
+    groupBy->reducer = GetAggClass(reducerType);
+    return TSDB_OK;
+}
+
+// Writes the range of a series on the main thread
+static void MRangeWriteSeries(RedisModuleCtx *ctx, const MRangeCtx *query, MRangeSeries *result) {
+    RedisModuleKey *key;
+    Series *series;
+    if (!QueryBudgetCheck(query->budget)) {
+        return;
+    }
+    STAGE_BEGIN(STAGE_KEY_LOOKUP, lookupStart);
+    bool found = SilentGetSeries(ctx, result->keyName, &key, &series, REDISMODULE_READ);
+    STAGE_END(STAGE_KEY_LOOKUP, lookupStart);
+    if (!found) {
+        return;
+    }
+    if (!QueryBudgetCharge(query->budget, MRangeSamplesToRead(query, series))) {
+        RedisModule_CloseKey(key);
+        return;
+    }
+    result->found = true;
+    result->version = series->version;
+    if (query->withLabels || query->groupBy.label != NULL) {
+        result->labels = RetainLabels(series->labels, series->labelsCount);
+        result->labelsCount = series->labelsCount;
+    }
+    STAGE_BEGIN(STAGE_SERIES_READ, readStart);
+    WriteSeriesRange(&result->writer,
+                     series,
+                     query->start_ts,
+                     query->end_ts,
+                     query->aggObject,
+                     query->time_delta,
+                     query->count,
+                     query->rev,
+                     &query->filter,
+                     query->downsample);
+    STAGE_END(STAGE_SERIES_READ, readStart);
+    RedisModule_CloseKey(key);
+}
+
+/*
+ * Brings a cached series up to date. When samples were only appended since, the samples before
+ * the last cached bucket are kept and the range is written on from that bucket.
+ */
+static void MRangeRefreshSeries(RedisModuleCtx *ctx, const MRangeCtx *query, MRangeSeries *result) {
+    RedisModuleKey *key;
+    Series *series;
+    bool found = SilentGetSeries(ctx, result->keyName, &key, &series, REDISMODULE_READ);
+    if (found && result->found && series->version == result->version) {
+        RedisModule_CloseKey(key);
+        return;
+    }
+    RangeWriter *writer = &result->writer;
+    if (found && result->found && series->rewriteVersion <= result->version && !query->rev &&
+        series->retentionTime == 0 && query->downsample == 0 && writer->count > 0) {
+        writer->count--;
+        timestamp_t resume = max(writer->samples[writer->count].timestamp, query->start_ts);
+        WriteSeriesRange(writer,
+                         series,
+                         resume,
+                         query->end_ts,
+                         query->aggObject,
+                         query->time_delta,
+                         query->count == -1 ? -1 : query->count - (long long)writer->count,
+                         false,
+                         &query->filter,
+                         query->downsample);
+        result->version = series->version;
+        RedisModule_CloseKey(key);
+        return;
+    }
+    if (found) {
+        RedisModule_CloseKey(key);
+    }
+
+    if (result->labels != NULL) {
+        ReleaseLabels(result->labels, result->labelsCount);
+        result->labels = NULL;
+        result->labelsCount = 0;
+    }
+    writer->count = 0;
+    result->found = false;
+    MRangeWriteSeries(ctx, query, result);
+}
+
+// Replies with the ranges of the series in `result`
+static int MRangeReplyPage(RedisModuleCtx *ctx,
+                           const MRangeCtx *query,
+                           RedisModuleString **result,
+                           size_t result_count) {
+    if (!query->profile && ThreadPool_IsActive() && result_count > 0 && CanBlockClient(ctx)) {
+        return MRangeOnThreadPool(ctx, query, result, result_count);
+    }
+
+    // the groups and the cache need all the series before replying, a profile its reply apart,
+    // and a budget may fail the query after some were read
+    if (query->groupBy.label != NULL || query->cacheKey != NULL || query->profile ||
+        QueryBudgetBoundsReading(query->budget)) {
+        MRangeSeries *series = calloc(max(result_count, 1), sizeof(MRangeSeries));
+        for (size_t i = 0; i < result_count; i++) {
+            series[i].keyName = RedisModule_CreateStringFromString(NULL, result[i]);
+            MRangeWriteSeries(ctx, query, &series[i]);
+        }
+        if (QueryBudgetExceeded(query->budget)) {
+            FreeMRangeSeries(series, result_count);
+            return ReplyQueryBudgetExceeded(ctx, query->budget);
+        }
+        STAGE_BEGIN(STAGE_REPLY, replyStart);
+        ReplyMRangeSeries(ctx, query, series, result_count);
+        STAGE_END(STAGE_REPLY, replyStart);
+        if (query->cacheKey != NULL) {
+            MRangeCacheSeries(query, series, result_count);
+        } else {
+            FreeMRangeSeries(series, result_count);
+        }
+        return REDISMODULE_OK;
+    }
+
+    ReplyWithNextCursor(ctx, query->nextCursor);
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+
+    long long replylen = 0;
+    Series *series;
+    for (size_t i = 0; i < result_count; i++) {
+        RedisModuleKey *key;
+        STAGE_BEGIN(STAGE_KEY_LOOKUP, lookupStart);
+        const int status = SilentGetSeries(ctx, result[i], &key, &series, REDISMODULE_READ);
+        STAGE_END(STAGE_KEY_LOOKUP, lookupStart);
+        if (!status) {
+            RedisModule_Log(ctx,
+                            "warning",
+                            "couldn't open key or key is not a Timeseries. key=%s",
+                            RedisModule_StringPtrLen(result[i], NULL));
+            continue;
+        }
+        RedisModule_ReplyWithArray(ctx, 3);
+        RedisModule_ReplyWithString(ctx, result[i]);
+        if (query->withLabels) {
+            ReplyWithSeriesLabels(ctx, series);
+        } else {
+            RedisModule_ReplyWithArray(ctx, 0);
+        }
+        // the range is replied as it is read
+        STAGE_BEGIN(STAGE_SERIES_READ, readStart);
+        ReplySeriesRange(ctx,
+                         series,
+                         query->start_ts,
+                         query->end_ts,
+                         query->aggObject,
+                         query->time_delta,
+                         query->count,
+                         query->rev,
+                         &query->filter,
+                         query->downsample);
+        STAGE_END(STAGE_SERIES_READ, readStart);
+        replylen++;
+        RedisModule_CloseKey(key);
+    }
+    RedisModule_ReplySetArrayLength(ctx, replylen);
+
+    return REDISMODULE_OK;
+}
+
+/*
+ * Parses the arguments of TS.MRANGE into `query` and its filters, replying with the error on
+ * failure. `cursorId` is -1 without CURSOR.
+ */
+static int parseMRangeQuery(RedisModuleCtx *ctx,
+                            RedisModuleString **argv,
+                            int argc,
+                            bool rev,
+                            MRangeCtx *query,
+                            QueryPredicate **queries,
+                            size_t *queryCount,
+                            long long *cursorId,
+                            long long *limit) {
+    if (argc < 4) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+
+    api_timestamp_t start_ts, end_ts;
+    api_timestamp_t time_delta = 0;
+    Series fake_series = { 0 };
+    fake_series.lastTimestamp = LLONG_MAX;
+    if (parseRangeArguments(ctx, &fake_series, 1, argv, &start_ts, &end_ts) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    AggregationClass *aggObject = NULL;
+    const int aggregationResult = parseAggregationArgs(ctx, argv, argc, &time_delta, &aggObject);
+    if (aggregationResult == TSDB_ERROR) {
+        return REDISMODULE_ERR;
+    }
+
+    const int filter_location = RMUtil_ArgIndex("FILTER", argv, argc);
+    if (filter_location == -1) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+
+    long long count = -1;
+    if (parseCountArgument(ctx, argv, argc, &count) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    // the arguments after FILTER are label filters
+    ValueFilter valueFilter;
+    if (parseValueFilterArgument(ctx, argv, filter_location, &valueFilter) != TSDB_OK) {
+        return REDISMODULE_ERR;
+    }
+    size_t downsample;
+    if (parseDownsampleArgument(ctx, argv, filter_location, aggObject != NULL, &downsample) !=
+        TSDB_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    MRangeGroupBy groupBy = { 0 };
+    const int groupby_location = RMUtil_ArgIndex("GROUPBY", argv, argc);
+    if (parseGroupByArguments(ctx, argv, argc, filter_location, groupby_location, &groupBy) ==
+        TSDB_ERROR) {
+        return REDISMODULE_ERR;
+    }
+
+    *cursorId = -1;
+    *limit = 0;
+    const int cursorResult = parseCursorArguments(ctx, argv, filter_location, cursorId, limit);
+    if (cursorResult == TSDB_ERROR) {
+        return REDISMODULE_ERR;
+    }
+    if (cursorResult == TSDB_OK && groupBy.label != NULL) {
+        RTS_ReplyGeneralError(ctx, "TSDB: CURSOR cannot be used with GROUPBY");
+        return REDISMODULE_ERR;
+    }
+
+    QueryBudget *budget = RedisModule_PoolAlloc(ctx, sizeof(QueryBudget));
+    if (parseQueryBudget(ctx, argv, filter_location, false, budget) != TSDB_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    *queryCount = (groupby_location >= 0 ? groupby_location : argc) - 1 - filter_location;
+    const int withlabels_location = RMUtil_ArgIndex("WITHLABELS", argv, argc);
+    *query = (MRangeCtx){ .start_ts = start_ts,
+                          .end_ts = end_ts,
+                          .aggObject = aggObject,
+                          .time_delta = time_delta,
+                          .count = count,
+                          .rev = rev,
+                          .filter = valueFilter,
+                          .downsample = downsample,
+                          .withLabels = withlabels_location >= 0,
+                          .groupBy = groupBy,
+                          .nextCursor = -1,
+                          .profile = RMUtil_ArgIndex("PROFILE", argv, filter_location) >= 0,
+                          .budget = budget };
+    *queries = RedisModule_PoolAlloc(ctx, sizeof(QueryPredicate) * *queryCount);
+    if (parseLabelListFromArgs(ctx, argv, filter_location + 1, *queryCount, *queries) ==
+        TSDB_ERROR) {
+        RTS_ReplyGeneralError(ctx, "TSDB: failed parsing labels");
+        return REDISMODULE_ERR;
+    }
+
+    if (CountMatcherPredicates(*queries, *queryCount) == 0) {
+        RTS_ReplyGeneralError(ctx, "TSDB: please provide at least one matcher");
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+/*
+ * With PROFILE, the reply is an array of the reply of the query and of its stages, each an array
+ * of its name, its calls and the microseconds they took, "total" being the whole command.
+ */
+#if STAGE_STATS
+static void ReplyWithStageProfile(RedisModuleCtx *ctx,
+                                  const StageProfile *profile,
+                                  uint64_t totalNs) {
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    RedisModule_ReplyWithArray(ctx, 3);
+    RedisModule_ReplyWithSimpleString(ctx, "total");
+    RedisModule_ReplyWithLongLong(ctx, 1);
+    RedisModule_ReplyWithDouble(ctx, totalNs / 1000.0);
+    long long replylen = 1;
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        if (profile->calls[stage] == 0) {
+            continue;
+        }
+        RedisModule_ReplyWithArray(ctx, 3);
+        RedisModule_ReplyWithSimpleString(ctx, StageStats_Name(stage));
+        RedisModule_ReplyWithLongLong(ctx, profile->calls[stage]);
+        RedisModule_ReplyWithDouble(ctx, profile->ns[stage] / 1000.0);
+        replylen++;
+    }
+    RedisModule_ReplySetArrayLength(ctx, replylen);
+}
+#endif
+
+static int MRangeQueryAndReply(RedisModuleCtx *ctx,
+                               RedisModuleString **argv,
+                               int argc,
+                               MRangeCtx *query,
+                               QueryPredicate *queries,
+                               size_t query_count,
+                               long long cursorId,
+                               long long limit) {
+    // pages are not cached, the cursors would be
+    if (cursorId < 0 && QueryCache_IsEnabled()) {
+        query->cacheKey = QueryCache_Key(ctx, argv, argc);
+        MRangeCached *cached = QueryCache_Get(query->cacheKey);
+        if (cached != NULL) {
+            for (size_t i = 0; i < cached->seriesCount; i++) {
+                MRangeRefreshSeries(ctx, query, &cached->series[i]);
+            }
+            if (QueryBudgetExceeded(query->budget)) {
+                return ReplyQueryBudgetExceeded(ctx, query->budget);
+            }
+            STAGE_BEGIN(STAGE_REPLY, replyStart);
+            ReplyMRangeSeries(ctx, query, cached->series, cached->seriesCount);
+            STAGE_END(STAGE_REPLY, replyStart);
+            return REDISMODULE_OK;
+        }
+        query->indexVersion = IndexVersion();
+    }
+
+    size_t result_count;
+    RedisModuleString **result;
+    QueryCursor *cursor = NULL;
+    if (cursorId > 0) {
+        // the filters are only validated, the keys come from the first page
+        cursor = QueryCursor_Take(cursorId);
+        if (cursor == NULL) {
+            return RTS_ReplyGeneralError(ctx, "TSDB: unknown or expired cursor");
+        }
+    } else {
+        STAGE_BEGIN(STAGE_QUERY_INDEX, indexStart);
+        result = QueryIndex(ctx, queries, query_count, &result_count, NULL);
+        STAGE_END(STAGE_QUERY_INDEX, indexStart);
+        if (cursorId == 0) {
+            cursor = QueryCursor_New(result, result_count);
+        }
+    }
+    if (cursor != NULL) {
+        result = cursor->keys + cursor->pos;
+        result_count = min((size_t)limit, cursor->count - cursor->pos);
+    }
+    if (!QueryBudgetAdmitSeries(query->budget, result_count)) {
+        // the cursor goes with the page it was to reply
+        if (cursor != NULL) {
+            QueryCursor_Free(cursor);
+        }
+        return ReplyQueryBudgetExceeded(ctx, query->budget);
+    }
+    if (cursor != NULL) {
+        query->nextCursor =
+            cursor->pos + result_count < cursor->count ? QueryCursor_Store(cursor) : 0;
+    }
+
+    int rv = MRangeReplyPage(ctx, query, result, result_count);
+    if (cursor != NULL) {
+        if (query->nextCursor > 0) {
+            QueryCursor_Advance(cursor, result_count);
+        } else {
+            QueryCursor_Free(cursor);
+        }
+    }
+    return rv;
+}
+
+int TSDB_generic_mrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, bool rev) {
+    RedisModule_AutoMemory(ctx);
+
+    MRangeCtx query;
+    QueryPredicate *queries;
+    size_t query_count;
+    long long cursorId, limit;
+    if (parseMRangeQuery(
+            ctx, argv, argc, rev, &query, &queries, &query_count, &cursorId, &limit) !=
+        REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (!query.profile) {
+        return MRangeQueryAndReply(
+            ctx, argv, argc, &query, queries, query_count, cursorId, limit);
+    }
+#if STAGE_STATS
+    StageProfile profile;
+    uint64_t start = StageStats_Now();
+    StageStats_BeginProfile(&profile);
+    RedisModule_ReplyWithArray(ctx, 2);
+    int rv = MRangeQueryAndReply(ctx, argv, argc, &query, queries, query_count, cursorId, limit);
+    StageStats_EndProfile();
+    ReplyWithStageProfile(ctx, &profile, StageStats_Now() - start);
+    return rv;
+#else
+    return RTS_ReplyGeneralError(ctx, "TSDB: PROFILE needs a build with STAGE_STATS");
+#endif
+}
+
+int TSDB_mrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return TSDB_generic_mrange(ctx, argv, argc, false);
+}
+
+int TSDB_mrevrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return TSDB_generic_mrange(ctx, argv, argc, true);
+}
+
+static bool SeriesFirstTimestamp(Series *series, timestamp_t *timestamp) {
+    SeriesIterator iterator = SeriesQuery(series, 0, UINT64_MAX, false);
+    Sample sample;
+    bool found = SeriesIteratorGetNext(&iterator, &sample) == CR_OK;
+    SeriesIteratorClose(&iterator);
+    *timestamp = sample.timestamp;
+    return found;
+}
+
+static CompactionRule *FindRule(Series *series, TS_AGG_TYPES_T aggType, timestamp_t timeBucket) {
+    for (CompactionRule *rule = series->rules; rule != NULL; rule = rule->nextRule) {
+        if (rule->aggType == aggType && rule->timeBucket == timeBucket) {
+            return rule;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * With USE_COMPACTIONS, the buckets computed by the compaction rules of the series replace its
+ * samples where they can: the rule buckets must divide the query buckets, and min, max, sum and
+ * count come from a rule of the same aggregation, avg from a sum and a count rule. Left to the
+ * samples are the buckets not wholly within the range, the first bucket of the destinations, which
+ * may compact only the samples added after the rule was created, and the buckets not compacted or
+ * not written to the destinations yet.
+ */
+static bool FindCompactionRoute(RedisModuleCtx *ctx,
+                                Series *series,
+                                AggregationClass *aggObject,
+                                timestamp_t time_delta,
+                                api_timestamp_t start_ts,
+                                api_timestamp_t end_ts,
+                                CompactionRoute *route) {
+    TS_AGG_TYPES_T types[] = { TS_AGG_MIN, TS_AGG_MAX, TS_AGG_SUM, TS_AGG_COUNT, TS_AGG_AVG };
+    TS_AGG_TYPES_T aggType = TS_AGG_NONE;
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (GetAggClass(types[i]) == aggObject) {
+            aggType = types[i];
+        }
+    }
+    if (aggType == TS_AGG_NONE) {
+        return false;
+    }
+
+    // the rules with the largest buckets
+    CompactionRule *valuesRule = NULL, *countsRule = NULL;
+    TS_AGG_TYPES_T valuesType = aggType == TS_AGG_AVG ? TS_AGG_SUM : aggType;
+    for (CompactionRule *rule = series->rules; rule != NULL; rule = rule->nextRule) {
+        if (rule->aggType != valuesType || time_delta % rule->timeBucket != 0 ||
+            rule->startCurrentTimeBucket == -1LL ||
+            (valuesRule != NULL && valuesRule->timeBucket >= rule->timeBucket)) {
+            continue;
+        }
+        CompactionRule *counts = NULL;
+        if (aggType == TS_AGG_AVG &&
+            ((counts = FindRule(series, TS_AGG_COUNT, rule->timeBucket)) == NULL ||
+             counts->startCurrentTimeBucket == -1LL)) {
+            continue;
+        }
+        valuesRule = rule;
+        countsRule = counts;
+    }
+    if (valuesRule == NULL) {
+        return false;
+    }
+
+    timestamp_t bucket = valuesRule->timeBucket, first;
+    route->values = CompactionRuleGetDestSeries(ctx, valuesRule);
+    route->valuesType = valuesType;
+    route->counts = countsRule != NULL ? CompactionRuleGetDestSeries(ctx, countsRule) : NULL;
+    route->end = min(valuesRule->startCurrentTimeBucket, CalcWindowStart(end_ts, bucket));
+    if (route->values == NULL || !SeriesFirstTimestamp(route->values, &first)) {
+        return false;
+    }
+    // ASYNC_COMPACTION may still hold the buckets after the last one written
+    route->start = first + bucket;
+    route->end = min(route->end, route->values->lastTimestamp + bucket);
+    if (countsRule != NULL) {
+        if (route->counts == NULL || !SeriesFirstTimestamp(route->counts, &first)) {
+            return false;
+        }
+        route->start = max(route->start, first + bucket);
+        route->end = min(route->end, countsRule->startCurrentTimeBucket);
+        route->end = min(route->end, route->counts->lastTimestamp + bucket);
+    }
+    route->start = max(route->start, CalcWindowStart(start_ts + bucket - 1, bucket));
+    return route->start < route->end;
+}
+
+int TSDB_generic_range(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, bool rev) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    Series *series;
+    RedisModuleKey *key;
+    const int status = GetSeries(ctx, argv[1], &key, &series, REDISMODULE_READ);
+    if (!status) {
+        return REDISMODULE_ERR;
+    }
+
+    api_timestamp_t start_ts, end_ts;
+    api_timestamp_t time_delta = 0;
+    if (parseRangeArguments(ctx, series, 2, argv, &start_ts, &end_ts) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    long long count = -1;
+    if (parseCountArgument(ctx, argv, argc, &count) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    AggregationClass *aggObjects[TS_AGG_TYPES_MAX];
+    size_t aggCount = 0;
+    int aggregationResult = parseAggregationListArgs(
+        ctx, argv, argc, &time_delta, aggObjects, TS_AGG_TYPES_MAX, &aggCount);
+    if (aggregationResult == TSDB_ERROR) {
+        return REDISMODULE_ERR;
+    }
+
+    bool binary;
+    if (parseFormatArgument(ctx, argv, argc, &binary) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    ValueFilter filter;
+    if (parseValueFilterArgument(ctx, argv, argc, &filter) != TSDB_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    size_t downsample;
+    if (parseDownsampleArgument(ctx, argv, argc, aggCount > 0, &downsample) != TSDB_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    QueryBudget budget;
+    if (parseQueryBudget(ctx, argv, argc, true, &budget) != TSDB_OK) {
+        return REDISMODULE_ERR;
+    }
+    size_t samples = RangeSamplesToRead(
+        series, start_ts, end_ts, aggCount > 0 || downsample > 0, count, &filter);
+    if (!QueryBudgetCharge(&budget, samples)) {
+        return ReplyQueryBudgetExceeded(ctx, &budget);
+    }
+
+    // the compactions summarize all the samples, filtered or not
+    CompactionRoute compactionRoute, *route = NULL;
+    if (RMUtil_ArgIndex("USE_COMPACTIONS", argv, argc) > 0 && aggCount == 1 && !filter.enabled &&
+        FindCompactionRoute(
+            ctx, series, aggObjects[0], time_delta, start_ts, end_ts, &compactionRoute)) {
+        route = &compactionRoute;
+    }
+
+    if (binary) {
+        if (aggCount > 1) {
+            return RTS_ReplyGeneralError(ctx, "TSDB: FORMAT BINARY supports a single aggregation");
+        }
+        AggregationClass *aggObject = aggCount > 0 ? aggObjects[0] : NULL;
+        ReplySeriesRangeBinary(ctx,
+                               series,
+                               start_ts,
+                               end_ts,
+                               aggObject,
+                               time_delta,
+                               count,
+                               rev,
+                               route,
+                               &filter,
+                               downsample);
+    } else {
+        ReplySeriesRangeAggregations(ctx,
+                                     series,
+                                     start_ts,
+                                     end_ts,
+                                     aggObjects,
+                                     aggCount,
+                                     time_delta,
+                                     count,
+                                     rev,
+                                     route,
+                                     &filter,
+                                     downsample);
+    }
+
+    RedisModule_CloseKey(key);
+    return REDISMODULE_OK;
+}
+
+int TSDB_range(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return TSDB_generic_range(ctx, argv, argc, false);
+}
+
+int TSDB_revrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return TSDB_generic_range(ctx, argv, argc, true);
+}
+
+/*
+ * The aggregated buckets of a range query, fed in iteration order with the samples of the series,
+ * and with the buckets of compaction rules when routed.
+ */
+typedef struct RangeAggregator
+{
+    RangeWriter *writer;
+    AggregationClass **aggObjects;
+    void **contexts;
+    size_t aggCount;
+    int64_t time_delta;
+    long long maxResults;
+    bool rev;
+    const ValueFilter *filter; // may be NULL
+    // the samples preceding the buckets are looked up in it, for the aggregations seeded with them
+    Series *series;
+    timestamp_t start_ts;
+    bool empty; // nothing was aggregated yet
+    timestamp_t last_agg_timestamp;
+    long long arraylen;
+} RangeAggregator;
+
+static bool RangeAggregatorFull(const RangeAggregator *agg) {
+    return agg->maxResults != -1 && agg->arraylen >= agg->maxResults;
+}
+
+// Seeds the contexts with the sample preceding `timestamp`, for the aggregations depending on it
+static void RangeAggregatorSeed(RangeAggregator *agg, timestamp_t timestamp) {
+    double value;
+    bool looked = false, found = false;
+    for (size_t i = 0; i < agg->aggCount; i++) {
+        if (agg->aggObjects[i]->seedContext == NULL) {
+            continue;
+        }
+        if (!looked) {
+            found = SeriesPrecedingValue(agg->series, timestamp, agg->filter, &value);
+            looked = true;
+        }
+        if (found) {
+            agg->aggObjects[i]->seedContext(agg->contexts[i], value);
+        }
+    }
+}
+
+// Writes the current bucket unless it is empty, and resets the aggregation contexts
+static void RangeAggregatorWriteBucket(RangeAggregator *agg) {
+    if (agg->rev && !agg->empty) {
+        // the previous bucket in time is yet to be read
+        RangeAggregatorSeed(agg, max(agg->last_agg_timestamp, agg->start_ts));
+    }
+    double values[agg->aggCount];
+    for (size_t i = 0; i < agg->aggCount; i++) {
+        // the aggregations see the same samples, they are either all empty or none is
+        if (agg->aggObjects[i]->finalize(agg->contexts[i], &values[i]) != TSDB_OK) {
+            return;
+        }
+    }
+    WriteSampleValues(agg->writer, agg->last_agg_timestamp, values, agg->aggCount);
+    for (size_t i = 0; i < agg->aggCount; i++) {
+        agg->aggObjects[i]->resetContext(agg->contexts[i]);
+    }
+    agg->arraylen++;
+}
+
+/*
+ * Called before aggregating a sample at `timestamp`. When the sample starts a new bucket, the
+ * previous bucket is written and the aggregation contexts are reset.
+ */
+static void RangeAggregatorMoveTo(RangeAggregator *agg, timestamp_t timestamp) {
+    if (agg->empty) {
+        agg->last_agg_timestamp = CalcWindowStart(timestamp, agg->time_delta);
+    } else if ((agg->rev == false && timestamp >= agg->last_agg_timestamp + agg->time_delta) ||
+               (agg->rev == true && timestamp < agg->last_agg_timestamp)) {
+        RangeAggregatorWriteBucket(agg);
+        agg->last_agg_timestamp = CalcWindowStart(timestamp, agg->time_delta);
+    }
+    agg->empty = false;
+}
+
+/*
+ * Index past the samples from `from` that fall in the bucket bounded by `bound`, its end going
+ * forward or its start in reverse. The timestamps are sorted in iteration order. The run is
+ * galloped over, so that a bucket covering the batch costs a single comparison. Called with a
+ * constant `rev`, each direction is inlined into its own loop.
+ */
+static inline size_t BucketRunEnd(const timestamp_t *timestamps,
+                                  size_t from,
+                                  size_t count,
+                                  timestamp_t bound,
+                                  bool rev) {
+#define IN_BUCKET(ts) (rev ? (ts) >= bound : (ts) < bound)
+    if (from >= count || IN_BUCKET(timestamps[count - 1])) {
+        return count;
+    }
+    size_t lo = from, step = 1;
+    while (true) {
+        size_t hi = min(lo + step, count - 1);
+        if (IN_BUCKET(timestamps[hi])) {
+            lo = hi + 1;
+            step *= 2;
+            continue;
+        }
+        // the run ends within [lo, hi]
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (IN_BUCKET(timestamps[mid])) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+#undef IN_BUCKET
+}
+
+static inline timestamp_t bucketEnd(const RangeAggregator *agg) {
+    return agg->last_agg_timestamp + agg->time_delta;
+}
+
+// Aggregates the samples of the series within [start_ts, end_ts]
+static void RangeAggregatorAddSeries(RangeAggregator *agg,
+                                     Series *series,
+                                     api_timestamp_t start_ts,
+                                     api_timestamp_t end_ts) {
+    const bool rev = agg->rev;
+    SeriesIterator iterator = SeriesQueryFiltered(series, start_ts, end_ts, rev, agg->filter);
+    if (iterator.series == NULL) {
+        return;
+    }
+
+    bool summaries = true;
+    for (size_t j = 0; j < agg->aggCount; j++) {
+        summaries &= agg->aggObjects[j]->appendSummary != NULL;
+    }
+
+    timestamp_t timestamps[SERIES_ITER_BATCH_SIZE];
+    double values[SERIES_ITER_BATCH_SIZE];
+    size_t count;
+    ChunkSummary summary;
+    timestamp_t first, last;
+    while (!RangeAggregatorFull(agg)) {
+        // a chunk lying entirely in one bucket is aggregated from its summary
+        if (summaries && SeriesIteratorPeekChunk(&iterator, &summary, &first, &last) &&
+            CalcWindowStart(first, agg->time_delta) == CalcWindowStart(last, agg->time_delta)) {
+            RangeAggregatorMoveTo(agg, first);
+            if (RangeAggregatorFull(agg)) {
+                break;
+            }
+            for (size_t j = 0; j < agg->aggCount; j++) {
+                agg->aggObjects[j]->appendSummary(agg->contexts[j], &summary);
+            }
+            SeriesIteratorSkipChunk(&iterator);
+            continue;
+        }
+
+        count = SeriesIteratorGetNextBatch(&iterator, timestamps, values, SERIES_ITER_BATCH_SIZE);
+        if (count == 0) {
+            break;
+        }
+        size_t i = 0;
+        while (i < count && !RangeAggregatorFull(agg)) {
+            RangeAggregatorMoveTo(agg, timestamps[i]);
+            if (RangeAggregatorFull(agg)) {
+                break;
+            }
+            // hand the whole run of samples that fall in the current bucket to the
+            // aggregations at once
+            size_t end = rev ? BucketRunEnd(timestamps, i + 1, count, agg->last_agg_timestamp, true)
+                             : BucketRunEnd(timestamps, i + 1, count, bucketEnd(agg), false);
+            for (size_t j = 0; j < agg->aggCount; j++) {
+                AggregationAppendValues(agg->aggObjects[j], agg->contexts[j], values + i, end - i);
+            }
+            i = end;
+        }
+    }
+    SeriesIteratorClose(&iterator);
+}
+
+/*
+ * Aggregates the buckets of the compaction route within [start_ts, end_ts], each bucket stands
+ * for a summary of the samples it compacts.
+ */
+static void RangeAggregatorAddCompactions(RangeAggregator *agg,
+                                          const CompactionRoute *route,
+                                          api_timestamp_t start_ts,
+                                          api_timestamp_t end_ts) {
+    SeriesIterator values = SeriesQuery(route->values, start_ts, end_ts, agg->rev);
+    SeriesIterator counts = { 0 };
+    if (route->counts != NULL) {
+        counts = SeriesQuery(route->counts, start_ts, end_ts, agg->rev);
+    }
+
+    Sample sample, countSample;
+    ChunkResult countResult = CR_OK;
+    while (!RangeAggregatorFull(agg) && SeriesIteratorGetNext(&values, &sample) == CR_OK) {
+        ChunkSummary summary = { .count = 1 };
+        if (route->counts != NULL) {
+            // both rules compact the same samples into the same buckets
+            while (countResult == CR_OK &&
+                   (countResult = SeriesIteratorGetNext(&counts, &countSample)) == CR_OK &&
+                   (agg->rev ? countSample.timestamp > sample.timestamp
+                             : countSample.timestamp < sample.timestamp)) {
+            }
+            if (countResult != CR_OK || countSample.timestamp != sample.timestamp) {
+                continue;
+            }
+            summary.count = countSample.value;
+        }
+        switch (route->valuesType) {
+            case TS_AGG_COUNT:
+                summary.count = sample.value;
+                break;
+            case TS_AGG_SUM:
+                summary.sum = sample.value;
+                break;
+            default: // min or max
+                summary.min = summary.max = sample.value;
+                break;
+        }
+        RangeAggregatorMoveTo(agg, sample.timestamp);
+        if (RangeAggregatorFull(agg)) {
+            break;
+        }
+        agg->aggObjects[0]->appendSummary(agg->contexts[0], &summary);
+    }
+
+    SeriesIteratorClose(&values);
+    if (route->counts != NULL) {
+        SeriesIteratorClose(&counts);
+    }
+}
+
+static int ReplySeriesRangeAggregations(RedisModuleCtx *ctx,
+                                        Series *series,
+                                        api_timestamp_t start_ts,
+                                        api_timestamp_t end_ts,
+                                        AggregationClass **aggObjects,
+                                        size_t aggCount,
+                                        int64_t time_delta,
+                                        long long maxResults,
+                                        bool rev,
+                                        const CompactionRoute *route,
+                                        const ValueFilter *filter,
+                                        size_t downsample) {
+    RangeWriter writer = { .ctx = ctx };
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    long long arraylen = WriteSeriesRangeAggregations(&writer,
+                                                      series,
+                                                      start_ts,
+                                                      end_ts,
+                                                      aggObjects,
+                                                      aggCount,
+                                                      time_delta,
+                                                      maxResults,
+                                                      rev,
+                                                      route,
+                                                      filter,
+                                                      downsample);
+    RedisModule_ReplySetArrayLength(ctx, arraylen);
+    return REDISMODULE_OK;
+}
+
+int ReplySeriesRange(RedisModuleCtx *ctx,
+                     Series *series,
+                     api_timestamp_t start_ts,
+                     api_timestamp_t end_ts,
+                     AggregationClass *aggObject,
+                     int64_t time_delta,
+                     long long maxResults,
+                     bool rev,
+                     const ValueFilter *filter,
+                     size_t downsample) {
+    return ReplySeriesRangeAggregations(ctx,
+                                        series,
+                                        start_ts,
+                                        end_ts,
+                                        &aggObject,
+                                        aggObject != NULL ? 1 : 0,
+                                        time_delta,
+                                        maxResults,
+                                        rev,
+                                        NULL,
+                                        filter,
+                                        downsample);
+}
+
+/*
+ * Replies with two strings holding the samples column by column: the timestamps as little-endian
+ * int64 and the values as little-endian doubles, so the client doesn't parse a RESP pair per
+ * sample.
+ */
+static int ReplySeriesRangeBinary(RedisModuleCtx *ctx,
+                                  Series *series,
+                                  api_timestamp_t start_ts,
+                                  api_timestamp_t end_ts,
+                                  AggregationClass *aggObject,
+                                  int64_t time_delta,
+                                  long long maxResults,
+                                  bool rev,
+                                  const CompactionRoute *route,
+                                  const ValueFilter *filter,
+                                  size_t downsample) {
+    RangeWriter writer = { 0 };
+    WriteSeriesRangeAggregations(&writer,
+                                 series,
+                                 start_ts,
+                                 end_ts,
+                                 &aggObject,
+                                 aggObject != NULL ? 1 : 0,
+                                 time_delta,
+                                 maxResults,
+                                 rev,
+                                 route,
+                                 filter,
+                                 downsample);
+
+    u_int64_t *timestamps = malloc(max(writer.count, 1) * sizeof(u_int64_t));
+    u_int64_t *values = malloc(max(writer.count, 1) * sizeof(u_int64_t));
+    for (size_t i = 0; i < writer.count; i++) {
+        timestamps[i] = writer.samples[i].timestamp;
+        memcpy(&values[i], &writer.samples[i].value, sizeof(double));
+        memrev64ifbe(&timestamps[i]);
+        memrev64ifbe(&values[i]);
+    }
+    RedisModule_ReplyWithArray(ctx, 2);
+    RedisModule_ReplyWithStringBuffer(
+        ctx, (const char *)timestamps, writer.count * sizeof(u_int64_t));
+    RedisModule_ReplyWithStringBuffer(ctx, (const char *)values, writer.count * sizeof(u_int64_t));
+
+    free(timestamps);
+    free(values);
+    free(writer.samples);
+    return REDISMODULE_OK;
+}
+
+// The samples of a bucket of the downsampling
+typedef struct DownsampleBucket
+{
+    Sample *samples;
+    size_t count;
+    size_t capacity;
+    size_t index;
+} DownsampleBucket;
+
+/*
+ * Reduces the samples of a range to at most `points` with Largest-Triangle-Three-Buckets, which
+ * keeps the shape of the data: the first and last samples are kept, and the samples between them
+ * are split by time into points - 2 buckets. Each bucket keeps the sample forming the largest
+ * triangle with the sample kept from the previous bucket and the average of the next bucket.
+ * Samples are fed in iteration order, only the samples of the last two buckets are held.
+ */
+typedef struct Downsampler
+{
+    RangeWriter *writer;
+    size_t points;
+    long long maxResults;
+    long long arraylen;
+    bool rev;
+    timestamp_t origin; // the timestamp iteration starts from
+    double span;
+    bool started;
+    Sample kept; // from the previous bucket
+    DownsampleBucket current;
+    DownsampleBucket next;
+} Downsampler;
+
+static inline double DownsamplerPosition(const Downsampler *ds, timestamp_t timestamp) {
+    return ds->rev ? (double)(ds->origin - timestamp) : (double)(timestamp - ds->origin);
+}
+
+static void DownsamplerWrite(Downsampler *ds, Sample sample) {
+    if (ds->maxResults == -1 || ds->arraylen < ds->maxResults) {
+        WriteSample(ds->writer, sample.timestamp, sample.value);
+        ds->arraylen++;
+    }
+    ds->kept = sample;
+}
+
+// Keeps the sample of `bucket` forming the largest triangle with the kept sample and (cPos, cValue)
+static void DownsamplerKeep(Downsampler *ds,
+                            const DownsampleBucket *bucket,
+                            double cPos,
+                            double cValue) {
+    double aPos = DownsamplerPosition(ds, ds->kept.timestamp), aValue = ds->kept.value;
+    size_t best = 0;
+    double bestArea = -1;
+    for (size_t i = 0; i < bucket->count; i++) {
+        double bPos = DownsamplerPosition(ds, bucket->samples[i].timestamp);
+        double bValue = bucket->samples[i].value;
+        double area = fabs((aPos - cPos) * (bValue - aValue) - (aPos - bPos) * (cValue - aValue));
+        if (area > bestArea) {
+            bestArea = area;
+            best = i;
+        }
+    }
+    DownsamplerWrite(ds, bucket->samples[best]);
+}
+
+static void DownsamplerAverage(const Downsampler *ds,
+                               const DownsampleBucket *bucket,
+                               double *pos,
+                               double *value) {
+    *pos = *value = 0;
+    for (size_t i = 0; i < bucket->count; i++) {
+        *pos += DownsamplerPosition(ds, bucket->samples[i].timestamp);
+        *value += bucket->samples[i].value;
+    }
+    *pos /= bucket->count;
+    *value /= bucket->count;
+}
+
+static void DownsamplerAdd(Downsampler *ds, timestamp_t timestamp, double value) {
+    Sample sample = { .timestamp = timestamp, .value = value };
+    if (!ds->started) {
+        ds->started = true;
+        DownsamplerWrite(ds, sample);
+        return;
+    }
+    size_t index = DownsamplerPosition(ds, timestamp) * (ds->points - 2) / (ds->span + 1);
+    index = min(index, ds->points - 3);
+    if (ds->next.count > 0 && index != ds->next.index) {
+        // the next bucket is complete, the current one can choose its sample
+        if (ds->current.count > 0) {
+            double pos, avg;
+            DownsamplerAverage(ds, &ds->next, &pos, &avg);
+            DownsamplerKeep(ds, &ds->current, pos, avg);
+        }
+        DownsampleBucket bucket = ds->current;
+        ds->current = ds->next;
+        ds->next = bucket;
+        ds->next.count = 0;
+    }
+    DownsampleBucket *next = &ds->next;
+    if (next->count == next->capacity) {
+        next->capacity = max(next->capacity * 2, SERIES_ITER_BATCH_SIZE);
+        next->samples = realloc(next->samples, next->capacity * sizeof(Sample));
+    }
+    next->samples[next->count++] = sample;
+    next->index = index;
+}
+
+// Writes the samples kept from the last buckets, the last sample as is
+static void DownsamplerFinish(Downsampler *ds) {
+    if (ds->next.count > 0) {
+        Sample last = ds->next.samples[--ds->next.count];
+        if (ds->current.count > 0) {
+            double pos = DownsamplerPosition(ds, last.timestamp), avg = last.value;
+            if (ds->next.count > 0) {
+                DownsamplerAverage(ds, &ds->next, &pos, &avg);
+            }
+            DownsamplerKeep(ds, &ds->current, pos, avg);
+        }
+        if (ds->next.count > 0) {
+            DownsamplerKeep(ds, &ds->next, DownsamplerPosition(ds, last.timestamp), last.value);
+        }
+        DownsamplerWrite(ds, last);
+    }
+    free(ds->current.samples);
+    free(ds->next.samples);
+}
+
+static long long WriteSeriesRangeDownsampled(RangeWriter *writer,
+                                             Series *series,
+                                             api_timestamp_t start_ts,
+                                             api_timestamp_t end_ts,
+                                             size_t points,
+                                             long long maxResults,
+                                             bool rev,
+                                             const ValueFilter *filter) {
+    if (series->totalSamples == 0) {
+        return 0;
+    }
+    // the buckets split the time the samples of the range may span
+    timestamp_t first = series->funcs->GetFirstTimestamp(ChunkDir_Get(&series->chunks, 0));
+    start_ts = max(start_ts, first);
+    end_ts = min(end_ts, series->lastTimestamp);
+    if (start_ts > end_ts) {
+        return 0;
+    }
+    Downsampler ds = { .writer = writer,
+                       .points = points,
+                       .maxResults = maxResults,
+                       .rev = rev,
+                       .origin = rev ? end_ts : start_ts,
+                       .span = (double)(end_ts - start_ts) };
+
+    SeriesIterator iterator = SeriesQueryFiltered(series, start_ts, end_ts, rev, filter);
+    if (iterator.series == NULL) {
+        return 0;
+    }
+    timestamp_t timestamps[SERIES_ITER_BATCH_SIZE];
+    double values[SERIES_ITER_BATCH_SIZE];
+    size_t count;
+    while ((maxResults == -1 || ds.arraylen < maxResults) &&
+           (count = SeriesIteratorGetNextBatch(
+                &iterator, timestamps, values, SERIES_ITER_BATCH_SIZE)) > 0) {
+        for (size_t i = 0; i < count; ++i) {
+            DownsamplerAdd(&ds, timestamps[i], values[i]);
+        }
+    }
+    SeriesIteratorClose(&iterator);
+    DownsamplerFinish(&ds);
+    return ds.arraylen;
+}
+
+/*
+ * Writes the samples of the range, or its aggregated buckets, and returns their number. Several
+ * aggregations are computed together in one scan over the same buckets. With a route, the buckets
+ * it covers are aggregated from compactions instead of the samples of the series.
+ */
+static long long WriteSeriesRangeAggregations(RangeWriter *writer,
+                                              Series *series,
+                                              api_timestamp_t start_ts,
+                                              api_timestamp_t end_ts,
+                                              AggregationClass **aggObjects,
+                                              size_t aggCount,
+                                              int64_t time_delta,
+                                              long long maxResults,
+                                              bool rev,
+                                              const CompactionRoute *route,
+                                              const ValueFilter *filter,
+                                              size_t downsample) {
+    // In case a retention is set shouldn't return chunks older than the retention
+    // TODO: move to parseRangeArguments(?)
+    if (series->retentionTime) {
+        start_ts = series->lastTimestamp > series->retentionTime
+                       ? max(start_ts, series->lastTimestamp - series->retentionTime)
+                       : start_ts;
+        // if new start_ts > end_ts, there are no results to return
+        if (start_ts > end_ts) {
+            return 0;
+        }
+    }
+
+    if (downsample > 0) {
+        return WriteSeriesRangeDownsampled(
+            writer, series, start_ts, end_ts, downsample, maxResults, rev, filter);
+    }
+
+    if (aggCount == 0) {
+        // No aggregation
+        SeriesIterator iterator = SeriesQueryFiltered(series, start_ts, end_ts, rev, filter);
+        if (iterator.series == NULL) {
+            return 0;
+        }
+        timestamp_t timestamps[SERIES_ITER_BATCH_SIZE];
+        double values[SERIES_ITER_BATCH_SIZE];
+        size_t count;
+        long long arraylen = 0;
+        while ((maxResults == -1 || arraylen < maxResults) &&
+               (count = SeriesIteratorGetNextBatch(
+                    &iterator, timestamps, values, SERIES_ITER_BATCH_SIZE)) > 0) {
+            if (maxResults != -1) {
+                count = min(count, maxResults - arraylen);
+            }
+            WriteSamples(writer, timestamps, values, count);
+            arraylen += count;
+        }
+        SeriesIteratorClose(&iterator);
+        return arraylen;
+    }
+
+    void *contexts[aggCount];
+    for (size_t j = 0; j < aggCount; j++) {
+        contexts[j] = AggregationCreateContext(aggObjects[j], time_delta, rev);
+    }
+    RangeAggregator agg = { .writer = writer,
+                            .aggObjects = aggObjects,
+                            .contexts = contexts,
+                            .aggCount = aggCount,
+                            .time_delta = time_delta,
+                            .maxResults = maxResults,
+                            .rev = rev,
+                            .filter = filter,
+                            .series = series,
+                            .start_ts = start_ts,
+                            .empty = true };
+    if (!rev) {
+        // the next buckets are seeded as the contexts are reset
+        RangeAggregatorSeed(&agg, start_ts);
+    }
+
+    // the compacted buckets lie within the range, between the samples before and after them
+    if (route == NULL || route->start < start_ts || route->start >= route->end ||
+        route->end > end_ts) {
+        RangeAggregatorAddSeries(&agg, series, start_ts, end_ts);
+    } else if (!rev) {
+        if (route->start > start_ts) {
+            RangeAggregatorAddSeries(&agg, series, start_ts, route->start - 1);
+        }
+        RangeAggregatorAddCompactions(&agg, route, route->start, route->end - 1);
+        RangeAggregatorAddSeries(&agg, series, route->end, end_ts);
+    } else {
+        RangeAggregatorAddSeries(&agg, series, route->end, end_ts);
+        RangeAggregatorAddCompactions(&agg, route, route->start, route->end - 1);
+        if (route->start > start_ts) {
+            RangeAggregatorAddSeries(&agg, series, start_ts, route->start - 1);
+        }
+    }
+
+    if (!RangeAggregatorFull(&agg)) {
+        // reply last bucket of data
+        RangeAggregatorWriteBucket(&agg);
+    }
+    for (size_t j = 0; j < aggCount; j++) {
+        aggObjects[j]->freeContext(contexts[j]);
+    }
+    return agg.arraylen;
+}
+
+static long long WriteSeriesRange(RangeWriter *writer,
+                                  Series *series,
+                                  api_timestamp_t start_ts,
+                                  api_timestamp_t end_ts,
+                                  AggregationClass *aggObject,
+                                  int64_t time_delta,
+                                  long long maxResults,
+                                  bool rev,
+                                  const ValueFilter *filter,
+                                  size_t downsample) {
+    return WriteSeriesRangeAggregations(writer,
+                                        series,
+                                        start_ts,
+                                        end_ts,
+                                        &aggObject,
+                                        aggObject != NULL ? 1 : 0,
+                                        time_delta,
+                                        maxResults,
+                                        rev,
+                                        NULL,
+                                        filter,
+                                        downsample);
+}
+
+// Closes the current bucket of the rule when currentTimestamp starts a new one. Returns false when
+// the destination doesn't exist anymore, and the sample is dropped.
+static bool rollCompactionBucket(RedisModuleCtx *ctx,
+                                 CompactionRule *rule,
+                                 timestamp_t currentTimestamp) {
+    if (rule->startCurrentTimeBucket == -1LL) {
+        // first sample, lets init the startCurrentTimeBucket
+        rule->startCurrentTimeBucket = currentTimestamp;
+    }
+
+    if (currentTimestamp > rule->startCurrentTimeBucket) {
+        Series *destSeries = CompactionRuleGetDestSeries(ctx, rule);
+        if (destSeries == NULL) {
+            // key doesn't exist anymore and we don't do anything
+            return false;
+        }
+
+        double aggVal;
+        if (rule->aggClass->finalize(rule->aggContext, &aggVal) == TSDB_OK) {
+            if (TSGlobalConfig.asyncCompaction) {
+                CompactionQueueAdd(ctx, rule, rule->startCurrentTimeBucket, aggVal);
+            } else {
+                SeriesAddSample(destSeries, rule->startCurrentTimeBucket, aggVal);
+                if (RedisModule_SignalModifiedKey) {
+                    RedisModule_SignalModifiedKey(ctx, rule->destKey);
+                }
+            }
+        }
+        rule->aggClass->resetContext(rule->aggContext);
+        rule->startCurrentTimeBucket = currentTimestamp;
+    }
+    return true;
+}
+
+static void handleCompaction(RedisModuleCtx *ctx,
+                             Series *series,
+                             CompactionRule *rule,
+                             api_timestamp_t timestamp,
+                             double value) {
+    timestamp_t currentTimestamp = CalcWindowStart(timestamp, rule->timeBucket);
+    if (rollCompactionBucket(ctx, rule, currentTimestamp)) {
+        rule->aggClass->appendValue(rule->aggContext, value);
+    }
+}
+
+// Same as calling handleCompaction for each of the samples, which must be in increasing timestamp
+// order, but the samples of each bucket are aggregated as one batch.
+static void handleCompactionBatch(RedisModuleCtx *ctx,
+                                  CompactionRule *rule,
+                                  const timestamp_t *timestamps,
+                                  const double *values,
+                                  size_t count) {
+    size_t i = 0;
+    while (i < count) {
+        timestamp_t currentTimestamp = CalcWindowStart(timestamps[i], rule->timeBucket);
+        size_t j = i + 1;
+        while (j < count && CalcWindowStart(timestamps[j], rule->timeBucket) == currentTimestamp) {
+            j++;
+        }
+        if (rollCompactionBucket(ctx, rule, currentTimestamp)) {
+            AggregationAppendValues(rule->aggClass, rule->aggContext, &values[i], j - i);
+        }
+        i = j;
+    }
+}
+
+// Adds the sample to the series, returns NULL or the error to reply
+static const char *internalAddSample(RedisModuleCtx *ctx,
+                                     Series *series,
+                                     api_timestamp_t timestamp,
+                                     double value,
+                                     DuplicatePolicy dp_override,
+                                     bool runRules) {
+    timestamp_t lastTS = series->lastTimestamp;
+    uint64_t retention = series->retentionTime;
+    // ensure inside retention period.
+    if (retention && timestamp < lastTS && retention < lastTS - timestamp) {
+        return RTS_ERR " TSDB: Timestamp is older than retention";
+    }
+    // the rules and the subscribers see the value as stored
+    value = Compressed_RoundSignificantDigits(value, series->significantDigits);
+
+    if (timestamp <= series->lastTimestamp && series->totalSamples != 0) {
+        STAGE_BEGIN(STAGE_UPSERT_SAMPLE, upsertStart);
+        int rv = SeriesUpsertSample(series, timestamp, value, dp_override);
+        STAGE_END(STAGE_UPSERT_SAMPLE, upsertStart);
+        if (rv != REDISMODULE_OK) {
+            return RTS_ERR " TSDB: Error at upsert, update is not supported in BLOCK mode";
+        }
+    } else {
+        STAGE_BEGIN(STAGE_ADD_SAMPLE, addStart);
+        int rv = SeriesAddSample(series, timestamp, value);
+        STAGE_END(STAGE_ADD_SAMPLE, addStart);
+        if (rv != REDISMODULE_OK) {
+            return RTS_ERR " TSDB: Error at add";
+        }
+        // handle compaction rules
+        CompactionRule *rule = runRules ? series->rules : NULL;
+        if (rule != NULL) {
+            STAGE_BEGIN(STAGE_COMPACTION, compactionStart);
+            while (rule != NULL) {
+                handleCompaction(ctx, series, rule, timestamp, value);
+                rule = rule->nextRule;
+            }
+            STAGE_END(STAGE_COMPACTION, compactionStart);
+        }
+    }
+    Subscriptions_AddSample(ctx, series->keyName, timestamp, value);
+    return NULL;
+}
+
+static int internalAdd(RedisModuleCtx *ctx,
+                       Series *series,
+                       api_timestamp_t timestamp,
+                       double value,
+                       DuplicatePolicy dp_override,
+                       bool runRules) {
+    const char *error = internalAddSample(ctx, series, timestamp, value, dp_override, runRules);
+    if (error != NULL) {
+        RedisModule_ReplyWithError(ctx, error);
+        return REDISMODULE_ERR;
+    }
+    RedisModule_ReplyWithLongLong(ctx, timestamp);
+    return REDISMODULE_OK;
+}
+
+static int parseSample(RedisModuleCtx *ctx,
+                       RedisModuleString *timestampStr,
+                       RedisModuleString *valueStr,
+                       api_timestamp_t *timestamp,
+                       double *value) {
+    if ((RedisModule_StringToDouble(valueStr, value) != REDISMODULE_OK))
+        return RTS_ReplyGeneralError(ctx, "TSDB: invalid value");
+
+    if ((RedisModule_StringToLongLong(timestampStr, (long long int *)timestamp) !=
+         REDISMODULE_OK)) {
+        // if timestamp is "*", take current time (automatic timestamp)
+        if (RMUtil_StringEqualsC(timestampStr, "*"))
+            *timestamp = (u_int64_t)RedisModule_Milliseconds();
+        else
+            return RTS_ReplyGeneralError(ctx, "TSDB: invalid timestamp");
+    }
+    return REDISMODULE_OK;
+}
+
+// Sets `sample` to the parsed sample
+static inline int add(RedisModuleCtx *ctx,
+                      RedisModuleString *keyName,
+                      RedisModuleString *timestampStr,
+                      RedisModuleString *valueStr,
+                      RedisModuleString **argv,
+                      int argc,
+                      Sample *sample) {
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyName, REDISMODULE_READ | REDISMODULE_WRITE);
+    double value;
+    api_timestamp_t timestamp;
+    if (parseSample(ctx, timestampStr, valueStr, &timestamp, &value) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    sample->timestamp = timestamp;
+    sample->value = value;
+
+    Series *series = NULL;
+    DuplicatePolicy dp = DP_NONE;
+
+    if (argv != NULL && RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+        // the key doesn't exist, lets check we have enough information to create one
+        CreateCtx cCtx = { 0 };
+        if (parseCreateArgs(ctx, argv, argc, &cCtx) != REDISMODULE_OK) {
+            return REDISMODULE_ERR;
+        }
+
+        CreateTsKey(ctx, keyName, &cCtx, &series, &key);
+        SeriesCreateRulesFromGlobalConfig(ctx, keyName, series, cCtx.labels, cCtx.labelsCount);
+    } else if (RedisModule_ModuleTypeGetType(key) != SeriesType) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: the key is not a TSDB key");
+    } else {
+        series = RedisModule_ModuleTypeGetValue(key);
+        if (ParseDuplicatePolicy(ctx, argv, argc, TS_ADD_DUPLICATE_POLICY_ARG, &dp) != TSDB_OK) {
+            return REDISMODULE_ERR;
+        }
+    }
+    int rv = internalAdd(ctx, series, timestamp, value, dp, true);
+    RedisModule_CloseKey(key);
+    return rv;
+}
+
+/*
+ * The writes whose timestamp is `*` replicate the timestamp they resolved to, and the bulk writes
+ * only the samples they added: TS.MADD replicates the keys given at least MADD_BULK_MIN_SAMPLES
+ * samples as a TS.ADDBULK in the RAW format, and the other keys as a single TS.MADD.
+ */
+#define MADD_BULK_MIN_SAMPLES 4
+
+static inline void writeLE64(unsigned char *p, u_int64_t v) {
+    memrev64ifbe(&v);
+    memcpy(p, &v, sizeof(v));
+}
+
+// Appends a sample in the RAW format of TS.ADDBULK to `buf`
+static inline void appendRawSample(unsigned char *buf, size_t *len, timestamp_t ts, double value) {
+    u_int64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writeLE64(buf + *len, ts);
+    writeLE64(buf + *len + 8, bits);
+    *len += 16;
+}
+
+// Replicates argv with argv[pos] set to `timestamp`, or TIMESTAMP <timestamp> appended if pos is -1
+static void ReplicateWithTimestamp(RedisModuleCtx *ctx,
+                                   RedisModuleString **argv,
+                                   int argc,
+                                   int pos,
+                                   api_timestamp_t timestamp) {
+    RedisModuleString *args[argc + 1];
+    size_t count = argc - 1;
+    memcpy(args, argv + 1, count * sizeof(RedisModuleString *));
+    RedisModuleString *timestampStr = RedisModule_CreateStringFromLongLong(ctx, timestamp);
+    if (pos > 0) {
+        args[pos - 1] = timestampStr;
+    } else {
+        args[count++] = RedisModule_CreateString(ctx, "TIMESTAMP", strlen("TIMESTAMP"));
+        args[count++] = timestampStr;
+    }
+    RedisModule_Replicate(ctx, RedisModule_StringPtrLen(argv[0], NULL), "v", args, count);
+}
+
+typedef struct AddedSample
+{
+    RedisModuleString *key;
+    RedisModuleString *valueStr;
+    Sample sample;
+    size_t pos; // in the arguments
+} AddedSample;
+
+static int compareAddedSamples(const void *a, const void *b) {
+    const AddedSample *x = a, *y = b;
+    int cmp = RedisModule_StringCompare(x->key, y->key);
+    return cmp != 0 ? cmp : (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+static void ReplicateMAdd(RedisModuleCtx *ctx, AddedSample *added, size_t count) {
+    // the samples of a key keep their order
+    qsort(added, count, sizeof(AddedSample), compareAddedSamples);
+    RedisModuleString **args = malloc(max(count, 1) * 3 * sizeof(RedisModuleString *));
+    unsigned char *buf = malloc(max(count, 1) * 16);
+    size_t argsCount = 0;
+    for (size_t i = 0, j; i < count; i = j) {
+        for (j = i + 1; j < count; j++) {
+            if (RedisModule_StringCompare(added[i].key, added[j].key) != 0) {
+                break;
+            }
+        }
+        if (j - i < MADD_BULK_MIN_SAMPLES) {
+            for (size_t k = i; k < j; k++) {
+                args[argsCount++] = added[k].key;
+                args[argsCount++] =
+                    RedisModule_CreateStringFromLongLong(ctx, added[k].sample.timestamp);
+                args[argsCount++] = added[k].valueStr;
+            }
+            continue;
+        }
+        size_t len = 0;
+        for (size_t k = i; k < j; k++) {
+            appendRawSample(buf, &len, added[k].sample.timestamp, added[k].sample.value);
+        }
+        RedisModule_Replicate(
+            ctx, "TS.ADDBULK", "sccb", added[i].key, "FORMAT", "RAW", (const char *)buf, len);
+    }
+    if (argsCount > 0) {
+        RedisModule_Replicate(ctx, "TS.MADD", "v", args, argsCount);
+    }
+    free(args);
+    free(buf);
+}
+
+/*
+ * A TS.MADD of at least MADD_THREADED_MIN_SAMPLES samples is parsed on the thread pool, where its
+ * samples are grouped by key. They are then added on the main thread by the reply callback, which
+ * opens each key once and adds its samples in their order. The replies and the replication are
+ * the ones of the main thread path, `*` timestamps resolve when the samples are added.
+ */
+#define MADD_THREADED_MIN_SAMPLES 1024
+
+typedef struct MAddSample
+{
+    RedisModuleString *key;
+    RedisModuleString *valueStr;
+    Sample sample;
+    size_t pos;        // in the arguments
+    bool now;          // the timestamp is `*`
+    const char *error; // set when the sample wasn't added
+} MAddSample;
+
+typedef struct MAddCtx
+{
+    RedisModuleBlockedClient *bc;
+    RedisModuleString **argv; // retained until the reply
+    int argc;
+    MAddSample *samples; // sorted by key
+    size_t count;
+} MAddCtx;
+
+static int compareMAddSamples(const void *a, const void *b) {
+    const MAddSample *x = a, *y = b;
+    int cmp = RedisModule_StringCompare(x->key, y->key);
+    return cmp != 0 ? cmp : (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+static void MAddJobRun(void *arg) {
+    MAddCtx *madd = arg;
+    for (size_t i = 0; i < madd->count; i++) {
+        MAddSample *sample = &madd->samples[i];
+        RedisModuleString *timestampStr = madd->argv[i * 3 + 1];
+        long long timestamp = 0;
+        *sample = (MAddSample){ .key = madd->argv[i * 3],
+                                .valueStr = madd->argv[i * 3 + 2],
+                                .pos = i };
+        if (RedisModule_StringToDouble(sample->valueStr, &sample->sample.value) !=
+            REDISMODULE_OK) {
+            sample->error = RTS_ERR " TSDB: invalid value";
+        } else if (RedisModule_StringToLongLong(timestampStr, &timestamp) == REDISMODULE_OK) {
+            sample->sample.timestamp = timestamp;
+        } else if (RMUtil_StringEqualsC(timestampStr, "*")) {
+            sample->now = true;
+        } else {
+            sample->error = RTS_ERR " TSDB: invalid timestamp";
+        }
+    }
+    qsort(madd->samples, madd->count, sizeof(MAddSample), compareMAddSamples);
+    RedisModule_UnblockClient(madd->bc, madd);
+}
+
+static int MAddReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    MAddCtx *madd = RedisModule_GetBlockedClientPrivateData(ctx);
+    MAddSample *samples = madd->samples;
+    AddedSample *added = malloc(max(madd->count, 1) * sizeof(AddedSample));
+    const MAddSample **replies = malloc(max(madd->count, 1) * sizeof(MAddSample *));
+    size_t addedCount = 0;
+    for (size_t i = 0, j; i < madd->count; i = j) {
+        for (j = i + 1; j < madd->count; j++) {
+            if (RedisModule_StringCompare(samples[i].key, samples[j].key) != 0) {
+                break;
+            }
+        }
+        RedisModuleKey *key =
+            RedisModule_OpenKey(ctx, samples[i].key, REDISMODULE_READ | REDISMODULE_WRITE);
+        Series *series = RedisModule_ModuleTypeGetType(key) == SeriesType
+                             ? RedisModule_ModuleTypeGetValue(key)
+                             : NULL;
+        for (size_t k = i; k < j; k++) {
+            MAddSample *sample = &samples[k];
+            replies[sample->pos] = sample;
+            if (sample->error != NULL) {
+                continue;
+            }
+            if (series == NULL) {
+                sample->error = RTS_ERR " TSDB: the key is not a TSDB key";
+                continue;
+            }
+            if (sample->now) {
+                sample->sample.timestamp = (u_int64_t)RedisModule_Milliseconds();
+            }
+            sample->error = internalAddSample(
+                ctx, series, sample->sample.timestamp, sample->sample.value, DP_NONE, true);
+            if (sample->error == NULL) {
+                added[addedCount++] = (AddedSample){ .key = sample->key,
+                                                     .valueStr = sample->valueStr,
+                                                     .sample = sample->sample,
+                                                     .pos = sample->pos };
+            }
+        }
+        RedisModule_CloseKey(key);
+    }
+
+    RedisModule_ReplyWithArray(ctx, madd->count);
+    for (size_t i = 0; i < madd->count; i++) {
+        if (replies[i]->error != NULL) {
+            RedisModule_ReplyWithError(ctx, replies[i]->error);
+        } else {
+            RedisModule_ReplyWithLongLong(ctx, replies[i]->sample.timestamp);
+        }
+    }
+    ReplicateMAdd(ctx, added, addedCount);
+    free(replies);
+    free(added);
+    return REDISMODULE_OK;
+}
+
+static void MAddFree(RedisModuleCtx *ctx, void *privdata) {
+    MAddCtx *madd = privdata;
+    for (int i = 0; i < madd->argc; i++) {
+        RedisModule_FreeString(NULL, madd->argv[i]);
+    }
+    free(madd->argv);
+    free(madd->samples);
+    free(madd);
+}
+
+static bool CanAddOnThreadPool(RedisModuleCtx *ctx, size_t count) {
+    // the writes of the master and of the AOF are applied in order
+    const int flags = REDISMODULE_CTX_FLAGS_REPLICATED | REDISMODULE_CTX_FLAGS_LOADING;
+    return count >= MADD_THREADED_MIN_SAMPLES && ThreadPool_IsActive() && CanBlockClient(ctx) &&
+           !(RedisModule_GetContextFlags(ctx) & flags);
+}
+
+static int MAddOnThreadPool(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    MAddCtx *madd = malloc(sizeof(MAddCtx));
+    madd->argc = argc - 1;
+    madd->argv = malloc(madd->argc * sizeof(RedisModuleString *));
+    for (int i = 0; i < madd->argc; i++) {
+        RedisModule_RetainString(NULL, argv[i + 1]);
+        madd->argv[i] = argv[i + 1];
+    }
+    madd->count = madd->argc / 3;
+    madd->samples = malloc(madd->count * sizeof(MAddSample));
+    madd->bc = RedisModule_BlockClient(ctx, MAddReply, NULL, MAddFree, 0);
+    ThreadPool_AddJob(MAddJobRun, madd);
+    return REDISMODULE_OK;
+}
+
+int TSDB_madd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 4 || (argc - 1) % 3 != 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+    if (CanAddOnThreadPool(ctx, (argc - 1) / 3)) {
+        return MAddOnThreadPool(ctx, argv, argc);
+    }
+
+    AddedSample *added = malloc((argc - 1) / 3 * sizeof(AddedSample));
+    size_t addedCount = 0;
+    RedisModule_ReplyWithArray(ctx, (argc - 1) / 3);
+    for (int i = 1; i < argc; i += 3) {
+        RedisModuleString *keyName = argv[i];
+        RedisModuleString *timestampStr = argv[i + 1];
+        RedisModuleString *valueStr = argv[i + 2];
+        AddedSample *sample = &added[addedCount];
+        if (add(ctx, keyName, timestampStr, valueStr, NULL, -1, &sample->sample) ==
+            REDISMODULE_OK) {
+            sample->key = keyName;
+            sample->valueStr = valueStr;
+            sample->pos = addedCount++;
+        }
+    }
+    ReplicateMAdd(ctx, added, addedCount);
+    free(added);
+    return REDISMODULE_OK;
+}
+
+/*
+ * Binary sample formats of TS.ADDBULK key FORMAT <format> <samples>:
+ * RAW   - (int64 timestamp, double value) pairs, both little-endian, 16 bytes per sample.
+ * DELTA - for every sample, the timestamp minus the previous one (0 for the first sample) as a
+ *         zigzag LEB128 varint, followed by the value as a little-endian double.
+ */
+static inline u_int64_t readLE64(const unsigned char *p) {
+    u_int64_t v;
+    memcpy(&v, p, sizeof(v));
+    memrev64ifbe(&v);
+    return v;
+}
+
+static int decodeBinarySamples(RedisModuleString *format,
+                               RedisModuleString *samples,
+                               timestamp_t **timestamps,
+                               double **values,
+                               size_t *count) {
+    size_t len;
+    const unsigned char *buf = (const unsigned char *)RedisModule_StringPtrLen(samples, &len);
+    const bool delta = RMUtil_StringEqualsCaseC(format, "DELTA");
+    if (!delta && !RMUtil_StringEqualsCaseC(format, "RAW")) {
+        return TSDB_ERROR;
+    }
+    if (!delta && len % 16 != 0) {
+        return TSDB_ERROR;
+    }
+
+    // a delta encoded sample takes at least 9 bytes
+    const size_t maxSamples = delta ? len / 9 : len / 16;
+    *timestamps = malloc(max(maxSamples, 1) * sizeof(timestamp_t));
+    *values = malloc(max(maxSamples, 1) * sizeof(double));
+    *count = 0;
+
+    size_t pos = 0;
+    u_int64_t prev = 0;
+    while (pos < len) {
+        u_int64_t ts;
+        if (delta) {
+            u_int64_t zigzag = 0;
+            int shift = 0;
+            while (true) {
+                if (pos == len || shift > 63) {
+                    goto error;
+                }
+                unsigned char byte = buf[pos++];
+                zigzag |= (u_int64_t)(byte & 0x7f) << shift;
+                shift += 7;
+                if ((byte & 0x80) == 0) {
+                    break;
+                }
+            }
+            ts = prev + (u_int64_t)((int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+            prev = ts;
+        } else {
+            ts = readLE64(buf + pos);
+            pos += 8;
+        }
+        if (len - pos < 8) {
+            goto error;
+        }
+        u_int64_t bits = readLE64(buf + pos);
+        pos += 8;
+        (*timestamps)[*count] = ts;
+        memcpy(&(*values)[*count], &bits, sizeof(double));
+        (*count)++;
+    }
+    return TSDB_OK;
+
+error:
+    free(*timestamps);
+    free(*values);
+    return TSDB_ERROR;
+}
+
+// Adds a sample and keeps it in timestamps/values when the compaction rules have to see it,
+// timestamps is NULL when the series has no rules.
+static int addBulkSample(RedisModuleCtx *ctx,
+                         Series *series,
+                         api_timestamp_t timestamp,
+                         double value,
+                         timestamp_t *timestamps,
+                         double *values,
+                         size_t *appended) {
+    const bool isAppend = series->totalSamples == 0 || timestamp > series->lastTimestamp;
+    if (!isAppend && *appended > 0) {
+        // an upsert finds the rules up to date, as if the samples were added one by one
+        for (CompactionRule *rule = series->rules; rule != NULL; rule = rule->nextRule) {
+            handleCompactionBatch(ctx, rule, timestamps, values, *appended);
+        }
+        *appended = 0;
+    }
+    int rv = internalAdd(ctx, series, timestamp, value, DP_NONE, false);
+    if (rv == REDISMODULE_OK && isAppend && timestamps != NULL) {
+        timestamps[*appended] = timestamp;
+        values[*appended] = value;
+        (*appended)++;
+    }
+    return rv;
+}
+
+/*
+ * TS.ADDBULK key timestamp value [timestamp value ...]
+ * TS.ADDBULK key FORMAT RAW|DELTA samples
+ * Appends many samples to a single existing series. The key is opened once, and the compaction
+ * rules run once at the end over all the samples that were appended.
+ */
+int TSDB_addbulk(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    const bool binary = argc > 2 && RMUtil_StringEqualsCaseC(argv[2], "FORMAT");
+    if (binary ? argc != 5 : argc < 4 || argc % 2 != 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModuleKey *key;
+    Series *series;
+    if (!GetSeries(ctx, argv[1], &key, &series, REDISMODULE_READ | REDISMODULE_WRITE)) {
+        return REDISMODULE_ERR;
+    }
+
+    size_t count;
+    timestamp_t *samplesTimestamps = NULL;
+    double *samplesValues = NULL;
+    if (binary) {
+        if (decodeBinarySamples(argv[3], argv[4], &samplesTimestamps, &samplesValues, &count) !=
+            TSDB_OK) {
+            RedisModule_CloseKey(key);
+            return RTS_ReplyGeneralError(ctx, "TSDB: invalid binary samples");
+        }
+    } else {
+        count = (argc - 2) / 2;
+    }
+
+    timestamp_t *timestamps = NULL;
+    double *values = NULL;
+    size_t appended = 0;
+    if (series->rules != NULL) {
+        timestamps = malloc(max(count, 1) * sizeof(timestamp_t));
+        values = malloc(max(count, 1) * sizeof(double));
+    }
+
+    // the added samples are replicated in the RAW format
+    unsigned char *added = malloc(max(count, 1) * 16);
+    size_t addedCount = 0, addedLen = 0;
+    RedisModule_ReplyWithArray(ctx, count);
+    for (size_t i = 0; i < count; i++) {
+        api_timestamp_t timestamp;
+        double value;
+        if (binary) {
+            timestamp = samplesTimestamps[i];
+            value = samplesValues[i];
+            if ((int64_t)timestamp < 0) {
+                RTS_ReplyGeneralError(ctx, "TSDB: invalid timestamp");
+                continue;
+            }
+        } else if (parseSample(ctx, argv[2 + i * 2], argv[3 + i * 2], &timestamp, &value) !=
+                   REDISMODULE_OK) {
+            continue;
+        }
+        if (addBulkSample(ctx, series, timestamp, value, timestamps, values, &appended) ==
+            REDISMODULE_OK) {
+            appendRawSample(added, &addedLen, timestamp, value);
+            addedCount++;
+        }
+    }
+
+    // handle compaction rules
+    for (CompactionRule *rule = series->rules; rule != NULL; rule = rule->nextRule) {
+        handleCompactionBatch(ctx, rule, timestamps, values, appended);
+    }
+    free(timestamps);
+    free(values);
+    free(samplesTimestamps);
+    free(samplesValues);
+
+    RedisModule_CloseKey(key);
+    if (binary && addedCount == count) {
+        RedisModule_ReplicateVerbatim(ctx);
+    } else if (addedCount > 0) {
+        RedisModule_Replicate(
+            ctx, "TS.ADDBULK", "sccb", argv[1], "FORMAT", "RAW", (const char *)added, addedLen);
+    }
+    free(added);
+    return REDISMODULE_OK;
+}
+
+int TSDB_add(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModuleString *keyName = argv[1];
+    RedisModuleString *timestampStr = argv[2];
+    RedisModuleString *valueStr = argv[3];
+
+    Sample sample;
+    int result = add(ctx, keyName, timestampStr, valueStr, argv, argc, &sample);
+    if (!RMUtil_StringEqualsC(timestampStr, "*")) {
+        RedisModule_ReplicateVerbatim(ctx);
+    } else if (result == REDISMODULE_OK) {
+        ReplicateWithTimestamp(ctx, argv, argc, 2, sample.timestamp);
+    }
+    return result;
+}
+
+int CreateTsKey(RedisModuleCtx *ctx,
+                RedisModuleString *keyName,
+                CreateCtx *cCtx,
+                Series **series,
+                RedisModuleKey **key) {
+    if (*key == NULL) {
+        *key = RedisModule_OpenKey(ctx, keyName, REDISMODULE_READ | REDISMODULE_WRITE);
+    }
+
+    RedisModule_RetainString(ctx, keyName);
+    *series = NewSeries(keyName, cCtx);
+    if (RedisModule_ModuleTypeSetValue(*key, SeriesType, *series) == REDISMODULE_ERR) {
+        return TSDB_ERROR;
+    }
+
+    IndexMetric(ctx, keyName, *series, (*series)->labels, (*series)->labelsCount);
+
+    return TSDB_OK;
+}
+
+int TSDB_create(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    Series *series;
+    RedisModuleString *keyName = argv[1];
+    CreateCtx cCtx = { 0 };
+    if (parseCreateArgs(ctx, argv, argc, &cCtx) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyName, REDISMODULE_READ | REDISMODULE_WRITE);
+
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        return RTS_ReplyGeneralError(ctx, "TSDB: key already exists");
+    }
+
+    CreateTsKey(ctx, keyName, &cCtx, &series, &key);
+    RedisModule_CloseKey(key);
+
+    RedisModule_Log(ctx, "verbose", "created new series");
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+/*
+ * TS.ALTER re-encodes the chunks of a series to a new encoding or chunk size. The samples are
+ * encoded on the thread pool from a copy of the series taken under the GIL, while it keeps taking
+ * samples, and swapped into it under the GIL with the samples added meanwhile. They are encoded
+ * again when older samples of the series changed meanwhile.
+ */
+#define REENCODE_MAX_ATTEMPTS 3
+
+typedef struct ReencodeCtx
+{
+    RedisModuleBlockedClient *bc;
+    RedisModuleString *keyName;
+    int options;
+    long long chunkSizeBytes;
+    const char *error;
+} ReencodeCtx;
+
+static void ReencodeJobRun(void *arg) {
+    ReencodeCtx *reencode = arg;
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(reencode->bc);
+    const int mode = REDISMODULE_READ | REDISMODULE_WRITE;
+    RedisModuleKey *key;
+    Series *series;
+    reencode->error = RTS_ERR " TSDB: the key was deleted during the re-encoding";
+
+    RedisModule_ThreadSafeContextLock(ctx);
+    for (int attempt = 1; SilentGetSeries(ctx, reencode->keyName, &key, &series, mode);
+         attempt++) {
+        SeriesEncoding encoding;
+        SeriesEncodingInit(&encoding, series, reencode->options, reencode->chunkSizeBytes);
+        if (attempt < REENCODE_MAX_ATTEMPTS) {
+            EpochGuard guard;
+            Epoch_Enter(&guard);
+            Series *copy = SeriesSnapshot(series, 0, UINT64_MAX, &guard);
+            uint64_t rewriteVersion = series->rewriteVersion;
+            RedisModule_CloseKey(key);
+            RedisModule_ThreadSafeContextUnlock(ctx);
+
+            SeriesEncodingAppend(&encoding, copy);
+            FreeSeriesSnapshot(copy);
+            Epoch_Exit(&guard);
+
+            RedisModule_ThreadSafeContextLock(ctx);
+            if (!SilentGetSeries(ctx, reencode->keyName, &key, &series, mode)) {
+                SeriesEncodingFree(&encoding);
+                break;
+            }
+            if (series->rewriteVersion != rewriteVersion) {
+                RedisModule_CloseKey(key);
+                SeriesEncodingFree(&encoding);
+                continue;
+            }
+        }
+        // the older samples keep changing, the last attempt doesn't leave the GIL
+        SeriesSwapEncoding(series, &encoding);
+        SeriesEncodingFree(&encoding);
+        RedisModule_CloseKey(key);
+        reencode->error = NULL;
+        break;
+    }
+    RedisModule_ThreadSafeContextUnlock(ctx);
+    RedisModule_FreeThreadSafeContext(ctx);
+    RedisModule_UnblockClient(reencode->bc, reencode);
+}
+
+static int ReencodeReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    ReencodeCtx *reencode = RedisModule_GetBlockedClientPrivateData(ctx);
+    if (reencode->error != NULL) {
+        return RedisModule_ReplyWithError(ctx, reencode->error);
+    }
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+static void ReencodeFree(RedisModuleCtx *ctx, void *privdata) {
+    ReencodeCtx *reencode = privdata;
+    RedisModule_FreeString(NULL, reencode->keyName);
+    free(reencode);
+}
+
+// Replies once the chunks of the series are re-encoded with the encoding options
+static int ReplyReencode(RedisModuleCtx *ctx,
+                         RedisModuleString *keyName,
+                         Series *series,
+                         int options) {
+    if (ThreadPool_IsActive() && CanBlockClient(ctx)) {
+        ReencodeCtx *reencode = malloc(sizeof(ReencodeCtx));
+        reencode->keyName = RedisModule_CreateStringFromString(NULL, keyName);
+        reencode->options = options;
+        reencode->chunkSizeBytes = series->chunkSizeBytes;
+        reencode->error = NULL;
+        reencode->bc = RedisModule_BlockClient(ctx, ReencodeReply, NULL, ReencodeFree, 0);
+        ThreadPool_AddJob(ReencodeJobRun, reencode);
+        return REDISMODULE_OK;
+    }
+
+    SeriesEncoding encoding;
+    SeriesEncodingInit(&encoding, series, options, series->chunkSizeBytes);
+    SeriesSwapEncoding(series, &encoding);
+    SeriesEncodingFree(&encoding);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+int TSDB_alter(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    Series *series;
+    RedisModuleKey *key;
+    RedisModuleString *keyName = argv[1];
+    CreateCtx cCtx = { 0 };
+    if (parseCreateArgs(ctx, argv, argc, &cCtx) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    const int status = GetSeries(ctx, argv[1], &key, &series, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (!status) {
+        return REDISMODULE_ERR;
+    }
+
+    // a new encoding re-encodes the chunks, REENCODE re-encodes them to the chunk size
+    bool reencode = RMUtil_ArgIndex("REENCODE", argv, argc) > 0;
+    int encoding = series->options & SERIES_OPT_ENCODING;
+    if (RMUtil_ArgIndex("ENCODING", argv, argc) > 0) {
+        reencode |= (cCtx.options & SERIES_OPT_ENCODING) != encoding;
+        encoding = cCtx.options & SERIES_OPT_ENCODING;
+    }
+    const u_int8_t significantDigits = RMUtil_ArgIndex("SIGNIFICANT_DIGITS", argv, argc) > 0
+                                           ? cCtx.significantDigits
+                                           : series->significantDigits;
+    if (significantDigits > 0 && (encoding & SERIES_OPT_DECIMAL)) {
+        RedisModule_CloseKey(key);
+        return RTS_ReplyGeneralError(ctx, "TSDB: SIGNIFICANT_DIGITS can't be used with DECIMAL");
+    }
+
+    if (RMUtil_ArgIndex("RETENTION", argv, argc) > 0) {
+        series->retentionTime = cCtx.retentionTime;
+        // samples past the new retention are freed in the background
+        SeriesScheduleTrim(series);
+    }
+
+    if (RMUtil_ArgIndex("CHUNK_SIZE", argv, argc) > 0) {
+        if (cCtx.options & SERIES_OPT_ADAPTIVE_CHUNK_SIZE) {
+            // adapts from the current size
+            series->options |= SERIES_OPT_ADAPTIVE_CHUNK_SIZE;
+        } else {
+            series->options &= ~SERIES_OPT_ADAPTIVE_CHUNK_SIZE;
+            series->chunkSizeBytes = cCtx.chunkSizeBytes;
+        }
+    }
+
+    if (RMUtil_ArgIndex("CHUNK_TIME_WINDOW", argv, argc) > 0) {
+        // the chunks are cut at the windows from the next sample on
+        series->chunkTimeWindow = cCtx.chunkTimeWindow;
+    }
+
+    if (RMUtil_ArgIndex("SIGNIFICANT_DIGITS", argv, argc) > 0) {
+        // the stored samples are kept as they are
+        series->significantDigits = cCtx.significantDigits;
+    }
+
+    if (RMUtil_ArgIndex("DUPLICATE_POLICY", argv, argc) > 0) {
+        series->duplicatePolicy = cCtx.duplicatePolicy;
+    }
+
+    if (RMUtil_ArgIndex("LABELS", argv, argc) > 0) {
+        RemoveIndexedMetric(ctx, keyName, series->labels, series->labelsCount);
+        // free current labels
+        ReleaseLabels(series->labels, series->labelsCount);
+
+        // set new newLabels
+        InternLabels(cCtx.labels, cCtx.labelsCount);
+        series->labels = cCtx.labels;
+        series->labelsCount = cCtx.labelsCount;
+        IndexMetric(ctx, keyName, series, series->labels, series->labelsCount);
+    }
+    RedisModule_ReplicateVerbatim(ctx);
+    if (reencode) {
+        ReplyReencode(ctx, keyName, series, encoding);
+    } else {
+        RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    RedisModule_CloseKey(key);
+    return REDISMODULE_OK;
+}
+
+/*
+TS.DELETERULE SOURCE_KEY DEST_KEY
+ */
+int TSDB_deleteRule(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModuleString *srcKeyName = argv[1];
+
+    // First try to remove the rule from the source key
+    Series *srcSeries;
+    RedisModuleKey *srcKey;
+    const int statusS =
+        GetSeries(ctx, srcKeyName, &srcKey, &srcSeries, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (!statusS) {
+        return REDISMODULE_ERR;
+    }
+
+    RedisModuleString *destKeyName = argv[2];
+    if (!SeriesDeleteRule(srcSeries, destKeyName)) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: compaction rule does not exist");
+    }
+
+    // If succeed to remove the rule from the source key remove from the destination too
+    Series *destSeries;
+    RedisModuleKey *destKey;
+    const int statusD =
+        GetSeries(ctx, destKeyName, &destKey, &destSeries, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (!statusD) {
+        return REDISMODULE_ERR;
+    }
+    SeriesDeleteSrcRule(destSeries, srcKeyName);
+
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    RedisModule_ReplicateVerbatim(ctx);
+    RedisModule_CloseKey(srcKey);
+    RedisModule_CloseKey(destKey);
+    return REDISMODULE_OK;
+}
+
+/*
+TS.DEL key fromTimestamp toTimestamp
+*/
+int TSDB_del(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    Series *series;
+    RedisModuleKey *key;
+    const int status =
+        GetSeries(ctx, argv[1], &key, &series, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (!status) {
+        return REDISMODULE_ERR;
+    }
+
+    api_timestamp_t start_ts, end_ts;
+    if (parseRangeArguments(ctx, series, 2, argv, &start_ts, &end_ts) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    size_t deleted = SeriesDelRange(series, start_ts, end_ts);
+    RedisModule_ReplyWithLongLong(ctx, deleted);
+    RedisModule_ReplicateVerbatim(ctx);
+    RedisModule_CloseKey(key);
+    return REDISMODULE_OK;
+}
+
+/*
+TS.CREATERULE sourceKey destKey AGGREGATION aggregationType timeBucket
+*/
+/*
+ * TS.CREATERULE ... BACKFILL aggregates the samples the source already holds. The rule starts from
+ * the current bucket of the source right away, and the buckets before it are computed on the
+ * thread pool from a copy of the source taken under the GIL, then written to the destination under
+ * the GIL at once. They are computed again when older samples of the source changed meanwhile.
+ */
+#define BACKFILL_MAX_ATTEMPTS 3
+
+typedef struct BackfillCtx
+{
+    RedisModuleBlockedClient *bc;
+    RedisModuleString *srcKey;
+    RedisModuleString *destKey;
+    TS_AGG_TYPES_T aggType;
+    timestamp_t timeBucket;
+    timestamp_t end; // of the buckets to backfill
+    const char *error;
+} BackfillCtx;
+
+// Opens the source if it still has the rule
+static bool OpenBackfillSource(RedisModuleCtx *ctx,
+                               BackfillCtx *backfill,
+                               RedisModuleKey **key,
+                               Series **series) {
+    if (!SilentGetSeries(ctx, backfill->srcKey, key, series, REDISMODULE_READ)) {
+        return false;
+    }
+    for (CompactionRule *rule = (*series)->rules; rule != NULL; rule = rule->nextRule) {
+        if (rule->aggType == backfill->aggType && rule->timeBucket == backfill->timeBucket &&
+            RedisModule_StringCompare(rule->destKey, backfill->destKey) == 0) {
+            return true;
+        }
+    }
+    RedisModule_CloseKey(*key);
+    return false;
+}
+
+static void WriteBackfill(RedisModuleCtx *ctx,
+                          RedisModuleString *destKey,
+                          Series *destSeries,
+                          const Sample *buckets,
+                          size_t count) {
+    // the buckets closed meanwhile may still be queued
+    CompactionQueueFlush(ctx);
+    for (size_t i = 0; i < count; i++) {
+        if (destSeries->totalSamples == 0 || buckets[i].timestamp > destSeries->lastTimestamp) {
+            SeriesAddSample(destSeries, buckets[i].timestamp, buckets[i].value);
+        } else {
+            SeriesUpsertSample(destSeries, buckets[i].timestamp, buckets[i].value, DP_LAST);
+        }
+    }
+    if (count > 0 && RedisModule_SignalModifiedKey) {
+        RedisModule_SignalModifiedKey(ctx, destKey);
+    }
+}
+
+static void BackfillJobRun(void *arg) {
+    BackfillCtx *backfill = arg;
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(backfill->bc);
+    AggregationClass *aggClass = GetAggClass(backfill->aggType);
+    RedisModuleKey *key, *destKey;
+    Series *series, *destSeries;
+    Sample *buckets = NULL;
+    size_t count = 0;
+    backfill->error = RTS_ERR " TSDB: the rule was deleted during the backfill";
+
+    RedisModule_ThreadSafeContextLock(ctx);
+    for (int attempt = 1; OpenBackfillSource(ctx, backfill, &key, &series); attempt++) {
+        if (attempt < BACKFILL_MAX_ATTEMPTS) {
+            EpochGuard guard;
+            Epoch_Enter(&guard);
+            Series *copy = SeriesSnapshot(series, 0, backfill->end, &guard);
+            uint64_t rewriteVersion = series->rewriteVersion;
+            RedisModule_CloseKey(key);
+            RedisModule_ThreadSafeContextUnlock(ctx);
+
+            count = SeriesAggregateBuckets(
+                copy, 0, backfill->end, aggClass, backfill->timeBucket, &buckets);
+            FreeSeriesSnapshot(copy);
+            Epoch_Exit(&guard);
+
+            RedisModule_ThreadSafeContextLock(ctx);
+            if (!OpenBackfillSource(ctx, backfill, &key, &series)) {
+                break;
+            }
+            if (series->rewriteVersion != rewriteVersion) {
+                RedisModule_CloseKey(key);
+                free(buckets);
+                buckets = NULL;
+                continue;
+            }
+        } else {
+            // the older samples keep changing, the last attempt doesn't leave the GIL
+            count = SeriesAggregateBuckets(
+                series, 0, backfill->end, aggClass, backfill->timeBucket, &buckets);
+        }
+        if (SilentGetSeries(ctx,
+                            backfill->destKey,
+                            &destKey,
+                            &destSeries,
+                            REDISMODULE_READ | REDISMODULE_WRITE)) {
+            WriteBackfill(ctx, backfill->destKey, destSeries, buckets, count);
+            RedisModule_CloseKey(destKey);
+            backfill->error = NULL;
+        }
+        RedisModule_CloseKey(key);
+        break;
+    }
+    RedisModule_ThreadSafeContextUnlock(ctx);
+    RedisModule_FreeThreadSafeContext(ctx);
+    free(buckets);
+    RedisModule_UnblockClient(backfill->bc, backfill);
+}
+
+static int BackfillReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    BackfillCtx *backfill = RedisModule_GetBlockedClientPrivateData(ctx);
+    if (backfill->error != NULL) {
+        return RedisModule_ReplyWithError(ctx, backfill->error);
+    }
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
 
-int TSDB_mrevrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return TSDB_generic_mrange(ctx, argv, argc, true);
+static void BackfillFree(RedisModuleCtx *ctx, void *privdata) {
+    BackfillCtx *backfill = privdata;
+    RedisModule_FreeString(NULL, backfill->srcKey);
+    RedisModule_FreeString(NULL, backfill->destKey);
+    free(backfill);
 }
 
-int TSDB_generic_range(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, bool rev) {
+// Replies once the samples of the source before its current bucket are compacted
+static int ReplyBackfill(RedisModuleCtx *ctx,
+                         RedisModuleString *srcKey,
+                         Series *srcSeries,
+                         RedisModuleString *destKey,
+                         Series *destSeries,
+                         CompactionRule *rule) {
+    if (srcSeries->totalSamples == 0) {
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    timestamp_t current = CalcWindowStart(srcSeries->lastTimestamp, rule->timeBucket);
+    SeriesCalcRange(srcSeries, current, UINT64_MAX, rule, NULL);
+    rule->startCurrentTimeBucket = current;
+    if (current == 0) {
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+
+    if (ThreadPool_IsActive() && CanBlockClient(ctx)) {
+        BackfillCtx *backfill = malloc(sizeof(BackfillCtx));
+        backfill->srcKey = RedisModule_CreateStringFromString(NULL, srcKey);
+        backfill->destKey = RedisModule_CreateStringFromString(NULL, destKey);
+        backfill->aggType = rule->aggType;
+        backfill->timeBucket = rule->timeBucket;
+        backfill->end = current - 1;
+        backfill->error = NULL;
+        backfill->bc = RedisModule_BlockClient(ctx, BackfillReply, NULL, BackfillFree, 0);
+        ThreadPool_AddJob(BackfillJobRun, backfill);
+        return REDISMODULE_OK;
+    }
+
+    Sample *buckets;
+    size_t count = SeriesAggregateBuckets(
+        srcSeries, 0, current - 1, rule->aggClass, rule->timeBucket, &buckets);
+    WriteBackfill(ctx, destKey, destSeries, buckets, count);
+    free(buckets);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+int TSDB_createRule(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
-    if (argc < 4) {
+    if (argc != 6 && argc != 7) {
+        return RedisModule_WrongArity(ctx);
+    }
+    const bool backfill = argc == 7;
+    if (backfill && !RMUtil_StringEqualsCaseC(argv[6], "BACKFILL")) {
         return RedisModule_WrongArity(ctx);
     }
 
-    Series *series;
-    RedisModuleKey *key;
-    const int status = GetSeries(ctx, argv[1], &key, &series, REDISMODULE_READ);
-    if (!status) {
+    // Validate aggregation arguments
+    api_timestamp_t timeBucket;
+    int aggType;
+    const int result = _parseAggregationArgs(ctx, argv, argc, &timeBucket, &aggType);
+    if (result == TSDB_NOTEXISTS) {
+        return RedisModule_WrongArity(ctx);
+    }
+    if (result == TSDB_ERROR) {
         return REDISMODULE_ERR;
     }
 
-    api_timestamp_t start_ts, end_ts;
-    api_timestamp_t time_delta = 0;
-    if (parseRangeArguments(ctx, series, 2, argv, &start_ts, &end_ts) != REDISMODULE_OK) {
+    RedisModuleString *srcKeyName = argv[1];
+    RedisModuleString *destKeyName = argv[2];
+    if (!RedisModule_StringCompare(srcKeyName, destKeyName)) {
+        return RTS_ReplyGeneralError(
+            ctx, "TSDB: the source key and destination key should be different");
+    }
+
+    // First we verify the source is not a destination
+    Series *srcSeries;
+    RedisModuleKey *srcKey;
+    const int statusS =
+        GetSeries(ctx, srcKeyName, &srcKey, &srcSeries, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (!statusS) {
         return REDISMODULE_ERR;
     }
+    if (srcSeries->srcKey) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: the source key already has a source rule");
+    }
 
-    long long count = -1;
-    if (parseCountArgument(ctx, argv, argc, &count) != REDISMODULE_OK) {
+    // Second verify the destination doesn't have other rule
+    Series *destSeries;
+    RedisModuleKey *destKey;
+    const int statusD =
+        GetSeries(ctx, destKeyName, &destKey, &destSeries, REDISMODULE_READ | REDISMODULE_WRITE);
+    if (!statusD) {
         return REDISMODULE_ERR;
     }
+    srcKeyName = RedisModule_CreateStringFromString(ctx, srcKeyName);
+    if (!SeriesSetSrcRule(destSeries, srcKeyName)) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: the destination key already has a rule");
+    }
+    RedisModule_RetainString(ctx, srcKeyName);
 
-    AggregationClass *aggObject = NULL;
-    int aggregationResult = parseAggregationArgs(ctx, argv, argc, &time_delta, &aggObject);
-    if (aggregationResult == TSDB_ERROR) {
+    // Last add the rule to source
+    destKeyName = RedisModule_CreateStringFromString(ctx, destKeyName);
+    CompactionRule *rule = SeriesAddRule(srcSeries, destKeyName, aggType, timeBucket);
+    if (rule == NULL) {
+        RedisModule_ReplyWithSimpleString(ctx, "TSDB: ERROR creating rule");
         return REDISMODULE_ERR;
     }
+    RedisModule_RetainString(ctx, destKeyName);
+    if (backfill) {
+        ReplyBackfill(ctx, argv[1], srcSeries, argv[2], destSeries, rule);
+    } else {
+        RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+    RedisModule_ReplicateVerbatim(ctx);
+    RedisModule_CloseKey(srcKey);
+    RedisModule_CloseKey(destKey);
+    return REDISMODULE_OK;
+}
+
+/*
+TS.INCRBY ts_key NUMBER [TIMESTAMP timestamp]
+*/
+int TSDB_incrby(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModuleString *keyName = argv[1];
+    Series *series;
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+        // the key doesn't exist, lets check we have enough information to create one
+        CreateCtx cCtx = { 0 };
+        if (parseCreateArgs(ctx, argv, argc, &cCtx) != REDISMODULE_OK) {
+            return REDISMODULE_ERR;
+        }
+
+        CreateTsKey(ctx, keyName, &cCtx, &series, &key);
+        SeriesCreateRulesFromGlobalConfig(ctx, keyName, series, cCtx.labels, cCtx.labelsCount);
+    } else if (RedisModule_ModuleTypeGetType(key) != SeriesType) {
+        return RTS_ReplyGeneralError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    series = RedisModule_ModuleTypeGetValue(key);
+
+    double incrby = 0;
+    if (RMUtil_ParseArgs(argv, argc, 2, "d", &incrby) != REDISMODULE_OK) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: invalid increase/decrease value");
+    }
+
+    long long currentUpdatedTime = -1;
+    int timestampLoc = RMUtil_ArgIndex("TIMESTAMP", argv, argc);
+    if (timestampLoc == -1 || RMUtil_StringEqualsC(argv[timestampLoc + 1], "*")) {
+        currentUpdatedTime = RedisModule_Milliseconds();
+    } else if (RedisModule_StringToLongLong(argv[timestampLoc + 1],
+                                            (long long *)&currentUpdatedTime) != REDISMODULE_OK) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: invalid timestamp");
+    }
+
+    if (currentUpdatedTime < series->lastTimestamp && series->lastTimestamp != 0) {
+        return RedisModule_ReplyWithError(
+            ctx, "TSDB: for incrby/decrby, timestamp should be newer than the lastest one");
+    }
+
+    double result = series->lastValue;
+    RMUtil_StringToLower(argv[0]);
+    if (RMUtil_StringEqualsC(argv[0], "ts.incrby")) {
+        result += incrby;
+    } else {
+        result -= incrby;
+    }
+
+    int rv = internalAdd(ctx, series, currentUpdatedTime, result, DP_LAST, true);
+    if (timestampLoc == -1) {
+        ReplicateWithTimestamp(ctx, argv, argc, -1, currentUpdatedTime);
+    } else if (RMUtil_StringEqualsC(argv[timestampLoc + 1], "*")) {
+        ReplicateWithTimestamp(ctx, argv, argc, timestampLoc + 1, currentUpdatedTime);
+    } else {
+        RedisModule_ReplicateVerbatim(ctx);
+    }
+    RedisModule_CloseKey(key);
+    return rv;
+}
+
+int TSDB_get(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc != 2) {
+        return RedisModule_WrongArity(ctx);
+    }
 
-    ReplySeriesRange(ctx, series, start_ts, end_ts, aggObject, time_delta, count, rev);
+    Series *series;
+    RedisModuleKey *key;
+    const int status = GetSeries(ctx, argv[1], &key, &series, REDISMODULE_READ);
+    if (!status) {
+        return REDISMODULE_ERR;
+    }
 
+    ReplyWithSeriesLastDatapoint(ctx, series);
     RedisModule_CloseKey(key);
     return REDISMODULE_OK;
 }
 
-int TSDB_range(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return TSDB_generic_range(ctx, argv, argc, false);
+// The result of the QueryIndex of a TS.MGET in the query cache
+typedef struct MGetCached
+{
+    RedisModuleString **keys;
+    void **handles;
+    size_t count;
+} MGetCached;
+
+static void FreeMGetCached(void *value) {
+    MGetCached *cached = value;
+    for (size_t i = 0; i < cached->count; i++) {
+        RedisModule_FreeString(NULL, cached->keys[i]);
+    }
+    free(cached->keys);
+    free(cached->handles);
+    free(cached);
 }
 
-int TSDB_revrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return TSDB_generic_range(ctx, argv, argc, true);
+static void MGetCache(RedisModuleString *cacheKey,
+                      uint64_t indexVersion,
+                      RedisModuleString **keys,
+                      void **handles,
+                      size_t count) {
+    MGetCached *cached = malloc(sizeof(MGetCached));
+    cached->keys = malloc(max(count, 1) * sizeof(RedisModuleString *));
+    cached->handles = malloc(max(count, 1) * sizeof(void *));
+    for (size_t i = 0; i < count; i++) {
+        cached->keys[i] = RedisModule_CreateStringFromString(NULL, keys[i]);
+        cached->handles[i] = handles[i];
+    }
+    cached->count = count;
+    QueryCache_Put(cacheKey, indexVersion, cached, FreeMGetCached);
 }
 
-int ReplySeriesRange(RedisModuleCtx *ctx,
-                     Series *series,
-                     api_timestamp_t start_ts,
-                     api_timestamp_t end_ts,
-                     AggregationClass *aggObject,
-                     int64_t time_delta,
-                     long long maxResults,
-                     bool rev) {
-    Sample sample;
-    void *context = NULL;
-    long long arraylen = 0;
-    timestamp_t last_agg_timestamp;
+// Parses the arguments of TS.MGET into its filters, replying with the error on failure
+static int parseMGetQuery(RedisModuleCtx *ctx,
+                          RedisModuleString **argv,
+                          int argc,
+                          QueryPredicate **queries,
+                          size_t *queryCount,
+                          bool *withLabels) {
+    if (argc < 3) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
 
-    // In case a retention is set shouldn't return chunks older than the retention
-    // TODO: move to parseRangeArguments(?)
-    if (series->retentionTime) {
-        start_ts = series->lastTimestamp > series->retentionTime
-                       ? max(start_ts, series->lastTimestamp - series->retentionTime)
-                       : start_ts;
-        // if new start_ts > end_ts, there are no results to return
-        if (start_ts > end_ts) {
-            return RedisModule_ReplyWithArray(ctx, 0);
-        }
+    int filter_location = RMUtil_ArgIndex("FILTER", argv, argc);
+    if (filter_location == -1) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+    *queryCount = argc - 1 - filter_location;
+    *withLabels = RMUtil_ArgIndex("WITHLABELS", argv, argc) >= 0;
+    *queries = RedisModule_PoolAlloc(ctx, sizeof(QueryPredicate) * *queryCount);
+    if (parseLabelListFromArgs(ctx, argv, filter_location + 1, *queryCount, *queries) ==
+        TSDB_ERROR) {
+        RTS_ReplyGeneralError(ctx, "TSDB: failed parsing labels");
+        return REDISMODULE_ERR;
     }
 
-    SeriesIterator iterator = SeriesQuery(series, start_ts, end_ts, rev);
-    if (iterator.series == NULL) {
-        return RedisModule_ReplyWithArray(ctx, 0);
+    if (CountMatcherPredicates(*queries, *queryCount) == 0) {
+        RTS_ReplyGeneralError(ctx, "TSDB: please provide at least one matcher");
+        return REDISMODULE_ERR;
     }
+    return REDISMODULE_OK;
+}
 
-    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-    if (aggObject == NULL) {
-        // No aggregation
-        while (SeriesIteratorGetNext(&iterator, &sample) == CR_OK &&
-               (maxResults == -1 || arraylen < maxResults)) {
-            ReplyWithSample(ctx, sample.timestamp, sample.value);
-            arraylen++;
-        }
+static void MGetQueryAndReply(RedisModuleCtx *ctx,
+                              RedisModuleString **argv,
+                              int argc,
+                              QueryPredicate *queries,
+                              size_t query_count,
+                              bool withLabels) {
+    size_t result_count;
+    void **handles;
+    RedisModuleString **result;
+    RedisModuleString *cacheKey = NULL;
+    MGetCached *cached = NULL;
+    if (QueryCache_IsEnabled()) {
+        cacheKey = QueryCache_Key(ctx, argv, argc);
+        cached = QueryCache_Get(cacheKey);
+    }
+    if (cached != NULL) {
+        result = cached->keys;
+        handles = cached->handles;
+        result_count = cached->count;
     } else {
-        bool firstSample = TRUE;
-        context = aggObject->createContext();
-        // setting the first timestamp of the aggregation
-        timestamp_t init_ts = (rev == false)
-                                  ? series->funcs->GetFirstTimestamp(iterator.currentChunk)
-                                  : series->funcs->GetLastTimestamp(iterator.currentChunk);
-        last_agg_timestamp = init_ts - (init_ts % time_delta);
-
-        while (SeriesIteratorGetNext(&iterator, &sample) == CR_OK &&
-               (maxResults == -1 || arraylen < maxResults)) {
-            if ((iterator.reverse == false &&
-                 sample.timestamp >= last_agg_timestamp + time_delta) ||
-                (iterator.reverse == true && sample.timestamp < last_agg_timestamp)) {
-                if (firstSample == FALSE) {
-                    double value;
-                    if (aggObject->finalize(context, &value) == TSDB_OK) {
-                        ReplyWithSample(ctx, last_agg_timestamp, value);
-                        aggObject->resetContext(context);
-                        arraylen++;
-                    }
-                }
-                last_agg_timestamp = sample.timestamp - (sample.timestamp % time_delta);
-            }
-            firstSample = FALSE;
-            aggObject->appendValue(context, sample.value);
+        uint64_t indexVersion = IndexVersion();
+        STAGE_BEGIN(STAGE_QUERY_INDEX, indexStart);
+        result = QueryIndex(ctx, queries, query_count, &result_count, &handles);
+        STAGE_END(STAGE_QUERY_INDEX, indexStart);
+        if (cacheKey != NULL) {
+            MGetCache(cacheKey, indexVersion, result, handles, result_count);
         }
     }
-    SeriesIteratorClose(&iterator);
-
-    if (aggObject != NULL) {
-        if (arraylen != maxResults) {
-            // reply last bucket of data
-            double value;
-            if (aggObject->finalize(context, &value) == TSDB_OK) {
-                ReplyWithSample(ctx, last_agg_timestamp, value);
-                aggObject->resetContext(context);
-                arraylen++;
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    long long replylen = 0;
+    Series *series;
+    for (size_t i = 0; i < result_count; i++) {
+        RedisModuleKey *key = NULL;
+        series = handles[i];
+        if (series == NULL) {
+            STAGE_BEGIN(STAGE_KEY_LOOKUP, lookupStart);
+            const int status = SilentGetSeries(ctx, result[i], &key, &series, REDISMODULE_READ);
+            STAGE_END(STAGE_KEY_LOOKUP, lookupStart);
+            if (!status) {
+                RedisModule_Log(ctx,
+                                "warning",
+                                "couldn't open key or key is not a Timeseries. key=%s",
+                                RedisModule_StringPtrLen(result[i], NULL));
+                continue;
+            }
+            if (RedisModule_GetExpire(key) == REDISMODULE_NO_EXPIRE) {
+                // Until an expire is set, the next queries can read the series from the index
+                IndexSetSeriesVolatile(result[i], false);
             }
         }
-        aggObject->freeContext(context);
+        STAGE_BEGIN(STAGE_REPLY, replyStart);
+        RedisModule_ReplyWithArray(ctx, 3);
+        RedisModule_ReplyWithString(ctx, result[i]);
+        if (withLabels) {
+            ReplyWithSeriesLabels(ctx, series);
+        } else {
+            RedisModule_ReplyWithArray(ctx, 0);
+        }
+        ReplyWithSeriesLastDatapoint(ctx, series);
+        STAGE_END(STAGE_REPLY, replyStart);
+        replylen++;
+        if (key != NULL) {
+            RedisModule_CloseKey(key);
+        }
     }
-
-    RedisModule_ReplySetArrayLength(ctx, arraylen);
-    return REDISMODULE_OK;
+    RedisModule_ReplySetArrayLength(ctx, replylen);
 }
 
-static void handleCompaction(RedisModuleCtx *ctx,
-                             Series *series,
-                             CompactionRule *rule,
-                             api_timestamp_t timestamp,
-                             double value) {
-    timestamp_t currentTimestamp = CalcWindowStart(timestamp, rule->timeBucket);
+int TSDB_mget(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
 
-    if (rule->startCurrentTimeBucket == -1LL) {
-        // first sample, lets init the startCurrentTimeBucket
-        rule->startCurrentTimeBucket = currentTimestamp;
+    QueryPredicate *queries;
+    size_t query_count;
+    bool withLabels;
+    if (parseMGetQuery(ctx, argv, argc, &queries, &query_count, &withLabels) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
     }
+    if (RMUtil_ArgIndex("PROFILE", argv, argc) < 0) {
+        MGetQueryAndReply(ctx, argv, argc, queries, query_count, withLabels);
+        return REDISMODULE_OK;
+    }
+#if STAGE_STATS
+    StageProfile profile;
+    uint64_t start = StageStats_Now();
+    StageStats_BeginProfile(&profile);
+    RedisModule_ReplyWithArray(ctx, 2);
+    MGetQueryAndReply(ctx, argv, argc, queries, query_count, withLabels);
+    StageStats_EndProfile();
+    ReplyWithStageProfile(ctx, &profile, StageStats_Now() - start);
+    return REDISMODULE_OK;
+#else
+    return RTS_ReplyGeneralError(ctx, "TSDB: PROFILE needs a build with STAGE_STATS");
+#endif
+}
 
-    if (currentTimestamp > rule->startCurrentTimeBucket) {
-        RedisModuleKey *key =
-            RedisModule_OpenKey(ctx, rule->destKey, REDISMODULE_READ | REDISMODULE_WRITE);
-        if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
-            // key doesn't exist anymore and we don't do anything
-            return;
-        }
-        Series *destSeries = RedisModule_ModuleTypeGetValue(key);
-
-        double aggVal;
-        if (rule->aggClass->finalize(rule->aggContext, &aggVal) == TSDB_OK) {
-            SeriesAddSample(destSeries, rule->startCurrentTimeBucket, aggVal);
-        }
-        rule->aggClass->resetContext(rule->aggContext);
-        rule->startCurrentTimeBucket = currentTimestamp;
-        RedisModule_CloseKey(key);
+/*
+ * TS.CLUSTER.MRANGE, TS.CLUSTER.MREVRANGE and TS.CLUSTER.MGET run their query on every shard, see
+ * cluster.h. The shards reply with the series they hold, aggregated when the query aggregates, and
+ * the coordinator merges them in key name order. A GROUPBY whose reducer can be merged is reduced
+ * on the shards as well, which send the sum, min, max and count of each group by timestamp.
+ */
+static int clusterMRangeType, clusterMRevRangeType, clusterMGetType;
+
+typedef struct ClusterPartial
+{
+    timestamp_t timestamp;
+    double sum;
+    double min;
+    double max;
+    uint64_t count;
+} ClusterPartial;
+
+static bool IsMergeableReducer(TS_AGG_TYPES_T reducerType) {
+    switch (reducerType) {
+        case TS_AGG_MIN:
+        case TS_AGG_MAX:
+        case TS_AGG_SUM:
+        case TS_AGG_AVG:
+        case TS_AGG_COUNT:
+        case TS_AGG_RANGE:
+            return true;
+        default:
+            return false;
     }
-    rule->aggClass->appendValue(rule->aggContext, value);
 }
 
-static int internalAdd(RedisModuleCtx *ctx,
-                       Series *series,
-                       api_timestamp_t timestamp,
-                       double value,
-                       DuplicatePolicy dp_override) {
-    timestamp_t lastTS = series->lastTimestamp;
-    uint64_t retention = series->retentionTime;
-    // ensure inside retention period.
-    if (retention && timestamp < lastTS && retention < lastTS - timestamp) {
-        RTS_ReplyGeneralError(ctx, "TSDB: Timestamp is older than retention");
-        return REDISMODULE_ERR;
+static double FinalizePartial(const ClusterPartial *partial, TS_AGG_TYPES_T reducerType) {
+    switch (reducerType) {
+        case TS_AGG_MIN:
+            return partial->min;
+        case TS_AGG_MAX:
+            return partial->max;
+        case TS_AGG_AVG:
+            return partial->sum / partial->count;
+        case TS_AGG_COUNT:
+            return partial->count;
+        case TS_AGG_RANGE:
+            return partial->max - partial->min;
+        default:
+            return partial->sum;
     }
+}
 
-    if (timestamp <= series->lastTimestamp && series->totalSamples != 0) {
-        if (SeriesUpsertSample(series, timestamp, value, dp_override) != REDISMODULE_OK) {
-            RTS_ReplyGeneralError(ctx,
-                                  "TSDB: Error at upsert, update is not supported in BLOCK mode");
-            return REDISMODULE_ERR;
-        }
-    } else {
-        if (SeriesAddSample(series, timestamp, value) != REDISMODULE_OK) {
-            RTS_ReplyGeneralError(ctx, "TSDB: Error at add");
-            return REDISMODULE_ERR;
+static inline void MergePartial(ClusterPartial *partial,
+                                double sum,
+                                double min,
+                                double max,
+                                uint64_t count) {
+    partial->sum += sum;
+    partial->min = partial->count == 0 || min < partial->min ? min : partial->min;
+    partial->max = partial->count == 0 || max > partial->max ? max : partial->max;
+    partial->count += count;
+}
+
+// Writes the partial reductions of the ranges by timestamp, the heap holds non-empty ranges
+static void WriteReducedPartials(ClusterBuffer *out, MRangeCursor *heap, size_t count, bool rev) {
+    for (size_t i = count / 2; i-- > 0;) {
+        CursorHeapSiftDown(heap, count, i, rev);
+    }
+    size_t lenPos = out->len;
+    uint64_t len = 0;
+    ClusterBuffer_WriteU64(out, 0);
+    while (count > 0) {
+        ClusterPartial partial = { .timestamp = heap[0].samples[heap[0].pos].timestamp };
+        while (count > 0 && heap[0].samples[heap[0].pos].timestamp == partial.timestamp) {
+            double value = heap[0].samples[heap[0].pos].value;
+            MergePartial(&partial, value, value, value, 1);
+            if (++heap[0].pos == heap[0].count) {
+                heap[0] = heap[--count];
+            }
+            CursorHeapSiftDown(heap, count, 0, rev);
         }
-        // handle compaction rules
-        CompactionRule *rule = series->rules;
-        while (rule != NULL) {
-            handleCompaction(ctx, series, rule, timestamp, value);
-            rule = rule->nextRule;
+        ClusterBuffer_WriteU64(out, partial.timestamp);
+        ClusterBuffer_WriteDouble(out, partial.sum);
+        ClusterBuffer_WriteDouble(out, partial.min);
+        ClusterBuffer_WriteDouble(out, partial.max);
+        ClusterBuffer_WriteU64(out, partial.count);
+        len++;
+    }
+    ClusterBuffer_SetU64(out, lenPos, len);
+}
+
+// A group has its value, its source series and its partial reductions
+static void WriteGroupPartials(ClusterBuffer *out,
+                               const MRangeSeries *series,
+                               size_t seriesCount,
+                               const MRangeGroupBy *groupBy,
+                               bool rev) {
+    size_t labelLen;
+    const char *label = RedisModule_StringPtrLen(groupBy->label, &labelLen);
+    MRangeGroupMember *members = malloc(max(seriesCount, 1) * sizeof(MRangeGroupMember));
+    size_t membersCount = GroupSeriesMembers(series, seriesCount, label, labelLen, members);
+    MRangeCursor *heap = malloc(max(membersCount, 1) * sizeof(MRangeCursor));
+
+    size_t lenPos = out->len;
+    uint64_t len = 0;
+    ClusterBuffer_WriteU64(out, 0);
+    for (size_t start = 0, end; start < membersCount; start = end) {
+        end = GroupEnd(members, membersCount, start);
+        ClusterBuffer_WriteString(out, members[start].value, members[start].valueLen);
+        ClusterBuffer_WriteU64(out, end - start);
+        size_t heapCount = 0;
+        for (size_t i = start; i < end; i++) {
+            const MRangeSeries *member = &series[members[i].index];
+            size_t keyLen;
+            const char *key = RedisModule_StringPtrLen(member->keyName, &keyLen);
+            ClusterBuffer_WriteString(out, key, keyLen);
+            if (member->writer.count > 0) {
+                heap[heapCount++] = (MRangeCursor){ .samples = member->writer.samples,
+                                                    .count = member->writer.count };
+            }
         }
+        WriteReducedPartials(out, heap, heapCount, rev);
+        len++;
     }
-    RedisModule_ReplyWithLongLong(ctx, timestamp);
-    return REDISMODULE_OK;
+    ClusterBuffer_SetU64(out, lenPos, len);
+    free(heap);
+    free(members);
 }
 
-static inline int add(RedisModuleCtx *ctx,
-                      RedisModuleString *keyName,
-                      RedisModuleString *timestampStr,
-                      RedisModuleString *valueStr,
-                      RedisModuleString **argv,
-                      int argc) {
-    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyName, REDISMODULE_READ | REDISMODULE_WRITE);
-    double value;
-    api_timestamp_t timestamp;
-    if ((RedisModule_StringToDouble(valueStr, &value) != REDISMODULE_OK))
-        return RTS_ReplyGeneralError(ctx, "TSDB: invalid value");
+static void WriteClusterLabels(ClusterBuffer *out, const Label *labels, size_t labelsCount) {
+    ClusterBuffer_WriteU64(out, labelsCount);
+    for (size_t i = 0; i < labelsCount; i++) {
+        size_t len;
+        const char *str = RedisModule_StringPtrLen(labels[i].key, &len);
+        ClusterBuffer_WriteString(out, str, len);
+        str = RedisModule_StringPtrLen(labels[i].value, &len);
+        ClusterBuffer_WriteString(out, str, len);
+    }
+}
 
-    if ((RedisModule_StringToLongLong(timestampStr, (long long int *)&timestamp) !=
-         REDISMODULE_OK)) {
-        // if timestamp is "*", take current time (automatic timestamp)
-        if (RMUtil_StringEqualsC(timestampStr, "*"))
-            timestamp = (u_int64_t)RedisModule_Milliseconds();
-        else
-            return RTS_ReplyGeneralError(ctx, "TSDB: invalid timestamp");
+static Label *ReadClusterLabels(ClusterBuffer *part, size_t *labelsCount) {
+    *labelsCount = ClusterBuffer_ReadU64(part);
+    if (part->error || *labelsCount > part->len) {
+        *labelsCount = 0;
+        return NULL;
     }
+    Label *labels = malloc(max(*labelsCount, 1) * sizeof(Label));
+    for (size_t i = 0; i < *labelsCount; i++) {
+        size_t len;
+        const char *str = ClusterBuffer_ReadString(part, &len);
+        labels[i].key = RedisModule_CreateString(NULL, str, len);
+        str = ClusterBuffer_ReadString(part, &len);
+        labels[i].value = RedisModule_CreateString(NULL, str, len);
+    }
+    return labels;
+}
 
-    Series *series = NULL;
-    DuplicatePolicy dp = DP_NONE;
+/*
+ * The part of a shard holds its series: the key name, the labels and the range of each, or the
+ * partial reductions of its groups.
+ */
+static int ClusterMRangeShard(RedisModuleCtx *ctx,
+                              RedisModuleString **argv,
+                              int argc,
+                              ClusterBuffer *out,
+                              bool rev) {
+    MRangeCtx query;
+    QueryPredicate *queries;
+    size_t query_count;
+    long long cursorId, limit;
+    if (parseMRangeQuery(
+            ctx, argv, argc, rev, &query, &queries, &query_count, &cursorId, &limit) !=
+        REDISMODULE_OK) {
+        return TSDB_ERROR;
+    }
+    size_t result_count;
+    RedisModuleString **result = QueryIndex(ctx, queries, query_count, &result_count, NULL);
+    if (!QueryBudgetAdmitSeries(query.budget, result_count)) {
+        return TSDB_ERROR;
+    }
 
-    if (argv != NULL && RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
-        // the key doesn't exist, lets check we have enough information to create one
-        CreateCtx cCtx = { 0 };
-        if (parseCreateArgs(ctx, argv, argc, &cCtx) != REDISMODULE_OK) {
-            return REDISMODULE_ERR;
+    if (query.groupBy.label != NULL && IsMergeableReducer(query.groupBy.reducerType)) {
+        MRangeSeries *series = calloc(max(result_count, 1), sizeof(MRangeSeries));
+        for (size_t i = 0; i < result_count; i++) {
+            series[i].keyName = RedisModule_CreateStringFromString(NULL, result[i]);
+            MRangeWriteSeries(ctx, &query, &series[i]);
+        }
+        if (QueryBudgetExceeded(query.budget)) {
+            FreeMRangeSeries(series, result_count);
+            return TSDB_ERROR;
         }
+        WriteGroupPartials(out, series, result_count, &query.groupBy, rev);
+        FreeMRangeSeries(series, result_count);
+        return TSDB_OK;
+    }
 
-        CreateTsKey(ctx, keyName, &cCtx, &series, &key);
-        SeriesCreateRulesFromGlobalConfig(ctx, keyName, series, cCtx.labels, cCtx.labelsCount);
-    } else if (RedisModule_ModuleTypeGetType(key) != SeriesType) {
-        return RTS_ReplyGeneralError(ctx, "TSDB: the key is not a TSDB key");
-    } else {
-        series = RedisModule_ModuleTypeGetValue(key);
-        if (ParseDuplicatePolicy(ctx, argv, argc, TS_ADD_DUPLICATE_POLICY_ARG, &dp) != TSDB_OK) {
-            return REDISMODULE_ERR;
+    size_t lenPos = out->len;
+    uint64_t len = 0;
+    ClusterBuffer_WriteU64(out, 0);
+    for (size_t i = 0; i < result_count; i++) {
+        MRangeSeries series = { .keyName = result[i] };
+        MRangeWriteSeries(ctx, &query, &series);
+        if (series.found) {
+            size_t keyLen;
+            const char *key = RedisModule_StringPtrLen(result[i], &keyLen);
+            ClusterBuffer_WriteString(out, key, keyLen);
+            WriteClusterLabels(out, series.labels, series.labelsCount);
+            ClusterBuffer_WriteU64(out, series.writer.count);
+            for (size_t j = 0; j < series.writer.count; j++) {
+                ClusterBuffer_WriteU64(out, series.writer.samples[j].timestamp);
+                ClusterBuffer_WriteDouble(out, series.writer.samples[j].value);
+            }
+            len++;
         }
+        if (series.labels != NULL) {
+            ReleaseLabels(series.labels, series.labelsCount);
+        }
+        free(series.writer.samples);
     }
-    int rv = internalAdd(ctx, series, timestamp, value, dp);
-    RedisModule_CloseKey(key);
-    return rv;
+    if (QueryBudgetExceeded(query.budget)) {
+        return TSDB_ERROR;
+    }
+    ClusterBuffer_SetU64(out, lenPos, len);
+    return TSDB_OK;
 }
 
-int TSDB_madd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
+static int ClusterMRangeRunShard(RedisModuleCtx *ctx,
+                                 RedisModuleString **argv,
+                                 int argc,
+                                 ClusterBuffer *out) {
+    return ClusterMRangeShard(ctx, argv, argc, out, false);
+}
 
-    if (argc < 4 || (argc - 1) % 3 != 0) {
-        return RedisModule_WrongArity(ctx);
+static int ClusterMRevRangeRunShard(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv,
+                                    int argc,
+                                    ClusterBuffer *out) {
+    return ClusterMRangeShard(ctx, argv, argc, out, true);
+}
+
+static int CompareMRangeSeriesKeys(const void *a, const void *b) {
+    size_t leftLen, rightLen;
+    const char *left = RedisModule_StringPtrLen(((const MRangeSeries *)a)->keyName, &leftLen);
+    const char *right = RedisModule_StringPtrLen(((const MRangeSeries *)b)->keyName, &rightLen);
+    int cmp = memcmp(left, right, min(leftLen, rightLen));
+    return cmp != 0 ? cmp : (leftLen > rightLen) - (leftLen < rightLen);
+}
+
+static int ClusterMergeSeries(RedisModuleCtx *ctx,
+                              const MRangeCtx *query,
+                              ClusterBuffer *parts,
+                              size_t count) {
+    MRangeSeries *series = NULL;
+    size_t seriesCount = 0;
+    bool failed = false;
+    for (size_t i = 0; i < count && !failed; i++) {
+        ClusterBuffer *part = &parts[i];
+        uint64_t len = ClusterBuffer_ReadU64(part);
+        if (part->error || len > part->len) {
+            failed = true;
+            break;
+        }
+        series = realloc(series, (seriesCount + len) * sizeof(MRangeSeries));
+        for (uint64_t j = 0; j < len; j++) {
+            MRangeSeries *result = &series[seriesCount++];
+            size_t keyLen;
+            const char *key = ClusterBuffer_ReadString(part, &keyLen);
+            *result = (MRangeSeries){ .keyName = RedisModule_CreateString(NULL, key, keyLen),
+                                      .found = true };
+            result->labels = ReadClusterLabels(part, &result->labelsCount);
+            InternLabels(result->labels, result->labelsCount); // released with the series
+            uint64_t samples = ClusterBuffer_ReadU64(part);
+            if (part->error || samples > part->len) {
+                failed = true;
+                break;
+            }
+            for (uint64_t k = 0; k < samples; k++) {
+                timestamp_t timestamp = ClusterBuffer_ReadU64(part);
+                WriteSample(&result->writer, timestamp, ClusterBuffer_ReadDouble(part));
+            }
+        }
+        failed = failed || part->error;
     }
 
-    RedisModule_ReplyWithArray(ctx, (argc - 1) / 3);
-    for (int i = 1; i < argc; i += 3) {
-        RedisModuleString *keyName = argv[i];
-        RedisModuleString *timestampStr = argv[i + 1];
-        RedisModuleString *valueStr = argv[i + 2];
-        add(ctx, keyName, timestampStr, valueStr, NULL, -1);
+    if (failed) {
+        RTS_ReplyGeneralError(ctx, "TSDB: invalid result of a shard");
+    } else {
+        qsort(series, seriesCount, sizeof(MRangeSeries), CompareMRangeSeriesKeys);
+        ReplyMRangeSeries(ctx, query, series, seriesCount);
     }
-    RedisModule_ReplicateVerbatim(ctx);
+    FreeMRangeSeries(series, seriesCount);
     return REDISMODULE_OK;
 }
 
-int TSDB_add(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
+// A group as sent by a shard, its sources and partials point into the part
+typedef struct ClusterGroup
+{
+    const char *value;
+    size_t valueLen;
+    ClusterBuffer *part;
+    size_t sourcesPos;
+    size_t sourcesCount;
+} ClusterGroup;
+
+static int CompareClusterGroups(const void *a, const void *b) {
+    const ClusterGroup *left = a, *right = b;
+    int cmp = memcmp(left->value, right->value, min(left->valueLen, right->valueLen));
+    return cmp != 0 ? cmp : (left->valueLen > right->valueLen) - (left->valueLen < right->valueLen);
+}
 
-    if (argc < 4) {
-        return RedisModule_WrongArity(ctx);
-    }
+typedef struct ClusterSource
+{
+    const char *key;
+    size_t keyLen;
+} ClusterSource;
 
-    RedisModuleString *keyName = argv[1];
-    RedisModuleString *timestampStr = argv[2];
-    RedisModuleString *valueStr = argv[3];
+static int CompareClusterSources(const void *a, const void *b) {
+    const ClusterSource *left = a, *right = b;
+    int cmp = memcmp(left->key, right->key, min(left->keyLen, right->keyLen));
+    return cmp != 0 ? cmp : (left->keyLen > right->keyLen) - (left->keyLen < right->keyLen);
+}
 
-    int result = add(ctx, keyName, timestampStr, valueStr, argv, argc);
-    RedisModule_ReplicateVerbatim(ctx);
-    return result;
+static int ComparePartials(const void *a, const void *b) {
+    timestamp_t left = ((const ClusterPartial *)a)->timestamp;
+    timestamp_t right = ((const ClusterPartial *)b)->timestamp;
+    return (left > right) - (left < right);
 }
 
-int CreateTsKey(RedisModuleCtx *ctx,
-                RedisModuleString *keyName,
-                CreateCtx *cCtx,
-                Series **series,
-                RedisModuleKey **key) {
-    if (*key == NULL) {
-        *key = RedisModule_OpenKey(ctx, keyName, REDISMODULE_READ | REDISMODULE_WRITE);
-    }
+static int ComparePartialsRev(const void *a, const void *b) {
+    return ComparePartials(b, a);
+}
 
-    RedisModule_RetainString(ctx, keyName);
-    *series = NewSeries(keyName, cCtx);
-    if (RedisModule_ModuleTypeSetValue(*key, SeriesType, *series) == REDISMODULE_ERR) {
-        return TSDB_ERROR;
+// Skips the sources and reads the partials of a group
+static ClusterPartial *ReadGroupPartials(ClusterGroup *group,
+                                         ClusterPartial *partials,
+                                         size_t *count) {
+    ClusterBuffer *part = group->part;
+    part->pos = group->sourcesPos;
+    for (size_t i = 0; i < group->sourcesCount; i++) {
+        size_t len;
+        ClusterBuffer_ReadString(part, &len);
     }
+    uint64_t len = ClusterBuffer_ReadU64(part);
+    if (part->error || len > part->len) {
+        return partials;
+    }
+    partials = realloc(partials, (*count + len) * sizeof(ClusterPartial));
+    for (uint64_t i = 0; i < len; i++) {
+        ClusterPartial *partial = &partials[(*count)++];
+        partial->timestamp = ClusterBuffer_ReadU64(part);
+        partial->sum = ClusterBuffer_ReadDouble(part);
+        partial->min = ClusterBuffer_ReadDouble(part);
+        partial->max = ClusterBuffer_ReadDouble(part);
+        partial->count = ClusterBuffer_ReadU64(part);
+    }
+    return partials;
+}
 
-    IndexMetric(ctx, keyName, (*series)->labels, (*series)->labelsCount);
-
-    return TSDB_OK;
+static void ReplyMergedGroup(RedisModuleCtx *ctx,
+                             const MRangeCtx *query,
+                             ClusterGroup *groups,
+                             size_t count) {
+    size_t sourcesCount = 0, sourcesLen = 0;
+    for (size_t i = 0; i < count; i++) {
+        sourcesCount += groups[i].sourcesCount;
+    }
+    ClusterSource *sources = malloc(max(sourcesCount, 1) * sizeof(ClusterSource));
+    sourcesCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        groups[i].part->pos = groups[i].sourcesPos;
+        for (size_t j = 0; j < groups[i].sourcesCount; j++) {
+            ClusterSource *source = &sources[sourcesCount++];
+            source->key = ClusterBuffer_ReadString(groups[i].part, &source->keyLen);
+            sourcesLen += source->keyLen + 1;
+        }
+    }
+    qsort(sources, sourcesCount, sizeof(ClusterSource), CompareClusterSources);
+    char *joined = malloc(max(sourcesLen, 1));
+    size_t pos = 0;
+    for (size_t i = 0; i < sourcesCount; i++) {
+        memcpy(joined + pos, sources[i].key, sources[i].keyLen);
+        pos += sources[i].keyLen;
+        joined[pos++] = ',';
+    }
+    size_t labelLen;
+    const char *label = RedisModule_StringPtrLen(query->groupBy.label, &labelLen);
+    ReplyGroupHeader(ctx,
+                     label,
+                     labelLen,
+                     groups[0].value,
+                     groups[0].valueLen,
+                     query->groupBy.reducerType,
+                     joined,
+                     pos > 0 ? pos - 1 : 0);
+    free(joined);
+    free(sources);
+
+    ClusterPartial *partials = NULL;
+    size_t partialsCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        partials = ReadGroupPartials(&groups[i], partials, &partialsCount);
+    }
+    qsort(partials,
+          partialsCount,
+          sizeof(ClusterPartial),
+          query->rev ? ComparePartialsRev : ComparePartials);
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    long long arraylen = 0;
+    for (size_t start = 0, end; start < partialsCount; start = end) {
+        ClusterPartial merged = { .timestamp = partials[start].timestamp };
+        for (end = start;
+             end < partialsCount && partials[end].timestamp == partials[start].timestamp;
+             end++) {
+            const ClusterPartial *partial = &partials[end];
+            MergePartial(&merged, partial->sum, partial->min, partial->max, partial->count);
+        }
+        ReplyWithSample(
+            ctx, merged.timestamp, FinalizePartial(&merged, query->groupBy.reducerType));
+        arraylen++;
+    }
+    RedisModule_ReplySetArrayLength(ctx, arraylen);
+    free(partials);
 }
 
-int TSDB_create(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
+static int ClusterMergeGroups(RedisModuleCtx *ctx,
+                              const MRangeCtx *query,
+                              ClusterBuffer *parts,
+                              size_t count) {
+    ClusterGroup *groups = NULL;
+    size_t groupsCount = 0;
+    bool failed = false;
+    for (size_t i = 0; i < count && !failed; i++) {
+        ClusterBuffer *part = &parts[i];
+        uint64_t len = ClusterBuffer_ReadU64(part);
+        if (part->error || len > part->len) {
+            failed = true;
+            break;
+        }
+        groups = realloc(groups, (groupsCount + len) * sizeof(ClusterGroup));
+        for (uint64_t j = 0; j < len && !part->error; j++) {
+            ClusterGroup *group = &groups[groupsCount++];
+            group->value = ClusterBuffer_ReadString(part, &group->valueLen);
+            group->part = part;
+            group->sourcesCount = ClusterBuffer_ReadU64(part);
+            group->sourcesPos = part->pos;
+            size_t partialsCount = 0;
+            free(ReadGroupPartials(group, NULL, &partialsCount));
+        }
+        failed = part->error;
+    }
 
-    if (argc < 2) {
-        return RedisModule_WrongArity(ctx);
+    if (failed) {
+        RTS_ReplyGeneralError(ctx, "TSDB: invalid result of a shard");
+        free(groups);
+        return REDISMODULE_OK;
+    }
+    qsort(groups, groupsCount, sizeof(ClusterGroup), CompareClusterGroups);
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    long long replylen = 0;
+    for (size_t start = 0, end; start < groupsCount; start = end) {
+        for (end = start + 1;
+             end < groupsCount && CompareClusterGroups(&groups[start], &groups[end]) == 0;
+             end++) {
+        }
+        ReplyMergedGroup(ctx, query, &groups[start], end - start);
+        replylen++;
     }
+    RedisModule_ReplySetArrayLength(ctx, replylen);
+    free(groups);
+    return REDISMODULE_OK;
+}
 
-    Series *series;
-    RedisModuleString *keyName = argv[1];
-    CreateCtx cCtx = { 0 };
-    if (parseCreateArgs(ctx, argv, argc, &cCtx) != REDISMODULE_OK) {
+static int ClusterMRangeMergeParts(RedisModuleCtx *ctx,
+                                   RedisModuleString **argv,
+                                   int argc,
+                                   ClusterBuffer *parts,
+                                   size_t count,
+                                   bool rev) {
+    RedisModule_AutoMemory(ctx);
+    MRangeCtx query;
+    QueryPredicate *queries;
+    size_t query_count;
+    long long cursorId, limit;
+    if (parseMRangeQuery(
+            ctx, argv, argc, rev, &query, &queries, &query_count, &cursorId, &limit) !=
+        REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
-
-    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyName, REDISMODULE_READ | REDISMODULE_WRITE);
-
-    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
-        RedisModule_CloseKey(key);
-        return RTS_ReplyGeneralError(ctx, "TSDB: key already exists");
+    if (query.groupBy.label != NULL && IsMergeableReducer(query.groupBy.reducerType)) {
+        return ClusterMergeGroups(ctx, &query, parts, count);
     }
+    return ClusterMergeSeries(ctx, &query, parts, count);
+}
 
-    CreateTsKey(ctx, keyName, &cCtx, &series, &key);
-    RedisModule_CloseKey(key);
+static int ClusterMRangeMerge(RedisModuleCtx *ctx,
+                              RedisModuleString **argv,
+                              int argc,
+                              ClusterBuffer *parts,
+                              size_t count) {
+    return ClusterMRangeMergeParts(ctx, argv, argc, parts, count, false);
+}
 
-    RedisModule_Log(ctx, "verbose", "created new series");
-    RedisModule_ReplyWithSimpleString(ctx, "OK");
-    RedisModule_ReplicateVerbatim(ctx);
-    return REDISMODULE_OK;
+static int ClusterMRevRangeMerge(RedisModuleCtx *ctx,
+                                 RedisModuleString **argv,
+                                 int argc,
+                                 ClusterBuffer *parts,
+                                 size_t count) {
+    return ClusterMRangeMergeParts(ctx, argv, argc, parts, count, true);
 }
 
-int TSDB_alter(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+static int TSDB_cluster_generic_mrange(RedisModuleCtx *ctx,
+                                       RedisModuleString **argv,
+                                       int argc,
+                                       bool rev) {
     RedisModule_AutoMemory(ctx);
 
-    if (argc < 2) {
-        return RedisModule_WrongArity(ctx);
-    }
-
-    Series *series;
-    RedisModuleKey *key;
-    RedisModuleString *keyName = argv[1];
-    CreateCtx cCtx = { 0 };
-    if (parseCreateArgs(ctx, argv, argc, &cCtx) != REDISMODULE_OK) {
+    MRangeCtx query;
+    QueryPredicate *queries;
+    size_t query_count;
+    long long cursorId, limit;
+    if (parseMRangeQuery(
+            ctx, argv, argc, rev, &query, &queries, &query_count, &cursorId, &limit) !=
+        REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
+    if (cursorId >= 0) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: CURSOR cannot be used with cluster queries");
+    }
+    return Cluster_Query(ctx, rev ? clusterMRevRangeType : clusterMRangeType, argv, argc);
+}
 
-    const int status = GetSeries(ctx, argv[1], &key, &series, REDISMODULE_READ | REDISMODULE_WRITE);
-    if (!status) {
-        return REDISMODULE_ERR;
+int TSDB_cluster_mrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return TSDB_cluster_generic_mrange(ctx, argv, argc, false);
+}
+
+int TSDB_cluster_mrevrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return TSDB_cluster_generic_mrange(ctx, argv, argc, true);
+}
+
+// The part of a shard holds the key name, the labels and the last sample of each of its series
+static int ClusterMGetShard(RedisModuleCtx *ctx,
+                            RedisModuleString **argv,
+                            int argc,
+                            ClusterBuffer *out) {
+    QueryPredicate *queries;
+    size_t query_count;
+    bool withLabels;
+    if (parseMGetQuery(ctx, argv, argc, &queries, &query_count, &withLabels) != REDISMODULE_OK) {
+        return TSDB_ERROR;
     }
-    if (RMUtil_ArgIndex("RETENTION", argv, argc) > 0) {
-        series->retentionTime = cCtx.retentionTime;
+    size_t result_count;
+    RedisModuleString **result = QueryIndex(ctx, queries, query_count, &result_count, NULL);
+    size_t lenPos = out->len;
+    uint64_t len = 0;
+    ClusterBuffer_WriteU64(out, 0);
+    for (size_t i = 0; i < result_count; i++) {
+        RedisModuleKey *key;
+        Series *series;
+        if (!SilentGetSeries(ctx, result[i], &key, &series, REDISMODULE_READ)) {
+            continue;
+        }
+        size_t keyLen;
+        const char *keyName = RedisModule_StringPtrLen(result[i], &keyLen);
+        ClusterBuffer_WriteString(out, keyName, keyLen);
+        WriteClusterLabels(out, series->labels, withLabels ? series->labelsCount : 0);
+        ClusterBuffer_WriteU64(out, SeriesGetNumSamples(series) > 0);
+        ClusterBuffer_WriteU64(out, series->lastTimestamp);
+        ClusterBuffer_WriteDouble(out, series->lastValue);
+        RedisModule_CloseKey(key);
+        len++;
     }
+    ClusterBuffer_SetU64(out, lenPos, len);
+    return TSDB_OK;
+}
 
-    if (RMUtil_ArgIndex("CHUNK_SIZE", argv, argc) > 0) {
-        series->chunkSizeBytes = cCtx.chunkSizeBytes;
+// A series of a shard, read from `pos` of its part
+typedef struct ClusterMGetEntry
+{
+    ClusterSource key;
+    ClusterBuffer *part;
+    size_t pos;
+} ClusterMGetEntry;
+
+static int ClusterMGetMerge(RedisModuleCtx *ctx,
+                            RedisModuleString **argv,
+                            int argc,
+                            ClusterBuffer *parts,
+                            size_t count) {
+    ClusterMGetEntry *entries = NULL;
+    size_t entriesCount = 0;
+    bool failed = false;
+    for (size_t i = 0; i < count && !failed; i++) {
+        ClusterBuffer *part = &parts[i];
+        uint64_t len = ClusterBuffer_ReadU64(part);
+        if (part->error || len > part->len) {
+            failed = true;
+            break;
+        }
+        entries = realloc(entries, (entriesCount + len) * sizeof(ClusterMGetEntry));
+        for (uint64_t j = 0; j < len && !part->error; j++) {
+            ClusterMGetEntry *entry = &entries[entriesCount++];
+            entry->key.key = ClusterBuffer_ReadString(part, &entry->key.keyLen);
+            entry->part = part;
+            entry->pos = part->pos;
+            uint64_t labels = ClusterBuffer_ReadU64(part);
+            for (uint64_t k = 0; k < labels * 2 && !part->error; k++) {
+                size_t strLen;
+                ClusterBuffer_ReadString(part, &strLen);
+            }
+            ClusterBuffer_ReadU64(part);
+            ClusterBuffer_ReadU64(part);
+            ClusterBuffer_ReadDouble(part);
+        }
+        failed = part->error;
     }
-
-    if (RMUtil_ArgIndex("DUPLICATE_POLICY", argv, argc) > 0) {
-        series->duplicatePolicy = cCtx.duplicatePolicy;
+    if (failed) {
+        free(entries);
+        return RTS_ReplyGeneralError(ctx, "TSDB: invalid result of a shard");
     }
 
-    if (RMUtil_ArgIndex("LABELS", argv, argc) > 0) {
-        RemoveIndexedMetric(ctx, keyName, series->labels, series->labelsCount);
-        // free current labels
-        FreeLabels(series->labels, series->labelsCount);
-
-        // set new newLabels
-        series->labels = cCtx.labels;
-        series->labelsCount = cCtx.labelsCount;
-        IndexMetric(ctx, keyName, series->labels, series->labelsCount);
+    // the key comes first in an entry
+    qsort(entries, entriesCount, sizeof(ClusterMGetEntry), CompareClusterSources);
+    RedisModule_ReplyWithArray(ctx, entriesCount);
+    for (size_t i = 0; i < entriesCount; i++) {
+        ClusterBuffer *part = entries[i].part;
+        part->pos = entries[i].pos;
+        RedisModule_ReplyWithArray(ctx, 3);
+        RedisModule_ReplyWithStringBuffer(ctx, entries[i].key.key, entries[i].key.keyLen);
+        uint64_t labels = ClusterBuffer_ReadU64(part);
+        RedisModule_ReplyWithArray(ctx, labels);
+        for (uint64_t j = 0; j < labels; j++) {
+            size_t keyLen, valueLen;
+            const char *key = ClusterBuffer_ReadString(part, &keyLen);
+            const char *value = ClusterBuffer_ReadString(part, &valueLen);
+            ReplyWithLabelPair(ctx, key, keyLen, value, valueLen);
+        }
+        bool hasSample = ClusterBuffer_ReadU64(part);
+        timestamp_t timestamp = ClusterBuffer_ReadU64(part);
+        double value = ClusterBuffer_ReadDouble(part);
+        if (hasSample) {
+            ReplyWithSample(ctx, timestamp, value);
+        } else {
+            RedisModule_ReplyWithArray(ctx, 0);
+        }
     }
-    RedisModule_ReplyWithSimpleString(ctx, "OK");
-    RedisModule_ReplicateVerbatim(ctx);
-    RedisModule_CloseKey(key);
+    free(entries);
     return REDISMODULE_OK;
 }
 
-/*
-TS.DELETERULE SOURCE_KEY DEST_KEY
- */
-int TSDB_deleteRule(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+int TSDB_cluster_mget(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
-    if (argc != 3) {
-        return RedisModule_WrongArity(ctx);
-    }
-
-    RedisModuleString *srcKeyName = argv[1];
-
-    // First try to remove the rule from the source key
-    Series *srcSeries;
-    RedisModuleKey *srcKey;
-    const int statusS =
-        GetSeries(ctx, srcKeyName, &srcKey, &srcSeries, REDISMODULE_READ | REDISMODULE_WRITE);
-    if (!statusS) {
+    QueryPredicate *queries;
+    size_t query_count;
+    bool withLabels;
+    if (parseMGetQuery(ctx, argv, argc, &queries, &query_count, &withLabels) != REDISMODULE_OK) {
         return REDISMODULE_ERR;
     }
+    return Cluster_Query(ctx, clusterMGetType, argv, argc);
+}
 
-    RedisModuleString *destKeyName = argv[2];
-    if (!SeriesDeleteRule(srcSeries, destKeyName)) {
-        return RTS_ReplyGeneralError(ctx, "TSDB: compaction rule does not exist");
+static int GetWideSeries(RedisModuleCtx *ctx,
+                         RedisModuleString *keyName,
+                         RedisModuleKey **key,
+                         WideSeries **series,
+                         int mode) {
+    RedisModuleKey *new_key = RedisModule_OpenKey(ctx, keyName, mode);
+    if (RedisModule_KeyType(new_key) == REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(new_key);
+        RTS_ReplyGeneralError(ctx, "TSDB: the key does not exist");
+        return FALSE;
     }
-
-    // If succeed to remove the rule from the source key remove from the destination too
-    Series *destSeries;
-    RedisModuleKey *destKey;
-    const int statusD =
-        GetSeries(ctx, destKeyName, &destKey, &destSeries, REDISMODULE_READ | REDISMODULE_WRITE);
-    if (!statusD) {
-        return REDISMODULE_ERR;
+    if (RedisModule_ModuleTypeGetType(new_key) != WideSeriesType) {
+        RedisModule_CloseKey(new_key);
+        RTS_ReplyGeneralError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return FALSE;
     }
-    SeriesDeleteSrcRule(destSeries, srcKeyName);
-
-    RedisModule_ReplyWithSimpleString(ctx, "OK");
-    RedisModule_ReplicateVerbatim(ctx);
-    RedisModule_CloseKey(srcKey);
-    RedisModule_CloseKey(destKey);
-    return REDISMODULE_OK;
+    *key = new_key;
+    *series = RedisModule_ModuleTypeGetValue(new_key);
+    return TRUE;
 }
 
 /*
-TS.CREATERULE sourceKey destKey AGGREGATION aggregationType timeBucket
+TS.WIDE.CREATE key FIELDS count field... [RETENTION retentionTime] [CHUNK_SIZE size]
 */
-int TSDB_createRule(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+int TSDB_wide_create(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
-    if (argc != 6) {
+    if (argc < 5 || !RMUtil_StringEqualsCaseC(argv[2], "FIELDS")) {
         return RedisModule_WrongArity(ctx);
     }
-
-    // Validate aggregation arguments
-    api_timestamp_t timeBucket;
-    int aggType;
-    const int result = _parseAggregationArgs(ctx, argv, argc, &timeBucket, &aggType);
-    if (result == TSDB_NOTEXISTS) {
-        return RedisModule_WrongArity(ctx);
+    long long fieldsCount;
+    if (RedisModule_StringToLongLong(argv[3], &fieldsCount) != REDISMODULE_OK ||
+        fieldsCount <= 0 || fieldsCount > WIDE_FIELDS_MAX) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: FIELDS must be between 1 and 64");
     }
-    if (result == TSDB_ERROR) {
-        return REDISMODULE_ERR;
+    if (argc < 4 + fieldsCount) {
+        return RedisModule_WrongArity(ctx);
     }
 
-    RedisModuleString *srcKeyName = argv[1];
-    RedisModuleString *destKeyName = argv[2];
-    if (!RedisModule_StringCompare(srcKeyName, destKeyName)) {
-        return RTS_ReplyGeneralError(
-            ctx, "TSDB: the source key and destination key should be different");
+    // the options follow the fields, which may be named like them
+    RedisModuleString **options = argv + 4 + fieldsCount;
+    int optionsCount = argc - 4 - fieldsCount;
+    long long retentionTime = TSGlobalConfig.retentionPolicy;
+    long long chunkSizeBytes = TSGlobalConfig.chunkSizeBytes;
+    if (RMUtil_ArgIndex("RETENTION", options, optionsCount) >= 0 &&
+        (RMUtil_ParseArgsAfter("RETENTION", options, optionsCount, "l", &retentionTime) !=
+             REDISMODULE_OK ||
+         retentionTime < 0)) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse RETENTION");
     }
-
-    // First we verify the source is not a destination
-    Series *srcSeries;
-    RedisModuleKey *srcKey;
-    const int statusS =
-        GetSeries(ctx, srcKeyName, &srcKey, &srcSeries, REDISMODULE_READ | REDISMODULE_WRITE);
-    if (!statusS) {
-        return REDISMODULE_ERR;
+    if (RMUtil_ArgIndex("CHUNK_SIZE", options, optionsCount) >= 0 &&
+        (RMUtil_ParseArgsAfter("CHUNK_SIZE", options, optionsCount, "l", &chunkSizeBytes) !=
+             REDISMODULE_OK ||
+         chunkSizeBytes <= 0)) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: Couldn't parse CHUNK_SIZE");
     }
-    if (srcSeries->srcKey) {
-        return RTS_ReplyGeneralError(ctx, "TSDB: the source key already has a source rule");
+    if (chunkSizeBytes > CHUNK_SIZE_MAX_BYTES) {
+        return RTS_ReplyGeneralError(ctx, "TSDB: CHUNK_SIZE is larger than 1048576 bytes");
     }
 
-    // Second verify the destination doesn't have other rule
-    Series *destSeries;
-    RedisModuleKey *destKey;
-    const int statusD =
-        GetSeries(ctx, destKeyName, &destKey, &destSeries, REDISMODULE_READ | REDISMODULE_WRITE);
-    if (!statusD) {
-        return REDISMODULE_ERR;
+    RedisModuleString **fields = malloc(fieldsCount * sizeof(RedisModuleString *));
+    for (long long i = 0; i < fieldsCount; ++i) {
+        fields[i] = RedisModule_CreateStringFromString(NULL, argv[4 + i]);
     }
-    srcKeyName = RedisModule_CreateStringFromString(ctx, srcKeyName);
-    if (!SeriesSetSrcRule(destSeries, srcKeyName)) {
-        return RTS_ReplyGeneralError(ctx, "TSDB: the destination key already has a rule");
+    WideSeries *series = NewWideSeries(fields, fieldsCount, retentionTime, chunkSizeBytes);
+    for (long long i = 1; i < fieldsCount; ++i) {
+        size_t len;
+        const char *name = RedisModule_StringPtrLen(fields[i], &len);
+        if (WideSeriesFieldIndex(series, name, len) != i) {
+            FreeWideSeries(series);
+            return RTS_ReplyGeneralError(ctx, "TSDB: duplicate field");
+        }
     }
-    RedisModule_RetainString(ctx, srcKeyName);
 
-    // Last add the rule to source
-    destKeyName = RedisModule_CreateStringFromString(ctx, destKeyName);
-    if (SeriesAddRule(srcSeries, destKeyName, aggType, timeBucket) == NULL) {
-        RedisModule_ReplyWithSimpleString(ctx, "TSDB: ERROR creating rule");
-        return REDISMODULE_ERR;
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        FreeWideSeries(series);
+        return RTS_ReplyGeneralError(ctx, "TSDB: key already exists");
     }
-    RedisModule_RetainString(ctx, destKeyName);
+    RedisModule_ModuleTypeSetValue(key, WideSeriesType, series);
+    RedisModule_CloseKey(key);
+
     RedisModule_ReplyWithSimpleString(ctx, "OK");
     RedisModule_ReplicateVerbatim(ctx);
-    RedisModule_CloseKey(srcKey);
-    RedisModule_CloseKey(destKey);
     return REDISMODULE_OK;
 }
 
 /*
-TS.INCRBY ts_key NUMBER [TIMESTAMP timestamp]
+TS.WIDE.ADD key timestamp value... [timestamp value...]
+Adds rows holding a value for each field, in timestamp order. No row is added unless all are valid.
 */
-int TSDB_incrby(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+int TSDB_wide_add(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
-    if (argc < 3) {
+    if (argc < 4) {
         return RedisModule_WrongArity(ctx);
     }
-
-    RedisModuleString *keyName = argv[1];
-    Series *series;
-
-    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
-    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
-        // the key doesn't exist, lets check we have enough information to create one
-        CreateCtx cCtx = { 0 };
-        if (parseCreateArgs(ctx, argv, argc, &cCtx) != REDISMODULE_OK) {
-            return REDISMODULE_ERR;
+    WideSeries *series;
+    RedisModuleKey *key;
+    if (!GetWideSeries(ctx, argv[1], &key, &series, REDISMODULE_READ | REDISMODULE_WRITE)) {
+        return REDISMODULE_ERR;
+    }
+    size_t rowArgs = 1 + series->fieldsCount;
+    if ((argc - 2) % rowArgs != 0) {
+        RedisModule_CloseKey(key);
+        return RedisModule_WrongArity(ctx);
+    }
+    size_t rowsCount = (argc - 2) / rowArgs;
+
+    timestamp_t *timestamps = malloc(rowsCount * sizeof(timestamp_t));
+    double *values = malloc(rowsCount * series->fieldsCount * sizeof(double));
+    bool resolved = false;
+    int result = REDISMODULE_OK;
+    for (size_t row = 0; row < rowsCount && result == REDISMODULE_OK; ++row) {
+        RedisModuleString **rowArgv = argv + 2 + row * rowArgs;
+        if (RedisModule_StringToLongLong(rowArgv[0], (long long *)&timestamps[row]) !=
+            REDISMODULE_OK) {
+            if (!RMUtil_StringEqualsC(rowArgv[0], "*")) {
+                result = RTS_ReplyGeneralError(ctx, "TSDB: invalid timestamp");
+                break;
+            }
+            timestamps[row] = (u_int64_t)RedisModule_Milliseconds();
+            resolved = true;
         }
+        timestamp_t prev = row > 0 ? timestamps[row - 1] : series->lastTimestamp;
+        if ((row > 0 || series->totalSamples > 0) && timestamps[row] <= prev) {
+            result = RTS_ReplyGeneralError(
+                ctx, "TSDB: rows must be added after the last row of the wide series");
+            break;
+        }
+        for (size_t i = 0; i < series->fieldsCount; ++i) {
+            if (RedisModule_StringToDouble(rowArgv[1 + i],
+                                           &values[row * series->fieldsCount + i]) !=
+                REDISMODULE_OK) {
+                result = RTS_ReplyGeneralError(ctx, "TSDB: invalid value");
+                break;
+            }
+        }
+    }
 
-        CreateTsKey(ctx, keyName, &cCtx, &series, &key);
-        SeriesCreateRulesFromGlobalConfig(ctx, keyName, series, cCtx.labels, cCtx.labelsCount);
-    } else if (RedisModule_ModuleTypeGetType(key) != SeriesType) {
-        return RTS_ReplyGeneralError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    if (result == REDISMODULE_OK) {
+        RedisModule_ReplyWithArray(ctx, rowsCount);
+        for (size_t row = 0; row < rowsCount; ++row) {
+            WideSeriesAddRow(series, timestamps[row], &values[row * series->fieldsCount]);
+            RedisModule_ReplyWithLongLong(ctx, timestamps[row]);
+        }
+        if (resolved) {
+            // replicas and the AOF add the rows at the timestamps resolved here
+            RedisModuleString **args = malloc((argc - 1) * sizeof(RedisModuleString *));
+            memcpy(args, argv + 1, (argc - 1) * sizeof(RedisModuleString *));
+            for (size_t row = 0; row < rowsCount; ++row) {
+                args[1 + row * rowArgs] =
+                    RedisModule_CreateStringFromLongLong(ctx, timestamps[row]);
+            }
+            RedisModule_Replicate(ctx, "TS.WIDE.ADD", "v", args, (size_t)(argc - 1));
+            free(args);
+        } else {
+            RedisModule_ReplicateVerbatim(ctx);
+        }
+        if (RedisModule_SignalModifiedKey) {
+            RedisModule_SignalModifiedKey(ctx, argv[1]);
+        }
     }
+    free(timestamps);
+    free(values);
+    RedisModule_CloseKey(key);
+    return result;
+}
 
-    series = RedisModule_ModuleTypeGetValue(key);
+/*
+TS.WIDE.RANGE key field fromTimestamp toTimestamp [FILTER_BY_VALUE min max] [COUNT count]
+              [AGGREGATION type timeBucket]
+*/
+int TSDB_wide_range(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
 
-    double incrby = 0;
-    if (RMUtil_ParseArgs(argv, argc, 2, "d", &incrby) != REDISMODULE_OK) {
-        return RTS_ReplyGeneralError(ctx, "TSDB: invalid increase/decrease value");
+    if (argc < 5) {
+        return RedisModule_WrongArity(ctx);
     }
-
-    long long currentUpdatedTime = -1;
-    int timestampLoc = RMUtil_ArgIndex("TIMESTAMP", argv, argc);
-    if (timestampLoc == -1 || RMUtil_StringEqualsC(argv[timestampLoc + 1], "*")) {
-        currentUpdatedTime = RedisModule_Milliseconds();
-    } else if (RedisModule_StringToLongLong(argv[timestampLoc + 1],
-                                            (long long *)&currentUpdatedTime) != REDISMODULE_OK) {
-        return RTS_ReplyGeneralError(ctx, "TSDB: invalid timestamp");
+    WideSeries *series;
+    RedisModuleKey *key;
+    if (!GetWideSeries(ctx, argv[1], &key, &series, REDISMODULE_READ)) {
+        return REDISMODULE_ERR;
+    }
+    size_t len;
+    const char *name = RedisModule_StringPtrLen(argv[2], &len);
+    int field = WideSeriesFieldIndex(series, name, len);
+    if (field < 0) {
+        RedisModule_CloseKey(key);
+        return RTS_ReplyGeneralError(ctx, "TSDB: the wide series has no such field");
     }
 
-    if (currentUpdatedTime < series->lastTimestamp && series->lastTimestamp != 0) {
-        return RedisModule_ReplyWithError(
-            ctx, "TSDB: for incrby/decrby, timestamp should be newer than the lastest one");
+    api_timestamp_t start_ts, end_ts;
+    api_timestamp_t time_delta = 0;
+    Series fake_series = { 0 };
+    fake_series.lastTimestamp = series->lastTimestamp;
+    if (parseRangeArguments(ctx, &fake_series, 3, argv, &start_ts, &end_ts) != REDISMODULE_OK) {
+        RedisModule_CloseKey(key);
+        return REDISMODULE_ERR;
+    }
+    long long count = -1;
+    if (parseCountArgument(ctx, argv, argc, &count) != REDISMODULE_OK) {
+        RedisModule_CloseKey(key);
+        return REDISMODULE_ERR;
+    }
+    AggregationClass *aggObjects[TS_AGG_TYPES_MAX];
+    size_t aggCount = 0;
+    if (parseAggregationListArgs(
+            ctx, argv, argc, &time_delta, aggObjects, TS_AGG_TYPES_MAX, &aggCount) ==
+        TSDB_ERROR) {
+        RedisModule_CloseKey(key);
+        return REDISMODULE_ERR;
     }
 
-    double result = series->lastValue;
-    RMUtil_StringToLower(argv[0]);
-    if (RMUtil_StringEqualsC(argv[0], "ts.incrby")) {
-        result += incrby;
-    } else {
-        result -= incrby;
+    ValueFilter filter;
+    if (parseValueFilterArgument(ctx, argv, argc, &filter) != TSDB_OK) {
+        RedisModule_CloseKey(key);
+        return REDISMODULE_ERR;
     }
 
-    int rv = internalAdd(ctx, series, currentUpdatedTime, result, DP_LAST);
-    RedisModule_ReplicateVerbatim(ctx);
+    Series *copy = WideSeriesCopyField(series, field, start_ts, end_ts);
+    ReplySeriesRangeAggregations(ctx,
+                                 copy,
+                                 start_ts,
+                                 end_ts,
+                                 aggObjects,
+                                 aggCount,
+                                 time_delta,
+                                 count,
+                                 false,
+                                 NULL,
+                                 &filter,
+                                 0);
+    FreeSeriesCopy(copy);
     RedisModule_CloseKey(key);
-    return rv;
+    return REDISMODULE_OK;
 }
 
-int TSDB_get(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+int TSDB_wide_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
     if (argc != 2) {
         return RedisModule_WrongArity(ctx);
     }
-
-    Series *series;
+    WideSeries *series;
     RedisModuleKey *key;
-    const int status = GetSeries(ctx, argv[1], &key, &series, REDISMODULE_READ);
-    if (!status) {
+    if (!GetWideSeries(ctx, argv[1], &key, &series, REDISMODULE_READ)) {
         return REDISMODULE_ERR;
     }
 
-    ReplyWithSeriesLastDatapoint(ctx, series);
+    RedisModule_ReplyWithArray(ctx, 8 * 2);
+    RedisModule_ReplyWithSimpleString(ctx, "totalSamples");
+    RedisModule_ReplyWithLongLong(ctx, series->totalSamples);
+    RedisModule_ReplyWithSimpleString(ctx, "memoryUsage");
+    RedisModule_ReplyWithLongLong(ctx, WideSeriesMemUsage(series));
+    RedisModule_ReplyWithSimpleString(ctx, "firstTimestamp");
+    RedisModule_ReplyWithLongLong(
+        ctx,
+        series->totalSamples > 0
+            ? WideChunk_FirstTimestamp(ChunkDir_Get(&series->chunks, 0))
+            : 0);
+    RedisModule_ReplyWithSimpleString(ctx, "lastTimestamp");
+    RedisModule_ReplyWithLongLong(ctx, series->lastTimestamp);
+    RedisModule_ReplyWithSimpleString(ctx, "retentionTime");
+    RedisModule_ReplyWithLongLong(ctx, series->retentionTime);
+    RedisModule_ReplyWithSimpleString(ctx, "chunkCount");
+    RedisModule_ReplyWithLongLong(ctx, ChunkDir_Count(&series->chunks));
+    RedisModule_ReplyWithSimpleString(ctx, "chunkSize");
+    RedisModule_ReplyWithLongLong(ctx, series->chunkSizeBytes);
+    RedisModule_ReplyWithSimpleString(ctx, "fields");
+    RedisModule_ReplyWithArray(ctx, series->fieldsCount);
+    for (size_t i = 0; i < series->fieldsCount; ++i) {
+        RedisModule_ReplyWithString(ctx, series->fields[i]);
+    }
     RedisModule_CloseKey(key);
     return REDISMODULE_OK;
 }
 
-int TSDB_mget(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
-
-    if (argc < 3) {
-        return RedisModule_WrongArity(ctx);
+/*
+ * Runs for the generic events of every key, most of them not series: only renames and moves, rare,
+ * take a context. Series deletions invalidate the rule cache from SeriesUnlink and FreeSeries.
+ */
+int NotifyCallback(RedisModuleCtx *original_ctx,
+                   int type,
+                   const char *event,
+                   RedisModuleString *key) {
+    if (strcmp(event, "del") == 0) {
+        // the series unlinked by this deletion, if any, detaches from its rules
+        CleanLastDeletedSeries(key);
+    } else if (strcmp(event, "expire") == 0) {
+        IndexSetSeriesVolatile(key, true);
+    } else if (strcmp(event, "rename_from") == 0) {
+        RenameSeriesFrom(original_ctx, key);
+    } else if (strcmp(event, "rename_to") == 0) {
+        RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
+        RedisModule_AutoMemory(ctx);
+        RenameSeriesTo(ctx, key);
+        RedisModule_FreeThreadSafeContext(ctx);
+    } else if (strcmp(event, "move_to") == 0) {
+        RedisModuleKey *seriesKey;
+        Series *series;
+        if (SilentGetSeries(original_ctx, key, &seriesKey, &series, REDISMODULE_READ)) {
+            RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
+            RedisModule_AutoMemory(ctx);
+            // the rules of the other database may have resolved it
+            SeriesInvalidateRuleCache();
+            SeriesRelink(ctx, series);
+            RedisModule_FreeThreadSafeContext(ctx);
+            RedisModule_CloseKey(seriesKey);
+        }
     }
+    return REDISMODULE_OK;
+}
 
-    int filter_location = RMUtil_ArgIndex("FILTER", argv, argc);
-    if (filter_location == -1) {
-        return RedisModule_WrongArity(ctx);
-    }
-    size_t query_count = argc - 1 - filter_location;
-    const int withlabels_location = RMUtil_ArgIndex("WITHLABELS", argv, argc);
-    QueryPredicate *queries = RedisModule_PoolAlloc(ctx, sizeof(QueryPredicate) * query_count);
-    if (parseLabelListFromArgs(ctx, argv, filter_location + 1, query_count, queries) ==
-        TSDB_ERROR) {
-        return RTS_ReplyGeneralError(ctx, "TSDB: failed parsing labels");
-    }
+static void RetentionSweepCallback(RedisModuleCtx *ctx, void *data) {
+    SeriesRetentionSweep(RETENTION_SWEEP_MAX_CHUNKS);
+    RedisModule_CreateTimer(ctx, RETENTION_SWEEP_PERIOD_MS, RetentionSweepCallback, NULL);
+}
 
-    if (CountPredicateType(queries, (size_t)query_count, EQ) +
-            CountPredicateType(queries, (size_t)query_count, LIST_MATCH) ==
-        0) {
-        return RTS_ReplyGeneralError(ctx, "TSDB: please provide at least one matcher");
+// The timeseries_memory section of INFO
+static void InfoCallback(RedisModuleInfoCtx *ctx, int for_crash_report) {
+    SeriesTotals totals;
+    SeriesGetTotals(&totals);
+    RedisModule_InfoAddSection(ctx, "memory");
+    RedisModule_InfoAddFieldLongLong(ctx, "chunks", totals.chunks);
+    RedisModule_InfoAddFieldLongLong(ctx, "samples", totals.samples);
+    RedisModule_InfoAddFieldLongLong(ctx, "chunks_bytes", totals.bytes);
+    RedisModule_InfoAddFieldLongLong(ctx, "offloaded_bytes", SegmentStore_LiveBytes());
+    RedisModule_InfoAddFieldLongLong(ctx, "label_strings", InternedLabelStrings());
+    RedisModule_InfoAddFieldLongLong(ctx, "retired_chunks", Epoch_RetiredCount());
+    // SAMPLE_SIZE bytes per sample against the memory of the chunks
+    RedisModule_InfoAddFieldDouble(
+        ctx,
+        "compression_ratio",
+        totals.bytes > 0 ? (double)totals.samples * SAMPLE_SIZE / totals.bytes : 0);
+
+    if (QueryCache_IsEnabled()) {
+        long long entries, hits, misses;
+        QueryCache_Stats(&entries, &hits, &misses);
+        RedisModule_InfoAddSection(ctx, "query_cache");
+        RedisModule_InfoAddFieldLongLong(ctx, "entries", entries);
+        RedisModule_InfoAddFieldLongLong(ctx, "hits", hits);
+        RedisModule_InfoAddFieldLongLong(ctx, "misses", misses);
     }
 
-    RedisModuleDict *result = QueryIndex(ctx, queries, query_count);
-    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(result, "^", NULL, 0);
-    char *currentKey;
-    size_t currentKeyLen;
-    long long replylen = 0;
-    Series *series;
-    while ((currentKey = RedisModule_DictNextC(iter, &currentKeyLen, NULL)) != NULL) {
-        RedisModuleKey *key;
-        const int status = SilentGetSeries(ctx,
-                                           RedisModule_CreateString(ctx, currentKey, currentKeyLen),
-                                           &key,
-                                           &series,
-                                           REDISMODULE_READ);
-        if (!status) {
-            RedisModule_Log(ctx,
-                            "warning",
-                            "couldn't open key or key is not a Timeseries. key=%.*s",
-                            currentKeyLen,
-                            currentKey);
+#if STAGE_STATS
+    // the quantiles are the upper bounds of their histogram buckets
+    RedisModule_InfoAddSection(ctx, "stages");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        StageHistogram histogram;
+        StageStats_Get(stage, &histogram);
+        char name[64];
+        RedisModule_InfoBeginDictField(ctx, (char *)StageStats_Name(stage));
+        RedisModule_InfoAddFieldULongLong(ctx, "calls", histogram.calls);
+        RedisModule_InfoAddFieldULongLong(ctx, "timed", histogram.timed);
+        RedisModule_InfoAddFieldULongLong(
+            ctx, "avg_ns", histogram.timed > 0 ? histogram.ns / histogram.timed : 0);
+        RedisModule_InfoAddFieldULongLong(ctx, "p50_ns", StageStats_Quantile(&histogram, 0.5));
+        RedisModule_InfoAddFieldULongLong(ctx, "p99_ns", StageStats_Quantile(&histogram, 0.99));
+        RedisModule_InfoAddFieldULongLong(ctx, "p999_ns", StageStats_Quantile(&histogram, 0.999));
+        RedisModule_InfoEndDictField(ctx);
+        if (histogram.timed == 0) {
             continue;
         }
-        RedisModule_ReplyWithArray(ctx, 3);
-        RedisModule_ReplyWithStringBuffer(ctx, currentKey, currentKeyLen);
-        if (withlabels_location >= 0) {
-            ReplyWithSeriesLabels(ctx, series);
-        } else {
-            RedisModule_ReplyWithArray(ctx, 0);
+
+        // the non empty buckets, by their upper bound
+        snprintf(name, sizeof(name), "%s_histogram", StageStats_Name(stage));
+        RedisModule_InfoBeginDictField(ctx, name);
+        for (int i = 0; i < STAGE_HISTOGRAM_BUCKETS; i++) {
+            if (histogram.buckets[i] == 0) {
+                continue;
+            }
+            char bucket[32];
+            snprintf(bucket, sizeof(bucket), "le_%llu", 1ULL << (i + 1));
+            RedisModule_InfoAddFieldULongLong(ctx, bucket, histogram.buckets[i]);
         }
-        ReplyWithSeriesLastDatapoint(ctx, series);
-        replylen++;
-        RedisModule_CloseKey(key);
+        RedisModule_InfoEndDictField(ctx);
     }
-    RedisModule_ReplySetArrayLength(ctx, replylen);
-    RedisModule_DictIteratorStop(iter);
-    return REDISMODULE_OK;
+#endif
 }
 
-int NotifyCallback(RedisModuleCtx *original_ctx,
-                   int type,
-                   const char *event,
-                   RedisModuleString *key) {
-    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
-    RedisModule_AutoMemory(ctx);
-
-    if (strcasecmp(event, "del") == 0) {
-        CleanLastDeletedSeries(key);
+void FlushCallback(RedisModuleCtx *ctx, RedisModuleEvent eid, uint64_t subevent, void *data) {
+    if (subevent == REDISMODULE_SUBEVENT_FLUSHDB_START) {
+        // The series may be freed in the background, stop handing them out of the index
+        IndexSetAllSeriesVolatile();
     }
+}
 
-    if (strcasecmp(event, "rename_from") == 0) {
-        RenameSeriesFrom(ctx, key);
+void LoadingCallback(RedisModuleCtx *ctx, RedisModuleEvent eid, uint64_t subevent, void *data) {
+    if (subevent == REDISMODULE_SUBEVENT_LOADING_ENDED ||
+        subevent == REDISMODULE_SUBEVENT_LOADING_FAILED) {
+        SeriesIndexQueued();
+        CompactionQueueFlush(ctx);
     }
+}
 
-    if (strcasecmp(event, "rename_to") == 0) {
-        RenameSeriesTo(ctx, key);
+// Snapshots must hold the buckets already closed
+void PersistenceCallback(RedisModuleCtx *ctx, RedisModuleEvent eid, uint64_t subevent, void *data) {
+    if (subevent == REDISMODULE_SUBEVENT_PERSISTENCE_RDB_START ||
+        subevent == REDISMODULE_SUBEVENT_PERSISTENCE_AOF_START ||
+        subevent == REDISMODULE_SUBEVENT_PERSISTENCE_SYNC_RDB_START) {
+        CompactionQueueFlush(ctx);
     }
+}
 
-    RedisModule_FreeThreadSafeContext(ctx);
-
-    return REDISMODULE_OK;
+static void CompactionFlushCallback(RedisModuleCtx *ctx, void *data) {
+    CompactionQueueFlush(ctx);
+    RedisModule_CreateTimer(ctx, COMPACTION_FLUSH_PERIOD_MS, CompactionFlushCallback, NULL);
 }
 
 /*
@@ -1332,21 +5510,46 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         return REDISMODULE_ERR;
     }
 
+    if (TSGlobalConfig.offloadDir != NULL &&
+        SegmentStore_Init(TSGlobalConfig.offloadDir) != TSDB_OK) {
+        RedisModule_Log(ctx, "warning", "Failed to create a segment file in OFFLOAD_DIR");
+        return REDISMODULE_ERR;
+    }
+
+    if (TSGlobalConfig.workerThreads > 0 &&
+        ThreadPool_Init(TSGlobalConfig.workerThreads) != TSDB_OK) {
+        RedisModule_Log(ctx, "warning", "Failed to start the worker threads");
+        return REDISMODULE_ERR;
+    }
+    QueryCache_Init(TSGlobalConfig.queryCacheSize);
+
     RedisModuleTypeMethods tm = { .version = REDISMODULE_TYPE_METHOD_VERSION,
                                   .rdb_load = series_rdb_load,
                                   .rdb_save = series_rdb_save,
-                                  .aof_rewrite = RMUtil_DefaultAofRewrite,
+                                  .aof_rewrite = series_aof_rewrite,
                                   .mem_usage = SeriesMemUsage,
-                                  .free = FreeSeries };
+                                  .free = FreeSeries,
+                                  .free_effort = SeriesFreeEffort,
+                                  .unlink = SeriesUnlink };
 
-    SeriesType = RedisModule_CreateDataType(ctx, "TSDB-TYPE", TS_SIZE_RDB_VER, &tm);
+    SeriesType = RedisModule_CreateDataType(ctx, "TSDB-TYPE", TS_LATEST_ENCVER, &tm);
     if (SeriesType == NULL)
         return REDISMODULE_ERR;
+    RedisModuleTypeMethods wideTm = { .version = REDISMODULE_TYPE_METHOD_VERSION,
+                                      .rdb_load = wide_rdb_load,
+                                      .rdb_save = wide_rdb_save,
+                                      .aof_rewrite = RMUtil_DefaultAofRewrite,
+                                      .mem_usage = WideSeriesMemUsage,
+                                      .free = FreeWideSeries };
+    WideSeriesType = RedisModule_CreateDataType(ctx, "TSDB-WIDE", WIDE_LATEST_ENCVER, &wideTm);
+    if (WideSeriesType == NULL)
+        return REDISMODULE_ERR;
     IndexInit();
     RMUtil_RegisterWriteDenyOOMCmd(ctx, "ts.create", TSDB_create);
     RMUtil_RegisterWriteDenyOOMCmd(ctx, "ts.alter", TSDB_alter);
     RMUtil_RegisterWriteDenyOOMCmd(ctx, "ts.createrule", TSDB_createRule);
     RMUtil_RegisterWriteCmd(ctx, "ts.deleterule", TSDB_deleteRule);
+    RMUtil_RegisterWriteCmd(ctx, "ts.del", TSDB_del);
     RMUtil_RegisterWriteDenyOOMCmd(ctx, "ts.add", TSDB_add);
     RMUtil_RegisterWriteDenyOOMCmd(ctx, "ts.incrby", TSDB_incrby);
     RMUtil_RegisterWriteDenyOOMCmd(ctx, "ts.decrby", TSDB_incrby);
@@ -1354,8 +5557,16 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     RMUtil_RegisterReadCmd(ctx, "ts.revrange", TSDB_revrange);
     RMUtil_RegisterReadCmd(ctx, "ts.queryindex", TSDB_queryindex);
     RMUtil_RegisterReadCmd(ctx, "ts.info", TSDB_info);
+    RMUtil_RegisterWriteDenyOOMCmd(ctx, "ts.wide.create", TSDB_wide_create);
+    RMUtil_RegisterWriteDenyOOMCmd(ctx, "ts.wide.add", TSDB_wide_add);
+    RMUtil_RegisterReadCmd(ctx, "ts.wide.range", TSDB_wide_range);
+    RMUtil_RegisterReadCmd(ctx, "ts.wide.info", TSDB_wide_info);
     RMUtil_RegisterReadCmd(ctx, "ts.get", TSDB_get);
 
+    if (RedisModule_CreateCommand(ctx, "ts.addbulk", TSDB_addbulk, "write deny-oom", 1, 1, 1) ==
+        REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
     if (RedisModule_CreateCommand(ctx, "ts.madd", TSDB_madd, "write deny-oom", 1, -1, 3) ==
         REDISMODULE_ERR)
         return REDISMODULE_ERR;
@@ -1372,7 +5583,50 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         REDISMODULE_ERR)
         return REDISMODULE_ERR;
 
+    if (RedisModule_CreateCommand(ctx, "ts.labelnames", TSDB_labelnames, "readonly", 0, 0, 0) ==
+        REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "ts.labelvalues", TSDB_labelvalues, "readonly", 0, 0, 0) ==
+        REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "ts.subscribe", TSDB_subscribe, "readonly", 0, 0, 0) ==
+        REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "ts.unsubscribe", TSDB_unsubscribe, "readonly", 0, 0, 0) ==
+        REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    Cluster_Init(ctx);
+    clusterMRangeType = Cluster_RegisterQuery(ClusterMRangeRunShard, ClusterMRangeMerge);
+    clusterMRevRangeType = Cluster_RegisterQuery(ClusterMRevRangeRunShard, ClusterMRevRangeMerge);
+    clusterMGetType = Cluster_RegisterQuery(ClusterMGetShard, ClusterMGetMerge);
+    if (RedisModule_CreateCommand(
+            ctx, "ts.cluster.mrange", TSDB_cluster_mrange, "readonly", 0, 0, 0) ==
+        REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(
+            ctx, "ts.cluster.mrevrange", TSDB_cluster_mrevrange, "readonly", 0, 0, 0) ==
+        REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(
+            ctx, "ts.cluster.mget", TSDB_cluster_mget, "readonly", 0, 0, 0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    RedisModule_RegisterInfoFunc(ctx, InfoCallback);
     RedisModule_SubscribeToKeyspaceEvents(ctx, REDISMODULE_NOTIFY_GENERIC, NotifyCallback);
+    RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_FlushDB, FlushCallback);
+    RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_Loading, LoadingCallback);
+    RedisModule_CreateTimer(ctx, RETENTION_SWEEP_PERIOD_MS, RetentionSweepCallback, NULL);
+    if (TSGlobalConfig.asyncCompaction) {
+        RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_Persistence, PersistenceCallback);
+        RedisModule_CreateTimer(ctx, COMPACTION_FLUSH_PERIOD_MS, CompactionFlushCallback, NULL);
+    }
+    IndexUseSeriesHandles(RTS_IsSingleDatabase(ctx));
 
     return REDISMODULE_OK;
 }
@@ -6,6 +6,7 @@
 #ifndef MODULE_H
 #define MODULE_H
 
+#include "indexer.h"
 #include "redismodule.h"
 #include "tsdb.h"
 
@@ -34,4 +35,11 @@ int SilentGetSeries(RedisModuleCtx *ctx,
                     Series **series,
                     int mode);
 
+// Parses the label filters argv[start..start + query_count) into queries
+int parseLabelListFromArgs(RedisModuleCtx *ctx,
+                           RedisModuleString **argv,
+                           int start,
+                           int query_count,
+                           QueryPredicate *queries);
+
 #endif
@@ -0,0 +1,147 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "query_cache.h"
+
+#include "indexer.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "rmutil/alloc.h"
+
+typedef struct QueryCacheEntry
+{
+    RedisModuleString *key;
+    uint64_t indexVersion;
+    void *value;
+    QueryCacheFreeFunc freeValue;
+    // the most recently used entry is the head of the list
+    struct QueryCacheEntry *prev;
+    struct QueryCacheEntry *next;
+} QueryCacheEntry;
+
+static struct
+{
+    size_t capacity;
+    RedisModuleDict *entries;
+    size_t count;
+    QueryCacheEntry *head;
+    QueryCacheEntry *tail;
+    long long hits;
+    long long misses;
+} queryCache;
+
+void QueryCache_Init(size_t capacity) {
+    queryCache.capacity = capacity;
+    if (capacity > 0) {
+        queryCache.entries = RedisModule_CreateDict(NULL);
+    }
+}
+
+bool QueryCache_IsEnabled() {
+    return queryCache.capacity > 0;
+}
+
+RedisModuleString *QueryCache_Key(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModuleString *key =
+        RedisModule_CreateStringPrintf(ctx, "%d", RedisModule_GetSelectedDb(ctx));
+    bool filters = false;
+    for (int i = 0; i < argc; i++) {
+        size_t len;
+        const char *arg = RedisModule_StringPtrLen(argv[i], &len);
+        filters |= strcasecmp(arg, "FILTER") == 0;
+        // arguments are length prefixed, so that no two queries share a key
+        char prefix[24];
+        int prefixLen = snprintf(prefix, sizeof(prefix), ":%zu:", len);
+        RedisModule_StringAppendBuffer(ctx, key, prefix, prefixLen);
+        if (filters) {
+            RedisModule_StringAppendBuffer(ctx, key, arg, len);
+            continue;
+        }
+        char lower[len + 1];
+        for (size_t j = 0; j < len; j++) {
+            lower[j] = tolower((unsigned char)arg[j]);
+        }
+        RedisModule_StringAppendBuffer(ctx, key, lower, len);
+    }
+    return key;
+}
+
+static void unlinkEntry(QueryCacheEntry *entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        queryCache.head = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        queryCache.tail = entry->prev;
+    }
+}
+
+static void pushEntry(QueryCacheEntry *entry) {
+    entry->prev = NULL;
+    entry->next = queryCache.head;
+    if (queryCache.head != NULL) {
+        queryCache.head->prev = entry;
+    } else {
+        queryCache.tail = entry;
+    }
+    queryCache.head = entry;
+}
+
+static void dropEntry(QueryCacheEntry *entry) {
+    unlinkEntry(entry);
+    RedisModule_DictDel(queryCache.entries, entry->key, NULL);
+    queryCache.count--;
+    entry->freeValue(entry->value);
+    RedisModule_FreeString(NULL, entry->key);
+    free(entry);
+}
+
+void *QueryCache_Get(RedisModuleString *key) {
+    QueryCacheEntry *entry = RedisModule_DictGet(queryCache.entries, key, NULL);
+    if (entry != NULL && entry->indexVersion != IndexVersion()) {
+        dropEntry(entry);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        queryCache.misses++;
+        return NULL;
+    }
+    queryCache.hits++;
+    unlinkEntry(entry);
+    pushEntry(entry);
+    return entry->value;
+}
+
+void QueryCache_Put(RedisModuleString *key,
+                    uint64_t indexVersion,
+                    void *value,
+                    QueryCacheFreeFunc freeValue) {
+    QueryCacheEntry *entry = RedisModule_DictGet(queryCache.entries, key, NULL);
+    if (entry != NULL) {
+        dropEntry(entry);
+    } else if (queryCache.count == queryCache.capacity) {
+        dropEntry(queryCache.tail);
+    }
+    entry = malloc(sizeof(QueryCacheEntry));
+    entry->key = RedisModule_CreateStringFromString(NULL, key);
+    entry->indexVersion = indexVersion;
+    entry->value = value;
+    entry->freeValue = freeValue;
+    RedisModule_DictSet(queryCache.entries, entry->key, entry);
+    queryCache.count++;
+    pushEntry(entry);
+}
+
+void QueryCache_Stats(long long *entries, long long *hits, long long *misses) {
+    *entries = queryCache.count;
+    *hits = queryCache.hits;
+    *misses = queryCache.misses;
+}
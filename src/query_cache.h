@@ -0,0 +1,39 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef QUERY_CACHE_H
+#define QUERY_CACHE_H
+
+#include "redismodule.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * LRU cache of the results of TS.MRANGE and TS.MGET, keyed by the normalized query, see
+ * QUERY_CACHE. An entry is dropped once the label index changed since its query ran, as the
+ * matching series may have changed. The cached values check the versions of their series
+ * themselves. The cache is only used on the main thread.
+ */
+typedef void (*QueryCacheFreeFunc)(void *value);
+
+// A capacity of 0 disables the cache
+void QueryCache_Init(size_t capacity);
+bool QueryCache_IsEnabled();
+/*
+ * The key of a query in the selected database: the command and the arguments before FILTER are
+ * case insensitive, the filters and what follows them are kept as given. Owned by ctx.
+ */
+RedisModuleString *QueryCache_Key(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
+// Returns NULL on a miss, the value stays owned by the cache
+void *QueryCache_Get(RedisModuleString *key);
+// Caches the result of a query that ran at `indexVersion`, replacing the one of the same key
+void QueryCache_Put(RedisModuleString *key,
+                    uint64_t indexVersion,
+                    void *value,
+                    QueryCacheFreeFunc freeValue);
+void QueryCache_Stats(long long *entries, long long *hits, long long *misses);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "query_cursor.h"
+
+#include "rmutil/alloc.h"
+
+static QueryCursor *cursors[QUERY_CURSOR_MAX];
+static size_t cursorsCount;
+static long long nextCursorId = 1;
+
+QueryCursor *QueryCursor_New(RedisModuleString **keys, size_t count) {
+    QueryCursor *cursor = malloc(sizeof(QueryCursor));
+    cursor->id = 0;
+    cursor->keys = malloc(sizeof(RedisModuleString *) * count);
+    for (size_t i = 0; i < count; i++) {
+        cursor->keys[i] = RedisModule_CreateStringFromString(NULL, keys[i]);
+    }
+    cursor->count = count;
+    cursor->pos = 0;
+    return cursor;
+}
+
+static void removeCursor(size_t i) {
+    cursors[i] = cursors[--cursorsCount];
+}
+
+static void dropExpired(mstime_t now) {
+    for (size_t i = 0; i < cursorsCount;) {
+        if (now - cursors[i]->lastUsed >= QUERY_CURSOR_IDLE_MS) {
+            QueryCursor_Free(cursors[i]);
+            removeCursor(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+long long QueryCursor_Store(QueryCursor *cursor) {
+    mstime_t now = RedisModule_Milliseconds();
+    dropExpired(now);
+    if (cursorsCount == QUERY_CURSOR_MAX) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < cursorsCount; i++) {
+            if (cursors[i]->lastUsed < cursors[oldest]->lastUsed) {
+                oldest = i;
+            }
+        }
+        QueryCursor_Free(cursors[oldest]);
+        removeCursor(oldest);
+    }
+    cursor->id = nextCursorId++;
+    cursor->lastUsed = now;
+    cursors[cursorsCount++] = cursor;
+    return cursor->id;
+}
+
+QueryCursor *QueryCursor_Take(long long id) {
+    dropExpired(RedisModule_Milliseconds());
+    for (size_t i = 0; i < cursorsCount; i++) {
+        if (cursors[i]->id == id) {
+            QueryCursor *cursor = cursors[i];
+            removeCursor(i);
+            return cursor;
+        }
+    }
+    return NULL;
+}
+
+void QueryCursor_Advance(QueryCursor *cursor, size_t count) {
+    for (size_t i = cursor->pos; i < cursor->pos + count; i++) {
+        RedisModule_FreeString(NULL, cursor->keys[i]);
+        cursor->keys[i] = NULL;
+    }
+    cursor->pos += count;
+}
+
+void QueryCursor_Free(QueryCursor *cursor) {
+    for (size_t i = cursor->pos; i < cursor->count; i++) {
+        RedisModule_FreeString(NULL, cursor->keys[i]);
+    }
+    free(cursor->keys);
+    free(cursor);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef QUERY_CURSOR_H
+#define QUERY_CURSOR_H
+
+#include "redismodule.h"
+
+#include <stddef.h>
+
+/*
+ * The keys of a QueryIndex result left to reply to by a paged TS.MRANGE, see CURSOR. Cursors are
+ * only used on the main thread. A cursor idle for QUERY_CURSOR_IDLE_MS is dropped, and so is the
+ * oldest one once QUERY_CURSOR_MAX are open.
+ */
+#define QUERY_CURSOR_IDLE_MS (5 * 60 * 1000)
+#define QUERY_CURSOR_MAX 1024
+
+typedef struct QueryCursor
+{
+    long long id;
+    RedisModuleString **keys;
+    size_t count;
+    // the next key to reply to
+    size_t pos;
+    mstime_t lastUsed;
+} QueryCursor;
+
+// A cursor over copies of `keys`
+QueryCursor *QueryCursor_New(RedisModuleString **keys, size_t count);
+// Keeps the cursor for the next page under a new id, which is returned
+long long QueryCursor_Store(QueryCursor *cursor);
+// Removes a stored cursor, returns NULL if it is unknown or expired
+QueryCursor *QueryCursor_Take(long long id);
+// Frees the keys before the position, they were replied to
+void QueryCursor_Advance(QueryCursor *cursor, size_t count);
+void QueryCursor_Free(QueryCursor *cursor);
+
+#endif
@@ -10,15 +10,15 @@
 
 #include <string.h>
 #include <rmutil/alloc.h>
+#include <rmutil/util.h>
 
 void *series_rdb_load(RedisModuleIO *io, int encver) {
-    if (encver < TS_ENC_VER && encver > TS_SIZE_RDB_VER) {
+    if (encver < TS_ENC_VER || encver > TS_LATEST_ENCVER) {
         RedisModule_LogIOError(io, "error", "data is not in the correct encoding");
         return NULL;
     }
     double lastValue;
     timestamp_t lastTimestamp;
-    uint64_t totalSamples;
     RedisModuleString *srcKey = NULL;
 
     CreateCtx cCtx = { 0 };
@@ -34,11 +34,17 @@ void *series_rdb_load(RedisModuleIO *io, int encver) {
     } else {
         cCtx.options |= SERIES_OPT_UNCOMPRESSED;
     }
+    if (encver >= TS_CHUNK_TIME_WINDOW_VER) {
+        cCtx.chunkTimeWindow = RedisModule_LoadUnsigned(io);
+    }
+    if (encver >= TS_SIGNIFICANT_DIGITS_VER) {
+        cCtx.significantDigits = RedisModule_LoadUnsigned(io);
+    }
 
     if (encver >= TS_SIZE_RDB_VER) {
         lastTimestamp = RedisModule_LoadUnsigned(io);
         lastValue = RedisModule_LoadDouble(io);
-        totalSamples = RedisModule_LoadUnsigned(io);
+        RedisModule_LoadUnsigned(io); // the total of samples, counted again from the chunks
         uint64_t hasSrcKey = RedisModule_LoadUnsigned(io);
         if (hasSrcKey) {
             srcKey = RedisModule_LoadString(io);
@@ -54,6 +60,8 @@ void *series_rdb_load(RedisModuleIO *io, int encver) {
 
     uint64_t rulesCount = RedisModule_LoadUnsigned(io);
 
+    // the saved chunks replace the default one
+    cCtx.skipChunkCreation = encver >= TS_SIZE_RDB_VER;
     Series *series = NewSeries(keyName, &cCtx);
 
     CompactionRule *lastRule = NULL;
@@ -88,27 +96,29 @@ void *series_rdb_load(RedisModuleIO *io, int encver) {
         }
     } else {
         Chunk_t *chunk = NULL;
-        // Free the default allocated chunk given LoadFromRDB will allocate a proper sized chunk
-        timestamp_t rax_key = htonu64(0);
-        chunk = (Chunk_t *)RedisModule_DictGetC(series->chunks, &rax_key, sizeof(rax_key), NULL);
-        if (chunk != NULL) {
-            series->funcs->FreeChunk(chunk);
-        }
-        dictOperator(series->chunks, NULL, 0, DICT_OP_DEL);
         uint64_t numChunks = RedisModule_LoadUnsigned(io);
         for (int i = 0; i < numChunks; ++i) {
-            series->funcs->LoadFromRDB(&chunk, io);
-            dictOperator(
-                series->chunks, chunk, series->funcs->GetFirstTimestamp(chunk), DICT_OP_SET);
+            series->funcs->LoadFromRDB(&chunk, io, encver);
+            SeriesAddChunk(series, series->funcs->GetFirstTimestamp(chunk), chunk);
+        }
+        if (chunk == NULL) {
+            chunk = series->funcs->NewChunk(series->chunkSizeBytes);
+            SeriesAddChunk(series, 0, chunk);
         }
-        series->totalSamples = totalSamples;
         series->srcKey = srcKey;
         series->lastTimestamp = lastTimestamp;
         series->lastValue = lastValue;
         series->lastChunk = chunk;
     }
 
-    IndexMetric(ctx, keyName, series->labels, series->labelsCount);
+    if (RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_LOADING) {
+        // indexed with all the other loaded series once loading ends
+        SeriesQueueIndexing(series);
+    } else {
+        IndexMetric(ctx, keyName, series, series->labels, series->labelsCount);
+    }
+    // the samples may have expired while the series was saved
+    SeriesScheduleTrim(series);
     return series;
 }
 
@@ -124,10 +134,13 @@ unsigned int countRules(Series *series) {
 
 void series_rdb_save(RedisModuleIO *io, void *value) {
     Series *series = value;
+    SeriesFlushPendingSamples(series);
     RedisModule_SaveString(io, series->keyName);
     RedisModule_SaveUnsigned(io, series->retentionTime);
     RedisModule_SaveUnsigned(io, series->chunkSizeBytes);
     RedisModule_SaveUnsigned(io, series->options);
+    RedisModule_SaveUnsigned(io, series->chunkTimeWindow);
+    RedisModule_SaveUnsigned(io, series->significantDigits);
     RedisModule_SaveUnsigned(io, series->lastTimestamp);
     RedisModule_SaveDouble(io, series->lastValue);
     RedisModule_SaveUnsigned(io, series->totalSamples);
@@ -156,13 +169,204 @@ void series_rdb_save(RedisModuleIO *io, void *value) {
         rule = rule->nextRule;
     }
 
-    Chunk_t *chunk;
-    uint64_t numChunks = RedisModule_DictSize(series->chunks);
+    uint64_t numChunks = ChunkDir_Count(&series->chunks);
+    RedisModule_SaveUnsigned(io, numChunks);
+    for (size_t i = 0; i < numChunks; i++) {
+        series->funcs->SaveToRDB(ChunkDir_Get(&series->chunks, i), io);
+    }
+}
+
+// Samples per TS.ADDBULK call of an AOF rewrite
+#define AOF_REWRITE_BATCH_SIZE 4096
+// A sample in the DELTA format of TS.ADDBULK: a varint of up to 10 bytes and the value
+#define DELTA_SAMPLE_MAX_BYTES (10 + sizeof(double))
+
+static const char *seriesEncoding(const Series *series) {
+    if (series->options & SERIES_OPT_UNCOMPRESSED) {
+        return "UNCOMPRESSED";
+    } else if (series->options & SERIES_OPT_DECIMAL) {
+        return "DECIMAL";
+    }
+    return "COMPRESSED";
+}
+
+static void emitCreate(RedisModuleIO *aof, RedisModuleString *key, Series *series) {
+    size_t argc = 0;
+    RedisModuleString **argv = malloc((14 + series->labelsCount * 2) * sizeof(*argv));
+    argv[argc++] = key;
+    argv[argc++] = RedisModule_CreateString(NULL, "RETENTION", strlen("RETENTION"));
+    argv[argc++] = RedisModule_CreateStringFromLongLong(NULL, series->retentionTime);
+    argv[argc++] = RedisModule_CreateString(NULL, "CHUNK_SIZE", strlen("CHUNK_SIZE"));
+    if (series->options & SERIES_OPT_ADAPTIVE_CHUNK_SIZE) {
+        argv[argc++] = RedisModule_CreateString(NULL, "ADAPTIVE", strlen("ADAPTIVE"));
+    } else {
+        argv[argc++] = RedisModule_CreateStringFromLongLong(NULL, series->chunkSizeBytes);
+    }
+    if (series->chunkTimeWindow > 0) {
+        argv[argc++] =
+            RedisModule_CreateString(NULL, "CHUNK_TIME_WINDOW", strlen("CHUNK_TIME_WINDOW"));
+        argv[argc++] = RedisModule_CreateStringFromLongLong(NULL, series->chunkTimeWindow);
+    }
+    if (series->significantDigits > 0) {
+        argv[argc++] =
+            RedisModule_CreateString(NULL, "SIGNIFICANT_DIGITS", strlen("SIGNIFICANT_DIGITS"));
+        argv[argc++] = RedisModule_CreateStringFromLongLong(NULL, series->significantDigits);
+    }
+    const char *encoding = seriesEncoding(series);
+    argv[argc++] = RedisModule_CreateString(NULL, "ENCODING", strlen("ENCODING"));
+    argv[argc++] = RedisModule_CreateString(NULL, encoding, strlen(encoding));
+    if (series->duplicatePolicy != DP_NONE) {
+        const char *policy = DuplicatePolicyToString(series->duplicatePolicy);
+        argv[argc++] =
+            RedisModule_CreateString(NULL, DUPLICATE_POLICY_ARG, strlen(DUPLICATE_POLICY_ARG));
+        argv[argc++] = RedisModule_CreateString(NULL, policy, strlen(policy));
+    }
+    argv[argc++] = RedisModule_CreateString(NULL, "LABELS", strlen("LABELS"));
+    // the strings before the labels were created here
+    size_t created = argc;
+    for (size_t i = 0; i < series->labelsCount; i++) {
+        argv[argc++] = series->labels[i].key;
+        argv[argc++] = series->labels[i].value;
+    }
+
+    RedisModule_EmitAOF(aof, "TS.CREATE", "v", argv, argc);
+    for (size_t i = 1; i < created; i++) {
+        RedisModule_FreeString(NULL, argv[i]);
+    }
+    free(argv);
+}
+
+// Writes one sample in the DELTA format of TS.ADDBULK, returns the bytes written
+static size_t encodeDeltaSample(unsigned char *buf,
+                                timestamp_t prev,
+                                timestamp_t ts,
+                                double value) {
+    int64_t delta = (int64_t)(ts - prev);
+    u_int64_t zigzag = ((u_int64_t)delta << 1) ^ (u_int64_t)(delta >> 63);
+    size_t len = 0;
+    while (zigzag >= 0x80) {
+        buf[len++] = (unsigned char)(zigzag | 0x80);
+        zigzag >>= 7;
+    }
+    buf[len++] = (unsigned char)zigzag;
+
+    u_int64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    memrev64ifbe(&bits);
+    memcpy(buf + len, &bits, sizeof(bits));
+    return len + sizeof(bits);
+}
+
+/*
+ * Rewrites a series as TS.CREATE followed by TS.ADDBULK calls carrying the samples in the binary
+ * DELTA format, so no sample is formatted or parsed as text. Replaying the samples would run the
+ * compaction rules again and lose the partial buckets, so series with rules or a source series
+ * are rewritten with DUMP and RESTORE.
+ */
+void series_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
+    Series *series = value;
+    if (series->rules != NULL || series->srcKey != NULL) {
+        RMUtil_DefaultAofRewrite(aof, key, value);
+        return;
+    }
+
+    SeriesFlushPendingSamples(series);
+    emitCreate(aof, key, series);
+
+    timestamp_t *timestamps = malloc(AOF_REWRITE_BATCH_SIZE * sizeof(timestamp_t));
+    double *values = malloc(AOF_REWRITE_BATCH_SIZE * sizeof(double));
+    unsigned char *buf = malloc(AOF_REWRITE_BATCH_SIZE * DELTA_SAMPLE_MAX_BYTES);
+    SeriesIterator iter = SeriesQuery(series, 0, series->lastTimestamp, false);
+    size_t count;
+    while ((count = SeriesIteratorGetNextBatch(&iter, timestamps, values, AOF_REWRITE_BATCH_SIZE)) >
+           0) {
+        size_t len = 0;
+        timestamp_t prev = 0;
+        for (size_t i = 0; i < count; i++) {
+            len += encodeDeltaSample(buf + len, prev, timestamps[i], values[i]);
+            prev = timestamps[i];
+        }
+        RedisModule_EmitAOF(aof, "TS.ADDBULK", "sccb", key, "FORMAT", "DELTA", buf, len);
+    }
+    SeriesIteratorClose(&iter);
+    free(buf);
+    free(values);
+    free(timestamps);
+}
+
+void *wide_rdb_load(RedisModuleIO *io, int encver) {
+    if (encver < WIDE_ENC_VER || encver > WIDE_LATEST_ENCVER) {
+        RedisModule_LogIOError(io, "error", "data is not in the correct encoding");
+        return NULL;
+    }
+    size_t fieldsCount = RedisModule_LoadUnsigned(io);
+    if (fieldsCount == 0 || fieldsCount > WIDE_FIELDS_MAX) {
+        RedisModule_LogIOError(io, "error", "wide series with %zu fields", fieldsCount);
+        return NULL;
+    }
+    RedisModuleString **fields = malloc(fieldsCount * sizeof(RedisModuleString *));
+    for (size_t i = 0; i < fieldsCount; ++i) {
+        fields[i] = RedisModule_LoadString(io);
+    }
+    u_int64_t retentionTime = RedisModule_LoadUnsigned(io);
+    size_t chunkSizeBytes = RedisModule_LoadUnsigned(io);
+    WideSeries *series = NewWideSeries(fields, fieldsCount, retentionTime, chunkSizeBytes);
+
+    uint64_t numChunks = RedisModule_LoadUnsigned(io);
+    for (uint64_t i = 0; i < numChunks; ++i) {
+        WideChunk *chunk = WideChunk_New(fieldsCount, RedisModule_LoadUnsigned(io));
+        chunk->count = RedisModule_LoadUnsigned(io);
+        chunk->idx = RedisModule_LoadUnsigned(io);
+        chunk->baseTimestamp = RedisModule_LoadUnsigned(io);
+        chunk->prevTimestamp = RedisModule_LoadUnsigned(io);
+        chunk->prevTimestampDelta = RedisModule_LoadSigned(io);
+        for (size_t f = 0; f < fieldsCount; ++f) {
+            chunk->fields[f].prevValue.u = RedisModule_LoadUnsigned(io);
+            chunk->fields[f].prevLeading = RedisModule_LoadUnsigned(io);
+            chunk->fields[f].prevTrailing = RedisModule_LoadUnsigned(io);
+        }
+        // only the words holding rows are saved
+        size_t len;
+        char *data = RedisModule_LoadStringBuffer(io, &len);
+        if (len > chunk->size || chunk->idx > (u_int64_t)len * 8) {
+            RedisModule_LogIOError(io, "error", "wide chunk data is corrupted");
+            RedisModule_Free(data);
+            WideChunk_Free(chunk);
+            FreeWideSeries(series);
+            return NULL;
+        }
+        memcpy(chunk->data, data, len);
+        RedisModule_Free(data);
+        WideSeriesAddChunk(series, chunk);
+    }
+    return series;
+}
+
+void wide_rdb_save(RedisModuleIO *io, void *value) {
+    WideSeries *series = value;
+    RedisModule_SaveUnsigned(io, series->fieldsCount);
+    for (size_t i = 0; i < series->fieldsCount; ++i) {
+        RedisModule_SaveString(io, series->fields[i]);
+    }
+    RedisModule_SaveUnsigned(io, series->retentionTime);
+    RedisModule_SaveUnsigned(io, series->chunkSizeBytes);
+
+    uint64_t numChunks = ChunkDir_Count(&series->chunks);
     RedisModule_SaveUnsigned(io, numChunks);
-    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(series->chunks, "^", NULL, 0);
-    while (RedisModule_DictNextC(iter, NULL, &chunk)) {
-        series->funcs->SaveToRDB(chunk, io);
-        numChunks--;
+    for (size_t i = 0; i < numChunks; ++i) {
+        WideChunk *chunk = ChunkDir_Get(&series->chunks, i);
+        RedisModule_SaveUnsigned(io, chunk->size);
+        RedisModule_SaveUnsigned(io, chunk->count);
+        RedisModule_SaveUnsigned(io, chunk->idx);
+        RedisModule_SaveUnsigned(io, chunk->baseTimestamp);
+        RedisModule_SaveUnsigned(io, chunk->prevTimestamp);
+        RedisModule_SaveSigned(io, chunk->prevTimestampDelta);
+        for (size_t f = 0; f < series->fieldsCount; ++f) {
+            RedisModule_SaveUnsigned(io, chunk->fields[f].prevValue.u);
+            RedisModule_SaveUnsigned(io, chunk->fields[f].prevLeading);
+            RedisModule_SaveUnsigned(io, chunk->fields[f].prevTrailing);
+        }
+        RedisModule_SaveStringBuffer(
+            io, (char *)chunk->data, (chunk->idx + 63) / 64 * sizeof(u_int64_t));
     }
-    RedisModule_DictIteratorStop(iter);
 }
@@ -5,6 +5,7 @@
  */
 #include "redismodule.h"
 #include "tsdb.h"
+#include "wide_series.h"
 
 #ifndef RDB_H
 #define RDB_H
@@ -12,8 +13,21 @@
 #define TS_ENC_VER 0
 #define TS_UNCOMPRESSED_VER 1
 #define TS_SIZE_RDB_VER 2
+#define TS_REGULAR_RUN_VER 3 // compressed chunks save regularCount
+#define TS_DECIMAL_VER 4 // compressed chunks save their value encoding
+#define TS_PACKED_CHUNKS_VER 5 // chunk headers are saved as one buffer, checkpoints are saved
+#define TS_CHUNK_TIME_WINDOW_VER 6 // series save their chunk time window
+#define TS_SIGNIFICANT_DIGITS_VER 7 // series save their significant digits
+#define TS_LATEST_ENCVER TS_SIGNIFICANT_DIGITS_VER
+
+#define WIDE_ENC_VER 0
+#define WIDE_LATEST_ENCVER WIDE_ENC_VER
 
 void *series_rdb_load(RedisModuleIO *io, int encver);
 void series_rdb_save(RedisModuleIO *io, void *value);
+void series_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key, void *value);
+
+void *wide_rdb_load(RedisModuleIO *io, int encver);
+void wide_rdb_save(RedisModuleIO *io, void *value);
 
 #endif
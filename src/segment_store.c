@@ -0,0 +1,148 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "segment_store.h"
+
+#include "consts.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "rmutil/alloc.h"
+
+// buffers are aligned for the words chunks are read by
+#define BUFFER_ALIGNMENT 8
+
+typedef struct Segment
+{
+    char *base;
+    size_t used;
+    size_t live;
+} Segment;
+
+static struct
+{
+    pthread_mutex_t lock;
+    char *dir;
+    // the last segment is the one appended to
+    Segment *segments;
+    size_t segmentsCount;
+    size_t liveBytes;
+} segmentStore = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static bool openSegment(Segment *segment) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/redistimeseries-%d-XXXXXX", segmentStore.dir, (int)getpid());
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return false;
+    }
+    unlink(path);
+
+    // reserve the blocks up front, writing to the mapping of a file the disk has no room for
+    // would raise SIGBUS
+#ifdef __APPLE__
+    int reserved = ftruncate(fd, SEGMENT_STORE_SEGMENT_SIZE);
+#else
+    int reserved = posix_fallocate(fd, 0, SEGMENT_STORE_SEGMENT_SIZE);
+#endif
+    void *base = MAP_FAILED;
+    if (reserved == 0) {
+        base = mmap(NULL, SEGMENT_STORE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    segment->base = base;
+    segment->used = 0;
+    segment->live = 0;
+    return true;
+}
+
+int SegmentStore_Init(const char *dir) {
+    segmentStore.dir = strdup(dir);
+    Segment segment;
+    if (!openSegment(&segment)) {
+        free(segmentStore.dir);
+        segmentStore.dir = NULL;
+        return TSDB_ERROR;
+    }
+    segmentStore.segments = malloc(sizeof(Segment));
+    segmentStore.segments[0] = segment;
+    segmentStore.segmentsCount = 1;
+    return TSDB_OK;
+}
+
+bool SegmentStore_Enabled() {
+    return segmentStore.dir != NULL;
+}
+
+void *SegmentStore_Append(const void *buffer, size_t size) {
+    size_t alignedSize = (size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+    if (!SegmentStore_Enabled() || alignedSize > SEGMENT_STORE_SEGMENT_SIZE) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&segmentStore.lock);
+    Segment *segment = &segmentStore.segments[segmentStore.segmentsCount - 1];
+    if (segment->used + alignedSize > SEGMENT_STORE_SEGMENT_SIZE) {
+        Segment newSegment;
+        if (!openSegment(&newSegment)) {
+            pthread_mutex_unlock(&segmentStore.lock);
+            return NULL;
+        }
+        // the full segment goes once its last buffer is released
+        if (segment->live == 0) {
+            munmap(segment->base, SEGMENT_STORE_SEGMENT_SIZE);
+            segmentStore.segmentsCount--;
+        }
+        segmentStore.segments = realloc(
+            segmentStore.segments, (segmentStore.segmentsCount + 1) * sizeof(Segment));
+        segmentStore.segments[segmentStore.segmentsCount++] = newSegment;
+        segment = &segmentStore.segments[segmentStore.segmentsCount - 1];
+    }
+
+    char *stored = segment->base + segment->used;
+    memcpy(stored, buffer, size);
+    segment->used += alignedSize;
+    segment->live += alignedSize;
+    segmentStore.liveBytes += alignedSize;
+    pthread_mutex_unlock(&segmentStore.lock);
+    return stored;
+}
+
+void SegmentStore_Release(void *buffer, size_t size) {
+    size_t alignedSize = (size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+    char *address = buffer;
+
+    pthread_mutex_lock(&segmentStore.lock);
+    for (size_t i = 0; i < segmentStore.segmentsCount; i++) {
+        Segment *segment = &segmentStore.segments[i];
+        if (address < segment->base || address >= segment->base + SEGMENT_STORE_SEGMENT_SIZE) {
+            continue;
+        }
+        segment->live -= alignedSize;
+        segmentStore.liveBytes -= alignedSize;
+        if (segment->live == 0 && i + 1 < segmentStore.segmentsCount) {
+            munmap(segment->base, SEGMENT_STORE_SEGMENT_SIZE);
+            memmove(segment, segment + 1, (segmentStore.segmentsCount - i - 1) * sizeof(Segment));
+            segmentStore.segmentsCount--;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&segmentStore.lock);
+}
+
+size_t SegmentStore_LiveBytes() {
+    pthread_mutex_lock(&segmentStore.lock);
+    size_t liveBytes = segmentStore.liveBytes;
+    pthread_mutex_unlock(&segmentStore.lock);
+    return liveBytes;
+}
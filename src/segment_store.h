@@ -0,0 +1,36 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef SEGMENT_STORE_H
+#define SEGMENT_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Storage for the samples of the chunks offloaded from memory. Buffers are appended to segment
+ * files of SEGMENT_STORE_SEGMENT_SIZE bytes, which are mapped in memory: once written back to the
+ * file, their pages are reclaimed by the kernel under memory pressure and read again on access.
+ *
+ * The files are removed as soon as they are created, their content lasts as long as the process
+ * (chunks are saved to RDB from the mapping, and loaded back in memory). A segment is unmapped
+ * once all the buffers appended to it were released, except the one being appended to.
+ * The store is thread safe, chunks may be freed on a background thread.
+ */
+#define SEGMENT_STORE_SEGMENT_SIZE (64 * 1024 * 1024)
+
+// Returns TSDB_ERROR if segment files can't be created in `dir`
+int SegmentStore_Init(const char *dir);
+bool SegmentStore_Enabled();
+
+// Returns the stored copy of `buffer`, or NULL if it can't be stored. The copy is read only.
+void *SegmentStore_Append(const void *buffer, size_t size);
+// `size` must be the size the buffer was appended with
+void SegmentStore_Release(void *buffer, size_t size);
+
+// Bytes of the buffers stored and not released
+size_t SegmentStore_LiveBytes();
+
+#endif
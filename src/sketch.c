@@ -0,0 +1,244 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "sketch.h"
+
+#include "consts.h"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include "rmutil/alloc.h"
+
+// bucket i holds the magnitudes in (gamma^(i-1), gamma^i]
+#define SKETCH_GAMMA ((1 + SKETCH_RELATIVE_ACCURACY) / (1 - SKETCH_RELATIVE_ACCURACY))
+
+static inline int32_t sketchIndex(double magnitude) {
+    if (magnitude > DBL_MAX) {
+        magnitude = DBL_MAX;
+    }
+    return (int32_t)ceil(log(magnitude) / log(SKETCH_GAMMA));
+}
+
+// the value of a bucket within the relative accuracy of all its magnitudes
+static inline double sketchValue(int32_t index) {
+    return 2 * exp(index * log(SKETCH_GAMMA)) / (SKETCH_GAMMA + 1);
+}
+
+static void storeInit(SketchStore *store) {
+    store->offset = 0;
+    store->size = 0;
+    store->capacity = 0;
+    store->bins = NULL;
+}
+
+static void storeReserve(SketchStore *store, uint32_t size) {
+    if (size <= store->capacity) {
+        return;
+    }
+    uint32_t capacity = store->capacity > 0 ? store->capacity : 16;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    store->capacity = capacity < SKETCH_MAX_BINS ? capacity : SKETCH_MAX_BINS;
+    store->bins = realloc(store->bins, store->capacity * sizeof(uint64_t));
+}
+
+static void storeAdd(SketchStore *store, int32_t index, uint64_t count) {
+    if (store->size == 0) {
+        storeReserve(store, 1);
+        store->offset = index;
+        store->size = 1;
+        store->bins[0] = count;
+        return;
+    }
+    int64_t low = index < store->offset ? index : store->offset;
+    int64_t high = (int64_t)store->offset + store->size - 1;
+    high = index > high ? index : high;
+    if (high - low + 1 > SKETCH_MAX_BINS) {
+        // the smallest magnitudes are merged into the lowest bucket kept
+        low = high - SKETCH_MAX_BINS + 1;
+        index = index < low ? low : index;
+    }
+
+    uint64_t collapsed = 0;
+    if (low > store->offset) {
+        uint32_t merged = low - store->offset < store->size ? low - store->offset : store->size;
+        for (uint32_t i = 0; i < merged; ++i) {
+            collapsed += store->bins[i];
+        }
+        store->size -= merged;
+        memmove(store->bins, store->bins + merged, store->size * sizeof(uint64_t));
+        store->offset = low;
+    }
+    uint32_t size = high - low + 1;
+    storeReserve(store, size);
+    uint32_t shift = store->offset - low;
+    memmove(store->bins + shift, store->bins, store->size * sizeof(uint64_t));
+    memset(store->bins, 0, shift * sizeof(uint64_t));
+    memset(store->bins + shift + store->size, 0, (size - shift - store->size) * sizeof(uint64_t));
+    store->offset = low;
+    store->size = size;
+    store->bins[0] += collapsed;
+    store->bins[index - low] += count;
+}
+
+static int storeRemove(SketchStore *store, int32_t index) {
+    if (index < store->offset || index - store->offset >= (int64_t)store->size ||
+        store->bins[index - store->offset] == 0) {
+        return TSDB_ERROR;
+    }
+    store->bins[index - store->offset]--;
+    return TSDB_OK;
+}
+
+static void storeMerge(SketchStore *store, const SketchStore *other) {
+    if (other->size == 0) {
+        return;
+    }
+    // sizes the store once for the whole range
+    storeAdd(store, other->offset, 0);
+    storeAdd(store, other->offset + other->size - 1, 0);
+    for (uint32_t i = 0; i < other->size; ++i) {
+        if (other->bins[i] > 0) {
+            storeAdd(store, other->offset + i, other->bins[i]);
+        }
+    }
+}
+
+uint64_t *SketchStore_Reserve(SketchStore *store, int32_t offset, uint32_t size) {
+    storeReserve(store, size);
+    store->offset = offset;
+    store->size = size;
+    return store->bins;
+}
+
+void QuantileSketch_Init(QuantileSketch *sketch) {
+    storeInit(&sketch->positive);
+    storeInit(&sketch->negative);
+    QuantileSketch_Reset(sketch);
+}
+
+void QuantileSketch_Free(QuantileSketch *sketch) {
+    free(sketch->positive.bins);
+    free(sketch->negative.bins);
+    QuantileSketch_Init(sketch);
+}
+
+void QuantileSketch_Reset(QuantileSketch *sketch) {
+    sketch->positive.size = 0;
+    sketch->negative.size = 0;
+    sketch->zeros = 0;
+    sketch->count = 0;
+    sketch->min = 0;
+    sketch->max = 0;
+}
+
+void QuantileSketch_Add(QuantileSketch *sketch, double value) {
+    if (isnan(value)) {
+        return;
+    }
+    if (sketch->count == 0 || value < sketch->min) {
+        sketch->min = value;
+    }
+    if (sketch->count == 0 || value > sketch->max) {
+        sketch->max = value;
+    }
+    sketch->count++;
+    double magnitude = fabs(value);
+    if (magnitude < SKETCH_MIN_VALUE) {
+        sketch->zeros++;
+    } else {
+        storeAdd(value > 0 ? &sketch->positive : &sketch->negative, sketchIndex(magnitude), 1);
+    }
+}
+
+int QuantileSketch_Remove(QuantileSketch *sketch, double value) {
+    if (isnan(value)) {
+        return TSDB_OK;
+    }
+    if (sketch->count == 0 || value < sketch->min || value > sketch->max) {
+        return TSDB_ERROR;
+    }
+    if (sketch->count == 1) {
+        QuantileSketch_Reset(sketch);
+        return TSDB_OK;
+    }
+    // the other extreme isn't known
+    if (value == sketch->min || value == sketch->max) {
+        return TSDB_ERROR;
+    }
+    double magnitude = fabs(value);
+    if (magnitude < SKETCH_MIN_VALUE) {
+        if (sketch->zeros == 0) {
+            return TSDB_ERROR;
+        }
+        sketch->zeros--;
+    } else if (storeRemove(value > 0 ? &sketch->positive : &sketch->negative,
+                           sketchIndex(magnitude)) != TSDB_OK) {
+        return TSDB_ERROR;
+    }
+    sketch->count--;
+    return TSDB_OK;
+}
+
+void QuantileSketch_Merge(QuantileSketch *sketch, const QuantileSketch *other) {
+    if (other->count == 0) {
+        return;
+    }
+    if (sketch->count == 0 || other->min < sketch->min) {
+        sketch->min = other->min;
+    }
+    if (sketch->count == 0 || other->max > sketch->max) {
+        sketch->max = other->max;
+    }
+    sketch->count += other->count;
+    sketch->zeros += other->zeros;
+    storeMerge(&sketch->positive, &other->positive);
+    storeMerge(&sketch->negative, &other->negative);
+}
+
+int QuantileSketch_Quantile(const QuantileSketch *sketch, double quantile, double *value) {
+    if (sketch->count == 0) {
+        return TSDB_ERROR;
+    }
+    if (quantile <= 0) {
+        *value = sketch->min;
+        return TSDB_OK;
+    }
+    if (quantile >= 1) {
+        *value = sketch->max;
+        return TSDB_OK;
+    }
+
+    double rank = quantile * (sketch->count - 1);
+    double result = sketch->max;
+    uint64_t seen = 0;
+    const SketchStore *negative = &sketch->negative, *positive = &sketch->positive;
+    bool found = false;
+    // from the most negative value up
+    for (int64_t i = (int64_t)negative->size - 1; i >= 0 && !found; --i) {
+        seen += negative->bins[i];
+        if (seen > rank) {
+            result = -sketchValue(negative->offset + i);
+            found = true;
+        }
+    }
+    if (!found && (seen += sketch->zeros) > rank) {
+        result = 0;
+        found = true;
+    }
+    for (uint32_t i = 0; i < positive->size && !found; ++i) {
+        seen += positive->bins[i];
+        if (seen > rank) {
+            result = sketchValue(positive->offset + i);
+            found = true;
+        }
+    }
+    // the bucket values may lie past the extremes, which are exact
+    result = result < sketch->min ? sketch->min : result;
+    *value = result > sketch->max ? sketch->max : result;
+    return TSDB_OK;
+}
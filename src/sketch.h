@@ -0,0 +1,56 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A mergeable quantile sketch, after DDSketch: values are counted in buckets of logarithmically
+ * growing width, so any quantile is answered within SKETCH_RELATIVE_ACCURACY of the value of that
+ * rank. Values whose magnitude is below SKETCH_MIN_VALUE are counted as zeros. A store keeps at
+ * most SKETCH_MAX_BINS buckets, the buckets of the smallest magnitudes are merged beyond that,
+ * which still covers more than 17 orders of magnitude.
+ */
+#define SKETCH_RELATIVE_ACCURACY 0.01
+#define SKETCH_MIN_VALUE 1e-9
+#define SKETCH_MAX_BINS 2048
+
+typedef struct SketchStore
+{
+    int32_t offset; // index of bins[0]
+    uint32_t size;
+    uint32_t capacity;
+    uint64_t *bins;
+} SketchStore;
+
+typedef struct QuantileSketch
+{
+    SketchStore positive;
+    SketchStore negative; // by the magnitude of the values
+    uint64_t zeros;
+    uint64_t count;
+    double min;
+    double max;
+} QuantileSketch;
+
+void QuantileSketch_Init(QuantileSketch *sketch);
+void QuantileSketch_Free(QuantileSketch *sketch);
+// Empties the sketch, keeping its memory
+void QuantileSketch_Reset(QuantileSketch *sketch);
+// NaN values are ignored
+void QuantileSketch_Add(QuantileSketch *sketch, double value);
+// Returns TSDB_ERROR when the value wasn't counted, or was the minimum or maximum of the sketch
+int QuantileSketch_Remove(QuantileSketch *sketch, double value);
+void QuantileSketch_Merge(QuantileSketch *sketch, const QuantileSketch *other);
+// `quantile` is within [0, 1], returns TSDB_ERROR for an empty sketch
+int QuantileSketch_Quantile(const QuantileSketch *sketch, double quantile, double *value);
+
+// Reserves room for `size` bins from `offset` in an empty store, for loading it back
+uint64_t *SketchStore_Reserve(SketchStore *store, int32_t offset, uint32_t size);
+
+#endif
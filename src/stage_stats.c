@@ -0,0 +1,96 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "stage_stats.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+static StageHistogram stages[STAGE_COUNT];
+static __thread StageProfile *profile;
+
+static const char *stageNames[STAGE_COUNT] = {
+    [STAGE_QUERY_INDEX] = "query_index",     [STAGE_KEY_LOOKUP] = "key_lookup",
+    [STAGE_SERIES_READ] = "series_read",     [STAGE_REPLY] = "reply",
+    [STAGE_ADD_SAMPLE] = "add_sample",       [STAGE_UPSERT_SAMPLE] = "upsert_sample",
+    [STAGE_COMPACTION] = "compaction",
+};
+
+const char *StageStats_Name(Stage stage) {
+    return stageNames[stage];
+}
+
+uint64_t StageStats_Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline bool stageIsSampled(Stage stage) {
+    return stage >= STAGE_ADD_SAMPLE;
+}
+
+uint64_t StageStats_Start(Stage stage) {
+    uint64_t calls = __atomic_fetch_add(&stages[stage].calls, 1, __ATOMIC_RELAXED);
+    if (profile == NULL && stageIsSampled(stage) && calls % STAGE_SAMPLING != 0) {
+        return 0;
+    }
+    return StageStats_Now();
+}
+
+void StageStats_End(Stage stage, uint64_t start) {
+    if (start == 0) {
+        return;
+    }
+    uint64_t ns = StageStats_Now() - start;
+    int bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+    bucket = bucket < STAGE_HISTOGRAM_BUCKETS ? bucket : STAGE_HISTOGRAM_BUCKETS - 1;
+    StageHistogram *histogram = &stages[stage];
+    __atomic_add_fetch(&histogram->timed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    if (profile != NULL) {
+        profile->calls[stage]++;
+        profile->ns[stage] += ns;
+    }
+}
+
+void StageStats_Get(Stage stage, StageHistogram *histogram) {
+    const StageHistogram *current = &stages[stage];
+    histogram->calls = __atomic_load_n(&current->calls, __ATOMIC_RELAXED);
+    histogram->timed = __atomic_load_n(&current->timed, __ATOMIC_RELAXED);
+    histogram->ns = __atomic_load_n(&current->ns, __ATOMIC_RELAXED);
+    for (int i = 0; i < STAGE_HISTOGRAM_BUCKETS; i++) {
+        histogram->buckets[i] = __atomic_load_n(&current->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t StageStats_Quantile(const StageHistogram *histogram, double quantile) {
+    uint64_t total = 0;
+    for (int i = 0; i < STAGE_HISTOGRAM_BUCKETS; i++) {
+        total += histogram->buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(quantile * (total - 1)), seen = 0;
+    for (int i = 0; i < STAGE_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > rank) {
+            return 1ULL << (i + 1);
+        }
+    }
+    return 1ULL << STAGE_HISTOGRAM_BUCKETS;
+}
+
+void StageStats_BeginProfile(StageProfile *current) {
+    memset(current, 0, sizeof(StageProfile));
+    profile = current;
+}
+
+void StageStats_EndProfile() {
+    profile = NULL;
+}
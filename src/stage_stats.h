@@ -0,0 +1,71 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef STAGE_STATS_H
+#define STAGE_STATS_H
+
+#include <stdint.h>
+
+/*
+ * Latency histograms of the stages of the queries and of the ingestion, see the stages section
+ * of INFO, and the breakdown of a single query with its PROFILE option. They are built in unless
+ * compiled with STAGE_STATS=0. An ingestion stage takes about as long as reading the clock, so
+ * only 1 in STAGE_SAMPLING of its calls is timed, unless profiling. The histograms are updated
+ * from any thread, a profile collects the stages of the thread that began it.
+ */
+#ifndef STAGE_STATS
+#define STAGE_STATS 1
+#endif
+#define STAGE_SAMPLING 64
+// bucket i counts the durations within [2^i, 2^(i+1)) nanoseconds, the last one the longer ones
+#define STAGE_HISTOGRAM_BUCKETS 40
+
+typedef enum
+{
+    STAGE_QUERY_INDEX,
+    STAGE_KEY_LOOKUP,
+    STAGE_SERIES_READ, // decoding and aggregating the chunks of a range
+    STAGE_REPLY,
+    STAGE_ADD_SAMPLE,
+    STAGE_UPSERT_SAMPLE,
+    STAGE_COMPACTION,
+    STAGE_COUNT
+} Stage;
+
+typedef struct StageHistogram
+{
+    uint64_t calls;
+    uint64_t timed; // the calls counted by the buckets
+    uint64_t ns;    // of the timed calls
+    uint64_t buckets[STAGE_HISTOGRAM_BUCKETS];
+} StageHistogram;
+
+typedef struct StageProfile
+{
+    uint64_t calls[STAGE_COUNT];
+    uint64_t ns[STAGE_COUNT];
+} StageProfile;
+
+#if STAGE_STATS
+// Returns the start of a timed call of the stage, 0 when it isn't timed
+uint64_t StageStats_Start(Stage stage);
+void StageStats_End(Stage stage, uint64_t start);
+#define STAGE_BEGIN(stage, start) uint64_t start = StageStats_Start(stage)
+#define STAGE_END(stage, start) StageStats_End(stage, start)
+#else
+#define STAGE_BEGIN(stage, start)
+#define STAGE_END(stage, start)
+#endif
+
+const char *StageStats_Name(Stage stage);
+uint64_t StageStats_Now();
+void StageStats_Get(Stage stage, StageHistogram *histogram);
+// The upper bound of the bucket of the quantile, 0 without timed calls
+uint64_t StageStats_Quantile(const StageHistogram *histogram, double quantile);
+// Times every call of the stages on this thread into `profile`, which is zeroed, until the end
+void StageStats_BeginProfile(StageProfile *profile);
+void StageStats_EndProfile();
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "subscription.h"
+
+#include "indexer.h"
+#include "module.h"
+
+#include <stdio.h>
+#include "rmutil/alloc.h"
+
+typedef struct Subscription
+{
+    RedisModuleString *channel;
+    RedisModuleString **filters;
+    size_t filtersCount;
+    // the names of the matching series, looked up at indexVersion
+    RedisModuleDict *keys;
+    uint64_t indexVersion;
+    bool matched;
+} Subscription;
+
+typedef struct SubscribedSample
+{
+    RedisModuleString *key;
+    timestamp_t timestamp;
+    double value;
+} SubscribedSample;
+
+static struct
+{
+    Subscription **items;
+    size_t count;
+    SubscribedSample *queue;
+    size_t queueCount;
+    size_t queueCapacity;
+    bool flushScheduled;
+} subscriptions;
+
+static void freeSubscription(Subscription *sub) {
+    RedisModule_FreeString(NULL, sub->channel);
+    for (size_t i = 0; i < sub->filtersCount; i++) {
+        RedisModule_FreeString(NULL, sub->filters[i]);
+    }
+    free(sub->filters);
+    if (sub->keys != NULL) {
+        RedisModule_FreeDict(NULL, sub->keys);
+    }
+    free(sub);
+}
+
+static size_t findSubscription(RedisModuleString *channel) {
+    for (size_t i = 0; i < subscriptions.count; i++) {
+        if (RedisModule_StringCompare(subscriptions.items[i]->channel, channel) == 0) {
+            return i;
+        }
+    }
+    return subscriptions.count;
+}
+
+void Subscriptions_Set(RedisModuleString *channel, RedisModuleString **filters, size_t count) {
+    Subscription *sub = malloc(sizeof(Subscription));
+    sub->channel = RedisModule_CreateStringFromString(NULL, channel);
+    sub->filters = malloc(sizeof(RedisModuleString *) * count);
+    for (size_t i = 0; i < count; i++) {
+        sub->filters[i] = RedisModule_CreateStringFromString(NULL, filters[i]);
+    }
+    sub->filtersCount = count;
+    sub->keys = NULL;
+    sub->matched = false;
+
+    size_t pos = findSubscription(channel);
+    if (pos < subscriptions.count) {
+        freeSubscription(subscriptions.items[pos]);
+    } else {
+        subscriptions.items =
+            realloc(subscriptions.items, sizeof(Subscription *) * (subscriptions.count + 1));
+        subscriptions.count++;
+    }
+    subscriptions.items[pos] = sub;
+}
+
+int Subscriptions_Remove(RedisModuleString *channel) {
+    size_t pos = findSubscription(channel);
+    if (pos == subscriptions.count) {
+        return TSDB_ERROR;
+    }
+    freeSubscription(subscriptions.items[pos]);
+    subscriptions.items[pos] = subscriptions.items[--subscriptions.count];
+    return TSDB_OK;
+}
+
+size_t Subscriptions_Count() {
+    return subscriptions.count;
+}
+
+static void flushCallback(RedisModuleCtx *ctx, void *data) {
+    subscriptions.flushScheduled = false;
+    Subscriptions_Flush(ctx);
+}
+
+void Subscriptions_AddSample(RedisModuleCtx *ctx,
+                             RedisModuleString *key,
+                             timestamp_t timestamp,
+                             double value) {
+    if (subscriptions.count == 0) {
+        return;
+    }
+    if (subscriptions.queueCount == subscriptions.queueCapacity) {
+        subscriptions.queueCapacity = max(subscriptions.queueCapacity * 2, 64);
+        subscriptions.queue = realloc(subscriptions.queue,
+                                      sizeof(SubscribedSample) * subscriptions.queueCapacity);
+    }
+    subscriptions.queue[subscriptions.queueCount++] = (SubscribedSample){
+        .key = RedisModule_CreateStringFromString(NULL, key),
+        .timestamp = timestamp,
+        .value = value,
+    };
+    if (!subscriptions.flushScheduled) {
+        // a timer of 0 fires on the next event loop iteration
+        RedisModule_CreateTimer(ctx, 0, flushCallback, NULL);
+        subscriptions.flushScheduled = true;
+    }
+}
+
+// Looks up the series matching the filters, which were checked when subscribing
+static void matchSubscription(RedisModuleCtx *ctx, Subscription *sub) {
+    uint64_t indexVersion = IndexVersion();
+    if (sub->matched && sub->indexVersion == indexVersion) {
+        return;
+    }
+    if (sub->keys != NULL) {
+        RedisModule_FreeDict(NULL, sub->keys);
+    }
+    sub->keys = RedisModule_CreateDict(NULL);
+    sub->indexVersion = indexVersion;
+    sub->matched = true;
+
+    QueryPredicate *queries =
+        RedisModule_PoolAlloc(ctx, sizeof(QueryPredicate) * sub->filtersCount);
+    if (parseLabelListFromArgs(ctx, sub->filters, 0, sub->filtersCount, queries) == TSDB_ERROR) {
+        return;
+    }
+    size_t count;
+    RedisModuleString **keys = QueryIndex(ctx, queries, sub->filtersCount, &count, NULL);
+    for (size_t i = 0; i < count; i++) {
+        RedisModule_DictSet(sub->keys, keys[i], NULL);
+    }
+}
+
+void Subscriptions_Flush(RedisModuleCtx *ctx) {
+    RedisModule_AutoMemory(ctx);
+    for (size_t i = 0; i < subscriptions.count; i++) {
+        Subscription *sub = subscriptions.items[i];
+        matchSubscription(ctx, sub);
+        // a line per sample: timestamp, value and key name, last as it may hold spaces
+        RedisModuleString *message = NULL;
+        for (size_t j = 0; j < subscriptions.queueCount; j++) {
+            const SubscribedSample *sample = &subscriptions.queue[j];
+            int nokey;
+            RedisModule_DictGet(sub->keys, sample->key, &nokey);
+            if (nokey) {
+                continue;
+            }
+            char buf[64];
+            int len = snprintf(buf,
+                               sizeof(buf),
+                               "%s%llu %.15g ",
+                               message != NULL ? "\n" : "",
+                               (unsigned long long)sample->timestamp,
+                               sample->value);
+            if (message == NULL) {
+                message = RedisModule_CreateString(ctx, buf, len);
+            } else {
+                RedisModule_StringAppendBuffer(ctx, message, buf, len);
+            }
+            size_t keyLen;
+            const char *key = RedisModule_StringPtrLen(sample->key, &keyLen);
+            RedisModule_StringAppendBuffer(ctx, message, key, keyLen);
+        }
+        if (message != NULL) {
+            RedisModule_PublishMessage(ctx, sub->channel, message);
+        }
+    }
+
+    for (size_t j = 0; j < subscriptions.queueCount; j++) {
+        RedisModule_FreeString(NULL, subscriptions.queue[j].key);
+    }
+    subscriptions.queueCount = 0;
+}
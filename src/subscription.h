@@ -0,0 +1,35 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef SUBSCRIPTION_H
+#define SUBSCRIPTION_H
+
+#include "consts.h"
+#include "redismodule.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Label filters whose new samples are published to a Pub/Sub channel, see TS.SUBSCRIBE. The
+ * samples added during an event loop iteration are queued and published together on the next
+ * one, as a single message per channel. The series matching a filter are looked up again once
+ * the label index changed. Subscriptions are only used on the main thread.
+ */
+
+// Subscribes the channel to the series matching the filters, replacing its previous filters
+void Subscriptions_Set(RedisModuleString *channel, RedisModuleString **filters, size_t count);
+// Returns TSDB_ERROR when the channel isn't subscribed
+int Subscriptions_Remove(RedisModuleString *channel);
+size_t Subscriptions_Count();
+// Queues a sample added to the series `key` when any channel is subscribed
+void Subscriptions_AddSample(RedisModuleCtx *ctx,
+                             RedisModuleString *key,
+                             timestamp_t timestamp,
+                             double value);
+// Publishes the queued samples
+void Subscriptions_Flush(RedisModuleCtx *ctx);
+
+#endif
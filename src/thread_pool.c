@@ -0,0 +1,91 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include "rmutil/alloc.h"
+
+typedef struct ThreadPoolJob
+{
+    ThreadPoolJobFunc func;
+    void *arg;
+    struct ThreadPoolJob *next;
+} ThreadPoolJob;
+
+static struct
+{
+    pthread_t *threads;
+    size_t numThreads;
+    pthread_mutex_t lock;
+    pthread_cond_t hasJobs;
+    ThreadPoolJob *head;
+    ThreadPoolJob *tail;
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .hasJobs = PTHREAD_COND_INITIALIZER };
+
+static void *threadMain(void *unused) {
+    while (true) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.head == NULL) {
+            pthread_cond_wait(&pool.hasJobs, &pool.lock);
+        }
+        ThreadPoolJob *job = pool.head;
+        pool.head = job->next;
+        if (pool.head == NULL) {
+            pool.tail = NULL;
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        job->func(job->arg);
+        free(job);
+    }
+    return NULL;
+}
+
+int ThreadPool_Init(size_t numThreads) {
+    if (pool.threads != NULL || numThreads == 0) {
+        return TSDB_ERROR;
+    }
+    pool.threads = (pthread_t *)malloc(numThreads * sizeof(pthread_t));
+    for (size_t i = 0; i < numThreads; ++i) {
+        if (pthread_create(&pool.threads[i], NULL, threadMain, NULL) != 0) {
+            // threads already started keep serving the queue
+            if (i == 0) {
+                free(pool.threads);
+                pool.threads = NULL;
+                return TSDB_ERROR;
+            }
+            break;
+        }
+        pthread_detach(pool.threads[i]);
+        pool.numThreads++;
+    }
+    return TSDB_OK;
+}
+
+bool ThreadPool_IsActive() {
+    return pool.numThreads > 0;
+}
+
+size_t ThreadPool_NumThreads() {
+    return pool.numThreads;
+}
+
+void ThreadPool_AddJob(ThreadPoolJobFunc func, void *arg) {
+    ThreadPoolJob *job = (ThreadPoolJob *)malloc(sizeof(ThreadPoolJob));
+    job->func = func;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.tail == NULL) {
+        pool.head = job;
+    } else {
+        pool.tail->next = job;
+    }
+    pool.tail = job;
+    pthread_cond_signal(&pool.hasJobs);
+    pthread_mutex_unlock(&pool.lock);
+}
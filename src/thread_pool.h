@@ -0,0 +1,25 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "consts.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef void (*ThreadPoolJobFunc)(void *arg);
+
+/*
+ * Starts `numThreads` worker threads, jobs added afterwards run on them in FIFO order.
+ * Returns TSDB_ERROR if the pool is already running or the threads cannot be created.
+ */
+int ThreadPool_Init(size_t numThreads);
+bool ThreadPool_IsActive();
+size_t ThreadPool_NumThreads();
+void ThreadPool_AddJob(ThreadPoolJobFunc func, void *arg);
+
+#endif
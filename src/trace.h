@@ -0,0 +1,41 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Static tracepoints (USDT) of the `timeseries` provider, for bpftrace, perf or SystemTap, e.g.
+ *   bpftrace -e 'usdt:./redistimeseries.so:timeseries:chunk_split { @[arg1] = count(); }'
+ * A probe is a nop and an ELF note until a tracer attaches, its arguments being values at hand.
+ * They are built in when <sys/sdt.h> is found, unless compiled with USDT=0. The probes and their
+ * arguments are listed in docs/development.md.
+ */
+#ifndef USDT
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define USDT 1
+#endif
+#endif
+#endif
+
+#if defined(USDT) && USDT
+#include <sys/sdt.h>
+#define TRACE_PROBE(name) DTRACE_PROBE(timeseries, name)
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(timeseries, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(timeseries, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(timeseries, name, a, b, c)
+#define TRACE_PROBE4(name, a, b, c, d) DTRACE_PROBE4(timeseries, name, a, b, c, d)
+#else
+// the arguments are not evaluated
+#define TRACE_PROBE(name) ((void)0)
+#define TRACE_PROBE1(name, a) ((void)sizeof(a))
+#define TRACE_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define TRACE_PROBE3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#define TRACE_PROBE4(name, a, b, c, d)                                                            \
+    ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c), (void)sizeof(d))
+#endif
+
+#endif
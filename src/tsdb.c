@@ -5,39 +5,125 @@
  */
 #include "tsdb.h"
 
+#include "chunk_pool.h"
 #include "config.h"
 #include "consts.h"
-#include "endianconv.h"
+#include "gorilla.h"
 #include "indexer.h"
 #include "module.h"
+#include "trace.h"
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include "rmutil/alloc.h"
 #include "rmutil/logging.h"
 #include "rmutil/strings.h"
 
 static Series *lastDeletedSeries = NULL;
+// the series whose key names and rules lastDeletedSeries holds, see SeriesUnlink
+static Series *lastUnlinkedSeries = NULL;
 static RedisModuleString *renameFromKey = NULL;
 
-int dictOperator(RedisModuleDict *d, void *chunk, timestamp_t ts, DictOp op) {
-    timestamp_t rax_key = htonu64(ts);
-    switch (op) {
-        case DICT_OP_SET:
-            return RedisModule_DictSetC(d, &rax_key, sizeof(rax_key), chunk);
-        case DICT_OP_REPLACE:
-            return RedisModule_DictReplaceC(d, &rax_key, sizeof(rax_key), chunk);
-        case DICT_OP_DEL:
-            return RedisModule_DictDelC(d, &rax_key, sizeof(rax_key), NULL);
+/*
+ * Totals of all the series, for the INFO section of the module. They follow the changes of the
+ * series on the main thread, while FreeSeries runs on a background thread for asynchronous flushes
+ * and adds what it frees to freedTotals atomically.
+ */
+static SeriesTotals seriesTotals;
+static SeriesTotals freedTotals;
+
+void SeriesGetTotals(SeriesTotals *totals) {
+    totals->chunks = seriesTotals.chunks - __atomic_load_n(&freedTotals.chunks, __ATOMIC_RELAXED);
+    totals->samples =
+        seriesTotals.samples - __atomic_load_n(&freedTotals.samples, __ATOMIC_RELAXED);
+    totals->bytes = seriesTotals.bytes - __atomic_load_n(&freedTotals.bytes, __ATOMIC_RELAXED);
+}
+
+static uint64_t seriesVersion;
+
+// Marks a change of the samples, `rewrite` when samples before the last one may have changed
+static void SeriesSamplesChanged(Series *series, bool rewrite) {
+    series->version = ++seriesVersion;
+    if (rewrite) {
+        series->rewriteVersion = series->version;
+    }
+}
+
+// Applies a change in the number of chunks, samples and chunk bytes of `series`
+static void SeriesAccount(Series *series, long long chunks, long long samples, long long bytes) {
+    series->totalSamples += samples;
+    series->chunksBytes += bytes;
+    seriesTotals.chunks += chunks;
+    seriesTotals.samples += samples;
+    seriesTotals.bytes += bytes;
+}
+
+static size_t SeriesChunkBytes(Series *series, Chunk_t *chunk) {
+    return series->funcs->GetChunkSize(chunk, true);
+}
+
+// Accounts for `chunk` having changed since it took `before` bytes
+static void SeriesChunkResized(Series *series, Chunk_t *chunk, size_t before) {
+    SeriesAccount(series, 0, 0, (long long)SeriesChunkBytes(series, chunk) - (long long)before);
+}
+
+/*
+ * The chunks of a series but the last one are shared with its snapshots while the epoch of the
+ * last snapshot is pinned. The last chunk never is: snapshots copy it, and a chunk that becomes
+ * the last one again is copied first.
+ */
+static bool SeriesChunkShared(Series *series, Chunk_t *chunk) {
+    return chunk != series->lastChunk && Epoch_Pinned(series->snapshotEpoch);
+}
+
+// Frees a chunk removed from the series once the snapshots sharing it are read
+static void SeriesFreeChunk(Series *series, Chunk_t *chunk) {
+    if (Epoch_Pinned(series->snapshotEpoch)) {
+        Epoch_Retire(chunk, series->funcs->FreeChunk);
+    } else {
+        series->funcs->FreeChunk(chunk);
     }
-    chunk = NULL;
-    return REDISMODULE_OK; // silence compiler
+}
+
+// The chunk at `pos`, to be changed in place. A shared chunk is replaced by a copy of it.
+static Chunk_t *SeriesChunkForWrite(Series *series, size_t pos) {
+    Chunk_t *chunk = ChunkDir_Get(&series->chunks, pos);
+    if (!SeriesChunkShared(series, chunk)) {
+        return chunk;
+    }
+    Chunk_t *copy = series->funcs->CloneChunk(chunk);
+    TRACE_PROBE2(chunk_copy_on_write, series->funcs->GetNumOfSample(chunk), pos);
+    SeriesAccount(series,
+                  0,
+                  0,
+                  (long long)SeriesChunkBytes(series, copy) -
+                      (long long)SeriesChunkBytes(series, chunk));
+    ChunkDir_Set(&series->chunks, pos, copy);
+    Epoch_Retire(chunk, series->funcs->FreeChunk);
+    return copy;
+}
+
+void SeriesAddChunk(Series *series, timestamp_t key, Chunk_t *chunk) {
+    if (ChunkDir_Insert(&series->chunks, key, chunk) == TSDB_OK) {
+        SeriesAccount(
+            series, 1, series->funcs->GetNumOfSample(chunk), SeriesChunkBytes(series, chunk));
+    }
+}
+
+static ChunkFuncs *SeriesChunkClass(int options) {
+    if (options & SERIES_OPT_UNCOMPRESSED) {
+        return GetChunkClass(CHUNK_REGULAR);
+    } else if (options & SERIES_OPT_DECIMAL) {
+        return GetChunkClass(CHUNK_DECIMAL);
+    }
+    return GetChunkClass(CHUNK_COMPRESSED);
 }
 
 Series *NewSeries(RedisModuleString *keyName, CreateCtx *cCtx) {
     Series *newSeries = (Series *)malloc(sizeof(Series));
     newSeries->keyName = keyName;
-    newSeries->chunks = RedisModule_CreateDict(NULL);
+    ChunkDir_Init(&newSeries->chunks);
     newSeries->chunkSizeBytes = cCtx->chunkSizeBytes;
     newSeries->retentionTime = cCtx->retentionTime;
     newSeries->srcKey = NULL;
@@ -45,58 +131,241 @@ Series *NewSeries(RedisModuleString *keyName, CreateCtx *cCtx) {
     newSeries->lastTimestamp = 0;
     newSeries->lastValue = 0;
     newSeries->totalSamples = 0;
+    SeriesSamplesChanged(newSeries, true);
+    newSeries->chunksBytes = 0;
+    InternLabels(cCtx->labels, cCtx->labelsCount);
     newSeries->labels = cCtx->labels;
     newSeries->labelsCount = cCtx->labelsCount;
     newSeries->options = cCtx->options;
     newSeries->duplicatePolicy = cCtx->duplicatePolicy;
-
-    if (newSeries->options & SERIES_OPT_UNCOMPRESSED) {
-        newSeries->options |= SERIES_OPT_UNCOMPRESSED;
-        newSeries->funcs = GetChunkClass(CHUNK_REGULAR);
-    } else {
-        newSeries->funcs = GetChunkClass(CHUNK_COMPRESSED);
+    newSeries->chunkTimeWindow = cCtx->chunkTimeWindow;
+    newSeries->significantDigits = cCtx->significantDigits;
+    newSeries->pendingSamples = NULL;
+    newSeries->pendingCount = 0;
+    newSeries->trimQueued = false;
+    newSeries->sealedUntil = 0;
+    newSeries->offloadedUntil = 0;
+    newSeries->indexQueued = false;
+    newSeries->unlinked = false;
+    newSeries->snapshotEpoch = 0;
+    newSeries->snapshotChunk = NULL;
+
+    newSeries->funcs = SeriesChunkClass(newSeries->options);
+    newSeries->lastChunk = NULL;
+    if (!cCtx->skipChunkCreation) {
+        Chunk_t *newChunk = newSeries->funcs->NewChunk(newSeries->chunkSizeBytes);
+        SeriesAddChunk(newSeries, 0, newChunk);
+        newSeries->lastChunk = newChunk;
     }
-    Chunk_t *newChunk = newSeries->funcs->NewChunk(newSeries->chunkSizeBytes);
-    dictOperator(newSeries->chunks, newChunk, 0, DICT_OP_SET);
-    newSeries->lastChunk = newChunk;
     return newSeries;
 }
 
-void SeriesTrim(Series *series) {
-    if (series->retentionTime == 0) {
+/*
+ * Series with expired chunks left to free or cold chunks left to seal, handled by
+ * SeriesRetentionSweep. The lock is taken by FreeSeries as well, which runs on a background thread
+ * for asynchronous flushes.
+ */
+static Series **trimQueue;
+static size_t trimQueueCount;
+static size_t trimQueueCapacity;
+static pthread_mutex_t trimQueueLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void trimQueueRemove(Series *series) {
+    Series *last = trimQueue[--trimQueueCount];
+    trimQueue[series->trimQueuePos] = last;
+    last->trimQueuePos = series->trimQueuePos;
+    series->trimQueued = false;
+}
+
+static bool SeriesHasOldChunksToSweep() {
+    return TSGlobalConfig.coldChunkAge > 0 || TSGlobalConfig.offloadAge > 0;
+}
+
+void SeriesScheduleTrim(Series *series) {
+    if (series->retentionTime == 0 && !SeriesHasOldChunksToSweep()) {
         return;
     }
+    pthread_mutex_lock(&trimQueueLock);
+    if (!series->trimQueued) {
+        if (trimQueueCount == trimQueueCapacity) {
+            trimQueueCapacity = trimQueueCapacity ? trimQueueCapacity * 2 : 64;
+            trimQueue = realloc(trimQueue, trimQueueCapacity * sizeof(Series *));
+        }
+        series->trimQueuePos = trimQueueCount;
+        series->trimQueued = true;
+        trimQueue[trimQueueCount++] = series;
+    }
+    pthread_mutex_unlock(&trimQueueLock);
+}
+
+/*
+ * Series loaded from RDB, indexed together when loading ends rather than one by one. Only the
+ * main thread loads and frees series while loading, so no lock is needed.
+ */
+static Series **indexQueue;
+static size_t indexQueueCount;
+static size_t indexQueueCapacity;
+
+void SeriesQueueIndexing(Series *series) {
+    if (indexQueueCount == indexQueueCapacity) {
+        indexQueueCapacity = indexQueueCapacity ? indexQueueCapacity * 2 : 1024;
+        indexQueue = realloc(indexQueue, indexQueueCapacity * sizeof(Series *));
+    }
+    series->indexQueuePos = indexQueueCount;
+    series->indexQueued = true;
+    indexQueue[indexQueueCount++] = series;
+}
+
+static void indexQueueRemove(Series *series) {
+    Series *last = indexQueue[--indexQueueCount];
+    indexQueue[series->indexQueuePos] = last;
+    last->indexQueuePos = series->indexQueuePos;
+    series->indexQueued = false;
+}
+
+void SeriesIndexQueued() {
+    if (indexQueueCount == 0) {
+        return;
+    }
+    IndexedMetric *metrics = malloc(indexQueueCount * sizeof(IndexedMetric));
+    for (size_t i = 0; i < indexQueueCount; i++) {
+        Series *series = indexQueue[i];
+        metrics[i] = (IndexedMetric){ .keyName = series->keyName,
+                                      .handle = series,
+                                      .labels = series->labels,
+                                      .labelsCount = series->labelsCount };
+        series->indexQueued = false;
+    }
+    IndexMetrics(metrics, indexQueueCount);
+    free(metrics);
+
+    free(indexQueue);
+    indexQueue = NULL;
+    indexQueueCount = 0;
+    indexQueueCapacity = 0;
+}
+
+// Frees up to `maxChunks` expired chunks, returns whether expired chunks are left
+static bool SeriesTrim(Series *series, size_t maxChunks, size_t *trimmed) {
+    *trimmed = 0;
+    if (series->retentionTime == 0) {
+        return false;
+    }
 
-    // start iterator from smallest key
-    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(series->chunks, "^", NULL, 0);
-    Chunk_t *currentChunk;
-    void *currentKey;
-    size_t keyLen;
     timestamp_t minTimestamp = series->lastTimestamp > series->retentionTime
                                    ? series->lastTimestamp - series->retentionTime
                                    : 0;
 
-    while ((currentKey = RedisModule_DictNextC(iter, &keyLen, (void *)&currentChunk))) {
-        if (series->funcs->GetLastTimestamp(currentChunk) < minTimestamp) {
-            RedisModule_DictDelC(series->chunks, currentKey, keyLen, NULL);
-            // reseek iterator since we modified the dict,
-            // go to first element that is bigger than current key
-            RedisModule_DictIteratorReseekC(iter, ">", currentKey, keyLen);
+    // the expired chunks are the first ones, removed at once
+    bool expiredLeft = false;
+    size_t samples = 0;
+    for (; *trimmed < ChunkDir_Count(&series->chunks); (*trimmed)++) {
+        Chunk_t *currentChunk = ChunkDir_Get(&series->chunks, *trimmed);
+        if (currentChunk == series->lastChunk ||
+            series->funcs->GetLastTimestamp(currentChunk) >= minTimestamp) {
+            break;
+        }
+        if (*trimmed == maxChunks) {
+            expiredLeft = true;
+            break;
+        }
+        size_t chunkSamples = series->funcs->GetNumOfSample(currentChunk);
+        samples += chunkSamples;
+        SeriesAccount(series,
+                      -1,
+                      -(long long)chunkSamples,
+                      -(long long)SeriesChunkBytes(series, currentChunk));
+        SeriesFreeChunk(series, currentChunk);
+    }
+    if (*trimmed > 0) {
+        SeriesSamplesChanged(series, true);
+        TRACE_PROBE3(series_trim, *trimmed, samples, expiredLeft);
+    }
+    ChunkDir_DeleteFirst(&series->chunks, *trimmed);
+    return expiredLeft;
+}
 
-            series->totalSamples -= series->funcs->GetNumOfSample(currentChunk);
-            series->funcs->FreeChunk(currentChunk);
-        } else {
+/*
+ * Applies `action` to the chunks of the series that ended `age` before its last sample, from the
+ * chunk holding `*until` on, at most `maxChunks` of them. `*until` is moved past the chunks done.
+ * Returns whether some are left.
+ */
+static bool SeriesSweepOldChunks(Series *series,
+                                 timestamp_t age,
+                                 void (*action)(Chunk_t *chunk),
+                                 timestamp_t *until,
+                                 size_t maxChunks,
+                                 size_t *done) {
+    *done = 0;
+    ChunkFuncs *funcs = series->funcs;
+    if (age == 0 || action == NULL || series->lastTimestamp <= age) {
+        return false;
+    }
+    timestamp_t oldTimestamp = series->lastTimestamp - age;
+
+    // from the chunk holding `until`
+    bool oldLeft = false;
+    for (size_t pos = ChunkDir_Find(&series->chunks, *until);
+         pos < ChunkDir_Count(&series->chunks);
+         pos++) {
+        Chunk_t *chunk = ChunkDir_Get(&series->chunks, pos);
+        if (chunk == series->lastChunk || funcs->GetLastTimestamp(chunk) >= oldTimestamp) {
+            break;
+        }
+        if (*done == maxChunks) {
+            oldLeft = true;
             break;
         }
+        chunk = SeriesChunkForWrite(series, pos);
+        size_t before = SeriesChunkBytes(series, chunk);
+        action(chunk);
+        SeriesChunkResized(series, chunk, before);
+        *until = funcs->GetLastTimestamp(chunk) + 1;
+        (*done)++;
     }
-    RedisModule_DictIteratorStop(iter);
+    return oldLeft;
 }
 
-// Encode timestamps as bigendian to allow correct lexical sorting
-static void seriesEncodeTimestamp(void *buf, timestamp_t timestamp) {
-    uint64_t e;
-    e = htonu64(timestamp);
-    memcpy(buf, &e, sizeof(e));
+// A write to the chunks from `firstTimestamp` on may have unsealed them or brought them back in
+// memory, the sweeper handles them again once the series is queued with its next chunk
+static void SeriesChunksRewritten(Series *series, timestamp_t firstTimestamp) {
+    series->sealedUntil = min(series->sealedUntil, firstTimestamp);
+    series->offloadedUntil = min(series->offloadedUntil, firstTimestamp);
+}
+
+size_t SeriesRetentionSweep(size_t maxChunks) {
+    size_t total = 0;
+    pthread_mutex_lock(&trimQueueLock);
+    while (total < maxChunks && trimQueueCount > 0) {
+        Series *series = trimQueue[trimQueueCount - 1];
+        ChunkFuncs *funcs = series->funcs;
+        size_t trimmed, sealed, offloaded;
+        // pending samples are merged into the chunks they belong to before these are freed
+        SeriesFlushPendingSamples(series);
+        bool left = SeriesTrim(series, maxChunks - total, &trimmed);
+        total += trimmed;
+        left = SeriesSweepOldChunks(series,
+                                    TSGlobalConfig.coldChunkAge,
+                                    funcs->SealChunk,
+                                    &series->sealedUntil,
+                                    maxChunks - total,
+                                    &sealed) ||
+               left;
+        total += sealed;
+        left = SeriesSweepOldChunks(series,
+                                    TSGlobalConfig.offloadAge,
+                                    funcs->OffloadChunk,
+                                    &series->offloadedUntil,
+                                    maxChunks - total,
+                                    &offloaded) ||
+               left;
+        total += offloaded;
+        if (!left) {
+            trimQueueRemove(series);
+        }
+    }
+    pthread_mutex_unlock(&trimQueueLock);
+    return total;
 }
 
 void freeLastDeletedSeries() {
@@ -115,6 +384,7 @@ void freeLastDeletedSeries() {
     RedisModule_FreeString(NULL, lastDeletedSeries->keyName);
     free(lastDeletedSeries);
     lastDeletedSeries = NULL;
+    lastUnlinkedSeries = NULL;
 }
 
 void CleanLastDeletedSeries(RedisModuleString *key) {
@@ -168,10 +438,15 @@ void RenameSeriesTo(RedisModuleCtx *ctx, RedisModuleString *keyTo) {
     if (!status) { // Not a timeseries key
         goto cleanup;
     }
+    SeriesInvalidateRuleCache();
+    // deleting the key it was renamed from unlinked it
+    SeriesRelink(ctx, series);
 
     // Reindex key by the new name
-    RemoveIndexedMetric(ctx, renameFromKey, series->labels, series->labelsCount);
-    IndexMetric(ctx, keyTo, series->labels, series->labelsCount);
+    RenameIndexedMetric(ctx, renameFromKey, keyTo, series->labels, series->labelsCount);
+    RedisModule_FreeString(NULL, series->keyName);
+    RedisModule_RetainString(NULL, keyTo);
+    series->keyName = keyTo;
 
     // A destination key was renamed
     if (series->srcKey) {
@@ -235,29 +510,298 @@ cleanup:
 }
 
 // Releases Series and all its compaction rules
+void SeriesUnlink(RedisModuleString *key, const void *value) {
+    Series *series = (Series *)value;
+    pthread_mutex_lock(&trimQueueLock);
+    if (series->trimQueued) {
+        trimQueueRemove(series);
+    }
+    pthread_mutex_unlock(&trimQueueLock);
+
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
+    RedisModule_AutoMemory(ctx);
+    if (series->indexQueued) {
+        indexQueueRemove(series);
+    } else {
+        RemoveIndexedMetric(ctx, series->keyName, series->labels, series->labelsCount);
+    }
+    RedisModule_FreeThreadSafeContext(ctx);
+    // rules of other series may point at this one
+    SeriesInvalidateRuleCache();
+
+    // CleanLastDeletedSeries only needs the names and rules
+    Series *deleted = calloc(1, sizeof(Series));
+    deleted->keyName = series->keyName;
+    deleted->srcKey = series->srcKey;
+    deleted->rules = series->rules;
+    series->keyName = NULL;
+    series->srcKey = NULL;
+    series->rules = NULL;
+    series->unlinked = true;
+
+    freeLastDeletedSeries();
+    lastDeletedSeries = deleted;
+    lastUnlinkedSeries = series;
+}
+
+void SeriesRelink(RedisModuleCtx *ctx, Series *series) {
+    if (!series->unlinked || series != lastUnlinkedSeries) {
+        return;
+    }
+    series->keyName = lastDeletedSeries->keyName;
+    series->srcKey = lastDeletedSeries->srcKey;
+    series->rules = lastDeletedSeries->rules;
+    series->unlinked = false;
+    free(lastDeletedSeries);
+    lastDeletedSeries = NULL;
+    lastUnlinkedSeries = NULL;
+
+    IndexMetric(ctx, series->keyName, series, series->labels, series->labelsCount);
+    SeriesScheduleTrim(series);
+}
+
+size_t SeriesFreeEffort(RedisModuleString *key, const void *value) {
+    return ChunkDir_Count(&((Series *)value)->chunks);
+}
+
+// Frees what SeriesUnlink left, on any thread
+static void FreeUnlinkedSeries(Series *series) {
+    for (size_t i = 0; i < ChunkDir_Count(&series->chunks); i++) {
+        SeriesFreeChunk(series, ChunkDir_Get(&series->chunks, i));
+    }
+    __atomic_add_fetch(&freedTotals.chunks, ChunkDir_Count(&series->chunks), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&freedTotals.samples, series->totalSamples, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&freedTotals.bytes, series->chunksBytes, __ATOMIC_RELAXED);
+    free(series->pendingSamples);
+    ReleaseLabels(series->labels, series->labelsCount);
+    ChunkDir_Free(&series->chunks);
+    free(series);
+}
+
 void FreeSeries(void *value) {
     Series *currentSeries = (Series *)value;
-    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(currentSeries->chunks, "^", NULL, 0);
-    Chunk_t *currentChunk;
-    while (RedisModule_DictNextC(iter, NULL, (void *)&currentChunk) != NULL) {
-        currentSeries->funcs->FreeChunk(currentChunk);
+    if (currentSeries->unlinked) {
+        FreeUnlinkedSeries(currentSeries);
+        return;
+    }
+    pthread_mutex_lock(&trimQueueLock);
+    if (currentSeries->trimQueued) {
+        trimQueueRemove(currentSeries);
+    }
+    pthread_mutex_unlock(&trimQueueLock);
+
+    for (size_t i = 0; i < ChunkDir_Count(&currentSeries->chunks); i++) {
+        SeriesFreeChunk(currentSeries, ChunkDir_Get(&currentSeries->chunks, i));
     }
-    RedisModule_DictIteratorStop(iter);
+    __atomic_add_fetch(
+        &freedTotals.chunks, ChunkDir_Count(&currentSeries->chunks), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&freedTotals.samples, currentSeries->totalSamples, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&freedTotals.bytes, currentSeries->chunksBytes, __ATOMIC_RELAXED);
+    free(currentSeries->pendingSamples);
+    currentSeries->pendingSamples = NULL;
 
     RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
     RedisModule_AutoMemory(ctx);
-    RemoveIndexedMetric(
-        ctx, currentSeries->keyName, currentSeries->labels, currentSeries->labelsCount);
+    if (currentSeries->indexQueued) {
+        indexQueueRemove(currentSeries);
+    } else {
+        RemoveIndexedMetric(
+            ctx, currentSeries->keyName, currentSeries->labels, currentSeries->labelsCount);
+    }
+    // rules of other series may point at this one
+    SeriesInvalidateRuleCache();
 
-    FreeLabels(currentSeries->labels, currentSeries->labelsCount);
+    ReleaseLabels(currentSeries->labels, currentSeries->labelsCount);
 
     RedisModule_FreeThreadSafeContext(ctx);
-    RedisModule_FreeDict(NULL, currentSeries->chunks);
+    ChunkDir_Free(&currentSeries->chunks);
 
     freeLastDeletedSeries();
     lastDeletedSeries = currentSeries;
 }
 
+Series *SeriesSnapshot(Series *series,
+                       timestamp_t start_ts,
+                       timestamp_t end_ts,
+                       const EpochGuard *guard) {
+    SeriesFlushPendingSamples(series);
+    series->snapshotEpoch = max(series->snapshotEpoch, guard->epoch);
+
+    Series *snapshot = (Series *)calloc(1, sizeof(Series));
+    ChunkDir_Init(&snapshot->chunks);
+    snapshot->chunkSizeBytes = series->chunkSizeBytes;
+    snapshot->retentionTime = series->retentionTime;
+    snapshot->options = series->options;
+    snapshot->duplicatePolicy = series->duplicatePolicy;
+    snapshot->chunkTimeWindow = series->chunkTimeWindow;
+    snapshot->significantDigits = series->significantDigits;
+    snapshot->lastTimestamp = series->lastTimestamp;
+    snapshot->lastValue = series->lastValue;
+    snapshot->totalSamples = series->totalSamples;
+    snapshot->funcs = series->funcs;
+
+    // the chunk before the range is shared as well, it holds the sample preceding the range that
+    // the counter aggregations are seeded with
+    size_t first = 0;
+    for (size_t i = 0; i < ChunkDir_Count(&series->chunks); i++) {
+        Chunk_t *chunk = ChunkDir_Get(&series->chunks, i);
+        if (series->funcs->GetNumOfSample(chunk) == 0) {
+            continue;
+        }
+        if (series->funcs->GetLastTimestamp(chunk) >= start_ts) {
+            break;
+        }
+        first = i;
+    }
+    for (size_t i = first; i < ChunkDir_Count(&series->chunks); i++) {
+        Chunk_t *chunk = ChunkDir_Get(&series->chunks, i);
+        if (series->funcs->GetFirstTimestamp(chunk) > end_ts) {
+            break;
+        }
+        if (series->funcs->GetNumOfSample(chunk) == 0) {
+            continue;
+        }
+        if (chunk == series->lastChunk) {
+            chunk = series->funcs->CloneChunk(chunk);
+            snapshot->snapshotChunk = chunk;
+        } else {
+            // a stale summary is computed now, readers on several threads then only read it
+            series->funcs->GetSummary(chunk);
+        }
+        ChunkDir_Insert(&snapshot->chunks, series->funcs->GetFirstTimestamp(chunk), chunk);
+        snapshot->chunksBytes += SeriesChunkBytes(snapshot, chunk);
+        snapshot->lastChunk = chunk;
+    }
+
+    if (snapshot->lastChunk == NULL) {
+        // queries expect at least one chunk
+        snapshot->lastChunk = snapshot->funcs->NewChunk(snapshot->chunkSizeBytes);
+        snapshot->snapshotChunk = snapshot->lastChunk;
+        ChunkDir_Insert(&snapshot->chunks, 0, snapshot->lastChunk);
+        snapshot->chunksBytes += SeriesChunkBytes(snapshot, snapshot->lastChunk);
+    }
+    return snapshot;
+}
+
+void FreeSeriesSnapshot(Series *snapshot) {
+    if (snapshot->snapshotChunk != NULL) {
+        snapshot->funcs->FreeChunk(snapshot->snapshotChunk);
+    }
+    ChunkDir_Free(&snapshot->chunks);
+    free(snapshot);
+}
+
+void FreeSeriesCopy(Series *copy) {
+    for (size_t i = 0; i < ChunkDir_Count(&copy->chunks); i++) {
+        copy->funcs->FreeChunk(ChunkDir_Get(&copy->chunks, i));
+    }
+    ChunkDir_Free(&copy->chunks);
+    free(copy);
+}
+
+void SeriesEncodingInit(SeriesEncoding *encoding,
+                        const Series *series,
+                        int options,
+                        long long chunkSizeBytes) {
+    encoding->options = options & SERIES_OPT_ENCODING;
+    encoding->funcs = SeriesChunkClass(options);
+    encoding->chunkSizeBytes = chunkSizeBytes;
+    encoding->chunkTimeWindow = series->chunkTimeWindow;
+    ChunkDir_Init(&encoding->chunks);
+    encoding->lastChunk = NULL;
+    encoding->samples = 0;
+    encoding->lastTimestamp = 0;
+}
+
+// Appends a sample, cutting the chunks as SeriesAddSample does
+static void SeriesEncodingAdd(SeriesEncoding *encoding, timestamp_t timestamp, double value) {
+    ChunkFuncs *funcs = encoding->funcs;
+    const timestamp_t window = encoding->chunkTimeWindow;
+    Chunk_t *chunk = encoding->lastChunk;
+    Sample sample = { .timestamp = timestamp, .value = value };
+    if (chunk == NULL ||
+        (window > 0 && CalcWindowStart(timestamp, window) !=
+                           CalcWindowStart(funcs->GetFirstTimestamp(chunk), window)) ||
+        funcs->AddSample(chunk, &sample) == CR_END) {
+        if (chunk != NULL && funcs->FlushChunk != NULL) {
+            funcs->FlushChunk(chunk);
+        }
+        Chunk_t *next = funcs->NewChunk(encoding->chunkSizeBytes);
+        // the first chunk of a series is keyed 0
+        ChunkDir_Insert(&encoding->chunks, chunk == NULL ? 0 : timestamp, next);
+        funcs->AddSample(next, &sample);
+        encoding->lastChunk = next;
+    }
+    encoding->samples++;
+    encoding->lastTimestamp = timestamp;
+}
+
+void SeriesEncodingAppend(SeriesEncoding *encoding, Series *series) {
+    if (encoding->samples > 0 && encoding->lastTimestamp == UINT64_MAX) {
+        return;
+    }
+    timestamp_t start = encoding->samples > 0 ? encoding->lastTimestamp + 1 : 0;
+    SeriesIterator iterator = SeriesQuery(series, start, UINT64_MAX, false);
+    timestamp_t timestamps[SERIES_ITER_BATCH_SIZE];
+    double values[SERIES_ITER_BATCH_SIZE];
+    size_t count;
+    while ((count = SeriesIteratorGetNextBatch(
+                &iterator, timestamps, values, SERIES_ITER_BATCH_SIZE)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            SeriesEncodingAdd(encoding, timestamps[i], values[i]);
+        }
+    }
+    SeriesIteratorClose(&iterator);
+}
+
+void SeriesSwapEncoding(Series *series, SeriesEncoding *encoding) {
+    SeriesEncodingAppend(encoding, series);
+    if (encoding->lastChunk == NULL) {
+        // queries expect at least one chunk
+        encoding->lastChunk = encoding->funcs->NewChunk(encoding->chunkSizeBytes);
+        ChunkDir_Insert(&encoding->chunks, 0, encoding->lastChunk);
+    }
+
+    size_t count = ChunkDir_Count(&series->chunks);
+    for (size_t i = 0; i < count; i++) {
+        SeriesFreeChunk(series, ChunkDir_Get(&series->chunks, i));
+    }
+    SeriesAccount(series,
+                  -(long long)count,
+                  -(long long)series->totalSamples,
+                  -(long long)series->chunksBytes);
+    ChunkDir_Free(&series->chunks);
+
+    series->chunks = encoding->chunks;
+    series->lastChunk = encoding->lastChunk;
+    series->funcs = encoding->funcs;
+    series->options = (series->options & ~SERIES_OPT_ENCODING) | encoding->options;
+    size_t bytes = 0;
+    for (size_t i = 0; i < ChunkDir_Count(&series->chunks); i++) {
+        bytes += SeriesChunkBytes(series, ChunkDir_Get(&series->chunks, i));
+    }
+    SeriesAccount(series, ChunkDir_Count(&series->chunks), encoding->samples, bytes);
+    TRACE_PROBE3(series_reencode, count, ChunkDir_Count(&series->chunks), encoding->samples);
+
+    // the new chunks are neither sealed nor offloaded yet
+    series->sealedUntil = 0;
+    series->offloadedUntil = 0;
+    SeriesSamplesChanged(series, true);
+    if (SeriesHasOldChunksToSweep()) {
+        SeriesScheduleTrim(series);
+    }
+    ChunkDir_Init(&encoding->chunks);
+    encoding->lastChunk = NULL;
+    encoding->samples = 0;
+}
+
+void SeriesEncodingFree(SeriesEncoding *encoding) {
+    for (size_t i = 0; i < ChunkDir_Count(&encoding->chunks); i++) {
+        encoding->funcs->FreeChunk(ChunkDir_Get(&encoding->chunks, i));
+    }
+    ChunkDir_Free(&encoding->chunks);
+}
+
 void FreeCompactionRule(void *value) {
     CompactionRule *rule = (CompactionRule *)value;
     RedisModule_FreeString(NULL, rule->destKey);
@@ -266,14 +810,7 @@ void FreeCompactionRule(void *value) {
 }
 
 size_t SeriesGetChunksSize(Series *series) {
-    size_t size = 0;
-    Chunk_t *currentChunk;
-    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(series->chunks, "^", NULL, 0);
-    while (RedisModule_DictNextC(iter, NULL, (void *)&currentChunk)) {
-        size += series->funcs->GetChunkSize(currentChunk, true);
-    }
-    RedisModule_DictIteratorStop(iter);
-    return size;
+    return series->chunks.capacity * sizeof(ChunkDirEntry) + series->chunksBytes;
 }
 
 size_t SeriesMemUsage(const void *value) {
@@ -295,8 +832,11 @@ size_t SeriesMemUsage(const void *value) {
         rule = rule->nextRule;
     }
 
+    size_t pendingSize =
+        series->pendingSamples != NULL ? PENDING_SAMPLES_MAX * sizeof(PendingSample) : 0;
+
     return sizeof(series) + rulesSize + labelsLen + sizeof(Label) * series->labelsCount +
-           SeriesGetChunksSize(series);
+           pendingSize + SeriesGetChunksSize(series);
 }
 
 size_t SeriesGetNumSamples(const Series *series) {
@@ -307,86 +847,438 @@ size_t SeriesGetNumSamples(const Series *series) {
     return numSamples;
 }
 
-static void upsertCompaction(Series *series, UpsertCtx *uCtx) {
-    CompactionRule *rule = series->rules;
-    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
+// Applies an upsert to an aggregation context holding the samples of its bucket before it
+static bool updateAggContext(AggregationClass *aggClass, void *context, UpsertCtx *uCtx, int size) {
+    if (aggClass->removeValue == NULL) {
+        return false;
+    }
+    if (size == 0 && aggClass->removeValue(context, uCtx->replacedValue) != TSDB_OK) {
+        return false;
+    }
+    aggClass->appendValue(context, uCtx->sample.value);
+    return true;
+}
+
+/*
+ * Recomputes the value of an older bucket from its value in the destination when the aggregation
+ * allows it. Returns false when the bucket has to be aggregated again from the samples.
+ */
+static bool updateCompactedBucket(CompactionRule *rule,
+                                  Series *destSeries,
+                                  timestamp_t start,
+                                  UpsertCtx *uCtx,
+                                  int size,
+                                  double *val) {
+    AggregationClass *aggClass = rule->aggClass;
+    if (aggClass->loadValue == NULL) {
+        return false;
+    }
+
+    // a bucket missing from the destination may still hold samples older than the rule
+    SeriesIterator iterator = SeriesQuery(destSeries, start, start, false);
+    Sample bucket;
+    bool compacted = SeriesIteratorGetNext(&iterator, &bucket) == CR_OK;
+    SeriesIteratorClose(&iterator);
+    if (!compacted) {
+        return false;
+    }
+
+    void *context = aggClass->createContext();
+    aggClass->loadValue(context, bucket.value);
+    bool updated = updateAggContext(aggClass, context, uCtx, size) &&
+                   aggClass->finalize(context, val) == TSDB_OK;
+    aggClass->freeContext(context);
+    return updated;
+}
+
+static bool SeriesHasSamples(Series *series, timestamp_t start, timestamp_t end) {
+    SeriesIterator iterator = SeriesQuery(series, start, end, false);
+    Sample sample;
+    bool found = SeriesIteratorGetNext(&iterator, &sample) == CR_OK;
+    SeriesIteratorClose(&iterator);
+    return found;
+}
+
+/*
+ * The counter aggregations count the increment from the last sample of the previous bucket, which
+ * a write to `bucket` may have changed: the bucket after it is aggregated again.
+ */
+static void recompactNextBucket(Series *series,
+                                CompactionRule *rule,
+                                Series *destSeries,
+                                timestamp_t bucket) {
+    const timestamp_t next = bucket + rule->timeBucket;
+    if (rule->aggClass->seedContext == NULL || rule->startCurrentTimeBucket == -1LL ||
+        next > rule->startCurrentTimeBucket) {
+        return;
+    }
+    if (next == rule->startCurrentTimeBucket) {
+        SeriesCalcRange(series, next, UINT64_MAX, rule, NULL);
+        return;
+    }
+    double val = 0;
+    if (!SeriesHasSamples(series, next, next + rule->timeBucket - 1) ||
+        SeriesCalcRange(series, next, next + rule->timeBucket - 1, rule, &val) == TSDB_ERROR) {
+        return;
+    }
+    if (destSeries->totalSamples == 0) {
+        SeriesAddSample(destSeries, next, val);
+    } else {
+        SeriesUpsertSample(destSeries, next, val, DP_LAST);
+    }
+}
+
+/*
+ * Brings the compactions up to date with an upserted sample, `size` being 1 when it was added and
+ * 0 when it replaced uCtx->replacedValue. The aggregations that can remove a value are updated in
+ * place: only min and max losing their extreme, first, last, and the older buckets of the
+ * aggregations whose result does not hold their whole state (avg, std, var, range) go back to the
+ * samples of the bucket.
+ */
+static void upsertCompaction(Series *series, UpsertCtx *uCtx, int size) {
+    if (size == 0 && uCtx->replacedValue == uCtx->sample.value) {
+        return;
+    }
+    // the buckets read back from the destinations must be there
+    CompactionQueueFlush(NULL);
+    RedisModuleCtx *ctx = NULL;
     const timestamp_t upsertTimestamp = uCtx->sample.timestamp;
     const timestamp_t seriesLastTimestamp = series->lastTimestamp;
-    while (rule != NULL) {
+    for (CompactionRule *rule = series->rules; rule != NULL; rule = rule->nextRule) {
         const timestamp_t ruleTimebucket = rule->timeBucket;
         const timestamp_t curAggWindowStart = CalcWindowStart(seriesLastTimestamp, ruleTimebucket);
         if (upsertTimestamp >= curAggWindowStart) {
             // upsert in latest timebucket
-            const int rv = SeriesCalcRange(series, curAggWindowStart, UINT64_MAX, rule, NULL);
-            if (rv == TSDB_ERROR) {
-                RedisModule_Log(ctx, "verbose", "%s", "Failed to calculate range for downsample");
+            if (rule->startCurrentTimeBucket == curAggWindowStart &&
+                updateAggContext(rule->aggClass, rule->aggContext, uCtx, size)) {
                 continue;
             }
-        } else {
-            const timestamp_t start = CalcWindowStart(upsertTimestamp, ruleTimebucket);
-            // ensure last include/exclude
-            double val = 0;
-            const int rv = SeriesCalcRange(series, start, start + ruleTimebucket - 1, rule, &val);
+            const int rv = SeriesCalcRange(series, curAggWindowStart, UINT64_MAX, rule, NULL);
             if (rv == TSDB_ERROR) {
-                RedisModule_Log(ctx, "verbose", "%s", "Failed to calculate range for downsample");
-                continue;
+                RedisModule_Log(NULL, "verbose", "%s", "Failed to calculate range for downsample");
             }
+            continue;
+        }
 
-            RedisModuleKey *key;
-            Series *destSeries;
-            if (!GetSeries(ctx, rule->destKey, &key, &destSeries, REDISMODULE_READ)) {
-                RedisModule_Log(ctx, "verbose", "%s", "Failed to retrieve downsample series");
-                continue;
-            }
-            if (destSeries->totalSamples == 0) {
-                SeriesAddSample(destSeries, start, val);
-            } else {
-                SeriesUpsertSample(destSeries, start, val, DP_LAST);
-            }
+        if (ctx == NULL) {
+            ctx = RedisModule_GetThreadSafeContext(NULL);
+        }
+        RedisModuleKey *key;
+        Series *destSeries;
+        if (!GetSeries(ctx, rule->destKey, &key, &destSeries, REDISMODULE_READ)) {
+            RedisModule_Log(ctx, "verbose", "%s", "Failed to retrieve downsample series");
+            continue;
+        }
+        const timestamp_t start = CalcWindowStart(upsertTimestamp, ruleTimebucket);
+        double val = 0;
+        if (!updateCompactedBucket(rule, destSeries, start, uCtx, size, &val) &&
+            SeriesCalcRange(series, start, start + ruleTimebucket - 1, rule, &val) == TSDB_ERROR) {
+            RedisModule_Log(ctx, "verbose", "%s", "Failed to calculate range for downsample");
             RedisModule_CloseKey(key);
+            continue;
         }
-        rule = rule->nextRule;
+        if (destSeries->totalSamples == 0) {
+            SeriesAddSample(destSeries, start, val);
+        } else {
+            SeriesUpsertSample(destSeries, start, val, DP_LAST);
+        }
+        recompactNextBucket(series, rule, destSeries, start);
+        RedisModule_CloseKey(key);
+    }
+    if (ctx != NULL) {
+        RedisModule_FreeThreadSafeContext(ctx);
+    }
+}
+
+// Updates the directory key of `chunk` if its first timestamp changed
+static void SeriesReindexChunk(Series *series, Chunk_t *chunk, timestamp_t oldFirstTS) {
+    timestamp_t newFirstTS = series->funcs->GetFirstTimestamp(chunk);
+    if (newFirstTS != oldFirstTS) {
+        if (ChunkDir_Delete(&series->chunks, oldFirstTS) == TSDB_ERROR) {
+            ChunkDir_Delete(&series->chunks, 0);
+        }
+        ChunkDir_Insert(&series->chunks, newFirstTS, chunk);
+    }
+}
+
+// Indexes `newChunk`, split from `chunk` when it took `before` bytes
+static void SeriesSplitDone(Series *series, Chunk_t *chunk, Chunk_t *newChunk, size_t before) {
+    TRACE_PROBE2(chunk_split_done,
+                 series->funcs->GetNumOfSample(chunk),
+                 series->funcs->GetNumOfSample(newChunk));
+    ChunkDir_Insert(&series->chunks, series->funcs->GetFirstTimestamp(newChunk), newChunk);
+    size_t after = SeriesChunkBytes(series, chunk) + SeriesChunkBytes(series, newChunk);
+    SeriesAccount(series, 1, 0, (long long)after - (long long)before);
+}
+
+// Splits `chunk` until all parts fit within the series chunk size
+static void SeriesSplitOversizedChunk(Series *series, Chunk_t *chunk) {
+    ChunkFuncs *funcs = series->funcs;
+    while (funcs->GetNumOfSample(chunk) > 1 &&
+           funcs->GetChunkSize(chunk, false) > series->chunkSizeBytes * SPLIT_FACTOR) {
+        size_t before = SeriesChunkBytes(series, chunk);
+        TRACE_PROBE2(chunk_split_start, funcs->GetNumOfSample(chunk), before);
+        Chunk_t *newChunk = funcs->SplitChunk(chunk);
+        SeriesSplitDone(series, chunk, newChunk, before);
+        if (series->lastChunk == chunk) {
+            series->lastChunk = newChunk;
+        }
+        SeriesSplitOversizedChunk(series, newChunk);
+    }
+}
+
+/*
+ * Position of the chunk `timestamp` belongs to. The chunks of a series with a time window are
+ * looked up from the window of the timestamp, which gives the position right away as long as each
+ * window up to it holds one chunk.
+ */
+static size_t SeriesFindChunkPos(Series *series, timestamp_t timestamp) {
+    const timestamp_t window = series->chunkTimeWindow;
+    Chunk_t *first = ChunkDir_Get(&series->chunks, 0);
+    if (window == 0 || series->funcs->GetNumOfSample(first) == 0) {
+        return ChunkDir_Find(&series->chunks, timestamp);
+    }
+    timestamp_t firstWindow = CalcWindowStart(series->funcs->GetFirstTimestamp(first), window);
+    size_t hint = timestamp > firstWindow ? (timestamp - firstWindow) / window : 0;
+    return ChunkDir_FindFrom(&series->chunks, timestamp, hint);
+}
+
+// The first timestamp of the chunk at `pos`, or its key while it holds no sample
+static timestamp_t SeriesChunkFirstTS(Series *series, size_t pos) {
+    Chunk_t *chunk = ChunkDir_Get(&series->chunks, pos);
+    return series->funcs->GetNumOfSample(chunk) > 0 ? series->funcs->GetFirstTimestamp(chunk)
+                                                    : ChunkDir_Key(&series->chunks, pos);
+}
+
+// Whether `timestamp` falls out of the window of `chunk`, with a chunk time window
+static bool SeriesChunkOutOfWindow(Series *series, Chunk_t *chunk, timestamp_t timestamp) {
+    const timestamp_t window = series->chunkTimeWindow;
+    return window > 0 && series->funcs->GetNumOfSample(chunk) > 0 &&
+           CalcWindowStart(timestamp, window) !=
+               CalcWindowStart(series->funcs->GetFirstTimestamp(chunk), window);
+}
+
+/*
+ * Position of the chunk to write `timestamp` to. With a chunk time window that is the chunk of the
+ * window of `timestamp`, added if the window has none yet. Chunks written before the window was
+ * set may span several windows, and are written to within their range.
+ */
+static size_t SeriesWriteChunkPos(Series *series, timestamp_t timestamp) {
+    ChunkFuncs *funcs = series->funcs;
+    ChunkDir *dir = &series->chunks;
+    size_t pos = SeriesFindChunkPos(series, timestamp);
+    Chunk_t *chunk = ChunkDir_Get(dir, pos);
+    if (!SeriesChunkOutOfWindow(series, chunk, timestamp) ||
+        (timestamp >= funcs->GetFirstTimestamp(chunk) &&
+         timestamp <= funcs->GetLastTimestamp(chunk))) {
+        return pos;
+    }
+    if (timestamp > funcs->GetLastTimestamp(chunk) && pos + 1 < ChunkDir_Count(dir) &&
+        !SeriesChunkOutOfWindow(series, ChunkDir_Get(dir, pos + 1), timestamp)) {
+        // the next chunk starts later in the window
+        return pos + 1;
+    }
+    if (timestamp < funcs->GetFirstTimestamp(chunk)) {
+        // the first chunk of a series is keyed 0 whatever its samples, the new one goes before it
+        SeriesReindexChunk(series, chunk, ChunkDir_Key(dir, pos));
+    }
+    SeriesAddChunk(series, timestamp, funcs->NewChunk(series->chunkSizeBytes));
+    return ChunkDir_Find(dir, timestamp);
+}
+
+/*
+ * Returns the chunk at `pos`, which `timestamp` belongs to, and the first timestamp past it: the
+ * first timestamp of the chunk following it, or the end of the window of `timestamp`.
+ */
+static Chunk_t *SeriesChunkAt(Series *series,
+                              size_t pos,
+                              timestamp_t timestamp,
+                              timestamp_t *nextFirstTS) {
+    if (pos + 1 < ChunkDir_Count(&series->chunks)) {
+        *nextFirstTS = series->funcs->GetFirstTimestamp(ChunkDir_Get(&series->chunks, pos + 1));
+    } else {
+        *nextFirstTS = UINT64_MAX;
+    }
+    const timestamp_t window = series->chunkTimeWindow;
+    if (window > 0 && CalcWindowStart(timestamp, window) < UINT64_MAX - window) {
+        *nextFirstTS = min(*nextFirstTS, CalcWindowStart(timestamp, window) + window);
+    }
+    return ChunkDir_Get(&series->chunks, pos);
+}
+
+// Returns the chunk `timestamp` belongs to, and the first timestamp past it
+static Chunk_t *SeriesFindChunk(Series *series, timestamp_t timestamp, timestamp_t *nextFirstTS) {
+    return SeriesChunkAt(series, SeriesFindChunkPos(series, timestamp), timestamp, nextFirstTS);
+}
+
+void SeriesFlushPendingSamples(Series *series) {
+    ChunkFuncs *funcs = series->funcs;
+    size_t i = 0;
+    while (i < series->pendingCount) {
+        PendingSample *samples = &series->pendingSamples[i];
+        timestamp_t nextFirstTS;
+        size_t pos = SeriesWriteChunkPos(series, samples[0].sample.timestamp);
+        SeriesChunkAt(series, pos, samples[0].sample.timestamp, &nextFirstTS);
+        Chunk_t *chunk = SeriesChunkForWrite(series, pos);
+        size_t count = 1;
+        while (i + count < series->pendingCount &&
+               samples[count].sample.timestamp < nextFirstTS) {
+            count++;
+        }
+
+        timestamp_t chunkFirstTS = SeriesChunkFirstTS(series, pos);
+        int size = 0;
+        size_t before = SeriesChunkBytes(series, chunk);
+        // BLOCK samples are checked for duplicates before they're buffered, the merge can't fail
+        if (funcs->MergeSamples(chunk, samples, count, &size) == CR_OK) {
+            SeriesAccount(series, 0, size, 0);
+            SeriesChunkResized(series, chunk, before);
+            SeriesReindexChunk(series, chunk, chunkFirstTS);
+            SeriesSplitOversizedChunk(series, chunk);
+            SeriesChunksRewritten(series, chunkFirstTS);
+        }
+        i += count;
+    }
+    free(series->pendingSamples);
+    series->pendingSamples = NULL;
+    series->pendingCount = 0;
+}
+
+/*
+ * Out of order samples are buffered instead of being upserted one by one, as each upsert costs a
+ * rewrite of the whole chunk. Samples that must update the last sample, or that must be propagated
+ * to compactions, are upserted right away.
+ */
+static bool SeriesCanDeferUpsert(Series *series, timestamp_t timestamp) {
+    return series->funcs->MergeSamples != NULL && series->rules == NULL &&
+           timestamp < series->lastTimestamp;
+}
+
+static bool SeriesChunksHaveTimestamp(Series *series, timestamp_t timestamp) {
+    ChunkFuncs *funcs = series->funcs;
+    ChunkIterFuncs iterFuncs;
+    timestamp_t nextFirstTS;
+    Chunk_t *chunk = SeriesFindChunk(series, timestamp, &nextFirstTS);
+    ChunkIterStorage storage = { 0 };
+    ChunkIter_t *iter = funcs->InitChunkIterator(chunk, CHUNK_ITER_OP_NONE, &iterFuncs, &storage);
+    iterFuncs.Seek(iter, timestamp);
+
+    Sample sample;
+    bool found = false;
+    while (iterFuncs.GetNext(iter, &sample) == CR_OK && sample.timestamp <= timestamp) {
+        if (sample.timestamp == timestamp) {
+            found = true;
+            break;
+        }
+    }
+    iterFuncs.Release(iter);
+    return found;
+}
+
+static int SeriesAddPendingSample(Series *series,
+                                  timestamp_t timestamp,
+                                  double value,
+                                  DuplicatePolicy policy) {
+    size_t lo = 0, hi = series->pendingCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (series->pendingSamples[mid].sample.timestamp < timestamp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < series->pendingCount && series->pendingSamples[lo].sample.timestamp == timestamp) {
+        PendingSample *pending = &series->pendingSamples[lo];
+        Sample sample = { .timestamp = timestamp, .value = value };
+        if (policy == DP_BLOCK) {
+            return REDISMODULE_ERR;
+        }
+        // Applying a policy twice is the same as applying it once on the combined sample. A LAST
+        // sample discards whatever came before it.
+        if (pending->duplicatePolicy == policy) {
+            handleDuplicateSample(policy, pending->sample, &sample);
+            pending->sample = sample;
+            return REDISMODULE_OK;
+        } else if (policy == DP_LAST) {
+            pending->sample = sample;
+            pending->duplicatePolicy = policy;
+            return REDISMODULE_OK;
+        }
+        SeriesFlushPendingSamples(series);
+        lo = 0;
+    } else if (policy == DP_BLOCK && SeriesChunksHaveTimestamp(series, timestamp)) {
+        return REDISMODULE_ERR;
+    }
+
+    if (series->pendingCount == PENDING_SAMPLES_MAX) {
+        SeriesFlushPendingSamples(series);
+        lo = 0;
+    }
+    if (series->pendingSamples == NULL) {
+        series->pendingSamples = malloc(PENDING_SAMPLES_MAX * sizeof(PendingSample));
+    }
+    memmove(&series->pendingSamples[lo + 1],
+            &series->pendingSamples[lo],
+            (series->pendingCount - lo) * sizeof(PendingSample));
+    series->pendingSamples[lo].sample.timestamp = timestamp;
+    series->pendingSamples[lo].sample.value = value;
+    series->pendingSamples[lo].duplicatePolicy = policy;
+    series->pendingCount++;
+    return REDISMODULE_OK;
+}
+
+int SeriesUpsertSample(Series *series,
+                       api_timestamp_t timestamp,
+                       double value,
+                       DuplicatePolicy dp_override) {
+    // Use module level configuration if key level configuration doesn't exists
+    DuplicatePolicy dp_policy;
+    if (dp_override != DP_NONE) {
+        dp_policy = dp_override;
+    } else if (series->duplicatePolicy != DP_NONE) {
+        dp_policy = series->duplicatePolicy;
+    } else {
+        dp_policy = TSGlobalConfig.duplicatePolicy;
     }
-    RedisModule_FreeThreadSafeContext(ctx);
-}
+    value = Compressed_RoundSignificantDigits(value, series->significantDigits);
+    SeriesSamplesChanged(series, timestamp < series->lastTimestamp);
+
+    if (SeriesCanDeferUpsert(series, timestamp)) {
+        TRACE_PROBE2(upsert_deferred, timestamp, series->pendingCount);
+        return SeriesAddPendingSample(series, timestamp, value, dp_policy);
+    }
+    SeriesFlushPendingSamples(series);
 
-int SeriesUpsertSample(Series *series,
-                       api_timestamp_t timestamp,
-                       double value,
-                       DuplicatePolicy dp_override) {
     bool latestChunk = true;
-    void *chunkKey = NULL;
     ChunkFuncs *funcs = series->funcs;
     Chunk_t *chunk = series->lastChunk;
     timestamp_t chunkFirstTS = funcs->GetFirstTimestamp(series->lastChunk);
 
-    if (timestamp < chunkFirstTS && RedisModule_DictSize(series->chunks) > 1) {
+    if (series->chunkTimeWindow > 0) {
+        size_t pos = SeriesWriteChunkPos(series, timestamp);
+        chunk = SeriesChunkForWrite(series, pos);
+        chunkFirstTS = SeriesChunkFirstTS(series, pos);
+        latestChunk = chunk == series->lastChunk;
+    } else if (timestamp < chunkFirstTS && ChunkDir_Count(&series->chunks) > 1) {
         // Upsert in an older chunk
         latestChunk = false;
-        timestamp_t rax_key;
-        seriesEncodeTimestamp(&rax_key, timestamp);
-        RedisModuleDictIter *dictIter =
-            RedisModule_DictIteratorStartC(series->chunks, "<=", &rax_key, sizeof(rax_key));
-        chunkKey = RedisModule_DictNextC(dictIter, NULL, (void *)&chunk);
-        if (chunkKey == NULL) {
-            RedisModule_DictIteratorReseekC(dictIter, "^", NULL, 0);
-            chunkKey = RedisModule_DictNextC(dictIter, NULL, (void *)&chunk);
-        }
-        RedisModule_DictIteratorStop(dictIter);
-        if (chunkKey == NULL) {
-            return REDISMODULE_ERR;
-        }
+        chunk = SeriesChunkForWrite(series, ChunkDir_Find(&series->chunks, timestamp));
         chunkFirstTS = funcs->GetFirstTimestamp(chunk);
     }
+    SeriesChunksRewritten(series, chunkFirstTS);
 
     // Split chunks
     if (funcs->GetChunkSize(chunk, false) > series->chunkSizeBytes * SPLIT_FACTOR) {
+        size_t before = SeriesChunkBytes(series, chunk);
+        TRACE_PROBE2(chunk_split_start, funcs->GetNumOfSample(chunk), before);
         Chunk_t *newChunk = funcs->SplitChunk(chunk);
         if (newChunk == NULL) {
             return REDISMODULE_ERR;
         }
         timestamp_t newChunkFirstTS = funcs->GetFirstTimestamp(newChunk);
-        dictOperator(series->chunks, newChunk, newChunkFirstTS, DICT_OP_SET);
+        SeriesSplitDone(series, chunk, newChunk, before);
         if (timestamp >= newChunkFirstTS) {
             chunk = newChunk;
             chunkFirstTS = newChunkFirstTS;
@@ -402,57 +1294,257 @@ int SeriesUpsertSample(Series *series,
     };
 
     int size = 0;
-
-    // Use module level configuration if key level configuration doesn't exists
-    DuplicatePolicy dp_policy;
-    if (dp_override != DP_NONE) {
-        dp_policy = dp_override;
-    } else if (series->duplicatePolicy != DP_NONE) {
-        dp_policy = series->duplicatePolicy;
-    } else {
-        dp_policy = TSGlobalConfig.duplicatePolicy;
-    }
-
+    size_t before = SeriesChunkBytes(series, chunk);
+    // a compressed chunk is re-encoded from the sample on
+    TRACE_PROBE3(upsert_start, timestamp, funcs->GetNumOfSample(chunk), latestChunk);
     ChunkResult rv = funcs->UpsertSample(&uCtx, &size, dp_policy);
+    TRACE_PROBE2(upsert_done, rv, size);
+    SeriesChunkResized(series, chunk, before);
     if (rv == CR_OK) {
-        series->totalSamples += size;
+        SeriesAccount(series, 0, size, 0);
         if (timestamp == series->lastTimestamp) {
             series->lastValue = uCtx.sample.value;
         }
-        timestamp_t chunkFirstTSAfterOp = funcs->GetFirstTimestamp(uCtx.inChunk);
-        if (chunkFirstTSAfterOp != chunkFirstTS) {
-            // update chunk in dictionary if first timestamp changed
-            if (dictOperator(series->chunks, NULL, chunkFirstTS, DICT_OP_DEL) == REDISMODULE_ERR) {
-                dictOperator(series->chunks, NULL, 0, DICT_OP_DEL);
-            }
-            dictOperator(series->chunks, uCtx.inChunk, chunkFirstTSAfterOp, DICT_OP_SET);
-        }
+        SeriesReindexChunk(series, uCtx.inChunk, chunkFirstTS);
 
-        upsertCompaction(series, &uCtx);
+        upsertCompaction(series, &uCtx, size);
     }
     return rv;
 }
 
+// Sizes the next chunk of an adaptive series after `fullChunk`, the chunk that just filled up
+static void SeriesAdaptChunkSize(Series *series, Chunk_t *fullChunk) {
+    if (!(series->options & SERIES_OPT_ADAPTIVE_CHUNK_SIZE)) {
+        return;
+    }
+    ChunkFuncs *funcs = series->funcs;
+    size_t size = funcs->GetChunkSize(fullChunk, false);
+    timestamp_t span = funcs->GetLastTimestamp(fullChunk) - funcs->GetFirstTimestamp(fullChunk);
+    long long target = span > 0 ? (long long)(size * ADAPTIVE_CHUNK_TARGET_SPAN_MS / span)
+                                : ADAPTIVE_CHUNK_MAX_BYTES;
+    // at most double or halve per chunk, a burst alone doesn't size the chunks
+    target = max(min(target, series->chunkSizeBytes * 2), series->chunkSizeBytes / 2);
+    target = max(min(target, ADAPTIVE_CHUNK_MAX_BYTES), ADAPTIVE_CHUNK_MIN_BYTES);
+    // rounding up to the pool size classes costs no memory
+    series->chunkSizeBytes = ChunkPool_AllocatedSize(target);
+}
+
 int SeriesAddSample(Series *series, api_timestamp_t timestamp, double value) {
+    value = Compressed_RoundSignificantDigits(value, series->significantDigits);
+    SeriesSamplesChanged(series, false);
     // backfilling or update
     Sample sample = { .timestamp = timestamp, .value = value };
-    ChunkResult ret = series->funcs->AddSample(series->lastChunk, &sample);
+    Chunk_t *chunk = series->lastChunk;
+    size_t before = SeriesChunkBytes(series, chunk);
+    // a sample of the next window starts a new chunk
+    bool windowEnded = SeriesChunkOutOfWindow(series, chunk, timestamp);
+    ChunkResult ret = windowEnded ? CR_END : series->funcs->AddSample(chunk, &sample);
 
     if (ret == CR_END) {
-        // When a new chunk is created trim the series
-        SeriesTrim(series);
+        if (series->funcs->FlushChunk != NULL) {
+            series->funcs->FlushChunk(chunk);
+        }
+        SeriesChunkResized(series, chunk, before);
+        if (!windowEnded) {
+            SeriesAdaptChunkSize(series, series->lastChunk);
+        }
+        // When a new chunk is created trim the series, a longer backlog is left to the sweeper
+        SeriesFlushPendingSamples(series);
+        size_t trimmed;
+        if (SeriesTrim(series, RETENTION_TRIM_INLINE_CHUNKS, &trimmed)) {
+            SeriesScheduleTrim(series);
+        }
 
-        Chunk_t *newChunk = series->funcs->NewChunk(series->chunkSizeBytes);
-        dictOperator(series->chunks, newChunk, timestamp, DICT_OP_SET);
-        ret = series->funcs->AddSample(newChunk, &sample);
-        series->lastChunk = newChunk;
+        chunk = series->funcs->NewChunk(series->chunkSizeBytes);
+        SeriesAddChunk(series, timestamp, chunk);
+        before = SeriesChunkBytes(series, chunk);
+        ret = series->funcs->AddSample(chunk, &sample);
+        series->lastChunk = chunk;
+        if (SeriesHasOldChunksToSweep()) {
+            // the chunks that turned cold are sealed or offloaded in the background
+            SeriesScheduleTrim(series);
+        }
     }
     series->lastTimestamp = timestamp;
     series->lastValue = value;
-    series->totalSamples++;
+    SeriesAccount(series, 0, 1, (long long)SeriesChunkBytes(series, chunk) - (long long)before);
     return TSDB_OK;
 }
 
+int SeriesUpdateLastSample(Series *series) {
+    series->lastTimestamp = 0;
+    series->lastValue = 0;
+    if (series->totalSamples == 0) {
+        return TSDB_OK;
+    }
+    SeriesIterator iterator = SeriesQuery(series, 0, UINT64_MAX, true);
+    Sample sample;
+    int rv = SeriesIteratorGetNext(&iterator, &sample) == CR_OK ? TSDB_OK : TSDB_ERROR;
+    SeriesIteratorClose(&iterator);
+    if (rv == TSDB_OK) {
+        series->lastTimestamp = sample.timestamp;
+        series->lastValue = sample.value;
+    }
+    return rv;
+}
+
+/*
+ * Brings the compactions up to date with the deletion of [start, end]. The buckets within the
+ * range are deleted from the destinations at once, and only the buckets at both ends of the range,
+ * when they kept samples outside of it, are aggregated again. A rule whose current bucket was
+ * reached continues from the bucket of the new last sample.
+ */
+static void deleteCompaction(Series *series, timestamp_t start, timestamp_t end) {
+    // the buckets read back from the destinations must be there
+    CompactionQueueFlush(NULL);
+    RedisModuleCtx *ctx = NULL;
+    for (CompactionRule *rule = series->rules; rule != NULL; rule = rule->nextRule) {
+        const timestamp_t timeBucket = rule->timeBucket;
+        const timestamp_t firstBucket = CalcWindowStart(start, timeBucket);
+        const timestamp_t lastBucket = CalcWindowStart(end, timeBucket);
+
+        if (ctx == NULL) {
+            ctx = RedisModule_GetThreadSafeContext(NULL);
+        }
+        RedisModuleKey *key;
+        Series *destSeries;
+        if (!GetSeries(ctx, rule->destKey, &key, &destSeries, REDISMODULE_READ)) {
+            RedisModule_Log(ctx, "verbose", "%s", "Failed to retrieve downsample series");
+            continue;
+        }
+
+        // the buckets at the ends of the range that were compacted, and kept some samples
+        timestamp_t edges[2];
+        size_t edgeCount = 0;
+        for (timestamp_t bucket = firstBucket;; bucket = lastBucket) {
+            if ((bucket < start || end - bucket < timeBucket - 1) &&
+                bucket < rule->startCurrentTimeBucket &&
+                SeriesHasSamples(destSeries, bucket, bucket)) {
+                edges[edgeCount++] = bucket;
+            }
+            if (bucket == lastBucket) {
+                break;
+            }
+        }
+        SeriesDelRange(destSeries, firstBucket, lastBucket);
+
+        if (rule->startCurrentTimeBucket != -1LL && lastBucket >= rule->startCurrentTimeBucket) {
+            if (series->totalSamples == 0) {
+                rule->aggClass->resetContext(rule->aggContext);
+                rule->startCurrentTimeBucket = -1LL;
+            } else {
+                // the bucket of the last sample is open again
+                timestamp_t currentBucket = CalcWindowStart(series->lastTimestamp, timeBucket);
+                if (currentBucket < firstBucket) {
+                    SeriesDelRange(destSeries, currentBucket, currentBucket);
+                }
+                rule->startCurrentTimeBucket = currentBucket;
+                SeriesCalcRange(series, currentBucket, UINT64_MAX, rule, NULL);
+            }
+        }
+
+        for (size_t i = 0; i < edgeCount; i++) {
+            const timestamp_t bucket = edges[i];
+            double val = 0;
+            if (bucket >= rule->startCurrentTimeBucket ||
+                !SeriesHasSamples(series, bucket, bucket + timeBucket - 1) ||
+                SeriesCalcRange(series, bucket, bucket + timeBucket - 1, rule, &val) ==
+                    TSDB_ERROR) {
+                continue;
+            }
+            if (destSeries->totalSamples == 0) {
+                SeriesAddSample(destSeries, bucket, val);
+            } else {
+                SeriesUpsertSample(destSeries, bucket, val, DP_LAST);
+            }
+        }
+        if (lastBucket < rule->startCurrentTimeBucket) {
+            recompactNextBucket(series, rule, destSeries, lastBucket);
+        }
+        RedisModule_CloseKey(key);
+    }
+    if (ctx != NULL) {
+        RedisModule_FreeThreadSafeContext(ctx);
+    }
+}
+
+size_t SeriesDelRange(Series *series, timestamp_t startTs, timestamp_t endTs) {
+    SeriesFlushPendingSamples(series);
+    if (series->totalSamples == 0 || startTs > endTs) {
+        return 0;
+    }
+    ChunkFuncs *funcs = series->funcs;
+    ChunkDir *dir = &series->chunks;
+
+    // the chunks overlapping the range
+    size_t lo = SeriesFindChunkPos(series, startTs);
+    if (funcs->GetLastTimestamp(ChunkDir_Get(dir, lo)) < startTs) {
+        lo++;
+    }
+    size_t hi = lo;
+    while (hi < ChunkDir_Count(dir) && funcs->GetFirstTimestamp(ChunkDir_Get(dir, hi)) <= endTs) {
+        hi++;
+    }
+    if (lo == hi) {
+        return 0;
+    }
+
+    // only the chunks at the ends of the range keep samples
+    Chunk_t *edges[2];
+    size_t edgeCount = 0;
+    if (funcs->GetFirstTimestamp(ChunkDir_Get(dir, lo)) < startTs) {
+        edges[edgeCount++] = SeriesChunkForWrite(series, lo++);
+    }
+    if (lo < hi && funcs->GetLastTimestamp(ChunkDir_Get(dir, hi - 1)) > endTs) {
+        edges[edgeCount++] = SeriesChunkForWrite(series, --hi);
+    }
+
+    // the chunks in between are dropped as a whole
+    size_t deleted = 0;
+    bool lastChunkFreed = false;
+    for (size_t pos = lo; pos < hi; pos++) {
+        Chunk_t *chunk = ChunkDir_Get(dir, pos);
+        size_t samples = funcs->GetNumOfSample(chunk);
+        SeriesAccount(series, -1, -(long long)samples, -(long long)SeriesChunkBytes(series, chunk));
+        deleted += samples;
+        lastChunkFreed = lastChunkFreed || chunk == series->lastChunk;
+        SeriesFreeChunk(series, chunk);
+    }
+    ChunkDir_DeleteRange(dir, lo, hi - lo);
+
+    for (size_t i = 0; i < edgeCount; i++) {
+        Chunk_t *chunk = edges[i];
+        timestamp_t chunkFirstTS = funcs->GetFirstTimestamp(chunk);
+        size_t before = SeriesChunkBytes(series, chunk);
+        size_t removed = funcs->DelRange(chunk, startTs, endTs);
+        SeriesAccount(series, 0, -(long long)removed, 0);
+        SeriesChunkResized(series, chunk, before);
+        SeriesReindexChunk(series, chunk, chunkFirstTS);
+        deleted += removed;
+    }
+
+    if (ChunkDir_Count(dir) == 0) {
+        // like a new series
+        Chunk_t *newChunk = funcs->NewChunk(series->chunkSizeBytes);
+        SeriesAddChunk(series, 0, newChunk);
+        series->lastChunk = newChunk;
+    } else if (lastChunkFreed) {
+        // the new last chunk is appended to in place, it is no longer shared
+        series->lastChunk = NULL;
+        series->lastChunk = SeriesChunkForWrite(series, ChunkDir_Count(dir) - 1);
+    }
+    if (endTs >= series->lastTimestamp) {
+        SeriesUpdateLastSample(series);
+    }
+    SeriesSamplesChanged(series, true);
+    SeriesChunksRewritten(series, startTs);
+
+    if (deleted > 0 && series->rules != NULL) {
+        deleteCompaction(series, startTs, endTs);
+    }
+    return deleted;
+}
+
 static int SeriesChunkIteratorOptions(SeriesIterator *iter) {
     int options = 0;
     if (iter->reverse) {
@@ -461,52 +1553,287 @@ static int SeriesChunkIteratorOptions(SeriesIterator *iter) {
     return options;
 }
 
+static bool SeriesIteratorChunkWithinRange(SeriesIterator *iter, Chunk_t *chunk) {
+    ChunkFuncs *funcs = iter->series->funcs;
+    return funcs->GetNumOfSample(chunk) > 0 &&
+           funcs->GetFirstTimestamp(chunk) >= iter->minTimestamp &&
+           funcs->GetLastTimestamp(chunk) <= iter->maxTimestamp;
+}
+
+// Opens an iterator on `chunk`, skipping what precedes the query range
+static void SeriesIteratorOpenChunk(SeriesIterator *iter, Chunk_t *chunk) {
+    ChunkFuncs *funcs = iter->series->funcs;
+    iter->currentChunk = chunk;
+    iter->chunkRead = 0;
+    iter->chunkDrained = false;
+    iter->chunkWithinRange = SeriesIteratorChunkWithinRange(iter, chunk);
+    funcs->InitChunkIterator(
+        chunk, SeriesChunkIteratorOptions(iter), &iter->chunkIteratorFuncs, &iter->chunkIterator);
+    if (!iter->reverse) {
+        if (funcs->GetFirstTimestamp(chunk) < iter->minTimestamp) {
+            iter->chunkIteratorFuncs.Seek(&iter->chunkIterator, iter->minTimestamp);
+        }
+    } else {
+        if (funcs->GetLastTimestamp(chunk) > iter->maxTimestamp) {
+            iter->chunkIteratorFuncs.Seek(&iter->chunkIterator, iter->maxTimestamp);
+        }
+    }
+}
+
+static inline bool SeriesIteratorKeepsValue(const SeriesIterator *iter, double value) {
+    return !iter->filter.enabled || (value >= iter->filter.min && value <= iter->filter.max);
+}
+
+// Whether the summary of a chunk within the query range tells none of its values is kept
+static bool SeriesIteratorPrunesChunk(const SeriesIterator *iter, Chunk_t *chunk) {
+    ChunkFuncs *funcs = iter->series->funcs;
+    if (!iter->filter.enabled || funcs->GetNumOfSample(chunk) == 0 ||
+        funcs->GetFirstTimestamp(chunk) > iter->maxTimestamp ||
+        funcs->GetLastTimestamp(chunk) < iter->minTimestamp) {
+        return false;
+    }
+    const ChunkSummary *summary = funcs->GetSummary(chunk);
+    // NaN values leave the bounds unknown
+    if (isnan(summary->min) || isnan(summary->max)) {
+        return false;
+    }
+    return summary->max < iter->filter.min || summary->min > iter->filter.max;
+}
+
+/*
+ * Returns the chunk following the current one in iteration order, NULL after the last one, and
+ * passes over the chunks pruned by the value filter. The chunk after it is prefetched, its header
+ * is read as soon as this one is done.
+ */
+static Chunk_t *SeriesIteratorStepChunk(SeriesIterator *iter) {
+    const ChunkDir *chunks = &iter->series->chunks;
+    size_t count = ChunkDir_Count(chunks);
+    Chunk_t *chunk;
+    do {
+        if (iter->reverse ? iter->chunkPos == 0 : iter->chunkPos + 1 >= count) {
+            return NULL;
+        }
+        iter->chunkPos = iter->reverse ? iter->chunkPos - 1 : iter->chunkPos + 1;
+        size_t nextPos = iter->reverse ? iter->chunkPos - 1 : iter->chunkPos + 1;
+        if (nextPos < count) { // wraps around before the first chunk
+            __builtin_prefetch(ChunkDir_Get(chunks, nextPos));
+        }
+        chunk = ChunkDir_Get(chunks, iter->chunkPos);
+    } while (SeriesIteratorPrunesChunk(iter, chunk));
+    return chunk;
+}
+
+// Moves to the next chunk in iteration order, unless it lies past the query range
+static bool SeriesIteratorNextChunk(SeriesIterator *iter) {
+    ChunkFuncs *funcs = iter->series->funcs;
+    Chunk_t *chunk = SeriesIteratorStepChunk(iter);
+    if (chunk == NULL || funcs->GetFirstTimestamp(chunk) > iter->maxTimestamp ||
+        funcs->GetLastTimestamp(chunk) < iter->minTimestamp) {
+        iter->reachedEnd = true; // No more chunks or they out of range
+        return false;
+    }
+    SeriesIteratorOpenChunk(iter, chunk);
+    return true;
+}
+
+size_t SeriesRangeSamples(Series *series, timestamp_t start_ts, timestamp_t end_ts) {
+    size_t samples = series->pendingCount;
+    const size_t count = ChunkDir_Count(&series->chunks);
+    for (size_t pos = SeriesFindChunkPos(series, start_ts); pos < count; pos++) {
+        Chunk_t *chunk = ChunkDir_Get(&series->chunks, pos);
+        size_t chunkSamples = series->funcs->GetNumOfSample(chunk);
+        if (chunkSamples == 0 || series->funcs->GetLastTimestamp(chunk) < start_ts) {
+            continue;
+        }
+        if (series->funcs->GetFirstTimestamp(chunk) > end_ts) {
+            break;
+        }
+        samples += chunkSamples;
+    }
+    return samples;
+}
+
 // Initiates SeriesIterator, find the correct chunk and initiate a ChunkIterator
 SeriesIterator SeriesQuery(Series *series, timestamp_t start_ts, timestamp_t end_ts, bool rev) {
+    return SeriesQueryFiltered(series, start_ts, end_ts, rev, NULL);
+}
+
+SeriesIterator SeriesQueryFiltered(Series *series,
+                                   timestamp_t start_ts,
+                                   timestamp_t end_ts,
+                                   bool rev,
+                                   const ValueFilter *filter) {
+    SeriesFlushPendingSamples(series);
+
     SeriesIterator iter = { 0 };
     iter.series = series;
     iter.minTimestamp = start_ts;
     iter.maxTimestamp = end_ts;
     iter.reverse = rev;
-
-    timestamp_t rax_key;
-    ChunkFuncs *funcs = series->funcs;
-
-    if (iter.reverse == false) {
-        iter.DictGetNext = RedisModule_DictNextC;
-        seriesEncodeTimestamp(&rax_key, iter.minTimestamp);
-    } else {
-        iter.DictGetNext = RedisModule_DictPrevC;
-        seriesEncodeTimestamp(&rax_key, iter.maxTimestamp);
+    if (filter != NULL) {
+        iter.filter = *filter;
     }
 
-    // get first chunk within query range
-    iter.dictIter = RedisModule_DictIteratorStartC(series->chunks, "<=", &rax_key, sizeof(rax_key));
-    if (!iter.DictGetNext(iter.dictIter, NULL, (void *)&iter.currentChunk)) {
-        RedisModule_DictIteratorReseekC(iter.dictIter, "^", NULL, 0);
-        iter.DictGetNext(iter.dictIter, NULL, (void *)&iter.currentChunk);
+    // get first chunk within query range, the last one is opened when all are pruned
+    iter.chunkPos = SeriesFindChunkPos(series, rev ? end_ts : start_ts);
+    size_t count = ChunkDir_Count(&series->chunks);
+    while (SeriesIteratorPrunesChunk(&iter, ChunkDir_Get(&series->chunks, iter.chunkPos)) &&
+           (rev ? iter.chunkPos > 0 : iter.chunkPos + 1 < count)) {
+        iter.chunkPos = rev ? iter.chunkPos - 1 : iter.chunkPos + 1;
     }
-
-    iter.chunkIterator = funcs->NewChunkIterator(
-        iter.currentChunk, SeriesChunkIteratorOptions(&iter), &iter.chunkIteratorFuncs);
+    SeriesIteratorOpenChunk(&iter, ChunkDir_Get(&series->chunks, iter.chunkPos));
     return iter;
 }
 
 // this is an internal function that routes the next call to the appropriate chunk iterator function
 static ChunkResult SeriesGetNext(SeriesIterator *iter, Sample *sample) {
     if (iter->reverse == false) {
-        return iter->chunkIteratorFuncs.GetNext(iter->chunkIterator, sample);
+        return iter->chunkIteratorFuncs.GetNext(&iter->chunkIterator, sample);
     } else {
         if (iter->chunkIteratorFuncs.GetPrev == NULL) {
             return CR_ERR;
         }
-        return iter->chunkIteratorFuncs.GetPrev(iter->chunkIterator, sample);
+        return iter->chunkIteratorFuncs.GetPrev(&iter->chunkIterator, sample);
+    }
+}
+
+// Keeps the samples of the batch whose value passes the filter
+static size_t SeriesFilterBatchValues(SeriesIterator *iter,
+                                      timestamp_t *timestamps,
+                                      double *values,
+                                      size_t count) {
+    if (!iter->filter.enabled) {
+        return count;
+    }
+    size_t matched = 0;
+    for (size_t i = 0; i < count; ++i) {
+        timestamps[matched] = timestamps[i];
+        values[matched] = values[i];
+        matched += SeriesIteratorKeepsValue(iter, values[i]);
+    }
+    return matched;
+}
+
+// Keeps the samples of the batch that lie within the query range. Samples are sorted in iteration
+// order, so out of range samples can only be found at both ends of the batch. A chunk lying
+// within the range is not checked at all.
+static size_t SeriesFilterBatch(SeriesIterator *iter,
+                                timestamp_t *timestamps,
+                                double *values,
+                                size_t count) {
+    if (iter->chunkWithinRange) {
+        return SeriesFilterBatchValues(iter, timestamps, values, count);
+    }
+    const timestamp_t minTS = iter->minTimestamp;
+    const timestamp_t maxTS = iter->maxTimestamp;
+    size_t before = 0, within = 0;
+    if (!iter->reverse) {
+        for (size_t i = 0; i < count; ++i) {
+            before += timestamps[i] < minTS;
+            within += timestamps[i] <= maxTS;
+        }
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            before += timestamps[i] > maxTS;
+            within += timestamps[i] >= minTS;
+        }
+    }
+    if (within < count) {
+        iter->reachedEnd = true;
+    }
+    if (within <= before) {
+        return 0;
+    }
+    size_t kept = within - before;
+    if (before > 0) {
+        memmove(timestamps, timestamps + before, kept * sizeof(*timestamps));
+        memmove(values, values + before, kept * sizeof(*values));
+    }
+    return SeriesFilterBatchValues(iter, timestamps, values, kept);
+}
+
+// The timestamp of the last sample of the current chunk in the order of the iterator
+static inline timestamp_t SeriesIteratorChunkEnd(const SeriesIterator *iter) {
+    ChunkFuncs *funcs = iter->series->funcs;
+    return iter->reverse ? funcs->GetFirstTimestamp(iter->currentChunk)
+                         : funcs->GetLastTimestamp(iter->currentChunk);
+}
+
+size_t SeriesIteratorGetNextBatch(SeriesIterator *iterator,
+                                  timestamp_t *timestamps,
+                                  double *values,
+                                  size_t max) {
+    size_t count = 0;
+    while (count < max && !iterator->reachedEnd) {
+        size_t read;
+        if (!iterator->reverse) {
+            read = iterator->chunkIteratorFuncs.GetNextBatch(
+                &iterator->chunkIterator, timestamps + count, values + count, max - count);
+        } else {
+            read = iterator->chunkIteratorFuncs.GetPrevBatch(
+                &iterator->chunkIterator, timestamps + count, values + count, max - count);
+        }
+        if (read == 0) { // Reached the end of the chunk
+            iterator->chunkDrained = true;
+            if (count > 0) {
+                // a batch never spans two chunks, so callers can peek at the next one
+                break;
+            }
+            if (!SeriesIteratorNextChunk(iterator)) {
+                break;
+            }
+            continue;
+        }
+        iterator->chunkRead += read;
+        iterator->chunkDrained = timestamps[count + read - 1] == SeriesIteratorChunkEnd(iterator);
+        count += SeriesFilterBatch(iterator, timestamps + count, values + count, read);
     }
+    return count;
+}
+
+bool SeriesIteratorPeekChunk(SeriesIterator *iterator,
+                             ChunkSummary *summary,
+                             timestamp_t *first,
+                             timestamp_t *last) {
+    ChunkFuncs *funcs = iterator->series->funcs;
+    if (iterator->reachedEnd) {
+        return false;
+    }
+    // the current chunk was entirely read, e.g. the one the range starts in, the next one may
+    // still be untouched
+    if (iterator->chunkDrained && !SeriesIteratorNextChunk(iterator)) {
+        return false;
+    }
+    if (!SeriesIteratorChunkWithinRange(iterator, iterator->currentChunk) ||
+        iterator->chunkRead != 0) {
+        return false;
+    }
+
+    Chunk_t *chunk = iterator->currentChunk;
+    *summary = *funcs->GetSummary(chunk);
+    if (iterator->filter.enabled && !(SeriesIteratorKeepsValue(iterator, summary->min) &&
+                                      SeriesIteratorKeepsValue(iterator, summary->max))) {
+        return false;
+    }
+    *first = funcs->GetFirstTimestamp(chunk);
+    *last = funcs->GetLastTimestamp(chunk);
+    if (iterator->reverse) {
+        double value = summary->first;
+        summary->first = summary->last;
+        summary->last = value;
+        timestamp_t ts = *first;
+        *first = *last;
+        *last = ts;
+    }
+    return true;
+}
+
+void SeriesIteratorSkipChunk(SeriesIterator *iterator) {
+    SeriesIteratorNextChunk(iterator);
 }
 
 void SeriesIteratorClose(SeriesIterator *iterator) {
-    iterator->chunkIteratorFuncs.Free(iterator->chunkIterator);
-    RedisModule_DictIteratorStop(iterator->dictIter);
+    iterator->chunkIteratorFuncs.Release(&iterator->chunkIterator);
 }
 
 // Fills sample from chunk. If all samples were extracted from the chunk, we
@@ -519,14 +1846,13 @@ ChunkResult SeriesIteratorGetNext(SeriesIterator *iterator, Sample *currentSampl
     while (true) {
         res = SeriesGetNext(iterator, currentSample);
         if (res == CR_END) { // Reached the end of the chunk
-            if (!iterator->DictGetNext(iterator->dictIter, NULL, (void *)&currentChunk) ||
+            currentChunk = SeriesIteratorStepChunk(iterator);
+            if (currentChunk == NULL ||
                 funcs->GetFirstTimestamp(currentChunk) > iterator->maxTimestamp ||
                 funcs->GetLastTimestamp(currentChunk) < iterator->minTimestamp) {
                 return CR_END; // No more chunks or they out of range
             }
-            iterator->chunkIteratorFuncs.Free(iterator->chunkIterator);
-            iterator->chunkIterator = funcs->NewChunkIterator(
-                currentChunk, SeriesChunkIteratorOptions(iterator), &iterator->chunkIteratorFuncs);
+            SeriesIteratorOpenChunk(iterator, currentChunk);
             if (SeriesGetNext(iterator, currentSample) != CR_OK) {
                 return CR_END;
             }
@@ -534,33 +1860,55 @@ ChunkResult SeriesIteratorGetNext(SeriesIterator *iterator, Sample *currentSampl
             return CR_ERR;
         }
 
-        // check timestamp is within range
-        if (!iterator->reverse) {
-            // forward range handling
-            if (currentSample->timestamp < iterator->minTimestamp) {
-                // didn't reach the starting point of the requested range
-                continue;
-            }
-            if (currentSample->timestamp > iterator->maxTimestamp) {
-                // reached the end of the requested range
-                return CR_END;
-            }
-        } else {
-            // reverse range handling
-            if (currentSample->timestamp > iterator->maxTimestamp) {
-                // didn't reach our starting range
-                continue;
-            }
-            if (currentSample->timestamp < iterator->minTimestamp) {
-                // didn't reach the starting point of the requested range
-                return CR_END;
+        // check timestamp is within range, unless the whole chunk is
+        if (!iterator->chunkWithinRange) {
+            if (!iterator->reverse) {
+                // forward range handling
+                if (currentSample->timestamp < iterator->minTimestamp) {
+                    // didn't reach the starting point of the requested range
+                    continue;
+                }
+                if (currentSample->timestamp > iterator->maxTimestamp) {
+                    // reached the end of the requested range
+                    return CR_END;
+                }
+            } else {
+                // reverse range handling
+                if (currentSample->timestamp > iterator->maxTimestamp) {
+                    // didn't reach our starting range
+                    continue;
+                }
+                if (currentSample->timestamp < iterator->minTimestamp) {
+                    // didn't reach the starting point of the requested range
+                    return CR_END;
+                }
             }
         }
+        if (!SeriesIteratorKeepsValue(iterator, currentSample->value)) {
+            continue;
+        }
         return CR_OK;
     }
     return CR_OK;
 }
 
+bool SeriesPrecedingValue(Series *series,
+                          timestamp_t timestamp,
+                          const ValueFilter *filter,
+                          double *value) {
+    if (timestamp == 0) {
+        return false;
+    }
+    SeriesIterator iterator = SeriesQueryFiltered(series, 0, timestamp - 1, true, filter);
+    Sample sample;
+    bool found = SeriesIteratorGetNext(&iterator, &sample) == CR_OK;
+    SeriesIteratorClose(&iterator);
+    if (found) {
+        *value = sample.value;
+    }
+    return found;
+}
+
 CompactionRule *SeriesAddRule(Series *series,
                               RedisModuleString *destKeyStr,
                               int aggType,
@@ -569,6 +1917,8 @@ CompactionRule *SeriesAddRule(Series *series,
     if (rule == NULL) {
         return NULL;
     }
+    // compacted series upsert samples right away
+    SeriesFlushPendingSamples(series);
     if (series->rules == NULL) {
         series->rules = rule;
     } else {
@@ -644,15 +1994,152 @@ CompactionRule *NewRule(RedisModuleString *destKey, int aggType, uint64_t timeBu
     rule->aggClass = GetAggClass(aggType);
     ;
     rule->aggType = aggType;
-    rule->aggContext = rule->aggClass->createContext();
+    rule->aggContext = AggregationCreateContext(rule->aggClass, timeBucket, false);
     rule->timeBucket = timeBucket;
     rule->destKey = destKey;
     rule->startCurrentTimeBucket = -1LL;
     rule->nextRule = NULL;
+    rule->destSeries = NULL;
+    rule->destSeriesEpoch = 0;
 
     return rule;
 }
 
+// Cached destination series are only trusted when stamped with the current epoch
+static u_int64_t ruleCacheEpoch = 1;
+
+void SeriesInvalidateRuleCache(void) {
+    ruleCacheEpoch++;
+}
+
+Series *CompactionRuleGetDestSeries(RedisModuleCtx *ctx, CompactionRule *rule) {
+    if (rule->destSeriesEpoch == ruleCacheEpoch) {
+        return rule->destSeries;
+    }
+
+    RedisModuleKey *key;
+    Series *destSeries;
+    if (!SilentGetSeries(ctx, rule->destKey, &key, &destSeries, REDISMODULE_READ)) {
+        // not cached, the key may be created later on
+        return NULL;
+    }
+    RedisModule_CloseKey(key);
+    rule->destSeries = destSeries;
+    rule->destSeriesEpoch = ruleCacheEpoch;
+    return destSeries;
+}
+
+/*
+ * Buckets closed by the compaction rules and not written to their destination yet. The queue is
+ * only used on the main thread.
+ */
+typedef struct QueuedBucket
+{
+    RedisModuleString *destKey;
+    int db;
+    size_t order;
+    Sample sample;
+} QueuedBucket;
+
+static QueuedBucket *compactionQueue;
+static size_t compactionQueueCount;
+static size_t compactionQueueCapacity;
+
+void CompactionQueueAdd(RedisModuleCtx *ctx,
+                        CompactionRule *rule,
+                        timestamp_t timestamp,
+                        double value) {
+    if (compactionQueueCount == compactionQueueCapacity) {
+        compactionQueueCapacity = compactionQueueCapacity ? compactionQueueCapacity * 2 : 256;
+        compactionQueue = realloc(compactionQueue, compactionQueueCapacity * sizeof(QueuedBucket));
+    }
+    RedisModule_RetainString(NULL, rule->destKey);
+    compactionQueue[compactionQueueCount] =
+        (QueuedBucket){ .destKey = rule->destKey,
+                        .db = RedisModule_GetSelectedDb(ctx),
+                        .order = compactionQueueCount,
+                        .sample = { .timestamp = timestamp, .value = value } };
+    compactionQueueCount++;
+    if (compactionQueueCount >= COMPACTION_QUEUE_MAX) {
+        CompactionQueueFlush(ctx);
+    }
+}
+
+size_t CompactionQueueSize() {
+    return compactionQueueCount;
+}
+
+// Groups the buckets by destination, in the order they were queued
+static int compareQueuedBuckets(const void *a, const void *b) {
+    const QueuedBucket *x = a, *y = b;
+    if (x->db != y->db) {
+        return x->db < y->db ? -1 : 1;
+    }
+    if (x->destKey != y->destKey) {
+        int cmp = RedisModule_StringCompare(x->destKey, y->destKey);
+        if (cmp != 0) {
+            return cmp;
+        }
+    }
+    return x->order < y->order ? -1 : (x->order > y->order ? 1 : 0);
+}
+
+void CompactionQueueFlush(RedisModuleCtx *ctx) {
+    if (compactionQueueCount == 0) {
+        return;
+    }
+    // writing to a destination may close buckets of its own rules, which are queued anew
+    QueuedBucket *buckets = compactionQueue;
+    size_t count = compactionQueueCount;
+    compactionQueue = NULL;
+    compactionQueueCount = compactionQueueCapacity = 0;
+
+    RedisModuleCtx *flushCtx = ctx != NULL ? ctx : RedisModule_GetThreadSafeContext(NULL);
+    int selectedDb = RedisModule_GetSelectedDb(flushCtx);
+    qsort(buckets, count, sizeof(QueuedBucket), compareQueuedBuckets);
+    size_t i = 0;
+    while (i < count) {
+        size_t end = i + 1;
+        while (end < count && buckets[end].db == buckets[i].db &&
+               RedisModule_StringCompare(buckets[end].destKey, buckets[i].destKey) == 0) {
+            end++;
+        }
+
+        RedisModuleKey *key;
+        Series *destSeries;
+        RedisModule_SelectDb(flushCtx, buckets[i].db);
+        if (SilentGetSeries(flushCtx,
+                            buckets[i].destKey,
+                            &key,
+                            &destSeries,
+                            REDISMODULE_READ | REDISMODULE_WRITE)) {
+            // the destination may have been written to since
+            for (size_t j = i; j < end; j++) {
+                Sample *sample = &buckets[j].sample;
+                if (destSeries->totalSamples == 0 ||
+                    sample->timestamp > destSeries->lastTimestamp) {
+                    SeriesAddSample(destSeries, sample->timestamp, sample->value);
+                } else {
+                    SeriesUpsertSample(destSeries, sample->timestamp, sample->value, DP_LAST);
+                }
+            }
+            if (RedisModule_SignalModifiedKey) {
+                RedisModule_SignalModifiedKey(flushCtx, buckets[i].destKey);
+            }
+            RedisModule_CloseKey(key);
+        }
+        for (size_t j = i; j < end; j++) {
+            RedisModule_FreeString(NULL, buckets[j].destKey);
+        }
+        i = end;
+    }
+    RedisModule_SelectDb(flushCtx, selectedDb);
+    if (ctx == NULL) {
+        RedisModule_FreeThreadSafeContext(flushCtx);
+    }
+    free(buckets);
+}
+
 int SeriesDeleteRule(Series *series, RedisModuleString *destKey) {
     CompactionRule *rule = series->rules;
     CompactionRule *prev_rule = NULL;
@@ -692,6 +2179,17 @@ int SeriesDeleteSrcRule(Series *series, RedisModuleString *srctKey) {
     return FALSE;
 }
 
+// Seeds `context` with the sample preceding `start_ts`, for the aggregations that depend on it
+static void SeriesSeedContext(Series *series,
+                              AggregationClass *aggClass,
+                              void *context,
+                              timestamp_t start_ts) {
+    double value;
+    if (aggClass->seedContext != NULL && SeriesPrecedingValue(series, start_ts, NULL, &value)) {
+        aggClass->seedContext(context, value);
+    }
+}
+
 /*
  * This function calculate aggregation value of a range.
  *
@@ -704,15 +2202,31 @@ int SeriesCalcRange(Series *series,
                     double *val) {
     AggregationClass *aggObject = rule->aggClass;
 
-    Sample sample = { 0 };
+    timestamp_t timestamps[SERIES_ITER_BATCH_SIZE];
+    double values[SERIES_ITER_BATCH_SIZE];
+    size_t count;
     SeriesIterator iterator = SeriesQuery(series, start_ts, end_ts, false);
     if (iterator.series == NULL) {
         return TSDB_ERROR;
     }
-    void *context = aggObject->createContext();
+    void *context = AggregationCreateContext(aggObject, rule->timeBucket, false);
+    SeriesSeedContext(series, aggObject, context, start_ts);
 
-    while (SeriesIteratorGetNext(&iterator, &sample) == CR_OK) {
-        aggObject->appendValue(context, sample.value);
+    ChunkSummary summary;
+    timestamp_t first, last;
+    while (true) {
+        // chunks entirely within the range are aggregated from their summary
+        if (aggObject->appendSummary != NULL &&
+            SeriesIteratorPeekChunk(&iterator, &summary, &first, &last)) {
+            aggObject->appendSummary(context, &summary);
+            SeriesIteratorSkipChunk(&iterator);
+            continue;
+        }
+        count = SeriesIteratorGetNextBatch(&iterator, timestamps, values, SERIES_ITER_BATCH_SIZE);
+        if (count == 0) {
+            break;
+        }
+        AggregationAppendValues(aggObject, context, values, count);
     }
     SeriesIteratorClose(&iterator);
     if (val == NULL) { // just update context for current window
@@ -725,6 +2239,88 @@ int SeriesCalcRange(Series *series,
     return TSDB_OK;
 }
 
+// Appends the result of the context to the buckets, and resets it
+static void closeBucket(AggregationClass *aggClass,
+                        void *context,
+                        timestamp_t bucket,
+                        Sample **buckets,
+                        size_t *count,
+                        size_t *capacity) {
+    double value;
+    if (aggClass->finalize(context, &value) == TSDB_OK) {
+        if (*count == *capacity) {
+            *capacity = *capacity > 0 ? *capacity * 2 : 64;
+            *buckets = realloc(*buckets, *capacity * sizeof(Sample));
+        }
+        (*buckets)[(*count)++] = (Sample){ .timestamp = bucket, .value = value };
+    }
+    aggClass->resetContext(context);
+}
+
+size_t SeriesAggregateBuckets(Series *series,
+                              timestamp_t start_ts,
+                              timestamp_t end_ts,
+                              AggregationClass *aggClass,
+                              timestamp_t timeBucket,
+                              Sample **buckets) {
+    size_t count = 0, capacity = 0;
+    *buckets = NULL;
+    SeriesIterator iterator = SeriesQuery(series, start_ts, end_ts, false);
+    if (iterator.series == NULL) {
+        return 0;
+    }
+    void *context = AggregationCreateContext(aggClass, timeBucket, false);
+    SeriesSeedContext(series, aggClass, context, start_ts);
+    timestamp_t timestamps[SERIES_ITER_BATCH_SIZE];
+    double values[SERIES_ITER_BATCH_SIZE];
+    timestamp_t bucket = 0;
+    bool open = false;
+
+    ChunkSummary summary;
+    timestamp_t first, last;
+    while (true) {
+        // chunks within a single bucket are aggregated from their summary
+        if (aggClass->appendSummary != NULL &&
+            SeriesIteratorPeekChunk(&iterator, &summary, &first, &last) &&
+            CalcWindowStart(first, timeBucket) == CalcWindowStart(last, timeBucket)) {
+            if (open && CalcWindowStart(first, timeBucket) != bucket) {
+                closeBucket(aggClass, context, bucket, buckets, &count, &capacity);
+            }
+            bucket = CalcWindowStart(first, timeBucket);
+            open = true;
+            aggClass->appendSummary(context, &summary);
+            SeriesIteratorSkipChunk(&iterator);
+            continue;
+        }
+        size_t read =
+            SeriesIteratorGetNextBatch(&iterator, timestamps, values, SERIES_ITER_BATCH_SIZE);
+        if (read == 0) {
+            break;
+        }
+        size_t i = 0;
+        while (i < read) {
+            timestamp_t current = CalcWindowStart(timestamps[i], timeBucket);
+            size_t j = i + 1;
+            while (j < read && CalcWindowStart(timestamps[j], timeBucket) == current) {
+                j++;
+            }
+            if (open && current != bucket) {
+                closeBucket(aggClass, context, bucket, buckets, &count, &capacity);
+            }
+            bucket = current;
+            open = true;
+            AggregationAppendValues(aggClass, context, &values[i], j - i);
+            i = j;
+        }
+    }
+    SeriesIteratorClose(&iterator);
+    if (open) {
+        closeBucket(aggClass, context, bucket, buckets, &count, &capacity);
+    }
+    aggClass->freeContext(context);
+    return count;
+}
+
 timestamp_t CalcWindowStart(timestamp_t timestamp, size_t window) {
     return timestamp - (timestamp % window);
 }
@@ -6,8 +6,10 @@
 #ifndef TSDB_H
 #define TSDB_H
 
+#include "chunk_dir.h"
 #include "compaction.h"
 #include "consts.h"
+#include "epoch.h"
 #include "generic_chunk.h"
 #include "indexer.h"
 #include "redismodule.h"
@@ -21,6 +23,9 @@ typedef struct CompactionRule
     void *aggContext;
     struct CompactionRule *nextRule;
     timestamp_t startCurrentTimeBucket;
+    // Destination series resolved from destKey, valid while destSeriesEpoch is current
+    struct Series *destSeries;
+    u_int64_t destSeriesEpoch;
 } CompactionRule;
 
 typedef struct CreateCtx
@@ -31,15 +36,22 @@ typedef struct CreateCtx
     Label *labels;
     int options;
     DuplicatePolicy duplicatePolicy;
+    timestamp_t chunkTimeWindow;
+    u_int8_t significantDigits;
+    bool skipChunkCreation; // the caller sets the chunks, e.g. when loading from RDB
 } CreateCtx;
 
 typedef struct Series
 {
-    RedisModuleDict *chunks;
+    ChunkDir chunks;
     Chunk_t *lastChunk;
     uint64_t retentionTime;
-    short chunkSizeBytes;
+    long long chunkSizeBytes; // of the next chunk
     short options;
+    // with CHUNK_TIME_WINDOW, each chunk only holds the samples of one window of this length
+    timestamp_t chunkTimeWindow;
+    // with SIGNIFICANT_DIGITS, the values are rounded to that many digits before being stored
+    u_int8_t significantDigits;
     CompactionRule *rules;
     timestamp_t lastTimestamp;
     double lastValue;
@@ -49,24 +61,125 @@ typedef struct Series
     RedisModuleString *srcKey;
     ChunkFuncs *funcs;
     size_t totalSamples;
+    size_t chunksBytes; // memory of the chunks, see SeriesGetChunksSize
     DuplicatePolicy duplicatePolicy;
+    // out of order samples not merged into the chunks yet, sorted by timestamp
+    PendingSample *pendingSamples;
+    size_t pendingCount;
+    // queued for the retention sweeper, at trimQueuePos
+    bool trimQueued;
+    size_t trimQueuePos;
+    // the chunks before these timestamps were sealed or offloaded by the sweeper, see
+    // COLD_CHUNK_AGE and OFFLOAD_AGE
+    timestamp_t sealedUntil;
+    timestamp_t offloadedUntil;
+    // loaded from RDB and not indexed yet, at indexQueuePos
+    bool indexQueued;
+    size_t indexQueuePos;
+    // detached from the index and the rules by SeriesUnlink, only the data is left to free
+    bool unlinked;
+    // unique across the series, changed when the samples change, and rewriteVersion when samples
+    // before the last one changed. The query cache compares them with the cached ones.
+    uint64_t version;
+    uint64_t rewriteVersion;
+    // the epoch of the last reader that took a snapshot of the series. While it is pinned, the
+    // chunks are copied before being changed, and retired rather than freed.
+    u_int64_t snapshotEpoch;
+    // on a snapshot, the chunk it owns, see SeriesSnapshot
+    Chunk_t *snapshotChunk;
 } Series;
 
+// Keeps the samples whose value lies within [min, max]
+typedef struct ValueFilter
+{
+    bool enabled;
+    double min;
+    double max;
+} ValueFilter;
+
 typedef struct SeriesIterator
 {
     Series *series;
-    RedisModuleDictIter *dictIter;
     Chunk_t *currentChunk;
-    ChunkIter_t *chunkIterator;
+    size_t chunkPos; // of the current chunk in the chunks of the series
+    // the iterator of the current chunk, reused for each chunk so queries allocate nothing
+    ChunkIterStorage chunkIterator;
     ChunkIterFuncs chunkIteratorFuncs;
     api_timestamp_t maxTimestamp;
     api_timestamp_t minTimestamp;
     bool reverse;
-    void *(*DictGetNext)(RedisModuleDictIter *di, size_t *keylen, void **dataptr);
+    bool reachedEnd; // set once a batch went past the query range
+    size_t chunkRead; // samples read by batches from the current chunk
+    bool chunkDrained; // the batches read the current chunk up to its end
+    // the current chunk lies within the query range, its samples are not range checked
+    bool chunkWithinRange;
+    // chunks whose values all lie outside the filter are skipped without being decoded
+    ValueFilter filter;
 } SeriesIterator;
 
+// Number of samples decoded at once by batch consumers of SeriesIteratorGetNextBatch
+#define SERIES_ITER_BATCH_SIZE 256
+
 Series *NewSeries(RedisModuleString *keyName, CreateCtx *cCtx);
+// Indexes `chunk` at `key` in the chunks of `series`, with its samples
+void SeriesAddChunk(Series *series, timestamp_t key, Chunk_t *chunk);
 void FreeSeries(void *value);
+/*
+ * Called on the main thread when the key of a series is deleted, before the series is freed,
+ * possibly on a background thread. It removes the series from the index and the sweeper and keeps
+ * its names and rules for CleanLastDeletedSeries, so FreeSeries only frees the data.
+ */
+void SeriesUnlink(RedisModuleString *key, const void *value);
+// Undoes SeriesUnlink for a series whose key was renamed or moved rather than deleted
+void SeriesRelink(RedisModuleCtx *ctx, Series *series);
+// Large series are freed in the background by UNLINK and lazy deletes
+size_t SeriesFreeEffort(RedisModuleString *key, const void *value);
+/*
+ * A standalone series of the chunks of `series` that overlap [start_ts, end_ts], and of the one
+ * before them, to be queried while the original one changes, e.g. outside the GIL. The chunks are
+ * shared with `series`, but for its last chunk which is appended to in place and copied. The
+ * reader entered `guard` before and exits it after FreeSeriesSnapshot. Labels, rules and key name
+ * are not copied.
+ */
+Series *SeriesSnapshot(Series *series,
+                       timestamp_t start_ts,
+                       timestamp_t end_ts,
+                       const EpochGuard *guard);
+void FreeSeriesSnapshot(Series *snapshot);
+// Frees a standalone series with all its chunks, see WideSeriesCopyField
+void FreeSeriesCopy(Series *copy);
+
+#define SERIES_OPT_ENCODING (SERIES_OPT_UNCOMPRESSED | SERIES_OPT_DECIMAL)
+
+/*
+ * The samples of a series re-encoded in chunks of another encoding or size, see TS.ALTER. They
+ * are appended from a copy of the series outside the GIL, then from the series itself for the
+ * samples added meanwhile, and swapped into it under the GIL.
+ */
+typedef struct SeriesEncoding
+{
+    ChunkFuncs *funcs;
+    int options; // the SERIES_OPT_ENCODING bits
+    long long chunkSizeBytes;
+    timestamp_t chunkTimeWindow;
+    ChunkDir chunks;
+    Chunk_t *lastChunk;
+    size_t samples;
+    timestamp_t lastTimestamp;
+} SeriesEncoding;
+
+void SeriesEncodingInit(SeriesEncoding *encoding,
+                        const Series *series,
+                        int options,
+                        long long chunkSizeBytes);
+// Encodes the samples of series after the last one encoded
+void SeriesEncodingAppend(SeriesEncoding *encoding, Series *series);
+/*
+ * Appends the last samples of series and replaces its chunks by the encoded ones, the encoding is
+ * left empty. The samples before the last one encoded must not have changed since they were.
+ */
+void SeriesSwapEncoding(Series *series, SeriesEncoding *encoding);
+void SeriesEncodingFree(SeriesEncoding *encoding);
 void CleanLastDeletedSeries(RedisModuleString *key);
 void RenameSeriesFrom(RedisModuleCtx *ctx, RedisModuleString *key);
 void RenameSeriesTo(RedisModuleCtx *ctx, RedisModuleString *key);
@@ -87,13 +200,73 @@ int SilentGetSeries(RedisModuleCtx *ctx,
                     int mode);
 
 void FreeCompactionRule(void *value);
+// Returns the destination series of the rule, NULL if destKey isn't a series. The lookup is cached
+// on the rule until SeriesInvalidateRuleCache() is called.
+Series *CompactionRuleGetDestSeries(RedisModuleCtx *ctx, CompactionRule *rule);
+// Must be called whenever a series may have been freed, moved or renamed
+void SeriesInvalidateRuleCache(void);
+/*
+ * With ASYNC_COMPACTION, the buckets closed by the compaction rules are queued rather than written
+ * to their destination by the write that closed them, and CompactionQueueFlush, run every
+ * COMPACTION_FLUSH_PERIOD_MS, writes them grouped by destination. The queue is also flushed
+ * inline once it holds COMPACTION_QUEUE_MAX buckets, and before persistence and upserts.
+ */
+#define COMPACTION_FLUSH_PERIOD_MS 100
+#define COMPACTION_QUEUE_MAX 65536
+void CompactionQueueAdd(RedisModuleCtx *ctx,
+                        CompactionRule *rule,
+                        timestamp_t timestamp,
+                        double value);
+// `ctx` may be NULL, the destinations are then opened from a thread safe context
+void CompactionQueueFlush(RedisModuleCtx *ctx);
+size_t CompactionQueueSize();
+/*
+ * Adding a sample frees at most RETENTION_TRIM_INLINE_CHUNKS expired chunks of the series. The
+ * rest, like the backlog left by shortening the retention, is freed by SeriesRetentionSweep, which
+ * runs on the main thread every RETENTION_SWEEP_PERIOD_MS and frees up to
+ * RETENTION_SWEEP_MAX_CHUNKS chunks across the queued series. Queries already skip expired samples.
+ * With COLD_CHUNK_AGE set, the sweeper also seals the chunks that much older than the last sample
+ * of their series, and with OFFLOAD_DIR set, offloads the chunks OFFLOAD_AGE older, within the same
+ * budget of chunks.
+ */
+#define RETENTION_TRIM_INLINE_CHUNKS 2
+#define RETENTION_SWEEP_PERIOD_MS 50
+#define RETENTION_SWEEP_MAX_CHUNKS 256
+// Queue the series for the sweeper
+void SeriesScheduleTrim(Series *series);
+// Defer indexing the labels of a series loaded from RDB to SeriesIndexQueued
+void SeriesQueueIndexing(Series *series);
+// Index the labels of all the queued series, called when loading ends
+void SeriesIndexQueued();
+// Returns the number of chunks freed, sealed or offloaded
+size_t SeriesRetentionSweep(size_t maxChunks);
+// Kept up to date as chunks are added, resized and freed, computing it reads no chunk
 size_t SeriesMemUsage(const void *value);
+
+typedef struct SeriesTotals
+{
+    long long chunks;
+    long long samples;
+    long long bytes; // memory of the chunks, offloaded data excluded
+} SeriesTotals;
+
+// Totals of all the series in memory, for the INFO section of the module
+void SeriesGetTotals(SeriesTotals *totals);
 int SeriesAddSample(Series *series, api_timestamp_t timestamp, double value);
 int SeriesUpsertSample(Series *series,
                        api_timestamp_t timestamp,
                        double value,
                        DuplicatePolicy dp_override);
+// Sets the last timestamp and value of the series from its chunks
 int SeriesUpdateLastSample(Series *series);
+/*
+ * Deletes the samples within [startTs, endTs] and their compactions, returns the number deleted.
+ * The chunks within the range are freed as a whole, only the chunks at its ends are re-encoded.
+ */
+size_t SeriesDelRange(Series *series, timestamp_t startTs, timestamp_t endTs);
+// Merges the buffered out of order samples into the chunks. Must be called before the chunks are
+// read.
+void SeriesFlushPendingSamples(Series *series);
 int SeriesDeleteRule(Series *series, RedisModuleString *destKey);
 int SeriesSetSrcRule(Series *series, RedisModuleString *srctKey);
 int SeriesDeleteSrcRule(Series *series, RedisModuleString *srctKey);
@@ -108,10 +281,40 @@ int SeriesCreateRulesFromGlobalConfig(RedisModuleCtx *ctx,
                                       Label *labels,
                                       size_t labelsCount);
 size_t SeriesGetNumSamples(const Series *series);
+// The samples of the chunks overlapping the range, the most reading it decodes
+size_t SeriesRangeSamples(Series *series, timestamp_t start_ts, timestamp_t end_ts);
 
 // Iterator over the series
 SeriesIterator SeriesQuery(Series *series, timestamp_t start_ts, timestamp_t end_ts, bool rev);
+// Iterates the samples of the range kept by `filter`, which may be NULL
+SeriesIterator SeriesQueryFiltered(Series *series,
+                                   timestamp_t start_ts,
+                                   timestamp_t end_ts,
+                                   bool rev,
+                                   const ValueFilter *filter);
 ChunkResult SeriesIteratorGetNext(SeriesIterator *iterator, Sample *currentSample);
+// The value of the last sample before `timestamp` kept by `filter`, which may be NULL
+bool SeriesPrecedingValue(Series *series,
+                          timestamp_t timestamp,
+                          const ValueFilter *filter,
+                          double *value);
+// Fills up to `max` samples within the query range, in iteration order. Returns the number of
+// samples read, 0 once the range is exhausted.
+size_t SeriesIteratorGetNextBatch(SeriesIterator *iterator,
+                                  timestamp_t *timestamps,
+                                  double *values,
+                                  size_t max);
+/*
+ * When the next samples of the iterator are a whole chunk lying within the query range, and the
+ * chunk has not been read from yet, gets its summary and its first and last timestamps, all in
+ * iteration order. The caller may then consume the chunk with SeriesIteratorSkipChunk instead of
+ * reading its samples. With a value filter, only chunks whose samples are all kept are peeked.
+ */
+bool SeriesIteratorPeekChunk(SeriesIterator *iterator,
+                             ChunkSummary *summary,
+                             timestamp_t *first,
+                             timestamp_t *last);
+void SeriesIteratorSkipChunk(SeriesIterator *iterator);
 void SeriesIteratorClose(SeriesIterator *iterator);
 
 int SeriesCalcRange(Series *series,
@@ -119,6 +322,16 @@ int SeriesCalcRange(Series *series,
                     timestamp_t end_ts,
                     CompactionRule *rule,
                     double *val);
+/*
+ * Aggregates the samples of [start_ts, end_ts] into buckets of `timeBucket`, as a compaction rule
+ * of `aggClass` would. Returns the number of buckets set in `*buckets`, to be freed with free().
+ */
+size_t SeriesAggregateBuckets(Series *series,
+                              timestamp_t start_ts,
+                              timestamp_t end_ts,
+                              AggregationClass *aggClass,
+                              timestamp_t timeBucket,
+                              Sample **buckets);
 
 // Calculate the begining of  aggregation window
 timestamp_t CalcWindowStart(timestamp_t timestamp, size_t window);
@@ -129,13 +342,4 @@ timestamp_t getFirstValidTimestamp(Series *series, long long *skipped);
 
 CompactionRule *NewRule(RedisModuleString *destKey, int aggType, uint64_t timeBucket);
 
-// set/delete/replace a chunk in a dictionary
-typedef enum
-{
-    DICT_OP_SET = 0,
-    DICT_OP_REPLACE = 1,
-    DICT_OP_DEL = 2
-} DictOp;
-int dictOperator(RedisModuleDict *d, void *chunk, timestamp_t ts, DictOp op);
-
 #endif /* TSDB_H */
@@ -5,10 +5,18 @@
  */
 #include "minunit.h"
 #include "parse_policies.h"
+#include "unittests_chunk_dir.c"
+#include "unittests_chunk_pool.c"
+#include "unittests_compaction.c"
 #include "unittests_compressed_chunk.c"
+#include "unittests_epoch.c"
 #include "unittests_parse_duplicate_policy.c"
 #include "unittests_parse_policies.c"
+#include "unittests_segment_store.c"
+#include "unittests_sketch.c"
+#include "unittests_stage_stats.c"
 #include "unittests_uncompressed_chunk.c"
+#include "unittests_wide_chunk.c"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,6 +29,14 @@ int main(int argc, char *argv[]) {
     MU_RUN_SUITE(uncompressed_chunk_test_suite);
     MU_RUN_SUITE(compressed_chunk_test_suite);
     MU_RUN_SUITE(parse_duplicate_policy_test_suite);
+    MU_RUN_SUITE(compaction_test_suite);
+    MU_RUN_SUITE(chunk_dir_test_suite);
+    MU_RUN_SUITE(chunk_pool_test_suite);
+    MU_RUN_SUITE(epoch_test_suite);
+    MU_RUN_SUITE(segment_store_test_suite);
+    MU_RUN_SUITE(sketch_test_suite);
+    MU_RUN_SUITE(stage_stats_test_suite);
+    MU_RUN_SUITE(wide_chunk_test_suite);
     MU_REPORT();
     return minunit_fail;
 }
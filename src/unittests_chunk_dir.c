@@ -0,0 +1,114 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "chunk_dir.h"
+#include "minunit.h"
+
+#include <stdint.h>
+#include "rmutil/alloc.h"
+
+// the directory only stores the chunk pointers, fake ones do
+#define FAKE_CHUNK(i) ((Chunk_t *)(uintptr_t)(0x1000 + (i)))
+
+MU_TEST(test_chunk_dir_insert) {
+    ChunkDir dir;
+    ChunkDir_Init(&dir);
+    for (int i = 1; i <= 100; i++) {
+        mu_assert_int_eq(TSDB_OK, ChunkDir_Insert(&dir, i * 10, FAKE_CHUNK(i)));
+    }
+    // backfilled chunks go in order, keys are unique
+    mu_assert_int_eq(TSDB_OK, ChunkDir_Insert(&dir, 0, FAKE_CHUNK(0)));
+    mu_assert_int_eq(TSDB_OK, ChunkDir_Insert(&dir, 505, FAKE_CHUNK(505)));
+    mu_assert_int_eq(TSDB_ERROR, ChunkDir_Insert(&dir, 500, FAKE_CHUNK(1)));
+    mu_assert_int_eq(TSDB_ERROR, ChunkDir_Insert(&dir, 1000, FAKE_CHUNK(1)));
+    mu_assert_int_eq(102, ChunkDir_Count(&dir));
+
+    mu_check(ChunkDir_Get(&dir, 0) == FAKE_CHUNK(0));
+    mu_check(ChunkDir_Get(&dir, 50) == FAKE_CHUNK(50));
+    mu_check(ChunkDir_Get(&dir, 51) == FAKE_CHUNK(505));
+    mu_check(ChunkDir_Get(&dir, 101) == FAKE_CHUNK(100));
+    for (size_t i = 1; i < ChunkDir_Count(&dir); i++) {
+        mu_check(dir.entries[i - 1].key < dir.entries[i].key);
+    }
+    ChunkDir_Free(&dir);
+    mu_assert_int_eq(0, ChunkDir_Count(&dir));
+}
+
+MU_TEST(test_chunk_dir_find) {
+    ChunkDir dir;
+    ChunkDir_Init(&dir);
+    ChunkDir_Insert(&dir, 0, FAKE_CHUNK(0));
+    mu_assert_int_eq(0, ChunkDir_Find(&dir, 0));
+    mu_assert_int_eq(0, ChunkDir_Find(&dir, 12345));
+
+    for (int i = 1; i < 1000; i++) {
+        ChunkDir_Insert(&dir, i * 10, FAKE_CHUNK(i));
+    }
+    mu_assert_int_eq(0, ChunkDir_Find(&dir, 9));
+    mu_assert_int_eq(1, ChunkDir_Find(&dir, 10));
+    mu_assert_int_eq(1, ChunkDir_Find(&dir, 19));
+    mu_assert_int_eq(500, ChunkDir_Find(&dir, 5000));
+    mu_assert_int_eq(998, ChunkDir_Find(&dir, 9989));
+    mu_assert_int_eq(999, ChunkDir_Find(&dir, 9990));
+    mu_assert_int_eq(999, ChunkDir_Find(&dir, UINT64_MAX));
+
+    // a hint is only taken when it is the position found
+    mu_assert_int_eq(500, ChunkDir_FindFrom(&dir, 5000, 500));
+    mu_assert_int_eq(500, ChunkDir_FindFrom(&dir, 5005, 500));
+    mu_assert_int_eq(500, ChunkDir_FindFrom(&dir, 5005, 499));
+    mu_assert_int_eq(500, ChunkDir_FindFrom(&dir, 5005, 501));
+    mu_assert_int_eq(999, ChunkDir_FindFrom(&dir, 12345, 999));
+    mu_assert_int_eq(999, ChunkDir_FindFrom(&dir, 12345, 5000));
+    mu_assert_int_eq(0, ChunkDir_FindFrom(&dir, 0, 0));
+
+    // without a chunk keyed at or before the timestamp, the first chunk is found
+    ChunkDir_Delete(&dir, 0);
+    mu_assert_int_eq(0, ChunkDir_Find(&dir, 5));
+    mu_check(ChunkDir_Get(&dir, 0) == FAKE_CHUNK(1));
+    ChunkDir_Free(&dir);
+}
+
+MU_TEST(test_chunk_dir_delete) {
+    ChunkDir dir;
+    ChunkDir_Init(&dir);
+    for (int i = 0; i < 1000; i++) {
+        ChunkDir_Insert(&dir, i, FAKE_CHUNK(i));
+    }
+    mu_assert_int_eq(TSDB_OK, ChunkDir_Delete(&dir, 500));
+    mu_assert_int_eq(TSDB_ERROR, ChunkDir_Delete(&dir, 500));
+    mu_assert_int_eq(TSDB_ERROR, ChunkDir_Delete(&dir, 1000));
+    mu_assert_int_eq(999, ChunkDir_Count(&dir));
+    mu_check(ChunkDir_Get(&dir, 500) == FAKE_CHUNK(501));
+
+    ChunkDir_DeleteFirst(&dir, 0);
+    mu_assert_int_eq(999, ChunkDir_Count(&dir));
+    ChunkDir_DeleteRange(&dir, 100, 0);
+    mu_assert_int_eq(999, ChunkDir_Count(&dir));
+    ChunkDir_DeleteRange(&dir, 100, 400);
+    mu_assert_int_eq(599, ChunkDir_Count(&dir));
+    mu_check(ChunkDir_Get(&dir, 99) == FAKE_CHUNK(99));
+    mu_check(ChunkDir_Get(&dir, 100) == FAKE_CHUNK(501));
+    ChunkDir_DeleteRange(&dir, 0, 10);
+    mu_check(ChunkDir_Get(&dir, 0) == FAKE_CHUNK(10));
+    ChunkDir_DeleteRange(&dir, 579, 10);
+    mu_assert_int_eq(579, ChunkDir_Count(&dir));
+    mu_check(ChunkDir_Get(&dir, 578) == FAKE_CHUNK(989));
+    ChunkDir_DeleteFirst(&dir, 570);
+    mu_assert_int_eq(9, ChunkDir_Count(&dir));
+    mu_check(ChunkDir_Get(&dir, 0) == FAKE_CHUNK(981));
+    // the capacity follows the shrinking directory
+    mu_check(dir.capacity < 1000);
+    ChunkDir_DeleteFirst(&dir, 9);
+    mu_assert_int_eq(0, ChunkDir_Count(&dir));
+    mu_assert_int_eq(TSDB_OK, ChunkDir_Insert(&dir, 7, FAKE_CHUNK(7)));
+    mu_assert_int_eq(0, ChunkDir_Find(&dir, 0));
+    ChunkDir_Free(&dir);
+}
+
+MU_TEST_SUITE(chunk_dir_test_suite) {
+    MU_RUN_TEST(test_chunk_dir_insert);
+    MU_RUN_TEST(test_chunk_dir_find);
+    MU_RUN_TEST(test_chunk_dir_delete);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "chunk_pool.h"
+#include "minunit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "rmutil/alloc.h"
+
+MU_TEST(test_chunk_pool_size_classes) {
+    size_t prev = 0;
+    for (size_t size = 1; size <= CHUNK_POOL_MAX_SIZE; size += 1 + size / 7) {
+        size_t allocated = ChunkPool_AllocatedSize(size);
+        mu_check(allocated >= size);
+        mu_check(allocated >= prev);
+        // at most a quarter of the power of two below is wasted
+        mu_check(allocated - size < 16 || (allocated - size) * 4 <= allocated);
+        prev = allocated;
+    }
+    mu_assert_int_eq(16, ChunkPool_AllocatedSize(1));
+    mu_assert_int_eq(128, ChunkPool_AllocatedSize(128));
+    mu_assert_int_eq(160, ChunkPool_AllocatedSize(129));
+    mu_assert_int_eq(4096, ChunkPool_AllocatedSize(4096));
+    mu_assert_int_eq(5120, ChunkPool_AllocatedSize(4097));
+    mu_assert_int_eq(CHUNK_POOL_MAX_SIZE, ChunkPool_AllocatedSize(CHUNK_POOL_MAX_SIZE));
+    mu_assert_int_eq(CHUNK_POOL_MAX_SIZE + 1, ChunkPool_AllocatedSize(CHUNK_POOL_MAX_SIZE + 1));
+}
+
+MU_TEST(test_chunk_pool_reuse) {
+    void *first = ChunkPool_Alloc(4000);
+    size_t idle = ChunkPool_IdleBytes();
+    ChunkPool_Free(first, 4000);
+    mu_assert_int_eq(idle + 4096, ChunkPool_IdleBytes());
+
+    // any size of the same class gets the freed buffer back, zeroed when asked to
+    char *second = ChunkPool_Calloc(3900);
+    mu_check(second == first);
+    mu_assert_int_eq(idle, ChunkPool_IdleBytes());
+    for (size_t i = 0; i < 3900; i++) {
+        mu_assert_int_eq(0, second[i]);
+    }
+    ChunkPool_Free(second, 3900);
+
+    void *large = ChunkPool_Alloc(CHUNK_POOL_MAX_SIZE + 1);
+    ChunkPool_Free(large, CHUNK_POOL_MAX_SIZE + 1);
+    mu_assert_int_eq(idle + 4096, ChunkPool_IdleBytes());
+}
+
+MU_TEST(test_chunk_pool_realloc) {
+    char *buffer = ChunkPool_Alloc(100);
+    for (int i = 0; i < 100; i++) {
+        buffer[i] = (char)i;
+    }
+    // resizing within the class keeps the buffer
+    mu_check(ChunkPool_Realloc(buffer, 100, 112) == buffer);
+
+    size_t size = 112;
+    while (size < CHUNK_POOL_MAX_SIZE * 2) {
+        size_t newSize = size * 3 / 2;
+        buffer = ChunkPool_Realloc(buffer, size, newSize);
+        size = newSize;
+    }
+    buffer = ChunkPool_Realloc(buffer, size, 50);
+    for (int i = 0; i < 50; i++) {
+        mu_assert_int_eq(i, buffer[i]);
+    }
+    ChunkPool_Free(buffer, 50);
+}
+
+MU_TEST_SUITE(chunk_pool_test_suite) {
+    MU_RUN_TEST(test_chunk_pool_size_classes);
+    MU_RUN_TEST(test_chunk_pool_reuse);
+    MU_RUN_TEST(test_chunk_pool_realloc);
+}
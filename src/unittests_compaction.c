@@ -0,0 +1,180 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "compaction.h"
+#include "consts.h"
+#include "minunit.h"
+
+#include <stdlib.h>
+
+MU_TEST(test_aggregation_append_values) {
+    const size_t total = 1000;
+    double values[total];
+    srand(42);
+    for (size_t i = 0; i < total; ++i) {
+        values[i] = (double)(rand() % 20000) / 8 - 1000;
+    }
+
+    const TS_AGG_TYPES_T aggTypes[] = { TS_AGG_MIN,   TS_AGG_MAX,   TS_AGG_SUM,   TS_AGG_AVG,
+                                        TS_AGG_COUNT, TS_AGG_FIRST, TS_AGG_LAST,  TS_AGG_RANGE,
+                                        TS_AGG_STD_P, TS_AGG_STD_S, TS_AGG_VAR_P, TS_AGG_VAR_S };
+    // odd run lengths exercise both the unrolled body and the remainder of every kernel
+    const size_t runs[] = { 1, 3, 4, 7, 1, 0, 64, 5, 255, 256 };
+
+    for (size_t a = 0; a < sizeof(aggTypes) / sizeof(aggTypes[0]); ++a) {
+        AggregationClass *aggClass = GetAggClass(aggTypes[a]);
+        mu_check(aggClass->appendValues != NULL);
+        void *scalar = aggClass->createContext();
+        void *batch = aggClass->createContext();
+        size_t pos = 0;
+        for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); ++r) {
+            for (size_t i = pos; i < pos + runs[r]; ++i) {
+                aggClass->appendValue(scalar, values[i]);
+            }
+            AggregationAppendValues(aggClass, batch, values + pos, runs[r]);
+            pos += runs[r];
+
+            double expected = 0, actual = 0;
+            int expectedRv = aggClass->finalize(scalar, &expected);
+            mu_assert_int_eq(expectedRv, aggClass->finalize(batch, &actual));
+            if (expectedRv == TSDB_OK) {
+                // values are multiples of 1/8, so summing in a different order is still exact
+                mu_assert_double_eq(expected, actual);
+            }
+        }
+        aggClass->resetContext(batch);
+        AggregationAppendValues(aggClass, batch, values, 0);
+        double value;
+        mu_assert_int_eq(aggTypes[a] == TS_AGG_COUNT ? TSDB_OK : TSDB_ERROR,
+                         aggClass->finalize(batch, &value));
+        aggClass->freeContext(scalar);
+        aggClass->freeContext(batch);
+    }
+}
+
+MU_TEST(test_aggregation_remove_value) {
+    const size_t total = 200;
+    double values[total];
+    srand(7);
+    for (size_t i = 0; i < total; ++i) {
+        values[i] = (double)(rand() % 2000) / 8 - 100;
+    }
+
+    const TS_AGG_TYPES_T aggTypes[] = { TS_AGG_MIN,   TS_AGG_MAX,   TS_AGG_SUM,   TS_AGG_AVG,
+                                        TS_AGG_COUNT, TS_AGG_RANGE, TS_AGG_STD_P, TS_AGG_VAR_S };
+    for (size_t a = 0; a < sizeof(aggTypes) / sizeof(aggTypes[0]); ++a) {
+        AggregationClass *aggClass = GetAggClass(aggTypes[a]);
+        mu_check(aggClass->removeValue != NULL);
+        void *updated = aggClass->createContext();
+        AggregationAppendValues(aggClass, updated, values, total);
+        size_t removed = 0;
+        for (size_t k = 0; k < total; k += 3) {
+            double replacement = (double)(rand() % 2000) / 8 - 100;
+            if (aggClass->removeValue(updated, values[k]) != TSDB_OK) {
+                // only the extremes cannot be removed, the context is then rebuilt
+                aggClass->resetContext(updated);
+                values[k] = replacement;
+                AggregationAppendValues(aggClass, updated, values, total);
+                continue;
+            }
+            removed++;
+            values[k] = replacement;
+            aggClass->appendValue(updated, replacement);
+
+            void *expected = aggClass->createContext();
+            AggregationAppendValues(aggClass, expected, values, total);
+            double expectedValue, actualValue;
+            mu_assert_int_eq(TSDB_OK, aggClass->finalize(expected, &expectedValue));
+            mu_assert_int_eq(TSDB_OK, aggClass->finalize(updated, &actualValue));
+            mu_assert_double_eq(expectedValue, actualValue);
+            aggClass->freeContext(expected);
+        }
+        mu_check(removed > 0);
+
+        if (aggClass->loadValue != NULL) {
+            double value, loaded;
+            aggClass->finalize(updated, &value);
+            void *context = aggClass->createContext();
+            aggClass->loadValue(context, value);
+            mu_assert_int_eq(TSDB_OK, aggClass->finalize(context, &loaded));
+            mu_assert_double_eq(value, loaded);
+            aggClass->freeContext(context);
+        }
+        aggClass->freeContext(updated);
+    }
+    mu_check(GetAggClass(TS_AGG_FIRST)->removeValue == NULL);
+    mu_check(GetAggClass(TS_AGG_LAST)->removeValue == NULL);
+    mu_check(GetAggClass(TS_AGG_AVG)->loadValue == NULL);
+}
+
+MU_TEST(test_aggregation_counters) {
+    // the counter is reset between 30 and 5, then between 12 and 0
+    const double values[] = { 10, 20, 20, 30, 5, 12, 0, 4 };
+    const size_t count = sizeof(values) / sizeof(values[0]);
+    double reversed[count];
+    for (size_t i = 0; i < count; ++i) {
+        reversed[i] = values[count - 1 - i];
+    }
+
+    const TS_AGG_TYPES_T aggTypes[] = { TS_AGG_INCREASE, TS_AGG_RATE, TS_AGG_DELTA };
+    const double expected[] = { 20 + 5 + 7 + 4, (20 + 5 + 7 + 4) / 2.0, 4 - 10 };
+    for (size_t a = 0; a < sizeof(aggTypes) / sizeof(aggTypes[0]); ++a) {
+        AggregationClass *aggClass = GetAggClass(aggTypes[a]);
+        mu_check(IsCounterAggType(aggTypes[a]));
+        void *scalar = AggregationCreateContext(aggClass, 2000, false);
+        void *batch = AggregationCreateContext(aggClass, 2000, false);
+        void *backward = AggregationCreateContext(aggClass, 2000, true);
+        for (size_t i = 0; i < count; ++i) {
+            aggClass->appendValue(scalar, values[i]);
+        }
+        AggregationAppendValues(aggClass, batch, values, 3);
+        AggregationAppendValues(aggClass, batch, values + 3, count - 3);
+        AggregationAppendValues(aggClass, backward, reversed, count);
+
+        double value;
+        mu_assert_int_eq(TSDB_OK, aggClass->finalize(scalar, &value));
+        mu_assert_double_eq(expected[a], value);
+        mu_assert_int_eq(TSDB_OK, aggClass->finalize(batch, &value));
+        mu_assert_double_eq(expected[a], value);
+        mu_assert_int_eq(TSDB_OK, aggClass->finalize(backward, &value));
+        mu_assert_double_eq(expected[a], value);
+
+        // a reset keeps the bucket duration, and the latest value precedes the next bucket: the
+        // counter was reset once more between 4 and 1
+        aggClass->resetContext(scalar);
+        mu_assert_int_eq(TSDB_ERROR, aggClass->finalize(scalar, &value));
+        aggClass->appendValue(scalar, 1);
+        aggClass->appendValue(scalar, 3);
+        mu_assert_int_eq(TSDB_OK, aggClass->finalize(scalar, &value));
+        const double next[] = { 1 + 2, (1 + 2) / 2.0, 2 };
+        mu_assert_double_eq(next[a], value);
+
+        // backward, the bucket is seeded with the value preceding it
+        aggClass->resetContext(backward);
+        if (aggClass->seedContext != NULL) {
+            aggClass->seedContext(backward, 0.5);
+        }
+        aggClass->appendValue(backward, 3);
+        aggClass->appendValue(backward, 1);
+        mu_assert_int_eq(TSDB_OK, aggClass->finalize(backward, &value));
+        const double seeded[] = { 0.5 + 2, (0.5 + 2) / 2.0, 2 };
+        mu_assert_double_eq(seeded[a], value);
+
+        aggClass->freeContext(scalar);
+        aggClass->freeContext(batch);
+        aggClass->freeContext(backward);
+    }
+    mu_check(GetAggClass(TS_AGG_DELTA)->seedContext == NULL);
+    mu_check(!IsCounterAggType(TS_AGG_SUM));
+    mu_check(StringAggTypeToEnum("increase") == TS_AGG_INCREASE);
+    mu_check(StringAggTypeToEnum("RATE") == TS_AGG_RATE);
+    mu_check(StringAggTypeToEnum("delta") == TS_AGG_DELTA);
+}
+
+MU_TEST_SUITE(compaction_test_suite) {
+    MU_RUN_TEST(test_aggregation_append_values);
+    MU_RUN_TEST(test_aggregation_remove_value);
+    MU_RUN_TEST(test_aggregation_counters);
+}
@@ -3,6 +3,7 @@
  *
  * This file is available under the Redis Labs Source Available License Agreement
  */
+#include "chunk.h"
 #include "compaction.h"
 #include "compressed_chunk.h"
 #include "gorilla.h"
@@ -10,6 +11,8 @@
 #include "parse_policies.h"
 #include "tsdb.h"
 
+#include <float.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "rmutil/alloc.h"
@@ -191,15 +194,860 @@ MU_TEST(test_Compressed_SplitChunk_force_realloc) {
     mu_assert(rv == CR_OK, "upsert non existing sample");
     total_added_samples++;
     mu_assert_int_eq(total_added_samples, chunk->count);
-    mu_assert_int_eq(chunk_size + 32, chunk->size);
+    // grown once, by the word the new sample spills into
+    mu_assert_int_eq(chunk_size + sizeof(binary_t), chunk->size);
 
     Compressed_FreeChunk(chunk);
 }
 
+MU_TEST(test_Compressed_SizeEstimator) {
+    srand((unsigned int)time(NULL));
+    for (int round = 0; round < 20; ++round) {
+        bool decimal = round % 4 >= 2;
+        CompressedChunk *chunk =
+            decimal ? Compressed_NewDecimalChunk(64 * 1024) : Compressed_NewChunk(64 * 1024);
+        CompressedSizeEstimator estimator;
+        Compressed_SizeEstimatorInit(&estimator, chunk);
+        timestamp_t ts = rand() % 1000;
+        double value = rand() % 100;
+        for (int i = 0; i < 2000; ++i) {
+            // mix regular and irregular intervals, repeated, integer, decimal and other values
+            ts += (round % 2 == 0) ? 10 : 1 + rand() % (1 << (rand() % 34));
+            if (rand() % 3 == 0) {
+                int kind = rand() % 3;
+                value = kind == 0 ? value + 1 : kind == 1 ? rand() % 10000 / 100.0 : rand() / 7.0;
+            }
+            mu_assert(Compressed_Append(chunk, ts, value) == CR_OK, "append sample");
+            Compressed_SizeEstimatorAdd(&estimator, ts, value);
+            mu_assert_int_eq(chunk->idx, estimator.idx);
+        }
+
+        // an exactly sized chunk fits the same samples, and the first half of its blocks
+        CompressedChunk *exact = Compressed_NewChunk(Compressed_SizeEstimatorBytes(&estimator));
+        exact->decimalValues = decimal;
+        exact->decimals = chunk->decimals;
+        Compressed_Iterator *iter = Compressed_NewChunkIterator(chunk, CHUNK_ITER_OP_NONE, NULL);
+        Sample sample;
+        while (Compressed_ChunkIteratorGetNext(iter, &sample) == CR_OK) {
+            mu_assert(Compressed_Append(exact, sample.timestamp, sample.value) == CR_OK,
+                      "append to exact chunk");
+        }
+        Compressed_FreeChunkIterator(iter);
+        mu_assert_int_eq(chunk->count, exact->count);
+
+        u_int32_t blockId = chunk->checkpointsCount / 2;
+        Compressed_SizeEstimatorInitFromBlocks(&estimator, chunk, blockId);
+        mu_assert_int_eq(blockId == 0 ? 0 : chunk->checkpoints[blockId - 1].idx, estimator.idx);
+
+        Compressed_FreeChunk(exact);
+        Compressed_FreeChunk(chunk);
+    }
+}
+
+static void assert_reverse_matches_forward(CompressedChunk *chunk) {
+    u_int64_t count = Compressed_ChunkNumOfSample(chunk);
+    Sample *forward = malloc(max(count, 1) * sizeof(Sample));
+    Sample sample;
+
+    ChunkIter_t *iter = Compressed_NewChunkIterator(chunk, CHUNK_ITER_OP_NONE, NULL);
+    u_int64_t i = 0;
+    while (Compressed_ChunkIteratorGetNext(iter, &sample) == CR_OK) {
+        forward[i++] = sample;
+    }
+    Compressed_FreeChunkIterator(iter);
+    mu_assert_int_eq(count, i);
+
+    ChunkIterFuncs iterFuncs;
+    iter = Compressed_NewChunkIterator(chunk, CHUNK_ITER_OP_REVERSE, &iterFuncs);
+    mu_assert(iterFuncs.GetPrev != NULL, "compressed iterator supports reverse");
+    while (iterFuncs.GetPrev(iter, &sample) == CR_OK) {
+        mu_assert(i > 0, "reverse iterator returned too many samples");
+        --i;
+        mu_assert_int_eq(forward[i].timestamp, sample.timestamp);
+        mu_assert_double_eq(forward[i].value, sample.value);
+    }
+    mu_assert_int_eq(0, i);
+    mu_assert(iterFuncs.GetPrev(iter, &sample) == CR_END, "reverse iterator stays at end");
+    iterFuncs.Free(iter);
+    free(forward);
+}
+
+MU_TEST(test_Compressed_DecodeBuckets) {
+    const int total = 5000;
+    timestamp_t timestamps[total];
+    double values[total];
+    // double deltas on both sides of the bucket bounds, up to the 64 bits bucket
+    const int64_t edges[] = { 0,      1,         -1,      (1 << 4) - 1, -(1 << 4), 1 << 4,
+                              -(1 << 4) - 1,     (1 << 5), (1 << 8) - 1, 1 << 8,   -(1 << 10),
+                              (1 << 14) - 1,     1 << 14, (1LL << 31) - 1, 1LL << 31,
+                              1LL << 40 };
+    srand(17);
+    for (int decimal = 0; decimal < 2; ++decimal) {
+        timestamp_t ts = 1000;
+        int64_t delta = 0;
+        double value = 10;
+        for (int i = 0; i < total; ++i) {
+            int64_t dd = edges[rand() % (sizeof(edges) / sizeof(edges[0]))];
+            if (delta + dd > 0) {
+                delta += dd;
+            }
+            ts += delta;
+            int kind = rand() % 5;
+            if (kind == 1) {
+                value += (rand() % 2001 - 1000) / 100.0;
+            } else if (kind == 2) {
+                value = (double)rand() / (rand() + 1);
+            } else if (kind == 3) {
+                value = -value * (1LL << (rand() % 40));
+            }
+            timestamps[i] = ts;
+            values[i] = decimal ? round(value * 100) / 100 : value;
+        }
+
+        // fields ending on the last bits of an exactly sized chunk are read too
+        CompressedChunk *sizing = decimal ? Compressed_NewDecimalChunk(1024 * 1024)
+                                          : Compressed_NewChunk(1024 * 1024);
+        CompressedSizeEstimator estimator;
+        Compressed_SizeEstimatorInit(&estimator, sizing);
+        for (int i = 0; i < total; ++i) {
+            Compressed_SizeEstimatorAdd(&estimator, timestamps[i], values[i]);
+        }
+        CompressedChunk *chunk = Compressed_NewChunk(Compressed_SizeEstimatorBytes(&estimator));
+        chunk->decimalValues = sizing->decimalValues;
+        chunk->decimals = estimator.decimals;
+        for (int i = 0; i < total; ++i) {
+            mu_assert(Compressed_Append(chunk, timestamps[i], values[i]) == CR_OK, "append");
+        }
+        mu_assert_int_eq(total, chunk->count);
+
+        Compressed_Iterator *iter = Compressed_NewChunkIterator(chunk, CHUNK_ITER_OP_NONE, NULL);
+        Sample sample;
+        for (int i = 0; i < total; ++i) {
+            mu_assert(Compressed_ChunkIteratorGetNext(iter, &sample) == CR_OK, "read sample");
+            mu_assert_int_eq(timestamps[i], sample.timestamp);
+            mu_assert_double_eq(values[i], sample.value);
+        }
+        mu_assert(Compressed_ChunkIteratorGetNext(iter, &sample) == CR_END, "end of chunk");
+        Compressed_FreeChunkIterator(iter);
+        Compressed_FreeChunk(chunk);
+        Compressed_FreeChunk(sizing);
+    }
+}
+
+MU_TEST(test_Compressed_RegularRun) {
+    CompressedChunk *chunk = Compressed_NewChunk(4096);
+    const int regular = 1000;
+    for (int i = 0; i < regular; ++i) {
+        mu_assert(Compressed_Append(chunk, 5 + i * 10, 42) == CR_OK, "append regular sample");
+    }
+    // only the second timestamp (7 bits) and one bit per repeated value are written
+    mu_assert_int_eq(regular, chunk->regularCount);
+    mu_assert_int_eq(7 + regular - 1, chunk->idx);
+
+    // the run ends with the first other interval, later samples are encoded as usual
+    timestamp_t ts = 5 + (regular - 1) * 10;
+    for (int i = 0; i < 100; ++i) {
+        ts += i % 2 ? 10 : 7;
+        mu_assert(Compressed_Append(chunk, ts, i) == CR_OK, "append irregular sample");
+    }
+    mu_assert_int_eq(regular, chunk->regularCount);
+
+    Compressed_Iterator *iter = Compressed_NewChunkIterator(chunk, CHUNK_ITER_OP_NONE, NULL);
+    Sample sample;
+    ts = 5 + (regular - 1) * 10;
+    for (int i = 0; i < regular + 100; ++i) {
+        mu_assert(Compressed_ChunkIteratorGetNext(iter, &sample) == CR_OK, "read sample");
+        if (i < regular) {
+            mu_assert_int_eq(5 + i * 10, sample.timestamp);
+            mu_assert_double_eq(42, sample.value);
+        } else {
+            ts += (i - regular) % 2 ? 10 : 7;
+            mu_assert_int_eq(ts, sample.timestamp);
+            mu_assert_double_eq(i - regular, sample.value);
+        }
+    }
+    mu_assert(Compressed_ChunkIteratorGetNext(iter, &sample) == CR_END, "end of chunk");
+    Compressed_FreeChunkIterator(iter);
+
+    // a merge keeps the run up to the merged sample
+    PendingSample pending = { .sample = { .timestamp = 5 + 500 * 10 + 1, .value = 1 },
+                              .duplicatePolicy = DP_BLOCK };
+    int size;
+    mu_assert(Compressed_MergeSamples(chunk, &pending, 1, &size) == CR_OK, "merge sample");
+    mu_assert_int_eq(501, chunk->regularCount);
+    assert_reverse_matches_forward(chunk);
+    Compressed_FreeChunk(chunk);
+}
+
+static void assert_same_double(double expected, double actual) {
+    union64bits a = { .d = expected }, b = { .d = actual };
+    mu_assert_int_eq(a.u, b.u);
+}
+
+MU_TEST(test_Compressed_DecimalValues) {
+    CompressedChunk *chunk = Compressed_NewDecimalChunk(4096);
+    CompressedChunk *xorChunk = Compressed_NewChunk(4096);
+    Sample sample;
+    for (int i = 0; i < 200; ++i) {
+        sample = (Sample){ .timestamp = 1000 + i * 10, .value = 1000000 + i * 3 };
+        mu_assert(Compressed_AddSample(chunk, &sample) == CR_OK, "append counter sample");
+        mu_assert(Compressed_AddSample(xorChunk, &sample) == CR_OK, "append counter sample");
+    }
+    // a delta of 3 takes 7 bits
+    mu_assert_int_eq(0, chunk->decimals);
+    mu_assert_int_eq(7 + 199 * 7, chunk->idx);
+    mu_check(chunk->idx < xorChunk->idx);
+
+    // more decimals re-encode the chunk, values that are not decimal are stored as is
+    double values[] = { 21.5, 21.25, 21.25, -3.75, 1.0 / 3, 1.0 / 3, -0.0, 1e300, NAN, 4 };
+    size_t n = sizeof(values) / sizeof(values[0]);
+    for (size_t i = 0; i < n; ++i) {
+        sample = (Sample){ .timestamp = 5000 + i, .value = values[i] };
+        mu_assert(Compressed_AddSample(chunk, &sample) == CR_OK, "append decimal sample");
+    }
+    mu_assert_int_eq(2, chunk->decimals);
+
+    Compressed_Iterator *iter = Compressed_NewChunkIterator(chunk, CHUNK_ITER_OP_NONE, NULL);
+    for (int i = 0; i < 200; ++i) {
+        mu_assert(Compressed_ChunkIteratorGetNext(iter, &sample) == CR_OK, "read counter");
+        mu_assert_int_eq(1000 + i * 10, sample.timestamp);
+        assert_same_double(1000000 + i * 3, sample.value);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        mu_assert(Compressed_ChunkIteratorGetNext(iter, &sample) == CR_OK, "read decimal");
+        mu_assert_int_eq(5000 + i, sample.timestamp);
+        assert_same_double(values[i], sample.value);
+    }
+    mu_assert(Compressed_ChunkIteratorGetNext(iter, &sample) == CR_END, "end of chunk");
+    Compressed_FreeChunkIterator(iter);
+    assert_reverse_matches_forward(chunk);
+
+    // split halves keep the decimals
+    CompressedChunk *second = Compressed_SplitChunk(chunk);
+    mu_check(second->decimalValues);
+    mu_assert_int_eq(2, second->decimals);
+    iter = Compressed_NewChunkIterator(second, CHUNK_ITER_OP_NONE, NULL);
+    size_t i = 0;
+    while (Compressed_ChunkIteratorGetNext(iter, &sample) == CR_OK) {
+        if (sample.timestamp >= 5000) {
+            assert_same_double(values[sample.timestamp - 5000], sample.value);
+            i++;
+        }
+    }
+    mu_assert_int_eq(n, i);
+    Compressed_FreeChunkIterator(iter);
+
+    Compressed_FreeChunk(second);
+    Compressed_FreeChunk(xorChunk);
+    Compressed_FreeChunk(chunk);
+}
+
+MU_TEST(test_Compressed_SignificantDigits) {
+    assert_same_double(0.1, Compressed_RoundSignificantDigits(0.1, 0));
+    mu_check(isnan(Compressed_RoundSignificantDigits(NAN, 3)));
+    mu_check(isinf(Compressed_RoundSignificantDigits(INFINITY, 3)));
+    mu_check(Compressed_RoundSignificantDigits(DBL_MAX, 1) <= DBL_MAX);
+
+    CompressedChunk *lossless = Compressed_NewChunk(4096);
+    CompressedChunk *rounded = Compressed_NewChunk(4096);
+    Sample sample;
+    for (u_int8_t digits = 1; digits <= SIGNIFICANT_DIGITS_MAX; ++digits) {
+        for (int i = 0; i < 100; ++i) {
+            double value = (i % 2 ? -1 : 1) * sin(i) * pow(10, i % 7) / 3;
+            double result = Compressed_RoundSignificantDigits(value, digits);
+            mu_check(fabs(result - value) <= fabs(value) * 0.5 * pow(10, -digits));
+            assert_same_double(result, Compressed_RoundSignificantDigits(result, digits));
+            union64bits bits = { .d = result };
+            mu_check(bits.u == 0 || __builtin_ctzll(bits.u) >= 50 - digits * 10 / 3);
+        }
+    }
+    for (int i = 0; i < 200; ++i) {
+        double value = 20 + sin(i / 10.0);
+        sample = (Sample){ .timestamp = i, .value = value };
+        mu_assert(Compressed_AddSample(lossless, &sample) == CR_OK, "append lossless sample");
+        sample.value = Compressed_RoundSignificantDigits(value, 4);
+        mu_assert(Compressed_AddSample(rounded, &sample) == CR_OK, "append rounded sample");
+    }
+    // the rounded XORs end in zeros that are left out
+    mu_check(rounded->idx * 2 < lossless->idx);
+
+    Compressed_FreeChunk(rounded);
+    Compressed_FreeChunk(lossless);
+}
+
+MU_TEST(test_Compressed_ReverseIterator) {
+    srand((unsigned int)time(NULL));
+    CompressedChunk *chunk = Compressed_NewChunk(4096);
+
+    // empty and single sample chunks
+    assert_reverse_matches_forward(chunk);
+    Sample s = { .timestamp = 1, .value = 1.5 };
+    Compressed_AddSample(chunk, &s);
+    assert_reverse_matches_forward(chunk);
+
+    // random values span several checkpoints
+    timestamp_t ts = 1;
+    while (Compressed_AddSample(chunk, &s) == CR_OK) {
+        ts += 1 + rand() % 1000;
+        s.timestamp = ts;
+        s.value = (double)rand() / RAND_MAX * 100;
+    }
+    mu_assert(chunk->checkpointsCount > 1, "random samples create checkpoints");
+    assert_reverse_matches_forward(chunk);
+    Compressed_FreeChunk(chunk);
+
+    // constant values hit the per-block sample limit instead of the bit interval
+    chunk = Compressed_NewChunk(4096);
+    for (ts = 1; ts <= 10 * CHECKPOINT_MAX_SAMPLES + 7; ++ts) {
+        Sample c = { .timestamp = ts, .value = 42 };
+        mu_assert(Compressed_AddSample(chunk, &c) == CR_OK, "add sample");
+    }
+    mu_assert_int_eq(10, chunk->checkpointsCount);
+    assert_reverse_matches_forward(chunk);
+
+    // checkpoints are rebuilt when the chunk is re-encoded
+    int size = 0;
+    UpsertCtx uCtx = { .inChunk = chunk, .sample = { .timestamp = 3, .value = -1 } };
+    mu_assert(Compressed_UpsertSample(&uCtx, &size, DP_LAST) == CR_OK, "upsert");
+    assert_reverse_matches_forward(chunk);
+
+    CompressedChunk *chunk2 = Compressed_SplitChunk(chunk);
+    assert_reverse_matches_forward(chunk);
+    assert_reverse_matches_forward(chunk2);
+
+    u_int32_t checkpointsCount = chunk->checkpointsCount;
+    Compressed_BuildCheckpoints(chunk);
+    mu_assert_int_eq(checkpointsCount, chunk->checkpointsCount);
+    assert_reverse_matches_forward(chunk);
+
+    Compressed_FreeChunk(chunk);
+    Compressed_FreeChunk(chunk2);
+}
+
+MU_TEST(test_Compressed_SealChunk) {
+    const int total = 3000;
+    CompressedChunk *chunk = Compressed_NewChunk(8192);
+    Sample sample;
+    int added = 0;
+    for (; added < total; ++added) {
+        sample = (Sample){ .timestamp = 1000 + added * 10, .value = added % 37 };
+        if (Compressed_AddSample(chunk, &sample) != CR_OK) {
+            break;
+        }
+    }
+    mu_check(added > CHECKPOINT_MAX_SAMPLES * 2);
+    size_t sizeBefore = Compressed_GetChunkSize(chunk, true);
+    u_int32_t checkpointsCount = chunk->checkpointsCount;
+    mu_check(checkpointsCount > 1);
+    mu_check(Compressed_GetChunkUsedSize(chunk) <= Compressed_GetChunkSize(chunk, false));
+
+    Compressed_SealChunk(chunk);
+    mu_check(chunk->sealed);
+    mu_assert_int_eq(checkpointsCount, chunk->checkpointsCount);
+    mu_assert_int_eq((chunk->idx + 63) / 64 * 8, chunk->size);
+    mu_assert_int_eq(chunk->size, Compressed_GetChunkUsedSize(chunk));
+    mu_check(Compressed_GetChunkSize(chunk, true) < sizeBefore);
+    assert_reverse_matches_forward(chunk);
+
+    // reverse reads decode one block at a time
+    ChunkIterFuncs iterFuncs;
+    ChunkIter_t *iter = Compressed_NewChunkIterator(chunk, CHUNK_ITER_OP_REVERSE, &iterFuncs);
+    mu_assert_int_eq(CHECKPOINT_MAX_SAMPLES, ((Compressed_Iterator *)iter)->blockCapacity);
+    for (int i = added - 1; i >= 0; --i) {
+        mu_assert(iterFuncs.GetPrev(iter, &sample) == CR_OK, "read sample");
+        mu_assert_int_eq(1000 + i * 10, sample.timestamp);
+        mu_assert_double_eq(i % 37, sample.value);
+    }
+    mu_assert(iterFuncs.GetPrev(iter, &sample) == CR_END, "start of chunk");
+    iterFuncs.Free(iter);
+
+    // seeks start from the checkpoint before the sample
+    iter = Compressed_NewChunkIterator(chunk, CHUNK_ITER_OP_NONE, &iterFuncs);
+    iterFuncs.Seek(iter, 1000 + 1234 * 10);
+    mu_check(((Compressed_Iterator *)iter)->count > CHECKPOINT_MAX_SAMPLES);
+    while (iterFuncs.GetNext(iter, &sample) == CR_OK && sample.timestamp < 1000 + 1234 * 10) {
+    }
+    mu_assert_int_eq(1000 + 1234 * 10, sample.timestamp);
+    iterFuncs.Free(iter);
+
+    // writes unseal the chunk
+    UpsertCtx uCtx = { .inChunk = chunk, .sample = { .timestamp = 1005, .value = -1 } };
+    int size = 0;
+    mu_assert(Compressed_UpsertSample(&uCtx, &size, DP_LAST) == CR_OK, "upsert");
+    mu_assert_int_eq(1, size);
+    mu_check(!chunk->sealed);
+    mu_check(chunk->checkpointsCount > 0);
+    mu_assert_int_eq(added + 1, chunk->count);
+
+    Compressed_SealChunk(chunk);
+    sample = (Sample){ .timestamp = 1000 + added * 10, .value = 1 };
+    Compressed_AddSample(chunk, &sample);
+    mu_check(!chunk->sealed);
+    mu_check(chunk->checkpointsCount > 0);
+    Compressed_FreeChunk(chunk);
+}
+
+MU_TEST(test_Compressed_HeadBlock) {
+    for (int decimal = 0; decimal < 2; ++decimal) {
+        CompressedChunk *buffered = decimal ? Compressed_NewDecimalChunk(256)
+                                            : Compressed_NewChunk(256);
+        CompressedChunk *direct = decimal ? Compressed_NewDecimalChunk(256)
+                                          : Compressed_NewChunk(256);
+        Sample sample;
+        int added = 0;
+        ChunkResult res = CR_OK;
+        while (res == CR_OK) {
+            // the values take more decimals as the chunk fills up
+            sample = (Sample){ .timestamp = 1000 + added * 10 + added % 3,
+                               .value = added % 20 + (added > 40 ? 0.25 : 0) };
+            res = Compressed_BufferSample(buffered, &sample);
+            mu_assert(Compressed_AddSample(direct, &sample) == res, "same room as encoding");
+            added += res == CR_OK;
+            if (added % 7 == 0 || res != CR_OK) {
+                // reads include the samples of the head, without encoding them
+                mu_assert_int_eq(added, Compressed_ChunkNumOfSample(buffered));
+                mu_assert_int_eq(Compressed_GetLastTimestamp(direct),
+                                 Compressed_GetLastTimestamp(buffered));
+                const ChunkSummary *summary = Compressed_GetSummary(buffered);
+                mu_assert_int_eq(added, summary->count);
+                mu_assert_double_eq(Compressed_GetSummary(direct)->sum, summary->sum);
+                assert_reverse_matches_forward(buffered);
+            }
+        }
+        mu_check(added > HEAD_BLOCK_SAMPLES);
+        mu_check(buffered->head == NULL);
+        mu_assert_int_eq(direct->idx, buffered->idx);
+
+        // reads from the head, and seeks into it
+        Compressed_FreeChunk(buffered);
+        buffered = decimal ? Compressed_NewDecimalChunk(4096) : Compressed_NewChunk(4096);
+        for (int i = 0; i < 50; ++i) {
+            sample = (Sample){ .timestamp = i * 10, .value = i };
+            mu_assert(Compressed_BufferSample(buffered, &sample) == CR_OK, "buffer sample");
+        }
+        mu_assert_int_eq(50 - HEAD_BLOCK_SAMPLES - 1, buffered->head->count);
+        timestamp_t timestamps[64];
+        double values[64];
+        ChunkIterFuncs iterFuncs;
+        ChunkIter_t *iter =
+            Compressed_NewChunkIterator(buffered, CHUNK_ITER_OP_REVERSE, &iterFuncs);
+        iterFuncs.Seek(iter, 455);
+        mu_assert_int_eq(46, iterFuncs.GetPrevBatch(iter, timestamps, values, 64));
+        mu_assert_int_eq(450, timestamps[0]);
+        mu_assert_int_eq(0, timestamps[45]);
+        iterFuncs.Free(iter);
+        iter = Compressed_NewChunkIterator(buffered, CHUNK_ITER_OP_NONE, &iterFuncs);
+        iterFuncs.Seek(iter, 455);
+        mu_assert_int_eq(4, iterFuncs.GetNextBatch(iter, timestamps, values, 64));
+        mu_assert_int_eq(460, timestamps[0]);
+        mu_assert_double_eq(49, values[3]);
+        iterFuncs.Free(iter);
+
+        // writers encode the head first
+        Chunk_t *clone = Compressed_CloneChunk(buffered);
+        mu_assert_int_eq(0, buffered->head->count);
+        mu_assert_int_eq(50, ((CompressedChunk *)clone)->count);
+        Compressed_SealChunk(buffered);
+        mu_check(buffered->head == NULL);
+        mu_assert_int_eq(50, buffered->count);
+
+        Compressed_FreeChunk(clone);
+        Compressed_FreeChunk(direct);
+        Compressed_FreeChunk(buffered);
+    }
+}
+
+MU_TEST(test_ChunkIterator_Seek) {
+    const int numSamples = 5000;
+    CHUNK_TYPES_T types[] = { CHUNK_REGULAR, CHUNK_COMPRESSED };
+    for (int t = 0; t < 2; ++t) {
+        ChunkFuncs *funcs = GetChunkClass(types[t]);
+        Chunk_t *chunk = funcs->NewChunk(numSamples * SAMPLE_SIZE);
+        // timestamps 10, 20, ... with changing values
+        for (int i = 1; i <= numSamples; ++i) {
+            Sample sample = { .timestamp = i * 10, .value = i % 7 };
+            mu_assert(funcs->AddSample(chunk, &sample) == CR_OK, "add sample");
+        }
+
+        timestamp_t seeks[] = { 0, 5, 10, 15, 2560, 2565, 25005, 49990, 50000, 50001 };
+        for (int s = 0; s < sizeof(seeks) / sizeof(seeks[0]); ++s) {
+            timestamp_t seek = seeks[s];
+            ChunkIterFuncs iterFuncs;
+            Sample sample;
+
+            // forward: every sample at or after `seek` must still be returned, in order
+            ChunkIter_t *iter = funcs->NewChunkIterator(chunk, CHUNK_ITER_OP_NONE, &iterFuncs);
+            iterFuncs.Seek(iter, seek);
+            timestamp_t expected = max((seek + 9) / 10 * 10, 10);
+            int skipped = 0;
+            while (iterFuncs.GetNext(iter, &sample) == CR_OK) {
+                if (sample.timestamp < seek) {
+                    skipped++;
+                    continue;
+                }
+                mu_assert_int_eq(expected, sample.timestamp);
+                mu_assert_double_eq((expected / 10) % 7, sample.value);
+                expected += 10;
+            }
+            mu_assert_int_eq(numSamples * 10 + 10, expected);
+            mu_assert(skipped < CHECKPOINT_MAX_SAMPLES, "seek skipped most older samples");
+            if (types[t] == CHUNK_REGULAR) {
+                mu_assert_int_eq(0, skipped);
+            }
+            iterFuncs.Free(iter);
+
+            // reverse: every sample at or before `seek` must still be returned, in order
+            iter = funcs->NewChunkIterator(chunk, CHUNK_ITER_OP_REVERSE, &iterFuncs);
+            iterFuncs.Seek(iter, seek);
+            expected = min(seek / 10 * 10, numSamples * 10);
+            while (iterFuncs.GetPrev(iter, &sample) == CR_OK) {
+                mu_assert_int_eq(expected, sample.timestamp);
+                mu_assert_double_eq((expected / 10) % 7, sample.value);
+                expected -= 10;
+            }
+            mu_assert_int_eq(0, expected);
+            iterFuncs.Free(iter);
+        }
+        funcs->FreeChunk(chunk);
+    }
+}
+
+// Compares the summary of the chunk with the one computed from its samples
+static void assert_summary_matches_samples(ChunkFuncs *funcs, Chunk_t *chunk) {
+    ChunkSummary expected;
+    ChunkSummaryReset(&expected);
+    Sample sample;
+    ChunkIterFuncs iterFuncs;
+    ChunkIter_t *iter = funcs->NewChunkIterator(chunk, CHUNK_ITER_OP_NONE, &iterFuncs);
+    while (iterFuncs.GetNext(iter, &sample) == CR_OK) {
+        ChunkSummaryAdd(&expected, sample.value);
+    }
+    iterFuncs.Free(iter);
+
+    const ChunkSummary *summary = funcs->GetSummary(chunk);
+    mu_check(!summary->stale);
+    mu_assert_int_eq(expected.count, summary->count);
+    if (expected.count > 0) {
+        mu_assert_double_eq(expected.min, summary->min);
+        mu_assert_double_eq(expected.max, summary->max);
+        mu_assert_double_eq(expected.sum, summary->sum);
+        mu_assert_double_eq(expected.sumsq, summary->sumsq);
+        mu_assert_double_eq(expected.first, summary->first);
+        mu_assert_double_eq(expected.last, summary->last);
+    }
+}
+
+MU_TEST(test_Compressed_MergeSamples) {
+    srand((unsigned int)time(NULL));
+    DuplicatePolicy policies[] = { DP_LAST, DP_FIRST, DP_MIN, DP_MAX, DP_SUM };
+    for (int round = 0; round < 20; ++round) {
+        // the uncompressed chunk, upserted one sample at a time, is the reference
+        CompressedChunk *chunk = Compressed_NewChunk(4096);
+        Chunk *expected = Uncompressed_NewChunk(4096 * SAMPLE_SIZE);
+        for (timestamp_t ts = 2; ts < 2 * 2000; ts += 2) {
+            Sample sample = { .timestamp = ts, .value = rand() % 100 };
+            Compressed_AddSample(chunk, &sample);
+            Uncompressed_AddSample(expected, &sample);
+        }
+
+        // sorted unique timestamps, some of which already exist
+        PendingSample pending[100];
+        size_t count = 0;
+        timestamp_t ts = rand() % 50;
+        while (count < 100) {
+            pending[count].sample.timestamp = ts;
+            pending[count].sample.value = rand() % 100;
+            pending[count].duplicatePolicy = policies[rand() % 5];
+            count++;
+            ts += 1 + rand() % 60;
+        }
+
+        int expectedSize = 0;
+        for (size_t i = 0; i < count; ++i) {
+            int size = 0;
+            UpsertCtx uCtx = { .inChunk = expected, .sample = pending[i].sample };
+            Uncompressed_UpsertSample(&uCtx, &size, pending[i].duplicatePolicy);
+            expectedSize += size;
+        }
+
+        int size = 0;
+        mu_assert(Compressed_MergeSamples(chunk, pending, count, &size) == CR_OK, "merge");
+        mu_assert_int_eq(expectedSize, size);
+        mu_assert_int_eq(expected->num_samples, Compressed_ChunkNumOfSample(chunk));
+
+        Sample sample;
+        ChunkIter_t *iter = Compressed_NewChunkIterator(chunk, CHUNK_ITER_OP_NONE, NULL);
+        for (size_t i = 0; i < expected->num_samples; ++i) {
+            mu_assert(Compressed_ChunkIteratorGetNext(iter, &sample) == CR_OK, "read sample");
+            mu_assert_int_eq(expected->timestamps[i], sample.timestamp);
+            mu_assert_double_eq(expected->values[i], sample.value);
+        }
+        Compressed_FreeChunkIterator(iter);
+        assert_reverse_matches_forward(chunk);
+        assert_summary_matches_samples(GetChunkClass(CHUNK_COMPRESSED), chunk);
+
+        // BLOCK fails on an existing sample and leaves the chunk untouched
+        u_int64_t numSamples = Compressed_ChunkNumOfSample(chunk);
+        PendingSample blocked = { .sample = { expected->timestamps[10], expected->values[10] },
+                                  .duplicatePolicy = DP_BLOCK };
+        mu_assert(Compressed_MergeSamples(chunk, &blocked, 1, &size) == CR_ERR, "block");
+        mu_assert_int_eq(0, size);
+        mu_assert_int_eq(numSamples, Compressed_ChunkNumOfSample(chunk));
+
+        Compressed_FreeChunk(chunk);
+        Uncompressed_FreeChunk(expected);
+    }
+}
+
+MU_TEST(test_Compressed_DelRange) {
+    srand((unsigned int)time(NULL));
+    for (int round = 0; round < 20; ++round) {
+        // the uncompressed chunk is the reference
+        CompressedChunk *chunk = Compressed_NewChunk(4096);
+        Chunk *expected = Uncompressed_NewChunk(4096 * SAMPLE_SIZE);
+        for (timestamp_t ts = 10; ts < 10 + 3 * 1000; ts += 1 + rand() % 5) {
+            Sample sample = { .timestamp = ts, .value = rand() % 100 };
+            Compressed_AddSample(chunk, &sample);
+            Uncompressed_AddSample(expected, &sample);
+        }
+        if (round % 2) {
+            Compressed_SealChunk(chunk);
+        }
+
+        for (int i = 0; i < 3; ++i) {
+            timestamp_t start = rand() % 3100, end = start + rand() % (i == 2 ? 3000 : 300);
+            size_t removed = Uncompressed_DelRange(expected, start, end);
+            mu_assert_int_eq(removed, Compressed_DelRange(chunk, start, end));
+            mu_assert_int_eq(expected->num_samples, Compressed_ChunkNumOfSample(chunk));
+        }
+        mu_assert_int_eq(0, Compressed_DelRange(chunk, 5000, 6000));
+
+        Sample sample;
+        ChunkIter_t *iter = Compressed_NewChunkIterator(chunk, CHUNK_ITER_OP_NONE, NULL);
+        for (size_t i = 0; i < expected->num_samples; ++i) {
+            mu_assert(Compressed_ChunkIteratorGetNext(iter, &sample) == CR_OK, "read sample");
+            mu_assert_int_eq(expected->timestamps[i], sample.timestamp);
+            mu_assert_double_eq(expected->values[i], sample.value);
+        }
+        mu_assert(Compressed_ChunkIteratorGetNext(iter, &sample) == CR_END, "no more samples");
+        Compressed_FreeChunkIterator(iter);
+        if (expected->num_samples > 0) {
+            assert_reverse_matches_forward(chunk);
+            assert_summary_matches_samples(GetChunkClass(CHUNK_COMPRESSED), chunk);
+            mu_assert_int_eq(expected->timestamps[0], Compressed_GetFirstTimestamp(chunk));
+        }
+
+        // the chunk remains writable
+        Sample last = { .timestamp = 10000, .value = 1 };
+        mu_assert(Compressed_AddSample(chunk, &last) == CR_OK, "append");
+        mu_assert_int_eq(10000, Compressed_GetLastTimestamp(chunk));
+
+        Compressed_FreeChunk(chunk);
+        Uncompressed_FreeChunk(expected);
+    }
+}
+
+MU_TEST(test_ChunkIterator_Batch) {
+    srand((unsigned int)time(NULL));
+    const int numSamples = 3000;
+    CHUNK_TYPES_T types[] = { CHUNK_REGULAR, CHUNK_COMPRESSED };
+    for (int t = 0; t < 2; ++t) {
+        ChunkFuncs *funcs = GetChunkClass(types[t]);
+        Chunk_t *chunk = funcs->NewChunk(numSamples * SAMPLE_SIZE);
+        for (int i = 0; i < numSamples; ++i) {
+            Sample sample = { .timestamp = i * 3, .value = rand() % 1000 };
+            funcs->AddSample(chunk, &sample);
+        }
+
+        for (int reverse = 0; reverse < 2; ++reverse) {
+            ChunkIterFuncs iterFuncs, batchFuncs;
+            int options = reverse ? CHUNK_ITER_OP_REVERSE : CHUNK_ITER_OP_NONE;
+            ChunkIter_t *iter = funcs->NewChunkIterator(chunk, options, &iterFuncs);
+            ChunkIter_t *batchIter = funcs->NewChunkIterator(chunk, options, &batchFuncs);
+
+            timestamp_t timestamps[100];
+            double values[100];
+            size_t total = 0, count;
+            do {
+                size_t max = 1 + rand() % 100;
+                count = reverse ? batchFuncs.GetPrevBatch(batchIter, timestamps, values, max)
+                                : batchFuncs.GetNextBatch(batchIter, timestamps, values, max);
+                mu_assert(count <= max, "batch size");
+                for (size_t i = 0; i < count; ++i) {
+                    Sample sample;
+                    ChunkResult res = reverse ? iterFuncs.GetPrev(iter, &sample)
+                                              : iterFuncs.GetNext(iter, &sample);
+                    mu_assert(res == CR_OK, "batch returned too many samples");
+                    mu_assert_int_eq(sample.timestamp, timestamps[i]);
+                    mu_assert_double_eq(sample.value, values[i]);
+                }
+                total += count;
+            } while (count > 0);
+            mu_assert_int_eq(numSamples, total);
+            iterFuncs.Free(iter);
+            batchFuncs.Free(batchIter);
+        }
+        funcs->FreeChunk(chunk);
+    }
+}
+
+MU_TEST(test_ChunkIterator_InPlace) {
+    const int numChunks = 4, numSamples = 1000;
+    CHUNK_TYPES_T types[] = { CHUNK_REGULAR, CHUNK_COMPRESSED };
+    for (int t = 0; t < 2; ++t) {
+        ChunkFuncs *funcs = GetChunkClass(types[t]);
+        Chunk_t *chunks[numChunks];
+        for (int c = 0; c < numChunks; ++c) {
+            // chunks of different lengths, so the reused buffers must fit each of them
+            chunks[c] = funcs->NewChunk(numSamples * SAMPLE_SIZE);
+            for (int i = 0; i < numSamples / (c + 1); ++i) {
+                Sample sample = { .timestamp = c * numSamples + i, .value = i % 13 };
+                funcs->AddSample(chunks[c], &sample);
+            }
+        }
+
+        for (int reverse = 0; reverse < 2; ++reverse) {
+            int options = reverse ? CHUNK_ITER_OP_REVERSE : CHUNK_ITER_OP_NONE;
+            ChunkIterStorage storage = { 0 };
+            ChunkIterFuncs iterFuncs, expectedFuncs;
+            ChunkIter_t *iter = NULL;
+            for (int c = 0; c < numChunks; ++c) {
+                // a single storage serves the iterators of all the chunks, one after the other
+                iter = funcs->InitChunkIterator(chunks[c], options, &iterFuncs, &storage);
+                mu_check(iter == (ChunkIter_t *)&storage);
+                ChunkIter_t *expected = funcs->NewChunkIterator(chunks[c], options, &expectedFuncs);
+                Sample sample, expectedSample;
+                size_t count = 0;
+                while ((reverse ? expectedFuncs.GetPrev(expected, &expectedSample)
+                                : expectedFuncs.GetNext(expected, &expectedSample)) == CR_OK) {
+                    ChunkResult res = reverse ? iterFuncs.GetPrev(iter, &sample)
+                                              : iterFuncs.GetNext(iter, &sample);
+                    mu_assert(res == CR_OK, "in place iterator ended early");
+                    mu_assert_int_eq(expectedSample.timestamp, sample.timestamp);
+                    mu_assert_double_eq(expectedSample.value, sample.value);
+                    count++;
+                }
+                mu_assert_int_eq(funcs->GetNumOfSample(chunks[c]), count);
+                ChunkResult res =
+                    reverse ? iterFuncs.GetPrev(iter, &sample) : iterFuncs.GetNext(iter, &sample);
+                mu_assert(res == CR_END, "in place iterator did not end");
+                expectedFuncs.Free(expected);
+            }
+            iterFuncs.Release(iter);
+        }
+        for (int c = 0; c < numChunks; ++c) {
+            funcs->FreeChunk(chunks[c]);
+        }
+    }
+}
+
+MU_TEST(test_ChunkSummary) {
+    srand((unsigned int)time(NULL));
+    CHUNK_TYPES_T types[] = { CHUNK_REGULAR, CHUNK_COMPRESSED };
+    for (int t = 0; t < 2; ++t) {
+        ChunkFuncs *funcs = GetChunkClass(types[t]);
+        Chunk_t *chunk = funcs->NewChunk(4096 * SAMPLE_SIZE);
+        assert_summary_matches_samples(funcs, chunk);
+        for (timestamp_t ts = 10; ts < 10 * 3000; ts += 10) {
+            Sample sample = { .timestamp = ts, .value = rand() % 1000 - 500 };
+            funcs->AddSample(chunk, &sample);
+        }
+        assert_summary_matches_samples(funcs, chunk);
+
+        // upserts either insert or update a sample, at the head, middle or tail of the chunk
+        timestamp_t upserts[] = { 5, 10, 15005, 15010, 29990, 29995 };
+        for (size_t i = 0; i < sizeof(upserts) / sizeof(upserts[0]); ++i) {
+            int size = 0;
+            UpsertCtx uCtx = { .inChunk = chunk,
+                               .sample = { .timestamp = upserts[i], .value = 1000 + i } };
+            mu_assert(funcs->UpsertSample(&uCtx, &size, DP_LAST) == CR_OK, "upsert");
+            assert_summary_matches_samples(funcs, chunk);
+        }
+
+        Chunk_t *split = funcs->SplitChunk(chunk);
+        assert_summary_matches_samples(funcs, chunk);
+        assert_summary_matches_samples(funcs, split);
+
+        funcs->FreeChunk(chunk);
+        funcs->FreeChunk(split);
+    }
+}
+
+MU_TEST(test_Compressed_SplitChunk_Checkpoints) {
+    ChunkFuncs *funcs = GetChunkClass(CHUNK_COMPRESSED);
+    const int total = 10 * CHECKPOINT_MAX_SAMPLES + 100;
+    CompressedChunk *chunk = Compressed_NewChunk(8192);
+    for (int i = 0; i < total; ++i) {
+        Sample sample = { .timestamp = 1000 + i * 10, .value = i % 37 };
+        mu_assert(Compressed_AddSample(chunk, &sample) == CR_OK, "add sample");
+    }
+    CompressedChunk *sealed = Compressed_CloneChunk(chunk);
+    Compressed_SealChunk(sealed);
+
+    // split at the checkpoint nearest the middle, the first half keeping the blocks before it
+    u_int32_t checkpointsCount = chunk->checkpointsCount;
+    CompressedChunk *second = Compressed_SplitChunk(chunk);
+    mu_assert_int_eq(5 * CHECKPOINT_MAX_SAMPLES, chunk->count);
+    mu_assert_int_eq(total - 5 * CHECKPOINT_MAX_SAMPLES, second->count);
+    mu_assert_int_eq(5, chunk->checkpointsCount);
+    mu_check(second->checkpointsCount < checkpointsCount);
+    mu_assert_int_eq((chunk->idx + 63) / 64 * 8, chunk->size);
+    Sample sample;
+    int i = 0;
+    CompressedChunk *halves[] = { chunk, second };
+    for (int h = 0; h < 2; ++h) {
+        Compressed_Iterator *iter =
+            Compressed_NewChunkIterator(halves[h], CHUNK_ITER_OP_NONE, NULL);
+        while (Compressed_ChunkIteratorGetNext(iter, &sample) == CR_OK) {
+            mu_assert_int_eq(1000 + i * 10, sample.timestamp);
+            mu_assert_double_eq(i % 37, sample.value);
+            i++;
+        }
+        Compressed_FreeChunkIterator(iter);
+        assert_reverse_matches_forward(halves[h]);
+        assert_summary_matches_samples(funcs, halves[h]);
+    }
+    mu_assert_int_eq(total, i);
+
+    // the first half grows past its copied blocks
+    int size = 0;
+    UpsertCtx uCtx = { .inChunk = chunk, .sample = { .timestamp = 1000 + total * 10, .value = 1 } };
+    mu_assert(Compressed_UpsertSample(&uCtx, &size, DP_LAST) == CR_OK, "upsert");
+    mu_assert_int_eq(5 * CHECKPOINT_MAX_SAMPLES + 1, chunk->count);
+    assert_reverse_matches_forward(chunk);
+
+    // sealed chunks are split at their checkpoints as well
+    CompressedChunk *sealedSecond = Compressed_SplitChunk(sealed);
+    mu_assert_int_eq(5 * CHECKPOINT_MAX_SAMPLES, sealed->count);
+    mu_assert_int_eq(total - 5 * CHECKPOINT_MAX_SAMPLES, sealedSecond->count);
+    assert_summary_matches_samples(funcs, sealed);
+    assert_summary_matches_samples(funcs, sealedSecond);
+
+    Compressed_FreeChunk(chunk);
+    Compressed_FreeChunk(second);
+    Compressed_FreeChunk(sealed);
+    Compressed_FreeChunk(sealedSecond);
+}
+
 MU_TEST_SUITE(compressed_chunk_test_suite) {
     MU_RUN_TEST(test_compressed_upsert);
     MU_RUN_TEST(test_compressed_fail_appendInteger);
     MU_RUN_TEST(test_Compressed_SplitChunk_empty);
     MU_RUN_TEST(test_Compressed_SplitChunk_odd);
     MU_RUN_TEST(test_Compressed_SplitChunk_force_realloc);
+    MU_RUN_TEST(test_Compressed_SizeEstimator);
+    MU_RUN_TEST(test_Compressed_DecodeBuckets);
+    MU_RUN_TEST(test_Compressed_RegularRun);
+    MU_RUN_TEST(test_Compressed_DecimalValues);
+    MU_RUN_TEST(test_Compressed_SignificantDigits);
+    MU_RUN_TEST(test_Compressed_ReverseIterator);
+    MU_RUN_TEST(test_Compressed_SealChunk);
+    MU_RUN_TEST(test_Compressed_HeadBlock);
+    MU_RUN_TEST(test_ChunkIterator_Seek);
+    MU_RUN_TEST(test_Compressed_MergeSamples);
+    MU_RUN_TEST(test_Compressed_DelRange);
+    MU_RUN_TEST(test_ChunkIterator_Batch);
+    MU_RUN_TEST(test_ChunkIterator_InPlace);
+    MU_RUN_TEST(test_ChunkSummary);
+    MU_RUN_TEST(test_Compressed_SplitChunk_Checkpoints);
 }
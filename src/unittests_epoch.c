@@ -0,0 +1,64 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "epoch.h"
+#include "minunit.h"
+
+static int epochReclaimed;
+
+static void countReclaimed(void *ptr) {
+    epochReclaimed += *(int *)ptr;
+}
+
+MU_TEST(test_epoch_retire) {
+    int one = 1, ten = 10, hundred = 100;
+    epochReclaimed = 0;
+
+    // without readers the pointer is freed right away
+    Epoch_Retire(&one, countReclaimed);
+    mu_assert_int_eq(1, epochReclaimed);
+
+    EpochGuard first, second;
+    Epoch_Enter(&first);
+    mu_check(Epoch_Pinned(first.epoch));
+    mu_check(!Epoch_Pinned(first.epoch - 1));
+    Epoch_Retire(&ten, countReclaimed);
+    Epoch_Enter(&second);
+    mu_check(second.epoch > first.epoch);
+    Epoch_Retire(&hundred, countReclaimed);
+    mu_assert_int_eq(1, epochReclaimed);
+    mu_assert_int_eq(2, Epoch_RetiredCount());
+
+    // `ten` was retired before the second reader entered, which can't see it
+    Epoch_Exit(&first);
+    mu_assert_int_eq(11, epochReclaimed);
+    mu_check(!Epoch_Pinned(first.epoch));
+    mu_check(Epoch_Pinned(second.epoch));
+    Epoch_Exit(&second);
+    mu_assert_int_eq(111, epochReclaimed);
+    mu_assert_int_eq(0, Epoch_RetiredCount());
+    mu_check(!Epoch_Pinned(second.epoch));
+}
+
+MU_TEST(test_epoch_readers_out_of_order) {
+    int one = 1;
+    epochReclaimed = 0;
+    EpochGuard first, second;
+    Epoch_Enter(&first);
+    Epoch_Enter(&second);
+    Epoch_Retire(&one, countReclaimed);
+
+    // the newest reader exits first, the oldest one still pins the epoch
+    Epoch_Exit(&second);
+    mu_assert_int_eq(0, epochReclaimed);
+    mu_check(Epoch_Pinned(second.epoch));
+    Epoch_Exit(&first);
+    mu_assert_int_eq(1, epochReclaimed);
+}
+
+MU_TEST_SUITE(epoch_test_suite) {
+    MU_RUN_TEST(test_epoch_retire);
+    MU_RUN_TEST(test_epoch_readers_out_of_order);
+}
@@ -76,6 +76,9 @@ MU_TEST(test_StringLenAggTypeToEnum) {
     mu_check(StringAggTypeToEnum("first") == TS_AGG_FIRST);
     mu_check(StringAggTypeToEnum("last") == TS_AGG_LAST);
     mu_check(StringAggTypeToEnum("range") == TS_AGG_RANGE);
+    mu_check(StringAggTypeToEnum("p95") == TS_AGG_P95);
+    mu_check(StringAggTypeToEnum("P99.9") == TS_AGG_P999);
+    mu_check(StringAggTypeToEnum("p98") == TS_AGG_INVALID);
 }
 
 MU_TEST_SUITE(parse_policies_test_suite) {
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "compressed_chunk.h"
+#include "consts.h"
+#include "minunit.h"
+#include "segment_store.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "rmutil/alloc.h"
+
+MU_TEST(test_segment_store_append) {
+    mu_assert_int_eq(TSDB_ERROR, SegmentStore_Init("/nonexistent/segments"));
+    mu_check(!SegmentStore_Enabled());
+    mu_check(SegmentStore_Append("x", 1) == NULL);
+
+    mu_assert_int_eq(TSDB_OK, SegmentStore_Init("/tmp"));
+    mu_check(SegmentStore_Enabled());
+    size_t live = SegmentStore_LiveBytes();
+
+    char buffer[100];
+    for (int i = 0; i < 100; i++) {
+        buffer[i] = (char)i;
+    }
+    // sizes are rounded up to words
+    char *first = SegmentStore_Append(buffer, 100);
+    char *second = SegmentStore_Append(buffer, 13);
+    mu_check(first != NULL && second != NULL);
+    mu_assert_int_eq(0, memcmp(first, buffer, 100));
+    mu_assert_int_eq(0, memcmp(second, buffer, 13));
+    mu_assert_int_eq(0, (second - first) % 8);
+    mu_assert_int_eq(live + 104 + 16, SegmentStore_LiveBytes());
+
+    SegmentStore_Release(first, 100);
+    SegmentStore_Release(second, 13);
+    mu_assert_int_eq(live, SegmentStore_LiveBytes());
+    mu_check(SegmentStore_Append(buffer, SEGMENT_STORE_SEGMENT_SIZE + 1) == NULL);
+}
+
+MU_TEST(test_Compressed_OffloadChunk) {
+    CompressedChunk *chunk = Compressed_NewChunk(4096);
+    Sample sample;
+    int added = 0;
+    for (;; ++added) {
+        sample = (Sample){ .timestamp = 1000 + added * 10, .value = added % 13 };
+        if (Compressed_AddSample(chunk, &sample) != CR_OK) {
+            break;
+        }
+    }
+    size_t live = SegmentStore_LiveBytes();
+    size_t dataSize = Compressed_GetChunkSize(chunk, false);
+
+    Compressed_OffloadChunk(chunk);
+    mu_check(chunk->sealed && chunk->offloaded);
+    mu_assert_int_eq(live + Compressed_GetChunkSize(chunk, false), SegmentStore_LiveBytes());
+    // the header and the checkpoints stay in memory
+    mu_check(chunk->checkpointsCount > 0);
+    size_t checkpointsSize = chunk->checkpointsCount * sizeof(CompressedCheckpoint);
+    mu_assert_int_eq(sizeof(CompressedChunk) + checkpointsSize,
+                     Compressed_GetChunkSize(chunk, true));
+    mu_check(Compressed_GetChunkSize(chunk, false) <= dataSize);
+
+    // clones are in memory
+    CompressedChunk *clone = Compressed_CloneChunk(chunk);
+    mu_check(!clone->offloaded);
+    ChunkIterFuncs iterFuncs;
+    ChunkIter_t *iter = Compressed_NewChunkIterator(chunk, CHUNK_ITER_OP_REVERSE, &iterFuncs);
+    for (int i = added - 1; i >= 0; --i) {
+        mu_assert(iterFuncs.GetPrev(iter, &sample) == CR_OK, "read sample");
+        mu_assert_int_eq(1000 + i * 10, sample.timestamp);
+        mu_assert_double_eq(i % 13, sample.value);
+    }
+    iterFuncs.Free(iter);
+    Compressed_FreeChunk(clone);
+
+    // appending brings the data back in memory
+    sample = (Sample){ .timestamp = 1000 + added * 10, .value = 1 };
+    Compressed_AddSample(chunk, &sample);
+    mu_check(!chunk->offloaded);
+    mu_assert_int_eq(live, SegmentStore_LiveBytes());
+
+    Compressed_OffloadChunk(chunk);
+    mu_check(chunk->offloaded);
+    Compressed_FreeChunk(chunk);
+    mu_assert_int_eq(live, SegmentStore_LiveBytes());
+}
+
+MU_TEST_SUITE(segment_store_test_suite) {
+    MU_RUN_TEST(test_segment_store_append);
+    MU_RUN_TEST(test_Compressed_OffloadChunk);
+}
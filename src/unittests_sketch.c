@@ -0,0 +1,102 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "consts.h"
+#include "minunit.h"
+#include "sketch.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// the quantiles of the sketch are within the relative accuracy of the exact ones
+static void checkQuantiles(const QuantileSketch *sketch, double *values, size_t count) {
+    const double quantiles[] = { 0, 0.1, 0.5, 0.9, 0.95, 0.99, 0.999, 1 };
+    qsort(values, count, sizeof(double), compareDoubles);
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+        double expected = values[(size_t)(quantiles[q] * (count - 1))];
+        double actual;
+        mu_assert_int_eq(TSDB_OK, QuantileSketch_Quantile(sketch, quantiles[q], &actual));
+        mu_check(fabs(actual - expected) <= SKETCH_RELATIVE_ACCURACY * fabs(expected) + 1e-12);
+    }
+}
+
+MU_TEST(test_sketch_quantiles) {
+    const size_t total = 10000;
+    double *values = malloc(total * sizeof(double));
+    QuantileSketch sketch, merged, part;
+    QuantileSketch_Init(&sketch);
+    QuantileSketch_Init(&merged);
+    QuantileSketch_Init(&part);
+    double value;
+    mu_assert_int_eq(TSDB_ERROR, QuantileSketch_Quantile(&sketch, 0.5, &value));
+
+    srand(11);
+    for (size_t i = 0; i < total; ++i) {
+        // latencies over several orders of magnitude, some negative values and zeros
+        values[i] = exp((double)(rand() % 1000) / 100) * (i % 7 == 0 ? -1 : 1) * (i % 13 != 0);
+        QuantileSketch_Add(&sketch, values[i]);
+        QuantileSketch_Add(&part, values[i]);
+        if (i % 1000 == 999) {
+            QuantileSketch_Merge(&merged, &part);
+            QuantileSketch_Reset(&part);
+        }
+    }
+    QuantileSketch_Add(&sketch, NAN);
+    mu_assert_int_eq(total, sketch.count);
+    mu_assert_int_eq(total, merged.count);
+    checkQuantiles(&sketch, values, total);
+    checkQuantiles(&merged, values, total);
+
+    // removing values gives the sketch of the others
+    for (size_t i = 1; i < total; i += 2) {
+        if (QuantileSketch_Remove(&sketch, values[i]) == TSDB_OK) {
+            values[i] = NAN;
+        }
+    }
+    mu_assert_int_eq(TSDB_ERROR, QuantileSketch_Remove(&sketch, values[0]));
+    mu_assert_int_eq(TSDB_ERROR, QuantileSketch_Remove(&sketch, values[total - 1] + 1));
+    size_t kept = 0;
+    for (size_t i = 0; i < total; ++i) {
+        if (!isnan(values[i])) {
+            values[kept++] = values[i];
+        }
+    }
+    mu_assert_int_eq(kept, sketch.count);
+    checkQuantiles(&sketch, values, kept);
+
+    QuantileSketch_Free(&sketch);
+    QuantileSketch_Free(&merged);
+    QuantileSketch_Free(&part);
+    free(values);
+}
+
+MU_TEST(test_sketch_collapse) {
+    QuantileSketch sketch;
+    QuantileSketch_Init(&sketch);
+    // 30 orders of magnitude, past what the bins cover
+    double values[300];
+    for (int i = 0; i < 300; ++i) {
+        values[i] = pow(10, (double)i / 10 - 9);
+        QuantileSketch_Add(&sketch, values[i]);
+    }
+    mu_assert_int_eq(SKETCH_MAX_BINS, sketch.positive.size);
+    double value;
+    mu_assert_int_eq(TSDB_OK, QuantileSketch_Quantile(&sketch, 0, &value));
+    mu_assert_double_eq(values[0], value);
+    // the largest values keep their accuracy
+    mu_assert_int_eq(TSDB_OK, QuantileSketch_Quantile(&sketch, 0.9, &value));
+    mu_check(fabs(value - values[269]) <= SKETCH_RELATIVE_ACCURACY * values[269]);
+    QuantileSketch_Free(&sketch);
+}
+
+MU_TEST_SUITE(sketch_test_suite) {
+    MU_RUN_TEST(test_sketch_quantiles);
+    MU_RUN_TEST(test_sketch_collapse);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "minunit.h"
+#include "stage_stats.h"
+
+MU_TEST(test_stage_stats_quantiles) {
+    StageHistogram histogram = { 0 };
+    mu_assert_int_eq(0, StageStats_Quantile(&histogram, 0.5));
+
+    // 90 calls within [64, 128) ns and 10 within [4096, 8192) ns
+    histogram.buckets[6] = 90;
+    histogram.buckets[12] = 10;
+    mu_assert_int_eq(128, StageStats_Quantile(&histogram, 0));
+    mu_assert_int_eq(128, StageStats_Quantile(&histogram, 0.5));
+    mu_assert_int_eq(8192, StageStats_Quantile(&histogram, 0.99));
+    mu_assert_int_eq(8192, StageStats_Quantile(&histogram, 1));
+}
+
+MU_TEST(test_stage_stats_profile) {
+    StageHistogram before, after;
+    StageStats_Get(STAGE_ADD_SAMPLE, &before);
+
+    // the ingestion stages are sampled, unless profiling
+    for (int i = 0; i < STAGE_SAMPLING * 4; i++) {
+        STAGE_BEGIN(STAGE_ADD_SAMPLE, start);
+        STAGE_END(STAGE_ADD_SAMPLE, start);
+    }
+    StageStats_Get(STAGE_ADD_SAMPLE, &after);
+    mu_assert_int_eq(STAGE_SAMPLING * 4, after.calls - before.calls);
+    mu_assert_int_eq(4, after.timed - before.timed);
+
+    StageProfile profile;
+    StageStats_BeginProfile(&profile);
+    for (int i = 0; i < 10; i++) {
+        STAGE_BEGIN(STAGE_ADD_SAMPLE, start);
+        STAGE_END(STAGE_ADD_SAMPLE, start);
+    }
+    STAGE_BEGIN(STAGE_QUERY_INDEX, start);
+    STAGE_END(STAGE_QUERY_INDEX, start);
+    StageStats_EndProfile();
+    STAGE_BEGIN(STAGE_QUERY_INDEX, later);
+    STAGE_END(STAGE_QUERY_INDEX, later);
+
+    mu_assert_int_eq(10, profile.calls[STAGE_ADD_SAMPLE]);
+    mu_assert_int_eq(1, profile.calls[STAGE_QUERY_INDEX]);
+    mu_assert_int_eq(0, profile.calls[STAGE_REPLY]);
+    StageStats_Get(STAGE_ADD_SAMPLE, &before);
+    mu_assert_int_eq(10, before.timed - after.timed);
+}
+
+MU_TEST_SUITE(stage_stats_test_suite) {
+    MU_RUN_TEST(test_stage_stats_quantiles);
+#if STAGE_STATS
+    MU_RUN_TEST(test_stage_stats_profile);
+#endif
+}
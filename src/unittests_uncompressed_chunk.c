@@ -114,35 +114,84 @@ MU_TEST(test_Uncompressed_Uncompressed_UpsertSample_DuplicatePolicy) {
     mu_assert_int_eq(1, chunk->num_samples);
     const u_int64_t firstTs = Uncompressed_GetFirstTimestamp(chunk);
     mu_assert_int_eq(1, firstTs);
-    mu_assert_double_eq(-0.5, chunk->samples[0].value);
+    mu_assert_double_eq(-0.5, chunk->values[0]);
     // DP_MAX should keep -0.5 given that -0.4 is smaller
     uCtx.sample.value = -0.4;
     rv = Uncompressed_UpsertSample(&uCtx, &size, DP_MIN);
     mu_assert(rv == CR_OK, "duplicate min not changing old value");
     mu_assert_int_eq(1, chunk->num_samples);
-    mu_assert_double_eq(-0.5, chunk->samples[0].value);
+    mu_assert_double_eq(-0.5, chunk->values[0]);
     // DP_MIN should replace -0.5 by -0.6
     uCtx.sample.value = -0.6;
     rv = Uncompressed_UpsertSample(&uCtx, &size, DP_MIN);
     mu_assert(rv == CR_OK, "duplicate min changing old value");
     mu_assert_int_eq(1, chunk->num_samples);
-    mu_assert_double_eq(-0.6, chunk->samples[0].value);
+    mu_assert_double_eq(-0.6, chunk->values[0]);
     // DP_MAX should keep -0.6 given that -1 is smaller
     uCtx.sample.value = -1.0;
     rv = Uncompressed_UpsertSample(&uCtx, &size, DP_MAX);
     mu_assert(rv == CR_OK, "duplicate max not changing old value");
-    mu_assert_double_eq(-0.6, chunk->samples[0].value);
+    mu_assert_double_eq(-0.6, chunk->values[0]);
     // DP_MAX should replace -0.6 by -0.2
     uCtx.sample.value = -0.2;
     rv = Uncompressed_UpsertSample(&uCtx, &size, DP_MAX);
     mu_assert(rv == CR_OK, "duplicate max changing old value");
-    mu_assert_double_eq(-0.2, chunk->samples[0].value);
+    mu_assert_double_eq(-0.2, chunk->values[0]);
     Uncompressed_FreeChunk(chunk);
 }
 
+// Growing, sealing, splitting and deleting move both columns
+MU_TEST(test_Uncompressed_Columns) {
+    Chunk *chunk = Uncompressed_NewChunk(8 * SAMPLE_SIZE);
+    for (timestamp_t ts = 0; ts < 16; ts += 2) {
+        Sample sample = { .timestamp = ts, .value = ts * 10.0 };
+        mu_assert(Uncompressed_AddSample(chunk, &sample) == CR_OK, "add sample");
+    }
+    // the chunk is full, each upsert grows it
+    for (timestamp_t ts = 1; ts < 16; ts += 2) {
+        UpsertCtx uCtx = { .inChunk = chunk, .sample = { .timestamp = ts, .value = ts * 10.0 } };
+        int size = 0;
+        mu_assert(Uncompressed_UpsertSample(&uCtx, &size, DP_BLOCK) == CR_OK, "upsert");
+        mu_assert_int_eq(1, size);
+    }
+    mu_assert_int_eq(16, chunk->num_samples);
+    mu_assert_int_eq(16 * SAMPLE_SIZE, chunk->size);
+    for (size_t i = 0; i < 16; i++) {
+        mu_assert_int_eq(i, chunk->timestamps[i]);
+        mu_assert_double_eq(i * 10.0, chunk->values[i]);
+    }
+
+    Chunk *second = Uncompressed_SplitChunk(chunk);
+    mu_assert_int_eq(8, chunk->num_samples);
+    mu_assert_int_eq(8, second->num_samples);
+    mu_assert_int_eq(8, Uncompressed_GetFirstTimestamp(second));
+    mu_assert_double_eq(15 * 10.0, second->values[7]);
+    mu_assert_double_eq(7 * 10.0, chunk->values[7]);
+    // 10 times the sum of 8 to 15
+    mu_assert_double_eq(920, Uncompressed_GetSummary(second)->sum);
+
+    mu_assert_int_eq(3, Uncompressed_DelRange(chunk, 2, 4));
+    mu_assert_int_eq(5, chunk->num_samples);
+    Uncompressed_SealChunk(chunk);
+    mu_assert_int_eq(5 * SAMPLE_SIZE, chunk->size);
+    timestamp_t timestamps[8];
+    double values[8];
+    ChunkIterStorage storage = { 0 };
+    ChunkIter_t *iter = Uncompressed_InitChunkIterator(chunk, CHUNK_ITER_OP_NONE, NULL, &storage);
+    mu_assert_int_eq(5, Uncompressed_ChunkIteratorGetNextBatch(iter, timestamps, values, 8));
+    const timestamp_t expected[] = { 0, 1, 5, 6, 7 };
+    for (size_t i = 0; i < 5; i++) {
+        mu_assert_int_eq(expected[i], timestamps[i]);
+        mu_assert_double_eq(expected[i] * 10.0, values[i]);
+    }
+    Uncompressed_FreeChunk(chunk);
+    Uncompressed_FreeChunk(second);
+}
+
 MU_TEST_SUITE(uncompressed_chunk_test_suite) {
     MU_RUN_TEST(test_Uncompressed_NewChunk);
     MU_RUN_TEST(test_Uncompressed_Uncompressed_AddSample);
     MU_RUN_TEST(test_Uncompressed_Uncompressed_UpsertSample);
     MU_RUN_TEST(test_Uncompressed_Uncompressed_UpsertSample_DuplicatePolicy);
+    MU_RUN_TEST(test_Uncompressed_Columns);
 }
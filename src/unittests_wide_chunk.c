@@ -0,0 +1,122 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "compressed_chunk.h"
+#include "minunit.h"
+#include "wide_chunk.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include "rmutil/alloc.h"
+
+#define WIDE_TEST_FIELDS 10
+#define WIDE_TEST_ROWS 5000
+
+static timestamp_t wideTestTimestamp(size_t row) {
+    // mostly regular, with jitter and a few large gaps
+    return 1600000000000ULL + row * 10000 + (row % 17 == 0 ? 3 : 0) +
+           (row > WIDE_TEST_ROWS / 2 ? (1ULL << 40) : 0);
+}
+
+static double wideTestValue(size_t row, size_t field) {
+    switch (field % 4) {
+        case 0:
+            return 42; // constant
+        case 1:
+            return (double)(rand() % 100); // gauge
+        case 2:
+            return row * 0.25 - 100; // counter with decimals
+        default:
+            return row % 101 == 0 ? NAN : sin(row) * 1e6;
+    }
+}
+
+MU_TEST(test_wide_chunk_rows) {
+    static double values[WIDE_TEST_ROWS][WIDE_TEST_FIELDS];
+    srand(5);
+    for (size_t row = 0; row < WIDE_TEST_ROWS; ++row) {
+        for (size_t field = 0; field < WIDE_TEST_FIELDS; ++field) {
+            values[row][field] = wideTestValue(row, field);
+        }
+    }
+
+    // rows are split across chunks, trimmed once full
+    WideChunk *chunks[WIDE_TEST_ROWS];
+    size_t chunksCount = 1;
+    chunks[0] = WideChunk_New(WIDE_TEST_FIELDS, 4096);
+    size_t wideBytes = 0;
+    for (size_t row = 0; row < WIDE_TEST_ROWS; ++row) {
+        if (WideChunk_AppendRow(chunks[chunksCount - 1], wideTestTimestamp(row), values[row]) ==
+            CR_END) {
+            WideChunk_Trim(chunks[chunksCount - 1]);
+            chunks[chunksCount++] = WideChunk_New(WIDE_TEST_FIELDS, 4096);
+            mu_assert_int_eq(
+                CR_OK,
+                WideChunk_AppendRow(chunks[chunksCount - 1], wideTestTimestamp(row), values[row]));
+        }
+    }
+    mu_check(chunksCount > 1);
+
+    size_t row = 0;
+    for (size_t c = 0; c < chunksCount; ++c) {
+        wideBytes += WideChunk_Bytes(chunks[c]);
+        WideChunkIterator iter;
+        WideChunk_IteratorInit(&iter, chunks[c]);
+        timestamp_t timestamp;
+        double read[WIDE_TEST_FIELDS];
+        while (WideChunk_ReadRow(&iter, &timestamp, read) == CR_OK) {
+            mu_assert_int_eq(wideTestTimestamp(row), timestamp);
+            for (size_t field = 0; field < WIDE_TEST_FIELDS; ++field) {
+                mu_check(memcmp(&values[row][field], &read[field], sizeof(double)) == 0);
+            }
+            row++;
+        }
+        mu_assert_int_eq(wideTestTimestamp(row - 1), WideChunk_LastTimestamp(chunks[c]));
+        WideChunk_Free(chunks[c]);
+    }
+    mu_assert_int_eq(WIDE_TEST_ROWS, row);
+
+    // the same samples as a series per field encode each timestamp again
+    size_t seriesBytes = 0;
+    for (size_t field = 0; field < WIDE_TEST_FIELDS; ++field) {
+        CompressedChunk *chunk = Compressed_NewChunk(4096);
+        for (size_t r = 0; r < WIDE_TEST_ROWS; ++r) {
+            Sample sample = { .timestamp = wideTestTimestamp(r), .value = values[r][field] };
+            if (Compressed_AddSample(chunk, &sample) == CR_END) {
+                seriesBytes += Compressed_GetChunkSize(chunk, true);
+                Compressed_FreeChunk(chunk);
+                chunk = Compressed_NewChunk(4096);
+                Compressed_AddSample(chunk, &sample);
+            }
+        }
+        seriesBytes += Compressed_GetChunkSize(chunk, true);
+        Compressed_FreeChunk(chunk);
+    }
+    mu_check(wideBytes < seriesBytes);
+}
+
+MU_TEST(test_wide_chunk_small) {
+    // a chunk smaller than a row still takes one
+    WideChunk *chunk = WideChunk_New(WIDE_FIELDS_MAX, 8);
+    double values[WIDE_FIELDS_MAX] = { 0 };
+    mu_assert_int_eq(CR_OK, WideChunk_AppendRow(chunk, 10, values));
+    mu_assert_int_eq(CR_END, WideChunk_AppendRow(chunk, 20, values));
+    WideChunk_Trim(chunk);
+    mu_assert_int_eq(1, chunk->count);
+    mu_assert_int_eq(10, WideChunk_FirstTimestamp(chunk));
+
+    WideChunkIterator iter;
+    WideChunk_IteratorInit(&iter, chunk);
+    timestamp_t timestamp;
+    mu_assert_int_eq(CR_OK, WideChunk_ReadRow(&iter, &timestamp, values));
+    mu_assert_int_eq(10, timestamp);
+    mu_assert_int_eq(CR_END, WideChunk_ReadRow(&iter, &timestamp, values));
+    WideChunk_Free(chunk);
+}
+
+MU_TEST_SUITE(wide_chunk_test_suite) {
+    MU_RUN_TEST(test_wide_chunk_rows);
+    MU_RUN_TEST(test_wide_chunk_small);
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "wide_chunk.h"
+
+#include <string.h>
+#include "rmutil/alloc.h"
+
+// the leading zeros of a value are encoded in 5 bits
+#define WIDE_LEADING_MAX 31
+// no window was set yet, no XOR fits it
+#define WIDE_NO_WINDOW UINT8_MAX
+
+// the bits of the timestamp buckets: '0', then '10' and 7 bits, '110' and 9 bits, '1110' and 12
+// bits, '11110' and 32 bits, '11111' and 64 bits
+static const u_int8_t timestampBits[] = { 0, 7, 9, 12, 32, 64 };
+#define WIDE_TIMESTAMP_BUCKETS (sizeof(timestampBits) / sizeof(timestampBits[0]))
+#define WIDE_TIMESTAMP_MAX_BITS (WIDE_TIMESTAMP_BUCKETS - 1 + 64)
+// control bits, leading zeros, meaningful bits and the meaningful bits themselves
+#define WIDE_VALUE_MAX_BITS (2 + 5 + 6 + 64)
+
+static inline size_t rowMaxBits(size_t fieldsCount) {
+    return WIDE_TIMESTAMP_MAX_BITS + fieldsCount * WIDE_VALUE_MAX_BITS;
+}
+
+static inline void appendBits(u_int64_t *data, u_int64_t *idx, u_int64_t value, u_int8_t bits) {
+    if (bits == 0) {
+        return;
+    }
+    if (bits < 64) {
+        value &= (1ULL << bits) - 1;
+    }
+    u_int64_t word = *idx / 64;
+    u_int8_t offset = *idx % 64;
+    data[word] |= value << offset;
+    if (offset + bits > 64) {
+        data[word + 1] |= value >> (64 - offset);
+    }
+    *idx += bits;
+}
+
+static inline u_int64_t readBits(const u_int64_t *data, u_int64_t *idx, u_int8_t bits) {
+    if (bits == 0) {
+        return 0;
+    }
+    u_int64_t word = *idx / 64;
+    u_int8_t offset = *idx % 64;
+    u_int64_t value = data[word] >> offset;
+    if (offset + bits > 64) {
+        value |= data[word + 1] << (64 - offset);
+    }
+    *idx += bits;
+    return bits < 64 ? value & ((1ULL << bits) - 1) : value;
+}
+
+static void fieldsInit(WideFieldState *fields, size_t fieldsCount) {
+    for (size_t i = 0; i < fieldsCount; ++i) {
+        fields[i].prevValue.u = 0;
+        fields[i].prevLeading = WIDE_NO_WINDOW;
+        fields[i].prevTrailing = 0;
+    }
+}
+
+WideChunk *WideChunk_New(size_t fieldsCount, size_t size) {
+    size_t minSize = (rowMaxBits(fieldsCount) + 63) / 64 * sizeof(u_int64_t);
+    size = size < minSize ? minSize : (size + 7) / 8 * 8;
+    WideChunk *chunk = malloc(sizeof(WideChunk) + fieldsCount * sizeof(WideFieldState));
+    chunk->size = size;
+    chunk->count = 0;
+    chunk->idx = 0;
+    chunk->data = calloc(1, size);
+    chunk->baseTimestamp = 0;
+    chunk->prevTimestamp = 0;
+    chunk->prevTimestampDelta = 0;
+    chunk->fieldsCount = fieldsCount;
+    fieldsInit(chunk->fields, fieldsCount);
+    return chunk;
+}
+
+void WideChunk_Free(WideChunk *chunk) {
+    free(chunk->data);
+    free(chunk);
+}
+
+size_t WideChunk_Bytes(const WideChunk *chunk) {
+    return sizeof(WideChunk) + chunk->fieldsCount * sizeof(WideFieldState) + chunk->size;
+}
+
+void WideChunk_Trim(WideChunk *chunk) {
+    size_t size = (chunk->idx + 63) / 64 * sizeof(u_int64_t);
+    if (size == 0 || size == chunk->size) {
+        return;
+    }
+    chunk->data = realloc(chunk->data, size);
+    chunk->size = size;
+}
+
+static void appendTimestamp(WideChunk *chunk, timestamp_t timestamp) {
+    int64_t delta = timestamp - chunk->prevTimestamp;
+    int64_t dod = delta - chunk->prevTimestampDelta;
+    u_int64_t zigzag = ((u_int64_t)dod << 1) ^ (u_int64_t)(dod >> 63);
+    size_t bucket = 0;
+    while (bucket + 1 < WIDE_TIMESTAMP_BUCKETS &&
+           (bucket == 0 ? zigzag != 0 : zigzag >= (1ULL << timestampBits[bucket]))) {
+        bucket++;
+    }
+    appendBits(chunk->data, &chunk->idx, (1ULL << bucket) - 1, bucket);
+    if (bucket + 1 < WIDE_TIMESTAMP_BUCKETS) {
+        appendBits(chunk->data, &chunk->idx, 0, 1);
+    }
+    appendBits(chunk->data, &chunk->idx, zigzag, timestampBits[bucket]);
+    chunk->prevTimestampDelta = delta;
+}
+
+static void appendValue(WideChunk *chunk, WideFieldState *field, double value) {
+    union64bits current = { .d = value };
+    u_int64_t xor = current.u ^ field->prevValue.u;
+    field->prevValue = current;
+    if (xor == 0) {
+        appendBits(chunk->data, &chunk->idx, 0, 1);
+        return;
+    }
+    appendBits(chunk->data, &chunk->idx, 1, 1);
+    u_int8_t leading = __builtin_clzll(xor);
+    u_int8_t trailing = __builtin_ctzll(xor);
+    leading = leading > WIDE_LEADING_MAX ? WIDE_LEADING_MAX : leading;
+    if (field->prevLeading != WIDE_NO_WINDOW && leading >= field->prevLeading &&
+        trailing >= field->prevTrailing) {
+        // the meaningful bits fit the window of the previous value
+        appendBits(chunk->data, &chunk->idx, 0, 1);
+        appendBits(chunk->data,
+                   &chunk->idx,
+                   xor >> field->prevTrailing,
+                   64 - field->prevLeading - field->prevTrailing);
+        return;
+    }
+    u_int8_t meaningful = 64 - leading - trailing;
+    appendBits(chunk->data, &chunk->idx, 1, 1);
+    appendBits(chunk->data, &chunk->idx, leading, 5);
+    appendBits(chunk->data, &chunk->idx, meaningful - 1, 6);
+    appendBits(chunk->data, &chunk->idx, xor >> trailing, meaningful);
+    field->prevLeading = leading;
+    field->prevTrailing = trailing;
+}
+
+ChunkResult WideChunk_AppendRow(WideChunk *chunk, timestamp_t timestamp, const double *values) {
+    if (chunk->idx + rowMaxBits(chunk->fieldsCount) > (u_int64_t)chunk->size * 8) {
+        return CR_END;
+    }
+    if (chunk->count == 0) {
+        chunk->baseTimestamp = timestamp;
+    } else {
+        appendTimestamp(chunk, timestamp);
+    }
+    chunk->prevTimestamp = timestamp;
+    for (size_t i = 0; i < chunk->fieldsCount; ++i) {
+        appendValue(chunk, &chunk->fields[i], values[i]);
+    }
+    chunk->count++;
+    return CR_OK;
+}
+
+void WideChunk_IteratorInit(WideChunkIterator *iter, const WideChunk *chunk) {
+    iter->chunk = chunk;
+    iter->idx = 0;
+    iter->count = 0;
+    iter->prevTimestamp = chunk->baseTimestamp;
+    iter->prevTimestampDelta = 0;
+    fieldsInit(iter->fields, chunk->fieldsCount);
+}
+
+static timestamp_t readTimestamp(WideChunkIterator *iter) {
+    const u_int64_t *data = iter->chunk->data;
+    size_t bucket = 0;
+    while (bucket + 1 < WIDE_TIMESTAMP_BUCKETS && readBits(data, &iter->idx, 1)) {
+        bucket++;
+    }
+    u_int64_t zigzag = readBits(data, &iter->idx, timestampBits[bucket]);
+    int64_t dod = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+    iter->prevTimestampDelta += dod;
+    iter->prevTimestamp += iter->prevTimestampDelta;
+    return iter->prevTimestamp;
+}
+
+static double readValue(WideChunkIterator *iter, WideFieldState *field) {
+    const u_int64_t *data = iter->chunk->data;
+    if (readBits(data, &iter->idx, 1)) {
+        if (readBits(data, &iter->idx, 1)) {
+            field->prevLeading = readBits(data, &iter->idx, 5);
+            u_int8_t meaningful = readBits(data, &iter->idx, 6) + 1;
+            field->prevTrailing = 64 - field->prevLeading - meaningful;
+        }
+        u_int8_t meaningful = 64 - field->prevLeading - field->prevTrailing;
+        field->prevValue.u ^= readBits(data, &iter->idx, meaningful) << field->prevTrailing;
+    }
+    return field->prevValue.d;
+}
+
+ChunkResult WideChunk_ReadRow(WideChunkIterator *iter, timestamp_t *timestamp, double *values) {
+    if (iter->count >= iter->chunk->count) {
+        return CR_END;
+    }
+    *timestamp = iter->count == 0 ? iter->chunk->baseTimestamp : readTimestamp(iter);
+    for (size_t i = 0; i < iter->chunk->fieldsCount; ++i) {
+        values[i] = readValue(iter, &iter->fields[i]);
+    }
+    iter->count++;
+    return CR_OK;
+}
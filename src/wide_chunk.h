@@ -0,0 +1,78 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef WIDE_CHUNK_H
+#define WIDE_CHUNK_H
+
+#include "consts.h"
+#include "generic_chunk.h"
+#include "gorilla.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// The fields of a wide series
+#define WIDE_FIELDS_MAX 64
+
+typedef struct WideFieldState
+{
+    union64bits prevValue;
+    u_int8_t prevLeading;
+    u_int8_t prevTrailing;
+} WideFieldState;
+
+/*
+ * Rows of a wide series: one timestamp and a value per field. Each row is encoded as the
+ * delta-of-delta of its timestamp followed by the XOR of each value with the previous value of its
+ * field, so the timestamps are encoded once for all the fields. A row is only appended when its
+ * worst case encoding fits, and the chunk is trimmed to its data once the next chunk starts.
+ */
+typedef struct WideChunk
+{
+    u_int32_t size; // bytes of data
+    u_int32_t count;
+    u_int64_t idx; // bits written
+    u_int64_t *data;
+
+    timestamp_t baseTimestamp;
+    timestamp_t prevTimestamp;
+    int64_t prevTimestampDelta;
+
+    u_int16_t fieldsCount;
+    WideFieldState fields[];
+} WideChunk;
+
+typedef struct WideChunkIterator
+{
+    const WideChunk *chunk;
+    u_int64_t idx;
+    u_int32_t count;
+    timestamp_t prevTimestamp;
+    int64_t prevTimestampDelta;
+    WideFieldState fields[WIDE_FIELDS_MAX];
+} WideChunkIterator;
+
+// `size` is the data size in bytes, raised to fit at least one row
+WideChunk *WideChunk_New(size_t fieldsCount, size_t size);
+void WideChunk_Free(WideChunk *chunk);
+// Returns CR_END when the chunk is full, `timestamp` is past the last row of the chunk
+ChunkResult WideChunk_AppendRow(WideChunk *chunk, timestamp_t timestamp, const double *values);
+// Gives back the room past the last row, rows can still be appended
+void WideChunk_Trim(WideChunk *chunk);
+size_t WideChunk_Bytes(const WideChunk *chunk);
+
+static inline timestamp_t WideChunk_FirstTimestamp(const WideChunk *chunk) {
+    return chunk->baseTimestamp;
+}
+
+static inline timestamp_t WideChunk_LastTimestamp(const WideChunk *chunk) {
+    return chunk->prevTimestamp;
+}
+
+void WideChunk_IteratorInit(WideChunkIterator *iter, const WideChunk *chunk);
+// Returns CR_END past the last row
+ChunkResult WideChunk_ReadRow(WideChunkIterator *iter, timestamp_t *timestamp, double *values);
+
+#endif
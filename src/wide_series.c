@@ -0,0 +1,160 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#include "wide_series.h"
+
+#include <string.h>
+#include "rmutil/alloc.h"
+
+WideSeries *NewWideSeries(RedisModuleString **fields,
+                          size_t fieldsCount,
+                          u_int64_t retentionTime,
+                          size_t chunkSizeBytes) {
+    WideSeries *series = malloc(sizeof(WideSeries));
+    ChunkDir_Init(&series->chunks);
+    series->lastChunk = NULL;
+    series->fields = fields;
+    series->fieldsCount = fieldsCount;
+    series->retentionTime = retentionTime;
+    series->chunkSizeBytes = chunkSizeBytes;
+    series->totalSamples = 0;
+    series->lastTimestamp = 0;
+    series->chunksBytes = 0;
+    return series;
+}
+
+void FreeWideSeries(void *value) {
+    WideSeries *series = value;
+    for (size_t i = 0; i < ChunkDir_Count(&series->chunks); ++i) {
+        WideChunk_Free(ChunkDir_Get(&series->chunks, i));
+    }
+    ChunkDir_Free(&series->chunks);
+    for (size_t i = 0; i < series->fieldsCount; ++i) {
+        RedisModule_FreeString(NULL, series->fields[i]);
+    }
+    free(series->fields);
+    free(series);
+}
+
+size_t WideSeriesMemUsage(const void *value) {
+    const WideSeries *series = value;
+    size_t fieldsLen = 0;
+    for (size_t i = 0; i < series->fieldsCount; ++i) {
+        size_t len;
+        RedisModule_StringPtrLen(series->fields[i], &len);
+        fieldsLen += len;
+    }
+    return sizeof(WideSeries) + series->fieldsCount * sizeof(RedisModuleString *) + fieldsLen +
+           series->chunks.capacity * sizeof(ChunkDirEntry) + series->chunksBytes;
+}
+
+void WideSeriesAddChunk(WideSeries *series, WideChunk *chunk) {
+    ChunkDir_Insert(&series->chunks, WideChunk_FirstTimestamp(chunk), chunk);
+    series->lastChunk = chunk;
+    series->totalSamples += chunk->count;
+    series->chunksBytes += WideChunk_Bytes(chunk);
+    if (chunk->count > 0) {
+        series->lastTimestamp = WideChunk_LastTimestamp(chunk);
+    }
+}
+
+// Frees the chunks past the retention, the last chunk is kept
+static void WideSeriesTrim(WideSeries *series) {
+    if (series->retentionTime == 0 || series->lastTimestamp <= series->retentionTime) {
+        return;
+    }
+    timestamp_t minTimestamp = series->lastTimestamp - series->retentionTime;
+    size_t trimmed = 0;
+    for (; trimmed < ChunkDir_Count(&series->chunks); ++trimmed) {
+        WideChunk *chunk = ChunkDir_Get(&series->chunks, trimmed);
+        if (chunk == series->lastChunk || WideChunk_LastTimestamp(chunk) >= minTimestamp) {
+            break;
+        }
+        series->totalSamples -= chunk->count;
+        series->chunksBytes -= WideChunk_Bytes(chunk);
+        WideChunk_Free(chunk);
+    }
+    ChunkDir_DeleteFirst(&series->chunks, trimmed);
+}
+
+int WideSeriesAddRow(WideSeries *series, timestamp_t timestamp, const double *values) {
+    if (series->totalSamples > 0 && timestamp <= series->lastTimestamp) {
+        return TSDB_ERROR;
+    }
+    if (series->lastChunk == NULL ||
+        WideChunk_AppendRow(series->lastChunk, timestamp, values) == CR_END) {
+        if (series->lastChunk != NULL) {
+            size_t before = WideChunk_Bytes(series->lastChunk);
+            WideChunk_Trim(series->lastChunk);
+            series->chunksBytes -= before - WideChunk_Bytes(series->lastChunk);
+        }
+        WideChunk *chunk = WideChunk_New(series->fieldsCount, series->chunkSizeBytes);
+        WideChunk_AppendRow(chunk, timestamp, values);
+        ChunkDir_Insert(&series->chunks, timestamp, chunk);
+        series->lastChunk = chunk;
+        series->chunksBytes += WideChunk_Bytes(chunk);
+    }
+    series->lastTimestamp = timestamp;
+    series->totalSamples++;
+    WideSeriesTrim(series);
+    return TSDB_OK;
+}
+
+int WideSeriesFieldIndex(const WideSeries *series, const char *name, size_t len) {
+    for (size_t i = 0; i < series->fieldsCount; ++i) {
+        size_t fieldLen;
+        const char *field = RedisModule_StringPtrLen(series->fields[i], &fieldLen);
+        if (fieldLen == len && memcmp(field, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+Series *WideSeriesCopyField(const WideSeries *series,
+                            size_t field,
+                            timestamp_t start,
+                            timestamp_t end) {
+    Series *copy = calloc(1, sizeof(Series));
+    ChunkDir_Init(&copy->chunks);
+    copy->retentionTime = series->retentionTime;
+    copy->options = SERIES_OPT_UNCOMPRESSED;
+    copy->funcs = GetChunkClass(CHUNK_REGULAR);
+    copy->lastTimestamp = series->lastTimestamp;
+
+    double values[WIDE_FIELDS_MAX];
+    for (size_t i = 0; i < ChunkDir_Count(&series->chunks); ++i) {
+        WideChunk *chunk = ChunkDir_Get(&series->chunks, i);
+        if (WideChunk_FirstTimestamp(chunk) > end) {
+            break;
+        }
+        if (chunk->count == 0 || WideChunk_LastTimestamp(chunk) < start) {
+            continue;
+        }
+        Chunk_t *chunkCopy = copy->funcs->NewChunk(chunk->count * SAMPLE_SIZE);
+        WideChunkIterator iter;
+        WideChunk_IteratorInit(&iter, chunk);
+        Sample sample;
+        while (WideChunk_ReadRow(&iter, &sample.timestamp, values) == CR_OK) {
+            if (sample.timestamp >= start && sample.timestamp <= end) {
+                sample.value = values[field];
+                copy->funcs->AddSample(chunkCopy, &sample);
+                copy->totalSamples++;
+                copy->lastValue = sample.value;
+            }
+        }
+        ChunkDir_Insert(&copy->chunks, WideChunk_FirstTimestamp(chunk), chunkCopy);
+        copy->chunksBytes += copy->funcs->GetChunkSize(chunkCopy, true);
+        copy->lastChunk = chunkCopy;
+    }
+
+    if (copy->lastChunk == NULL) {
+        // queries expect at least one chunk
+        copy->lastChunk = copy->funcs->NewChunk(SAMPLE_SIZE);
+        ChunkDir_Insert(&copy->chunks, 0, copy->lastChunk);
+        copy->chunksBytes += copy->funcs->GetChunkSize(copy->lastChunk, true);
+    }
+    return copy;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2018-2020 Redis Labs Ltd. and Contributors
+ *
+ * This file is available under the Redis Labs Source Available License Agreement
+ */
+#ifndef WIDE_SERIES_H
+#define WIDE_SERIES_H
+
+#include "chunk_dir.h"
+#include "consts.h"
+#include "redismodule.h"
+#include "tsdb.h"
+#include "wide_chunk.h"
+
+#include <sys/types.h>
+
+/*
+ * Fields sampled at the same timestamps, e.g. the metrics of a host, stored as rows in one key:
+ * the timestamps are encoded and the retention applied once for all the fields. Rows are appended
+ * in timestamp order. Wide series have no labels and aren't indexed.
+ */
+typedef struct WideSeries
+{
+    ChunkDir chunks; // of WideChunk, keyed by their first timestamp
+    WideChunk *lastChunk;
+    RedisModuleString **fields;
+    size_t fieldsCount;
+    u_int64_t retentionTime;
+    size_t chunkSizeBytes;
+    u_int64_t totalSamples; // rows
+    timestamp_t lastTimestamp;
+    size_t chunksBytes;
+} WideSeries;
+
+// Takes ownership of `fields`
+WideSeries *NewWideSeries(RedisModuleString **fields,
+                          size_t fieldsCount,
+                          u_int64_t retentionTime,
+                          size_t chunkSizeBytes);
+void FreeWideSeries(void *value);
+size_t WideSeriesMemUsage(const void *value);
+// Returns TSDB_ERROR unless `timestamp` is past the last row
+int WideSeriesAddRow(WideSeries *series, timestamp_t timestamp, const double *values);
+// Appends a chunk loaded back, the chunks are added in order
+void WideSeriesAddChunk(WideSeries *series, WideChunk *chunk);
+// The position of the field named `name`, -1 when there is none
+int WideSeriesFieldIndex(const WideSeries *series, const char *name, size_t len);
+/*
+ * An uncompressed series copy of the samples of `field` between `start` and `end`, to be queried
+ * like any series. Free with FreeSeriesCopy.
+ */
+Series *WideSeriesCopyField(const WideSeries *series,
+                            size_t field,
+                            timestamp_t start,
+                            timestamp_t end);
+
+#endif
@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+"""
+Ingest benchmarks of RedisTimeSeries, the client of the ingest-*.yml specs.
+
+Each scenario writes synthetic series into an empty database through pipelines of commands, and
+writes a JSON result shaped like the TSBS ones, so that the same exporter reads it:
+  StartTime - epoch milliseconds
+  Totals.overallQuantiles.all_ingest - latency of a pipeline in milliseconds (q0 ... q100)
+  Totals.overallRates - samples, commands and series created per second
+
+Scenarios:
+  create        TS.CREATE of many series with labels of several cardinalities
+  madd          TS.MADD of --batch samples across the series, --pipeline commands at a time
+  out-of-order  like madd, with --out-of-order percent of the samples arriving late, which goes
+                through the upsert path of the series
+  rules         like madd, into series with --rules compaction rules each
+"""
+import argparse
+import json
+import random
+import time
+
+import redis
+
+AGGREGATIONS = ['avg', 'sum', 'min', 'max', 'count', 'last', 'first', 'range', 'std.p', 'var.p']
+BUCKETS = [60000, 300000, 3600000]
+START_TS = 1600000000000
+INTERVAL = 10000
+
+
+def quantiles(latencies):
+    latencies = sorted(latencies)
+    if not latencies:
+        return {}
+    result = {}
+    for name, q in [('q0', 0), ('q50', 0.5), ('q95', 0.95), ('q99', 0.99), ('q100', 1)]:
+        result[name] = latencies[min(int(q * len(latencies)), len(latencies) - 1)]
+    return result
+
+
+class Run:
+    def __init__(self, conn, pipeline):
+        self.conn = conn
+        self.pipeline = pipeline
+        self.latencies = []
+        self.samples = 0
+        self.commands = 0
+        self.series = 0
+        self.elapsed = 0
+
+    def send(self, commands):
+        """Sends the commands, `pipeline` at a time, with the samples each one adds"""
+        for i in range(0, len(commands), self.pipeline):
+            pipe = self.conn.pipeline(transaction=False)
+            for args, _ in commands[i:i + self.pipeline]:
+                pipe.execute_command(*args)
+            start = time.perf_counter()
+            pipe.execute(raise_on_error=False)
+            latency = time.perf_counter() - start
+            self.elapsed += latency
+            self.latencies.append(latency * 1000)
+            for _, samples in commands[i:i + self.pipeline]:
+                self.samples += samples
+            self.commands += len(commands[i:i + self.pipeline])
+
+
+def series_name(i):
+    return 'ingest:{}'.format(i)
+
+
+def series_labels(i):
+    # from a host per series to a few regions
+    return ['LABELS', 'hostname', 'host_{}'.format(i), 'service', 'service_{}'.format(i % 100),
+            'rack', 'rack_{}'.format(i % 1000), 'region', 'region_{}'.format(i % 10)]
+
+
+def create_series(run, args, rules=0):
+    commands = []
+    for i in range(args.series):
+        commands.append((['TS.CREATE', series_name(i)] + series_labels(i), 0))
+    run.send(commands)
+    run.series += args.series
+    if rules == 0:
+        return
+    commands = []
+    for i in range(args.series):
+        # the destinations are written by the rules, not indexed by the labels of the sources
+        for r in range(rules):
+            dest = '{}:rule{}'.format(series_name(i), r)
+            commands.append((['TS.CREATE', dest], 0))
+            commands.append((['TS.CREATERULE', series_name(i), dest, 'AGGREGATION',
+                              AGGREGATIONS[r % len(AGGREGATIONS)], BUCKETS[r % len(BUCKETS)]], 0))
+    run.send(commands)
+
+
+def samples_order(args):
+    """The timestamp index of each round, with the late ones moved after later rounds"""
+    rounds = list(range(args.samples))
+    if args.out_of_order == 0:
+        return rounds
+    rng = random.Random(args.seed)
+    late = set(rng.sample(rounds, int(len(rounds) * args.out_of_order / 100)))
+    order, delayed = [], []
+    for r in rounds:
+        if r in late:
+            delayed.append((r + rng.randint(1, args.lateness), r))
+        else:
+            order.append(r)
+    # a late sample arrives after the samples of up to `lateness` rounds later
+    delayed.sort()
+    merged, j = [], 0
+    for r in order:
+        while j < len(delayed) and delayed[j][0] <= r:
+            merged.append(delayed[j][1])
+            j += 1
+        merged.append(r)
+    merged += [r for _, r in delayed[j:]]
+    return merged
+
+
+def madd_series(run, args):
+    rng = random.Random(args.seed)
+    commands, current = [], []
+    for r in samples_order(args):
+        ts = START_TS + r * INTERVAL
+        for i in range(args.series):
+            current += [series_name(i), ts, round(rng.uniform(0, 100), 2)]
+            if len(current) == args.batch * 3:
+                commands.append((['TS.MADD'] + current, args.batch))
+                current = []
+        if len(commands) >= args.pipeline * 16:
+            run.send(commands)
+            commands = []
+    if current:
+        commands.append((['TS.MADD'] + current, len(current) // 3))
+    run.send(commands)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--host', default='localhost')
+    parser.add_argument('--port', type=int, default=6379)
+    parser.add_argument('--scenario', required=True,
+                        choices=['create', 'madd', 'out-of-order', 'rules'])
+    parser.add_argument('--series', type=int, default=10000)
+    parser.add_argument('--samples', type=int, default=100, help='samples per series')
+    parser.add_argument('--batch', type=int, default=100, help='samples per TS.MADD')
+    parser.add_argument('--pipeline', type=int, default=50, help='commands per round trip')
+    parser.add_argument('--out-of-order', type=float, default=0,
+                        help='percent of the samples arriving late')
+    parser.add_argument('--lateness', type=int, default=10,
+                        help='rounds of samples a late sample arrives after, at most')
+    parser.add_argument('--rules', type=int, default=0, help='compaction rules per series')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--json-out-file', default='ingest-results.json')
+    args = parser.parse_args()
+
+    conn = redis.Redis(host=args.host, port=args.port)
+    run = Run(conn, args.pipeline)
+    start_time = int(time.time() * 1000)
+    if args.scenario == 'create':
+        create_series(run, args)
+    else:
+        create_series(Run(conn, args.pipeline), args,
+                      rules=args.rules if args.scenario == 'rules' else 0)
+        madd_series(run, args)
+
+    elapsed = max(run.elapsed, 1e-9)
+    result = {
+        'StartTime': start_time,
+        'EndTime': int(time.time() * 1000),
+        'Scenario': vars(args),
+        'Totals': {
+            'overallQuantiles': {'all_ingest': quantiles(run.latencies)},
+            'overallRates': {
+                'samples': run.samples / elapsed,
+                'commands': run.commands / elapsed,
+                'series': run.series / elapsed,
+            },
+            'samples': run.samples,
+            'commands': run.commands,
+            'series': run.series,
+        },
+    }
+    with open(args.json_out_file, 'w') as out:
+        json.dump(result, out, indent=2)
+    print(json.dumps(result['Totals'], indent=2))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,75 @@
+import time
+
+from RLTest import Env
+from test_helper_classes import _get_ts_info
+
+
+def _wait_for_aof_rewrite(r):
+    while r.info('persistence')['aof_rewrite_in_progress']:
+        time.sleep(0.1)
+
+
+def _series_state(r, key):
+    response = r.execute_command('TS.INFO', key)
+    info = _get_ts_info(r, key)
+    return [r.execute_command('TS.RANGE', key, '-', '+'), info.labels, info.rules, info.sourceKey,
+            info.retention_msecs, info.chunk_size_bytes, info.chunk_type, info.total_samples,
+            dict(zip(response[::2], response[1::2]))[b'duplicatePolicy']]
+
+
+def test_aof_rewrite():
+    env = Env(useAof=True)
+    with env.getConnection() as r:
+        r.execute_command('TS.CREATE', 'compressed', 'RETENTION', 100000, 'DUPLICATE_POLICY', 'MAX',
+                          'LABELS', 'name', 'brown', 'encoding', 'UNCOMPRESSED')
+        r.execute_command('TS.CREATE', 'uncompressed', 'UNCOMPRESSED', 'CHUNK_SIZE', 128)
+        r.execute_command('TS.CREATE', 'decimal', 'ENCODING', 'DECIMAL')
+        r.execute_command('TS.CREATE', 'empty', 'LABELS', 'name', 'empty')
+        r.execute_command('TS.CREATE', 'source')
+        r.execute_command('TS.CREATE', 'dest')
+        r.execute_command('TS.CREATERULE', 'source', 'dest', 'AGGREGATION', 'AVG', 100)
+        for i in range(10000):
+            timestamp = 1000 + i * (1 + i % 5)
+            for key in ['compressed', 'uncompressed', 'decimal', 'source']:
+                r.execute_command('TS.ADD', key, timestamp, i % 17 / 4 - 2)
+        # out of order samples
+        r.execute_command('TS.ADD', 'compressed', 1001, 42)
+        r.execute_command('TS.ADD', 'decimal', 1003, 1.0 / 3)
+
+        keys = ['compressed', 'uncompressed', 'decimal', 'empty', 'source', 'dest']
+        before = {key: _series_state(r, key) for key in keys}
+
+        r.execute_command('BGREWRITEAOF')
+        _wait_for_aof_rewrite(r)
+        r.execute_command('DEBUG', 'LOADAOF')
+
+        for key in keys:
+            assert before[key] == _series_state(r, key)
+        # the rule kept its open bucket, which the next sample closes
+        r.execute_command('TS.ADD', 'source', 10 ** 6, 1)
+        assert _get_ts_info(r, 'dest').total_samples == before['dest'][7] + 1
+
+
+def test_aof_replays_added_samples():
+    env = Env(useAof=True)
+    with env.getConnection() as r:
+        r.execute_command('TS.CREATE', 'bulk', 'DUPLICATE_POLICY', 'BLOCK')
+        r.execute_command('TS.CREATE', 'single')
+        r.execute_command('TS.CREATE', 'dest')
+        r.execute_command('TS.CREATERULE', 'bulk', 'dest', 'AGGREGATION', 'SUM', 10)
+        r.execute_command('TS.ADD', 'auto', '*', 1, 'LABELS', 'name', 'auto')
+        r.execute_command('TS.MADD', 'bulk', 1, 1, 'single', '*', 2, 'bulk', 2, 2.5, 'bulk', 2, 3,
+                          'bulk', 25, 4, 'missing', 1, 1, 'bulk', 12, 0.1, 'bulk', 38, 5)
+        r.execute_command('TS.ADDBULK', 'bulk', 40, 6, '*', 7, 41, 8)
+        r.execute_command('TS.INCRBY', 'counter', 3)
+        r.execute_command('TS.INCRBY', 'counter', 4, 'TIMESTAMP', '*')
+
+        keys = ['bulk', 'single', 'dest', 'auto', 'counter']
+        before = {key: _series_state(r, key) for key in keys}
+        # the timestamps resolved from the clock are replayed, and the samples that failed are not
+        time.sleep(0.01)
+        r.execute_command('DEBUG', 'LOADAOF')
+        for key in keys:
+            assert before[key] == _series_state(r, key)
+        assert r.execute_command('TS.RANGE', 'bulk', 0, 38) == \
+               [[1, b'1'], [2, b'2.5'], [12, b'0.1'], [25, b'4'], [38, b'5']]
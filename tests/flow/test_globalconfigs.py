@@ -1,3 +1,5 @@
+import time
+
 import pytest
 from RLTest import Env
 from test_helper_classes import TSInfo
@@ -8,7 +10,16 @@ class testModuleLoadTimeArguments(object):
         self.test_variations = [(True, 'CHUNK_SIZE_BYTES 2000'),
                                 (True, 'COMPACTION_POLICY', 'max:1m:1d\\;min:10s:1h\\;avg:2h:10d\\;avg:3d:100d'),
                                 (True, 'DUPLICATE_POLICY MAX'),
-                                (True, 'RETENTION_POLICY 30')
+                                (True, 'RETENTION_POLICY 30'),
+                                (True, 'WORKER_THREADS 4'),
+                                (True, 'ASYNC_COMPACTION'),
+                                (True, 'COLD_CHUNK_AGE 86400000'),
+                                (False, 'COLD_CHUNK_AGE -1'),
+                                (True, 'OFFLOAD_DIR /tmp OFFLOAD_AGE 86400000'),
+                                (False, 'OFFLOAD_DIR /tmp'),
+                                (False, 'OFFLOAD_DIR /nonexistent OFFLOAD_AGE 1000'),
+                                (True, 'QUERY_MAX_SERIES 100 QUERY_MAX_SAMPLES 1000000 QUERY_TIMEOUT 500'),
+                                (False, 'QUERY_MAX_SAMPLES -1')
                                 ]
 
     def test(self):
@@ -100,3 +111,112 @@ class testGlobalConfigTests():
 
             r.execute_command('DEL', 'tester')
             r.execute_command('DEL', 'tester_agg')
+
+
+def test_async_compaction():
+    env = Env(moduleArgs='ASYNC_COMPACTION')
+    with env.getConnection() as r:
+        r.execute_command('FLUSHALL')
+        r.execute_command('TS.CREATE', 'source')
+        for agg in ['sum', 'max']:
+            r.execute_command('TS.CREATE', 'source_' + agg)
+            r.execute_command('TS.CREATERULE', 'source', 'source_' + agg, 'AGGREGATION', agg, 10)
+        for ts in range(1, 100):
+            r.execute_command('TS.ADD', 'source', ts, ts)
+
+        # the closed buckets reach the destinations once flushed
+        expected = {agg: r.execute_command('TS.RANGE', 'source', 0, 89, 'AGGREGATION', agg, 10)
+                    for agg in ['sum', 'max']}
+        for _ in range(50):
+            if r.execute_command('TS.RANGE', 'source_sum', '-', '+') == expected['sum']:
+                break
+            time.sleep(0.1)
+        for agg in ['sum', 'max']:
+            assert r.execute_command('TS.RANGE', 'source_' + agg, '-', '+') == expected[agg]
+
+        # upserts see the queued buckets
+        r.execute_command('TS.ADD', 'source', 100, 100)
+        r.execute_command('TS.ADD', 'source', 95, 1000, 'ON_DUPLICATE', 'LAST')
+        assert r.execute_command('TS.RANGE', 'source_max', 90, 90) == [[90, b'1000']]
+
+
+def test_async_compaction_use_compactions():
+    env = Env(moduleArgs='ASYNC_COMPACTION')
+    with env.getConnection() as r:
+        r.execute_command('FLUSHALL')
+        r.execute_command('TS.CREATE', 'source')
+        for agg in ['sum', 'count', 'max']:
+            r.execute_command('TS.CREATE', 'source_' + agg)
+            r.execute_command('TS.CREATERULE', 'source', 'source_' + agg, 'AGGREGATION', agg, 10)
+        for ts in range(1, 1000):
+            r.execute_command('TS.ADD', 'source', ts, ts % 17)
+
+        # the buckets still queued are aggregated from the samples
+        for start in range(1000, 1300, 100):
+            for agg in ['avg', 'sum', 'count', 'max']:
+                query = ['TS.RANGE', 'source', '-', '+', 'AGGREGATION', agg, 20]
+                assert r.execute_command(*query, 'USE_COMPACTIONS') == r.execute_command(*query)
+            for ts in range(start, start + 100):
+                r.execute_command('TS.ADD', 'source', ts, ts % 17)
+
+
+def test_cold_chunk_age():
+    env = Env(moduleArgs='COLD_CHUNK_AGE 100000')
+    with env.getConnection() as r:
+        r.execute_command('FLUSHALL')
+        r.execute_command('TS.CREATE', 'tester', 'DUPLICATE_POLICY', 'LAST')
+        for ts in range(1, 20000):
+            r.execute_command('TS.ADD', 'tester', ts * 10, ts % 97)
+        # out of order samples leave the old chunks with room to append
+        for ts in range(1, 10000, 50):
+            r.execute_command('TS.ADD', 'tester', ts * 10 + 5, 0)
+        expected = r.execute_command('TS.RANGE', 'tester', '-', '+')
+        expected_rev = r.execute_command('TS.REVRANGE', 'tester', '-', '+')
+
+        # a new chunk queues the series for sealing
+        for ts in range(20000, 22000):
+            r.execute_command('TS.ADD', 'tester', ts * 10, ts % 89)
+            expected.append([ts * 10, str(ts % 89).encode()])
+            expected_rev.insert(0, [ts * 10, str(ts % 89).encode()])
+        time.sleep(0.5)
+        # the cold chunks are shrunk to their samples
+        info = r.execute_command('TS.INFO', 'tester', 'DEBUG')
+        chunks = [dict(zip(chunk[::2], chunk[1::2]))
+                  for chunk in dict(zip(info[::2], info[1::2]))[b'Chunks']]
+        cold = [chunk for chunk in chunks if chunk[b'endTimestamp'] < 21999 * 10 - 100000]
+        assert len(cold) > 0
+        for chunk in cold:
+            assert chunk[b'usedSize'] == chunk[b'size']
+        assert r.execute_command('TS.RANGE', 'tester', '-', '+') == expected
+        assert r.execute_command('TS.REVRANGE', 'tester', '-', '+') == expected_rev
+        assert r.execute_command('TS.REVRANGE', 'tester', 1000, 2000) == \
+               [s for s in expected_rev if 1000 <= s[0] <= 2000]
+
+        # sealed chunks are still writable
+        r.execute_command('TS.ADD', 'tester', 1003, 42)
+        assert r.execute_command('TS.RANGE', 'tester', 1000, 1009) == [[1000, b'3'], [1003, b'42']]
+
+
+def test_offload():
+    env = Env(moduleArgs='OFFLOAD_DIR /tmp OFFLOAD_AGE 100000')
+    with env.getConnection() as r:
+        r.execute_command('FLUSHALL')
+        r.execute_command('TS.CREATE', 'tester', 'DUPLICATE_POLICY', 'LAST')
+        for ts in range(1, 20000):
+            r.execute_command('TS.ADD', 'tester', ts * 10, ts % 97)
+        memory = TSInfo(r.execute_command('TS.INFO', 'tester')).memory_usage
+
+        # a new chunk queues the series for offloading
+        for ts in range(20000, 22000):
+            r.execute_command('TS.ADD', 'tester', ts * 10, ts % 97)
+        expected = [[ts * 10, str(ts % 97).encode()] for ts in range(1, 22000)]
+        time.sleep(0.5)
+        assert TSInfo(r.execute_command('TS.INFO', 'tester')).memory_usage < memory / 2
+        assert r.execute_command('TS.RANGE', 'tester', '-', '+') == expected
+        assert r.execute_command('TS.REVRANGE', 'tester', '-', '+') == expected[::-1]
+
+        # offloaded chunks are still writable and saved to RDB
+        r.execute_command('TS.ADD', 'tester', 1003, 42)
+        expected.insert(100, [1003, b'42'])
+        env.dumpAndReload()
+        assert r.execute_command('TS.RANGE', 'tester', '-', '+') == expected
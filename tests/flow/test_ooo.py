@@ -76,7 +76,7 @@ def test_ooo_split(self):
             r.execute_command('ts.add split', quantity, 42)
             for i in range(quantity):
                 r.execute_command('ts.add split', i, i * 1.01)
-            assert _get_ts_info(r, 'split').chunk_count in [13, 32]
+            assert _get_ts_info(r, 'split').chunk_count in [12, 32]
             res = r.execute_command('ts.range split - +')
             for i in range(quantity - 1):
                 assert res[i][0] + 1 == res[i + 1][0]
@@ -85,6 +85,63 @@ def test_ooo_split(self):
             r.execute_command('DEL split')
 
 
+def test_ooo_pending_samples(self):
+    with Env().getConnection() as r:
+        type_list = ['', 'UNCOMPRESSED']
+        for chunk_type in type_list:
+            r.execute_command('ts.create', 'pending', chunk_type, 'DUPLICATE_POLICY', 'BLOCK')
+            for i in range(0, 1000, 2):
+                r.execute_command('ts.add', 'pending', i, i)
+            r.execute_command('ts.add', 'pending', 1000, 1000)
+
+            # out of order samples are buffered, duplicates must still be detected
+            assert r.execute_command('ts.add', 'pending', 11, 11) == 11
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('ts.add', 'pending', 10, 1)
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('ts.add', 'pending', 11, 1)
+
+            # policies of consecutive updates compose
+            assert r.execute_command('ts.add', 'pending', 13, 1, 'ON_DUPLICATE', 'SUM') == 13
+            assert r.execute_command('ts.add', 'pending', 13, 2, 'ON_DUPLICATE', 'SUM') == 13
+            assert r.execute_command('ts.add', 'pending', 13, 5, 'ON_DUPLICATE', 'MAX') == 13
+            assert r.execute_command('ts.add', 'pending', 12, 5, 'ON_DUPLICATE', 'SUM') == 12
+            assert r.execute_command('ts.add', 'pending', 12, 7, 'ON_DUPLICATE', 'LAST') == 12
+            assert r.execute_command('ts.add', 'pending', 14, 1, 'ON_DUPLICATE', 'FIRST') == 14
+
+            assert _get_ts_info(r, 'pending').total_samples == 504
+            assert r.execute_command('ts.range', 'pending', 10, 14) == \
+                [[10, b'10'], [11, b'11'], [12, b'7'], [13, b'5'], [14, b'14']]
+            r.execute_command('DEL', 'pending')
+
+
+def test_ooo_compactions(self):
+    random.seed(11)
+    aggregations = ['avg', 'sum', 'min', 'max', 'range', 'count', 'first', 'last', 'std.p', 'var.s']
+    with Env().getConnection() as r:
+        r.execute_command('ts.create', 'tester', 'DUPLICATE_POLICY', 'LAST')
+        for agg in aggregations:
+            r.execute_command('ts.create', 'tester_' + agg)
+            r.execute_command('ts.createrule', 'tester', 'tester_' + agg, 'AGGREGATION', agg, 100)
+        for ts in range(0, 5000, 3):
+            r.execute_command('ts.add', 'tester', ts, random.randrange(1000))
+
+        # new samples and replacements, in older buckets and in the latest one
+        for i in range(500):
+            ts = random.randrange(4900, 5000) if i % 4 == 0 else random.randrange(5000)
+            r.execute_command('ts.add', 'tester', ts, random.randrange(1000))
+        r.execute_command('ts.add', 'tester', 5100, 0)
+
+        for agg in aggregations:
+            expected = r.execute_command('ts.range', 'tester', 0, 4999, 'AGGREGATION', agg, 100)
+            actual = r.execute_command('ts.range', 'tester_' + agg, 0, 4999)
+            assert len(actual) == len(expected)
+            for (ts, value), (expected_ts, expected_value) in zip(actual, expected):
+                assert ts == expected_ts
+                assert abs(float(value) - float(expected_value)) <= \
+                       1e-6 * abs(float(expected_value)) + 1e-6
+
+
 def test_rand_oom(self):
     random.seed(20)
     start_ts = 1592917924000
@@ -100,6 +100,24 @@ def test_rdb_aggregation_context():
         assert abs(float(actual_result_std[1][1]) - float(expected_result_std[1][1])) < ALLOWED_ERROR
 
 
+
+def test_rdb_quantile_context():
+    with Env().getConnection() as r:
+        assert r.execute_command('TS.CREATE', 'tester')
+        assert r.execute_command('TS.CREATE', 'tester_agg_p50_10')
+        assert r.execute_command('TS.CREATERULE', 'tester', 'tester_agg_p50_10', 'AGGREGATION', 'P50', 10)
+        for ts, value in enumerate([5, 1, 9]):
+            assert r.execute_command('TS.ADD', 'tester', ts, value)
+        data_tester = r.execute_command('dump', 'tester')
+        r.execute_command('DEL', 'tester')
+        r.execute_command('RESTORE', 'tester', 0, data_tester)
+        assert r.execute_command('TS.ADD', 'tester', 3, 7)
+        assert r.execute_command('TS.ADD', 'tester', 4, 3)
+        assert r.execute_command('TS.ADD', 'tester', 20, 0)  # closes the bucket
+        # the median of 1, 3, 5, 7 and 9, and 3 if the sketch wasn't saved
+        result = r.execute_command('TS.RANGE', 'tester_agg_p50_10', 0, 10)
+        assert len(result) == 1 and abs(float(result[0][1]) - 5) <= 0.05
+
 def test_dump_trimmed_series(self):
     with Env().getConnection() as r:
         samples = 120
@@ -125,3 +143,46 @@ def test_empty_series():
             assert [] == r.execute_command('TS.range tester 0 -1 aggregation ' + agg + ' 1000')
         assert [[0, b'0']] == r.execute_command('TS.range tester 0 -1 aggregation count 1000')
         assert r.execute_command('DUMP', 'tester')
+
+
+def test_restore_compressed_chunks():
+    with Env().getConnection() as r:
+        for encoding in ['COMPRESSED', 'DECIMAL', 'UNCOMPRESSED']:
+            key = 'restored_' + encoding
+            r.execute_command('TS.CREATE', key, 'ENCODING', encoding, 'CHUNK_SIZE', 1024)
+            for i in range(3000):
+                r.execute_command('TS.ADD', key, 1000 + i * (1 + i % 3), i % 7 * 1.25)
+            before = [r.execute_command('TS.RANGE', key, '-', '+'),
+                      r.execute_command('TS.REVRANGE', key, 2000, 5000),
+                      r.execute_command('TS.RANGE', key, '-', '+', 'AGGREGATION', 'SUM', 500)]
+
+            data = r.execute_command('DUMP', key)
+            r.execute_command('DEL', key)
+            r.execute_command('RESTORE', key, 0, data)
+            assert before == [r.execute_command('TS.RANGE', key, '-', '+'),
+                              r.execute_command('TS.REVRANGE', key, 2000, 5000),
+                              r.execute_command('TS.RANGE', key, '-', '+', 'AGGREGATION', 'SUM', 500)]
+            # the restored chunks take new samples
+            assert r.execute_command('TS.ADD', key, 100000, 1)
+            assert _get_ts_info(r, key).total_samples == 3001
+
+
+def test_index_after_reload():
+    env = Env()
+    with env.getConnection() as r:
+        for i in range(100):
+            labels = ['id', i, 'parity', i % 2] if i % 10 else []
+            r.execute_command('TS.CREATE', 'series{}'.format(i), 'LABELS', *labels)
+        r.execute_command('TS.ADD', 'series3', 1, 3)
+
+        r.execute_command('DEBUG', 'RELOAD')
+
+        odd = sorted('series{}'.format(i).encode() for i in range(1, 100, 2) if i % 10)
+        assert sorted(r.execute_command('TS.QUERYINDEX', 'parity=1')) == odd
+        assert r.execute_command('TS.QUERYINDEX', 'id=3') == [b'series3']
+        assert r.execute_command('TS.QUERYINDEX', 'id=10') == []
+        assert r.execute_command('TS.MGET', 'FILTER', 'id=3') == [[b'series3', [], [1, b'3']]]
+
+        # deleting a loaded series removes it from the index
+        r.execute_command('DEL', 'series3')
+        assert r.execute_command('TS.QUERYINDEX', 'id=3') == []
@@ -64,6 +64,13 @@ def test_rename_indexed():
 
         env.assertEqual(r.execute_command('TS.MGET', 'FILTER', 'area_id=32'), [[b'a1{3}', [], [100, b'200']]])
 
+        # the renamed series is dropped from the index once deleted
+        assert r.execute_command('TS.ADD', 'b{3}', 100, 300, 'LABELS', 'sensor_id', '3', 'area_id', '32')
+        env.assertTrue(r.execute_command('RENAME', 'a1{3}', 'a2{3}'))
+        env.assertEqual(r.execute_command('TS.QUERYINDEX', 'area_id=32'), [b'a2{3}', b'b{3}'])
+        assert r.execute_command('DEL', 'a2{3}')
+        env.assertEqual(r.execute_command('TS.QUERYINDEX', 'area_id=32'), [b'b{3}'])
+        env.assertEqual(r.execute_command('TS.QUERYINDEX', 'sensor_id=2'), [])
 
 
 def test_rename_none_ts():
@@ -83,4 +90,28 @@ def test_rename_none_ts():
 
         aInfo = TSInfo(r.execute_command('TS.INFO', 'a{4}'))
         env.assertEqual(aInfo.sourceKey, None)
-        env.assertEqual(aInfo.rules, [])
\ No newline at end of file
+        env.assertEqual(aInfo.rules, [])
+
+def test_rules_across_keyspace_events():
+    env = Env()
+    with env.getClusterConnectionIfNeeded() as r:
+        assert r.execute_command('TS.CREATE', 'src{5}')
+        assert r.execute_command('TS.CREATE', 'dst{5}')
+        assert r.execute_command('TS.CREATERULE', 'src{5}', 'dst{5}', 'AGGREGATION', 'SUM', 10)
+        for ts in range(1, 31):
+            # events of other keys leave the series alone
+            r.execute_command('SET', 'other{5}', ts)
+            r.execute_command('EXPIRE', 'other{5}', 100)
+            r.execute_command('RENAME', 'other{5}', 'other2{5}')
+            r.execute_command('DEL', 'other2{5}')
+            r.execute_command('TS.ADD', 'src{5}', ts, 1)
+        env.assertEqual(r.execute_command('TS.RANGE', 'dst{5}', '-', '+'),
+                        [[0, b'9'], [10, b'10'], [20, b'10']])
+
+        # the rule stops at the deleted destination, and follows a renamed one
+        env.assertTrue(r.execute_command('RENAME', 'dst{5}', 'dst2{5}'))
+        r.execute_command('TS.ADD', 'src{5}', 41, 1)
+        env.assertEqual(r.execute_command('TS.RANGE', 'dst2{5}', '-', '+')[-1], [30, b'1'])
+        assert r.execute_command('DEL', 'dst2{5}')
+        r.execute_command('TS.ADD', 'src{5}', 51, 1)
+        env.assertEqual(TSInfo(r.execute_command('TS.INFO', 'src{5}')).rules, [])
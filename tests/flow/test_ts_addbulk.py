@@ -0,0 +1,109 @@
+import struct
+
+import pytest
+import redis
+from RLTest import Env
+from test_helper_classes import _get_ts_info
+
+
+def test_addbulk():
+    with Env().getConnection() as r:
+        assert r.execute_command('TS.CREATE', 'tester')
+        args = []
+        for i in range(1000):
+            args += [1000 + i, i]
+        assert r.execute_command('TS.ADDBULK', 'tester', *args) == [1000 + i for i in range(1000)]
+        assert r.execute_command('TS.RANGE', 'tester', '-', '+') == \
+               [[1000 + i, str(i).encode('ascii')] for i in range(1000)]
+
+        # samples are validated one by one, like TS.MADD
+        reply = r.execute_command('TS.ADDBULK', 'tester', 3000, 1, 'bad', 2, 3001, 'bad', 500, 7, 3002, 3)
+        assert reply[0] == 3000
+        assert isinstance(reply[1], redis.ResponseError)
+        assert isinstance(reply[2], redis.ResponseError)
+        assert reply[3] == 500
+        assert reply[4] == 3002
+        assert _get_ts_info(r, 'tester').total_samples == 1003
+
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.ADDBULK', 'tester', 1, 2, 3)
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.ADDBULK', 'tester', 1)
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.ADDBULK', 'missing', 1, 2)
+        r.execute_command('SET', 'string', 'x')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.ADDBULK', 'string', 1, 2)
+
+
+def test_addbulk_compaction():
+    with Env().getConnection() as r:
+        for key in ['bulk', 'madd']:
+            assert r.execute_command('TS.CREATE', key)
+            for agg in ['avg', 'sum', 'min', 'max', 'count', 'first', 'last', 'range', 'std.p', 'var.s']:
+                dest = '{}_{}'.format(key, agg)
+                assert r.execute_command('TS.CREATE', dest)
+                assert r.execute_command('TS.CREATERULE', key, dest, 'AGGREGATION', agg, 10)
+
+        samples = [(ts, (ts * 7) % 13) for ts in range(0, 500, 3)]
+        bulk_args, madd_args = [], []
+        for ts, value in samples:
+            bulk_args += [ts, value]
+            madd_args += ['madd', ts, value]
+        r.execute_command('TS.ADDBULK', 'bulk', *bulk_args)
+        r.execute_command('TS.MADD', *madd_args)
+        # a second batch continues the bucket left open by the first one
+        r.execute_command('TS.ADDBULK', 'bulk', 501, 5, 505, 6, 512, 1)
+        r.execute_command('TS.MADD', 'madd', 501, 5, 'madd', 505, 6, 'madd', 512, 1)
+
+        for agg in ['avg', 'sum', 'min', 'max', 'count', 'first', 'last', 'range', 'std.p', 'var.s']:
+            assert r.execute_command('TS.RANGE', 'bulk_' + agg, '-', '+') == \
+                   r.execute_command('TS.RANGE', 'madd_' + agg, '-', '+')
+
+
+def _delta_encode(samples):
+    out = b''
+    prev = 0
+    for ts, value in samples:
+        delta = ts - prev
+        prev = ts
+        zigzag = (delta << 1) ^ (delta >> 63)
+        zigzag &= (1 << 64) - 1
+        while True:
+            byte = zigzag & 0x7f
+            zigzag >>= 7
+            out += bytes([byte | (0x80 if zigzag else 0)])
+            if not zigzag:
+                break
+        out += struct.pack('<d', value)
+    return out
+
+
+def test_addbulk_binary():
+    with Env().getConnection() as r:
+        samples = [(1000 + i * 1000, i * 0.25) for i in range(500)]
+        raw = b''.join(struct.pack('<qd', ts, value) for ts, value in samples)
+        assert r.execute_command('TS.CREATE', 'text')
+        text_args = []
+        for ts, value in samples:
+            text_args += [ts, value]
+        r.execute_command('TS.ADDBULK', 'text', *text_args)
+
+        for key, fmt, blob in [('raw', 'RAW', raw), ('delta', 'delta', _delta_encode(samples))]:
+            assert r.execute_command('TS.CREATE', key)
+            assert r.execute_command('TS.ADDBULK', key, 'FORMAT', fmt, blob) == [ts for ts, _ in samples]
+            assert r.execute_command('TS.RANGE', key, '-', '+') == r.execute_command('TS.RANGE', 'text', '-', '+')
+
+        # out of order and duplicate samples are handled like in the text form
+        reply = r.execute_command('TS.ADDBULK', 'delta', 'FORMAT', 'DELTA', _delta_encode([(1500, 1), (1000, 2)]))
+        assert reply[0] == 1500
+        assert isinstance(reply[1], redis.ResponseError)
+
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.ADDBULK', 'raw', 'FORMAT', 'RAW', raw[:-1])
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.ADDBULK', 'raw', 'FORMAT', 'DELTA', _delta_encode(samples[:1])[:-1])
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.ADDBULK', 'raw', 'FORMAT', 'TEXT', raw)
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.ADDBULK', 'raw', 'FORMAT', 'RAW')
@@ -1,7 +1,9 @@
 import pytest
 import redis
+import time
 from RLTest import Env
-from test_helper_classes import _assert_alter_cmd, _ts_alter_cmd, _fill_data, _insert_data
+from test_helper_classes import _assert_alter_cmd, _ts_alter_cmd, _fill_data, _insert_data, \
+    _get_ts_info
 
 
 def test_alter_cmd():
@@ -63,3 +65,75 @@ def test_alter_key(self):
             [overrided_ts, str(overrided_ts).encode("ascii")]]
         r.execute_command('TS.ADD', key, date_ranges[0][0] + 10, 10)
         assert r.execute_command('TS.RANGE', key, overrided_ts, overrided_ts) == [[overrided_ts, b'10']]
+
+
+def test_alter_retention_trims_in_background():
+    with Env().getConnection() as r:
+        key = 'trimmed'
+        samples_count = 3000
+        assert r.execute_command('TS.CREATE', key, 'CHUNK_SIZE', 128, 'UNCOMPRESSED')
+        for i in range(samples_count):
+            r.execute_command('TS.ADD', key, i, i)
+        chunks_before = _get_ts_info(r, key).chunk_count
+
+        assert r.execute_command('TS.ALTER', key, 'RETENTION', 100) == b'OK'
+        # expired samples are hidden right away and freed by the sweeper
+        assert len(r.execute_command('TS.RANGE', key, '-', '+')) == 101
+        for _ in range(100):
+            if _get_ts_info(r, key).chunk_count < chunks_before / 10:
+                break
+            time.sleep(0.05)
+        assert _get_ts_info(r, key).chunk_count < chunks_before / 10
+        first = samples_count - 101
+        assert r.execute_command('TS.RANGE', key, '-', '+')[0] == [first, str(first).encode('ascii')]
+
+        r.execute_command('TS.ADD', key, samples_count, samples_count)
+        assert r.execute_command('TS.GET', key) == [samples_count, str(samples_count).encode('ascii')]
+
+
+def test_alter_reencode():
+    for module_args in ['', 'WORKER_THREADS 2']:
+        env = Env(moduleArgs=module_args)
+        with env.getConnection() as r:
+            r.execute_command('FLUSHALL')
+            assert r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', 128, 'ENCODING', 'UNCOMPRESSED')
+            for ts in range(0, 5000, 3):
+                r.execute_command('TS.ADD', 'tester', ts, ts % 101)
+            r.execute_command('TS.ADD', 'tester', 1000, 7, 'ON_DUPLICATE', 'LAST')
+            samples = r.execute_command('TS.RANGE', 'tester', '-', '+')
+            info = _get_ts_info(r, 'tester')
+            assert info.chunk_type == b'uncompressed'
+
+            # the stored chunks are converted, not only the next ones
+            assert r.execute_command('TS.ALTER', 'tester', 'ENCODING', 'COMPRESSED') == b'OK'
+            reencoded = _get_ts_info(r, 'tester')
+            assert reencoded.chunk_type == b'compressed'
+            assert reencoded.total_samples == info.total_samples
+            assert reencoded.chunk_count < info.chunk_count
+            assert r.execute_command('TS.RANGE', 'tester', '-', '+') == samples
+            assert r.execute_command('TS.GET', 'tester') == samples[-1]
+
+            assert r.execute_command('TS.ALTER', 'tester', 'CHUNK_SIZE', 4096, 'REENCODE') == b'OK'
+            resized = _get_ts_info(r, 'tester')
+            assert resized.chunk_size_bytes == 4096
+            assert resized.chunk_count < reencoded.chunk_count
+            assert r.execute_command('TS.RANGE', 'tester', '-', '+') == samples
+
+            # the series keeps taking samples
+            r.execute_command('TS.ADD', 'tester', 6000, 1)
+            assert r.execute_command('TS.GET', 'tester') == [6000, b'1']
+            r.execute_command('TS.ADD', 'tester', 2, 3, 'ON_DUPLICATE', 'LAST')
+            assert r.execute_command('TS.RANGE', 'tester', 2, 2) == [[2, b'3']]
+
+            assert r.execute_command('TS.CREATE', 'empty')
+            assert r.execute_command('TS.ALTER', 'empty', 'ENCODING', 'DECIMAL') == b'OK'
+            assert _get_ts_info(r, 'empty').chunk_type == b'decimal'
+            r.execute_command('TS.ADD', 'empty', 1, 1.5)
+            assert r.execute_command('TS.GET', 'empty') == [1, b'1.5']
+
+            assert r.execute_command('TS.CREATE', 'rounded', 'SIGNIFICANT_DIGITS', 3)
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.ALTER', 'rounded', 'ENCODING', 'DECIMAL')
+            assert r.execute_command('TS.ALTER', 'rounded', 'ENCODING', 'DECIMAL',
+                                     'SIGNIFICANT_DIGITS', 0) == b'OK'
+        env.stop()
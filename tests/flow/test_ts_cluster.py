@@ -0,0 +1,86 @@
+import pytest
+import redis
+from RLTest import Env
+
+
+def create_series(r, count):
+    for i in range(count):
+        r.execute_command('TS.CREATE', 'series{%d}' % i, 'LABELS', 'name', 'cluster', 'class', 'abc'[i % 3],
+                          'id', i)
+        for ts in range(1, 200, 1 + i % 5):
+            r.execute_command('TS.ADD', 'series{%d}' % i, ts, (ts * i) % 17)
+
+
+queries = [['-', '+', 'FILTER', 'name=cluster'],
+           ['-', '+', 'WITHLABELS', 'FILTER', 'class=(a,b)'],
+           [50, 150, 'COUNT', 7, 'FILTER', 'name=cluster', 'id!=3'],
+           ['-', '+', 'AGGREGATION', 'avg', 20, 'FILTER', 'name=cluster'],
+           ['-', '+', 'AGGREGATION', 'max', 10, 'COUNT', 5, 'WITHLABELS', 'FILTER', 'name=cluster'],
+           ['-', '+', 'FILTER', 'name=cluster', 'GROUPBY', 'class', 'REDUCE', 'sum'],
+           ['-', '+', 'AGGREGATION', 'sum', 25, 'FILTER', 'name=cluster', 'GROUPBY', 'class', 'REDUCE', 'max'],
+           [10, 100, 'FILTER', 'name=cluster', 'GROUPBY', 'class', 'REDUCE', 'min'],
+           ['-', '+', 'AGGREGATION', 'count', 30, 'FILTER', 'name=cluster', 'GROUPBY', 'class', 'REDUCE', 'avg'],
+           ['-', '+', 'FILTER', 'name=cluster', 'GROUPBY', 'class', 'REDUCE', 'count'],
+           ['-', '+', 'FILTER', 'name=cluster', 'GROUPBY', 'class', 'REDUCE', 'range'],
+           ['-', '+', 'FILTER', 'name=cluster', 'GROUPBY', 'id', 'REDUCE', 'std.p'],
+           ['-', '+', 'FILTER', 'name=missing']]
+
+
+def test_cluster_query_on_single_node():
+    # outside of a cluster the node is the only shard, the replies are those of the local queries
+    with Env().getConnection() as r:
+        create_series(r, 20)
+        for query in queries:
+            assert r.execute_command('TS.MRANGE', *query) == r.execute_command('TS.CLUSTER.MRANGE', *query)
+            assert r.execute_command('TS.MREVRANGE', *query) == \
+                   r.execute_command('TS.CLUSTER.MREVRANGE', *query)
+        for query in [['FILTER', 'name=cluster'], ['WITHLABELS', 'FILTER', 'class=c'], ['FILTER', 'id=100']]:
+            assert r.execute_command('TS.MGET', *query) == r.execute_command('TS.CLUSTER.MGET', *query)
+        r.execute_command('TS.CREATE', 'empty', 'LABELS', 'name', 'cluster')
+        assert r.execute_command('TS.MGET', 'FILTER', 'name=cluster') == \
+               r.execute_command('TS.CLUSTER.MGET', 'FILTER', 'name=cluster')
+
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.CLUSTER.MRANGE', '-', '+', 'CURSOR', 0, 'FILTER', 'name=cluster')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.CLUSTER.MRANGE', '-', '+', 'FILTER', 'name!=cluster')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.CLUSTER.MGET', 'FILTER')
+
+
+def test_cluster_query_across_shards():
+    env = Env(env='oss-cluster', shardsCount=3)
+    create_series(env.getClusterConnection(), 30)
+    shards = [env.getConnection(i) for i in range(1, env.shardsCount + 1)]
+
+    for query in queries:
+        if 'GROUPBY' in query:
+            continue
+        # the series are spread over the shards, and merged by name
+        expected = sorted(sum((shard.execute_command('TS.MRANGE', *query) for shard in shards), []))
+        for shard in shards:
+            assert expected == shard.execute_command('TS.CLUSTER.MRANGE', *query)
+    expected = sorted(sum((shard.execute_command('TS.MGET', 'WITHLABELS', 'FILTER', 'name=cluster')
+                           for shard in shards), []))
+    assert len(expected) == 30
+    assert expected == shards[0].execute_command('TS.CLUSTER.MGET', 'WITHLABELS', 'FILTER', 'name=cluster')
+
+    # the groups reduce the series of all the shards
+    ranges = shards[1].execute_command('TS.CLUSTER.MRANGE', '-', '+', 'WITHLABELS', 'FILTER', 'name=cluster')
+    for reducer, reduce in [('sum', sum), ('max', max), ('count', len)]:
+        groups = shards[2].execute_command('TS.CLUSTER.MRANGE', '-', '+', 'FILTER', 'name=cluster',
+                                           'GROUPBY', 'class', 'REDUCE', reducer)
+        assert [group[0] for group in groups] == [b'class=a', b'class=b', b'class=c']
+        for group in groups:
+            members = [series for series in ranges if [b'class', group[0][6:]] in series[1]]
+            assert group[1][2] == [b'__source__', b','.join(series[0] for series in members)]
+            values = {}
+            for series in members:
+                for ts, value in series[2]:
+                    values.setdefault(ts, []).append(float(value))
+            assert [[ts, float(value)] for ts, value in group[2]] == \
+                   [[ts, float(reduce(values[ts]))] for ts in sorted(values)]
+    groups = shards[0].execute_command('TS.CLUSTER.MREVRANGE', '-', '+', 'FILTER', 'name=cluster',
+                                       'GROUPBY', 'class', 'REDUCE', 'std.p')
+    assert len(groups) == 3
+    assert groups[0][2][0][0] > groups[0][2][-1][0]
@@ -53,6 +53,95 @@ def test_create_with_negative_chunk_size():
             assert r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', -10)
 
 
+def test_create_chunk_size_limits():
+    with Env().getConnection() as r:
+        # larger than a short
+        r.execute_command('TS.CREATE', 'large', 'CHUNK_SIZE', 100000)
+        assert _get_ts_info(r, 'large').chunk_size_bytes == 100000
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', 2 * 1024 * 1024)
+
+
+def test_create_adaptive_chunk_size():
+    with Env().getConnection() as r:
+        for encoding in ['COMPRESSED', 'UNCOMPRESSED']:
+            r.execute_command('TS.CREATE', 'sparse', 'CHUNK_SIZE', 'ADAPTIVE', 'ENCODING', encoding)
+            r.execute_command('TS.CREATE', 'dense', 'CHUNK_SIZE', 'ADAPTIVE', 'ENCODING', encoding)
+            for i in range(1, 3000):
+                r.execute_command('TS.ADD', 'sparse', i * 3600 * 1000, i % 17)
+            for i in range(1, 100000, 10):
+                r.execute_command('TS.MADD', *[arg for ts in range(i, i + 10)
+                                               for arg in ['dense', ts, ts % 1000]])
+            assert _get_ts_info(r, 'sparse').chunk_size_bytes < 4096
+            assert _get_ts_info(r, 'dense').chunk_size_bytes > 4096
+            assert len(r.execute_command('TS.RANGE', 'dense', '-', '+')) == 99999
+
+            # a fixed size stops the adaptation
+            r.execute_command('TS.ALTER', 'sparse', 'CHUNK_SIZE', 1024)
+            r.execute_command('TS.ADD', 'sparse', 3000 * 3600 * 1000, 1)
+            assert _get_ts_info(r, 'sparse').chunk_size_bytes == 1024
+            r.execute_command('DEL', 'sparse', 'dense')
+
+
+def test_create_chunk_time_window():
+    def chunk_windows(r, key, window):
+        info = r.execute_command('TS.INFO', key, 'DEBUG')
+        chunks = info[info.index(b'Chunks') + 1]
+        return [(chunk[1] // window, chunk[3] // window) for chunk in chunks]
+
+    with Env().getConnection() as r:
+        for encoding in ['COMPRESSED', 'UNCOMPRESSED']:
+            r.execute_command('TS.CREATE', 'tester', 'CHUNK_TIME_WINDOW', 1000, 'ENCODING', encoding)
+            for ts in range(0, 10000, 7):
+                r.execute_command('TS.ADD', 'tester', ts, ts % 5)
+            # out of order samples go to the chunk of their window, a new one if it has none
+            r.execute_command('TS.ADD', 'tester', 20000, 1)
+            r.execute_command('TS.ADD', 'tester', 15500, 1)
+            r.execute_command('TS.ADD', 'tester', 3, 1)
+            windows = chunk_windows(r, 'tester', 1000)
+            assert [first for first, last in windows] == list(range(10)) + [15, 20]
+            assert all(first == last for first, last in windows)
+            assert len(r.execute_command('TS.RANGE', 'tester', '-', '+')) == len(range(0, 10000, 7)) + 3
+
+            # the chunks align with the buckets of the aggregations
+            assert r.execute_command('TS.RANGE', 'tester', 0, 9999, 'AGGREGATION', 'count', 1000) == \
+                   [[ts, str(len(range(ts + (-ts) % 7, ts + 1000, 7)) + (1 if ts == 0 else 0)).encode()]
+                    for ts in range(0, 10000, 1000)]
+
+            # without a window, chunks are cut by size only
+            r.execute_command('TS.ALTER', 'tester', 'CHUNK_TIME_WINDOW', 0)
+            for ts in range(20001, 25000, 7):
+                r.execute_command('TS.ADD', 'tester', ts, 1)
+            first, last = chunk_windows(r, 'tester', 1000)[-1]
+            assert first < last
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.ALTER', 'tester', 'CHUNK_TIME_WINDOW', -1)
+            r.execute_command('DEL', 'tester')
+
+
+def test_info_debug_chunks_efficiency():
+    with Env().getConnection() as r:
+        for encoding in ['COMPRESSED', 'UNCOMPRESSED']:
+            r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', 4096, 'ENCODING', encoding)
+            for ts in range(1, 2001):
+                r.execute_command('TS.ADD', 'tester', ts, ts % 10)
+            info = r.execute_command('TS.INFO', 'tester', 'DEBUG')
+            reply = dict(zip(info[::2], info[1::2]))
+            chunks = [dict(zip(chunk[::2], chunk[1::2])) for chunk in reply[b'Chunks']]
+            size = sum(chunk[b'size'] for chunk in chunks)
+            used = sum(chunk[b'usedSize'] for chunk in chunks)
+            assert 0 < used <= size
+            assert math.isclose(float(reply[b'fillFactor']), used / size)
+            assert math.isclose(float(reply[b'compressionRatio']), 2000 * SAMPLE_SIZE / size)
+            for chunk in chunks:
+                assert chunk[b'usedSize'] <= chunk[b'size']
+                fill = chunk[b'usedSize'] / chunk[b'size']
+                assert math.isclose(float(chunk[b'fillFactor']), fill)
+            if encoding == 'UNCOMPRESSED':
+                assert used == 2000 * SAMPLE_SIZE
+            r.execute_command('DEL', 'tester')
+
+
 def test_check_retention_64bit():
     with Env().getConnection() as r:
         huge_timestamp = 4000000000  # larger than uint32
@@ -77,7 +166,7 @@ def test_uncompressed():
         assert [[1, b'3.5'], [2, b'4.5'], [3, b'5.5']] == \
                r.execute_command('ts.range not_compressed 0 -1')
         info = _get_ts_info(r, 'not_compressed')
-        assert info.total_samples == 3 and info.memory_usage == 4136
+        assert info.total_samples == 3 and info.memory_usage == 4272
 
         # rdb load
         data = r.execute_command('dump', 'not_compressed')
@@ -88,11 +177,85 @@ def test_uncompressed():
         assert [[1, b'3.5'], [2, b'4.5'], [3, b'5.5']] == \
                r.execute_command('ts.range not_compressed 0 -1')
         info = _get_ts_info(r, 'not_compressed')
-        assert info.total_samples == 3 and info.memory_usage == 4136
+        assert info.total_samples == 3 and info.memory_usage == 4272
         # test deletion
         assert r.delete('not_compressed')
 
 
+def test_decimal_encoding():
+    with Env().getConnection() as r:
+        with pytest.raises(redis.ResponseError) as excinfo:
+            assert r.execute_command('TS.CREATE', 'invalid', 'ENCODING', 'BITS')
+        with pytest.raises(redis.ResponseError) as excinfo:
+            assert r.execute_command('TS.CREATE', 'invalid', 'ENCODING')
+
+        r.execute_command('TS.CREATE', 'decimal', 'ENCODING', 'DECIMAL')
+        r.execute_command('TS.CREATE', 'compressed', 'ENCODING', 'COMPRESSED')
+        assert _get_ts_info(r, 'decimal').chunk_type == b'decimal'
+        assert _get_ts_info(r, 'compressed').chunk_type == b'compressed'
+        for i in range(10000):
+            r.execute_command('TS.ADD', 'decimal', 1000 + i * 10, 1000000 + i * 3)
+            r.execute_command('TS.ADD', 'compressed', 1000 + i * 10, 1000000 + i * 3)
+        assert _get_ts_info(r, 'decimal').chunk_count < _get_ts_info(r, 'compressed').chunk_count
+
+        # values with more decimals, or none, are kept exactly
+        values = ['21.5', '21.25', '-3.75', '0.1', '3.14159265', '1e+300']
+        for i, value in enumerate(values):
+            r.execute_command('TS.ADD', 'decimal', 200000 + i, value)
+        expected = [[200000 + i, value.encode()] for i, value in enumerate(values)]
+        assert r.execute_command('TS.RANGE', 'decimal', 200000, '+') == expected
+
+        data = r.execute_command('DUMP', 'decimal')
+        r.execute_command('DEL', 'decimal')
+        r.execute_command('RESTORE', 'decimal', 0, data)
+        assert _get_ts_info(r, 'decimal').chunk_type == b'decimal'
+        assert _get_ts_info(r, 'decimal').total_samples == 10000 + len(values)
+        assert r.execute_command('TS.RANGE', 'decimal', 200000, '+') == expected
+        assert r.execute_command('TS.GET', 'decimal')[1] == b'1e+300'
+
+
+def test_significant_digits():
+    with Env().getConnection() as r:
+        for digits in ['-1', '16', 'two']:
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.CREATE', 'invalid', 'SIGNIFICANT_DIGITS', digits)
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.CREATE', 'invalid', 'ENCODING', 'DECIMAL',
+                              'SIGNIFICANT_DIGITS', 4)
+
+        r.execute_command('TS.CREATE', 'rounded', 'SIGNIFICANT_DIGITS', 4)
+        r.execute_command('TS.CREATE', 'lossless')
+        r.execute_command('TS.CREATE', 'rounded_max')
+        r.execute_command('TS.CREATERULE', 'rounded', 'rounded_max', 'AGGREGATION', 'max', 1000)
+        info = r.execute_command('TS.INFO', 'rounded')
+        assert dict(zip(info[::2], info[1::2]))[b'significantDigits'] == 4
+        for i in range(5000):
+            value = 20 + math.sin(i / 100)
+            r.execute_command('TS.ADD', 'rounded', i, value)
+            r.execute_command('TS.ADD', 'lossless', i, value)
+        assert _get_ts_info(r, 'rounded').chunk_count < _get_ts_info(r, 'lossless').chunk_count
+        for ts, value in r.execute_command('TS.RANGE', 'rounded', '-', '+'):
+            expected = 20 + math.sin(ts / 100)
+            assert abs(float(value) - expected) <= expected * 0.5e-4
+        # rules get the stored values
+        rounded_max = r.execute_command('TS.RANGE', 'rounded_max', 0, 0)[0][1]
+        stored = r.execute_command('TS.RANGE', 'rounded', 0, 999)
+        assert float(rounded_max) == max(float(value) for _, value in stored)
+
+        data = r.execute_command('DUMP', 'rounded')
+        r.execute_command('DEL', 'rounded')
+        r.execute_command('RESTORE', 'rounded', 0, data)
+        r.execute_command('TS.ADD', 'rounded', 5000, 1.23456789)
+        assert abs(float(r.execute_command('TS.GET', 'rounded')[1]) - 1.23456789) <= 0.5e-4 * 1.24
+
+        r.execute_command('TS.ALTER', 'rounded', 'SIGNIFICANT_DIGITS', 0)
+        r.execute_command('TS.ADD', 'rounded', 5001, 1.23456789)
+        assert r.execute_command('TS.GET', 'rounded')[1] == b'1.23456789'
+        r.execute_command('TS.CREATE', 'decimal', 'ENCODING', 'DECIMAL')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.ALTER', 'decimal', 'SIGNIFICANT_DIGITS', 4)
+
+
 def test_trim():
     with Env().getConnection() as r:
         for mode in ["UNCOMPRESSED", "COMPRESSED"]:
@@ -158,3 +321,49 @@ def test_expire():
         assert r.execute_command('expire test 1') == 1
         time.sleep(2)
         assert r.execute_command('keys *') == []
+
+
+def test_info_label_strings():
+    # the label names and values are stored once, whatever the number of series carrying them
+    with Env().getConnection() as r:
+        r.execute_command('FLUSHALL')
+        for i in range(10):
+            r.execute_command('TS.CREATE', 'sensor{}'.format(i), 'LABELS', 'name', 'sensor',
+                              'area', i % 2)
+        assert r.info('timeseries_memory')['timeseries_label_strings'] == 5
+        r.execute_command('TS.ADD', 'sensor1', 1, 1)
+        reply = r.execute_command('TS.MRANGE', '-', '+', 'WITHLABELS', 'FILTER', 'area=1')
+        assert len(reply) == 5
+        assert reply[0][1] == [[b'name', b'sensor'], [b'area', b'1']]
+
+        r.execute_command('TS.ALTER', 'sensor0', 'LABELS', 'name', 'gauge')
+        assert r.info('timeseries_memory')['timeseries_label_strings'] == 6
+        for i in range(1, 10):
+            r.execute_command('DEL', 'sensor{}'.format(i))
+        assert r.info('timeseries_memory')['timeseries_label_strings'] == 2
+        assert r.execute_command('TS.QUERYINDEX', 'name=gauge') == [b'sensor0']
+        r.execute_command('FLUSHALL')
+        assert r.info('timeseries_memory')['timeseries_label_strings'] == 0
+
+
+def test_info_memory_section():
+    with Env().getConnection() as r:
+        r.execute_command('FLUSHALL')
+        r.execute_command('TS.CREATE', 'a', 'CHUNK_SIZE', 128)
+        r.execute_command('TS.CREATE', 'b', 'UNCOMPRESSED')
+        for i in range(1, 1001):
+            r.execute_command('TS.MADD', 'a', i, i % 10, 'b', i, i)
+        a = _get_ts_info(r, 'a')
+        b = _get_ts_info(r, 'b')
+        info = r.info('timeseries_memory')
+        assert info['timeseries_chunks'] == a.chunk_count + b.chunk_count
+        assert info['timeseries_samples'] == 2000
+        assert info['timeseries_chunks_bytes'] < a.memory_usage + b.memory_usage
+        assert info['timeseries_compression_ratio'] > 1
+
+        # upserts, retention and deletes are accounted as well
+        r.execute_command('TS.ADD', 'a', 500, 7, 'ON_DUPLICATE', 'LAST')
+        r.execute_command('DEL', 'b')
+        info = r.info('timeseries_memory')
+        assert info['timeseries_chunks'] == _get_ts_info(r, 'a').chunk_count
+        assert info['timeseries_samples'] == 1000
@@ -44,6 +44,37 @@ def test_create_compaction_rule_with_wrong_aggregation():
             assert r.execute_command('TS.CREATERULE', 'tester', 'tester_agg_max_10', 'AGGREGATION', 'MA', 10)
 
 
+
+def test_create_compaction_rule_backfill():
+    for module_args in ['', 'WORKER_THREADS 2']:
+        env = Env(moduleArgs=module_args)
+        with env.getConnection() as r:
+            r.execute_command('FLUSHALL')
+            assert r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', 128)
+            for ts in range(0, 5000, 3):
+                r.execute_command('TS.ADD', 'tester', ts, ts % 101)
+            for agg_type in ['sum', 'max', 'avg', 'p90']:
+                dest = 'tester_agg_%s' % agg_type
+                assert r.execute_command('TS.CREATE', dest)
+                assert r.execute_command('TS.CREATERULE', 'tester', dest, 'AGGREGATION', agg_type, 100, 'BACKFILL')
+                # the current bucket is left to the rule
+                assert r.execute_command('TS.RANGE', dest, '-', '+') == \
+                       r.execute_command('TS.RANGE', 'tester', 0, 4899, 'AGGREGATION', agg_type, 100)
+
+            # the rules go on from the current bucket
+            r.execute_command('TS.ADD', 'tester', 5000, 1000)
+            for agg_type in ['sum', 'max', 'avg', 'p90']:
+                assert r.execute_command('TS.RANGE', 'tester_agg_%s' % agg_type, '-', '+') == \
+                       r.execute_command('TS.RANGE', 'tester', 0, 4999, 'AGGREGATION', agg_type, 100)
+
+            assert r.execute_command('TS.CREATE', 'empty')
+            assert r.execute_command('TS.CREATE', 'empty_agg')
+            assert r.execute_command('TS.CREATERULE', 'empty', 'empty_agg', 'AGGREGATION', 'sum', 10, 'BACKFILL')
+            assert r.execute_command('TS.CREATE', 'other')
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.CREATERULE', 'tester', 'other', 'AGGREGATION', 'sum', 10, 'BACKFIL')
+        env.stop()
+
 def test_create_compaction_rule_without_dest_series():
     with Env().getConnection() as r:
         assert r.execute_command('TS.CREATE', 'tester')
@@ -143,6 +174,29 @@ def test_delete_key():
         assert _get_ts_info(r, 'tester').rules == [[b'tester_agg_max_10', 12, b'AVG']]
 
 
+def test_unlink_large_key():
+    with Env().getConnection() as r:
+        assert r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', '128', 'LABELS', 'name', 'unlink')
+        assert r.execute_command('TS.CREATE', 'tester_agg', 'LABELS', 'name', 'unlink_agg')
+        assert r.execute_command('TS.CREATERULE', 'tester', 'tester_agg', 'AGGREGATION', 'avg', 10)
+        for i in range(0, 10000, 100):
+            r.execute_command('TS.MADD', *[arg for ts in range(i, i + 100) for arg in ('tester', ts, ts)])
+        # more chunks than the lazy free threshold, the series is freed in the background
+        assert _get_ts_info(r, 'tester').chunk_count > 64
+        assert r.execute_command('UNLINK', 'tester') == 1
+        assert r.execute_command('TS.QUERYINDEX', 'name=unlink') == []
+        assert r.execute_command('TS.QUERYINDEX', 'name=(unlink,unlink_agg)') == [b'tester_agg']
+        assert _get_ts_info(r, 'tester_agg').sourceKey == None
+
+        # a renamed key is unlinked as well, but keeps its labels and rules
+        assert r.execute_command('TS.CREATE', 'tester', 'LABELS', 'name', 'unlink')
+        assert r.execute_command('TS.CREATERULE', 'tester', 'tester_agg', 'AGGREGATION', 'avg', 10)
+        assert r.execute_command('RENAME', 'tester', 'tester_renamed')
+        assert r.execute_command('TS.QUERYINDEX', 'name=unlink') == [b'tester_renamed']
+        assert _get_ts_info(r, 'tester_renamed').rules == [[b'tester_agg', 10, b'AVG']]
+        assert _get_ts_info(r, 'tester_agg').sourceKey == b'tester_renamed'
+
+
 def test_downsampling_current():
     with Env().getConnection() as r:
         key = 'src'
@@ -329,3 +383,30 @@ def test_rule_timebucket_64bit(self):
         info = _get_ts_info(r, 'test_key')
         assert info.rules[0][1] == BELOW_32BIT_LIMIT
         assert info.rules[1][1] == ABOVE_32BIT_LIMIT
+
+
+def test_compaction_dest_changes_between_writes():
+    with Env().getConnection() as r:
+        assert r.execute_command('TS.CREATE', 'src')
+        for dest in ['dest_sum', 'dest_max']:
+            assert r.execute_command('TS.CREATE', dest)
+        assert r.execute_command('TS.CREATERULE', 'src', 'dest_sum', 'AGGREGATION', 'SUM', 10)
+        assert r.execute_command('TS.CREATERULE', 'src', 'dest_max', 'AGGREGATION', 'MAX', 10)
+
+        args = []
+        for ts in range(0, 50):
+            args += ['src', ts, ts % 7]
+        r.execute_command('TS.MADD', *args)
+        assert r.execute_command('TS.RANGE', 'dest_sum', 0, '+') == \
+               r.execute_command('TS.RANGE', 'src', 0, 39, 'AGGREGATION', 'SUM', 10)
+        assert r.execute_command('TS.RANGE', 'dest_max', 0, '+') == \
+               r.execute_command('TS.RANGE', 'src', 0, 39, 'AGGREGATION', 'MAX', 10)
+
+        # writes follow a renamed destination, and stop once it is deleted
+        assert r.execute_command('RENAME', 'dest_sum', 'dest_sum2')
+        assert r.execute_command('DEL', 'dest_max')
+        r.execute_command('TS.MADD', 'src', 50, 1, 'src', 60, 1)
+        assert r.execute_command('TS.RANGE', 'dest_sum2', 0, '+') == \
+               r.execute_command('TS.RANGE', 'src', 0, 59, 'AGGREGATION', 'SUM', 10)
+        assert _get_ts_info(r, 'src').rules == [[b'dest_sum2', 10, b'SUM']]
+        assert r.execute_command('EXISTS', 'dest_max') == 0
@@ -0,0 +1,71 @@
+import pytest
+import redis
+from RLTest import Env
+from test_helper_classes import _get_ts_info
+
+
+def test_del_range():
+    with Env().getConnection() as r:
+        for encoding in ['COMPRESSED', 'UNCOMPRESSED']:
+            r.execute_command('DEL', 'tester')
+            # small chunks, so that ranges span whole chunks
+            r.execute_command('TS.CREATE', 'tester', encoding, 'CHUNK_SIZE', 128)
+            samples = [[ts, str(ts % 13).encode()] for ts in range(1, 3000, 3)]
+            for ts, value in samples:
+                r.execute_command('TS.ADD', 'tester', ts, value)
+
+            for start, end in [(100, 200), (1000, 2000), (0, 5), (2990, 2999), (500, 500), (4000, 5000)]:
+                expected = [sample for sample in samples if not start <= sample[0] <= end]
+                assert r.execute_command('TS.DEL', 'tester', start, end) == len(samples) - len(expected)
+                samples = expected
+                assert r.execute_command('TS.RANGE', 'tester', '-', '+') == [[ts, value] for ts, value in samples]
+                assert _get_ts_info(r, 'tester').total_samples == len(samples)
+            assert r.execute_command('TS.GET', 'tester') == samples[-1]
+
+            # the series remains writable
+            assert r.execute_command('TS.ADD', 'tester', 2992, 7) == 2992
+            assert r.execute_command('TS.ADD', 'tester', 1500, 7) == 1500
+            assert r.execute_command('TS.RANGE', 'tester', 1500, 1500) == [[1500, b'7']]
+            assert r.execute_command('TS.DEL', 'tester', '-', '+') == len(samples) + 2
+            assert r.execute_command('TS.RANGE', 'tester', '-', '+') == []
+            assert r.execute_command('TS.ADD', 'tester', 10, 1) == 10
+            assert r.execute_command('TS.RANGE', 'tester', '-', '+') == [[10, b'1']]
+
+
+def test_del_compaction():
+    with Env().getConnection() as r:
+        r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', 128)
+        for agg in ['sum', 'max', 'avg', 'count', 'last']:
+            r.execute_command('TS.CREATE', 'tester_' + agg)
+            r.execute_command('TS.CREATERULE', 'tester', 'tester_' + agg, 'AGGREGATION', agg, 100)
+        for ts in range(1, 3000, 7):
+            r.execute_command('TS.ADD', 'tester', ts, ts % 11)
+
+        # the buckets at both ends are aggregated again, the ones within the range are deleted
+        assert r.execute_command('TS.DEL', 'tester', 450, 1250) > 0
+        for agg in ['sum', 'max', 'avg', 'count', 'last']:
+            expected = r.execute_command('TS.RANGE', 'tester', 0, 2899, 'AGGREGATION', agg, 100)
+            assert r.execute_command('TS.RANGE', 'tester_' + agg, '-', '+') == expected
+
+        # deleting the last samples opens the bucket of the new last sample again
+        assert r.execute_command('TS.DEL', 'tester', 2250, '+') > 0
+        r.execute_command('TS.ADD', 'tester', 2260, 5)
+        r.execute_command('TS.ADD', 'tester', 2400, 5)
+        for agg in ['sum', 'max', 'avg', 'count', 'last']:
+            expected = r.execute_command('TS.RANGE', 'tester', 0, 2299, 'AGGREGATION', agg, 100)
+            assert r.execute_command('TS.RANGE', 'tester_' + agg, '-', '+') == expected
+
+
+def test_del_errors():
+    with Env().getConnection() as r:
+        r.execute_command('TS.CREATE', 'tester')
+        r.execute_command('SET', 'string', 'value')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.DEL', 'tester', 1)
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.DEL', 'tester', 'a', 10)
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.DEL', 'missing', 1, 10)
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.DEL', 'string', 1, 10)
+        assert r.execute_command('TS.DEL', 'tester', 10, 1) == 0
@@ -74,3 +74,39 @@ def test_partial_madd():
         assert len(r.execute_command('ts.range', 'test_key1', "-", "+")) == 2
         assert len(r.execute_command('ts.range', 'test_key2', "-", "+")) == 2
         assert len(r.execute_command('ts.range', 'test_key3', "-", "+")) == 2
+
+
+def test_madd_large_batch():
+    replies, ranges = [], []
+    for module_args in ['', 'WORKER_THREADS 2']:
+        env = Env(moduleArgs=module_args)
+        with env.getConnection() as r:
+            r.execute_command('FLUSHALL')
+            for i in range(4):
+                r.execute_command('TS.CREATE', 'batch{}'.format(i))
+            r.execute_command('SET', 'not_series', 'x')
+            args = []
+            for ts in range(1, 1501):
+                args += ['batch{}'.format(ts % 4), ts, ts]
+            args[3 * 10 + 2] = 'nan_value'
+            args[3 * 20 + 1] = 'bad_ts'
+            args[3 * 30] = 'missing'
+            args[3 * 40] = 'not_series'
+            # out of order within a key, after a sample of the same key
+            args[3 * 50 + 1] = 2
+            reply = r.execute_command('TS.MADD', *args)
+            assert len(reply) == 1500
+            assert isinstance(reply[10], Exception) and isinstance(reply[20], Exception)
+            assert isinstance(reply[30], Exception) and isinstance(reply[40], Exception)
+            assert reply[0] == 1 and reply[1499] == 1500
+            replies.append([str(item) for item in reply])
+            ranges.append([r.execute_command('TS.RANGE', 'batch{}'.format(i), '-', '+')
+                           for i in range(4)])
+
+            now = int(time.time() * 1000)
+            reply = r.execute_command('TS.MADD', *(['batch0', '*', 1] * 1100))
+            assert len(reply) == 1100 and reply[0] >= now
+            for i in range(1, 1100):
+                assert isinstance(reply[i], Exception) or reply[i] >= reply[i - 1]
+    assert replies[0] == replies[1]
+    assert ranges[0] == ranges[1]
@@ -84,3 +84,31 @@ def test_mget_cmd():
             assert r.execute_command('TS.MGET filter k+1')
         with pytest.raises(redis.ResponseError) as excinfo:
             assert r.execute_command('TS.MGET retlif k!=5')
+
+
+def test_mget_after_key_changes():
+    with Env().getConnection() as r:
+        r.execute_command('TS.ADD', 'm1', 10, 1, 'LABELS', 'group', 'changes')
+        r.execute_command('TS.ADD', 'm2', 10, 2, 'LABELS', 'group', 'changes')
+        # populate the index before the keys change
+        assert r.execute_command('TS.MGET', 'FILTER', 'group=changes') == \
+               [[b'm1', [], [10, b'1']], [b'm2', [], [10, b'2']]]
+
+        r.execute_command('TS.ADD', 'm1', 20, 3)
+        r.execute_command('RENAME', 'm2', 'm3')
+        assert r.execute_command('TS.MGET', 'FILTER', 'group=changes') == \
+               [[b'm1', [], [20, b'3']], [b'm3', [], [10, b'2']]]
+
+        r.execute_command('DEL', 'm1')
+        r.execute_command('TS.ADD', 'm1', 5, 4, 'LABELS', 'group', 'changes')
+        r.execute_command('TS.ALTER', 'm3', 'LABELS', 'group', 'changes', 'altered', 'yes')
+        assert r.execute_command('TS.MGET', 'WITHLABELS', 'FILTER', 'group=changes') == \
+               [[b'm1', [[b'group', b'changes']], [5, b'4']],
+                [b'm3', [[b'group', b'changes'], [b'altered', b'yes']], [10, b'2']]]
+
+        r.execute_command('PEXPIRE', 'm1', 1)
+        time.sleep(0.01)
+        assert r.execute_command('TS.MGET', 'FILTER', 'group=changes') == [[b'm3', [], [10, b'2']]]
+
+        r.execute_command('FLUSHALL')
+        assert r.execute_command('TS.MGET', 'FILTER', 'group=changes') == []
@@ -1,5 +1,6 @@
 import pytest
 import redis
+import threading
 import time
 from RLTest import Env
 from test_helper_classes import _insert_data
@@ -159,3 +160,245 @@ def test_multilabel_filter():
 
         actual_result = r.execute_command('TS.mget', 'WITHLABELS', 'FILTER', 'name=(bob,rudy)', 'class!=(middle,top)')
         assert actual_result[0][0] == b'tester2'
+
+
+def test_mrange_worker_threads():
+    # the same queries must give the same replies with the scans running on worker threads
+    queries = [['-', '+', 'FILTER', 'generation=x'],
+               ['-', '+', 'WITHLABELS', 'FILTER', 'generation=x', 'class!=middle'],
+               [10, 900, 'COUNT', 7, 'FILTER', 'generation=x'],
+               ['-', '+', 'AGGREGATION', 'avg', 37, 'FILTER', 'generation=x'],
+               ['-', '+', 'COUNT', 3, 'AGGREGATION', 'max', 100, 'WITHLABELS', 'FILTER', 'generation=x'],
+               ['-', '+', 'AGGREGATION', 'sum', 50, 'FILTER', 'generation=x', 'GROUPBY', 'class', 'REDUCE', 'max']]
+    replies = {}
+    for args in ['', 'WORKER_THREADS 3']:
+        env = Env(moduleArgs=args)
+        with env.getConnection() as r:
+            r.execute_command('FLUSHALL')
+            for i in range(50):
+                r.execute_command('TS.CREATE', 'tester{}'.format(i), 'CHUNK_SIZE', 128,
+                                  'LABELS', 'generation', 'x', 'class', ['top', 'middle', 'bottom'][i % 3])
+                for ts in range(1, 1000, 1 + i % 5):
+                    r.execute_command('TS.ADD', 'tester{}'.format(i), ts, (ts * i) % 97)
+            result = []
+            for query in queries:
+                result.append(r.execute_command('TS.MRANGE', *query))
+                result.append(r.execute_command('TS.MREVRANGE', *query))
+            # blocking is not allowed inside MULTI, the query runs on the main thread
+            p = r.pipeline(transaction=True)
+            p.execute_command('TS.MRANGE', *queries[1])
+            result.append(p.execute()[0])
+            replies[args] = result
+    assert replies[''] == replies['WORKER_THREADS 3']
+
+
+def test_mrange_snapshots_while_writing():
+    env = Env(moduleArgs='WORKER_THREADS 2')
+    with env.getConnection() as r:
+        r.execute_command('FLUSHALL')
+        for i in range(10):
+            r.execute_command('TS.CREATE', 'tester{}'.format(i), 'CHUNK_SIZE', 128, 'RETENTION', 3000,
+                              'DUPLICATE_POLICY', 'LAST', 'LABELS', 'name', 'snapshot')
+            for ts in range(0, 2000, 2):
+                r.execute_command('TS.ADD', 'tester{}'.format(i), ts, ts)
+
+        done = threading.Event()
+        errors = []
+
+        def query():
+            with env.getConnection() as reader:
+                while not done.is_set():
+                    try:
+                        reply = reader.execute_command('TS.MRANGE', '-', '+', 'AGGREGATION', 'count', 100,
+                                                       'FILTER', 'name=snapshot')
+                        assert len(reply) == 10
+                    except Exception as e:
+                        errors.append(e)
+                        return
+
+        reader = threading.Thread(target=query)
+        reader.start()
+        # the sealed chunks the queries read are upserted into, deleted and trimmed meanwhile
+        for ts in range(1, 2000, 10):
+            for i in range(10):
+                r.execute_command('TS.ADD', 'tester{}'.format(i), ts, -ts)
+        for i in range(0, 10, 2):
+            r.execute_command('TS.DEL', 'tester{}'.format(i), 500, 900)
+        for ts in range(2000, 6000, 2):
+            r.execute_command('TS.ADD', 'tester{}'.format(ts % 10), ts, ts)
+        done.set()
+        reader.join()
+        assert errors == []
+
+        # inside MULTI the query runs on the main thread
+        p = r.pipeline(transaction=True)
+        p.execute_command('TS.MRANGE', '-', '+', 'FILTER', 'name=snapshot')
+        assert r.execute_command('TS.MRANGE', '-', '+', 'FILTER', 'name=snapshot') == p.execute()[0]
+        assert r.info('timeseries_memory')['timeseries_retired_chunks'] == 0
+
+def test_mrange_groupby():
+    env = Env()
+    with env.getConnection() as r:
+        samples = {}
+        for i in range(6):
+            key = 'series{}'.format(i)
+            labels = ['team', ['a', 'b'][i % 2]] if i < 5 else ['other', 'x']
+            r.execute_command('TS.CREATE', key, 'LABELS', 'all', 1, *labels)
+            samples[key] = {}
+            for ts in range(i, 100, 1 + i):
+                r.execute_command('TS.ADD', key, ts, ts * (i + 1))
+                samples[key][ts] = ts * (i + 1)
+
+        def expected(keys, reduce, rev=False):
+            timestamps = sorted(set(ts for key in keys for ts in samples[key]), reverse=rev)
+            return [[ts, str(reduce([samples[key][ts] for key in keys if ts in samples[key]])).encode()]
+                    for ts in timestamps]
+
+        reply = r.execute_command('TS.MRANGE', '-', '+', 'FILTER', 'all=1', 'GROUPBY', 'team', 'REDUCE', 'sum')
+        assert reply == [[b'team=a', [[b'team', b'a'], [b'__reducer__', b'sum'],
+                                      [b'__source__', b'series0,series2,series4']],
+                          expected(['series0', 'series2', 'series4'], sum)],
+                         [b'team=b', [[b'team', b'b'], [b'__reducer__', b'sum'],
+                                      [b'__source__', b'series1,series3']],
+                          expected(['series1', 'series3'], sum)]]
+
+        reply = r.execute_command('TS.MREVRANGE', '-', '+', 'FILTER', 'all=1', 'GROUPBY', 'team', 'REDUCE', 'max')
+        assert reply[1][2] == expected(['series1', 'series3'], max, rev=True)
+        reply = r.execute_command('TS.MRANGE', 10, 20, 'FILTER', 'all=1', 'GROUPBY', 'other', 'REDUCE', 'min')
+        assert reply == [[b'other=x', [[b'other', b'x'], [b'__reducer__', b'min'], [b'__source__', b'series5']],
+                          [[ts, str(v).encode()] for ts, v in sorted(samples['series5'].items()) if 10 <= ts <= 20]]]
+        assert r.execute_command('TS.MRANGE', '-', '+', 'FILTER', 'all=1', 'GROUPBY', 'none', 'REDUCE', 'max') == []
+
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.MRANGE', '-', '+', 'FILTER', 'all=1', 'GROUPBY', 'team')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.MRANGE', '-', '+', 'FILTER', 'all=1', 'GROUPBY', 'team', 'REDUCE', 'bad')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.MRANGE', '-', '+', 'GROUPBY', 'team', 'REDUCE', 'max', 'FILTER', 'all=1')
+
+
+def test_mrange_cursor():
+    for args in ['', 'WORKER_THREADS 2']:
+        env = Env(moduleArgs=args)
+        with env.getConnection() as r:
+            r.execute_command('FLUSHALL')
+            for i in range(25):
+                r.execute_command('TS.CREATE', 'tester{}'.format(i), 'LABELS', 'name', 'cursor', 'id', i)
+                for ts in range(1, 100, 1 + i % 3):
+                    r.execute_command('TS.ADD', 'tester{}'.format(i), ts, ts * i)
+
+            for cmd in ['TS.MRANGE', 'TS.MREVRANGE']:
+                expected = r.execute_command(cmd, 10, 90, 'COUNT', 20, 'WITHLABELS', 'FILTER', 'name=cursor')
+                pages = []
+                cursor = 0
+                while True:
+                    cursor, page = r.execute_command(cmd, 10, 90, 'COUNT', 20, 'WITHLABELS',
+                                                     'CURSOR', cursor, 'LIMIT', 10, 'FILTER', 'name=cursor')
+                    pages.append(page)
+                    if cursor == 0:
+                        break
+                assert [len(page) for page in pages] == [10, 10, 5]
+                assert [series for page in pages for series in page] == expected
+
+            # the series deleted after the first page are left out of the next ones
+            cursor, page = r.execute_command('TS.MRANGE', '-', '+', 'CURSOR', 0, 'LIMIT', 20, 'FILTER', 'name=cursor')
+            assert len(page) == 20
+            rest = sorted(set(r.execute_command('TS.QUERYINDEX', 'name=cursor')) - set(s[0] for s in page))
+            r.execute_command('DEL', rest[0])
+            last_cursor, page = r.execute_command('TS.MRANGE', '-', '+', 'CURSOR', cursor, 'FILTER', 'name=cursor')
+            assert last_cursor == 0
+            assert sorted(s[0] for s in page) == rest[1:]
+            assert r.execute_command('TS.MRANGE', '-', '+', 'CURSOR', 0, 'FILTER', 'name=none') == [0, []]
+
+            # a cursor is used once
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.MRANGE', '-', '+', 'CURSOR', cursor, 'FILTER', 'name=cursor')
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.MRANGE', '-', '+', 'LIMIT', 10, 'FILTER', 'name=cursor')
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.MRANGE', '-', '+', 'CURSOR', 0, 'LIMIT', 0, 'FILTER', 'name=cursor')
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.MRANGE', '-', '+', 'CURSOR', -1, 'FILTER', 'name=cursor')
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.MRANGE', '-', '+', 'CURSOR', 0, 'FILTER', 'name=cursor',
+                                  'GROUPBY', 'id', 'REDUCE', 'max')
+
+
+def test_query_cache():
+    # the replies must not change with the query cache, whatever changed in between
+    queries = [['TS.MRANGE', '-', '+', 'FILTER', 'name=cache'],
+               ['TS.MRANGE', 20, '+', 'COUNT', 30, 'WITHLABELS', 'FILTER', 'name=cache'],
+               ['ts.mrange', '-', '+', 'aggregation', 'AVG', 10, 'FILTER', 'name=cache'],
+               ['TS.MRANGE', '-', 500, 'AGGREGATION', 'max', 7, 'COUNT', 5, 'FILTER', 'name=cache'],
+               ['TS.MREVRANGE', '-', '+', 'COUNT', 10, 'FILTER', 'name=cache'],
+               ['TS.MRANGE', '-', '+', 'AGGREGATION', 'sum', 10, 'FILTER', 'name=cache',
+                'GROUPBY', 'class', 'REDUCE', 'max'],
+               ['TS.MGET', 'WITHLABELS', 'FILTER', 'name=cache']]
+    changes = [['TS.ADD', 'tester0', 200, 1],
+               ['TS.MADD', 'tester1', 200, 2, 'tester1', 201, 3, 'tester2', 205, 4],
+               ['TS.ADD', 'tester1', 201, 7, 'ON_DUPLICATE', 'LAST'],
+               ['TS.ADD', 'tester2', 50, 8, 'ON_DUPLICATE', 'LAST'],
+               ['TS.CREATE', 'tester4', 'LABELS', 'name', 'cache', 'class', 'b'],
+               ['TS.ADD', 'tester4', 10, 1],
+               ['TS.ALTER', 'tester3', 'LABELS', 'name', 'cache', 'class', 'c'],
+               ['DEL', 'tester0'],
+               ['TS.ADD', 'tester5', 300, 1, 'RETENTION', 100, 'LABELS', 'name', 'cache'],
+               ['TS.ADD', 'tester5', 450, 2],
+               ['RENAME', 'tester2', 'tester6']]
+    replies = {}
+    for args in ['', 'QUERY_CACHE 4', 'QUERY_CACHE 4 WORKER_THREADS 2']:
+        env = Env(moduleArgs=args)
+        with env.getConnection() as r:
+            r.execute_command('FLUSHALL')
+            for i in range(4):
+                r.execute_command('TS.CREATE', 'tester{}'.format(i), 'CHUNK_SIZE', 128,
+                                  'LABELS', 'name', 'cache', 'class', ['a', 'b'][i % 2])
+                for ts in range(1, 150, 1 + i):
+                    r.execute_command('TS.ADD', 'tester{}'.format(i), ts, ts * i)
+            result = []
+            for change in [None] + changes:
+                if change is not None:
+                    r.execute_command(*change)
+                for query in queries:
+                    result.append(r.execute_command(*query))
+                    result.append(r.execute_command(*query))
+            replies[args] = result
+            if args:
+                info = r.info('timeseries_query_cache')
+                assert info['timeseries_query_cache_hits'] > len(changes) * len(queries)
+                assert info['timeseries_query_cache_entries'] == 4
+    assert replies[''] == replies['QUERY_CACHE 4']
+    assert replies[''] == replies['QUERY_CACHE 4 WORKER_THREADS 2']
+
+
+def test_mrange_budgets():
+    with Env().getConnection() as r:
+        for i in range(4):
+            r.execute_command('TS.CREATE', 'budget{}'.format(i), 'LABELS', 'name', 'budget')
+            for ts in range(1, 101):
+                r.execute_command('TS.ADD', 'budget{}'.format(i), ts, ts)
+
+        assert len(r.execute_command('TS.MRANGE', '-', '+', 'MAX_SERIES', 4, 'MAX_SAMPLES', 400,
+                                     'TIMEOUT', 10000, 'FILTER', 'name=budget')) == 4
+        with pytest.raises(redis.ResponseError, match='MAX_SERIES'):
+            r.execute_command('TS.MRANGE', '-', '+', 'MAX_SERIES', 3, 'FILTER', 'name=budget')
+        with pytest.raises(redis.ResponseError, match='MAX_SAMPLES'):
+            r.execute_command('TS.MREVRANGE', '-', '+', 'MAX_SAMPLES', 399, 'FILTER', 'name=budget')
+        with pytest.raises(redis.ResponseError, match='MAX_SAMPLES'):
+            r.execute_command('TS.MRANGE', '-', '+', 'AGGREGATION', 'avg', 10, 'MAX_SAMPLES', 100,
+                              'FILTER', 'name=budget', 'GROUPBY', 'name', 'REDUCE', 'max')
+        # the samples are charged for the range read, and COUNT bounds the samples read
+        assert len(r.execute_command('TS.MRANGE', 1, 10, 'MAX_SAMPLES', 400,
+                                     'FILTER', 'name=budget')) == 4
+        assert len(r.execute_command('TS.MRANGE', '-', '+', 'COUNT', 10, 'MAX_SAMPLES', 40,
+                                     'FILTER', 'name=budget')) == 4
+        # a page of a cursor is a query of its own
+        cursor, page = r.execute_command('TS.MRANGE', '-', '+', 'CURSOR', 0, 'LIMIT', 2,
+                                         'MAX_SERIES', 2, 'FILTER', 'name=budget')
+        assert len(page) == 2 and cursor > 0
+
+        assert len(r.execute_command('TS.RANGE', 'budget0', '-', '+', 'MAX_SAMPLES', 100)) == 100
+        with pytest.raises(redis.ResponseError, match='MAX_SAMPLES'):
+            r.execute_command('TS.RANGE', 'budget0', '-', '+', 'MAX_SAMPLES', 99)
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.MRANGE', '-', '+', 'TIMEOUT', -1, 'FILTER', 'name=budget')
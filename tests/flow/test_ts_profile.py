@@ -0,0 +1,71 @@
+from RLTest import Env
+
+
+def stage_names(profile):
+    return [stage[0] for stage in profile]
+
+
+def test_mrange_profile():
+    with Env().getConnection() as r:
+        for i in range(3):
+            r.execute_command('TS.CREATE', 'profile{}'.format(i), 'LABELS', 'name', 'profile')
+            for ts in range(1, 11):
+                r.execute_command('TS.ADD', 'profile{}'.format(i), ts, ts * i)
+
+        expected = r.execute_command('TS.MRANGE', '-', '+', 'FILTER', 'name=profile')
+        reply, profile = r.execute_command('TS.MRANGE', '-', '+', 'PROFILE',
+                                           'FILTER', 'name=profile')
+        assert sorted(reply) == sorted(expected)
+        assert stage_names(profile) == [b'total', b'query_index', b'key_lookup', b'series_read',
+                                        b'reply']
+        calls = {stage[0]: stage[1] for stage in profile}
+        assert calls[b'query_index'] == 1
+        assert calls[b'key_lookup'] == 3
+        assert calls[b'series_read'] == 3
+        for stage in profile:
+            assert float(stage[2]) >= 0
+
+        expected = r.execute_command('TS.MREVRANGE', '-', '+', 'AGGREGATION', 'sum', 5,
+                                     'FILTER', 'name=profile', 'GROUPBY', 'name', 'REDUCE', 'max')
+        reply, profile = r.execute_command('TS.MREVRANGE', '-', '+', 'AGGREGATION', 'sum', 5,
+                                           'PROFILE', 'FILTER', 'name=profile',
+                                           'GROUPBY', 'name', 'REDUCE', 'max')
+        assert reply == expected
+        assert b'reply' in stage_names(profile)
+
+
+def test_mget_profile():
+    with Env().getConnection() as r:
+        r.execute_command('TS.ADD', 'mget1', 1, 1, 'LABELS', 'name', 'mget')
+        r.execute_command('TS.ADD', 'mget2', 2, 2, 'LABELS', 'name', 'mget')
+
+        expected = r.execute_command('TS.MGET', 'FILTER', 'name=mget')
+        reply, profile = r.execute_command('TS.MGET', 'PROFILE', 'FILTER', 'name=mget')
+        assert sorted(reply) == sorted(expected)
+        assert stage_names(profile)[0] == b'total'
+        assert b'query_index' in stage_names(profile)
+        assert {stage[0]: stage[1] for stage in profile}[b'reply'] == 2
+
+
+def test_info_stages():
+    with Env().getConnection() as r:
+        r.execute_command('TS.CREATE', 'stages', 'LABELS', 'name', 'stages')
+        r.execute_command('TS.CREATE', 'stages_dest')
+        r.execute_command('TS.CREATERULE', 'stages', 'stages_dest', 'AGGREGATION', 'max', 10)
+        for ts in range(1, 201):
+            r.execute_command('TS.ADD', 'stages', ts, ts)
+        r.execute_command('TS.ADD', 'stages', 100, 0, 'ON_DUPLICATE', 'LAST')
+        r.execute_command('TS.MRANGE', '-', '+', 'FILTER', 'name=stages')
+
+        info = r.info('timeseries_stages')
+        add = info['timeseries_add_sample']
+        assert add['calls'] >= 200
+        # 1 in 64 of the ingestion calls is timed
+        assert 0 < add['timed'] < add['calls']
+        assert add['p50_ns'] <= add['p99_ns'] <= add['p999_ns']
+        assert info['timeseries_upsert_sample']['calls'] >= 1
+        assert info['timeseries_compaction']['calls'] >= 200
+        query = info['timeseries_query_index']
+        assert query['calls'] >= 1 and query['timed'] == query['calls']
+        histogram = info['timeseries_query_index_histogram']
+        assert sum(histogram.values()) == query['timed']
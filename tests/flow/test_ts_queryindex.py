@@ -37,3 +37,112 @@ def test_label_index():
             assert r.execute_command('TS.QUERYINDEX', 'generation=x', 'class=(ab')
         with pytest.raises(redis.ResponseError):
             assert r.execute_command('TS.QUERYINDEX', 'generation!=(x,y)')
+
+
+def test_label_index_churn():
+    with Env().getConnection() as r:
+        for i in range(100):
+            r.execute_command('TS.CREATE', 'churn{}'.format(i), 'LABELS', 'region', 'us' if i % 2 else 'eu',
+                              'hostname', 'h{}'.format(i % 7), 'shard', str(i % 3))
+        expected = sorted('churn{}'.format(i).encode() for i in range(100) if i % 2 and i % 7 != 3)
+        assert expected == r.execute_command('TS.QUERYINDEX', 'region=us', 'hostname!=h3')
+
+        # deleted, recreated and altered series keep the result consistent and ordered by name
+        for i in range(0, 100, 5):
+            r.execute_command('DEL', 'churn{}'.format(i))
+        for i in range(0, 100, 10):
+            r.execute_command('TS.CREATE', 'churn{}'.format(i), 'LABELS', 'region', 'us', 'hostname', 'h3')
+        r.execute_command('TS.ALTER', 'churn1', 'LABELS', 'region', 'eu')
+
+        alive = [i for i in range(100) if i % 5 != 0]
+        expected = sorted('churn{}'.format(i).encode() for i in alive if i % 2 and i % 7 != 3 and i != 1)
+        assert expected == r.execute_command('TS.QUERYINDEX', 'region=us', 'hostname!=h3')
+        expected = sorted('churn{}'.format(i).encode() for i in range(0, 100, 10))
+        assert expected == r.execute_command('TS.QUERYINDEX', 'region=us', 'hostname=h3', 'shard=')
+        assert r.execute_command('TS.QUERYINDEX', 'region=(us,eu)', 'shard=(0,1,2)') == \
+               sorted('churn{}'.format(i).encode() for i in alive)
+
+
+def test_label_index_prefix_and_regex():
+    with Env().getConnection() as r:
+        for name, host in [('s1', 'web-1'), ('s2', 'web-2'), ('s3', 'web-10'), ('s4', 'db-1'), ('s5', 'webster')]:
+            r.execute_command('TS.CREATE', name, 'LABELS', 'host', host, 'dc', 'east' if name != 's2' else 'west')
+        r.execute_command('TS.CREATE', 's6', 'LABELS', 'dc', 'east')
+
+        assert [b's1', b's2', b's3'] == r.execute_command('TS.QUERYINDEX', 'host^=web-')
+        assert [b's1', b's3'] == r.execute_command('TS.QUERYINDEX', 'host^=web-', 'dc=east')
+        assert [b's1', b's2', b's3', b's5'] == r.execute_command('TS.QUERYINDEX', 'host^=web')
+        assert [] == r.execute_command('TS.QUERYINDEX', 'host^=x')
+
+        # the pattern has to match the whole value
+        assert [b's1', b's2'] == r.execute_command('TS.QUERYINDEX', 'host=~web-[0-9]')
+        assert [b's1', b's4'] == r.execute_command('TS.QUERYINDEX', 'host=~(web|db)-1')
+        assert [b's1', b's2', b's3'] == r.execute_command('TS.QUERYINDEX', 'host=~web-.*', 'host!=webster')
+        assert [b's3'] == r.execute_command('TS.QUERYINDEX', 'host=~.*-1[0-9]*', 'dc=east', 'host!=(web-1,db-1)')
+        assert [b's1', b's2', b's3', b's4', b's5'] == r.execute_command('TS.QUERYINDEX', 'host=~.*')
+
+        assert r.execute_command('TS.MGET', 'FILTER', 'host=~web-1.*') == [[b's1', [], []], [b's3', [], []]]
+        assert len(r.execute_command('TS.MRANGE', '-', '+', 'FILTER', 'host^=web')) == 4
+
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.QUERYINDEX', 'host=~web-(')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.QUERYINDEX', 'host^=')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.QUERYINDEX', '=~web')
+
+
+def test_label_index_predicate_order():
+    with Env().getConnection() as r:
+        for i in range(300):
+            r.execute_command('TS.CREATE', 'order{}'.format(i), 'LABELS', 'all', 'yes', 'mod', i % 50,
+                              'host', 'h{}'.format(i % 7), 'rare' if i % 100 == 0 else 'common', 'x')
+
+        filters = ['all=yes', 'mod=(1,2,3,4,5,6,7,8,9,10,11,12)', 'host!=(h1,h2)', 'host=~h[0-4]', 'common!=']
+        expected = sorted('order{}'.format(i).encode() for i in range(300)
+                          if 1 <= i % 50 <= 12 and i % 7 not in (1, 2) and i % 7 <= 4 and i % 100 != 0)
+        # the reply does not depend on the order the predicates are given in
+        for shift in range(len(filters)):
+            query = filters[shift:] + filters[:shift]
+            assert expected == r.execute_command('TS.QUERYINDEX', *query)
+            assert expected == r.execute_command('TS.QUERYINDEX', *reversed(query))
+
+        assert [b'order0', b'order100', b'order200'] == \
+               r.execute_command('TS.QUERYINDEX', 'all=yes', 'host!=h5', 'rare=x', 'mod=(0,1)')
+        assert [] == r.execute_command('TS.QUERYINDEX', 'host=~h.*', 'rare=x', 'mod=1')
+        assert [] == r.execute_command('TS.QUERYINDEX', 'all=yes', 'missing=x', 'host=~h.*')
+
+
+def test_label_names_and_values():
+    with Env().getConnection() as r:
+        r.execute_command('TS.CREATE', 'enum1', 'LABELS', 'region', 'eu', 'host', 'h1')
+        r.execute_command('TS.CREATE', 'enum2', 'LABELS', 'region', 'us', 'host', 'h2')
+        r.execute_command('TS.CREATE', 'enum3', 'LABELS', 'region', 'us', 'host', 'h3', 'rack', 'r1')
+        r.execute_command('TS.CREATE', 'enum4', 'LABELS', 'env', 'dev')
+
+        assert [[b'env', 1], [b'host', 3], [b'rack', 1], [b'region', 3]] == \
+            r.execute_command('TS.LABELNAMES')
+        assert [[b'host', 2], [b'rack', 1], [b'region', 2]] == \
+            r.execute_command('TS.LABELNAMES', 'FILTER', 'region=us')
+        assert [[b'eu', 1], [b'us', 2]] == r.execute_command('TS.LABELVALUES', 'region')
+        assert [[b'us', 1]] == r.execute_command('TS.LABELVALUES', 'region', 'FILTER', 'rack=r1')
+        assert [[b'h1', 1], [b'h2', 1]] == \
+            r.execute_command('TS.LABELVALUES', 'host', 'FILTER', 'region=(eu,us)', 'rack=')
+        assert [] == r.execute_command('TS.LABELVALUES', 'region', 'FILTER', 'env=dev')
+        assert [] == r.execute_command('TS.LABELVALUES', 'missing')
+
+        # the counts follow deleted and altered series
+        r.execute_command('DEL', 'enum2')
+        r.execute_command('TS.ALTER', 'enum1', 'LABELS', 'region', 'us')
+        assert [[b'us', 2]] == r.execute_command('TS.LABELVALUES', 'region')
+        assert [[b'h1', 1], [b'h3', 1]] == r.execute_command('TS.LABELVALUES', 'host')
+        assert [[b'env', 1], [b'rack', 1], [b'region', 2]] == r.execute_command('TS.LABELNAMES')
+
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.LABELVALUES')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.LABELNAMES', 'FILTER')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.LABELNAMES', 'region=us')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.LABELVALUES', 'region', 'FILTER', 'rack!=r1')
@@ -1,4 +1,5 @@
 import math
+import struct
 
 import pytest
 import redis
@@ -170,6 +171,33 @@ def test_agg_range():
         assert expected_result == actual_result
 
 
+
+def test_agg_quantiles():
+    values = (31, 41, 59, 26, 53, 58, 97, 93, 23, 84)
+    with Env().getConnection() as r:
+        for agg_type, quantile in [('p50', 0.5), ('p90', 0.9), ('p95', 0.95), ('p99', 0.99), ('p99.9', 0.999)]:
+            agg_key = _insert_agg_data(r, 'tester_' + agg_type, agg_type)
+            ranges = [r.execute_command('TS.RANGE', agg_key, 10, 50),
+                      r.execute_command('TS.RANGE', 'tester_' + agg_type, 10, 49, 'AGGREGATION', agg_type, 10)]
+            for actual_result in ranges:
+                assert [ts for ts, _ in actual_result] == [10, 20, 30, 40]
+                for ts, value in actual_result:
+                    bucket = sorted(ts // 10 * 100 + v for v in values)
+                    expected = bucket[int(quantile * (len(bucket) - 1))]
+                    # within the accuracy of the sketch
+                    assert abs(float(value) - expected) <= 0.01 * expected
+
+        # an upsert into the open bucket removes the replaced value from its sketch
+        assert r.execute_command('TS.CREATE', 'latency', 'DUPLICATE_POLICY', 'LAST')
+        assert r.execute_command('TS.CREATE', 'latency_p50')
+        assert r.execute_command('TS.CREATERULE', 'latency', 'latency_p50', 'AGGREGATION', 'P50', 100)
+        for ts, value in enumerate([5, 1, 200, 7, 3, 300]):
+            r.execute_command('TS.ADD', 'latency', ts, value)
+        r.execute_command('TS.ADD', 'latency', 2, 6)
+        r.execute_command('TS.ADD', 'latency', 100, 0)
+        assert abs(float(r.execute_command('TS.GET', 'latency_p50')[1]) - 5) <= 0.05
+        assert _get_ts_info(r, 'latency').rules == [[b'latency_p50', 100, b'P50']]
+
 def test_range_count():
     start_ts = 1511885908
     samples_count = 50
@@ -245,7 +273,7 @@ def test_sanity():
         actual_result = r.execute_command('TS.range', 'tester', start_ts, start_ts + samples_count)
         assert expected_result == actual_result
         expected_result = [
-            b'totalSamples', 1500, b'memoryUsage', 1166,
+            b'totalSamples', 1500, b'memoryUsage', 2030,
             b'firstTimestamp', start_ts, b'chunkCount', 1,
             b'labels', [[b'name', b'brown'], [b'color', b'pink']],
             b'lastTimestamp', start_ts + samples_count - 1,
@@ -282,3 +310,268 @@ def test_issue358():
         range_res = r.execute_command('ts.range issue358', 1582848000, -1)[0][1]
         get_res = r.execute_command('ts.get issue358')[1]
         assert range_res == get_res
+
+
+def test_agg_whole_chunks():
+    # buckets spanning several chunks are aggregated from the chunk summaries
+    with Env().getConnection() as r:
+        for key, args in [('compressed', []), ('uncompressed', ['UNCOMPRESSED'])]:
+            assert r.execute_command('TS.CREATE', key, 'CHUNK_SIZE', 128, *args)
+            samples = [(ts, (ts * 7) % 101 - 50) for ts in range(1, 5000, 3)]
+            for ts, value in samples:
+                r.execute_command('TS.ADD', key, ts, value)
+            # out of order samples leave stale summaries behind
+            r.execute_command('TS.ADD', key, 1000, 1000, 'ON_DUPLICATE', 'LAST')
+            r.execute_command('TS.ADD', key, 2500, -1000, 'ON_DUPLICATE', 'LAST')
+            samples = sorted([s for s in samples if s[0] not in (1000, 2500)] + [(1000, 1000), (2500, -1000)])
+
+            for agg, reduce in [('count', len), ('sum', sum), ('min', min), ('max', max),
+                                ('first', lambda v: v[0]), ('last', lambda v: v[-1]),
+                                ('range', lambda v: max(v) - min(v))]:
+                for bucket in [7, 500, 1200, 10000]:
+                    buckets = {}
+                    for ts, value in samples:
+                        if 100 <= ts <= 4800:
+                            buckets.setdefault(ts - ts % bucket, []).append(value)
+                    expected = [[ts, str(reduce(buckets[ts])).encode('ascii')] for ts in sorted(buckets)]
+                    actual_result = r.execute_command('TS.RANGE', key, 100, 4800, 'AGGREGATION', agg, bucket)
+                    assert expected == actual_result
+                    if agg not in ('first', 'last'):
+                        actual_result = r.execute_command('TS.REVRANGE', key, 100, 4800, 'AGGREGATION', agg,
+                                                          bucket)
+                        assert expected[::-1] == actual_result
+
+
+def test_range_bucket_runs():
+    # buckets of varying sizes end anywhere within the batches and the chunks
+    with Env().getConnection() as r:
+        assert r.execute_command('TS.CREATE', 'runs', 'CHUNK_SIZE', 128)
+        samples, ts = [], 0
+        for i in range(3000):
+            ts += 1 + (i * 13) % 17 if i % 300 else 500
+            samples.append((ts, i % 23))
+        for ts, value in samples:
+            r.execute_command('TS.ADD', 'runs', ts, value)
+        start, end = samples[40][0], samples[2900][0]
+        within = [(ts, value) for ts, value in samples if start <= ts <= end]
+
+        expected = [[ts, str(value).encode()] for ts, value in within]
+        assert r.execute_command('TS.RANGE', 'runs', start, end) == expected
+        assert r.execute_command('TS.REVRANGE', 'runs', start, end) == expected[::-1]
+        assert r.execute_command('TS.RANGE', 'runs', start, end, 'COUNT', 1000) == expected[:1000]
+        assert r.execute_command('TS.REVRANGE', 'runs', start, end, 'COUNT', 1000) == \
+               expected[::-1][:1000]
+
+        for bucket in [1, 2, 5, 37, 300, 4000]:
+            buckets = {}
+            for ts, value in within:
+                buckets.setdefault(ts - ts % bucket, []).append(value)
+            for agg, reduce in [('count', len), ('sum', sum)]:
+                expected = [[ts, str(reduce(buckets[ts])).encode()] for ts in sorted(buckets)]
+                assert r.execute_command('TS.RANGE', 'runs', start, end,
+                                         'AGGREGATION', agg, bucket) == expected
+                assert r.execute_command('TS.REVRANGE', 'runs', start, end,
+                                         'AGGREGATION', agg, bucket) == expected[::-1]
+                assert r.execute_command('TS.REVRANGE', 'runs', start, end, 'COUNT', 10,
+                                         'AGGREGATION', agg, bucket) == expected[::-1][:10]
+
+
+def test_range_format_binary():
+    with Env().getConnection() as r:
+        assert r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', '128')
+        for i in range(300):
+            r.execute_command('TS.ADD', 'tester', 1000 + i * 10, i * 0.5)
+
+        for cmd in ['TS.RANGE', 'TS.REVRANGE']:
+            for extra in [[], ['COUNT', 17], ['AGGREGATION', 'avg', 70], ['AGGREGATION', 'max', 70, 'COUNT', 5]]:
+                text = r.execute_command(cmd, 'tester', 1200, 3500, *extra)
+                timestamps, values = r.execute_command(cmd, 'tester', 1200, 3500, *(extra + ['FORMAT', 'BINARY']))
+                assert len(timestamps) == len(values) == 8 * len(text)
+                count = len(text)
+                decoded = list(zip(struct.unpack('<%dq' % count, timestamps), struct.unpack('<%dd' % count, values)))
+                assert decoded == [(ts, float(value)) for ts, value in text]
+            assert r.execute_command(cmd, 'tester', 0, 10, 'FORMAT', 'BINARY') == [b'', b'']
+            assert r.execute_command(cmd, 'tester', 0, 2000, 'FORMAT', 'text') == \
+                   r.execute_command(cmd, 'tester', 0, 2000)
+
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.RANGE', 'tester', 0, 2000, 'FORMAT')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.RANGE', 'tester', 0, 2000, 'FORMAT', 'JSON')
+
+
+def test_multiple_aggregations():
+    with Env().getConnection() as r:
+        r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', 128)
+        for ts in range(1, 2000):
+            r.execute_command('TS.ADD', 'tester', ts, (ts * 7) % 101)
+
+        types = ['min', 'max', 'avg', 'count', 'std.s']
+        for command in ['TS.RANGE', 'TS.REVRANGE']:
+            for args in [[], ['COUNT', 5]]:
+                replies = [r.execute_command(command, 'tester', 10, 1500, *args, 'AGGREGATION', t, 50)
+                           for t in types]
+                multi = r.execute_command(command, 'tester', 10, 1500, *args,
+                                          'AGGREGATION', ','.join(types), 50)
+                assert len(multi) == len(replies[0])
+                for i, bucket in enumerate(multi):
+                    assert bucket == [replies[0][i][0]] + [reply[i][1] for reply in replies]
+
+        # a single type keeps the (timestamp, value) pairs
+        assert r.execute_command('TS.RANGE', 'tester', '-', '+', 'AGGREGATION', 'max', 1000) == \
+               [[0, b'100'], [1000, b'100']]
+
+        for types in ['min,', ',max', 'min,,max', 'min,bad']:
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.RANGE', 'tester', '-', '+', 'AGGREGATION', types, 10)
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.RANGE', 'tester', '-', '+', 'AGGREGATION', 'min,max', 10, 'FORMAT', 'BINARY')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.MRANGE', '-', '+', 'AGGREGATION', 'min,max', 10, 'FILTER', 'a=b')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.CREATERULE', 'tester', 'dest', 'AGGREGATION', 'min,max', 10)
+
+
+def test_range_use_compactions():
+    with Env().getConnection() as r:
+        r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', 128)
+        for agg in ['sum', 'count', 'min', 'max']:
+            r.execute_command('TS.CREATE', 'tester_' + agg)
+            r.execute_command('TS.CREATERULE', 'tester', 'tester_' + agg, 'AGGREGATION', agg, 10)
+        for ts in range(3, 5000):
+            r.execute_command('TS.ADD', 'tester', ts, (ts * 7) % 101)
+
+        for command in ['TS.RANGE', 'TS.REVRANGE']:
+            for agg in ['avg', 'sum', 'count', 'min', 'max', 'std.p']:
+                for bucket in [10, 30, 45]:
+                    for args in [[], ['COUNT', 7]]:
+                        query = [command, 'tester', 5, 4321, *args, 'AGGREGATION', agg, bucket]
+                        assert r.execute_command(*query, 'USE_COMPACTIONS') == \
+                               r.execute_command(*query)
+
+
+def test_range_filter_by_value():
+    with Env().getConnection() as r:
+        r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', 128)
+        samples = [(ts, 1000 if ts % 997 == 0 else ts % 50) for ts in range(1, 5000)]
+        for ts, value in samples:
+            r.execute_command('TS.ADD', 'tester', ts, value)
+
+        spikes = [[ts, str(value).encode()] for ts, value in samples if value >= 500]
+        assert r.execute_command('TS.RANGE', 'tester', '-', '+', 'FILTER_BY_VALUE', 500, 'inf') == spikes
+        assert r.execute_command('TS.REVRANGE', 'tester', '-', '+', 'FILTER_BY_VALUE', 500, 'inf') == \
+               spikes[::-1]
+        assert r.execute_command('TS.RANGE', 'tester', 2000, '+', 'FILTER_BY_VALUE', 500, 2000,
+                                 'COUNT', 1) == [[2991, b'1000']]
+        assert r.execute_command('TS.RANGE', 'tester', '-', '+', 'FILTER_BY_VALUE', 2000, 3000) == []
+
+        # the aggregations see the kept samples only
+        kept = [(ts, value) for ts, value in samples if 10 <= value <= 20]
+        expected = {}
+        for ts, value in kept:
+            expected.setdefault(ts - ts % 1000, []).append(value)
+        assert r.execute_command('TS.RANGE', 'tester', '-', '+', 'FILTER_BY_VALUE', 10, 20,
+                                 'AGGREGATION', 'count', 1000) == \
+               [[bucket, str(len(values)).encode()] for bucket, values in sorted(expected.items())]
+        assert r.execute_command('TS.RANGE', 'tester', '-', '+', 'FILTER_BY_VALUE', 10, 20,
+                                 'AGGREGATION', 'min', 1000)[0] == [0, b'10']
+
+        r.execute_command('TS.CREATE', 'tester_max')
+        r.execute_command('TS.CREATERULE', 'tester', 'tester_max', 'AGGREGATION', 'max', 10)
+        assert r.execute_command('TS.RANGE', 'tester', '-', '+', 'FILTER_BY_VALUE', 0, 49,
+                                 'AGGREGATION', 'max', 1000, 'USE_COMPACTIONS')[1] == [1000, b'49']
+
+        r.execute_command('TS.ADD', 'tester2', 1, 1000, 'LABELS', 'name', 'a')
+        r.execute_command('TS.ADD', 'tester2', 2, 1, 'LABELS', 'name', 'a')
+        assert r.execute_command('TS.MRANGE', '-', '+', 'FILTER_BY_VALUE', 900, 1100,
+                                 'FILTER', 'name=a') == [[b'tester2', [], [[1, b'1000']]]]
+
+        for args in [['FILTER_BY_VALUE', 1], ['FILTER_BY_VALUE', 'a', 2], ['FILTER_BY_VALUE', 3, 2]]:
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.RANGE', 'tester', '-', '+', *args)
+
+
+def test_range_downsample_lttb():
+    with Env().getConnection() as r:
+        r.execute_command('TS.CREATE', 'tester', 'CHUNK_SIZE', 128, 'LABELS', 'name', 'lttb')
+        for ts in range(1, 10001):
+            r.execute_command('TS.ADD', 'tester', ts, 5000 if ts == 4321 else ts % 100)
+
+        res = r.execute_command('TS.RANGE', 'tester', '-', '+', 'DOWNSAMPLE', 'LTTB', 100)
+        assert len(res) == 100
+        assert res[0] == [1, b'1'] and res[-1] == [10000, b'0']
+        assert [4321, b'5000'] in res
+        assert [ts for ts, _ in res] == sorted(ts for ts, _ in res)
+
+        rev = r.execute_command('TS.REVRANGE', 'tester', '-', '+', 'DOWNSAMPLE', 'LTTB', 100)
+        assert len(rev) == 100
+        assert rev[0] == [10000, b'0'] and rev[-1] == [1, b'1']
+        assert [4321, b'5000'] in rev
+
+        # ranges with fewer samples than points are replied whole
+        assert r.execute_command('TS.RANGE', 'tester', 10, 12, 'DOWNSAMPLE', 'LTTB', 5) == \
+               r.execute_command('TS.RANGE', 'tester', 10, 12)
+        assert len(r.execute_command('TS.RANGE', 'tester', '-', '+', 'DOWNSAMPLE', 'LTTB', 100,
+                                     'COUNT', 10)) == 10
+
+        mres = r.execute_command('TS.MRANGE', '-', '+', 'DOWNSAMPLE', 'LTTB', 50,
+                                 'FILTER', 'name=lttb')
+        assert len(mres) == 1 and len(mres[0][2]) == 50
+        assert [4321, b'5000'] in mres[0][2]
+
+        for args in [['DOWNSAMPLE', 'LTTB'], ['DOWNSAMPLE', 'LTTB', 2], ['DOWNSAMPLE', 'M4', 10],
+                     ['DOWNSAMPLE', 'LTTB', 10, 'AGGREGATION', 'avg', 10]]:
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.RANGE', 'tester', '-', '+', *args)
+
+
+def test_range_counter_aggregations():
+    with Env().getConnection() as r:
+        r.execute_command('TS.CREATE', 'counter')
+        r.execute_command('TS.CREATE', 'counter_rate')
+        r.execute_command('TS.CREATERULE', 'counter', 'counter_rate', 'AGGREGATION', 'rate', 2000)
+        # the counter is reset at 2500 and at 4000
+        for ts, value in [(0, 10), (1000, 20), (1500, 30), (2000, 40), (2500, 5), (3000, 12),
+                          (4000, 0), (4500, 6), (6000, 100)]:
+            r.execute_command('TS.ADD', 'counter', ts, value)
+
+        # each bucket counts the increment from the sample preceding it
+        assert [[0, b'20'], [2000, b'22'], [4000, b'6'], [6000, b'94']] == \
+            r.execute_command('TS.RANGE', 'counter', '-', '+', 'AGGREGATION', 'increase', 2000)
+        assert [[0, b'10'], [2000, b'11'], [4000, b'3'], [6000, b'47']] == \
+            r.execute_command('TS.RANGE', 'counter', '-', '+', 'AGGREGATION', 'rate', 2000)
+        assert [[0, b'20', b'20'], [2000, b'22', b'-28'], [4000, b'6', b'6']] == \
+            r.execute_command('TS.RANGE', 'counter', 0, 5999, 'AGGREGATION', 'increase,delta',
+                              2000)
+        assert [[4000, b'6', b'6'], [2000, b'22', b'-28'], [0, b'20', b'20']] == \
+            r.execute_command('TS.REVRANGE', 'counter', 0, 5999, 'AGGREGATION', 'increase,delta',
+                              2000)
+        # from the sample before the range as well
+        assert [[2000, b'22'], [4000, b'6']] == \
+            r.execute_command('TS.RANGE', 'counter', 2000, 5999, 'AGGREGATION', 'increase', 2000)
+        assert [[4000, b'6'], [2000, b'22']] == \
+            r.execute_command('TS.REVRANGE', 'counter', 2000, 5999, 'AGGREGATION', 'increase', 2000)
+
+        # the compaction computes the closed buckets at ingest
+        assert [[0, b'10'], [2000, b'11'], [4000, b'3']] == \
+            r.execute_command('TS.RANGE', 'counter_rate', '-', '+')
+        # an upsert recomputes the bucket from its samples, and the next one from its last sample
+        r.execute_command('TS.ADD', 'counter', 3500, 15, 'ON_DUPLICATE', 'LAST')
+        assert [[0, b'10'], [2000, b'12.5'], [4000, b'3']] == \
+            r.execute_command('TS.RANGE', 'counter_rate', '-', '+')
+        r.execute_command('TS.ADD', 'counter', 1900, 35, 'ON_DUPLICATE', 'LAST')
+        assert [[0, b'12.5'], [2000, b'10'], [4000, b'3']] == \
+            r.execute_command('TS.RANGE', 'counter_rate', '-', '+')
+        # as well as the current bucket
+        r.execute_command('TS.ADD', 'counter', 7000, 110)
+        r.execute_command('TS.ADD', 'counter', 4500, 50, 'ON_DUPLICATE', 'LAST')
+        r.execute_command('TS.ADD', 'counter', 8000, 120)
+        assert [[0, b'12.5'], [2000, b'10'], [4000, b'25'], [6000, b'30']] == \
+            r.execute_command('TS.RANGE', 'counter_rate', '-', '+')
+        assert r.execute_command('TS.RANGE', 'counter_rate', '-', '+') == \
+            r.execute_command('TS.RANGE', 'counter', 0, 7999, 'AGGREGATION', 'rate', 2000)
+
+        r.execute_command('TS.CREATE', 'counter2', 'LABELS', 'kind', 'counter')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.MRANGE', '-', '+', 'FILTER', 'kind=counter',
+                              'GROUPBY', 'kind', 'REDUCE', 'rate')
@@ -0,0 +1,58 @@
+import time
+
+import pytest
+import redis
+from RLTest import Env
+
+
+def get_samples(pubsub, count, timeout=5):
+    samples = []
+    deadline = time.time() + timeout
+    while len(samples) < count and time.time() < deadline:
+        message = pubsub.get_message(ignore_subscribe_messages=True, timeout=0.1)
+        if message is not None:
+            samples += message['data'].split(b'\n')
+    return samples
+
+
+def test_subscribe():
+    env = Env()
+    with env.getConnection() as r:
+        r.execute_command('TS.CREATE', 'cpu:1', 'LABELS', 'metric', 'cpu', 'host', 'a')
+        r.execute_command('TS.CREATE', 'cpu:2', 'LABELS', 'metric', 'cpu', 'host', 'b')
+        r.execute_command('TS.CREATE', 'mem:1', 'LABELS', 'metric', 'mem', 'host', 'a')
+        assert r.execute_command('TS.SUBSCRIBE', 'cpu', 'FILTER', 'metric=cpu') == b'OK'
+
+        pubsub = r.pubsub()
+        pubsub.subscribe('cpu')
+        get_samples(pubsub, 1, timeout=0.5)
+
+        # the samples of one iteration are published together
+        pipe = r.pipeline(transaction=False)
+        pipe.execute_command('TS.ADD', 'cpu:1', 10, 1.5)
+        pipe.execute_command('TS.MADD', 'cpu:2', 10, 2, 'mem:1', 10, 3)
+        pipe.execute_command('TS.INCRBY', 'cpu:1', 2, 'TIMESTAMP', 20)
+        pipe.execute()
+        assert get_samples(pubsub, 3) == [b'10 1.5 cpu:1', b'10 2 cpu:2', b'20 3.5 cpu:1']
+
+        # a new series matching the filter is published too
+        r.execute_command('TS.ADD', 'cpu:3', 30, 4, 'LABELS', 'metric', 'cpu', 'host', 'c')
+        assert get_samples(pubsub, 1) == [b'30 4 cpu:3']
+
+        # subscribing again replaces the filters
+        r.execute_command('TS.SUBSCRIBE', 'cpu', 'FILTER', 'metric=cpu', 'host=b')
+        r.execute_command('TS.ADD', 'cpu:1', 40, 5)
+        r.execute_command('TS.ADD', 'cpu:2', 40, 6)
+        assert get_samples(pubsub, 1) == [b'40 6 cpu:2']
+
+        assert r.execute_command('TS.UNSUBSCRIBE', 'cpu') == b'OK'
+        r.execute_command('TS.ADD', 'cpu:2', 50, 7)
+        assert get_samples(pubsub, 1, timeout=0.5) == []
+        pubsub.close()
+
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.UNSUBSCRIBE', 'cpu')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.SUBSCRIBE', 'cpu', 'FILTER', 'metric!=cpu')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.SUBSCRIBE', 'cpu', 'metric=cpu')
@@ -0,0 +1,93 @@
+import pytest
+import redis
+from RLTest import Env
+
+
+def test_wide_add_range():
+    with Env().getConnection() as r:
+        assert r.execute_command('TS.WIDE.CREATE', 'cpu', 'FIELDS', 3, 'user', 'system', 'idle',
+                                 'CHUNK_SIZE', 128) == b'OK'
+        rows = []
+        for i in range(1000):
+            rows += [1000 + i * 10, i, i * 2, 100 - i % 100]
+        assert r.execute_command('TS.WIDE.ADD', 'cpu', *rows) == [1000 + i * 10 for i in range(1000)]
+
+        res = r.execute_command('TS.WIDE.RANGE', 'cpu', 'system', '-', '+')
+        assert len(res) == 1000
+        assert res[0] == [1000, b'0']
+        assert res[-1] == [1000 + 999 * 10, b'1998']
+        assert r.execute_command('TS.WIDE.RANGE', 'cpu', 'idle', 1010, 1030) == \
+               [[1010, b'99'], [1020, b'98'], [1030, b'97']]
+        assert r.execute_command('TS.WIDE.RANGE', 'cpu', 'user', '-', '+', 'COUNT', 2) == \
+               [[1000, b'0'], [1010, b'1']]
+        assert r.execute_command('TS.WIDE.RANGE', 'cpu', 'user', 1000, 1099,
+                                 'AGGREGATION', 'sum', 50) == [[1000, b'10'], [1050, b'35']]
+
+        # the rows match a series per field
+        r.execute_command('TS.CREATE', 'cpu:idle')
+        for i in range(1000):
+            r.execute_command('TS.ADD', 'cpu:idle', 1000 + i * 10, 100 - i % 100)
+        assert r.execute_command('TS.WIDE.RANGE', 'cpu', 'idle', '-', '+', 'AGGREGATION', 'avg', 300) == \
+               r.execute_command('TS.RANGE', 'cpu:idle', '-', '+', 'AGGREGATION', 'avg', 300)
+
+        info = r.execute_command('TS.WIDE.INFO', 'cpu')
+        info = dict(zip(info[::2], info[1::2]))
+        assert info[b'totalSamples'] == 1000
+        assert info[b'firstTimestamp'] == 1000
+        assert info[b'lastTimestamp'] == 1000 + 999 * 10
+        assert info[b'chunkCount'] > 1
+        assert info[b'fields'] == [b'user', b'system', b'idle']
+
+
+def test_wide_errors():
+    with Env().getConnection() as r:
+        r.execute_command('TS.WIDE.CREATE', 'w', 'FIELDS', 2, 'a', 'b')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.WIDE.CREATE', 'w', 'FIELDS', 2, 'a', 'b')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.WIDE.CREATE', 'dup', 'FIELDS', 2, 'a', 'a')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.WIDE.CREATE', 'none', 'FIELDS', 0)
+        r.execute_command('TS.WIDE.ADD', 'w', 100, 1, 2)
+        # rows are added in order, and all of them or none
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.WIDE.ADD', 'w', 200, 1, 2, 100, 1, 2)
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.WIDE.ADD', 'w', 300, 1, 'x')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.WIDE.ADD', 'w', 300, 1)
+        assert r.execute_command('TS.WIDE.RANGE', 'w', 'b', '-', '+') == [[100, b'2']]
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.WIDE.RANGE', 'w', 'c', '-', '+')
+        r.execute_command('TS.CREATE', 'series')
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.WIDE.ADD', 'series', 100, 1, 2)
+        with pytest.raises(redis.ResponseError):
+            r.execute_command('TS.RANGE', 'w', '-', '+')
+
+
+def test_wide_retention():
+    with Env().getConnection() as r:
+        r.execute_command('TS.WIDE.CREATE', 'w', 'FIELDS', 1, 'a', 'RETENTION', 100, 'CHUNK_SIZE', 64)
+        for i in range(1000):
+            r.execute_command('TS.WIDE.ADD', 'w', i, i)
+        res = r.execute_command('TS.WIDE.RANGE', 'w', 'a', '-', '+')
+        # whole chunks expire, the last 100ms are kept
+        assert res[0][0] <= 899
+        assert res[-1] == [999, b'999']
+        assert len(res) < 1000
+
+
+def test_wide_persistency():
+    env = Env()
+    with env.getConnection() as r:
+        r.execute_command('TS.WIDE.CREATE', 'w', 'FIELDS', 2, 'a', 'b', 'CHUNK_SIZE', 64)
+        for i in range(500):
+            r.execute_command('TS.WIDE.ADD', 'w', i * 1000, i * 1.5, -i)
+        before = r.execute_command('TS.WIDE.RANGE', 'w', 'a', '-', '+')
+        env.dumpAndReload()
+        assert r.execute_command('TS.WIDE.RANGE', 'w', 'a', '-', '+') == before
+        # the loaded chunks are appended to
+        r.execute_command('TS.WIDE.ADD', 'w', 500 * 1000, 1, 2)
+        assert r.execute_command('TS.WIDE.RANGE', 'w', 'b', 499000, '+') == \
+               [[499000, b'-499'], [500000, b'2']]